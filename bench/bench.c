@@ -0,0 +1,262 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_SIZE   10000
+#define BENCH_DEFAULT_REPEAT 5
+#define BENCH_DEFAULT_SEED   1
+#define BENCH_KEY_MAX        64
+#define BENCH_KEYS_PER_DEV   16
+
+static uint64_t _rand_state;
+
+static void _seed(uint64_t seed)
+{
+	/* xorshift state must not be zero */
+	_rand_state = seed ? seed : BENCH_DEFAULT_SEED;
+}
+
+uint64_t bench_rand(void)
+{
+	uint64_t x = _rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return _rand_state = x;
+}
+
+void bench_shuffle(size_t *idx, size_t count)
+{
+	size_t i, j, tmp;
+
+	for (i = count; i > 1; i--) {
+		j          = bench_rand() % i;
+		tmp        = idx[i - 1];
+		idx[i - 1] = idx[j];
+		idx[j]     = tmp;
+	}
+}
+
+size_t *bench_order_create(size_t count, int shuffled)
+{
+	size_t *idx, i;
+
+	if (!(idx = malloc(count * sizeof(*idx))))
+		return NULL;
+
+	for (i = 0; i < count; i++)
+		idx[i] = i;
+
+	if (shuffled)
+		bench_shuffle(idx, count);
+
+	return idx;
+}
+
+char **bench_keys_create(size_t count)
+{
+	char **keys;
+	size_t i;
+
+	if (!(keys = calloc(count, sizeof(*keys))))
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (!(keys[i] = malloc(BENCH_KEY_MAX))) {
+			bench_keys_destroy(keys, i);
+			return NULL;
+		}
+
+		snprintf(keys[i],
+		         BENCH_KEY_MAX,
+		         ":D:%zu_%zu::::BENCH_KEY_%zu",
+		         8 + i / BENCH_KEYS_PER_DEV / 4096,
+		         i / BENCH_KEYS_PER_DEV % 4096,
+		         i % BENCH_KEYS_PER_DEV);
+	}
+
+	return keys;
+}
+
+void bench_keys_destroy(char **keys, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(keys[i]);
+
+	free(keys);
+}
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int _ns_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int _run_case(const struct bench_case *c, size_t size, unsigned repeat, uint64_t seed, int first)
+{
+	uint64_t times[repeat], start;
+	void *   state = NULL;
+	size_t   ops   = 0;
+	unsigned i;
+	int      r;
+
+	for (i = 0; i < repeat; i++) {
+		_seed(seed);
+
+		if (c->setup && (r = c->setup(&state, size, c->arg)) < 0) {
+			fprintf(stderr, "Failed to set up benchmark case %s: %s.\n", c->name, strerror(-r));
+			return r;
+		}
+
+		start    = _now_ns();
+		ops      = c->run(state, size, c->arg);
+		times[i] = _now_ns() - start;
+
+		if (c->teardown)
+			c->teardown(state);
+		state = NULL;
+	}
+
+	qsort(times, repeat, sizeof(times[0]), _ns_cmp);
+
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %zu, \"min_ns\": %" PRIu64 ", \"median_ns\": %" PRIu64
+	       ", \"max_ns\": %" PRIu64 ", \"ns_per_op\": %.2f}",
+	       first ? "" : ",",
+	       c->name,
+	       ops,
+	       times[0],
+	       times[repeat / 2],
+	       times[repeat - 1],
+	       ops ? (double) times[repeat / 2] / ops : 0.0);
+
+	return 0;
+}
+
+static void _help(FILE *f, const char *prog)
+{
+	fprintf(f,
+	        "Usage: %s [options]\n"
+	        "\n"
+	        "    -f|--filter <str>    Run only cases with name containing str.\n"
+	        "    -h|--help            Show this help information.\n"
+	        "    -l|--list            List cases.\n"
+	        "    -n|--size <count>    Number of items each case works with (default %d).\n"
+	        "    -r|--repeat <count>  Number of repetitions of each case (default %d).\n"
+	        "    -s|--seed <seed>     Seed for pseudo-random data (default %d).\n"
+	        "\n",
+	        prog,
+	        BENCH_DEFAULT_SIZE,
+	        BENCH_DEFAULT_REPEAT,
+	        BENCH_DEFAULT_SEED);
+}
+
+int bench_main(int argc, char **argv, const char *suite, const struct bench_case *cases, size_t case_count)
+{
+	struct option longopts[] = {
+		{"filter", required_argument, NULL, 'f'},
+		{"help", no_argument, NULL, 'h'},
+		{"list", no_argument, NULL, 'l'},
+		{"size", required_argument, NULL, 'n'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"seed", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0},
+	};
+	const char *filter = NULL;
+	size_t      size   = BENCH_DEFAULT_SIZE;
+	unsigned    repeat = BENCH_DEFAULT_REPEAT;
+	uint64_t    seed   = BENCH_DEFAULT_SEED;
+	int         first  = 1;
+	size_t      i;
+	int         opt;
+
+	while ((opt = getopt_long(argc, argv, "f:hln:r:s:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 'h':
+				_help(stdout, argv[0]);
+				return EXIT_SUCCESS;
+			case 'l':
+				for (i = 0; i < case_count; i++)
+					printf("%s\n", cases[i].name);
+				return EXIT_SUCCESS;
+			case 'n':
+				size = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				repeat = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				_help(stderr, argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (!size || !repeat) {
+		_help(stderr, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("{\"suite\": \"%s\", \"size\": %zu, \"repeat\": %u, \"seed\": %" PRIu64 ", \"results\": [",
+	       suite,
+	       size,
+	       repeat,
+	       seed);
+
+	for (i = 0; i < case_count; i++) {
+		if (filter && !strstr(cases[i].name, filter))
+			continue;
+
+		if (_run_case(&cases[i], size, repeat, seed, first) < 0) {
+			printf("\n]}\n");
+			return EXIT_FAILURE;
+		}
+
+		first = 0;
+	}
+
+	printf("\n]}\n");
+	return EXIT_SUCCESS;
+}
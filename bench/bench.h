@@ -0,0 +1,66 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_BENCH_H
+#define _SID_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Microbenchmark harness.
+ *
+ * Each benchmark program is a suite of cases. For each repetition of a case, setup
+ * prepares the state (not timed), run does the measured work and teardown releases
+ * the state (not timed). The size is the number of items each case works with and
+ * run returns the number of operations it has done so that the time per operation
+ * can be reported.
+ *
+ * Pseudo-random numbers are reseeded before each setup so every repetition of a case
+ * works with the same data and the results are reproducible with the same seed.
+ *
+ * Results are written to standard output in JSON format:
+ *
+ *   {"suite": "hash", "size": 10000, "repeat": 5, "seed": 1, "results": [
+ *     {"name": "insert", "ops": 10000, "min_ns": ..., "median_ns": ..., "max_ns": ..., "ns_per_op": ...},
+ *     ...
+ *   ]}
+ */
+struct bench_case {
+	const char *name;
+	int (*setup)(void **state, size_t size, const void *arg); /* optional, returns < 0 on failure */
+	size_t (*run)(void *state, size_t size, const void *arg);
+	void (*teardown)(void *state); /* optional */
+	const void *arg;
+};
+
+int bench_main(int argc, char **argv, const char *suite, const struct bench_case *cases, size_t case_count);
+
+uint64_t bench_rand(void);
+void     bench_shuffle(size_t *idx, size_t count);
+size_t * bench_order_create(size_t count, int shuffled);
+
+/* Creates keys with device and core key parts in the same form that ubridge uses. */
+char **bench_keys_create(size_t count);
+void   bench_keys_destroy(char **keys, size_t count);
+
+/* Makes sure the compiler can not throw away computation of the value. */
+#define bench_keep(v) __asm__ volatile("" : : "g"(v) : "memory")
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/bitmap.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+struct bitmap_state {
+	struct bitmap *bmp;
+	struct bitmap *other;
+	size_t *       order;
+};
+
+static void _teardown(void *state)
+{
+	struct bitmap_state *s = state;
+
+	if (s->bmp)
+		bitmap_destroy(s->bmp);
+	if (s->other)
+		bitmap_destroy(s->other);
+	free(s->order);
+	free(s);
+}
+
+static int _setup(void **state, size_t size, const void *arg)
+{
+	struct bitmap_state *s;
+	size_t               i;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	if (!(s->bmp = bitmap_create(size, false, NULL)) || !(s->other = bitmap_create(size, false, NULL)) ||
+	    !(s->order = bench_order_create(size, 1)))
+		goto fail;
+
+	/* about half of the bits set in each bitmap, randomly */
+	for (i = 0; i < size; i++) {
+		if (bench_rand() & 1)
+			(void) bitmap_bit_set(s->bmp, i);
+		if (bench_rand() & 1)
+			(void) bitmap_bit_set(s->other, i);
+	}
+
+	*state = s;
+	return 0;
+fail:
+	_teardown(s);
+	return -ENOMEM;
+}
+
+/*
+ * Sparse setup for comparing bulk operation and set bit iteration with the
+ * equivalent done bit by bit: all bits are set in the first bitmap and every
+ * 16th bit in the other one.
+ */
+static int _setup_sparse(void **state, size_t size, const void *arg)
+{
+	struct bitmap_state *s;
+	size_t               i;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	if (!(s->bmp = bitmap_create(size, true, NULL)) || !(s->other = bitmap_create(size, false, NULL)))
+		goto fail;
+
+	for (i = 0; i < size; i += 16)
+		(void) bitmap_bit_set(s->other, i);
+
+	*state = s;
+	return 0;
+fail:
+	_teardown(s);
+	return -ENOMEM;
+}
+
+static size_t _run_set_unset(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+	size_t               i;
+
+	for (i = 0; i < size; i++)
+		(void) bitmap_bit_set(s->bmp, s->order[i]);
+	for (i = 0; i < size; i++)
+		(void) bitmap_bit_unset(s->bmp, s->order[i]);
+
+	return 2 * size;
+}
+
+static size_t _run_is_set(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+	size_t               i;
+
+	for (i = 0; i < size; i++)
+		bench_keep(bitmap_bit_is_set(s->bmp, s->order[i], NULL));
+
+	return size;
+}
+
+static size_t _run_find_next_set(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+	size_t               pos, ops = 0;
+
+	for (pos = bitmap_find_next_set(s->bmp, 0); pos < size; pos = bitmap_find_next_set(s->bmp, pos + 1))
+		ops++;
+
+	return ops;
+}
+
+static size_t _run_set_count(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+
+	bench_keep(bitmap_get_bit_set_count(s->bmp));
+
+	return 1;
+}
+
+static size_t _run_and_or_andnot(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+
+	(void) bitmap_or(s->bmp, s->other);
+	(void) bitmap_and(s->bmp, s->other);
+	(void) bitmap_andnot(s->bmp, s->other);
+
+	return 3;
+}
+
+static size_t _run_andnot(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+
+	(void) bitmap_andnot(s->bmp, s->other);
+
+	return 1;
+}
+
+static size_t _run_andnot_bit_by_bit(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s = state;
+	size_t               i;
+
+	for (i = 0; i < size; i++) {
+		if (bitmap_bit_is_set(s->other, i, NULL))
+			(void) bitmap_bit_unset(s->bmp, i);
+	}
+
+	return 1;
+}
+
+static size_t _run_iterate_set(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s   = state;
+	size_t               sum = 0, pos;
+
+	bitmap_iterate_set (pos, s->other)
+		sum += pos;
+	bench_keep(sum);
+
+	return 1;
+}
+
+static size_t _run_iterate_bit_by_bit(void *state, size_t size, const void *arg)
+{
+	struct bitmap_state *s   = state;
+	size_t               sum = 0, i;
+
+	for (i = 0; i < size; i++) {
+		if (bitmap_bit_is_set(s->other, i, NULL))
+			sum += i;
+	}
+	bench_keep(sum);
+
+	return 1;
+}
+
+static const struct bench_case _cases[] = {
+	{.name = "set_unset", .setup = _setup, .run = _run_set_unset, .teardown = _teardown},
+	{.name = "is_set", .setup = _setup, .run = _run_is_set, .teardown = _teardown},
+	{.name = "find_next_set", .setup = _setup, .run = _run_find_next_set, .teardown = _teardown},
+	{.name = "set_count", .setup = _setup, .run = _run_set_count, .teardown = _teardown},
+	{.name = "and_or_andnot", .setup = _setup, .run = _run_and_or_andnot, .teardown = _teardown},
+	{.name = "sparse_andnot", .setup = _setup_sparse, .run = _run_andnot, .teardown = _teardown},
+	{.name = "sparse_andnot_bit_by_bit", .setup = _setup_sparse, .run = _run_andnot_bit_by_bit, .teardown = _teardown},
+	{.name = "sparse_iterate_set", .setup = _setup_sparse, .run = _run_iterate_set, .teardown = _teardown},
+	{.name = "sparse_iterate_bit_by_bit", .setup = _setup_sparse, .run = _run_iterate_bit_by_bit, .teardown = _teardown},
+};
+
+int main(int argc, char **argv)
+{
+	return bench_main(argc, argv, "bitmap", _cases, sizeof(_cases) / sizeof(_cases[0]));
+}
@@ -0,0 +1,178 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/buffer.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ALLOC_STEP 4096
+#define RECORD_LEN 64
+#define RING_SIZE  (64 * 1024)
+
+struct buffer_state {
+	struct buffer *buf;
+	char **        keys;
+	size_t         count;
+	char           record[RECORD_LEN];
+	int            fd;
+};
+
+static void _teardown(void *state)
+{
+	struct buffer_state *s = state;
+
+	if (s->buf)
+		buffer_destroy(s->buf);
+	if (s->keys)
+		bench_keys_destroy(s->keys, s->count);
+	if (s->fd >= 0)
+		(void) close(s->fd);
+	free(s);
+}
+
+static int _setup(void **state, size_t size, buffer_type_t type, size_t buf_size, int fill)
+{
+	struct buffer_state *s;
+	size_t               i;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	s->count = size;
+	s->fd    = -1;
+	memset(s->record, 'x', sizeof(s->record));
+
+	if (!(s->buf = buffer_create(
+		      &((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC, .type = type, .mode = BUFFER_MODE_PLAIN}),
+		      &((struct buffer_init) {.size = buf_size, .alloc_step = ALLOC_STEP, .limit = 0}),
+		      NULL)) ||
+	    !(s->keys = bench_keys_create(size)) || (s->fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+		goto fail;
+
+	if (fill) {
+		for (i = 0; i < size; i++) {
+			if (!buffer_add(s->buf, s->record, sizeof(s->record), NULL))
+				goto fail;
+		}
+	}
+
+	*state = s;
+	return 0;
+fail:
+	_teardown(s);
+	return -ENOMEM;
+}
+
+static int _setup_linear(void **state, size_t size, const void *arg)
+{
+	return _setup(state, size, BUFFER_TYPE_LINEAR, 0, arg != NULL);
+}
+
+static int _setup_vector(void **state, size_t size, const void *arg)
+{
+	return _setup(state, size, BUFFER_TYPE_VECTOR, 0, arg != NULL);
+}
+
+static int _setup_ring(void **state, size_t size, const void *arg)
+{
+	return _setup(state, size, BUFFER_TYPE_RING, RING_SIZE, 0);
+}
+
+static size_t _run_add(void *state, size_t size, const void *arg)
+{
+	struct buffer_state *s = state;
+	size_t               i;
+
+	for (i = 0; i < size; i++)
+		bench_keep(buffer_add(s->buf, s->record, sizeof(s->record), NULL));
+
+	return size;
+}
+
+static size_t _run_fmt_add(void *state, size_t size, const void *arg)
+{
+	struct buffer_state *s = state;
+	size_t               i;
+
+	for (i = 0; i < size; i++)
+		bench_keep(buffer_fmt_add(s->buf, NULL, "%s=%zu", s->keys[i], i));
+
+	return size;
+}
+
+static size_t _run_join_add(void *state, size_t size, const void *arg)
+{
+	struct buffer_state *s = state;
+	struct buffer_str    parts[3];
+	size_t               i;
+
+	for (i = 0; i < size; i++) {
+		parts[0] = (struct buffer_str) {"", 0};
+		parts[1] = (struct buffer_str) {s->keys[i], strlen(s->keys[i])};
+		parts[2] = (struct buffer_str) {"BENCH", 5};
+		bench_keep(buffer_join_add(s->buf, NULL, ":", parts, 3));
+	}
+
+	return size;
+}
+
+static size_t _run_write(void *state, size_t size, const void *arg)
+{
+	struct buffer_state *s = state;
+
+	(void) buffer_write_all(s->buf, s->fd);
+
+	return size;
+}
+
+static size_t _run_ring(void *state, size_t size, const void *arg)
+{
+	struct buffer_state *s = state;
+	char                 rec[RECORD_LEN];
+	size_t               i;
+
+	for (i = 0; i < size; i++) {
+		bench_keep(buffer_add(s->buf, s->record, sizeof(s->record), NULL));
+		bench_keep(buffer_take(s->buf, rec, sizeof(rec)));
+	}
+
+	return size;
+}
+
+static const int _fill = 1;
+
+static const struct bench_case _cases[] = {
+	{.name = "linear_add", .setup = _setup_linear, .run = _run_add, .teardown = _teardown, .arg = NULL},
+	{.name = "linear_fmt_add", .setup = _setup_linear, .run = _run_fmt_add, .teardown = _teardown, .arg = NULL},
+	{.name = "linear_join_add", .setup = _setup_linear, .run = _run_join_add, .teardown = _teardown, .arg = NULL},
+	{.name = "linear_write", .setup = _setup_linear, .run = _run_write, .teardown = _teardown, .arg = &_fill},
+	{.name = "vector_add", .setup = _setup_vector, .run = _run_add, .teardown = _teardown, .arg = NULL},
+	{.name = "vector_write", .setup = _setup_vector, .run = _run_write, .teardown = _teardown, .arg = &_fill},
+	{.name = "ring_add_take", .setup = _setup_ring, .run = _run_ring, .teardown = _teardown, .arg = NULL},
+};
+
+int main(int argc, char **argv)
+{
+	return bench_main(argc, argv, "buffer", _cases, sizeof(_cases) / sizeof(_cases[0]));
+}
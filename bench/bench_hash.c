@@ -0,0 +1,168 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/hash.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Fixed tables have 32 slots as the main kv store used to have, presized tables have
+ * a slot for each item and resizable tables start with 32 slots and grow as needed.
+ */
+typedef enum
+{
+	HASH_TABLE_FIXED,
+	HASH_TABLE_PRESIZED,
+	HASH_TABLE_RESIZABLE,
+} hash_table_kind_t;
+
+struct hash_arg {
+	hash_table_kind_t kind;
+	int               fill;
+};
+
+struct hash_state {
+	struct hash_table *ht;
+	char **            keys;
+	size_t *           order;
+	size_t             count;
+};
+
+static void _teardown(void *state)
+{
+	struct hash_state *s = state;
+
+	if (s->ht)
+		hash_destroy(s->ht);
+	if (s->keys)
+		bench_keys_destroy(s->keys, s->count);
+	free(s->order);
+	free(s);
+}
+
+static struct hash_table *_create_table(hash_table_kind_t kind, size_t size)
+{
+	switch (kind) {
+		case HASH_TABLE_PRESIZED:
+			return hash_create(size);
+		case HASH_TABLE_RESIZABLE:
+			return hash_create_with_params(32, &((struct hash_params) {.grow_load = 100}));
+		default:
+			return hash_create(32);
+	}
+}
+
+static int _setup(void **state, size_t size, const void *arg)
+{
+	const struct hash_arg *hash_arg = arg;
+	struct hash_state *    s;
+	size_t                 i;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	s->count = size;
+
+	if (!(s->ht = _create_table(hash_arg->kind, size)) || !(s->keys = bench_keys_create(size)) || !(s->order = bench_order_create(size, 1)))
+		goto fail;
+
+	if (hash_arg->fill) {
+		for (i = 0; i < size; i++) {
+			if (hash_insert(s->ht, s->keys[i], strlen(s->keys[i]), &s->keys[i], sizeof(s->keys[i])) < 0)
+				goto fail;
+		}
+	}
+
+	*state = s;
+	return 0;
+fail:
+	_teardown(s);
+	return -ENOMEM;
+}
+
+static size_t _run_insert(void *state, size_t size, const void *arg)
+{
+	struct hash_state *s = state;
+	size_t             i, k;
+
+	for (i = 0; i < size; i++) {
+		k = s->order[i];
+		(void) hash_insert(s->ht, s->keys[k], strlen(s->keys[k]), &s->keys[k], sizeof(s->keys[k]));
+	}
+
+	return size;
+}
+
+static size_t _run_lookup(void *state, size_t size, const void *arg)
+{
+	struct hash_state *s = state;
+	size_t             i;
+
+	for (i = 0; i < size; i++)
+		bench_keep(hash_lookup(s->ht, s->keys[s->order[i]], strlen(s->keys[s->order[i]]), NULL));
+
+	return size;
+}
+
+static size_t _run_lookup_miss(void *state, size_t size, const void *arg)
+{
+	struct hash_state *s = state;
+	size_t             i, len;
+
+	/* same keys without the last character are not in the table */
+	for (i = 0; i < size; i++) {
+		len = strlen(s->keys[s->order[i]]) - 1;
+		bench_keep(hash_lookup(s->ht, s->keys[s->order[i]], len, NULL));
+	}
+
+	return size;
+}
+
+static size_t _run_remove(void *state, size_t size, const void *arg)
+{
+	struct hash_state *s = state;
+	size_t             i;
+
+	for (i = 0; i < size; i++)
+		hash_remove(s->ht, s->keys[s->order[i]], strlen(s->keys[s->order[i]]));
+
+	return size;
+}
+
+static const struct hash_arg _empty            = {.kind = HASH_TABLE_FIXED, .fill = 0};
+static const struct hash_arg _filled           = {.kind = HASH_TABLE_FIXED, .fill = 1};
+static const struct hash_arg _filled_presized  = {.kind = HASH_TABLE_PRESIZED, .fill = 1};
+static const struct hash_arg _filled_resizable = {.kind = HASH_TABLE_RESIZABLE, .fill = 1};
+
+static const struct bench_case _cases[] = {
+	{.name = "insert", .setup = _setup, .run = _run_insert, .teardown = _teardown, .arg = &_empty},
+	{.name = "lookup", .setup = _setup, .run = _run_lookup, .teardown = _teardown, .arg = &_filled},
+	{.name = "lookup_miss", .setup = _setup, .run = _run_lookup_miss, .teardown = _teardown, .arg = &_filled},
+	{.name = "lookup_presized", .setup = _setup, .run = _run_lookup, .teardown = _teardown, .arg = &_filled_presized},
+	{.name = "lookup_resizable", .setup = _setup, .run = _run_lookup, .teardown = _teardown, .arg = &_filled_resizable},
+	{.name = "remove", .setup = _setup, .run = _run_remove, .teardown = _teardown, .arg = &_filled},
+};
+
+int main(int argc, char **argv)
+{
+	return bench_main(argc, argv, "hash", _cases, sizeof(_cases) / sizeof(_cases[0]));
+}
@@ -0,0 +1,287 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/common.h"
+
+#include "bench.h"
+#include "resource/kv-store.h"
+#include "resource/resource-type-regs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define VALUE_LEN        32
+#define VALUE_ITEM_COUNT 4 /* number of items in vector values */
+
+/* Flag modes as listed in the table in resource/kv-store.h. */
+static const struct kv_mode {
+	const char *              name;
+	kv_store_value_flags_t    flags;
+	kv_store_value_op_flags_t op_flags;
+} _modes[] = {
+	{"A", KV_STORE_VALUE_NO_FLAGS, KV_STORE_VALUE_NO_OP},
+	{"B", KV_STORE_VALUE_NO_FLAGS, KV_STORE_VALUE_OP_MERGE},
+	{"C", KV_STORE_VALUE_REF, KV_STORE_VALUE_NO_OP},
+	{"D", KV_STORE_VALUE_REF, KV_STORE_VALUE_OP_MERGE},
+	{"E", KV_STORE_VALUE_VECTOR, KV_STORE_VALUE_NO_OP},
+	{"F", KV_STORE_VALUE_VECTOR, KV_STORE_VALUE_OP_MERGE},
+	{"G", KV_STORE_VALUE_VECTOR | KV_STORE_VALUE_REF, KV_STORE_VALUE_NO_OP},
+	{"H", KV_STORE_VALUE_VECTOR | KV_STORE_VALUE_REF, KV_STORE_VALUE_OP_MERGE},
+};
+
+#define MODE_COUNT (sizeof(_modes) / sizeof(_modes[0]))
+
+static const struct kv_backend {
+	const char *       name;
+	kv_store_backend_t backend;
+} _backends[] = {
+	{"hash", KV_STORE_BACKEND_HASH},
+	{"radix", KV_STORE_BACKEND_RADIX},
+};
+
+#define BACKEND_COUNT (sizeof(_backends) / sizeof(_backends[0]))
+
+typedef enum
+{
+	KV_BENCH_SET,
+	KV_BENCH_GET,
+	KV_BENCH_UNSET,
+	_KV_BENCH_COUNT,
+	KV_BENCH_IMAGE_LOAD = _KV_BENCH_COUNT, /* not run with each mode, only with mode A */
+} kv_bench_t;
+
+static const char *_bench_names[] = {
+	[KV_BENCH_SET]        = "set",
+	[KV_BENCH_GET]        = "get",
+	[KV_BENCH_UNSET]      = "unset",
+	[KV_BENCH_IMAGE_LOAD] = "image_load",
+};
+
+struct kv_arg {
+	const struct kv_backend *backend;
+	const struct kv_mode *   mode;
+	kv_bench_t               bench;
+};
+
+struct kv_state {
+	sid_resource_t *kv_store_res;
+	char **         keys;
+	size_t *        order;
+	size_t          count;
+	char *          values; /* VALUE_LEN bytes for each key */
+	struct iovec *  iovs;   /* VALUE_ITEM_COUNT items for each key */
+	char            image_path[32];
+};
+
+static const char *_items[VALUE_ITEM_COUNT] = {"8:0", "8:16", "253:0", "253:1"};
+
+static void _teardown(void *state)
+{
+	struct kv_state *s = state;
+
+	if (s->kv_store_res)
+		(void) sid_resource_destroy(s->kv_store_res);
+	if (s->image_path[0])
+		(void) unlink(s->image_path);
+	if (s->keys)
+		bench_keys_destroy(s->keys, s->count);
+	free(s->order);
+	free(s->values);
+	free(s->iovs);
+	free(s);
+}
+
+static void *_set(struct kv_state *s, const struct kv_mode *mode, size_t i)
+{
+	struct iovec *iov = &s->iovs[i * VALUE_ITEM_COUNT];
+	size_t        j;
+
+	if (mode->flags & KV_STORE_VALUE_VECTOR) {
+		/* merging with KV_STORE_VALUE_REF rewrites the vector so prepare it again */
+		for (j = 0; j < VALUE_ITEM_COUNT; j++)
+			iov[j] = (struct iovec) {(void *) _items[j], strlen(_items[j]) + 1};
+
+		return kv_store_set_value(s->kv_store_res,
+		                          s->keys[i],
+		                          iov,
+		                          VALUE_ITEM_COUNT,
+		                          mode->flags,
+		                          mode->op_flags,
+		                          NULL,
+		                          NULL);
+	}
+
+	return kv_store_set_value(s->kv_store_res,
+	                          s->keys[i],
+	                          &s->values[i * VALUE_LEN],
+	                          strlen(&s->values[i * VALUE_LEN]) + 1,
+	                          mode->flags,
+	                          mode->op_flags,
+	                          NULL,
+	                          NULL);
+}
+
+static sid_resource_t *_create_kv_store(const struct kv_backend *backend)
+{
+	struct sid_kv_store_resource_params params = {.backend = backend->backend};
+
+	return sid_resource_create(SID_RESOURCE_NO_PARENT,
+	                           &sid_resource_type_kv_store,
+	                           SID_RESOURCE_NO_FLAGS,
+	                           "bench",
+	                           &params,
+	                           SID_RESOURCE_PRIO_NORMAL,
+	                           SID_RESOURCE_NO_SERVICE_LINKS);
+}
+
+/*
+ * Writes all records into an image and replaces the store with an empty one, so
+ * that the run measures a cold start: the image is loaded and each record looked
+ * up once. Compare with the "set" case which rebuilds the store record by record,
+ * as re-scanning all devices would, but without the events and module processing.
+ */
+static int _setup_image(struct kv_state *s, const struct kv_arg *kv_arg)
+{
+	int fd;
+
+	snprintf(s->image_path, sizeof(s->image_path), "/tmp/bench_kv_store_XXXXXX");
+
+	if ((fd = mkstemp(s->image_path)) < 0) {
+		s->image_path[0] = '\0';
+		return -errno;
+	}
+	(void) close(fd);
+
+	if (kv_store_image_write(s->kv_store_res, s->image_path, 0) < 0)
+		return -EIO;
+
+	(void) sid_resource_destroy(s->kv_store_res);
+
+	if (!(s->kv_store_res = _create_kv_store(kv_arg->backend)))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int _setup(void **state, size_t size, const void *arg)
+{
+	const struct kv_arg *kv_arg = arg;
+	struct kv_state *    s;
+	size_t               i;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	s->count = size;
+
+	if (!(s->kv_store_res = _create_kv_store(kv_arg->backend)) ||
+	    !(s->keys = bench_keys_create(size)) || !(s->order = bench_order_create(size, 1)) ||
+	    !(s->values = malloc(size * VALUE_LEN)) || !(s->iovs = malloc(size * VALUE_ITEM_COUNT * sizeof(*s->iovs))))
+		goto fail;
+
+	for (i = 0; i < size; i++)
+		snprintf(&s->values[i * VALUE_LEN], VALUE_LEN, "value_%zu", i);
+
+	if (kv_arg->bench != KV_BENCH_SET) {
+		for (i = 0; i < size; i++) {
+			if (!_set(s, kv_arg->mode, i))
+				goto fail;
+		}
+	}
+
+	if (kv_arg->bench == KV_BENCH_IMAGE_LOAD && _setup_image(s, kv_arg) < 0)
+		goto fail;
+
+	*state = s;
+	return 0;
+fail:
+	_teardown(s);
+	return -ENOMEM;
+}
+
+static size_t _run(void *state, size_t size, const void *arg)
+{
+	const struct kv_arg *  kv_arg = arg;
+	struct kv_state *      s      = state;
+	size_t                 i, value_size;
+	kv_store_value_flags_t flags;
+
+	if (kv_arg->bench == KV_BENCH_IMAGE_LOAD && kv_store_image_load(s->kv_store_res, s->image_path, NULL) < 0)
+		return 0;
+
+	for (i = 0; i < size; i++) {
+		switch (kv_arg->bench) {
+			case KV_BENCH_SET:
+				bench_keep(_set(s, kv_arg->mode, s->order[i]));
+				break;
+			case KV_BENCH_GET:
+			case KV_BENCH_IMAGE_LOAD:
+				bench_keep(kv_store_get_value(s->kv_store_res, s->keys[s->order[i]], &value_size, &flags));
+				break;
+			case KV_BENCH_UNSET:
+				(void) kv_store_unset_value(s->kv_store_res, s->keys[s->order[i]], NULL, NULL);
+				break;
+			default:
+				break;
+		}
+	}
+
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	static struct kv_arg     args[BACKEND_COUNT * (MODE_COUNT * _KV_BENCH_COUNT + 1)];
+	static struct bench_case cases[BACKEND_COUNT * (MODE_COUNT * _KV_BENCH_COUNT + 1)];
+	static char              names[BACKEND_COUNT * (MODE_COUNT * _KV_BENCH_COUNT + 1)][32];
+	size_t                   b, m, n, i = 0;
+
+	for (b = 0; b < BACKEND_COUNT; b++) {
+		args[i] = (struct kv_arg) {.backend = &_backends[b], .mode = &_modes[0], .bench = KV_BENCH_IMAGE_LOAD};
+		snprintf(names[i], sizeof(names[i]), "%s/%s", _backends[b].name, _bench_names[KV_BENCH_IMAGE_LOAD]);
+		cases[i] = (struct bench_case) {.name     = names[i],
+		                                .setup    = _setup,
+		                                .run      = _run,
+		                                .teardown = _teardown,
+		                                .arg      = &args[i]};
+		i++;
+
+		for (m = 0; m < MODE_COUNT; m++) {
+			for (n = 0; n < _KV_BENCH_COUNT; n++, i++) {
+				args[i] = (struct kv_arg) {.backend = &_backends[b], .mode = &_modes[m], .bench = n};
+				snprintf(names[i],
+				         sizeof(names[i]),
+				         "%s/%s_%s",
+				         _backends[b].name,
+				         _bench_names[n],
+				         _modes[m].name);
+				cases[i] = (struct bench_case) {.name     = names[i],
+				                                .setup    = _setup,
+				                                .run      = _run,
+				                                .teardown = _teardown,
+				                                .arg      = &args[i]};
+			}
+		}
+	}
+
+	return bench_main(argc, argv, "kv_store", cases, i);
+}
@@ -0,0 +1,279 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* the benchmarked helpers are all static in ubridge.c */
+#include "../src/resource/ubridge.c"
+
+#include "bench.h"
+
+#define BENCH_OWNER      "bench"
+#define ITEM_LEN         11 /* "%010u" with '\0' */
+#define VALUE_LEN        32
+#define VALUE_ITEM_COUNT 4 /* number of items in exported sets */
+
+/*
+ * Vector deltas (_delta_step_calculate): the old set is a packed set with items
+ * 0 .. size-1 as stored in main kv store and the new set is a vector with items
+ * shifted by 10% as received from a module. So 10% of the items are removed,
+ * 10% added and the rest is unchanged.
+ */
+struct delta_state {
+	uint64_t            seqnum;
+	sid_ucmd_kv_flags_t flags;
+	char *              items;
+	char *              old_mem;
+	struct kv_value *   old_set;
+	size_t              old_size;
+	struct iovec *      new_iov;
+	size_t              new_iov_cnt;
+};
+
+static void _delta_teardown(void *state)
+{
+	struct delta_state *s = state;
+
+	free(s->items);
+	free(s->old_mem);
+	free(s->new_iov);
+	free(s);
+}
+
+static int _delta_setup(void **state, size_t size, const void *arg)
+{
+	struct delta_state *s;
+	struct iovec        header[KV_VALUE_IDX_DATA];
+	struct iovec        item;
+	size_t              shift = size / 10, capacity, i;
+	char *              mem;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	s->seqnum = 1;
+	s->flags  = KV_PERSISTENT;
+
+	KV_VALUE_PREPARE_HEADER(header, s->seqnum, s->flags, (char *) BENCH_OWNER);
+	capacity = _get_set_header_size(header) + size * (sizeof(kv_set_item_len_t) + ITEM_LEN);
+
+	if (!(s->items = malloc((size + shift) * ITEM_LEN)) || !(s->old_mem = malloc(capacity)) ||
+	    !(s->new_iov = malloc((KV_VALUE_IDX_DATA + size) * sizeof(struct iovec))))
+		goto fail;
+
+	for (i = 0; i < size + shift; i++)
+		snprintf(&s->items[i * ITEM_LEN], ITEM_LEN, "%010u", (unsigned) i);
+
+	mem = s->old_mem;
+	_init_delta_set(&s->old_set, &s->old_size, &mem, capacity, header);
+
+	for (i = 0; i < size; i++) {
+		item = (struct iovec) {&s->items[i * ITEM_LEN], ITEM_LEN};
+		_set_add_item(s->old_set, &s->old_size, &item);
+	}
+
+	KV_VALUE_PREPARE_HEADER(s->new_iov, s->seqnum, s->flags, (char *) BENCH_OWNER);
+	for (i = 0; i < size; i++)
+		s->new_iov[KV_VALUE_IDX_DATA + i] = (struct iovec) {&s->items[(i + shift) * ITEM_LEN], ITEM_LEN};
+	s->new_iov_cnt = KV_VALUE_IDX_DATA + size;
+
+	*state = s;
+	return 0;
+fail:
+	_delta_teardown(s);
+	return -ENOMEM;
+}
+
+static size_t _delta_run(void *state, size_t size, const void *arg)
+{
+	struct delta_state *        s          = state;
+	struct kv_delta             delta      = {.op = *(const kv_op_t *) arg};
+	struct kv_rel_spec          rel_spec   = {.delta = &delta};
+	struct kv_update_arg        update_arg = {.custom = &rel_spec};
+	struct kv_store_update_spec spec       = {.old_data      = s->old_set,
+	                                          .old_data_size = s->old_size,
+	                                          .old_flags     = KV_STORE_VALUE_NO_FLAGS,
+	                                          .new_data      = s->new_iov,
+	                                          .new_data_size = s->new_iov_cnt,
+	                                          .new_flags     = KV_STORE_VALUE_VECTOR};
+
+	(void) _delta_step_calculate(&spec, &update_arg);
+	_destroy_delta(&delta);
+
+	return size;
+}
+
+/*
+ * Export and sync serializer (_write_kv_rec and _read_kv_rec): every other
+ * record is a single value, the others are sets with VALUE_ITEM_COUNT items.
+ */
+struct rec_state {
+	uint64_t            seqnum;
+	sid_ucmd_kv_flags_t flags;
+	char **             keys;
+	size_t              count;
+	char *              values; /* VALUE_LEN bytes for each key, struct kv_value with owner and data */
+	size_t *            value_sizes;
+	struct iovec *      iovs; /* KV_VALUE_IDX_DATA + VALUE_ITEM_COUNT items for each key */
+	struct buffer *     buf;
+};
+
+static const char *_items[VALUE_ITEM_COUNT] = {"8:0", "8:16", "253:0", "253:1"};
+
+static void _rec_teardown(void *state)
+{
+	struct rec_state *s = state;
+
+	if (s->buf)
+		buffer_destroy(s->buf);
+	if (s->keys)
+		bench_keys_destroy(s->keys, s->count);
+	free(s->values);
+	free(s->value_sizes);
+	free(s->iovs);
+	free(s);
+}
+
+static int _rec_write(struct rec_state *s)
+{
+	struct rec_writer *    w;
+	size_t                 i, value_size;
+	void *                 value;
+	kv_store_value_flags_t flags;
+	int                    r;
+
+	if (!(w = rec_writer_create(s->buf, &r)))
+		return r;
+
+	for (i = 0; i < s->count; i++) {
+		if (i % 2) {
+			value      = &s->iovs[i * (KV_VALUE_IDX_DATA + VALUE_ITEM_COUNT)];
+			value_size = KV_VALUE_IDX_DATA + VALUE_ITEM_COUNT;
+			flags      = KV_STORE_VALUE_VECTOR;
+		} else {
+			value      = &s->values[i * VALUE_LEN];
+			value_size = s->value_sizes[i];
+			flags      = KV_STORE_VALUE_NO_FLAGS;
+		}
+
+		if ((r = _write_kv_rec(w, s->keys[i], flags, value, value_size, true)) < 0)
+			break;
+	}
+
+	rec_writer_destroy(w);
+	return r;
+}
+
+static int _rec_setup(void **state, size_t size, const void *arg)
+{
+	struct rec_state *s;
+	struct kv_value * kv_value;
+	struct iovec *    iov;
+	size_t            i, j;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return -ENOMEM;
+
+	s->count  = size;
+	s->seqnum = 1;
+	s->flags  = KV_PERSISTENT;
+
+	if (!(s->keys = bench_keys_create(size)) || !(s->values = malloc(size * VALUE_LEN)) ||
+	    !(s->value_sizes = malloc(size * sizeof(*s->value_sizes))) ||
+	    !(s->iovs = malloc(size * (KV_VALUE_IDX_DATA + VALUE_ITEM_COUNT) * sizeof(struct iovec))) ||
+	    !(s->buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                      .type    = BUFFER_TYPE_LINEAR,
+	                                                      .mode    = BUFFER_MODE_PLAIN}),
+	                             &((struct buffer_init) {.size = 0, .alloc_step = EXPORT_BUF_ALLOC_STEP, .limit = 0}),
+	                             NULL)))
+		goto fail;
+
+	for (i = 0; i < size; i++) {
+		kv_value         = (struct kv_value *) &s->values[i * VALUE_LEN];
+		kv_value->seqnum = s->seqnum;
+		kv_value->flags  = s->flags;
+		memcpy(kv_value->data, BENCH_OWNER, sizeof(BENCH_OWNER));
+		s->value_sizes[i] = sizeof(struct kv_value) + sizeof(BENCH_OWNER) +
+		                    snprintf(kv_value->data + sizeof(BENCH_OWNER),
+		                             VALUE_LEN - sizeof(struct kv_value) - sizeof(BENCH_OWNER),
+		                             "%zu",
+		                             i) +
+		                    1;
+
+		iov = &s->iovs[i * (KV_VALUE_IDX_DATA + VALUE_ITEM_COUNT)];
+		KV_VALUE_PREPARE_HEADER(iov, s->seqnum, s->flags, (char *) BENCH_OWNER);
+		for (j = 0; j < VALUE_ITEM_COUNT; j++)
+			iov[KV_VALUE_IDX_DATA + j] = (struct iovec) {(void *) _items[j], strlen(_items[j]) + 1};
+	}
+
+	/* the reading case needs the stream written in advance */
+	if (arg && _rec_write(s) < 0)
+		goto fail;
+
+	*state = s;
+	return 0;
+fail:
+	_rec_teardown(s);
+	return -ENOMEM;
+}
+
+static size_t _rec_run_export(void *state, size_t size, const void *arg)
+{
+	(void) _rec_write(state);
+
+	return size;
+}
+
+static size_t _rec_run_sync_read(void *state, size_t size, const void *arg)
+{
+	struct rec_state * s    = state;
+	struct kv_rec_bufs bufs = {0};
+	struct kv_rec      rec;
+	struct rec_reader *reader;
+	const void *       data;
+	size_t             data_size, ops = 0;
+
+	if (buffer_get_data(s->buf, &data, &data_size) < 0 || !(reader = rec_reader_create(data, data_size, NULL)))
+		return 0;
+
+	while (_read_kv_rec(NULL, reader, data_size, &bufs, &rec) == 1)
+		ops++;
+
+	rec_reader_destroy(reader);
+	free(bufs.iov);
+	free(bufs.pack);
+
+	return ops;
+}
+
+static const kv_op_t _op_set   = KV_OP_SET;
+static const kv_op_t _op_plus  = KV_OP_PLUS;
+static const kv_op_t _op_minus = KV_OP_MINUS;
+static const int     _written  = 1;
+
+static const struct bench_case _cases[] = {
+	{.name = "delta_set", .setup = _delta_setup, .run = _delta_run, .teardown = _delta_teardown, .arg = &_op_set},
+	{.name = "delta_plus", .setup = _delta_setup, .run = _delta_run, .teardown = _delta_teardown, .arg = &_op_plus},
+	{.name = "delta_minus", .setup = _delta_setup, .run = _delta_run, .teardown = _delta_teardown, .arg = &_op_minus},
+	{.name = "export", .setup = _rec_setup, .run = _rec_run_export, .teardown = _rec_teardown, .arg = NULL},
+	{.name = "sync_read", .setup = _rec_setup, .run = _rec_run_sync_read, .teardown = _rec_teardown, .arg = &_written},
+};
+
+int main(int argc, char **argv)
+{
+	return bench_main(argc, argv, "ubridge", _cases, sizeof(_cases) / sizeof(_cases[0]));
+}
@@ -0,0 +1,1081 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Udev event storm replay against a running SID daemon.
+ *
+ * Events are sent as USID_CMD_SCAN requests, each one through its own connection,
+ * the same way "usid scan" does it when called from udev rules, so the latency
+ * measured for each event is what udev would see. Events are sent in waves with
+ * the given concurrency. A new wave starts whenever an event is for a device which
+ * already has an event in current wave or if the scenario requires all previous
+ * events to be processed first (e.g. disks before their partitions), so, like
+ * with udev, events for the same device are never processed in parallel.
+ *
+ * Main kv store changes are followed through USID_CMD_SUBSCRIBE. The convergence
+ * time is the time from the last reply until the last change reported. Worker
+ * forks are counted by sampling child processes of the daemon.
+ *
+ * Results are written to standard output in JSON format.
+ */
+
+#include "base/common.h"
+
+#include "base/buffer.h"
+#include "base/hash.h"
+#include "base/rec.h"
+#include "iface/usid.h"
+#include "log/log.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_PREFIX "storm"
+
+#define STORM_DEFAULT_CONCURRENCY  8
+#define STORM_DEFAULT_COUNT        100
+#define STORM_DEFAULT_PARTITIONS   4
+#define STORM_DEFAULT_ITERATIONS   10
+#define STORM_DEFAULT_QUIET_MSEC   200
+#define STORM_SAMPLE_INTERVAL_USEC 5000
+#define STORM_CHILDREN_MAX         1024
+
+#define SD_MINORS_PER_DISK 16
+#define DM_MAJOR           253
+
+/* majors used for SCSI disks, each one with 16 disks */
+static const unsigned _sd_majors[] = {8, 65, 66, 67, 68, 69, 70, 71, 128, 129, 130, 131, 132, 133, 134, 135};
+
+#define SD_DISKS_MAX (sizeof(_sd_majors) / sizeof(_sd_majors[0]) * (256 / SD_MINORS_PER_DISK))
+
+typedef enum
+{
+	STORM_SCENARIO_COLDPLUG,
+	STORM_SCENARIO_MPATH_FLAP,
+	STORM_SCENARIO_DM_STACK,
+	STORM_SCENARIO_REPLAY,
+	_STORM_SCENARIO_COUNT,
+} storm_scenario_t;
+
+static const char *const _scenario_names[] = {
+	[STORM_SCENARIO_COLDPLUG]   = "coldplug",
+	[STORM_SCENARIO_MPATH_FLAP] = "mpath-flap",
+	[STORM_SCENARIO_DM_STACK]   = "dm-stack",
+	[STORM_SCENARIO_REPLAY]     = "replay",
+};
+
+struct storm_dev {
+	const char *devtype;
+	char        name[32];
+	char        devpath[128];
+	char        dm_name[32];
+	char        dm_uuid[64];
+	dev_t       devno;
+};
+
+struct storm_event {
+	char *   env; /* KEY=VALUE\0KEY=VALUE\0... */
+	size_t   env_size;
+	dev_t    devno;
+	uint64_t seqnum;
+	bool     barrier; /* all previous events need to be processed first */
+	uint64_t usec;    /* latency */
+	bool     failed;
+};
+
+struct storm {
+	struct storm_event *events;
+	size_t              count;
+	size_t              alloc;
+	uint64_t            seqnum;
+	struct buffer *     env_buf;
+
+	/* dispatching of events to sending threads */
+	pthread_mutex_t lock;
+	pthread_cond_t  wave_cond;
+	pthread_cond_t  done_cond;
+	size_t          next;
+	size_t          wave_end;
+	size_t          completed;
+	bool            finished;
+
+	/* main kv store changes */
+	struct usid_conn *sub_conn;
+	_Atomic uint64_t  last_change_usec;
+	atomic_bool       sub_failed;
+
+	/* worker forks */
+	pid_t       sid_pid;
+	atomic_bool sampling;
+	uint64_t    forks;
+	bool        forks_known;
+};
+
+static uint64_t _now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int _add_event(struct storm *s, const char *action, const struct storm_dev *dev, bool barrier)
+{
+	struct storm_event *ev;
+	const void *        data;
+	size_t              size;
+	int                 r = 0;
+
+	if (s->count == s->alloc) {
+		size_t alloc = s->alloc ? s->alloc * 2 : 256;
+
+		if (!(ev = realloc(s->events, alloc * sizeof(*ev))))
+			return -ENOMEM;
+		s->events = ev;
+		s->alloc  = alloc;
+	}
+
+	ev  = &s->events[s->count];
+	*ev = (struct storm_event) {.devno = dev->devno, .seqnum = ++s->seqnum, .barrier = barrier};
+
+	(void) buffer_rewind(s->env_buf, 0, BUFFER_POS_ABS);
+
+	if (!buffer_fmt_add(s->env_buf, &r, "ACTION=%s", action) ||
+	    !buffer_fmt_add(s->env_buf, &r, "DEVPATH=%s", dev->devpath) ||
+	    !buffer_fmt_add(s->env_buf, &r, "SUBSYSTEM=block") ||
+	    !buffer_fmt_add(s->env_buf, &r, "DEVNAME=/dev/%s", dev->name) ||
+	    !buffer_fmt_add(s->env_buf, &r, "DEVTYPE=%s", dev->devtype) ||
+	    !buffer_fmt_add(s->env_buf, &r, "MAJOR=%u", major(dev->devno)) ||
+	    !buffer_fmt_add(s->env_buf, &r, "MINOR=%u", minor(dev->devno)) ||
+	    !buffer_fmt_add(s->env_buf, &r, "SEQNUM=%" PRIu64, ev->seqnum) ||
+	    (dev->dm_name[0] && !buffer_fmt_add(s->env_buf, &r, "DM_NAME=%s", dev->dm_name)) ||
+	    (dev->dm_uuid[0] && !buffer_fmt_add(s->env_buf, &r, "DM_UUID=%s", dev->dm_uuid)))
+		return r < 0 ? r : -ENOMEM;
+
+	(void) buffer_get_data(s->env_buf, &data, &size);
+
+	if (!(ev->env = malloc(size)))
+		return -ENOMEM;
+
+	memcpy(ev->env, data, size);
+	ev->env_size = size;
+	s->count++;
+
+	return 0;
+}
+
+static void _init_sd_dev(struct storm_dev *dev, unsigned disk, unsigned part)
+{
+	char     name[16];
+	unsigned n     = disk, len = 0, i;
+	unsigned maj   = _sd_majors[disk / (256 / SD_MINORS_PER_DISK)];
+	unsigned min   = disk % (256 / SD_MINORS_PER_DISK) * SD_MINORS_PER_DISK + part;
+
+	/* sda ... sdz, sdaa ... sdzz, ... */
+	do {
+		name[len++] = 'a' + n % 26;
+		n           = n / 26;
+	} while (n-- > 0);
+
+	*dev = (struct storm_dev) {.devtype = part ? "partition" : "disk", .devno = makedev(maj, min)};
+
+	strcpy(dev->name, "sd");
+	for (i = 0; i < len; i++)
+		dev->name[2 + i] = name[len - 1 - i];
+	dev->name[2 + len] = '\0';
+
+	if (part) {
+		snprintf(dev->devpath,
+		         sizeof(dev->devpath),
+		         "/devices/storm/target0:0:%u/block/%s/%s%u",
+		         disk,
+		         dev->name,
+		         dev->name,
+		         part);
+		snprintf(dev->name + 2 + len, sizeof(dev->name) - 2 - len, "%u", part);
+	} else
+		snprintf(dev->devpath, sizeof(dev->devpath), "/devices/storm/target0:0:%u/block/%s", disk, dev->name);
+}
+
+static void _init_dm_dev(struct storm_dev *dev, unsigned minor, const char *dm_name, const char *dm_uuid)
+{
+	*dev = (struct storm_dev) {.devtype = "disk", .devno = makedev(DM_MAJOR, minor)};
+
+	snprintf(dev->name, sizeof(dev->name), "dm-%u", minor);
+	snprintf(dev->devpath, sizeof(dev->devpath), "/devices/virtual/block/%s", dev->name);
+	snprintf(dev->dm_name, sizeof(dev->dm_name), "%s", dm_name);
+	snprintf(dev->dm_uuid, sizeof(dev->dm_uuid), "%s", dm_uuid);
+}
+
+/* N disks with M partitions each, all disks appear first, then all partitions. */
+static int _gen_coldplug(struct storm *s, unsigned count, unsigned parts, unsigned iterations)
+{
+	struct storm_dev dev;
+	unsigned         d, p;
+	int              r;
+
+	if (count > SD_DISKS_MAX || parts >= SD_MINORS_PER_DISK) {
+		log_error(LOG_PREFIX, "At most %zu disks with %d partitions supported.", SD_DISKS_MAX, SD_MINORS_PER_DISK - 1);
+		return -EINVAL;
+	}
+
+	for (d = 0; d < count; d++) {
+		_init_sd_dev(&dev, d, 0);
+		if ((r = _add_event(s, "add", &dev, false)) < 0)
+			return r;
+	}
+
+	for (p = 1; p <= parts; p++) {
+		for (d = 0; d < count; d++) {
+			_init_sd_dev(&dev, d, p);
+			if ((r = _add_event(s, "add", &dev, d == 0 && p == 1)) < 0)
+				return r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * N paths of one multipath device, then in each iteration all paths fail and
+ * the multipath device changes, then all paths come back and it changes again.
+ */
+static int _gen_mpath_flap(struct storm *s, unsigned count, unsigned parts, unsigned iterations)
+{
+	struct storm_dev dev, mpath;
+	unsigned         d, i;
+	int              r;
+
+	if (count > SD_DISKS_MAX) {
+		log_error(LOG_PREFIX, "At most %zu paths supported.", SD_DISKS_MAX);
+		return -EINVAL;
+	}
+
+	_init_dm_dev(&mpath, 0, "mpatha", "mpath-storm0");
+
+	for (d = 0; d < count; d++) {
+		_init_sd_dev(&dev, d, 0);
+		if ((r = _add_event(s, "add", &dev, false)) < 0)
+			return r;
+	}
+
+	if ((r = _add_event(s, "add", &mpath, true)) < 0 || (r = _add_event(s, "change", &mpath, true)) < 0)
+		return r;
+
+	for (i = 0; i < iterations; i++) {
+		for (d = 0; d < count; d++) {
+			_init_sd_dev(&dev, d, 0);
+			if ((r = _add_event(s, "remove", &dev, d == 0)) < 0)
+				return r;
+		}
+
+		if ((r = _add_event(s, "change", &mpath, true)) < 0)
+			return r;
+
+		for (d = 0; d < count; d++) {
+			_init_sd_dev(&dev, d, 0);
+			if ((r = _add_event(s, "add", &dev, d == 0)) < 0)
+				return r;
+		}
+
+		if ((r = _add_event(s, "change", &mpath, true)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/* N dm devices created on top of one disk and then removed, repeated in each iteration. */
+static int _gen_dm_stack(struct storm *s, unsigned count, unsigned parts, unsigned iterations)
+{
+	struct storm_dev dev;
+	char             dm_name[32], dm_uuid[64];
+	unsigned         d, i;
+	int              r;
+
+	_init_sd_dev(&dev, 0, 0);
+	if ((r = _add_event(s, "add", &dev, false)) < 0)
+		return r;
+
+	for (i = 0; i < iterations; i++) {
+		for (d = 0; d < count; d++) {
+			snprintf(dm_name, sizeof(dm_name), "storm-lv%u", d);
+			snprintf(dm_uuid, sizeof(dm_uuid), "LVM-storm%08u", d);
+
+			/* dm device is not set up yet when it appears, the change comes after table load */
+			_init_dm_dev(&dev, d, "", "");
+			if ((r = _add_event(s, "add", &dev, d == 0)) < 0)
+				return r;
+
+			_init_dm_dev(&dev, d, dm_name, dm_uuid);
+			if ((r = _add_event(s, "change", &dev, false)) < 0)
+				return r;
+		}
+
+		for (d = 0; d < count; d++) {
+			snprintf(dm_name, sizeof(dm_name), "storm-lv%u", d);
+			snprintf(dm_uuid, sizeof(dm_uuid), "LVM-storm%08u", d);
+
+			_init_dm_dev(&dev, d, dm_name, dm_uuid);
+			if ((r = _add_event(s, "remove", &dev, d == 0)) < 0)
+				return r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reads recorded events as KEY=VALUE lines, events are separated by an empty line,
+ * the same as for "usid scan-batch". Lines without '=' are skipped so the output of
+ * "udevadm monitor --udev --property --subsystem-match=block" can be used directly.
+ */
+static int _gen_replay(struct storm *s, unsigned count, unsigned parts, unsigned iterations)
+{
+	unsigned long long  major = ULLONG_MAX, minor = ULLONG_MAX, seqnum = 0;
+	char *              line      = NULL;
+	size_t              line_size = 0;
+	struct storm_event *ev;
+	const void *        data;
+	size_t              size;
+	ssize_t             len;
+	bool                eof = false;
+	int                 r   = 0;
+
+	(void) buffer_rewind(s->env_buf, 0, BUFFER_POS_ABS);
+
+	while (!eof) {
+		if ((len = getline(&line, &line_size, stdin)) < 0) {
+			eof = true;
+			len = 0;
+		} else if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (len) {
+			if (!strchr(line, '='))
+				continue;
+
+			if (!strncmp(line, "MAJOR=", 6))
+				major = strtoull(line + 6, NULL, 10);
+			else if (!strncmp(line, "MINOR=", 6))
+				minor = strtoull(line + 6, NULL, 10);
+			else if (!strncmp(line, "SEQNUM=", 7))
+				seqnum = strtoull(line + 7, NULL, 10);
+
+			if (!buffer_add(s->env_buf, line, len + 1, &r))
+				goto out;
+			continue;
+		}
+
+		(void) buffer_get_data(s->env_buf, &data, &size);
+		if (!size)
+			continue;
+
+		if (major > SYSTEM_MAX_MAJOR || minor > SYSTEM_MAX_MINOR) {
+			log_error(LOG_PREFIX, "Missing or invalid MAJOR or MINOR in event %zu.", s->count);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (s->count == s->alloc) {
+			size_t alloc = s->alloc ? s->alloc * 2 : 256;
+
+			if (!(ev = realloc(s->events, alloc * sizeof(*ev)))) {
+				r = -ENOMEM;
+				goto out;
+			}
+			s->events = ev;
+			s->alloc  = alloc;
+		}
+
+		ev  = &s->events[s->count];
+		*ev = (struct storm_event) {.devno = makedev(major, minor), .seqnum = seqnum ? seqnum : ++s->seqnum};
+
+		if (!(ev->env = malloc(size))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		memcpy(ev->env, data, size);
+		ev->env_size = size;
+		s->count++;
+
+		major = minor = ULLONG_MAX;
+		seqnum        = 0;
+		(void) buffer_rewind(s->env_buf, 0, BUFFER_POS_ABS);
+	}
+out:
+	free(line);
+	return r;
+}
+
+typedef int (*storm_gen_fn_t)(struct storm *s, unsigned count, unsigned parts, unsigned iterations);
+
+static const storm_gen_fn_t _generators[] = {
+	[STORM_SCENARIO_COLDPLUG]   = _gen_coldplug,
+	[STORM_SCENARIO_MPATH_FLAP] = _gen_mpath_flap,
+	[STORM_SCENARIO_DM_STACK]   = _gen_dm_stack,
+	[STORM_SCENARIO_REPLAY]     = _gen_replay,
+};
+
+static int _add_event_to_buf(struct buffer *buf, void *data)
+{
+	struct storm_event *ev = data;
+	int                 r  = 0;
+
+	if (!buffer_add(buf, &ev->devno, sizeof(ev->devno), &r) || !buffer_add(buf, ev->env, ev->env_size, &r))
+		return r < 0 ? r : -ENOMEM;
+
+	return 0;
+}
+
+static void _send_event(struct storm_event *ev)
+{
+	struct buffer *         buf;
+	struct usid_msg_header *hdr;
+	size_t                  size;
+	uint64_t                start = _now_usec();
+
+	if (usid_req(LOG_PREFIX, USID_CMD_SCAN, ev->seqnum, _add_event_to_buf, ev, &buf) < 0) {
+		ev->failed = true;
+		ev->usec   = _now_usec() - start;
+		return;
+	}
+
+	ev->usec = _now_usec() - start;
+
+	buffer_get_data(buf, (const void **) &hdr, &size);
+	if (size < USID_MSG_HEADER_SIZE || (hdr->status & COMMAND_STATUS_MASK_OVERALL) == COMMAND_STATUS_FAILURE)
+		ev->failed = true;
+
+	buffer_destroy(buf);
+}
+
+static void *_sender_thread(void *arg)
+{
+	struct storm *s = arg;
+	size_t        i;
+
+	pthread_mutex_lock(&s->lock);
+
+	for (;;) {
+		if (s->next < s->wave_end) {
+			i = s->next++;
+			pthread_mutex_unlock(&s->lock);
+
+			_send_event(&s->events[i]);
+
+			pthread_mutex_lock(&s->lock);
+			if (++s->completed == s->wave_end)
+				pthread_cond_signal(&s->done_cond);
+			continue;
+		}
+
+		if (s->finished)
+			break;
+
+		pthread_cond_wait(&s->wave_cond, &s->lock);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Returns the end of the wave which starts with given event. */
+static size_t _get_wave_end(struct storm *s, struct hash_table *devs, size_t start)
+{
+	size_t i;
+
+	hash_wipe(devs);
+
+	for (i = start; i < s->count; i++) {
+		if ((i > start && s->events[i].barrier) ||
+		    hash_lookup(devs, &s->events[i].devno, sizeof(s->events[i].devno), NULL))
+			break;
+
+		if (hash_insert(devs, &s->events[i].devno, sizeof(s->events[i].devno), &s->events[i], sizeof(s->events[i])) < 0)
+			break;
+	}
+
+	/* at least one event so that we always make progress */
+	return i > start ? i : start + 1;
+}
+
+static void *_subscriber_thread(void *arg)
+{
+	struct storm *          s = arg;
+	struct buffer *         buf;
+	struct usid_msg_header *hdr;
+	size_t                  size;
+
+	for (;;) {
+		if (usid_conn_recv(s->sub_conn, NULL, &buf) < 0) {
+			s->sub_failed = true;
+			break;
+		}
+
+		buffer_get_data(buf, (const void **) &hdr, &size);
+		if (size < USID_MSG_HEADER_SIZE || hdr->status & COMMAND_STATUS_FAILURE) {
+			log_error(LOG_PREFIX, "Subscription ended by SID daemon, convergence time not known.");
+			s->sub_failed = true;
+			buffer_destroy(buf);
+			break;
+		}
+
+		if (size > USID_MSG_HEADER_SIZE)
+			s->last_change_usec = _now_usec();
+
+		buffer_destroy(buf);
+	}
+
+	return NULL;
+}
+
+static int _subscribe(struct storm *s)
+{
+	struct buffer *         buf;
+	struct usid_msg_header *hdr;
+	size_t                  size;
+	int                     r;
+
+	if ((r = usid_conn_open(LOG_PREFIX, &s->sub_conn)) < 0)
+		return r;
+
+	/* the first reply only confirms the subscription */
+	if ((r = usid_conn_send(s->sub_conn, USID_CMD_SUBSCRIBE, 0, NULL, NULL, NULL)) < 0 ||
+	    (r = usid_conn_recv(s->sub_conn, NULL, &buf)) < 0)
+		goto fail;
+
+	buffer_get_data(buf, (const void **) &hdr, &size);
+	r = size < USID_MSG_HEADER_SIZE || hdr->status & COMMAND_STATUS_FAILURE ? -EIO : 0;
+	buffer_destroy(buf);
+
+	if (r == 0)
+		return 0;
+fail:
+	usid_conn_close(s->sub_conn);
+	s->sub_conn = NULL;
+	return r;
+}
+
+/* Main process of SID daemon is the one with "sid" command name whose parent is not "sid". */
+static bool _read_proc_comm(pid_t pid, char *comm, size_t size)
+{
+	char  path[64];
+	FILE *f;
+	bool  ok;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int) pid);
+	if (!(f = fopen(path, "r")))
+		return false;
+
+	ok = fgets(comm, size, f) != NULL;
+	fclose(f);
+
+	if (ok)
+		comm[strcspn(comm, "\n")] = '\0';
+	return ok;
+}
+
+static pid_t _read_proc_ppid(pid_t pid)
+{
+	char  path[64], stat[512], *p;
+	FILE *f;
+	int   ppid = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	if (!(f = fopen(path, "r")))
+		return 0;
+
+	/* the command name may contain spaces so skip everything up to the last ')' */
+	if (fgets(stat, sizeof(stat), f) && (p = strrchr(stat, ')')))
+		(void) sscanf(p + 1, " %*c %d", &ppid);
+
+	fclose(f);
+	return ppid;
+}
+
+static pid_t _find_sid_pid(void)
+{
+	DIR *          dir;
+	struct dirent *dirent;
+	char           comm[32];
+	pid_t          pid, found = 0;
+
+	if (!(dir = opendir("/proc")))
+		return 0;
+
+	while ((dirent = readdir(dir))) {
+		if (!isdigit(dirent->d_name[0]))
+			continue;
+
+		pid = atoi(dirent->d_name);
+		if (!_read_proc_comm(pid, comm, sizeof(comm)) || strcmp(comm, "sid"))
+			continue;
+
+		if (!_read_proc_comm(_read_proc_ppid(pid), comm, sizeof(comm)) || strcmp(comm, "sid")) {
+			found = pid;
+			break;
+		}
+	}
+
+	closedir(dir);
+	return found;
+}
+
+static size_t _read_children(pid_t pid, pid_t *children, size_t max)
+{
+	char   path[64];
+	FILE * f;
+	int    child;
+	size_t count = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int) pid, (int) pid);
+	if (!(f = fopen(path, "r")))
+		return SIZE_MAX;
+
+	while (count < max && fscanf(f, "%d", &child) == 1)
+		children[count++] = child;
+
+	fclose(f);
+	return count;
+}
+
+/*
+ * Workers are counted as forked whenever they appear among children of the daemon.
+ * A worker which is forked and exits between two samples is not counted.
+ */
+static void *_sampler_thread(void *arg)
+{
+	struct storm *s = arg;
+	pid_t         prev[STORM_CHILDREN_MAX], cur[STORM_CHILDREN_MAX];
+	size_t        prev_count, cur_count, i, j;
+
+	if ((prev_count = _read_children(s->sid_pid, prev, STORM_CHILDREN_MAX)) == SIZE_MAX)
+		return NULL;
+
+	s->forks_known = true;
+
+	while (s->sampling) {
+		(void) usleep(STORM_SAMPLE_INTERVAL_USEC);
+
+		if ((cur_count = _read_children(s->sid_pid, cur, STORM_CHILDREN_MAX)) == SIZE_MAX)
+			break;
+
+		for (i = 0; i < cur_count; i++) {
+			for (j = 0; j < prev_count && prev[j] != cur[i]; j++)
+				;
+			if (j == prev_count)
+				s->forks++;
+		}
+
+		memcpy(prev, cur, cur_count * sizeof(cur[0]));
+		prev_count = cur_count;
+	}
+
+	return NULL;
+}
+
+static int _count_store_recs(const void *data, size_t size, uint64_t *recs)
+{
+	struct rec_reader *reader;
+	const char *       key;
+	const void *       item;
+	size_t             len;
+	uint64_t           type, seqnum, flags, count;
+	int                r;
+
+	if (!(reader = rec_reader_create(data, size, &r)))
+		return r;
+
+	/* the record fields are described in iface/usid.h */
+	while ((r = rec_read_key(reader, &key, NULL)) == 1) {
+		if ((r = rec_read_uint(reader, &type)) < 0 || (r = rec_read_uint(reader, &seqnum)) < 0 ||
+		    (r = rec_read_uint(reader, &flags)) < 0 || (r = rec_read_data(reader, &item, &len)) < 0 ||
+		    (r = rec_read_uint(reader, &count)) < 0)
+			break;
+
+		while (count-- && (r = rec_read_data(reader, &item, &len)) >= 0)
+			;
+		if (r < 0)
+			break;
+
+		(*recs)++;
+	}
+
+	rec_reader_destroy(reader);
+	return r;
+}
+
+static int _get_store_size(uint64_t *recs, uint64_t *bytes)
+{
+	struct usid_conn *      conn;
+	struct buffer *         buf;
+	struct usid_msg_header *hdr;
+	size_t                  size;
+	bool                    more;
+	int                     r;
+
+	*recs = *bytes = 0;
+
+	if ((r = usid_conn_open(LOG_PREFIX, &conn)) < 0)
+		return r;
+
+	if ((r = usid_conn_send(conn, USID_CMD_DUMP, 0, NULL, NULL, NULL)) < 0)
+		goto out;
+
+	do {
+		if ((r = usid_conn_recv(conn, NULL, &buf)) < 0)
+			goto out;
+
+		buffer_get_data(buf, (const void **) &hdr, &size);
+		if (size < USID_MSG_HEADER_SIZE || hdr->status & COMMAND_STATUS_FAILURE) {
+			buffer_destroy(buf);
+			r = -EIO;
+			goto out;
+		}
+
+		more = hdr->status & COMMAND_STATUS_MORE;
+		*bytes += size - USID_MSG_HEADER_SIZE;
+		r = _count_store_recs(hdr->data, size - USID_MSG_HEADER_SIZE, recs);
+		buffer_destroy(buf);
+	} while (r >= 0 && more);
+out:
+	usid_conn_close(conn);
+	return r;
+}
+
+static int _usec_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t _percentile(const uint64_t *sorted, size_t count, unsigned per_mille)
+{
+	size_t i = (count * per_mille + 999) / 1000;
+
+	return count ? sorted[i ? i - 1 : 0] : 0;
+}
+
+static void _print_results(struct storm *   s,
+                           storm_scenario_t scenario,
+                           unsigned         concurrency,
+                           uint64_t         elapsed_usec,
+                           size_t           waves,
+                           bool             converged,
+                           uint64_t         convergence_usec)
+{
+	uint64_t *lat;
+	uint64_t  recs, bytes;
+	size_t    i, failed = 0;
+	bool      store_known;
+
+	if (!(lat = malloc(s->count * sizeof(*lat))))
+		return;
+
+	for (i = 0; i < s->count; i++) {
+		lat[i] = s->events[i].usec;
+		if (s->events[i].failed)
+			failed++;
+	}
+
+	qsort(lat, s->count, sizeof(*lat), _usec_cmp);
+	store_known = _get_store_size(&recs, &bytes) >= 0;
+
+	printf("{\"scenario\": \"%s\", \"events\": %zu, \"waves\": %zu, \"concurrency\": %u, \"failed\": %zu,\n",
+	       _scenario_names[scenario],
+	       s->count,
+	       waves,
+	       concurrency,
+	       failed);
+	printf(" \"elapsed_usec\": %" PRIu64 ", \"events_per_sec\": %.1f,\n",
+	       elapsed_usec,
+	       elapsed_usec ? s->count * 1000000.0 / elapsed_usec : 0.0);
+	printf(" \"latency_usec\": {\"min\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+	       ", \"max\": %" PRIu64 "},\n",
+	       s->count ? lat[0] : 0,
+	       _percentile(lat, s->count, 500),
+	       _percentile(lat, s->count, 990),
+	       _percentile(lat, s->count, 999),
+	       s->count ? lat[s->count - 1] : 0);
+
+	if (converged)
+		printf(" \"convergence_usec\": %" PRIu64 ",\n", convergence_usec);
+	else
+		printf(" \"convergence_usec\": null,\n");
+
+	if (s->forks_known)
+		printf(" \"worker_forks\": %" PRIu64 ",\n", s->forks);
+	else
+		printf(" \"worker_forks\": null,\n");
+
+	if (store_known)
+		printf(" \"store_records\": %" PRIu64 ", \"store_bytes\": %" PRIu64 "}\n", recs, bytes);
+	else
+		printf(" \"store_records\": null, \"store_bytes\": null}\n");
+
+	free(lat);
+}
+
+static int _run(struct storm *s, storm_scenario_t scenario, unsigned concurrency, unsigned quiet_msec)
+{
+	pthread_t          senders[concurrency], subscriber, sampler;
+	unsigned           started = 0, i;
+	bool               subscribed = false, sampling = false;
+	struct hash_table *devs;
+	size_t             waves = 0;
+	uint64_t           start, end, last;
+	int                r = 0;
+
+	if (!(devs = hash_create(s->count)))
+		return -ENOMEM;
+
+	if (_subscribe(s) < 0)
+		log_warning(LOG_PREFIX, "Failed to subscribe to main kv store changes, convergence time not known.");
+	else if (pthread_create(&subscriber, NULL, _subscriber_thread, s) == 0)
+		subscribed = true;
+
+	if (s->sid_pid > 0) {
+		s->sampling = true;
+		if (pthread_create(&sampler, NULL, _sampler_thread, s) == 0)
+			sampling = true;
+	}
+
+	for (i = 0; i < concurrency; i++) {
+		if ((r = -pthread_create(&senders[i], NULL, _sender_thread, s)) < 0)
+			break;
+		started++;
+	}
+
+	start = _now_usec();
+
+	if (started) {
+		pthread_mutex_lock(&s->lock);
+
+		while (s->wave_end < s->count) {
+			s->wave_end = _get_wave_end(s, devs, s->wave_end);
+			waves++;
+			pthread_cond_broadcast(&s->wave_cond);
+
+			while (s->completed < s->wave_end)
+				pthread_cond_wait(&s->done_cond, &s->lock);
+		}
+
+		s->finished = true;
+		pthread_cond_broadcast(&s->wave_cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	end = _now_usec();
+
+	for (i = 0; i < started; i++)
+		pthread_join(senders[i], NULL);
+
+	/* wait until main kv store does not change for a while */
+	if (subscribed) {
+		while (!s->sub_failed) {
+			last = s->last_change_usec > end ? s->last_change_usec : end;
+			if (_now_usec() - last >= quiet_msec * UINT64_C(1000))
+				break;
+			(void) usleep(STORM_SAMPLE_INTERVAL_USEC);
+		}
+	}
+
+	if (sampling) {
+		s->sampling = false;
+		pthread_join(sampler, NULL);
+	}
+
+	if (subscribed) {
+		/* the thread is blocked reading from the connection, it is a cancellation point */
+		pthread_cancel(subscriber);
+		pthread_join(subscriber, NULL);
+	}
+
+	if (s->sub_conn)
+		usid_conn_close(s->sub_conn);
+
+	_print_results(s,
+	               scenario,
+	               concurrency,
+	               end - start,
+	               waves,
+	               subscribed && !s->sub_failed,
+	               s->last_change_usec > end ? s->last_change_usec - end : 0);
+
+	hash_destroy(devs);
+	return r;
+}
+
+static void _help(FILE *f)
+{
+	fprintf(f,
+	        "Usage: storm [options] coldplug|mpath-flap|dm-stack|replay\n"
+	        "\n"
+	        "Replay udev event storm against running SID daemon.\n"
+	        "\n"
+	        "Scenarios:\n"
+	        "    coldplug     Disks with partitions appearing.\n"
+	        "    mpath-flap   Paths of a multipath device failing and coming back.\n"
+	        "    dm-stack     Device-mapper devices created on a disk and removed.\n"
+	        "    replay       Recorded events from standard input, as KEY=VALUE lines separated\n"
+	        "                 by an empty line (e.g. from 'udevadm monitor --udev --property').\n"
+	        "\n"
+	        "Options:\n"
+	        "    -c|--concurrency <count>  Number of events sent in parallel (default %d).\n"
+	        "    -d|--devices <count>      Number of disks, paths or dm devices (default %d).\n"
+	        "    -h|--help                 Show this help information.\n"
+	        "    -i|--iterations <count>   Number of flaps or dm create/remove cycles (default %d).\n"
+	        "    -p|--partitions <count>   Number of partitions on each disk for coldplug (default %d).\n"
+	        "    -P|--pid <pid>            PID of SID daemon main process to count worker forks.\n"
+	        "                              Found by its command name if not given.\n"
+	        "    -q|--quiet <msec>         Main kv store is converged if it does not change for this long\n"
+	        "                              after the last reply (default %d).\n"
+	        "    -v|--verbose              Verbose mode, repeat to increase level.\n"
+	        "\n",
+	        STORM_DEFAULT_CONCURRENCY,
+	        STORM_DEFAULT_COUNT,
+	        STORM_DEFAULT_ITERATIONS,
+	        STORM_DEFAULT_PARTITIONS,
+	        STORM_DEFAULT_QUIET_MSEC);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option longopts[] = {
+		{"concurrency", required_argument, NULL, 'c'},
+		{"devices", required_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{"iterations", required_argument, NULL, 'i'},
+		{"partitions", required_argument, NULL, 'p'},
+		{"pid", required_argument, NULL, 'P'},
+		{"quiet", required_argument, NULL, 'q'},
+		{"verbose", no_argument, NULL, 'v'},
+		{NULL, 0, NULL, 0},
+	};
+	struct storm     s           = {.lock      = PTHREAD_MUTEX_INITIALIZER,
+	                                .wave_cond = PTHREAD_COND_INITIALIZER,
+	                                .done_cond = PTHREAD_COND_INITIALIZER};
+	unsigned         concurrency = STORM_DEFAULT_CONCURRENCY;
+	unsigned         count       = STORM_DEFAULT_COUNT;
+	unsigned         parts       = STORM_DEFAULT_PARTITIONS;
+	unsigned         iterations  = STORM_DEFAULT_ITERATIONS;
+	unsigned         quiet_msec  = STORM_DEFAULT_QUIET_MSEC;
+	int              verbose     = 0;
+	storm_scenario_t scenario;
+	sigset_t         sig_set;
+	size_t           i;
+	int              opt, r = -1;
+
+	while ((opt = getopt_long(argc, argv, "c:d:hi:p:P:q:v", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				concurrency = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				count = strtoul(optarg, NULL, 10);
+				break;
+			case 'h':
+				_help(stdout);
+				return EXIT_SUCCESS;
+			case 'i':
+				iterations = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				parts = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				s.sid_pid = atoi(optarg);
+				break;
+			case 'q':
+				quiet_msec = strtoul(optarg, NULL, 10);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				_help(stderr);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || !concurrency) {
+		_help(stderr);
+		return EXIT_FAILURE;
+	}
+
+	for (scenario = 0; scenario < _STORM_SCENARIO_COUNT; scenario++)
+		if (!strcmp(argv[optind], _scenario_names[scenario]))
+			break;
+
+	if (scenario == _STORM_SCENARIO_COUNT) {
+		_help(stderr);
+		return EXIT_FAILURE;
+	}
+
+	log_init(LOG_TARGET_STANDARD, verbose);
+
+	/* the same as usid, a reply may come after the daemon closed the connection */
+	if (sigemptyset(&sig_set) < 0 || sigaddset(&sig_set, SIGPIPE) < 0 || sigprocmask(SIG_BLOCK, &sig_set, NULL) < 0) {
+		log_error_errno(LOG_PREFIX, errno, "Failed to block SIGPIPE");
+		return EXIT_FAILURE;
+	}
+
+	if (!s.sid_pid && !(s.sid_pid = _find_sid_pid()))
+		log_warning(LOG_PREFIX, "SID daemon process not found, worker forks not counted.");
+
+	if (!(s.env_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                        .type    = BUFFER_TYPE_LINEAR,
+	                                                        .mode    = BUFFER_MODE_PLAIN}),
+	                                &((struct buffer_init) {.size = 0, .alloc_step = 1024, .limit = 0}),
+	                                &r))) {
+		log_error_errno(LOG_PREFIX, r, "Failed to create environment buffer");
+		return EXIT_FAILURE;
+	}
+
+	if ((r = _generators[scenario](&s, count, parts, iterations)) < 0)
+		log_error_errno(LOG_PREFIX, r, "Failed to prepare events");
+	else if (!s.count) {
+		log_error(LOG_PREFIX, "No events to send.");
+		r = -ENODATA;
+	} else
+		r = _run(&s, scenario, concurrency, quiet_msec);
+
+	for (i = 0; i < s.count; i++)
+		free(s.events[i].env);
+	free(s.events);
+	buffer_destroy(s.env_buf);
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
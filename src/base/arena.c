@@ -0,0 +1,124 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/arena.h"
+
+#include "base/mem.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define ARENA_ALIGN sizeof(max_align_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t              size;
+	size_t              used;
+	char                data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+	struct arena_chunk *chunks;
+	size_t              chunk_size;
+	size_t              total_size;
+};
+
+struct arena *arena_create(size_t chunk_size)
+{
+	struct arena *a;
+
+	if (!(a = mem_zalloc(sizeof(*a))))
+		return NULL;
+
+	a->chunk_size = chunk_size;
+
+	return a;
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c, *n;
+
+	for (c = a->chunks; c; c = n) {
+		n = c->next;
+		free(c);
+	}
+
+	free(a);
+}
+
+static struct arena_chunk *_add_chunk(struct arena *a, size_t size)
+{
+	struct arena_chunk *c;
+
+	if (!(c = malloc(sizeof(*c) + size)))
+		return NULL;
+
+	c->size = size;
+	c->used = 0;
+	a->total_size += size;
+
+	/*
+	 * Allocation bigger than regular chunk gets its own chunk which is put
+	 * behind the current one so we can still continue allocating from the
+	 * space left in the current chunk.
+	 */
+	if (size > a->chunk_size && a->chunks) {
+		c->next         = a->chunks->next;
+		a->chunks->next = c;
+	} else {
+		c->next   = a->chunks;
+		a->chunks = c;
+	}
+
+	return c;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c = a->chunks;
+	void *              p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!c || c->size - c->used < size) {
+		if (!(c = _add_chunk(a, size > a->chunk_size ? size : a->chunk_size)))
+			return NULL;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+
+	return p;
+}
+
+void *arena_zalloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	if ((p = arena_alloc(a, size)))
+		memset(p, 0, size);
+
+	return p;
+}
+
+size_t arena_get_size(struct arena *a)
+{
+	return a->total_size;
+}
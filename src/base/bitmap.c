@@ -21,19 +21,64 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef uint64_t block_t;
+
 struct bitmap {
-	size_t   bit_count;
-	size_t   bit_set_count;
-	unsigned mem[];
-} __attribute__((packed));
+	size_t  bit_count;
+	size_t  bit_set_count;
+	block_t mem[];
+};
 
-#define BLOCK_SIZE     sizeof(unsigned)
+#define BLOCK_SIZE     sizeof(block_t)
 #define BITS_PER_BLOCK (BLOCK_SIZE * CHAR_BIT)
 static unsigned BLOCK_SHIFT = 0;
 
+/*
+ * Vector registers used for bulk operations, if available. The blocks
+ * not filling whole vector register at the end are handled one by one.
+ */
+#if defined(__AVX2__)
+#define SIMD_BLOCKS       (sizeof(__m256i) / BLOCK_SIZE)
+#define SIMD_LOAD(p)      _mm256_loadu_si256((const __m256i *) (p))
+#define SIMD_STORE(p, v)  _mm256_storeu_si256((__m256i *) (p), (v))
+#define SIMD_AND(a, b)    _mm256_and_si256((a), (b))
+#define SIMD_OR(a, b)     _mm256_or_si256((a), (b))
+#define SIMD_ANDNOT(a, b) _mm256_andnot_si256((b), (a)) /* a & ~b */
+#elif defined(__SSE2__)
+#define SIMD_BLOCKS       (sizeof(__m128i) / BLOCK_SIZE)
+#define SIMD_LOAD(p)      _mm_loadu_si128((const __m128i *) (p))
+#define SIMD_STORE(p, v)  _mm_storeu_si128((__m128i *) (p), (v))
+#define SIMD_AND(a, b)    _mm_and_si128((a), (b))
+#define SIMD_OR(a, b)     _mm_or_si128((a), (b))
+#define SIMD_ANDNOT(a, b) _mm_andnot_si128((b), (a)) /* a & ~b */
+#elif defined(__ARM_NEON)
+#define SIMD_BLOCKS       (sizeof(uint64x2_t) / BLOCK_SIZE)
+#define SIMD_LOAD(p)      vld1q_u64(p)
+#define SIMD_STORE(p, v)  vst1q_u64((p), (v))
+#define SIMD_AND(a, b)    vandq_u64((a), (b))
+#define SIMD_OR(a, b)     vorrq_u64((a), (b))
+#define SIMD_ANDNOT(a, b) vbicq_u64((a), (b)) /* a & ~b */
+#endif
+
+typedef enum
+{
+	BITMAP_OP_AND,
+	BITMAP_OP_OR,
+	BITMAP_OP_ANDNOT,
+} bitmap_op_t;
+
 static unsigned _log2n_recursive(unsigned n)
 {
 	return n > 1 ? _log2n_recursive(n / 2) + 1 : 0;
@@ -44,9 +89,36 @@ __attribute__((constructor)) static void _init_bitmap()
 	BLOCK_SHIFT = _log2n_recursive(BITS_PER_BLOCK);
 }
 
+static size_t _get_block_count(size_t bit_count)
+{
+	return (bit_count - 1) / BITS_PER_BLOCK + 1;
+}
+
+/*
+ * Bits in the last block beyond bit_count are always kept unset
+ * so whole blocks can be used in bulk operations and for counting.
+ */
+static block_t _get_last_block_mask(size_t bit_count)
+{
+	unsigned bits = bit_count & (BITS_PER_BLOCK - 1);
+
+	return bits ? ((block_t) 1 << bits) - 1 : ~(block_t) 0;
+}
+
+static size_t _count_bits(const block_t *mem, size_t block_count)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < block_count; i++)
+		count += __builtin_popcountll(mem[i]);
+
+	return count;
+}
+
 struct bitmap *bitmap_create(size_t bit_count, bool invert, int *ret_code)
 {
-	size_t         mem_size;
+	size_t         block_count;
 	struct bitmap *bitmap = NULL;
 	int            r      = 0;
 
@@ -55,9 +127,9 @@ struct bitmap *bitmap_create(size_t bit_count, bool invert, int *ret_code)
 		goto out;
 	}
 
-	mem_size = ((bit_count - 1) / BITS_PER_BLOCK + 1) * BLOCK_SIZE;
+	block_count = _get_block_count(bit_count);
 
-	if (!(bitmap = malloc(sizeof(struct bitmap) + mem_size))) {
+	if (!(bitmap = malloc(sizeof(struct bitmap) + block_count * BLOCK_SIZE))) {
 		r = -ENOMEM;
 		goto out;
 	}
@@ -65,10 +137,11 @@ struct bitmap *bitmap_create(size_t bit_count, bool invert, int *ret_code)
 	bitmap->bit_count = bit_count;
 
 	if (invert) {
-		memset(bitmap->mem, UCHAR_MAX, mem_size);
+		memset(bitmap->mem, UCHAR_MAX, block_count * BLOCK_SIZE);
+		bitmap->mem[block_count - 1] &= _get_last_block_mask(bit_count);
 		bitmap->bit_set_count = bit_count;
 	} else {
-		memset(bitmap->mem, 0, mem_size);
+		memset(bitmap->mem, 0, block_count * BLOCK_SIZE);
 		bitmap->bit_set_count = 0;
 	}
 out:
@@ -82,21 +155,22 @@ void bitmap_destroy(struct bitmap *bitmap)
 	free(bitmap);
 }
 
-int _get_coord(struct bitmap *bitmap, size_t bit_pos, unsigned *block, unsigned *bit)
+int _get_coord(struct bitmap *bitmap, size_t bit_pos, size_t *block, block_t *bit)
 {
 	if (bit_pos >= bitmap->bit_count)
 		return -ERANGE;
 
 	*block = bit_pos >> BLOCK_SHIFT;
-	*bit   = 1 << (bit_pos & (BITS_PER_BLOCK - 1));
+	*bit   = (block_t) 1 << (bit_pos & (BITS_PER_BLOCK - 1));
 
 	return 0;
 }
 
 int bitmap_bit_set(struct bitmap *bitmap, size_t bit_pos)
 {
-	unsigned block, bit;
-	int      r;
+	size_t  block;
+	block_t bit;
+	int     r;
 
 	if ((r = _get_coord(bitmap, bit_pos, &block, &bit)) < 0)
 		return r;
@@ -111,8 +185,9 @@ int bitmap_bit_set(struct bitmap *bitmap, size_t bit_pos)
 
 int bitmap_bit_unset(struct bitmap *bitmap, size_t bit_pos)
 {
-	unsigned block, bit;
-	int      r;
+	size_t  block;
+	block_t bit;
+	int     r;
 
 	if ((r = _get_coord(bitmap, bit_pos, &block, &bit)) < 0)
 		return r;
@@ -127,8 +202,9 @@ int bitmap_bit_unset(struct bitmap *bitmap, size_t bit_pos)
 
 bool bitmap_bit_is_set(struct bitmap *bitmap, size_t bit_pos, int *ret_code)
 {
-	unsigned block, bit;
-	int      r;
+	size_t  block;
+	block_t bit;
+	int     r;
 
 	if ((r = _get_coord(bitmap, bit_pos, &block, &bit)) < 0) {
 		if (ret_code)
@@ -148,3 +224,88 @@ size_t bitmap_get_bit_set_count(struct bitmap *bitmap)
 {
 	return bitmap->bit_set_count;
 }
+
+static int _combine(struct bitmap *bitmap, struct bitmap *other, bitmap_op_t op)
+{
+	block_t *      dst = bitmap->mem;
+	const block_t *src = other->mem;
+	size_t         block_count, i = 0;
+
+	if (bitmap->bit_count != other->bit_count)
+		return -EINVAL;
+
+	block_count = _get_block_count(bitmap->bit_count);
+
+#ifdef SIMD_BLOCKS
+	switch (op) {
+		case BITMAP_OP_AND:
+			for (; i + SIMD_BLOCKS <= block_count; i += SIMD_BLOCKS)
+				SIMD_STORE(dst + i, SIMD_AND(SIMD_LOAD(dst + i), SIMD_LOAD(src + i)));
+			break;
+		case BITMAP_OP_OR:
+			for (; i + SIMD_BLOCKS <= block_count; i += SIMD_BLOCKS)
+				SIMD_STORE(dst + i, SIMD_OR(SIMD_LOAD(dst + i), SIMD_LOAD(src + i)));
+			break;
+		case BITMAP_OP_ANDNOT:
+			for (; i + SIMD_BLOCKS <= block_count; i += SIMD_BLOCKS)
+				SIMD_STORE(dst + i, SIMD_ANDNOT(SIMD_LOAD(dst + i), SIMD_LOAD(src + i)));
+			break;
+	}
+#endif
+
+	switch (op) {
+		case BITMAP_OP_AND:
+			for (; i < block_count; i++)
+				dst[i] &= src[i];
+			break;
+		case BITMAP_OP_OR:
+			for (; i < block_count; i++)
+				dst[i] |= src[i];
+			break;
+		case BITMAP_OP_ANDNOT:
+			for (; i < block_count; i++)
+				dst[i] &= ~src[i];
+			break;
+	}
+
+	bitmap->bit_set_count = _count_bits(dst, block_count);
+	return 0;
+}
+
+int bitmap_and(struct bitmap *bitmap, struct bitmap *other)
+{
+	return _combine(bitmap, other, BITMAP_OP_AND);
+}
+
+int bitmap_or(struct bitmap *bitmap, struct bitmap *other)
+{
+	return _combine(bitmap, other, BITMAP_OP_OR);
+}
+
+int bitmap_andnot(struct bitmap *bitmap, struct bitmap *other)
+{
+	return _combine(bitmap, other, BITMAP_OP_ANDNOT);
+}
+
+size_t bitmap_find_next_set(struct bitmap *bitmap, size_t bit_pos)
+{
+	size_t  block, block_count;
+	block_t b;
+
+	if (bit_pos >= bitmap->bit_count)
+		return bitmap->bit_count;
+
+	block_count = _get_block_count(bitmap->bit_count);
+	block       = bit_pos >> BLOCK_SHIFT;
+
+	/* mask out bits before bit_pos in the first block, then skip empty blocks */
+	b = bitmap->mem[block] & (~(block_t) 0 << (bit_pos & (BITS_PER_BLOCK - 1)));
+
+	while (!b) {
+		if (++block == block_count)
+			return bitmap->bit_count;
+		b = bitmap->mem[block];
+	}
+
+	return (block << BLOCK_SHIFT) + __builtin_ctzll(b);
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/bloom.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_WORD (sizeof(uint64_t) * 8)
+
+struct bloom {
+	size_t   bit_mask;
+	unsigned hash_count;
+	uint64_t bits[];
+};
+
+struct bloom *bloom_create(size_t bit_count, unsigned hash_count)
+{
+	struct bloom *b;
+	size_t        n = BITS_PER_WORD;
+
+	if (!hash_count)
+		return NULL;
+
+	while (n < bit_count)
+		n <<= 1;
+
+	if (!(b = calloc(1, sizeof(*b) + n / 8)))
+		return NULL;
+
+	b->bit_mask   = n - 1;
+	b->hash_count = hash_count;
+
+	return b;
+}
+
+void bloom_destroy(struct bloom *b)
+{
+	free(b);
+}
+
+void bloom_clear(struct bloom *b)
+{
+	memset(b->bits, 0, (b->bit_mask + 1) / 8);
+}
+
+/*
+ * The bit positions are derived from the single 64-bit hash
+ * by double hashing: pos(i) = h1 + i * h2, h2 being odd.
+ */
+static uint64_t _get_step(uint64_t hash)
+{
+	return ((hash >> 32) | (hash << 32)) | 1;
+}
+
+void bloom_add(struct bloom *b, uint64_t hash)
+{
+	uint64_t pos, step = _get_step(hash);
+	unsigned i;
+
+	for (i = 0, pos = hash; i < b->hash_count; i++, pos += step)
+		b->bits[(pos & b->bit_mask) / BITS_PER_WORD] |= UINT64_C(1) << (pos % BITS_PER_WORD);
+}
+
+bool bloom_may_contain(struct bloom *b, uint64_t hash)
+{
+	uint64_t pos, step = _get_step(hash);
+	unsigned i;
+
+	for (i = 0, pos = hash; i < b->hash_count; i++, pos += step)
+		if (!(b->bits[(pos & b->bit_mask) / BITS_PER_WORD] & (UINT64_C(1) << (pos % BITS_PER_WORD))))
+			return false;
+
+	return true;
+}
+
+size_t bloom_get_bit_count(struct bloom *b)
+{
+	return b->bit_mask + 1;
+}
@@ -42,6 +42,8 @@ static int _buffer_linear_realloc(struct buffer *buf, size_t needed, int force)
 			return 0;
 		if (!(alloc_step = buf->stat.init.alloc_step))
 			return -EXFULL;
+
+		needed = buffer_get_grown_size(buf, needed);
 	}
 
 	if ((align = (needed % alloc_step)))
@@ -202,6 +204,50 @@ out:
 	return start;
 }
 
+static const void *
+	_buffer_linear_join_add(struct buffer *buf, int *ret_code, const char *sep, const struct buffer_str *parts, size_t count)
+{
+	size_t used    = buf->stat.usage.used;
+	size_t sep_len = sep ? strlen(sep) : 0;
+	size_t len     = 1;
+	char * p, *start = NULL;
+	size_t i;
+	int    r;
+
+	if (!used && buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX)
+		used = MSG_SIZE_PREFIX_LEN;
+
+	for (i = 0; i < count; i++)
+		len += parts[i].len;
+
+	if (count)
+		len += (count - 1) * sep_len;
+
+	if ((r = _buffer_linear_realloc(buf, used + len, 0)) < 0)
+		goto out;
+
+	start = p = buf->mem + used;
+
+	for (i = 0; i < count; i++) {
+		if (i && sep_len) {
+			memcpy(p, sep, sep_len);
+			p += sep_len;
+		}
+
+		if (parts[i].len) {
+			memcpy(p, parts[i].str, parts[i].len);
+			p += parts[i].len;
+		}
+	}
+
+	*p                   = '\0';
+	buf->stat.usage.used = used + len;
+out:
+	if (ret_code)
+		*ret_code = r;
+	return start;
+}
+
 static int _buffer_linear_rewind(struct buffer *buf, size_t pos)
 {
 	size_t min_pos = (buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX) ? MSG_SIZE_PREFIX_LEN : 0;
@@ -361,14 +407,21 @@ static ssize_t _buffer_linear_write(struct buffer *buf, int fd, size_t pos)
 	return n;
 }
 
+static ssize_t _buffer_linear_take(struct buffer *buf, void *data, size_t size)
+{
+	return -ENOTSUP;
+}
+
 const struct buffer_type buffer_type_linear = {.create      = _buffer_linear_create,
                                                .destroy     = _buffer_linear_destroy,
                                                .reset       = _buffer_linear_reset,
                                                .add         = _buffer_linear_add,
                                                .fmt_add     = _buffer_linear_fmt_add,
+                                               .join_add    = _buffer_linear_join_add,
                                                .rewind      = _buffer_linear_rewind,
                                                .rewind_mem  = _buffer_linear_rewind_mem,
                                                .is_complete = _buffer_linear_is_complete,
                                                .get_data    = _buffer_linear_get_data,
                                                .read        = _buffer_linear_read,
-                                               .write       = _buffer_linear_write};
+                                               .write       = _buffer_linear_write,
+                                               .take        = _buffer_linear_take};
@@ -0,0 +1,322 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/common.h"
+
+#include "base/mem.h"
+#include "buffer-type.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Ring buffer with fixed size for single producer and single consumer.
+ *
+ * Whole state is kept in buffer memory, right in front of the data, so with
+ * BUFFER_BACKEND_MEMFD the producer and the consumer can be in different
+ * processes sharing the mapping (e.g. buffer created before fork). The layout
+ * is described by struct ring below. The producer only moves the head and the
+ * consumer only moves the tail so neither needs a lock.
+ *
+ * The data are stored as records, each one with RING_REC_HEADER_LEN bytes long
+ * header with record length. If struct buffer_init.ring_overwrite is set and
+ * there is not enough space for a new record, the producer drops the oldest
+ * records by moving the tail. The consumer then detects that the tail moved
+ * while it was copying a record out and it throws the copy away.
+ *
+ * Positions are never wrapped, only their offsets within the data area are.
+ */
+
+#define RING_CACHE_LINE     64
+#define RING_REC_HEADER_LEN sizeof(uint32_t)
+#define RING_FMT_MAX        1024 /* maximum length of record added with buffer_fmt_add */
+
+struct ring {
+	uint64_t head __attribute__((aligned(RING_CACHE_LINE))); /* producer position */
+	uint64_t tail __attribute__((aligned(RING_CACHE_LINE))); /* consumer position */
+	uint64_t size __attribute__((aligned(RING_CACHE_LINE))); /* size of data area */
+	char     data[] __attribute__((aligned(RING_CACHE_LINE)));
+};
+
+#define RING(buf)      ((struct ring *) (buf)->mem)
+#define RING_LEN(size) (sizeof(struct ring) + (size))
+
+static void _ring_copy_in(struct ring *ring, uint64_t pos, const void *src, size_t len)
+{
+	size_t off   = pos % ring->size;
+	size_t first = len < ring->size - off ? len : ring->size - off;
+
+	memcpy(ring->data + off, src, first);
+	memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+static void _ring_copy_out(struct ring *ring, uint64_t pos, void *dst, size_t len)
+{
+	size_t off   = pos % ring->size;
+	size_t first = len < ring->size - off ? len : ring->size - off;
+
+	memcpy(dst, ring->data + off, first);
+	memcpy((char *) dst + first, ring->data, len - first);
+}
+
+static void _ring_update_used(struct buffer *buf)
+{
+	struct ring *ring = RING(buf);
+
+	/* both the producer and the consumer update this so it is only a hint while any of them is active */
+	__atomic_store_n(&buf->stat.usage.used,
+	                 __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED),
+	                 __ATOMIC_RELAXED);
+}
+
+static int _buffer_ring_create(struct buffer *buf)
+{
+	size_t size = buf->stat.init.size;
+	void * p;
+	int    r;
+
+	/* records carry their own length so there is no place for size prefix */
+	if (!size || size > UINT32_MAX || buf->stat.spec.mode != BUFFER_MODE_PLAIN)
+		return -EINVAL;
+
+	switch (buf->stat.spec.backend) {
+		case BUFFER_BACKEND_MALLOC:
+			if (!(p = mem_zalloc(RING_LEN(size))))
+				return -ENOMEM;
+			break;
+
+		case BUFFER_BACKEND_MEMFD:
+			if ((buf->fd = memfd_create("buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+				return -errno;
+
+			if (ftruncate(buf->fd, RING_LEN(size)) < 0 ||
+			    (p = mmap(NULL, RING_LEN(size), PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd, 0)) == MAP_FAILED) {
+				r = -errno;
+				(void) close(buf->fd);
+				buf->fd = -1;
+				return r;
+			}
+			break;
+
+		default:
+			return -ENOTSUP;
+	}
+
+	buf->mem                  = p;
+	buf->stat.usage.allocated = size;
+	RING(buf)->size           = size;
+
+	return 0;
+}
+
+static int _buffer_ring_destroy(struct buffer *buf)
+{
+	int r;
+
+	switch (buf->stat.spec.backend) {
+		case BUFFER_BACKEND_MALLOC:
+			free(buf->mem);
+			r = 0;
+			break;
+
+		case BUFFER_BACKEND_MEMFD:
+			(void) close(buf->fd);
+			r = munmap(buf->mem, RING_LEN(buf->stat.usage.allocated));
+			break;
+
+		default:
+			r = -ENOTSUP;
+	}
+
+	return r;
+}
+
+/* Drops all records, neither the producer nor the consumer can be active at the same time! */
+static int _buffer_ring_reset(struct buffer *buf)
+{
+	struct ring *ring = RING(buf);
+
+	__atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+	buf->stat.usage.used = 0;
+
+	return 0;
+}
+
+/*
+ * Producer side. Returns the position of the record data within the ring, but
+ * as they can wrap around the end of the data area, it is only good for checking
+ * the success and not for accessing the data.
+ */
+static const void *_buffer_ring_add(struct buffer *buf, void *data, size_t len, int *ret_code)
+{
+	struct ring *ring = RING(buf);
+	uint64_t     head, tail, new_tail;
+	size_t       needed = RING_REC_HEADER_LEN + len;
+	uint32_t     rec_len;
+	const void * start = NULL;
+	int          r     = 0;
+
+	if (needed > ring->size) {
+		r = -EMSGSIZE;
+		goto out;
+	}
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	while (head + needed - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) > ring->size) {
+		if (!buf->stat.init.ring_overwrite) {
+			r = -EAGAIN;
+			goto out;
+		}
+
+		/* the record at tail is whole until somebody moves the tail past it */
+		_ring_copy_out(ring, tail, &rec_len, RING_REC_HEADER_LEN);
+		new_tail = tail + RING_REC_HEADER_LEN + rec_len;
+
+		/* if this fails, consumer took the record in the meantime */
+		(void) __atomic_compare_exchange_n(&ring->tail, &tail, new_tail, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	rec_len = len;
+	_ring_copy_in(ring, head, &rec_len, RING_REC_HEADER_LEN);
+	_ring_copy_in(ring, head + RING_REC_HEADER_LEN, data, len);
+
+	__atomic_store_n(&ring->head, head + needed, __ATOMIC_RELEASE);
+
+	start = ring->data + (head + RING_REC_HEADER_LEN) % ring->size;
+	_ring_update_used(buf);
+out:
+	if (ret_code)
+		*ret_code = r;
+	return start;
+}
+
+static const void *_buffer_ring_fmt_add(struct buffer *buf, int *ret_code, const char *fmt, va_list ap)
+{
+	char rec[RING_FMT_MAX];
+	int  printed;
+
+	if ((printed = vsnprintf(rec, sizeof(rec), fmt, ap)) < 0 || printed >= sizeof(rec)) {
+		if (ret_code)
+			*ret_code = printed < 0 ? -EIO : -EMSGSIZE;
+		return NULL;
+	}
+
+	return _buffer_ring_add(buf, rec, printed + 1, ret_code);
+}
+
+static const void *
+	_buffer_ring_join_add(struct buffer *buf, int *ret_code, const char *sep, const struct buffer_str *parts, size_t count)
+{
+	if (ret_code)
+		*ret_code = -ENOTSUP;
+	return NULL;
+}
+
+static int _buffer_ring_rewind(struct buffer *buf, size_t pos)
+{
+	return -ENOTSUP;
+}
+
+static int _buffer_ring_rewind_mem(struct buffer *buf, const void *mem)
+{
+	return -ENOTSUP;
+}
+
+static bool _buffer_ring_is_complete(struct buffer *buf, int *ret_code)
+{
+	if (ret_code)
+		*ret_code = -ENOTSUP;
+	return false;
+}
+
+static int _buffer_ring_get_data(struct buffer *buf, const void **data, size_t *data_size)
+{
+	return -ENOTSUP;
+}
+
+static ssize_t _buffer_ring_read(struct buffer *buf, int fd)
+{
+	return -ENOTSUP;
+}
+
+static ssize_t _buffer_ring_write(struct buffer *buf, int fd, size_t pos)
+{
+	return -ENOTSUP;
+}
+
+/* Consumer side. */
+static ssize_t _buffer_ring_take(struct buffer *buf, void *data, size_t size)
+{
+	struct ring *ring = RING(buf);
+	uint64_t     head, tail;
+	uint32_t     rec_len;
+
+	for (;;) {
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		if (tail == head)
+			return -ENODATA;
+
+		_ring_copy_out(ring, tail, &rec_len, RING_REC_HEADER_LEN);
+
+		/* length read while the producer was overwriting the record */
+		if (RING_REC_HEADER_LEN + rec_len > head - tail)
+			continue;
+
+		if (rec_len > size) {
+			if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != tail)
+				continue;
+			return -ENOBUFS;
+		}
+
+		_ring_copy_out(ring, tail + RING_REC_HEADER_LEN, data, rec_len);
+
+		/* the producer moves the tail before overwriting so if it did not move, the copy is whole */
+		if (__atomic_compare_exchange_n(&ring->tail,
+		                                &tail,
+		                                tail + RING_REC_HEADER_LEN + rec_len,
+		                                false,
+		                                __ATOMIC_ACQ_REL,
+		                                __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	_ring_update_used(buf);
+	return rec_len;
+}
+
+const struct buffer_type buffer_type_ring = {.create      = _buffer_ring_create,
+                                             .destroy     = _buffer_ring_destroy,
+                                             .reset       = _buffer_ring_reset,
+                                             .add         = _buffer_ring_add,
+                                             .fmt_add     = _buffer_ring_fmt_add,
+                                             .join_add    = _buffer_ring_join_add,
+                                             .rewind      = _buffer_ring_rewind,
+                                             .rewind_mem  = _buffer_ring_rewind_mem,
+                                             .is_complete = _buffer_ring_is_complete,
+                                             .get_data    = _buffer_ring_get_data,
+                                             .read        = _buffer_ring_read,
+                                             .write       = _buffer_ring_write,
+                                             .take        = _buffer_ring_take};
@@ -23,6 +23,7 @@
 #include "buffer-type.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -43,6 +44,8 @@ static int _buffer_vector_realloc(struct buffer *buf, size_t needed, int force)
 
 		if (!(alloc_step = buf->stat.init.alloc_step))
 			return -EXFULL;
+
+		needed = buffer_get_grown_size(buf, needed);
 	}
 
 	if ((align = (needed % alloc_step)))
@@ -77,7 +80,7 @@ static int _buffer_vector_realloc(struct buffer *buf, size_t needed, int force)
 					return -errno;
 			} else {
 				if (buf->stat.usage.allocated > 0) {
-					if (munmap(buf->mem, buf->stat.usage.allocated) < 0)
+					if (munmap(buf->mem, buf->stat.usage.allocated * VECTOR_ITEM_SIZE) < 0)
 						return -errno;
 				}
 				p = NULL;
@@ -112,7 +115,11 @@ static int _buffer_vector_create(struct buffer *buf)
 		return r;
 	}
 
-	// TODO: also count with BUFFER_BACKEND_MEMFD where we don't want to use malloc.
+	/*
+	 * The size prefix is kept in malloc-ed memory even with BUFFER_BACKEND_MEMFD
+	 * as the memfd only holds the vector itself, not the data it points to. To pass
+	 * the data to another process, use buffer_detach_fd which gathers them into memfd.
+	 */
 	if (buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX) {
 		if (!(((struct iovec *) buf->mem)[0].iov_base = malloc(MSG_SIZE_PREFIX_LEN))) {
 			free(buf->mem);
@@ -143,8 +150,13 @@ int _buffer_vector_destroy(struct buffer *buf)
 			break;
 
 		case BUFFER_BACKEND_MEMFD:
+			if (buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX) {
+				iov = buf->mem;
+				free(iov[0].iov_base);
+			}
+
 			(void) close(buf->fd);
-			r = munmap(buf->mem, buf->stat.usage.allocated);
+			r = munmap(buf->mem, buf->stat.usage.allocated * VECTOR_ITEM_SIZE);
 			break;
 
 		default:
@@ -159,6 +171,7 @@ int _buffer_vector_reset(struct buffer *buf)
 	size_t needed;
 
 	buf->stat.usage.used = 0;
+	buf->write_cursor    = (struct buffer_write_cursor) {0};
 
 	needed = buf->stat.init.size;
 
@@ -215,6 +228,14 @@ const void *_buffer_vector_fmt_add(struct buffer *buf, int *ret_code, const char
 	return NULL;
 }
 
+const void *
+	_buffer_vector_join_add(struct buffer *buf, int *ret_code, const char *sep, const struct buffer_str *parts, size_t count)
+{
+	if (ret_code)
+		*ret_code = -ENOTSUP;
+	return NULL;
+}
+
 int _buffer_vector_rewind(struct buffer *buf, size_t pos)
 {
 	size_t min_pos = (buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX) ? 1 : 0;
@@ -223,6 +244,7 @@ int _buffer_vector_rewind(struct buffer *buf, size_t pos)
 		return -EINVAL;
 
 	buf->stat.usage.used = pos;
+	buf->write_cursor    = (struct buffer_write_cursor) {0};
 	return 0;
 }
 
@@ -298,29 +320,25 @@ ssize_t _buffer_vector_read(struct buffer *buf, int fd)
 
 ssize_t _buffer_vector_write(struct buffer *buf, int fd, size_t pos)
 {
-	struct iovec *       iov         = buf->mem;
-	MSG_SIZE_PREFIX_TYPE size_prefix = 0;
-	unsigned             i, start_idx = 0;
-	void *               save_base = NULL;
-	size_t               save_len = 0, start_off = pos;
-	ssize_t              n;
-
-	i = 0;
-	if (pos) {
-		for (; i < buf->stat.usage.used; i++) {
-			if (iov[i].iov_len > start_off) {
-				start_idx = i;
-				save_base = iov[i].iov_base;
-				save_len  = iov[i].iov_len;
-				iov[i].iov_base += start_off;
-				iov[i].iov_len -= start_off;
-				break;
-			}
-			start_off -= iov[i].iov_len;
-		}
+	struct iovec *              iov         = buf->mem;
+	struct buffer_write_cursor *cursor      = &buf->write_cursor;
+	MSG_SIZE_PREFIX_TYPE        size_prefix = 0;
+	size_t                      i, idx, off, count;
+	void *                      save_base;
+	size_t                      save_len;
+	ssize_t                     n;
+
+	if (pos && pos == cursor->pos && cursor->idx < buf->stat.usage.used) {
+		/* continue where the previous write stopped without walking the vector again */
+		idx = cursor->idx;
+		off = cursor->off;
+	} else {
+		for (idx = 0, off = pos; idx < buf->stat.usage.used && iov[idx].iov_len <= off; idx++)
+			off -= iov[idx].iov_len;
 	}
-	if (i == buf->stat.usage.used) {
-		if (start_off == 0)
+
+	if (idx == buf->stat.usage.used) {
+		if (off == 0)
 			return -ENODATA;
 		else
 			return -ERANGE;
@@ -332,31 +350,54 @@ ssize_t _buffer_vector_write(struct buffer *buf, int fd, size_t pos)
 		*((MSG_SIZE_PREFIX_TYPE *) iov[0].iov_base) = size_prefix;
 	}
 
+	/* the rest is written with the next call(s) */
+	if ((count = buf->stat.usage.used - idx) > IOV_MAX)
+		count = IOV_MAX;
+
+	save_base = iov[idx].iov_base;
+	save_len  = iov[idx].iov_len;
+	iov[idx].iov_base += off;
+	iov[idx].iov_len -= off;
+
 	/*
 	 * Be aware that if we have BUFFER_BACKEND_MEMFD, we still have
 	 * to use writev and not the sendfile. This is because the buf->fd
 	 * only represents the memfd that stores the vector itself, but not
 	 * the contents of the memory that each iov.base points to!
 	 */
-	n = writev(fd, &iov[start_idx], buf->stat.usage.used - start_idx);
-	if (pos) {
-		iov[start_idx].iov_base = save_base;
-		iov[start_idx].iov_len  = save_len;
-	}
+	n = writev(fd, &iov[idx], count);
+
+	iov[idx].iov_base = save_base;
+	iov[idx].iov_len  = save_len;
+
 	if (n < 0)
-		n = -errno;
+		return -errno;
+
+	for (off += n; idx < buf->stat.usage.used && iov[idx].iov_len <= off; idx++)
+		off -= iov[idx].iov_len;
+
+	cursor->pos = pos + n;
+	cursor->idx = idx;
+	cursor->off = off;
 
 	return n;
 }
 
+ssize_t _buffer_vector_take(struct buffer *buf, void *data, size_t size)
+{
+	return -ENOTSUP;
+}
+
 const struct buffer_type buffer_type_vector = {.create      = _buffer_vector_create,
                                                .destroy     = _buffer_vector_destroy,
                                                .reset       = _buffer_vector_reset,
                                                .add         = _buffer_vector_add,
                                                .fmt_add     = _buffer_vector_fmt_add,
+                                               .join_add    = _buffer_vector_join_add,
                                                .rewind      = _buffer_vector_rewind,
                                                .rewind_mem  = _buffer_vector_rewind_mem,
                                                .is_complete = _buffer_vector_is_complete,
                                                .get_data    = _buffer_vector_get_data,
                                                .read        = _buffer_vector_read,
-                                               .write       = _buffer_vector_write};
+                                               .write       = _buffer_vector_write,
+                                               .take        = _buffer_vector_take};
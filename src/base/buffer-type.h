@@ -24,27 +24,43 @@
 
 #include <sys/types.h>
 
+/*
+ * Position after the last partial write so that the next write continuing
+ * at that position does not need to look it up again (used by vector buffer).
+ */
+struct buffer_write_cursor {
+	size_t pos; /* position in bytes, 0 if not set */
+	size_t idx; /* item at the position */
+	size_t off; /* offset within the item */
+};
+
 struct buffer {
-	struct buffer_stat stat;
-	void *             mem;
-	int                fd;
+	struct buffer_stat         stat;
+	void *                     mem;
+	int                        fd;
+	struct buffer_write_cursor write_cursor;
 };
 
+size_t buffer_get_grown_size(struct buffer *buf, size_t needed);
+
 struct buffer_type {
 	int (*create)(struct buffer *buf);
 	int (*destroy)(struct buffer *buf);
 	int (*reset)(struct buffer *buf);
 	const void *(*add)(struct buffer *buf, void *data, size_t len, int *ret_code);
 	const void *(*fmt_add)(struct buffer *buf, int *ret_code, const char *fmt, va_list ap);
+	const void *(*join_add)(struct buffer *buf, int *ret_code, const char *sep, const struct buffer_str *parts, size_t count);
 	int (*rewind)(struct buffer *buf, size_t pos);
 	int (*rewind_mem)(struct buffer *buf, const void *mem);
 	bool (*is_complete)(struct buffer *buf, int *ret_code);
 	int (*get_data)(struct buffer *buf, const void **data, size_t *data_size);
 	ssize_t (*read)(struct buffer *buf, int fd);
 	ssize_t (*write)(struct buffer *buf, int fd, size_t pos);
+	ssize_t (*take)(struct buffer *buf, void *data, size_t size);
 };
 
 extern const struct buffer_type buffer_type_linear;
 extern const struct buffer_type buffer_type_vector;
+extern const struct buffer_type buffer_type_ring;
 
 #endif
@@ -17,15 +17,23 @@
  * along with SID.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "base/common.h"
+
 #include "base/buffer.h"
 
 #include "base/mem.h"
 #include "buffer-type.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BUFFER_FD_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
 
-static const struct buffer_type *_buffer_type_registry[] =
-	{[BUFFER_TYPE_LINEAR] = &buffer_type_linear, [BUFFER_TYPE_VECTOR] = &buffer_type_vector};
+static const struct buffer_type *_buffer_type_registry[] = {[BUFFER_TYPE_LINEAR] = &buffer_type_linear,
+                                                            [BUFFER_TYPE_VECTOR] = &buffer_type_vector,
+                                                            [BUFFER_TYPE_RING]   = &buffer_type_ring};
 
 static bool _check_buf(struct buffer *buf)
 {
@@ -55,8 +63,9 @@ struct buffer *buffer_create(struct buffer_spec *spec, struct buffer_init *init,
 		.usage = (struct buffer_usage) {0},
 	};
 
-	buf->mem = NULL;
-	buf->fd  = -1;
+	buf->mem          = NULL;
+	buf->fd           = -1;
+	buf->write_cursor = (struct buffer_write_cursor) {0};
 
 	if (!_check_buf(buf)) {
 		r = -EINVAL;
@@ -99,6 +108,17 @@ int buffer_reset(struct buffer *buf)
 	return _buffer_type_registry[buf->stat.spec.type]->reset(buf);
 }
 
+int buffer_clear(struct buffer *buf)
+{
+	/* ring state is in its memory, reset does not reallocate anything */
+	if (buf->stat.spec.type == BUFFER_TYPE_RING)
+		return buffer_reset(buf);
+
+	buf->stat.usage.used = 0;
+	buf->write_cursor    = (struct buffer_write_cursor) {0};
+	return 0;
+}
+
 const void *buffer_add(struct buffer *buf, void *data, size_t len, int *ret_code)
 {
 	if (!data) {
@@ -127,6 +147,16 @@ const void *buffer_vfmt_add(struct buffer *buf, int *ret_code, const char *fmt,
 	return _buffer_type_registry[buf->stat.spec.type]->fmt_add(buf, ret_code, fmt, ap);
 }
 
+const void *buffer_join_add(struct buffer *buf, int *ret_code, const char *sep, const struct buffer_str *parts, size_t count)
+{
+	return _buffer_type_registry[buf->stat.spec.type]->join_add(buf, ret_code, sep, parts, count);
+}
+
+ssize_t buffer_take(struct buffer *buf, void *data, size_t size)
+{
+	return _buffer_type_registry[buf->stat.spec.type]->take(buf, data, size);
+}
+
 int buffer_rewind(struct buffer *buf, size_t pos, buffer_pos_t whence)
 {
 	if (whence == BUFFER_POS_REL) {
@@ -162,6 +192,95 @@ int buffer_get_fd(struct buffer *buf)
 	return buf->fd;
 }
 
+/*
+ * Take over the memfd of linear buffer with BUFFER_BACKEND_MEMFD, the data are already there.
+ */
+static int _take_linear_memfd(struct buffer *buf)
+{
+	int fd, r;
+
+	if (buf->stat.spec.mode == BUFFER_MODE_SIZE_PREFIX && buf->stat.usage.used)
+		*((MSG_SIZE_PREFIX_TYPE *) buf->mem) = (MSG_SIZE_PREFIX_TYPE) buf->stat.usage.used;
+
+	/* writable shared mapping would prevent F_SEAL_WRITE */
+	if (buf->mem && munmap(buf->mem, buf->stat.usage.allocated) < 0)
+		return -errno;
+
+	if (ftruncate(buf->fd, buf->stat.usage.used) < 0) {
+		r = -errno;
+		(void) close(buf->fd);
+		fd = r;
+	} else
+		fd = buf->fd;
+
+	buf->mem                  = NULL;
+	buf->fd                   = -1;
+	buf->stat.usage.allocated = 0;
+
+	return fd;
+}
+
+/*
+ * Gather the data referenced by the buffer into a new memfd.
+ */
+static int _copy_to_memfd(struct buffer *buf)
+{
+	int fd, r;
+
+	if ((fd = memfd_create("buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return -errno;
+
+	if ((r = buffer_write_all(buf, fd)) < 0) {
+		(void) close(fd);
+		return r;
+	}
+
+	return fd;
+}
+
+/*
+ * Detach buffer content as sealed memfd so it can be passed to another process.
+ *
+ * The file contains the same data as buffer_write would write, including the size
+ * prefix if the buffer has one. For linear buffer with BUFFER_BACKEND_MEMFD, the
+ * buffer memory is handed over as it is, otherwise the data are gathered into a new
+ * memfd. Either way, the buffer is empty afterwards and it can be used again.
+ *
+ * Returns the file descriptor which the caller is then responsible to close.
+ */
+int buffer_detach_fd(struct buffer *buf)
+{
+	int fd, r;
+
+	if (buf->stat.spec.backend == BUFFER_BACKEND_MEMFD && buf->stat.spec.type == BUFFER_TYPE_LINEAR && buf->fd >= 0) {
+		fd = _take_linear_memfd(buf);
+
+		/* the buffer lost its memory, recreate it so it can be used again */
+		if (buf->fd < 0) {
+			buf->stat.usage.used = 0;
+			buf->write_cursor    = (struct buffer_write_cursor) {0};
+
+			if ((r = _buffer_type_registry[buf->stat.spec.type]->create(buf)) < 0) {
+				if (fd >= 0)
+					(void) close(fd);
+				return r;
+			}
+		}
+	} else if ((fd = _copy_to_memfd(buf)) >= 0)
+		(void) buffer_clear(buf);
+
+	if (fd < 0)
+		return fd;
+
+	if (fcntl(fd, F_ADD_SEALS, BUFFER_FD_SEALS) < 0) {
+		r = -errno;
+		(void) close(fd);
+		return r;
+	}
+
+	return fd;
+}
+
 ssize_t buffer_read(struct buffer *buf, int fd)
 {
 	return _buffer_type_registry[buf->stat.spec.type]->read(buf, fd);
@@ -172,6 +291,26 @@ ssize_t buffer_write(struct buffer *buf, int fd, size_t pos)
 	return _buffer_type_registry[buf->stat.spec.type]->write(buf, fd, pos);
 }
 
+/*
+ * Get the size to grow the buffer to if it needs at least 'needed' - for a buffer
+ * with alloc_factor, this is the current size multiplied by the factor, if bigger,
+ * and capped at the limit. The result is not aligned to alloc_step yet.
+ */
+size_t buffer_get_grown_size(struct buffer *buf, size_t needed)
+{
+	size_t grown;
+
+	if (buf->stat.init.alloc_factor <= 1 || buf->stat.usage.allocated > SIZE_MAX / buf->stat.init.alloc_factor)
+		return needed;
+
+	grown = buf->stat.usage.allocated * buf->stat.init.alloc_factor;
+
+	if (buf->stat.init.limit && grown > buf->stat.init.limit)
+		grown = buf->stat.init.limit;
+
+	return grown > needed ? grown : needed;
+}
+
 struct buffer_stat buffer_stat(struct buffer *buf)
 {
 	return buf->stat;
@@ -17,10 +17,17 @@
  * along with SID.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "base/common.h"
+
 #include "base/comms.h"
 
+#include "base/mem.h"
+
 #include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -105,30 +112,64 @@ fail:
 	return r;
 }
 
-static ssize_t _do_comms_unix_send(int socket_fd, struct iovec *iov, size_t iov_len, int fd_to_send)
+/*
+ * Attach fds as SCM_RIGHTS to msg. The control buffer must be at least
+ * CMSG_SPACE(fd_count * sizeof(int)) bytes big and properly aligned.
+ */
+static void _set_msg_fds(struct msghdr *msg, void *control, const int *fds, unsigned fd_count)
+{
+	struct cmsghdr *cmsg;
+
+	if (!fd_count)
+		return;
+
+	msg->msg_control    = control;
+	msg->msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+	cmsg                = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level    = SOL_SOCKET;
+	cmsg->cmsg_type     = SCM_RIGHTS;
+	cmsg->cmsg_len      = CMSG_LEN(fd_count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+}
+
+/* Collect fds passed with received msg, at most *fd_count of them. */
+static void _get_msg_fds(struct msghdr *msg, int *fds, unsigned *fd_count)
 {
-	struct msghdr   msg = {0};
 	struct cmsghdr *cmsg;
+	unsigned        count = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (count > *fd_count)
+			count = *fd_count;
+
+		memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+		break;
+	}
+
+	*fd_count = count;
+}
+
+static ssize_t _do_comms_unix_send(int socket_fd, struct iovec *iov, size_t iov_len, const int *fds, unsigned fd_count)
+{
+	struct msghdr msg = {0};
 	union {
-		char           control[CMSG_SPACE(sizeof(int))];
+		char           control[CMSG_SPACE(COMMS_UNIX_FDS_MAX * sizeof(int))];
 		struct cmsghdr alignment;
 	} u = {0};
 	ssize_t r;
 
+	if (fd_count > COMMS_UNIX_FDS_MAX)
+		return -EINVAL;
+
 	msg.msg_iov    = iov;
 	msg.msg_iovlen = iov_len;
+	_set_msg_fds(&msg, u.control, fds, fd_count);
 
-	if (fd_to_send > -1) {
-		msg.msg_control    = u.control;
-		msg.msg_controllen = sizeof(u.control);
-		cmsg               = CMSG_FIRSTHDR(&msg);
-		cmsg->cmsg_level   = SOL_SOCKET;
-		cmsg->cmsg_type    = SCM_RIGHTS;
-		cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
-		memcpy(CMSG_DATA(cmsg), &fd_to_send, sizeof(int));
-	}
-
-	if ((r = sendmsg(socket_fd, &msg, 0) < 0))
+	if ((r = sendmsg(socket_fd, &msg, 0)) < 0)
 		return -errno;
 	else
 		return r;
@@ -138,20 +179,24 @@ ssize_t comms_unix_send(int socket_fd, void *buf, ssize_t buf_len, int fd_to_sen
 {
 	struct iovec iov = {.iov_base = buf, .iov_len = buf_len};
 
-	return _do_comms_unix_send(socket_fd, &iov, 1, fd_to_send);
+	return _do_comms_unix_send(socket_fd, &iov, 1, &fd_to_send, fd_to_send > -1 ? 1 : 0);
 }
 
 ssize_t comms_unix_send_iovec(int socket_fd, struct iovec *iov, size_t iov_len, int fd_to_send)
 {
-	return _do_comms_unix_send(socket_fd, iov, iov_len, fd_to_send);
+	return _do_comms_unix_send(socket_fd, iov, iov_len, &fd_to_send, fd_to_send > -1 ? 1 : 0);
 }
 
-static ssize_t _do_comms_unix_recv(int socket_fd, struct iovec *iov, size_t iov_len, int *fd_received)
+ssize_t comms_unix_send_fds(int socket_fd, struct iovec *iov, size_t iov_len, const int *fds, unsigned fd_count)
 {
-	struct msghdr   msg = {0};
-	struct cmsghdr *cmsg;
+	return _do_comms_unix_send(socket_fd, iov, iov_len, fds, fd_count);
+}
+
+static ssize_t _do_comms_unix_recv(int socket_fd, struct iovec *iov, size_t iov_len, int *fds, unsigned *fd_count)
+{
+	struct msghdr msg = {0};
 	union {
-		char           control[CMSG_SPACE(sizeof(int))];
+		char           control[CMSG_SPACE(COMMS_UNIX_FDS_MAX * sizeof(int))];
 		struct cmsghdr alignment;
 	} u;
 	ssize_t r;
@@ -159,28 +204,122 @@ static ssize_t _do_comms_unix_recv(int socket_fd, struct iovec *iov, size_t iov_
 	msg.msg_iov        = iov;
 	msg.msg_iovlen     = iov_len;
 	msg.msg_control    = u.control;
-	msg.msg_controllen = sizeof(u.control);
-
-	*fd_received = -1;
+	msg.msg_controllen = CMSG_SPACE((*fd_count < COMMS_UNIX_FDS_MAX ? *fd_count : COMMS_UNIX_FDS_MAX) * sizeof(int));
 
-	if ((r = recvmsg(socket_fd, &msg, 0)) < 0)
+	if ((r = recvmsg(socket_fd, &msg, 0)) < 0) {
+		*fd_count = 0;
 		return -errno;
+	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(int)) && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
-		memcpy(fd_received, CMSG_DATA(cmsg), sizeof(int));
-
+	_get_msg_fds(&msg, fds, fd_count);
 	return r;
 }
 
 ssize_t comms_unix_recv(int socket_fd, void *buf, ssize_t buf_len, int *fd_received)
 {
-	struct iovec iov = {.iov_base = buf, .iov_len = buf_len};
+	struct iovec iov      = {.iov_base = buf, .iov_len = buf_len};
+	unsigned     fd_count = 1;
 
-	return _do_comms_unix_recv(socket_fd, &iov, 1, fd_received);
+	*fd_received = -1;
+	return _do_comms_unix_recv(socket_fd, &iov, 1, fd_received, &fd_count);
 }
 
 ssize_t comms_unix_recv_iovec(int socket_fd, struct iovec *iov, size_t iov_len, int *fd_received)
 {
-	return _do_comms_unix_recv(socket_fd, iov, iov_len, fd_received);
+	unsigned fd_count = 1;
+
+	*fd_received = -1;
+	return _do_comms_unix_recv(socket_fd, iov, iov_len, fd_received, &fd_count);
+}
+
+ssize_t comms_unix_recv_fds(int socket_fd, struct iovec *iov, size_t iov_len, int *fds, unsigned *fd_count)
+{
+	return _do_comms_unix_recv(socket_fd, iov, iov_len, fds, fd_count);
+}
+
+/*
+ * Prepare mmsghdr array for msgs, including control buffers for fds, all in one allocation.
+ * For receive, control buffers are sized by the fd_count of each message.
+ */
+static struct mmsghdr *_create_mmsghdrs(struct comms_unix_msg *msgs, unsigned msg_count, bool send)
+{
+	struct mmsghdr *mmsgs;
+	size_t          control_size = 0;
+	char *          control;
+	unsigned        i;
+
+	for (i = 0; i < msg_count; i++) {
+		if (msgs[i].fd_count > COMMS_UNIX_FDS_MAX)
+			return NULL;
+		if (msgs[i].fd_count)
+			control_size += CMSG_SPACE(msgs[i].fd_count * sizeof(int));
+	}
+
+	if (!(mmsgs = mem_zalloc(msg_count * sizeof(struct mmsghdr) + control_size)))
+		return NULL;
+
+	control = (char *) (mmsgs + msg_count);
+
+	for (i = 0; i < msg_count; i++) {
+		mmsgs[i].msg_hdr.msg_iov    = msgs[i].iov;
+		mmsgs[i].msg_hdr.msg_iovlen = msgs[i].iov_len;
+
+		if (!msgs[i].fd_count)
+			continue;
+
+		if (send)
+			_set_msg_fds(&mmsgs[i].msg_hdr, control, msgs[i].fds, msgs[i].fd_count);
+		else {
+			mmsgs[i].msg_hdr.msg_control    = control;
+			mmsgs[i].msg_hdr.msg_controllen = CMSG_SPACE(msgs[i].fd_count * sizeof(int));
+		}
+
+		control += CMSG_SPACE(msgs[i].fd_count * sizeof(int));
+	}
+
+	return mmsgs;
+}
+
+int comms_unix_send_mmsg(int socket_fd, struct comms_unix_msg *msgs, unsigned msg_count)
+{
+	struct mmsghdr *mmsgs;
+	int             i, r;
+
+	if (!msg_count)
+		return 0;
+
+	if (!(mmsgs = _create_mmsghdrs(msgs, msg_count, true)))
+		return -ENOMEM;
+
+	if ((r = sendmmsg(socket_fd, mmsgs, msg_count, 0)) < 0)
+		r = -errno;
+
+	for (i = 0; i < r; i++)
+		msgs[i].len = mmsgs[i].msg_len;
+
+	free(mmsgs);
+	return r;
+}
+
+int comms_unix_recv_mmsg(int socket_fd, struct comms_unix_msg *msgs, unsigned msg_count)
+{
+	struct mmsghdr *mmsgs;
+	int             i, r;
+
+	if (!msg_count)
+		return 0;
+
+	if (!(mmsgs = _create_mmsghdrs(msgs, msg_count, false)))
+		return -ENOMEM;
+
+	if ((r = recvmmsg(socket_fd, mmsgs, msg_count, MSG_WAITFORONE, NULL)) < 0)
+		r = -errno;
+
+	for (i = 0; i < r; i++) {
+		msgs[i].len = mmsgs[i].msg_len;
+		_get_msg_fds(&mmsgs[i].msg_hdr, msgs[i].fds, &msgs[i].fd_count);
+	}
+
+	free(mmsgs);
+	return r;
 }
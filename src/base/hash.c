@@ -20,6 +20,7 @@
 
 #include "base/hash.h"
 
+#include "base/arena.h"
 #include "base/mem.h"
 
 #include <stdlib.h>
@@ -29,35 +30,47 @@ struct hash_node {
 	struct hash_node *next;
 	size_t            data_len;
 	void *            data;
+	uint64_t          hash;
 	unsigned          key_len;
 	char              key[];
 };
 
+/*
+ * Resizing is done incrementally. When a resize is started, current slots become
+ * 'old_slots' and new 'slots' array is allocated. Then, with each subsequent
+ * modifying operation, HASH_REHASH_STEP old slots are migrated to the new
+ * slots. A key is always stored either in old slots (if its old slot index
+ * is at least rehash_idx) or in the new slots, never in both.
+ *
+ * No migration is done on lookups or while iterating, so iterating over
+ * the table is stable as long as the table itself is not modified. If it is,
+ * the iteration must be enclosed in hash_rehash_pause and hash_rehash_resume
+ * so that entries are not moved past the iteration, see hash_get_next.
+ */
+#define HASH_REHASH_STEP 16u
+#define HASH_MAX_SLOTS   (1u << 31)
+
 struct hash_table {
 	unsigned           num_nodes;
 	unsigned           num_slots;
 	struct hash_node **slots;
+	unsigned           min_slots;
+	unsigned           old_num_slots;
+	struct hash_node **old_slots;
+	unsigned           rehash_idx;
+	unsigned           rehash_paused;
+	unsigned           grow_load;
+	unsigned           shrink_load;
+	struct arena *     arena;
 };
 
-/* Permutation of the Integers 0 through 255 */
-static unsigned char _nums[] = {
-	1,   14,  110, 25,  97,  174, 132, 119, 138, 170, 125, 118, 27,  233, 140, 51,  87,  197, 177, 107, 234, 169, 56,  68,
-	30,  7,   173, 73,  188, 40,  36,  65,  49,  213, 104, 190, 57,  211, 148, 223, 48,  115, 15,  2,   67,  186, 210, 28,
-	12,  181, 103, 70,  22,  58,  75,  78,  183, 167, 238, 157, 124, 147, 172, 144, 176, 161, 141, 86,  60,  66,  128, 83,
-	156, 241, 79,  46,  168, 198, 41,  254, 178, 85,  253, 237, 250, 154, 133, 88,  35,  206, 95,  116, 252, 192, 54,  221,
-	102, 218, 255, 240, 82,  106, 158, 201, 61,  3,   89,  9,   42,  155, 159, 93,  166, 80,  50,  34,  175, 195, 100, 99,
-	26,  150, 16,  145, 4,   33,  8,   189, 121, 64,  77,  72,  208, 245, 130, 122, 143, 55,  105, 134, 29,  164, 185, 194,
-	193, 239, 101, 242, 5,   171, 126, 11,  74,  59,  137, 228, 108, 191, 232, 139, 6,   24,  81,  20,  127, 17,  91,  92,
-	251, 151, 225, 207, 21,  98,  113, 112, 84,  226, 18,  214, 199, 187, 13,  32,  94,  220, 224, 212, 247, 204, 196, 43,
-	249, 236, 45,  244, 111, 182, 153, 136, 129, 90,  217, 202, 19,  165, 231, 71,  230, 142, 96,  227, 62,  179, 246, 114,
-	162, 53,  160, 215, 205, 180, 47,  109, 44,  38,  31,  149, 135, 0,   216, 52,  63,  23,  37,  69,  39,  117, 146, 184,
-	163, 200, 222, 235, 248, 243, 219, 10,  152, 131, 123, 229, 203, 76,  120, 209};
-
-static struct hash_node *_create_node(const char *key, unsigned key_len, void *data, size_t data_len)
+static struct hash_node *
+	_create_node(struct hash_table *t, const char *key, unsigned key_len, uint64_t hash, void *data, size_t data_len)
 {
-	struct hash_node *n = malloc(sizeof(*n) + key_len);
+	struct hash_node *n = t->arena ? arena_alloc(t->arena, sizeof(*n) + key_len) : malloc(sizeof(*n) + key_len);
 
 	if (n) {
+		n->hash    = hash;
 		n->key_len = key_len;
 		memcpy(n->key, key, key_len);
 		n->data_len = data_len;
@@ -67,42 +80,135 @@ static struct hash_node *_create_node(const char *key, unsigned key_len, void *d
 	return n;
 }
 
-static unsigned long _hash(const char *key, unsigned key_len)
+static void _free_node(struct hash_table *t, struct hash_node *n)
+{
+	/* nodes allocated from arena are released all at once together with the arena */
+	if (!t->arena)
+		free(n);
+}
+
+/*
+ * 64-bit hash reading the key a word at a time, modelled after wyhash.
+ *
+ * The full hash value is stored in each node so that we never need to rehash
+ * the key again when resizing and so that most non-matching nodes in a chain
+ * are rejected by comparing the hash value before comparing the keys themselves.
+ */
+#define HASH_SEED UINT64_C(0xa0761d6478bd642f)
+#define HASH_P1   UINT64_C(0xe7037ed1a0b428db)
+#define HASH_P2   UINT64_C(0x8ebc6af09c88c6e3)
+#define HASH_P3   UINT64_C(0x589965cc75374cc3)
+
+static uint64_t _mix(uint64_t a, uint64_t b)
 {
-	unsigned long h = 0, g;
-	unsigned      i;
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+
+	return (uint64_t) r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t) a;
+	uint64_t hb = b >> 32, lb = (uint32_t) b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t  = rl + (rm0 << 32);
+	uint64_t lo = t + (rm1 << 32);
+	uint64_t c  = (t < rl) + (lo < t);
+
+	return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static uint64_t _read64(const unsigned char *p)
+{
+	uint64_t v;
 
-	for (i = 0; i < key_len; i++) {
-		h <<= 4;
-		h += _nums[(unsigned char) *key++];
-		g = h & ((unsigned long) 0xf << 16u);
-		if (g) {
-			h ^= g >> 16u;
-			h ^= g >> 5u;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t _read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t _hash(const void *key, unsigned key_len)
+{
+	const unsigned char *p    = key;
+	unsigned             i    = key_len;
+	uint64_t             seed = HASH_SEED, seed1, seed2;
+	uint64_t             a, b;
+
+	if (i <= 16) {
+		if (i >= 4) {
+			a = (_read32(p) << 32) | _read32(p + ((i >> 3) << 2));
+			b = (_read32(p + i - 4) << 32) | _read32(p + i - 4 - ((i >> 3) << 2));
+		} else if (i > 0) {
+			a = ((uint64_t) p[0] << 16) | ((uint64_t) p[i >> 1] << 8) | p[i - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		if (i > 48) {
+			seed1 = seed2 = seed;
+			do {
+				seed  = _mix(_read64(p) ^ HASH_P1, _read64(p + 8) ^ seed);
+				seed1 = _mix(_read64(p + 16) ^ HASH_P2, _read64(p + 24) ^ seed1);
+				seed2 = _mix(_read64(p + 32) ^ HASH_P3, _read64(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= seed1 ^ seed2;
 		}
+
+		while (i > 16) {
+			seed = _mix(_read64(p) ^ HASH_P1, _read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		/* last 16 bytes, possibly overlapping with already processed ones */
+		a = _read64(p + i - 16);
+		b = _read64(p + i - 8);
 	}
 
-	return h;
+	return _mix(HASH_P1 ^ key_len, _mix(a ^ HASH_P1, b ^ seed));
 }
 
-struct hash_table *hash_create(unsigned size_hint)
+uint64_t hash_compute(const void *key, uint32_t key_len)
+{
+	return _hash(key, key_len);
+}
+
+struct hash_table *hash_create_with_params(unsigned size_hint, const struct hash_params *params)
 {
 	size_t             len;
 	unsigned           new_size = 16u;
-	struct hash_table *hc       = mem_zalloc(sizeof(*hc));
+	struct hash_table *hc;
+
+	/* keep shrink threshold well below grow threshold so there's no ping-pong between the two */
+	if (params && params->shrink_load && params->grow_load && params->shrink_load * 2 >= params->grow_load)
+		return NULL;
 
-	if (!hc)
+	if (!(hc = mem_zalloc(sizeof(*hc))))
 		return NULL;
 
 	/* round size hint up to a power of two */
-	while (new_size < size_hint)
+	while (new_size < size_hint && new_size < HASH_MAX_SLOTS)
 		new_size = new_size << 1;
 
-	hc->num_slots = new_size;
-	len           = sizeof(*(hc->slots)) * new_size;
+	hc->num_slots = hc->min_slots = new_size;
+	len                           = sizeof(*(hc->slots)) * new_size;
 	if (!(hc->slots = mem_zalloc(len)))
 		goto bad;
 
+	if (params) {
+		hc->grow_load   = params->grow_load;
+		hc->shrink_load = params->shrink_load;
+		hc->arena       = params->arena;
+	}
+
 	return hc;
 bad:
 	free(hc->slots);
@@ -110,32 +216,135 @@ bad:
 	return NULL;
 }
 
-static void _free_nodes(struct hash_table *t)
+struct hash_table *hash_create(unsigned size_hint)
+{
+	return hash_create_with_params(size_hint, NULL);
+}
+
+static void _free_slot_nodes(struct hash_node **slots, unsigned from, unsigned to)
 {
 	struct hash_node *c, *n;
 	unsigned          i;
 
-	for (i = 0; i < t->num_slots; i++)
-		for (c = t->slots[i]; c; c = n) {
+	for (i = from; i < to; i++)
+		for (c = slots[i]; c; c = n) {
 			n = c->next;
 			free(c);
 		}
 }
 
+static void _free_nodes(struct hash_table *t)
+{
+	/* no need to walk through the nodes if they're all in the arena */
+	if (t->arena)
+		return;
+
+	if (t->old_slots)
+		_free_slot_nodes(t->old_slots, t->rehash_idx, t->old_num_slots);
+
+	_free_slot_nodes(t->slots, 0, t->num_slots);
+}
+
+static void _end_rehash(struct hash_table *t)
+{
+	free(t->old_slots);
+	t->old_slots     = NULL;
+	t->old_num_slots = 0;
+	t->rehash_idx    = 0;
+}
+
 void hash_destroy(struct hash_table *t)
 {
 	_free_nodes(t);
+	_end_rehash(t);
 	free(t->slots);
 	free(t);
 }
 
-static struct hash_node **_find(struct hash_table *t, const void *key, uint32_t key_len)
+/*
+ * Get the slot where the key with hash 'h' is stored,
+ * taking into account any resize that is in progress.
+ */
+static struct hash_node **_get_slot(struct hash_table *t, uint64_t h)
+{
+	unsigned s;
+
+	if (t->old_slots && (s = h & (t->old_num_slots - 1)) >= t->rehash_idx)
+		return &t->old_slots[s];
+
+	return &t->slots[h & (t->num_slots - 1)];
+}
+
+static void _migrate_slot(struct hash_table *t, unsigned s)
+{
+	struct hash_node *c, *n, **tail;
+
+	for (c = t->old_slots[s]; c; c = n) {
+		n       = c->next;
+		c->next = NULL;
+
+		/* append so that the order of nodes with the same key is preserved */
+		for (tail = &t->slots[c->hash & (t->num_slots - 1)]; *tail; tail = &((*tail)->next))
+			;
+		*tail = c;
+	}
+
+	t->old_slots[s] = NULL;
+}
+
+static void _rehash_step(struct hash_table *t)
+{
+	unsigned i;
+
+	if (!t->old_slots || t->rehash_paused)
+		return;
+
+	for (i = 0; i < HASH_REHASH_STEP && t->rehash_idx < t->old_num_slots; i++, t->rehash_idx++)
+		_migrate_slot(t, t->rehash_idx);
+
+	if (t->rehash_idx == t->old_num_slots)
+		_end_rehash(t);
+}
+
+static void _start_rehash(struct hash_table *t, unsigned new_num_slots)
+{
+	struct hash_node **new_slots;
+
+	/*
+	 * Resizing is only an optimization - if we can't allocate
+	 * new slots, simply keep using the current ones.
+	 */
+	if (!(new_slots = mem_zalloc(sizeof(*new_slots) * new_num_slots)))
+		return;
+
+	t->old_slots     = t->slots;
+	t->old_num_slots = t->num_slots;
+	t->rehash_idx    = 0;
+	t->slots         = new_slots;
+	t->num_slots     = new_num_slots;
+
+	_rehash_step(t);
+}
+
+static void _check_resize(struct hash_table *t)
+{
+	if (t->old_slots || t->rehash_paused)
+		return;
+
+	if (t->grow_load && t->num_slots < HASH_MAX_SLOTS &&
+	    (uint64_t) t->num_nodes * 100 > (uint64_t) t->num_slots * t->grow_load)
+		_start_rehash(t, t->num_slots << 1);
+	else if (t->shrink_load && t->num_slots > t->min_slots &&
+	         (uint64_t) t->num_nodes * 100 < (uint64_t) t->num_slots * t->shrink_load)
+		_start_rehash(t, t->num_slots >> 1);
+}
+
+static struct hash_node **_find(struct hash_table *t, const void *key, uint32_t key_len, uint64_t h)
 {
-	unsigned           h = _hash(key, key_len) & (t->num_slots - 1);
 	struct hash_node **c;
 
-	for (c = &t->slots[h]; *c; c = &((*c)->next)) {
-		if ((*c)->key_len != key_len)
+	for (c = _get_slot(t, h); *c; c = &((*c)->next)) {
+		if ((*c)->hash != h || (*c)->key_len != key_len)
 			continue;
 
 		if (!memcmp(key, (*c)->key, key_len))
@@ -147,7 +356,7 @@ static struct hash_node **_find(struct hash_table *t, const void *key, uint32_t
 
 void *hash_lookup(struct hash_table *t, const void *key, uint32_t key_len, size_t *data_len)
 {
-	struct hash_node **c = _find(t, key, key_len);
+	struct hash_node **c = _find(t, key, key_len, _hash(key, key_len));
 
 	if (*c) {
 		if (data_len)
@@ -160,10 +369,15 @@ void *hash_lookup(struct hash_table *t, const void *key, uint32_t key_len, size_
 	return NULL;
 }
 
-static int
-	_do_hash_insert(struct hash_table *t, struct hash_node **c, const void *key, uint32_t key_len, void *data, size_t data_len)
+static int _do_hash_insert(struct hash_table *t,
+                           struct hash_node **c,
+                           const void *       key,
+                           uint32_t           key_len,
+                           uint64_t           h,
+                           void *             data,
+                           size_t             data_len)
 {
-	struct hash_node *n = _create_node(key, key_len, data, data_len);
+	struct hash_node *n = _create_node(t, key, key_len, h, data, data_len);
 
 	if (!n)
 		return -1;
@@ -176,43 +390,50 @@ static int
 	*c      = n;
 	t->num_nodes++;
 
+	_check_resize(t);
 	return 0;
 }
 
 int hash_insert(struct hash_table *t, const void *key, uint32_t key_len, void *data, size_t data_len)
 {
-	struct hash_node **c = _find(t, key, key_len);
+	uint64_t           h = _hash(key, key_len);
+	struct hash_node **c;
+
+	_rehash_step(t);
+	c = _find(t, key, key_len, h);
 
 	if (*c) {
 		(*c)->data = data;
 		return 0;
 	}
 
-	return _do_hash_insert(t, c, key, key_len, data, data_len);
+	return _do_hash_insert(t, c, key, key_len, h, data, data_len);
 }
 
 void hash_remove(struct hash_table *t, const void *key, uint32_t key_len)
 {
-	struct hash_node **c = _find(t, key, key_len);
+	struct hash_node **c;
+
+	_rehash_step(t);
+	c = _find(t, key, key_len, _hash(key, key_len));
 
 	if (*c) {
 		struct hash_node *old = *c;
 		*c                    = (*c)->next;
-		free(old);
+		_free_node(t, old);
 		t->num_nodes--;
+		_check_resize(t);
 	}
 }
 
 static struct hash_node **
 	_find_with_data(struct hash_table *t, const void *key, uint32_t key_len, const void *data, size_t data_len)
 {
+	uint64_t           h = _hash(key, key_len);
 	struct hash_node **c;
-	unsigned           h;
-
-	h = _hash(key, key_len) & (t->num_slots - 1);
 
-	for (c = &t->slots[h]; *c; c = &((*c)->next)) {
-		if ((*c)->key_len != key_len)
+	for (c = _get_slot(t, h); *c; c = &((*c)->next)) {
+		if ((*c)->hash != h || (*c)->key_len != key_len)
 			continue;
 
 		if (!memcmp(key, (*c)->key, key_len) && (*c)->data) {
@@ -226,25 +447,22 @@ static struct hash_node **
 
 int hash_insert_allow_multiple(struct hash_table *t, const char *key, uint32_t key_len, void *data, size_t data_len)
 {
-	struct hash_node *n;
-	struct hash_node *first;
-	unsigned          h;
+	uint64_t           h = _hash(key, key_len);
+	struct hash_node * n;
+	struct hash_node **slot;
 
-	n = _create_node(key, key_len, data, data_len);
+	n = _create_node(t, key, key_len, h, data, data_len);
 	if (!n)
 		return -1;
 
-	h = _hash(key, key_len) & (t->num_slots - 1);
+	_rehash_step(t);
+	slot = _get_slot(t, h);
 
-	first = t->slots[h];
-
-	if (first)
-		n->next = first;
-	else
-		n->next = 0;
-	t->slots[h] = n;
+	n->next = *slot;
+	*slot   = n;
 
 	t->num_nodes++;
+	_check_resize(t);
 	return 0;
 }
 
@@ -269,13 +487,15 @@ void hash_remove_with_data(struct hash_table *t, const char *key, uint32_t key_l
 {
 	struct hash_node **c;
 
+	_rehash_step(t);
 	c = _find_with_data(t, key, key_len, data, data_len);
 
 	if (c && *c) {
 		struct hash_node *old = *c;
 		*c                    = (*c)->next;
-		free(old);
+		_free_node(t, old);
 		t->num_nodes--;
+		_check_resize(t);
 	}
 }
 
@@ -296,14 +516,12 @@ void *hash_lookup_with_count(struct hash_table *t, const char *key, uint32_t key
 	struct hash_node **c;
 	struct hash_node **c1  = NULL;
 	uint32_t           len = strlen(key) + 1;
-	unsigned           h;
+	uint64_t           h   = _hash(key, len);
 
 	*count = 0;
 
-	h = _hash(key, len) & (t->num_slots - 1);
-
-	for (c = &t->slots[h]; *c; c = &((*c)->next)) {
-		if ((*c)->key_len != len)
+	for (c = _get_slot(t, h); *c; c = &((*c)->next)) {
+		if ((*c)->hash != h || (*c)->key_len != len)
 			continue;
 
 		if (!memcmp(key, (*c)->key, len)) {
@@ -329,21 +547,63 @@ unsigned hash_get_num_entries(struct hash_table *t)
 	return t->num_nodes;
 }
 
-void hash_iter(struct hash_table *t, hash_iterate_fn f)
+unsigned hash_get_num_slots(struct hash_table *t)
+{
+	return t->num_slots;
+}
+
+static unsigned _max_chain_len(struct hash_node **slots, unsigned from, unsigned to, unsigned max)
+{
+	struct hash_node *c;
+	unsigned          i, len;
+
+	for (i = from; i < to; i++) {
+		for (len = 0, c = slots[i]; c; c = c->next)
+			len++;
+		if (len > max)
+			max = len;
+	}
+
+	return max;
+}
+
+/*
+ * Walks all the slots so this is meant for statistics only, not for the hot path.
+ */
+unsigned hash_get_max_chain_len(struct hash_table *t)
+{
+	unsigned max = 0;
+
+	if (t->old_slots)
+		max = _max_chain_len(t->old_slots, t->rehash_idx, t->old_num_slots, max);
+
+	return _max_chain_len(t->slots, 0, t->num_slots, max);
+}
+
+static void _iter_slots(struct hash_node **slots, unsigned from, unsigned to, hash_iterate_fn f)
 {
 	struct hash_node *c, *n;
 	unsigned          i;
 
-	for (i = 0; i < t->num_slots; i++)
-		for (c = t->slots[i]; c; c = n) {
+	for (i = from; i < to; i++)
+		for (c = slots[i]; c; c = n) {
 			n = c->next;
 			f(c->data);
 		}
 }
 
+void hash_iter(struct hash_table *t, hash_iterate_fn f)
+{
+	if (t->old_slots)
+		_iter_slots(t->old_slots, t->rehash_idx, t->old_num_slots, f);
+
+	_iter_slots(t->slots, 0, t->num_slots, f);
+}
+
 void hash_wipe(struct hash_table *t)
 {
 	_free_nodes(t);
+	_end_rehash(t);
 	memset(t->slots, 0, sizeof(struct hash_node *) * t->num_slots);
 	t->num_nodes = 0u;
 }
@@ -364,11 +624,31 @@ void *hash_get_data(struct hash_table *t __attribute__((unused)), struct hash_no
 	return n->data;
 }
 
-static struct hash_node *_next_slot(struct hash_table *t, unsigned s)
+void hash_rehash_pause(struct hash_table *t)
+{
+	t->rehash_paused++;
+}
+
+void hash_rehash_resume(struct hash_table *t)
+{
+	if (t->rehash_paused)
+		t->rehash_paused--;
+}
+
+/*
+ * Iteration order is: old slots not yet migrated (if resize is in progress), then current slots.
+ * Migrating slots while iterating would move entries from old slots not visited yet to current
+ * slots already visited, or the other way round, see hash_rehash_pause.
+ */
+static struct hash_node *_next_slot(struct hash_table *t, unsigned old_s, unsigned s)
 {
 	struct hash_node *c = NULL;
 	unsigned          i;
 
+	if (t->old_slots)
+		for (i = old_s; i < t->old_num_slots && !c; i++)
+			c = t->old_slots[i];
+
 	for (i = s; i < t->num_slots && !c; i++)
 		c = t->slots[i];
 
@@ -377,14 +657,20 @@ static struct hash_node *_next_slot(struct hash_table *t, unsigned s)
 
 struct hash_node *hash_get_first(struct hash_table *t)
 {
-	return _next_slot(t, 0);
+	return _next_slot(t, t->rehash_idx, 0);
 }
 
 struct hash_node *hash_get_next(struct hash_table *t, struct hash_node *n)
 {
-	unsigned h = _hash(n->key, n->key_len) & (t->num_slots - 1);
+	unsigned s;
+
+	if (n->next)
+		return n->next;
 
-	return n->next ? n->next : _next_slot(t, h + 1);
+	if (t->old_slots && (s = n->hash & (t->old_num_slots - 1)) >= t->rehash_idx)
+		return _next_slot(t, s + 1, 0);
+
+	return _next_slot(t, t->old_num_slots, (n->hash & (t->num_slots - 1)) + 1);
 }
 
 int hash_update(struct hash_table *t,
@@ -395,22 +681,47 @@ int hash_update(struct hash_table *t,
                 hash_update_fn_t   hash_update_fn,
                 void *             hash_update_fn_arg)
 {
-	struct hash_node **c = _find(t, key, key_len);
+	uint64_t           h = _hash(key, key_len);
+	struct hash_node **c;
+	int                update;
+
+	_rehash_step(t);
+	c = _find(t, key, key_len, h);
 
 	/*
 	 * the hash_update_fn may add nodes to the hash table, but it must not
 	 * add this key to the hash table or remove any nodes.
+	 *
+	 * Rehashing is paused while hash_update_fn runs so that 'c' stays valid.
 	 */
 	if (*c) {
-		if (!hash_update_fn ||
-		    hash_update_fn(key, key_len, (*c)->data, (*c)->data_len, data, data_len, hash_update_fn_arg)) {
+		t->rehash_paused++;
+		update = hash_update_fn ? hash_update_fn(key, key_len, (*c)->data, (*c)->data_len, data, data_len, hash_update_fn_arg)
+		                        : HASH_UPDATE_SET;
+		t->rehash_paused--;
+
+		if (update == HASH_UPDATE_SET) {
 			(*c)->data     = data ? *data : NULL;
 			(*c)->data_len = data_len ? *data_len : 0;
+		} else if (update == HASH_UPDATE_REMOVE) {
+			struct hash_node *old = *c;
+			*c                    = (*c)->next;
+			_free_node(t, old);
+			t->num_nodes--;
 		}
+
+		_check_resize(t);
 		return 0;
 	} else {
-		if (!hash_update_fn || hash_update_fn(key, key_len, NULL, 0, data, data_len, hash_update_fn_arg))
-			return _do_hash_insert(t, c, key, key_len, data ? *data : NULL, data_len ? *data_len : 0);
+		t->rehash_paused++;
+		update = hash_update_fn ? hash_update_fn(key, key_len, NULL, 0, data, data_len, hash_update_fn_arg)
+		                        : HASH_UPDATE_SET;
+		t->rehash_paused--;
+
+		if (update == HASH_UPDATE_SET)
+			return _do_hash_insert(t, c, key, key_len, h, data ? *data : NULL, data_len ? *data_len : 0);
+
+		_check_resize(t);
 	}
 
 	return 0;
@@ -0,0 +1,601 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/radix.h"
+
+#include "base/mem.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Each node stores the full key from the root down to the node itself. The part of
+ * the key that is specific to the node starts at parent's key_len. Storing the full
+ * key makes it possible to return the key for any node directly and it also makes
+ * splicing out a node simple, because the child does not need to change its key.
+ *
+ * Children are kept in an array sorted by the first byte following parent's key.
+ */
+struct radix_node {
+	struct radix_node * parent;
+	struct radix_node **children;
+	unsigned            child_count;
+	unsigned            child_slots;
+	bool                has_data;
+	size_t              data_len;
+	void *              data;
+	unsigned            key_len;
+	char                key[];
+};
+
+struct radix_tree {
+	unsigned           num_entries;
+	struct radix_node *root;
+};
+
+static struct radix_node *_create_node(const char *key, unsigned key_len)
+{
+	struct radix_node *n = mem_zalloc(sizeof(*n) + key_len);
+
+	if (n) {
+		n->key_len = key_len;
+		memcpy(n->key, key, key_len);
+	}
+
+	return n;
+}
+
+static void _free_node(struct radix_node *n)
+{
+	unsigned i;
+
+	for (i = 0; i < n->child_count; i++)
+		_free_node(n->children[i]);
+
+	free(n->children);
+	free(n);
+}
+
+/*
+ * Find index of the child of 'n' which is branching with byte 'c'.
+ * If there's no such child, return the index where the child would be inserted.
+ */
+static unsigned _get_child_idx(struct radix_node *n, unsigned char c, bool *found)
+{
+	unsigned      lo = 0, hi = n->child_count, mid;
+	unsigned char mid_c;
+
+	while (lo < hi) {
+		mid   = (lo + hi) / 2;
+		mid_c = n->children[mid]->key[n->key_len];
+
+		if (mid_c == c) {
+			*found = true;
+			return mid;
+		}
+
+		if (mid_c < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = false;
+	return lo;
+}
+
+static int _add_child(struct radix_node *n, unsigned idx, struct radix_node *child)
+{
+	struct radix_node **children;
+	unsigned            slots;
+
+	if (n->child_count == n->child_slots) {
+		slots = n->child_slots ? n->child_slots * 2 : 2;
+
+		if (!(children = realloc(n->children, slots * sizeof(*children))))
+			return -ENOMEM;
+
+		n->children    = children;
+		n->child_slots = slots;
+	}
+
+	memmove(&n->children[idx + 1], &n->children[idx], (n->child_count - idx) * sizeof(*n->children));
+	n->children[idx] = child;
+	n->child_count++;
+	child->parent = n;
+
+	return 0;
+}
+
+static void _del_child(struct radix_node *n, unsigned idx)
+{
+	memmove(&n->children[idx], &n->children[idx + 1], (n->child_count - idx - 1) * sizeof(*n->children));
+	n->child_count--;
+}
+
+static struct radix_node *_find(struct radix_tree *t, const char *key, unsigned key_len)
+{
+	struct radix_node *n = t->root, *c;
+	unsigned           idx;
+	bool               found;
+
+	while (n->key_len < key_len) {
+		idx = _get_child_idx(n, key[n->key_len], &found);
+		if (!found)
+			return NULL;
+
+		c = n->children[idx];
+
+		if (c->key_len > key_len || memcmp(c->key + n->key_len, key + n->key_len, c->key_len - n->key_len))
+			return NULL;
+
+		n = c;
+	}
+
+	return n->has_data ? n : NULL;
+}
+
+/*
+ * Find the topmost node with key starting with given prefix.
+ * All nodes with that prefix are then in the subtree of this node.
+ */
+static struct radix_node *_find_prefix(struct radix_tree *t, const char *prefix, unsigned prefix_len)
+{
+	struct radix_node *n = t->root, *c;
+	unsigned           idx, len;
+	bool               found;
+
+	while (n->key_len < prefix_len) {
+		idx = _get_child_idx(n, prefix[n->key_len], &found);
+		if (!found)
+			return NULL;
+
+		c   = n->children[idx];
+		len = c->key_len < prefix_len ? c->key_len : prefix_len;
+
+		if (memcmp(c->key + n->key_len, prefix + n->key_len, len - n->key_len))
+			return NULL;
+
+		n = c;
+	}
+
+	return n;
+}
+
+/*
+ * Get node for the key, create the node if it does not exist yet.
+ */
+static struct radix_node *_get_node(struct radix_tree *t, const char *key, unsigned key_len)
+{
+	struct radix_node *n = t->root, *c, *m;
+	unsigned           idx, len, common;
+	bool               found;
+
+	while (n->key_len < key_len) {
+		idx = _get_child_idx(n, key[n->key_len], &found);
+
+		if (!found) {
+			if (!(c = _create_node(key, key_len)))
+				return NULL;
+
+			if (_add_child(n, idx, c) < 0) {
+				free(c);
+				return NULL;
+			}
+
+			return c;
+		}
+
+		c      = n->children[idx];
+		len    = c->key_len < key_len ? c->key_len : key_len;
+		common = n->key_len + 1;
+
+		while (common < len && c->key[common] == key[common])
+			common++;
+
+		if (common == c->key_len) {
+			n = c;
+			continue;
+		}
+
+		/* split: insert new node with the common part of the keys between n and c */
+		if (!(m = _create_node(key, common)))
+			return NULL;
+
+		if (_add_child(m, 0, c) < 0) {
+			free(m);
+			return NULL;
+		}
+
+		n->children[idx] = m;
+		m->parent        = n;
+		n                = m;
+	}
+
+	return n;
+}
+
+/*
+ * Remove nodes without data which have at most one child.
+ */
+static void _prune(struct radix_tree *t, struct radix_node *n)
+{
+	struct radix_node *p;
+	unsigned           idx;
+	bool               found;
+
+	while (n != t->root && !n->has_data && n->child_count <= 1) {
+		p   = n->parent;
+		idx = _get_child_idx(p, n->key[p->key_len], &found);
+
+		if (n->child_count) {
+			/* the child has full key stored so it can be attached directly to the parent */
+			p->children[idx]         = n->children[0];
+			p->children[idx]->parent = p;
+		} else
+			_del_child(p, idx);
+
+		free(n->children);
+		free(n);
+		n = p;
+	}
+}
+
+struct radix_tree *radix_create(void)
+{
+	struct radix_tree *t;
+
+	if (!(t = mem_zalloc(sizeof(*t))))
+		return NULL;
+
+	if (!(t->root = _create_node("", 0))) {
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void radix_destroy(struct radix_tree *t)
+{
+	_free_node(t->root);
+	free(t);
+}
+
+static int _do_radix_insert(struct radix_tree *t, const void *key, uint32_t key_len, void *data, size_t data_len)
+{
+	struct radix_node *n;
+
+	if (!(n = _get_node(t, key, key_len)))
+		return -1;
+
+	if (!n->has_data) {
+		n->has_data = true;
+		t->num_entries++;
+	}
+
+	n->data     = data;
+	n->data_len = data_len;
+
+	return 0;
+}
+
+int radix_insert(struct radix_tree *t, const void *key, uint32_t key_len, void *data, size_t data_len)
+{
+	return _do_radix_insert(t, key, key_len, data, data_len);
+}
+
+void *radix_lookup(struct radix_tree *t, const void *key, uint32_t key_len, size_t *data_len)
+{
+	struct radix_node *n = _find(t, key, key_len);
+
+	if (n) {
+		if (data_len)
+			*data_len = n->data_len;
+		return n->data;
+	}
+
+	if (data_len)
+		*data_len = 0;
+	return NULL;
+}
+
+static void _do_radix_remove(struct radix_tree *t, struct radix_node *n)
+{
+	n->has_data = false;
+	n->data     = NULL;
+	n->data_len = 0;
+	t->num_entries--;
+	_prune(t, n);
+}
+
+void radix_remove(struct radix_tree *t, const void *key, uint32_t key_len)
+{
+	struct radix_node *n = _find(t, key, key_len);
+
+	if (n)
+		_do_radix_remove(t, n);
+}
+
+int radix_update(struct radix_tree *t,
+                 const void *       key,
+                 uint32_t           key_len,
+                 void **            data,
+                 size_t *           data_len,
+                 radix_update_fn_t  radix_update_fn,
+                 void *             radix_update_fn_arg)
+{
+	struct radix_node *n = _find(t, key, key_len);
+	int                update;
+
+	/*
+	 * The radix_update_fn may add nodes to the tree and split existing ones,
+	 * but the node found here is never moved or freed by that.
+	 */
+	if (n) {
+		update = radix_update_fn ? radix_update_fn(key, key_len, n->data, n->data_len, data, data_len, radix_update_fn_arg)
+		                         : RADIX_UPDATE_SET;
+
+		if (update == RADIX_UPDATE_SET) {
+			n->data     = data ? *data : NULL;
+			n->data_len = data_len ? *data_len : 0;
+		} else if (update == RADIX_UPDATE_REMOVE)
+			_do_radix_remove(t, n);
+
+		return 0;
+	} else {
+		update = radix_update_fn ? radix_update_fn(key, key_len, NULL, 0, data, data_len, radix_update_fn_arg)
+		                         : RADIX_UPDATE_SET;
+
+		if (update == RADIX_UPDATE_SET)
+			return _do_radix_insert(t, key, key_len, data ? *data : NULL, data_len ? *data_len : 0);
+	}
+
+	return 0;
+}
+
+unsigned radix_get_num_entries(struct radix_tree *t)
+{
+	return t->num_entries;
+}
+
+static void _get_shape(struct radix_node *n, unsigned depth, unsigned *nodes, unsigned *depth_max)
+{
+	unsigned i;
+
+	(*nodes)++;
+
+	if (depth > *depth_max)
+		*depth_max = depth;
+
+	for (i = 0; i < n->child_count; i++)
+		_get_shape(n->children[i], depth + 1, nodes, depth_max);
+}
+
+void radix_get_shape(struct radix_tree *t, unsigned *nodes, unsigned *depth_max)
+{
+	*nodes     = 0;
+	*depth_max = 0;
+
+	_get_shape(t->root, 0, nodes, depth_max);
+}
+
+/*
+ * Get next node in pre-order following the whole subtree of node 'n'.
+ */
+static struct radix_node *_skip_subtree(struct radix_tree *t, struct radix_node *n)
+{
+	struct radix_node *p;
+	unsigned           idx;
+	bool               found;
+
+	while (n != t->root) {
+		p   = n->parent;
+		idx = _get_child_idx(p, n->key[p->key_len], &found);
+
+		if (idx + 1 < p->child_count)
+			return p->children[idx + 1];
+
+		n = p;
+	}
+
+	return NULL;
+}
+
+/*
+ * Get next node in pre-order, that is, in key order.
+ */
+static struct radix_node *_next_node(struct radix_tree *t, struct radix_node *n)
+{
+	if (n->child_count)
+		return n->children[0];
+
+	return _skip_subtree(t, n);
+}
+
+static struct radix_node *_first_with_data(struct radix_tree *t, struct radix_node *n)
+{
+	while (n && !n->has_data)
+		n = _next_node(t, n);
+
+	return n;
+}
+
+/*
+ * Find the first node with data which has its key greater than the given key.
+ * The key itself does not need to be stored in the tree.
+ */
+static struct radix_node *_upper_bound(struct radix_tree *t, const char *key, unsigned key_len)
+{
+	struct radix_node *n = t->root, *c;
+	unsigned           idx, len, i;
+	bool               found;
+
+	/* key of node 'n' is always a prefix of the 'key' here */
+	while (n->key_len < key_len) {
+		idx = _get_child_idx(n, key[n->key_len], &found);
+
+		if (!found)
+			return _first_with_data(t, idx < n->child_count ? n->children[idx] : _skip_subtree(t, n));
+
+		c   = n->children[idx];
+		len = c->key_len < key_len ? c->key_len : key_len;
+
+		for (i = n->key_len + 1; i < len && c->key[i] == key[i]; i++)
+			;
+
+		if (i == len) {
+			if (c->key_len > key_len)
+				/* key is a prefix of c's key so the whole c's subtree is greater */
+				return _first_with_data(t, c);
+			n = c;
+			continue;
+		}
+
+		if ((unsigned char) c->key[i] < (unsigned char) key[i])
+			return _first_with_data(t, _skip_subtree(t, c));
+
+		return _first_with_data(t, c);
+	}
+
+	/* the 'key' equals to n's key, so get the first one after it */
+	return _first_with_data(t, _next_node(t, n));
+}
+
+void radix_iter(struct radix_tree *t, radix_iterate_fn f)
+{
+	struct radix_node *n;
+
+	for (n = t->root; n; n = _next_node(t, n))
+		if (n->has_data)
+			f(n->data);
+}
+
+struct radix_node *radix_get_next(struct radix_tree *t, struct radix_node *n, const void *prefix, uint32_t prefix_len)
+{
+	/*
+	 * All nodes with the prefix form a contiguous sequence in key order,
+	 * so we can stop as soon as we hit the first node without the prefix.
+	 */
+	do {
+		if (!(n = _next_node(t, n)))
+			return NULL;
+
+		if (prefix && (n->key_len < prefix_len || memcmp(n->key, prefix, prefix_len)))
+			return NULL;
+	} while (!n->has_data);
+
+	return n;
+}
+
+struct radix_node *radix_get_next_after(struct radix_tree *t,
+                                        const void *       key,
+                                        uint32_t           key_len,
+                                        const void *       prefix,
+                                        uint32_t           prefix_len)
+{
+	struct radix_node *n;
+
+	if (!(n = _upper_bound(t, key, key_len)))
+		return NULL;
+
+	if (prefix && (n->key_len < prefix_len || memcmp(n->key, prefix, prefix_len)))
+		return NULL;
+
+	return n;
+}
+
+struct radix_node *radix_get_first(struct radix_tree *t, const void *prefix, uint32_t prefix_len)
+{
+	struct radix_node *n;
+
+	if (prefix) {
+		if (!(n = _find_prefix(t, prefix, prefix_len)))
+			return NULL;
+	} else
+		n = t->root;
+
+	return n->has_data ? n : radix_get_next(t, n, prefix, prefix_len);
+}
+
+char *radix_get_key(struct radix_tree *t __attribute__((unused)), struct radix_node *n, uint32_t *key_len)
+{
+	if (key_len)
+		*key_len = n->key_len;
+
+	return n->key;
+}
+
+void *radix_get_data(struct radix_tree *t __attribute__((unused)), struct radix_node *n, size_t *data_len)
+{
+	if (data_len)
+		*data_len = n->data_len;
+
+	return n->data;
+}
+
+static struct radix_node *_repack_node(struct radix_tree *t, struct radix_node *n)
+{
+	struct radix_node * m;
+	struct radix_node **children = NULL;
+	unsigned            idx, i;
+	bool                found;
+
+	/* repacking is only an optimization - if we can't allocate, simply keep the node where it is */
+	if (!(m = malloc(sizeof(*m) + n->key_len)))
+		return n;
+
+	if (n->child_count && !(children = malloc(n->child_count * sizeof(*children)))) {
+		free(m);
+		return n;
+	}
+
+	memcpy(m, n, sizeof(*m) + n->key_len);
+	if (children)
+		memcpy(children, n->children, n->child_count * sizeof(*children));
+	m->children    = children;
+	m->child_slots = n->child_count;
+
+	for (i = 0; i < m->child_count; i++)
+		m->children[i]->parent = m;
+
+	if (n == t->root)
+		t->root = m;
+	else {
+		idx                      = _get_child_idx(n->parent, n->key[n->parent->key_len], &found);
+		n->parent->children[idx] = m;
+	}
+
+	free(n->children);
+	free(n);
+
+	return m;
+}
+
+void radix_repack_node(struct radix_tree *t, struct radix_node *n)
+{
+	struct radix_node *p;
+
+	n = _repack_node(t, n);
+
+	/* nodes without an entry are never returned while iterating, move them together with their first child */
+	while ((p = n->parent) && !p->has_data && p->children[0] == n)
+		n = _repack_node(t, p);
+}
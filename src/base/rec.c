@@ -0,0 +1,243 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/rec.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VARINT_MAX_SIZE 10 /* 64 bits in 7-bit groups */
+
+struct rec_writer {
+	struct buffer *buf;
+	char *         last_key;
+	size_t         last_key_len;
+	size_t         last_key_alloc;
+};
+
+struct rec_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	char *               key;
+	size_t               key_len;
+	size_t               key_alloc;
+};
+
+static int _add(struct buffer *buf, const void *data, size_t len)
+{
+	int r = 0;
+
+	if (!buffer_add(buf, (void *) data, len, &r))
+		return r < 0 ? r : -ENOMEM;
+
+	return 0;
+}
+
+static int _reserve_key(char **key, size_t *key_alloc, size_t len)
+{
+	size_t alloc = *key_alloc ? *key_alloc : 64;
+	char * tmp;
+
+	if (len < *key_alloc)
+		return 0;
+
+	while (alloc <= len)
+		alloc <<= 1;
+
+	if (!(tmp = realloc(*key, alloc)))
+		return -ENOMEM;
+
+	*key       = tmp;
+	*key_alloc = alloc;
+
+	return 0;
+}
+
+struct rec_writer *rec_writer_create(struct buffer *buf, int *ret_code)
+{
+	static const unsigned char version = REC_FORMAT_VERSION;
+	struct rec_writer *        w;
+	int                        r;
+
+	if (!(w = calloc(1, sizeof(*w)))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	w->buf = buf;
+
+	if ((r = _add(buf, &version, sizeof(version))) < 0) {
+		free(w);
+		w = NULL;
+	}
+out:
+	if (ret_code)
+		*ret_code = r;
+	return w;
+}
+
+void rec_writer_destroy(struct rec_writer *w)
+{
+	free(w->last_key);
+	free(w);
+}
+
+int rec_write_uint(struct rec_writer *w, uint64_t val)
+{
+	unsigned char tmp[VARINT_MAX_SIZE];
+	size_t        n = 0;
+
+	do {
+		tmp[n] = val & 0x7f;
+		if ((val >>= 7))
+			tmp[n] |= 0x80;
+		n++;
+	} while (val);
+
+	return _add(w->buf, tmp, n);
+}
+
+int rec_write_data(struct rec_writer *w, const void *data, size_t len)
+{
+	int r;
+
+	if ((r = rec_write_uint(w, len)) < 0)
+		return r;
+
+	return len ? _add(w->buf, data, len) : 0;
+}
+
+int rec_write_key(struct rec_writer *w, const char *key)
+{
+	size_t key_len = strlen(key), prefix_len = 0;
+	int    r;
+
+	while (prefix_len < key_len && prefix_len < w->last_key_len && key[prefix_len] == w->last_key[prefix_len])
+		prefix_len++;
+
+	if ((r = rec_write_uint(w, prefix_len)) < 0 || (r = rec_write_data(w, key + prefix_len, key_len - prefix_len)) < 0)
+		return r;
+
+	if ((r = _reserve_key(&w->last_key, &w->last_key_alloc, key_len)) < 0)
+		return r;
+
+	memcpy(w->last_key + prefix_len, key + prefix_len, key_len - prefix_len);
+	w->last_key_len = key_len;
+
+	return 0;
+}
+
+struct rec_reader *rec_reader_create(const void *data, size_t size, int *ret_code)
+{
+	struct rec_reader *r;
+	int                ret = 0;
+
+	if (!size || *((const unsigned char *) data) != REC_FORMAT_VERSION) {
+		ret = -EPROTONOSUPPORT;
+		r   = NULL;
+		goto out;
+	}
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	r->p   = (const unsigned char *) data + 1;
+	r->end = (const unsigned char *) data + size;
+out:
+	if (ret_code)
+		*ret_code = ret;
+	return r;
+}
+
+void rec_reader_destroy(struct rec_reader *r)
+{
+	free(r->key);
+	free(r);
+}
+
+int rec_read_uint(struct rec_reader *r, uint64_t *val)
+{
+	uint64_t v = 0;
+	unsigned shift;
+
+	for (shift = 0; shift < VARINT_MAX_SIZE * 7; shift += 7) {
+		if (r->p == r->end)
+			return -EBADMSG;
+
+		v |= (uint64_t) (*r->p & 0x7f) << shift;
+
+		if (!(*r->p++ & 0x80)) {
+			*val = v;
+			return 0;
+		}
+	}
+
+	return -EBADMSG;
+}
+
+int rec_read_data(struct rec_reader *r, const void **data, size_t *len)
+{
+	uint64_t l;
+	int      ret;
+
+	if ((ret = rec_read_uint(r, &l)) < 0)
+		return ret;
+
+	if (l > (uint64_t) (r->end - r->p))
+		return -EBADMSG;
+
+	*data = r->p;
+	*len  = l;
+	r->p += l;
+
+	return 0;
+}
+
+int rec_read_key(struct rec_reader *r, const char **key, size_t *key_len)
+{
+	uint64_t    prefix_len;
+	const void *suffix;
+	size_t      suffix_len;
+	int         ret;
+
+	if (r->p == r->end)
+		return 0;
+
+	if ((ret = rec_read_uint(r, &prefix_len)) < 0 || (ret = rec_read_data(r, &suffix, &suffix_len)) < 0)
+		return ret;
+
+	if (prefix_len > r->key_len)
+		return -EBADMSG;
+
+	if ((ret = _reserve_key(&r->key, &r->key_alloc, prefix_len + suffix_len)) < 0)
+		return ret;
+
+	memcpy(r->key + prefix_len, suffix, suffix_len);
+	r->key_len         = prefix_len + suffix_len;
+	r->key[r->key_len] = '\0';
+
+	*key = r->key;
+	if (key_len)
+		*key_len = r->key_len;
+
+	return 1;
+}
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -36,7 +37,9 @@
 #define SID_DEFAULT_UMASK 0077
 #define LOG_PREFIX        "main"
 
-#define KEY_VERBOSE "VERBOSE"
+#define KEY_VERBOSE        "VERBOSE"
+#define KEY_LOG_RING_SIZE  "LOG_RING_SIZE" /* size of per-thread async log ring, 0 for synchronous logging */
+#define LOG_RING_SIZE_DFLT (256 * 1024)
 
 static void _help(FILE *f)
 {
@@ -166,6 +169,13 @@ int main(int argc, char *argv[])
 		_become_daemon();
 	}
 
+	if (util_env_get_ull(KEY_LOG_RING_SIZE, 0, UINT32_MAX, &val) < 0)
+		val = LOG_RING_SIZE_DFLT;
+
+	/* keep r for the exit status, not being able to log asynchronously is not fatal */
+	if (val && log_async_start(val) < 0)
+		log_error(LOG_PREFIX, "Failed to start asynchronous logging, logging synchronously.");
+
 	if (!(sid_res = sid_resource_ref(sid_resource_create(SID_RESOURCE_NO_PARENT,
 	                                                     &sid_resource_type_sid,
 	                                                     SID_RESOURCE_NO_FLAGS,
@@ -22,6 +22,8 @@
 #include "base/comms.h"
 #include "log/log.h"
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -40,54 +42,144 @@ usid_cmd_t usid_cmd_name_to_type(const char *cmd_name)
 	return USID_CMD_UNKNOWN;
 }
 
-int usid_req(const char *       prefix,
-             usid_cmd_t         cmd,
-             uint64_t           status,
-             usid_req_data_fn_t data_fn,
-             void *             data_fn_arg,
-             struct buffer **   resp_buf)
+struct usid_conn {
+	const char *prefix;
+	int         fd;
+	uint32_t    next_req_id;
+};
+
+int usid_conn_open(const char *prefix, struct usid_conn **conn)
 {
-	int            socket_fd = -1;
-	struct buffer *buf       = NULL;
-	ssize_t        n;
-	int            r = -1;
+	struct usid_conn *c;
+	int               r;
+
+	if (!(c = malloc(sizeof(*c))))
+		return -ENOMEM;
+
+	if ((c->fd = comms_unix_init(USID_SOCKET_PATH, USID_SOCKET_PATH_LEN, SOCK_STREAM | SOCK_CLOEXEC)) < 0) {
+		r = c->fd;
+		if (r != -ECONNREFUSED)
+			log_error_errno(prefix, r, "Failed to initialize connection");
+		free(c);
+		return r;
+	}
+
+	c->prefix      = prefix;
+	c->next_req_id = 1;
+
+	*conn = c;
+	return 0;
+}
+
+void usid_conn_close(struct usid_conn *conn)
+{
+	(void) close(conn->fd);
+	free(conn);
+}
+
+/*
+ * Returns a new req_id without sending anything, e.g. for USID_CMD_SCAN_BATCH items.
+ */
+uint32_t usid_conn_next_req_id(struct usid_conn *conn)
+{
+	return conn->next_req_id++;
+}
+
+int usid_conn_send(struct usid_conn * conn,
+                   usid_cmd_t         cmd,
+                   uint64_t           status,
+                   usid_req_data_fn_t data_fn,
+                   void *             data_fn_arg,
+                   uint32_t *         req_id)
+{
+	struct buffer *     buf;
+	struct usid_msg_ext ext = {.req_id = usid_conn_next_req_id(conn)};
+	ssize_t             n;
+	int                 r = -1;
 
 	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
 	                                                  .type    = BUFFER_TYPE_LINEAR,
 	                                                  .mode    = BUFFER_MODE_SIZE_PREFIX}),
 	                          &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
 	                          &r))) {
-		log_error_errno(prefix, r, "Failed to create request buffer");
-		goto out;
+		log_error_errno(conn->prefix, r, "Failed to create request buffer");
+		return r;
 	}
 
 	if (!buffer_add(buf,
 	                &((struct usid_msg_header) {.status = status, .prot = USID_PROTOCOL, .cmd = cmd}),
 	                USID_MSG_HEADER_SIZE,
-	                &r))
+	                &r) ||
+	    !buffer_add(buf, &ext, USID_MSG_EXT_SIZE, &r))
 		goto out;
 
-	if (data_fn && (data_fn(buf, data_fn_arg) < 0)) {
-		log_error(prefix, "Failed to add data to request.");
+	if (data_fn && ((r = data_fn(buf, data_fn_arg)) < 0)) {
+		log_error(conn->prefix, "Failed to add data to request.");
 		goto out;
 	}
 
-	if ((socket_fd = comms_unix_init(USID_SOCKET_PATH, USID_SOCKET_PATH_LEN, SOCK_STREAM | SOCK_CLOEXEC)) < 0) {
-		r = socket_fd;
-		if (r != -ECONNREFUSED)
-			log_error_errno(prefix, r, "Failed to initialize connection");
+	if ((n = buffer_write_all(buf, conn->fd)) < 0) {
+		r = n;
+		log_error_errno(conn->prefix, r, "Failed to send request");
 		goto out;
 	}
 
-	if ((n = buffer_write_all(buf, socket_fd)) < 0) {
-		log_error_errno(prefix, n, "Failed to send request");
-		goto out;
+	if (req_id)
+		*req_id = ext.req_id;
+	r = 0;
+out:
+	buffer_destroy(buf);
+	return r;
+}
+
+/*
+ * Strip the extension so the header is directly followed by data as in protocol 1.
+ */
+static int _strip_msg_ext(struct buffer *buf, uint32_t *req_id)
+{
+	struct usid_msg_header *hdr;
+	struct usid_msg_ext     ext;
+	size_t                  size;
+
+	(void) buffer_get_data(buf, (const void **) &hdr, &size);
+
+	if (size < USID_MSG_HEADER_SIZE)
+		return -EBADMSG;
+
+	if (!USID_PROTOCOL_HAS_EXT(hdr->prot)) {
+		*req_id = 0;
+		return 0;
 	}
 
-	buffer_reset(buf);
+	if (size < USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE)
+		return -EBADMSG;
+
+	memcpy(&ext, hdr->data, USID_MSG_EXT_SIZE);
+	memmove(hdr->data, hdr->data + USID_MSG_EXT_SIZE, size - USID_MSG_HEADER_SIZE - USID_MSG_EXT_SIZE);
+	*req_id = ext.req_id;
+
+	return buffer_rewind(buf, USID_MSG_EXT_SIZE, BUFFER_POS_REL);
+}
+
+int usid_conn_recv(struct usid_conn *conn, uint32_t *req_id, struct buffer **resp_buf)
+{
+	struct buffer *buf;
+	uint32_t       id = 0;
+	ssize_t        n;
+	int            r = -1;
 
+	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                  .type    = BUFFER_TYPE_LINEAR,
+	                                                  .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                          &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+	                          &r))) {
+		log_error_errno(conn->prefix, r, "Failed to create response buffer");
+		return r;
+	}
+
+	/* the buffer grows only to the size announced in the prefix so it never reads past the reply */
 	for (;;) {
-		n = buffer_read(buf, socket_fd);
+		n = buffer_read(buf, conn->fd);
 		if (n > 0) {
 			if (buffer_is_complete(buf, NULL)) {
 				r = 0;
@@ -96,24 +188,47 @@ int usid_req(const char *       prefix,
 		} else if (n < 0) {
 			if (n == -EAGAIN || n == -EINTR)
 				continue;
-			log_error_errno(prefix, errno, "Failed to read response");
+			log_error_errno(conn->prefix, n, "Failed to read response");
 			r = -EBADMSG;
 			break;
 		} else {
 			if (!buffer_is_complete(buf, NULL))
-				log_error(prefix, "Unexpected reponse end.");
+				log_error(conn->prefix, "Unexpected reponse end.");
+			r = -EPIPE;
 			break;
 		}
 	}
-out:
-	if (socket_fd >= 0)
-		close(socket_fd);
+
+	if (r == 0 && (r = _strip_msg_ext(buf, &id)) < 0)
+		log_error_errno(conn->prefix, r, "Malformed response");
 
 	if (r < 0) {
-		if (buf)
-			buffer_destroy(buf);
-	} else
-		*resp_buf = buf;
+		buffer_destroy(buf);
+		return r;
+	}
+
+	if (req_id)
+		*req_id = id;
+	*resp_buf = buf;
+	return 0;
+}
+
+int usid_req(const char *       prefix,
+             usid_cmd_t         cmd,
+             uint64_t           status,
+             usid_req_data_fn_t data_fn,
+             void *             data_fn_arg,
+             struct buffer **   resp_buf)
+{
+	struct usid_conn *conn;
+	int               r;
+
+	if ((r = usid_conn_open(prefix, &conn)) < 0)
+		return r;
+
+	if ((r = usid_conn_send(conn, cmd, status, data_fn, data_fn_arg, NULL)) == 0)
+		r = usid_conn_recv(conn, NULL, resp_buf);
 
+	usid_conn_close(conn);
 	return r;
 }
@@ -0,0 +1,53 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_ARENA_H
+#define _SID_ARENA_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Arena allocator.
+ *
+ * Memory is allocated by bumping a pointer within larger chunks. Individual
+ * allocations are never freed, all the memory is released at once when
+ * the arena is destroyed. This is meant for short-lived sets of small
+ * objects which are all discarded together.
+ */
+
+struct arena;
+
+struct arena *arena_create(size_t chunk_size);
+void          arena_destroy(struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size) __attribute__((__malloc__));
+void *arena_zalloc(struct arena *a, size_t size) __attribute__((__malloc__));
+
+/* Get overall size of memory allocated from the system for the arena. */
+size_t arena_get_size(struct arena *a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
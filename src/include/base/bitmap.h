@@ -37,6 +37,29 @@ bool           bitmap_bit_is_set(struct bitmap *bitmap, size_t bit_pos, int *ret
 size_t         bitmap_get_bit_count(struct bitmap *bitmap);
 size_t         bitmap_get_bit_set_count(struct bitmap *bitmap);
 
+/*
+ * Bulk operations, working on whole blocks of bits at once (using vector
+ * instructions if available). The result is stored in 'bitmap':
+ *   - bitmap_and:    bitmap = bitmap & other
+ *   - bitmap_or:     bitmap = bitmap | other
+ *   - bitmap_andnot: bitmap = bitmap & ~other
+ *
+ * Both bitmaps must have the same bit count, otherwise -EINVAL is returned.
+ */
+int bitmap_and(struct bitmap *bitmap, struct bitmap *other);
+int bitmap_or(struct bitmap *bitmap, struct bitmap *other);
+int bitmap_andnot(struct bitmap *bitmap, struct bitmap *other);
+
+/*
+ * Returns position of the first set bit at bit_pos or after it.
+ * If there's no such bit, bit count of the bitmap is returned.
+ */
+size_t bitmap_find_next_set(struct bitmap *bitmap, size_t bit_pos);
+
+#define bitmap_iterate_set(pos, bitmap)                                                                                          \
+	for (pos = bitmap_find_next_set((bitmap), 0); pos < bitmap_get_bit_count(bitmap);                                        \
+	     pos = bitmap_find_next_set((bitmap), pos + 1))
+
 #ifdef __cplusplus
 }
 #endif
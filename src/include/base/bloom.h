@@ -0,0 +1,55 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_BLOOM_H
+#define _SID_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bloom filter.
+ *
+ * Bloom filter answers whether an item may be in a set. If it answers "no", the item
+ * is surely not in the set. If it answers "maybe", the item may or may not be in the set.
+ * Items can't be removed from the filter - to get rid of removed items, the filter
+ * needs to be cleared and refilled.
+ *
+ * The items are represented by their 64-bit hash only (see also hash_compute in base/hash.h).
+ * The bit count is rounded up to power of 2.
+ */
+struct bloom;
+
+struct bloom *bloom_create(size_t bit_count, unsigned hash_count);
+void          bloom_destroy(struct bloom *b);
+void          bloom_clear(struct bloom *b);
+void          bloom_add(struct bloom *b, uint64_t hash);
+bool          bloom_may_contain(struct bloom *b, uint64_t hash);
+size_t        bloom_get_bit_count(struct bloom *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
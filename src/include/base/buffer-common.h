@@ -42,6 +42,7 @@ typedef enum
 {
 	BUFFER_TYPE_LINEAR,
 	BUFFER_TYPE_VECTOR,
+	BUFFER_TYPE_RING,
 } buffer_type_t;
 
 typedef enum
@@ -60,6 +61,8 @@ struct buffer_init {
 	size_t size;
 	size_t alloc_step;
 	size_t limit;
+	size_t alloc_factor;   /* if > 1, grow allocation at least this many times (still aligned to alloc_step) */
+	bool   ring_overwrite; /* BUFFER_TYPE_RING: drop oldest records if full instead of failing with -EAGAIN */
 };
 
 struct buffer_usage {
@@ -73,6 +76,12 @@ struct buffer_stat {
 	struct buffer_usage usage;
 };
 
+/* string part with known length (see buffer_join_add) */
+struct buffer_str {
+	const char *str;
+	size_t      len;
+};
+
 #ifdef __cplusplus
 }
 #endif
@@ -40,9 +40,26 @@ struct buffer *    buffer_create(struct buffer_spec *spec, struct buffer_init *i
 void               buffer_destroy(struct buffer *buf);
 int                buffer_reset(struct buffer *buf);
 int                buffer_reset_init(struct buffer *buf, struct buffer_init *init);
+int                buffer_clear(struct buffer *buf); /* like buffer_reset, but keeps allocated memory for reuse */
 const void *       buffer_add(struct buffer *buf, void *data, size_t len, int *ret_code);
 const void *       buffer_fmt_add(struct buffer *buf, int *ret_code, const char *fmt, ...);
 const void *       buffer_vfmt_add(struct buffer *buf, int *ret_code, const char *fmt, va_list ap);
+/*
+ * Adds parts joined with separator (if not NULL) as one string with trailing '\0'.
+ * The size is known in advance so unlike buffer_fmt_add, this is a single pass with
+ * no formatting involved, which is preferred for composing keys and paths.
+ */
+const void *       buffer_join_add(struct buffer *           buf,
+                                   int *                     ret_code,
+                                   const char *              sep,
+                                   const struct buffer_str * parts,
+                                   size_t                    count);
+/*
+ * Takes the oldest record out of BUFFER_TYPE_RING buffer and copies it to data.
+ * Returns record length, -ENODATA if there is no record or -ENOBUFS if size is
+ * not enough to hold the record, which is then kept in the buffer.
+ */
+ssize_t            buffer_take(struct buffer *buf, void *data, size_t size);
 int                buffer_rewind(struct buffer *buf, size_t pos, buffer_pos_t whence);
 int                buffer_rewind_mem(struct buffer *buf, const void *mem);
 bool               buffer_is_complete(struct buffer *buf, int *ret_code);
@@ -50,6 +67,7 @@ ssize_t            buffer_read(struct buffer *buf, int fd);
 ssize_t            buffer_write(struct buffer *buf, int fd, size_t pos);
 int                buffer_get_data(struct buffer *buf, const void **data, size_t *data_size);
 int                buffer_get_fd(struct buffer *buf);
+int                buffer_detach_fd(struct buffer *buf);
 struct buffer_stat buffer_stat(struct buffer *buf);
 int                buffer_write_all(struct buffer *buf, int fd);
 
@@ -28,6 +28,22 @@
 extern "C" {
 #endif
 
+#define COMMS_UNIX_FDS_MAX 253 /* maximum number of fds passed in one message (SCM_MAX_FD) */
+
+/*
+ * Message for batched send and receive. On send, fd_count fds from the fds array are
+ * passed with the message. On receive, fd_count is the size of the fds array and it is
+ * set to the number of fds actually received. The len is set to the number of bytes
+ * transferred for the message.
+ */
+struct comms_unix_msg {
+	struct iovec *iov;
+	size_t        iov_len;
+	int *         fds;
+	unsigned      fd_count;
+	ssize_t       len;
+};
+
 int comms_unix_create(const char *path, size_t path_len, int type);
 int comms_unix_init(const char *path, size_t path_len, int type);
 
@@ -37,6 +53,17 @@ ssize_t comms_unix_send_iovec(int socket_fd, struct iovec *iov, size_t iov_len,
 ssize_t comms_unix_recv(int socket_fd, void *buf, ssize_t buf_len, int *fd_received);
 ssize_t comms_unix_recv_iovec(int socket_fd, struct iovec *iov, size_t iov_len, int *fd_received);
 
+/* Send or receive a message with up to COMMS_UNIX_FDS_MAX fds in one SCM_RIGHTS control message. */
+ssize_t comms_unix_send_fds(int socket_fd, struct iovec *iov, size_t iov_len, const int *fds, unsigned fd_count);
+ssize_t comms_unix_recv_fds(int socket_fd, struct iovec *iov, size_t iov_len, int *fds, unsigned *fd_count);
+
+/*
+ * Send or receive several messages in one call (sendmmsg/recvmmsg).
+ * Returns the number of messages transferred, which may be less than msg_count, or -errno.
+ */
+int comms_unix_send_mmsg(int socket_fd, struct comms_unix_msg *msgs, unsigned msg_count);
+int comms_unix_recv_mmsg(int socket_fd, struct comms_unix_msg *msgs, unsigned msg_count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -45,7 +45,14 @@ int   hash_insert(struct hash_table *t, const void *key, uint32_t key_len, void
 void *hash_lookup(struct hash_table *t, const void *key, uint32_t key_len, size_t *data_len);
 void  hash_remove(struct hash_table *t, const void *key, uint32_t key_len);
 
+/*
+ * The hash function used by hash table, exposed for other uses, e.g. with Bloom filter.
+ */
+uint64_t hash_compute(const void *key, uint32_t key_len);
+
 unsigned hash_get_num_entries(struct hash_table *t);
+unsigned hash_get_num_slots(struct hash_table *t);
+unsigned hash_get_max_chain_len(struct hash_table *t);
 void     hash_iter(struct hash_table *t, hash_iterate_fn f);
 
 struct hash_node *hash_get_first(struct hash_table *t);
@@ -112,9 +119,16 @@ void  hash_remove_with_data(struct hash_table *t, const char *key, uint32_t key_
 /*
  * hash_update_fn_t callback type to define hash_update's hash_update_fn callback function.
  * Function of this type returns:
- * 	0 for hash table to keep old_data
- * 	1 for hash table to update old_data with new_data (new_data may be modified and/or newly allocated by this function)
+ * 	HASH_UPDATE_KEEP (0) for hash table to keep old_data
+ * 	HASH_UPDATE_SET (1) for hash table to update old_data with new_data (new_data may be modified and/or newly allocated by this function)
+ * 	HASH_UPDATE_REMOVE (2) for hash table to remove the node with old_data (no-op if there's no old_data)
+ *
+ * With HASH_UPDATE_REMOVE, the callback is responsible for releasing old_data if needed.
  */
+#define HASH_UPDATE_KEEP   0
+#define HASH_UPDATE_SET    1
+#define HASH_UPDATE_REMOVE 2
+
 typedef int (*hash_update_fn_t)(const void *key,
                                 uint32_t    key_len,
                                 void *      old_data,
@@ -125,7 +139,8 @@ typedef int (*hash_update_fn_t)(const void *key,
 
 /*
  * hash_update function calls hash_update_fn callback with hash_update_fn_arg right before the update
- * and based on callback's return value, it either keeps the old data or updates with new data.
+ * and based on callback's return value, it either keeps the old data, updates with new data or
+ * removes the node. All of this is done with a single lookup in the hash table.
  */
 int hash_update(struct hash_table *t,
                 const void *       key,
@@ -135,6 +150,46 @@ int hash_update(struct hash_table *t,
                 hash_update_fn_t   hash_update_fn,
                 void *             hash_update_fn_arg);
 
+struct arena;
+
+/*
+ * Hash table parameters:
+ *
+ * grow_load and shrink_load are load factor thresholds for automatic resizing,
+ * in percent (number of entries per 100 slots).
+ *
+ * Once grow_load is exceeded, the number of slots is doubled. Once the load drops below
+ * shrink_load, the number of slots is halved, but never below the initial size.
+ * Zero value disables the growing or shrinking respectively. If both are set, shrink_load
+ * must be less than half of grow_load.
+ *
+ * The entries are moved to resized slots incrementally with each subsequent modification
+ * of the hash table so that a single operation never needs to rehash the whole table.
+ *
+ * hash_create() creates a hash table which is never resized.
+ */
+/*
+ * If arena is set, hash nodes are allocated from the arena and they are not freed
+ * individually on removal. The arena must outlive the hash table.
+ */
+struct hash_params {
+	unsigned      grow_load;
+	unsigned      shrink_load;
+	struct arena *arena;
+};
+
+struct hash_table *hash_create_with_params(unsigned size_hint, const struct hash_params *params);
+
+/*
+ * Resized slots are filled with each modification of the hash table, so modifying the table
+ * while iterating over it with hash_get_first and hash_get_next could skip entries or visit
+ * them twice. If the table is modified during the iteration, call hash_rehash_pause before
+ * it starts and hash_rehash_resume once it is done. No resize is started or continued in
+ * between. The calls nest. The node the iteration is at must still never be removed.
+ */
+void hash_rehash_pause(struct hash_table *t);
+void hash_rehash_resume(struct hash_table *t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,54 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_PROBE_H
+#define _SID_PROBE_H
+
+#include "config.h"
+
+/*
+ * USDT static probes of "sid" provider for tracing with perf, bpftrace or systemtap.
+ *
+ * Probes are compiled in with --enable-usdt only. Then each probe is a single nop
+ * instruction until a tracer attaches to it, the arguments are only placed in
+ * registers or on stack where the tracer can find them. Without --enable-usdt,
+ * probes are compiled out completely and their arguments are never evaluated.
+ *
+ * Probe names use "__" which tracers show as "-", e.g. sid:cmd-start.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define SID_PROBE(name)                      DTRACE_PROBE(sid, name)
+#define SID_PROBE1(name, a1)                 DTRACE_PROBE1(sid, name, a1)
+#define SID_PROBE2(name, a1, a2)             DTRACE_PROBE2(sid, name, a1, a2)
+#define SID_PROBE3(name, a1, a2, a3)         DTRACE_PROBE3(sid, name, a1, a2, a3)
+#define SID_PROBE4(name, a1, a2, a3, a4)     DTRACE_PROBE4(sid, name, a1, a2, a3, a4)
+#define SID_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(sid, name, a1, a2, a3, a4, a5)
+#else
+/* arguments are not evaluated, only referenced to avoid unused variable warnings */
+#define SID_PROBE(name)                      ((void) 0)
+#define SID_PROBE1(name, a1)                 ((void) sizeof(a1))
+#define SID_PROBE2(name, a1, a2)             ((void) (sizeof(a1) + sizeof(a2)))
+#define SID_PROBE3(name, a1, a2, a3)         ((void) (sizeof(a1) + sizeof(a2) + sizeof(a3)))
+#define SID_PROBE4(name, a1, a2, a3, a4)     ((void) (sizeof(a1) + sizeof(a2) + sizeof(a3) + sizeof(a4)))
+#define SID_PROBE5(name, a1, a2, a3, a4, a5) ((void) (sizeof(a1) + sizeof(a2) + sizeof(a3) + sizeof(a4) + sizeof(a5)))
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_RADIX_H
+#define _SID_RADIX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Radix tree (compressed trie) with byte-wise branching.
+ *
+ * Unlike hash table, radix tree keeps the keys ordered. Iterating over the tree
+ * returns entries in lexicographical order of their keys and all entries with
+ * a common prefix are returned as one contiguous sequence. This makes it possible
+ * to iterate over all entries with a given prefix in time proportional to the
+ * number of matching entries and not to the number of all entries in the tree.
+ *
+ * The interface follows the one for hash table (see base/hash.h).
+ */
+
+struct radix_tree;
+struct radix_node;
+
+typedef void (*radix_iterate_fn)(void *data);
+
+/*
+ * radix_update_fn_t callback has the same semantics as hash_update_fn_t:
+ * 	RADIX_UPDATE_KEEP (0) for radix tree to keep old_data
+ * 	RADIX_UPDATE_SET (1) for radix tree to update old_data with new_data (new_data may be modified and/or newly allocated by this function)
+ * 	RADIX_UPDATE_REMOVE (2) for radix tree to remove the entry with old_data (no-op if there's no old_data)
+ *
+ * The callback may add new entries to the tree, but it must not add the entry
+ * with the key being updated or remove any entries.
+ */
+#define RADIX_UPDATE_KEEP   0
+#define RADIX_UPDATE_SET    1
+#define RADIX_UPDATE_REMOVE 2
+
+typedef int (*radix_update_fn_t)(const void *key,
+                                 uint32_t    key_len,
+                                 void *      old_data,
+                                 size_t      old_data_len,
+                                 void **     new_data,
+                                 size_t *    new_data_len,
+                                 void *      radix_update_fn_arg);
+
+struct radix_tree *radix_create(void);
+void               radix_destroy(struct radix_tree *t);
+
+int   radix_insert(struct radix_tree *t, const void *key, uint32_t key_len, void *data, size_t data_len);
+void *radix_lookup(struct radix_tree *t, const void *key, uint32_t key_len, size_t *data_len);
+void  radix_remove(struct radix_tree *t, const void *key, uint32_t key_len);
+int   radix_update(struct radix_tree *t,
+                   const void *       key,
+                   uint32_t           key_len,
+                   void **            data,
+                   size_t *           data_len,
+                   radix_update_fn_t  radix_update_fn,
+                   void *             radix_update_fn_arg);
+
+unsigned radix_get_num_entries(struct radix_tree *t);
+void     radix_iter(struct radix_tree *t, radix_iterate_fn f);
+
+/*
+ * Get the number of nodes in the tree, including the root and nodes without an entry,
+ * and the depth of the deepest node, the root being at depth 0. This walks the whole tree.
+ */
+void radix_get_shape(struct radix_tree *t, unsigned *nodes, unsigned *depth_max);
+
+/*
+ * Iterate over entries in key order. If prefix is not NULL, only entries
+ * with keys starting with the prefix are returned.
+ */
+struct radix_node *radix_get_first(struct radix_tree *t, const void *prefix, uint32_t prefix_len);
+struct radix_node *radix_get_next(struct radix_tree *t, struct radix_node *n, const void *prefix, uint32_t prefix_len);
+/*
+ * Same as radix_get_next, but starting from a key instead of a node. The key does not
+ * need to be stored in the tree so this can be used to continue iterating even if the
+ * tree has been modified in the meantime.
+ */
+struct radix_node *radix_get_next_after(struct radix_tree *t,
+                                        const void *       key,
+                                        uint32_t           key_len,
+                                        const void *       prefix,
+                                        uint32_t           prefix_len);
+
+char *radix_get_key(struct radix_tree *t, struct radix_node *n, uint32_t *key_len);
+void *radix_get_data(struct radix_tree *t, struct radix_node *n, size_t *data_len);
+
+/*
+ * Moves the node into newly allocated memory, with its array of children trimmed to
+ * the number of children it has now. Nodes without an entry are moved together with
+ * their first child. Arrays of children only ever grow on insertion so repacking all
+ * entries one by one gives back the memory after many removals and leaves the tree
+ * in memory allocated at about the same time. The node, and any node obtained from
+ * the tree before, must not be used afterwards, continue with radix_get_next_after.
+ */
+void radix_repack_node(struct radix_tree *t, struct radix_node *n);
+
+#define radix_iterate(v, t) for (v = radix_get_first((t), NULL, 0); v; v = radix_get_next((t), v, NULL, 0))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
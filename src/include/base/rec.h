@@ -0,0 +1,80 @@
+/*
+ * This file is part of SID.
+ *
+ * Copyright (C) 2017-2020 Red Hat, Inc. All rights reserved.
+ *
+ * SID is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * SID is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SID.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SID_REC_H
+#define _SID_REC_H
+
+#include "base/buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact binary record stream.
+ *
+ * The stream starts with one byte with format version (REC_FORMAT_VERSION) followed
+ * by records. Each record starts with a key which is followed by fields - unsigned
+ * integers and byte strings. The number, order and meaning of the fields is defined
+ * by the user of the stream, the stream itself does not record it.
+ *
+ *   - Unsigned integers are stored as varints: 7 bits per byte starting with the
+ *     least significant bits, the highest bit of the byte is set if more bytes follow.
+ *
+ *   - Byte strings are stored as varint with the length followed by the bytes.
+ *
+ *   - Keys are stored as varint with the length of the prefix shared with the key
+ *     of previous record followed by the rest of the key as byte string. Keys are
+ *     expected to be written in sorted order which makes the shared prefixes long.
+ *
+ * Writer appends the stream to a buffer. Reader works directly on the memory with
+ * the stream and it checks that all the fields are within its bounds. The keys are
+ * reconstructed in reader's own memory and they are valid until the next key is read.
+ * Byte strings are returned as references to the stream memory.
+ */
+#define REC_FORMAT_VERSION 1
+
+struct rec_writer;
+struct rec_reader;
+
+struct rec_writer *rec_writer_create(struct buffer *buf, int *ret_code);
+void               rec_writer_destroy(struct rec_writer *w);
+int                rec_write_key(struct rec_writer *w, const char *key);
+int                rec_write_uint(struct rec_writer *w, uint64_t val);
+int                rec_write_data(struct rec_writer *w, const void *data, size_t len);
+
+/*
+ * rec_read_key returns 1 if the key of next record is read, 0 at the end of the stream.
+ * Other rec_read_* functions return 0 on success. All of them return -EBADMSG if the
+ * stream is malformed.
+ */
+struct rec_reader *rec_reader_create(const void *data, size_t size, int *ret_code);
+void               rec_reader_destroy(struct rec_reader *r);
+int                rec_read_key(struct rec_reader *r, const char **key, size_t *key_len);
+int                rec_read_uint(struct rec_reader *r, uint64_t *val);
+int                rec_read_data(struct rec_reader *r, const void **data, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
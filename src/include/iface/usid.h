@@ -29,49 +29,69 @@
 extern "C" {
 #endif
 
-#define USID_PROTOCOL        1
+#define USID_PROTOCOL        2
 #define USID_SOCKET_PATH     "\0sid-ubridge.socket"
 #define USID_SOCKET_PATH_LEN (sizeof(USID_SOCKET_PATH) - 1)
 
 typedef enum
 {
-	_USID_CMD_START     = 0,
-	USID_CMD_UNDEFINED  = _USID_CMD_START, /* virtual cmd if cmd not defined at all */
-	USID_CMD_UNKNOWN    = 1,               /* virtual cmd if cmd defined, but not recognized */
-	USID_CMD_ACTIVE     = 2,
-	USID_CMD_CHECKPOINT = 3,
-	USID_CMD_REPLY      = 4,
-	USID_CMD_SCAN       = 5,
-	USID_CMD_VERSION    = 6,
-	USID_CMD_DUMP       = 7,
-	_USID_CMD_END       = USID_CMD_DUMP,
+	_USID_CMD_START       = 0,
+	USID_CMD_UNDEFINED    = _USID_CMD_START, /* virtual cmd if cmd not defined at all */
+	USID_CMD_UNKNOWN      = 1,               /* virtual cmd if cmd defined, but not recognized */
+	USID_CMD_ACTIVE       = 2,
+	USID_CMD_CHECKPOINT   = 3,
+	USID_CMD_REPLY        = 4,
+	USID_CMD_SCAN         = 5,
+	USID_CMD_VERSION      = 6,
+	USID_CMD_DUMP         = 7,
+	USID_CMD_EVENT_STATS  = 8,
+	USID_CMD_SCAN_BATCH   = 9,
+	USID_CMD_GET          = 10,
+	USID_CMD_SUBSCRIBE    = 11,
+	USID_CMD_MODULE_STATS = 12,
+	USID_CMD_STATS        = 13,
+	_USID_CMD_END         = USID_CMD_STATS,
 } usid_cmd_t;
 
 static const char *const usid_cmd_names[] = {
-	[USID_CMD_UNDEFINED]  = "undefined",
-	[USID_CMD_UNKNOWN]    = "unknown",
-	[USID_CMD_ACTIVE]     = "active",
-	[USID_CMD_CHECKPOINT] = "checkpoint",
-	[USID_CMD_REPLY]      = "reply",
-	[USID_CMD_SCAN]       = "scan",
-	[USID_CMD_VERSION]    = "version",
-	[USID_CMD_DUMP]       = "dump",
+	[USID_CMD_UNDEFINED]    = "undefined",
+	[USID_CMD_UNKNOWN]      = "unknown",
+	[USID_CMD_ACTIVE]       = "active",
+	[USID_CMD_CHECKPOINT]   = "checkpoint",
+	[USID_CMD_REPLY]        = "reply",
+	[USID_CMD_SCAN]         = "scan",
+	[USID_CMD_VERSION]      = "version",
+	[USID_CMD_DUMP]         = "dump",
+	[USID_CMD_EVENT_STATS]  = "event-stats",
+	[USID_CMD_SCAN_BATCH]   = "scan-batch",
+	[USID_CMD_GET]          = "get",
+	[USID_CMD_SUBSCRIBE]    = "subscribe",
+	[USID_CMD_MODULE_STATS] = "module-stats",
+	[USID_CMD_STATS]        = "stats",
 };
 
 bool usid_cmd_root_only[] = {
-	[USID_CMD_UNDEFINED]  = false,
-	[USID_CMD_UNKNOWN]    = false,
-	[USID_CMD_ACTIVE]     = false,
-	[USID_CMD_CHECKPOINT] = true,
-	[USID_CMD_REPLY]      = false,
-	[USID_CMD_SCAN]       = true,
-	[USID_CMD_VERSION]    = false,
-	[USID_CMD_DUMP]       = false,
+	[USID_CMD_UNDEFINED]    = false,
+	[USID_CMD_UNKNOWN]      = false,
+	[USID_CMD_ACTIVE]       = false,
+	[USID_CMD_CHECKPOINT]   = true,
+	[USID_CMD_REPLY]        = false,
+	[USID_CMD_SCAN]         = true,
+	[USID_CMD_VERSION]      = false,
+	[USID_CMD_DUMP]         = false,
+	[USID_CMD_EVENT_STATS]  = false,
+	[USID_CMD_SCAN_BATCH]   = true,
+	[USID_CMD_GET]          = false,
+	[USID_CMD_SUBSCRIBE]    = false,
+	[USID_CMD_MODULE_STATS] = false,
+	[USID_CMD_STATS]        = false,
 };
 
 #define COMMAND_STATUS_MASK_OVERALL UINT64_C(0x0000000000000001)
 #define COMMAND_STATUS_SUCCESS      UINT64_C(0x0000000000000000)
 #define COMMAND_STATUS_FAILURE      UINT64_C(0x0000000000000001)
+#define COMMAND_STATUS_SUPERSEDED   UINT64_C(0x0000000000000002) /* request skipped, superseded by a later one */
+#define COMMAND_STATUS_MORE         UINT64_C(0x0000000000000004) /* reply continues in next message with the same req_id */
 
 struct usid_msg_header {
 	uint64_t status;
@@ -80,9 +100,21 @@ struct usid_msg_header {
 	char     data[];
 } __attribute__((packed));
 
+/*
+ * Since protocol 2, the header is followed by this extension in both requests
+ * and replies. The connection stays open for further requests until the client
+ * closes it and the client may send more requests without waiting for replies.
+ * Each reply carries the req_id of the request it belongs to, replies to requests
+ * handled in parallel may come in different order than the requests were sent.
+ */
+struct usid_msg_ext {
+	uint32_t req_id;
+} __attribute__((packed));
+
 struct usid_msg {
-	size_t                  size; /* header + data */
+	size_t                  size; /* header + data, without extension */
 	struct usid_msg_header *header;
+	uint32_t                req_id; /* protocol 2 and higher */
 };
 
 struct usid_version {
@@ -91,14 +123,220 @@ struct usid_version {
 	uint16_t release;
 } __attribute__((packed));
 
-struct usid_dump_header {
+/*
+ * Key-value records, as used in USID_CMD_DUMP result, are stored in record stream
+ * (see base/rec.h). Each record consists of the key followed by these fields:
+ *
+ *   uint  type - USID_KV_REC_VALUE or USID_KV_REC_SET
+ *   uint  seqnum
+ *   uint  flags
+ *   data  owner (including the terminating NUL)
+ *   uint  number of data items (always 1 for USID_KV_REC_VALUE)
+ *   data  data item, repeated for each item
+ */
+#define USID_KV_REC_VALUE 0
+#define USID_KV_REC_SET   1
+#define USID_KV_REC_UNSET 2 /* USID_CMD_SUBSCRIBE only, the key is followed by the type only */
+
+/*
+ * USID_CMD_DUMP request may carry a filter as its data: USID_DUMP_FILTER_COUNT
+ * NUL-terminated strings in the order given by usid_dump_filter_t. Only records
+ * matching all non-empty strings are dumped. Without any data, all records are.
+ *
+ *   USID_DUMP_FILTER_NS         - namespace as used in keys (e.g. "D" for devices)
+ *   USID_DUMP_FILTER_DEV        - device ID (major_minor), selects device records only
+ *   USID_DUMP_FILTER_OWNER      - name of the module owning the record
+ *   USID_DUMP_FILTER_KEY_PREFIX - prefix of the full key
+ *
+ * Since protocol 2, the result is streamed in several replies as it is being
+ * written, each one with its own record stream. All of them, except the last
+ * one, have COMMAND_STATUS_MORE set.
+ */
+typedef enum
+{
+	USID_DUMP_FILTER_NS,
+	USID_DUMP_FILTER_DEV,
+	USID_DUMP_FILTER_OWNER,
+	USID_DUMP_FILTER_KEY_PREFIX,
+	USID_DUMP_FILTER_COUNT,
+} usid_dump_filter_t;
+
+/*
+ * USID_CMD_GET request carries the key spec as its data: USID_GET_SPEC_COUNT
+ * NUL-terminated strings in the order given by usid_get_spec_t. These are the
+ * parts of the key as stored in the database (e.g. "D", "8_0", "", "", "", "#RDY"
+ * for device ready state) and the key itself must not be empty. The namespace
+ * is one of "D", "M" or "G".
+ *
+ * The result is a record stream, the same as for USID_CMD_DUMP, with one record
+ * if the key is set or no records at all if it is not.
+ */
+typedef enum
+{
+	USID_GET_SPEC_NS,
+	USID_GET_SPEC_NS_PART,
+	USID_GET_SPEC_DOM,
+	USID_GET_SPEC_ID,
+	USID_GET_SPEC_ID_PART,
+	USID_GET_SPEC_KEY,
+	USID_GET_SPEC_COUNT,
+} usid_get_spec_t;
+
+/*
+ * USID_CMD_SUBSCRIBE request carries any number of key prefixes as NUL-terminated
+ * strings. Changes of records with keys matching any of the prefixes are reported,
+ * without any prefixes, changes of all records are. The connection is then used for
+ * the subscription only, it ends when the client closes it.
+ *
+ * The first reply comes right away with no records. Then, each time the database
+ * changes, there is a reply with records changed since the previous reply, the same
+ * as for USID_CMD_DUMP, or with USID_KV_REC_UNSET records for keys which are not set
+ * anymore. All these replies have COMMAND_STATUS_MORE set. More changes of one key are
+ * coalesced and only the resulting value is reported. If the client does not keep up
+ * and too many changes pile up, the last reply has COMMAND_STATUS_FAILURE set and the
+ * connection is closed. The client then needs to subscribe and dump the records again.
+ */
+
+/*
+ * USID_CMD_SCAN_BATCH request carries several devices, each one as this item header
+ * followed by the same data as in USID_CMD_SCAN request (devno and udev environment).
+ * The size includes the item header itself. The seqnum is the udev event SEQNUM which
+ * is otherwise in the status field of USID_CMD_SCAN request header. Each item gets its
+ * own USID_CMD_SCAN reply carrying the item req_id. There is no reply for the batch
+ * request itself unless the batch is malformed, then the reply has COMMAND_STATUS_FAILURE.
+ */
+struct usid_scan_batch_item {
+	uint32_t size;
+	uint32_t req_id;
 	uint64_t seqnum;
-	uint64_t flags;
-	uint32_t data_count; /* the number of data iovs */
 } __attribute__((packed));
 
-#define USID_MSG_HEADER_SIZE sizeof(struct usid_msg_header)
-#define USID_VERSION_SIZE    sizeof(struct usid_version)
+/*
+ * Event source statistics of the main event loop, as used in USID_CMD_EVENT_STATS result,
+ * are stored in record stream too. The key is "<resource type>/<event source>" and it is
+ * followed by these fields (see also struct sid_resource_event_stats):
+ *
+ *   uint  number of dispatches
+ *   uint  total handler run time in microseconds
+ *   uint  maximum handler run time in microseconds
+ *   uint  number of handler runs over the time budget
+ *   uint  number of histogram buckets
+ *   uint  number of dispatches in the bucket, repeated for each bucket
+ */
+
+/*
+ * Module statistics, as used in USID_CMD_MODULE_STATS result, are stored in record
+ * stream too. They are gathered by workers and aggregated in the main process. The key
+ * is the full module name and it is followed by these fields:
+ *
+ *   uint  number of phases
+ *
+ * Then, for each phase:
+ *
+ *   data  phase name (including the terminating NUL)
+ *   uint  number of calls
+ *   uint  number of failed calls
+ *   uint  total run time in microseconds
+ *   uint  maximum run time in microseconds
+ *
+ * Workers deliver their statistics together with database updates, or with the
+ * next command if no update has carried them for a second.
+ */
+
+/*
+ * Runtime statistics, as used in USID_CMD_STATS result. All fields are in host byte order.
+ * New fields are only ever appended. The size is the size of the structure as sent by the
+ * daemon so clients can tell which fields are present and daemons can talk to older clients.
+ * Counters with _total/_max suffix are in microseconds, queue_* fields describe the queue of
+ * connections waiting for a worker. The startup_usec is the time before the socket is served,
+ * modules are loaded only after that, taking modules_usec. The coldplug_* fields are only set
+ * if the daemon runs with SID_COLDPLUG=1 and scans all block devices found in sysfs on startup.
+ * The kv_garbage counts records removed or replaced in main key-value store since its last
+ * compaction was started, kv_compactions the compactions completed. The kv_atom_* fields
+ * describe the hash table with key atoms of main key-value store, not the store itself,
+ * which is a radix tree with kv_radix_nodes nodes, the deepest one at kv_radix_depth_max.
+ */
+struct usid_stats {
+	uint64_t size;
+	uint64_t uptime_usec;
+
+	uint64_t connections;
+	uint64_t scan_requests;
+
+	uint64_t queue_depth;
+	uint64_t queue_depth_max;
+	uint64_t queued;
+	uint64_t superseded;
+	uint64_t throttled;
+	uint64_t queue_wait_usec_total;
+	uint64_t queue_wait_usec_max;
+
+	uint64_t workers_running;
+	uint64_t workers_idle;
+	uint64_t worker_pool_forks;
+	uint64_t worker_on_demand_forks;
+	uint64_t worker_pool_hits;
+	uint64_t worker_reuses;
+	uint64_t worker_idle_timeouts;
+
+	uint64_t export_count;
+	uint64_t export_bytes;
+	uint64_t export_usec_total;
+	uint64_t export_usec_max;
+
+	uint64_t sync_count;
+	uint64_t sync_records;
+	uint64_t sync_usec_total;
+	uint64_t sync_usec_max;
+
+	uint64_t kv_records;
+	uint64_t kv_image_pending;
+	uint64_t kv_atom_entries;
+	uint64_t kv_atom_slots;
+	uint64_t kv_atom_chain_max;
+
+	uint64_t buffer_count;
+	uint64_t buffer_allocated;
+	uint64_t buffer_used;
+
+	uint64_t subscribers;
+
+	uint64_t startup_usec;
+	uint64_t modules_usec;
+	uint64_t modules_loaded;
+
+	uint64_t coldplug_devices;
+	uint64_t coldplug_failed;
+	uint64_t coldplug_usec;
+
+	uint64_t kv_garbage;
+	uint64_t kv_compactions;
+	uint64_t compact_usec_total;
+	uint64_t compact_usec_max;
+
+	uint64_t kv_radix_nodes;
+	uint64_t kv_radix_depth_max;
+} __attribute__((packed));
+
+/*
+ * The struct usid_stats in USID_CMD_STATS result is followed by a record stream with memory
+ * accounting of main key-value store. The key is "<class>/<account>" where class is "ns" for
+ * records accounted by namespace and "owner" for records accounted by owner module. It is
+ * followed by these fields:
+ *
+ *   uint  number of records
+ *   uint  bytes allocated for the records
+ */
+#define USID_STATS_ACCOUNT_NS    "ns"
+#define USID_STATS_ACCOUNT_OWNER "owner"
+
+#define USID_MSG_HEADER_SIZE      sizeof(struct usid_msg_header)
+#define USID_MSG_EXT_SIZE         sizeof(struct usid_msg_ext)
+#define USID_VERSION_SIZE         sizeof(struct usid_version)
+#define USID_SCAN_BATCH_ITEM_SIZE sizeof(struct usid_scan_batch_item)
+#define USID_STATS_SIZE           sizeof(struct usid_stats)
+
+#define USID_PROTOCOL_HAS_EXT(prot) ((prot) >= 2)
 
 typedef int (*usid_req_data_fn_t)(struct buffer *buf, void *data);
 
@@ -110,6 +348,25 @@ int        usid_req(const char *       prefix,
                     void *             data_fn_arg,
                     struct buffer **   resp_buf);
 
+/*
+ * Persistent connection for sending several requests, possibly without waiting
+ * for replies in between. Replies are returned by usid_conn_recv in the order
+ * they arrive with the req_id assigned by usid_conn_send. Reply buffers have
+ * the extension stripped so they look the same as the ones from usid_req.
+ */
+struct usid_conn;
+
+int      usid_conn_open(const char *prefix, struct usid_conn **conn);
+void     usid_conn_close(struct usid_conn *conn);
+uint32_t usid_conn_next_req_id(struct usid_conn *conn);
+int      usid_conn_send(struct usid_conn * conn,
+                        usid_cmd_t         cmd,
+                        uint64_t           status,
+                        usid_req_data_fn_t data_fn,
+                        void *             data_fn_arg,
+                        uint32_t *         req_id);
+int      usid_conn_recv(struct usid_conn *conn, uint32_t *req_id, struct buffer **resp_buf);
+
 #ifdef __cplusplus
 }
 #endif
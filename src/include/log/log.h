@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -60,6 +61,24 @@ extern const struct log_target log_target_journal;
 void log_init(log_target_t target, int verbose_mode);
 void log_change_target(log_target_t new_target);
 
+/*
+ * Switch to asynchronous output. Messages are formatted by the caller into
+ * a ring of ring_size bytes (one ring per thread) and a separate flusher thread
+ * passes them to the current log target in batches. If a ring is full, messages
+ * are dropped and the number of dropped messages is logged instead.
+ *
+ * log_async_stop flushes all pending messages and it switches back to synchronous
+ * output. It is also called automatically at exit.
+ */
+int  log_async_start(size_t ring_size);
+void log_async_stop(void);
+
+/*
+ * Returns non-zero if messages with level_id are logged with current target and
+ * verbosity. Use it to skip preparing arguments which are only needed for logging.
+ */
+int log_enabled(int level_id);
+
 __attribute__((format(printf, 8, 9))) void log_output(int         level_id,
                                                       const char *prefix,
                                                       int         class_id,
@@ -74,7 +93,23 @@ __attribute__((format(printf, 8, 9))) void log_output(int         level_id,
 
 #define LOG_PRINT LOG_LOCAL0
 
-#define LOG_LINE(l, p, c, e, ...) log_output(l, p, c, e, __FILE__, __LINE__, __func__, __VA_ARGS__)
+/*
+ * Messages with levels above LOG_LEVEL_MAX_COMPILED are compiled out completely,
+ * except for log_print. It is set with configure --with-log-level-max.
+ */
+#ifndef LOG_LEVEL_MAX_COMPILED
+#define LOG_LEVEL_MAX_COMPILED LOG_DEBUG
+#endif
+
+/*
+ * LOG_LINE checks the level first so the arguments are not evaluated at all
+ * if the message would not be logged anyway.
+ */
+#define LOG_LINE(l, p, c, e, ...)                                                                                                  \
+	do {                                                                                                                       \
+		if (((l) <= LOG_LEVEL_MAX_COMPILED || (l) == LOG_PRINT) && log_enabled(l))                                         \
+			log_output(l, p, c, e, __FILE__, __LINE__, __func__, __VA_ARGS__);                                         \
+	} while (0)
 
 #define log_debug(p, ...)          LOG_LINE(LOG_DEBUG, p, LOG_CLASS_UNCLASSIFIED, 0, __VA_ARGS__)
 #define log_info(p, ...)           LOG_LINE(LOG_INFO, p, LOG_CLASS_UNCLASSIFIED, 0, __VA_ARGS__)
@@ -22,6 +22,7 @@
 
 #include "resource/resource.h"
 
+#include <stdbool.h>
 #include <sys/uio.h>
 
 #ifdef __cplusplus
@@ -34,6 +35,7 @@ extern "C" {
 typedef enum
 {
 	KV_STORE_BACKEND_HASH,
+	KV_STORE_BACKEND_RADIX, /* keys ordered, iterating over keys with common prefix is proportional to number of matching keys */
 } kv_store_backend_t;
 
 typedef enum
@@ -51,14 +53,55 @@ typedef enum
 } kv_store_value_op_flags_t;
 
 struct kv_store_hash_backend_params {
-	size_t initial_size;
+	size_t   initial_size;
+	unsigned grow_load;   /* grow when entries per 100 slots exceed this value, 0 to never grow */
+	unsigned shrink_load; /* shrink when entries per 100 slots drop below this value, 0 to never shrink */
 };
 
+/*
+ * Memory accounting.
+ *
+ * If account_fn is set, each record is charged to one account in each of the
+ * KV_STORE_ACCOUNT_CLASS_COUNT account classes, e.g. one by key prefix and one
+ * by value owner. The account_fn fills in account names for the record in
+ * 'accounts', a NULL name does not charge the record in that class. The names
+ * are copied so they only need to be valid during the call. The record is
+ * charged with the memory allocated by the store for the record itself and
+ * its key, referenced values are not counted.
+ *
+ * If the account_soft_limit for the class is non-zero, a warning is logged
+ * when an account in that class grows over the limit. Records are still
+ * stored, the limit is never enforced.
+ */
+#define KV_STORE_ACCOUNT_CLASS_COUNT 2
+
+typedef void (*kv_store_account_fn_t)(const char *           key,
+                                      void *                 value,
+                                      size_t                 value_size,
+                                      kv_store_value_flags_t flags,
+                                      const char *           accounts[KV_STORE_ACCOUNT_CLASS_COUNT]);
+
 struct sid_kv_store_resource_params {
 	kv_store_backend_t backend;
 	union {
 		struct kv_store_hash_backend_params hash;
 	};
+	/*
+	 * If non-zero, records (and hash nodes with KV_STORE_BACKEND_HASH) are allocated from
+	 * an arena in chunks of this size instead of allocating each one separately. Memory
+	 * of removed or updated records is then not reused, it is all released at once when
+	 * the kv-store resource is destroyed. Suitable for short-lived stores only.
+	 */
+	size_t arena_chunk_size;
+	/*
+	 * If non-zero, a Bloom filter sized for this number of keys is kept for the store
+	 * so that lookups of keys which are not in the store are answered without searching
+	 * the store. The filter is grown automatically if more keys are stored.
+	 */
+	size_t filter_size_hint;
+	/* see Memory accounting above */
+	kv_store_account_fn_t account_fn;
+	uint64_t              account_soft_limit[KV_STORE_ACCOUNT_CLASS_COUNT];
 };
 
 struct kv_store_update_spec {
@@ -147,15 +190,250 @@ void *kv_store_get_value(sid_resource_t *kv_store_res, const char *key, size_t *
  */
 int kv_store_unset_value(sid_resource_t *kv_store_res, const char *key, kv_store_update_fn_t kv_unset_fn, void *kv_unset_fn_arg);
 
+/*
+ * Key atoms.
+ *
+ * An atom is an interned key: for each distinct key, there's exactly one atom with
+ * a stable integer identifier. Composing and parsing the key is then done
+ * only once when the atom is created and the atom can be used repeatedly
+ * with the *_atom variants of the functions to set, get and unset values.
+ * The key is also split into parts separated by KV_STORE_KEY_JOIN in advance.
+ *
+ * Atoms are reference counted: each kv_store_atom_get takes a reference and
+ * kv_store_atom_put drops it. The atom is valid until its last reference is
+ * dropped or the kv-store resource is destroyed, whether or not there's a value
+ * stored for the key. Identifiers of released atoms are not reused.
+ */
+typedef struct kv_store_atom kv_store_atom_t;
+
+const kv_store_atom_t *kv_store_atom_get(sid_resource_t *kv_store_res, const char *key);
+void                   kv_store_atom_put(sid_resource_t *kv_store_res, const kv_store_atom_t *atom);
+uint32_t               kv_store_atom_get_id(const kv_store_atom_t *atom);
+const char *           kv_store_atom_get_key(const kv_store_atom_t *atom);
+/*
+ * Gets key part with given index. If to_end is set, the part spans up to the end of the key,
+ * including any further KV_STORE_KEY_JOIN separators.
+ */
+const char *kv_store_atom_get_part(const kv_store_atom_t *atom, unsigned part, bool to_end, size_t *len);
+
+void *kv_store_set_value_atom(sid_resource_t *          kv_store_res,
+                              const kv_store_atom_t *   atom,
+                              void *                    value,
+                              size_t                    value_size,
+                              kv_store_value_flags_t    flags,
+                              kv_store_value_op_flags_t op_flags,
+                              kv_store_update_fn_t      kv_update_fn,
+                              void *                    kv_update_fn_arg);
+void *kv_store_get_value_atom(sid_resource_t *        kv_store_res,
+                              const kv_store_atom_t * atom,
+                              size_t *                value_size,
+                              kv_store_value_flags_t *flags);
+int   kv_store_unset_value_atom(sid_resource_t *       kv_store_res,
+                                const kv_store_atom_t *atom,
+                                kv_store_update_fn_t   kv_unset_fn,
+                                void *                 kv_unset_fn_arg);
+
 typedef struct kv_store_iter kv_store_iter_t;
 
 kv_store_iter_t *kv_store_iter_create(sid_resource_t *kv_store_res);
+/*
+ * Creates iterator over keys starting with given prefix only.
+ *   - With KV_STORE_BACKEND_RADIX, the keys are iterated in order and only matching keys are visited.
+ *   - With KV_STORE_BACKEND_HASH, all keys are still visited internally and checked for the prefix.
+ *     The hash table is not resized until the iterator is destroyed so that the store can be
+ *     changed while iterating, except for unsetting the current key.
+ */
+kv_store_iter_t *kv_store_iter_create_prefix(sid_resource_t *kv_store_res, const char *prefix);
 const char *     kv_store_iter_current_key(kv_store_iter_t *iter);
 void *           kv_store_iter_current(kv_store_iter_t *iter, size_t *size, kv_store_value_flags_t *flags);
 void *           kv_store_iter_next(kv_store_iter_t *iter, size_t *size, kv_store_value_flags_t *flags);
 void             kv_store_iter_reset(kv_store_iter_t *iter);
 void             kv_store_iter_destroy(kv_store_iter_t *iter);
 
+/*
+ * Snapshots.
+ *
+ * Snapshot preserves the content of the store as it was at the time the snapshot was
+ * created while the store itself can still be changed. Iterator created for the snapshot
+ * returns the keys and values from that time. Only values which are changed after taking
+ * the snapshot are kept aside so creating a snapshot is cheap. Values returned by the
+ * snapshot iterator must not be modified in place.
+ *
+ * Snapshots are supported with KV_STORE_BACKEND_RADIX only, kv_store_snapshot_create
+ * returns NULL for other backends. Any snapshots still existing are destroyed together
+ * with the store.
+ */
+typedef struct kv_store_snapshot kv_store_snapshot_t;
+
+kv_store_snapshot_t *kv_store_snapshot_create(sid_resource_t *kv_store_res);
+void                 kv_store_snapshot_destroy(kv_store_snapshot_t *snapshot);
+kv_store_iter_t *    kv_store_iter_create_snapshot(kv_store_snapshot_t *snapshot, const char *prefix);
+
+/*
+ * Dirty tracking.
+ *
+ * kv_store_dirty_track enables or disables recording of keys which are changed by
+ * kv_store_set_value or kv_store_unset_value. Iterator created by kv_store_iter_create_dirty
+ * returns only the records with recorded keys which still exist in the store, in key order.
+ * It returns NULL if tracking is not enabled. kv_store_dirty_reset drops all recorded keys,
+ * e.g. after the changed records have been exported, and tracking continues from scratch.
+ * kv_store_dirty_get_count returns number of recorded keys, including unset ones.
+ */
+int              kv_store_dirty_track(sid_resource_t *kv_store_res, bool enable);
+int              kv_store_dirty_reset(sid_resource_t *kv_store_res);
+int              kv_store_dirty_get_count(sid_resource_t *kv_store_res, unsigned *count);
+kv_store_iter_t *kv_store_iter_create_dirty(sid_resource_t *kv_store_res);
+
+/*
+ * Generation.
+ *
+ * The generation number is not used by the store itself. The owner may set it to tell
+ * which version of the content a copy of the store has, e.g. a copy inherited by a forked
+ * process which is then kept up to date by applying changes made to the original store.
+ */
+uint64_t kv_store_get_generation(sid_resource_t *kv_store_res);
+void     kv_store_set_generation(sid_resource_t *kv_store_res, uint64_t generation);
+
+/*
+ * Compaction.
+ *
+ * After many records are removed, the records left are scattered over the heap and the
+ * memory can not be returned to the system. Compaction moves all records into memory
+ * allocated anew - values which are not references are repacked into an arena, one
+ * after another in key order. The caller may then return the freed memory to the system
+ * with malloc_trim.
+ *
+ * kv_store_compact_start starts the compaction, if it is not in progress already. Then
+ * each kv_store_compact_step moves at most max_records records so that the compaction
+ * can be done in slices while the store is still used in between. It returns 1 if there
+ * are more records to move, 0 when the compaction is complete or -EBUSY if there's any
+ * snapshot (try again after destroying it). Moving a record is the same as changing it,
+ * values and iterators obtained before a step must not be used after it.
+ *
+ * Compaction is supported with KV_STORE_BACKEND_RADIX only and without arena_chunk_size,
+ * kv_store_compact_start returns -ENOTSUP otherwise.
+ */
+int kv_store_compact_start(sid_resource_t *kv_store_res);
+int kv_store_compact_step(sid_resource_t *kv_store_res, unsigned max_records);
+
+/*
+ * Images.
+ *
+ * kv_store_image_write writes all records to an image file at given path. The file is
+ * written under temporary name first and then renamed so the file at 'path' is always
+ * complete. Values stored by reference are written as copies. The 'seqnum' is stored
+ * in the image as it is and kv_store_image_load returns it back.
+ *
+ * kv_store_image_load maps the image into memory without reading the records. Each
+ * record is then copied into the store on first access only - when it is looked up,
+ * set, unset or iterated over. Records already in the store take precedence over the
+ * ones in the image. The image is unmapped as soon as all its records are loaded or
+ * when the store is destroyed. Returns -ENOENT if there's no image at given path.
+ *
+ * The image is in native byte order and it is not meant to be moved among machines.
+ */
+int kv_store_image_write(sid_resource_t *kv_store_res, const char *path, uint64_t seqnum);
+int kv_store_image_load(sid_resource_t *kv_store_res, const char *path, uint64_t *seqnum);
+
+/*
+ * Journals.
+ *
+ * Journal is an append-only file recording each set and unset, complementary to image.
+ * The entries are numbered with increasing seqnum.
+ *
+ * kv_store_journal_open opens the journal at 'path', creating it if it doesn't exist. All
+ * entries with seqnum greater than the one given (e.g. the seqnum returned by loading
+ * the image) are replayed into the store. If the last entry was not completely written,
+ * e.g. due to a crash, the journal is truncated just before that entry.
+ *
+ * kv_store_journal_add_{set,unset} queue a new entry in memory. The value is encoded
+ * right away so it doesn't need to be valid after the call. kv_store_journal_commit
+ * writes all queued entries at once and waits until they are on disk.
+ *
+ * kv_store_journal_reset drops all the entries, including the queued ones. This is used
+ * after writing an image with seqnum as returned by kv_store_journal_get_seqnum which
+ * covers all the entries then.
+ */
+typedef struct kv_store_journal kv_store_journal_t;
+
+kv_store_journal_t *kv_store_journal_open(sid_resource_t *kv_store_res, const char *path, uint64_t seqnum, int *ret_code);
+void                kv_store_journal_close(kv_store_journal_t *journal);
+int                 kv_store_journal_add_set(kv_store_journal_t *   journal,
+                                             const char *           key,
+                                             void *                 value,
+                                             size_t                 value_size,
+                                             kv_store_value_flags_t flags);
+int                 kv_store_journal_add_unset(kv_store_journal_t *journal, const char *key);
+int                 kv_store_journal_commit(kv_store_journal_t *journal);
+int                 kv_store_journal_reset(kv_store_journal_t *journal);
+uint64_t            kv_store_journal_get_seqnum(kv_store_journal_t *journal);
+
+/*
+ * Filter statistics.
+ *
+ * Each lookup that passes through the filter is counted as one of:
+ *   - negative: the filter knew the key is not in the store, the store was not searched
+ *   - positive: the key was found in the store
+ *   - false_positive: the store was searched, but the key was not found
+ *
+ * The 'rebuilds' counts how many times the filter was rebuilt, either to grow it
+ * or to drop keys which were unset. Returns -ENOTSUP if the store has no filter.
+ */
+struct kv_store_filter_stats {
+	uint64_t negative;
+	uint64_t positive;
+	uint64_t false_positive;
+	uint64_t rebuilds;
+};
+
+int kv_store_get_filter_stats(sid_resource_t *kv_store_res, struct kv_store_filter_stats *stats);
+
+/*
+ * Store statistics.
+ *
+ * The 'records' counts records in the backend, 'image_pending' records in the
+ * mapped image which are not loaded into the backend yet. The hash_* fields
+ * describe the hash table backend and the radix_* fields the radix tree backend,
+ * the fields of the other backend are zero. The radix_nodes counts all nodes of
+ * the tree including those without an entry, radix_depth_max is the depth of the
+ * deepest node. The atom_* fields describe the hash table with key atoms, if
+ * there is any. The 'garbage' counts records removed or replaced since the last
+ * compaction was started, 'compactions' the compactions completed.
+ */
+struct kv_store_stats {
+	uint64_t records;
+	uint64_t image_pending;
+	unsigned hash_entries;
+	unsigned hash_slots;
+	unsigned hash_chain_max;
+	unsigned radix_nodes;
+	unsigned radix_depth_max;
+	unsigned atom_entries;
+	unsigned atom_slots;
+	unsigned atom_chain_max;
+	uint64_t garbage;
+	uint64_t compactions;
+};
+
+int kv_store_get_stats(sid_resource_t *kv_store_res, struct kv_store_stats *stats);
+
+/*
+ * Account statistics, see Memory accounting above. Accounts without any records
+ * are dropped. Iteration stops early if account_fn returns < 0 and the value is
+ * returned. Returns -ENOTSUP if the store does not account memory.
+ */
+struct kv_store_account_stats {
+	uint64_t records;
+	uint64_t bytes;
+};
+
+typedef int (*kv_store_account_iterate_fn_t)(const char *name, const struct kv_store_account_stats *stats, void *arg);
+
+int kv_store_iterate_accounts(sid_resource_t *              kv_store_res,
+                              unsigned                      account_class,
+                              kv_store_account_iterate_fn_t account_fn,
+                              void *                        arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,7 @@ extern "C" {
 
 /* For use in struct module_registry_resource_resource_module_params.flags field. */
 #define MODULE_REGISTRY_PRELOAD UINT64_C(0x0000000000000001)
+#define MODULE_REGISTRY_LAZY    UINT64_C(0x0000000000000002) /* preload only indexes modules, load them on first use */
 
 /* For use in struct module_symbol_params.flags field. */
 #define MODULE_SYMBOL_WARN_ON_MISSING UINT64_C(0x0000000000000001)
@@ -55,6 +56,7 @@ sid_resource_t *module_registry_load_module(sid_resource_t *module_registry_res,
 sid_resource_t *module_registry_get_module(sid_resource_t *module_registry_res, const char *module_name);
 int             module_registry_unload_module(sid_resource_t *module_res);
 int             module_registry_get_module_symbols(sid_resource_t *module_res, const void ***ret);
+int             module_registry_load_modules(sid_resource_t *module_registry_res);
 
 int module_registry_reset_modules(sid_resource_t *module_registry_res);
 int module_registry_reset_module(sid_resource_t *module_res);
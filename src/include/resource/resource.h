@@ -177,6 +177,9 @@ int sid_resource_create_io_event_source(sid_resource_t *                res,
                                         const char *                    name,
                                         void *                          data);
 
+/* Changes the epoll events an io event source waits for, it is EPOLLIN after creation. */
+int sid_resource_set_io_event_source_events(sid_resource_event_source_t *es, uint32_t events);
+
 int sid_resource_create_signal_event_source(sid_resource_t *                    res,
                                             sid_resource_event_source_t **      es,
                                             sigset_t                            mask,
@@ -230,6 +233,42 @@ int sid_resource_destroy_event_source(sid_resource_event_source_t **es);
 int sid_resource_run_event_loop(sid_resource_t *res);
 int sid_resource_exit_event_loop(sid_resource_t *res);
 
+/*
+ * Event source statistics.
+ *
+ * Once enabled for an event loop, each dispatch of its event sources is counted and the
+ * run time of the handler is recorded. The statistics are aggregated by resource type
+ * name and event source name ("<type name>/<event source name>") so that event sources
+ * of short-lived resources of the same type accumulate in one entry.
+ *
+ * Histogram bucket 0 counts handler run times below 1 us, bucket i counts run times
+ * in [2^(i-1), 2^i) us and the last bucket counts everything above.
+ */
+#define SID_RESOURCE_EVENT_STATS_HIST_SIZE 24
+
+struct sid_resource_event_stats {
+	uint64_t dispatch_count;
+	uint64_t usec_total;
+	uint64_t usec_max;
+	uint64_t stall_count; /* handler runs over the budget, see sid_resource_set_event_handler_budget */
+	uint64_t usec_hist[SID_RESOURCE_EVENT_STATS_HIST_SIZE];
+};
+
+typedef int (*sid_resource_event_stats_fn_t)(const char *name, const struct sid_resource_event_stats *stats, void *arg);
+
+int sid_resource_enable_event_stats(sid_resource_t *res);
+int sid_resource_iterate_event_stats(sid_resource_t *res, sid_resource_event_stats_fn_t fn, void *arg);
+
+/*
+ * Handler time budget.
+ *
+ * If a handler of any event source in the event loop runs longer than the budget, it is
+ * logged as a stall together with the event source name, resource ID and the duration.
+ * Setting the budget to 0 disables the check.
+ */
+int      sid_resource_set_event_handler_budget(sid_resource_t *res, uint64_t usec);
+uint64_t sid_resource_get_event_stall_count(sid_resource_t *res);
+
 /*
  * miscellanous functions
  */
@@ -43,6 +43,8 @@ extern "C" {
 
 #define SID_UCMD_MOD_FN_NAME_ERROR "sid_ucmd_error"
 
+#define SID_UCMD_MOD_FN_NAME_SCAN_PREFETCH "sid_ucmd_scan_prefetch"
+
 struct sid_ucmd_mod_ctx;
 struct sid_ucmd_ctx;
 typedef struct sid_resource sid_resource_t;
@@ -100,6 +102,14 @@ typedef int           sid_ucmd_fn_t(struct module *module, struct sid_ucmd_ctx *
 #define SID_UCMD_TRIGGER_ACTION_NEXT(fn)    SID_UCMD_FN(trigger_action_next, _SID_UCMD_FN_CHECK_TYPE(fn))
 #define SID_UCMD_ERROR(fn)                  SID_UCMD_FN(error, _SID_UCMD_FN_CHECK_TYPE(fn))
 
+/*
+ * Block modules only: called for each device of a scan batch before any of the devices
+ * is scanned. The function should only start the I/O the scan phases are going to need
+ * later (e.g. by readahead) without waiting for it so that the devices of the batch are
+ * read in parallel and not one after another. Errors are ignored.
+ */
+#define SID_UCMD_SCAN_PREFETCH(fn) SID_UCMD_FN(scan_prefetch, _SID_UCMD_FN_CHECK_TYPE(fn))
+
 /*
  * Functions to retrieve device properties associated with given command ctx.
  */
@@ -20,6 +20,7 @@
 #ifndef _SID_WORKER_CONTROL_H
 #define _SID_WORKER_CONTROL_H
 
+#include "base/buffer-common.h"
 #include "resource/resource.h"
 
 #ifdef __cplusplus
@@ -52,6 +53,19 @@ struct worker_init_cb_spec {
 
 #define NULL_WORKER_INIT_CB_SPEC ((struct worker_init_cb_spec) {.cb = NULL, .arg = NULL})
 
+/*
+ * Worker availability specification
+ *
+ * The callback is called with the worker-control resource whenever a worker may have become
+ * available: a worker turned idle or a worker exited and so it made room for a new one.
+ */
+typedef int worker_available_cb_fn_t(sid_resource_t *worker_control_res, void *arg);
+
+struct worker_available_cb_spec {
+	worker_available_cb_fn_t *cb;
+	void *                    arg;
+};
+
 /* Wire specification */
 typedef enum
 {
@@ -102,6 +116,7 @@ struct worker_channel_cb_spec {
 
 struct worker_channel_spec {
 	const char *                  id;           /* channel id */
+	int64_t                       prio;         /* priority of channel events on both sides, lower value is higher prio */
 	struct worker_wire_spec       wire;         /* channel wire specification */
 	struct worker_channel_cb_spec worker_tx_cb; /* transmit callback specification on worker side */
 	struct worker_channel_cb_spec worker_rx_cb; /* receive callback specification on worker side */
@@ -111,15 +126,59 @@ struct worker_channel_spec {
 
 #define NULL_WORKER_CHANNEL_SPEC ((const struct worker_channel_spec) {NULL})
 
+/*
+ * Idle worker policy for the worker pool.
+ *
+ * How long idle pre-forked workers are kept and how many of them are kept follows
+ * the mean time between requests for a worker, tracked as an EWMA of inter-arrival
+ * times (any time passed since the last request counts in as soon as it is longer):
+ *
+ *   idle timeout = clamp(idle_timeout_factor * mean, idle_timeout_min_usec, idle_timeout_max_usec)
+ *   idle workers = clamp(pool_window_usec / mean, pool_min, pool_idle_max)
+ *
+ * Idle workers above the computed number exit after the idle timeout. Zero values select defaults,
+ * except for pool_idle_max where zero means the pool does not grow above pool_min.
+ */
+struct worker_idle_policy {
+	uint64_t idle_timeout_min_usec; /* shortest idle timeout */
+	uint64_t idle_timeout_max_usec; /* longest idle timeout */
+	unsigned idle_timeout_factor;   /* idle timeout as a multiple of mean time between requests */
+	uint64_t pool_window_usec;      /* keep enough idle workers for requests expected within this time */
+	unsigned pool_idle_max;         /* max number of idle workers */
+};
+
 /* Worker-control resource parameters */
 struct worker_control_resource_params {
-	worker_type_t                     worker_type;   /* type of workers this controller creates */
-	struct worker_init_cb_spec        init_cb_spec;  /* worker initialization callback specification */
-	const struct worker_channel_spec *channel_specs; /* NULL-terminated list of proxy <-> worker channel specs */
+	worker_type_t                     worker_type;       /* type of workers this controller creates */
+	struct worker_init_cb_spec        init_cb_spec;      /* worker initialization callback specification */
+	const struct worker_channel_spec *channel_specs;     /* NULL-terminated list of proxy <-> worker channel specs */
+	struct worker_available_cb_spec   available_cb_spec; /* worker availability callback specification */
+	unsigned                          pool_min;          /* number of idle workers to keep pre-forked (0 = no pool) */
+	unsigned                          pool_max;          /* max number of running workers when pre-forking (0 = no limit) */
+	bool                              reuse_workers;     /* keep yielded workers as idle instead of making them exit */
+	struct worker_idle_policy         idle_policy;       /* policy for idle workers in the pool */
 };
 
 int worker_control_channel_send(sid_resource_t *res, const char *channel_id, struct worker_data_spec *data_spec);
 
+/*
+ * Same as calling worker_control_channel_send for each of the count data specs, but all the
+ * messages are sent in one go if the channel uses socket wire, including any passed fds.
+ */
+int worker_control_channel_send_batch(sid_resource_t *         res,
+                                      const char *             channel_id,
+                                      struct worker_data_spec *data_specs,
+                                      unsigned                 count);
+
+/*
+ * Send data to all idle workers through the channel with given id. Unlike worker_control_channel_send,
+ * this does not assign the workers. Assigned workers tagged with affinity keys get the data, too, as they
+ * can still be given more work. Other running workers miss the data so they are marked as stale and they
+ * are not reused after yielding nor given more work by worker_control_get_affine_worker. Returns number
+ * of workers the data was sent to.
+ */
+int worker_control_send_to_idle(sid_resource_t *worker_control_res, const char *channel_id, struct worker_data_spec *data_spec);
+
 /* Worker creation/lookup. */
 struct worker_params {
 	const char *id;
@@ -136,6 +195,52 @@ sid_resource_t *worker_control_get_new_worker(sid_resource_t *worker_control_res
 sid_resource_t *worker_control_get_idle_worker(sid_resource_t *worker_control_res);
 sid_resource_t *worker_control_find_worker(sid_resource_t *worker_control_res, const char *id);
 
+/*
+ * Worker affinity.
+ *
+ * An assigned worker can be tagged with keys identifying the work it was given. Then
+ * worker_control_get_affine_worker returns the assigned worker tagged with the key so
+ * that related work can be queued for the same worker instead of running concurrently
+ * in another one. Each message sent to a worker through worker_control_channel_send is
+ * an assignment which the worker yields separately. The keys are dropped when the worker
+ * yields its last assignment. Only a limited number of assignments is queued this way.
+ */
+int             worker_control_add_worker_affinity(sid_resource_t *worker_proxy_res, const char *key);
+sid_resource_t *worker_control_get_affine_worker(sid_resource_t *worker_control_res, const char *key);
+
+/*
+ * Worker pool.
+ *
+ * Pre-forking is only supported for WORKER_TYPE_INTERNAL workers. Pre-forked workers are
+ * created from within the event loop, one per loop iteration, until there are pool_min
+ * idle workers or pool_max running workers. They are returned by worker_control_get_idle_worker.
+ *
+ * worker_control_refresh_pool makes all idle workers exit and schedules new ones to be
+ * pre-forked. Use it whenever the state inherited by workers changes.
+ */
+struct worker_control_stats {
+	uint64_t pool_forks;        /* workers pre-forked to fill the pool */
+	uint64_t pool_hits;         /* idle workers handed out by worker_control_get_idle_worker */
+	uint64_t on_demand_forks;   /* workers forked by worker_control_get_new_worker */
+	uint64_t reuses;            /* yielded workers kept as idle for reuse */
+	uint64_t affinity_hits;     /* assignments queued for a worker by worker_control_get_affine_worker */
+	uint64_t idle_timeouts;     /* idle workers exited after idle timeout to shrink the pool */
+	uint64_t policy_changes;    /* changes of the idle timeout or the number of idle workers */
+	uint64_t idle_timeout_usec; /* current idle timeout */
+	unsigned pool_idle;         /* current number of idle workers to keep */
+};
+
+int worker_control_fill_pool(sid_resource_t *worker_control_res);
+int worker_control_refresh_pool(sid_resource_t *worker_control_res);
+int worker_control_get_stats(sid_resource_t *worker_control_res, struct worker_control_stats *stats);
+int worker_control_get_worker_count(sid_resource_t *worker_control_res, unsigned *idle, unsigned *running);
+
+/*
+ * Sums up usage of channel buffers on the worker_proxy side and
+ * returns number of the buffers in 'count'.
+ */
+int worker_control_get_buffer_usage(sid_resource_t *worker_control_res, unsigned *count, struct buffer_usage *usage);
+
 /* Worker utility functions. */
 bool        worker_control_is_worker(sid_resource_t *res);
 const char *worker_control_get_worker_id(sid_resource_t *res);
@@ -143,6 +248,9 @@ const char *worker_control_get_worker_id(sid_resource_t *res);
 /* Yield current worker and make it available for others to use. */
 int worker_control_worker_yield(sid_resource_t *res);
 
+/* Yield current worker, but do not reuse it. The worker is made to exit once all its assignments are yielded. */
+int worker_control_worker_retire(sid_resource_t *res);
+
 #ifdef __cplusplus
 }
 #endif
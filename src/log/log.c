@@ -19,17 +19,418 @@
 
 #include "log/log.h"
 
+#include "base/buffer.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define LOG_ASYNC_REC_MAX 4096 /* maximum length of one record in async ring, longer messages are truncated */
+
 static log_target_t _current_target       = LOG_TARGET_NONE;
 static int          _current_verbose_mode = 0;
+static int          _max_level_id         = -1;
 
 static const struct log_target *log_target_registry[] = {[LOG_TARGET_STANDARD] = &log_target_standard,
                                                          [LOG_TARGET_SYSLOG]   = &log_target_syslog,
                                                          [LOG_TARGET_JOURNAL]  = &log_target_journal};
 
+/*
+ * Asynchronous output.
+ *
+ * Each thread which logs gets its own ring (BUFFER_TYPE_RING) so there is always
+ * single producer and single consumer for each ring and none of them needs a lock.
+ * The producer formats the message into a record and it adds the record to the
+ * ring. The flusher thread is the consumer which takes records out of all rings
+ * in batches and it passes them to the current log target. The lock is only used
+ * by the flusher and when rings are registered or unregistered.
+ *
+ * If a ring is full, the record is dropped and counted. The count is logged by
+ * the flusher together with next batch from the same ring.
+ *
+ * After fork, the child discards records inherited from the parent as the parent
+ * flushes them itself and the flusher thread is started again on first use.
+ */
+struct log_async_ring {
+	struct log_async_ring *next;
+	struct buffer *        buf;
+	unsigned long          dropped;  /* number of dropped records, flusher resets it when reported */
+	bool                   orphaned; /* owning thread exited, destroy once drained */
+};
+
+struct log_async_rec {
+	int  level_id;
+	int  class_id;
+	int  errno_id;
+	int  line_number;
+	bool has_prefix;
+	bool has_function_name;
+	char strs[]; /* prefix, file name, function name, message, each with trailing '\0' */
+};
+
+static struct {
+	bool                   enabled;
+	bool                   fork_hooks;
+	bool                   running; /* flusher thread running in this process */
+	bool                   stopping;
+	bool                   pending; /* there may be records in rings, flusher was woken up */
+	size_t                 ring_size;
+	int                    wake_fd;
+	pthread_t              flusher;
+	pthread_mutex_t        lock;
+	pthread_key_t          ring_key;
+	struct log_async_ring *rings;
+} _async = {.wake_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void _target_output(int         level_id,
+                           const char *prefix,
+                           int         class_id,
+                           int         errno_id,
+                           const char *file_name,
+                           int         line_number,
+                           const char *function_name,
+                           const char *format,
+                           ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_target_registry[_current_target]
+		->output(level_id, prefix, class_id, errno_id, file_name, line_number, function_name, format, ap);
+	va_end(ap);
+}
+
+static void _async_output_rec(struct log_async_rec *rec)
+{
+	const char *prefix        = rec->strs;
+	const char *file_name     = prefix + strlen(prefix) + 1;
+	const char *function_name = file_name + strlen(file_name) + 1;
+	const char *msg           = function_name + strlen(function_name) + 1;
+
+	_target_output(rec->level_id,
+	               rec->has_prefix ? prefix : NULL,
+	               rec->class_id,
+	               rec->errno_id,
+	               file_name,
+	               rec->line_number,
+	               rec->has_function_name ? function_name : NULL,
+	               "%s",
+	               msg);
+}
+
+/* Must be called with _async.lock held. */
+static void _async_drain(void)
+{
+	struct log_async_ring * ring, **prev_next;
+	char                    rec_buf[LOG_ASYNC_REC_MAX] __attribute__((aligned(sizeof(int))));
+	unsigned long           dropped;
+	bool                    orphaned;
+
+	for (prev_next = &_async.rings; (ring = *prev_next);) {
+		/* check before draining so that everything the thread added before it exited gets drained */
+		orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+		while (buffer_take(ring->buf, rec_buf, sizeof(rec_buf)) > 0) {
+			if (_current_target != LOG_TARGET_NONE)
+				_async_output_rec((struct log_async_rec *) rec_buf);
+		}
+
+		if ((dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED)) && _current_target != LOG_TARGET_NONE)
+			_target_output(LOG_WARNING,
+			               "log",
+			               LOG_CLASS_UNCLASSIFIED,
+			               0,
+			               __FILE__,
+			               __LINE__,
+			               __func__,
+			               "%lu log messages dropped, log buffer full.",
+			               dropped);
+
+		if (orphaned) {
+			*prev_next = ring->next;
+			buffer_destroy(ring->buf);
+			free(ring);
+		} else
+			prev_next = &ring->next;
+	}
+}
+
+static void *_async_flusher(void *arg)
+{
+	struct pollfd pfd = {.fd = _async.wake_fd, .events = POLLIN};
+	uint64_t      val;
+	bool          stopping;
+
+	do {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+
+		(void) read(_async.wake_fd, &val, sizeof(val));
+		__atomic_store_n(&_async.pending, false, __ATOMIC_SEQ_CST);
+
+		stopping = __atomic_load_n(&_async.stopping, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_lock(&_async.lock);
+		_async_drain();
+		pthread_mutex_unlock(&_async.lock);
+	} while (!stopping);
+
+	return NULL;
+}
+
+static void _async_wake(void)
+{
+	uint64_t val = 1;
+
+	if (!__atomic_exchange_n(&_async.pending, true, __ATOMIC_SEQ_CST))
+		(void) write(_async.wake_fd, &val, sizeof(val));
+}
+
+/* Must be called with _async.lock held. */
+static int _async_start_flusher(void)
+{
+	sigset_t original_sigmask, new_sigmask;
+	int      r;
+
+	if (_async.running)
+		return 0;
+
+	if ((_async.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+		return -errno;
+
+	_async.stopping = false;
+	_async.pending  = false;
+
+	/* signals are for the threads running event loops, never for the flusher */
+	(void) sigfillset(&new_sigmask);
+	(void) pthread_sigmask(SIG_SETMASK, &new_sigmask, &original_sigmask);
+	r = -pthread_create(&_async.flusher, NULL, _async_flusher, NULL);
+	(void) pthread_sigmask(SIG_SETMASK, &original_sigmask, NULL);
+
+	if (r < 0) {
+		(void) close(_async.wake_fd);
+		_async.wake_fd = -1;
+		return r;
+	}
+
+	__atomic_store_n(&_async.running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Must be called with _async.lock held. */
+static void _async_stop_flusher(void)
+{
+	if (!_async.running)
+		return;
+
+	__atomic_store_n(&_async.stopping, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&_async.pending, false, __ATOMIC_SEQ_CST);
+	_async_wake();
+
+	/* the flusher needs the lock to do the final drain */
+	pthread_mutex_unlock(&_async.lock);
+	(void) pthread_join(_async.flusher, NULL);
+	pthread_mutex_lock(&_async.lock);
+
+	(void) close(_async.wake_fd);
+	_async.wake_fd = -1;
+	__atomic_store_n(&_async.running, false, __ATOMIC_RELEASE);
+}
+
+static void _async_ring_key_destroy(void *data)
+{
+	struct log_async_ring *ring = data;
+
+	__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static struct log_async_ring *_async_get_ring(void)
+{
+	struct log_async_ring *ring;
+	struct buffer_spec     spec = {.backend = BUFFER_BACKEND_MALLOC, .type = BUFFER_TYPE_RING, .mode = BUFFER_MODE_PLAIN};
+	struct buffer_init     init = {.size = _async.ring_size};
+
+	if ((ring = pthread_getspecific(_async.ring_key)))
+		return ring;
+
+	if (!(ring = calloc(1, sizeof(*ring))))
+		return NULL;
+
+	if (!(ring->buf = buffer_create(&spec, &init, NULL))) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&_async.lock);
+	ring->next   = _async.rings;
+	_async.rings = ring;
+	pthread_mutex_unlock(&_async.lock);
+
+	(void) pthread_setspecific(_async.ring_key, ring);
+	return ring;
+}
+
+/*
+ * Returns false if the message can not go through the ring and it needs to be
+ * logged directly, or true if it has been added or counted as dropped.
+ */
+static bool _async_output(int         level_id,
+                          const char *prefix,
+                          int         class_id,
+                          int         errno_id,
+                          const char *file_name,
+                          int         line_number,
+                          const char *function_name,
+                          const char *format,
+                          va_list     ap)
+{
+	struct log_async_ring *ring;
+	char                   rec_buf[LOG_ASYNC_REC_MAX] __attribute__((aligned(sizeof(int))));
+	struct log_async_rec * rec = (struct log_async_rec *) rec_buf;
+	size_t                 len;
+	int                    r;
+
+	if (!__atomic_load_n(&_async.running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&_async.lock);
+		r = _async.enabled ? _async_start_flusher() : -ENOTCONN;
+		pthread_mutex_unlock(&_async.lock);
+		if (r < 0)
+			return false;
+	}
+
+	if (!(ring = _async_get_ring()))
+		return false;
+
+	*rec = (struct log_async_rec) {.level_id          = level_id,
+	                               .class_id          = class_id,
+	                               .errno_id          = errno_id,
+	                               .line_number       = line_number,
+	                               .has_prefix        = prefix != NULL,
+	                               .has_function_name = function_name != NULL};
+
+	r = snprintf(rec->strs,
+	             sizeof(rec_buf) - offsetof(struct log_async_rec, strs),
+	             "%s%c%s%c%s%c",
+	             prefix ?: "",
+	             '\0',
+	             file_name,
+	             '\0',
+	             function_name ?: "",
+	             '\0');
+
+	if (r < 0 || (len = offsetof(struct log_async_rec, strs) + r) >= sizeof(rec_buf))
+		return false;
+
+	r = vsnprintf(rec_buf + len, sizeof(rec_buf) - len, format, ap);
+
+	if (r < 0)
+		return false;
+
+	len = r < sizeof(rec_buf) - len ? len + r + 1 : sizeof(rec_buf);
+
+	if (!buffer_add(ring->buf, rec_buf, len, NULL))
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+
+	_async_wake();
+	return true;
+}
+
+static void _async_fork_prepare(void)
+{
+	pthread_mutex_lock(&_async.lock);
+	/* whatever the flusher left in stdio buffers would be written by the child again */
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+}
+
+static void _async_fork_parent(void)
+{
+	pthread_mutex_unlock(&_async.lock);
+}
+
+static void _async_fork_child(void)
+{
+	struct log_async_ring *ring, *own_ring = pthread_getspecific(_async.ring_key), *next;
+
+	(void) pthread_mutex_init(&_async.lock, NULL);
+
+	/* the parent flushes these records itself and rings of other threads have no producer in child */
+	for (ring = _async.rings; ring; ring = next) {
+		next = ring->next;
+		if (ring == own_ring) {
+			(void) buffer_reset(ring->buf);
+			ring->dropped = 0;
+			ring->next    = NULL;
+		} else {
+			buffer_destroy(ring->buf);
+			free(ring);
+		}
+	}
+
+	_async.rings = own_ring;
+
+	if (_async.running) {
+		(void) close(_async.wake_fd);
+		_async.wake_fd = -1;
+		_async.running = false;
+	}
+}
+
+int log_async_start(size_t ring_size)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&_async.lock);
+
+	if (_async.enabled)
+		goto out;
+
+	if (!_async.fork_hooks) {
+		if ((r = -pthread_key_create(&_async.ring_key, _async_ring_key_destroy)) < 0 ||
+		    (r = -pthread_atfork(_async_fork_prepare, _async_fork_parent, _async_fork_child)) < 0)
+			goto out;
+
+		(void) atexit(log_async_stop);
+		_async.fork_hooks = true;
+	}
+
+	_async.ring_size = ring_size;
+
+	if ((r = _async_start_flusher()) < 0)
+		goto out;
+
+	__atomic_store_n(&_async.enabled, true, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&_async.lock);
+	return r;
+}
+
+void log_async_stop(void)
+{
+	pthread_mutex_lock(&_async.lock);
+
+	if (!_async.enabled)
+		goto out;
+
+	__atomic_store_n(&_async.enabled, false, __ATOMIC_RELEASE);
+	_async_stop_flusher();
+	/* records added after the flusher's final drain */
+	_async_drain();
+out:
+	pthread_mutex_unlock(&_async.lock);
+}
+
 void log_init(log_target_t target, int verbose_mode)
 {
 	_current_target       = target;
 	_current_verbose_mode = verbose_mode;
+	_max_level_id         = verbose_mode == 0 ? LOG_NOTICE : verbose_mode == 1 ? LOG_INFO : LOG_DEBUG;
 
 	if (_current_target != LOG_TARGET_NONE)
 		log_target_registry[_current_target]->open(verbose_mode);
@@ -40,12 +441,23 @@ void log_change_target(log_target_t new_target)
 	if (_current_target == new_target)
 		return;
 
+	/* flush what is queued for the old target and keep the flusher away while switching */
+	pthread_mutex_lock(&_async.lock);
+	if (_async.enabled)
+		_async_drain();
+
 	if (_current_target != LOG_TARGET_NONE)
 		log_target_registry[_current_target]->close();
 	if (new_target != LOG_TARGET_NONE)
 		log_target_registry[new_target]->open(_current_verbose_mode);
 
 	_current_target = new_target;
+	pthread_mutex_unlock(&_async.lock);
+}
+
+int log_enabled(int level_id)
+{
+	return _current_target != LOG_TARGET_NONE && (level_id <= _max_level_id || level_id == LOG_PRINT);
 }
 
 void log_output(int         level_id,
@@ -59,6 +471,7 @@ void log_output(int         level_id,
                 ...)
 {
 	int     orig_errno;
+	bool    done;
 	va_list ap;
 
 	if (_current_target == LOG_TARGET_NONE)
@@ -68,9 +481,24 @@ void log_output(int         level_id,
 		errno_id = -errno_id;
 
 	orig_errno = errno;
+
+	if (__atomic_load_n(&_async.enabled, __ATOMIC_ACQUIRE)) {
+		/* do not format messages the target would throw away anyway */
+		if (level_id > _max_level_id && level_id != LOG_PRINT)
+			goto out;
+
+		va_start(ap, format);
+		done = _async_output(level_id, prefix, class_id, errno_id, file_name, line_number, function_name, format, ap);
+		va_end(ap);
+
+		if (done)
+			goto out;
+	}
+
 	va_start(ap, format);
 	log_target_registry[_current_target]
 		->output(level_id, prefix, class_id, errno_id, file_name, line_number, function_name, format, ap);
 	va_end(ap);
+out:
 	errno = orig_errno;
 }
@@ -25,7 +25,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +36,19 @@
 
 #define MID "blkid"
 
+/*
+ * Probe results are cached in device records together with the generation of device content
+ * they were read from so that repeated events for unchanged device do not need to probe again.
+ * The generation consists of device size and checksum of the areas at the start and at the end
+ * of the device where most signatures are found, prefixed with device sequence number (diskseq)
+ * if kernel provides it. The diskseq alone is not enough, it only changes with new media, not
+ * when the content is rewritten. Set BLKID_REPROBE_KEY udev variable for the event to probe
+ * in any case.
+ */
+#define BLKID_GEN_MAX     128
+#define BLKID_SUM_SIZE    (128 * 1024)
+#define BLKID_REPROBE_KEY "SID_BLKID_REPROBE"
+
 SID_UCMD_MOD_PRIO(0)
 
 enum
@@ -59,8 +74,9 @@ enum
 	_UDEV_KEY_END   = ID_FS_BOOT_SYSTEM_ID,
 
 	SID_NEXT_MOD,
+	BLKID_CACHE,
 	_DEVICE_KEY_START = SID_NEXT_MOD,
-	_DEVICE_KEY_END   = SID_NEXT_MOD,
+	_DEVICE_KEY_END   = BLKID_CACHE,
 
 	_NUM_KEYS
 };
@@ -84,6 +100,7 @@ static const char *keys[_NUM_KEYS] = {
 	[ID_FS_APPLICATION_ID] = "ID_FS_APPLICATION_ID",
 	[ID_FS_BOOT_SYSTEM_ID] = "ID_FS_BOOT_SYSTEM_ID",
 	[SID_NEXT_MOD]         = SID_UCMD_KEY_DEVICE_NEXT_MOD,
+	[BLKID_CACHE]          = "BLKID_CACHE",
 };
 
 static int _blkid_init(struct module *module, struct sid_ucmd_mod_ctx *ucmd_mod_ctx)
@@ -243,9 +260,212 @@ static int _probe_superblocks(blkid_probe pr)
 	return blkid_do_safeprobe(pr);
 }
 
+static int _read_sysfs_uint(struct sid_ucmd_ctx *ucmd_ctx, const char *attr, uint64_t *val)
+{
+	char  path[PATH_MAX];
+	FILE *fp;
+	int   r = 0;
+
+	snprintf(path,
+	         sizeof(path),
+	         SYSTEM_SYSFS_PATH "/dev/block/%d:%d/%s",
+	         sid_ucmd_dev_get_major(ucmd_ctx),
+	         sid_ucmd_dev_get_minor(ucmd_ctx),
+	         attr);
+
+	if (!(fp = fopen(path, "r")))
+		return -errno;
+
+	if (fscanf(fp, "%" SCNu64, val) != 1)
+		r = -EINVAL;
+
+	fclose(fp);
+	return r;
+}
+
+static uint64_t _checksum(uint64_t sum, const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		sum = (sum ^ data[i]) * UINT64_C(0x100000001b3);
+
+	return sum;
+}
+
+static int _checksum_area(int fd, uint64_t offset, size_t len, uint64_t *sum)
+{
+	unsigned char buf[4096];
+	ssize_t       n;
+
+	while (len) {
+		if ((n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!n)
+			break;
+
+		*sum = _checksum(*sum, buf, n);
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Get the generation of device content, the device is opened for that and it is left open for the probe. */
+static int _get_probe_gen(struct sid_ucmd_ctx *ucmd_ctx, const char *dev_path, int *fd, char *gen, size_t gen_size)
+{
+	uint64_t diskseq, start = 0, size, sum = UINT64_C(0xcbf29ce484222325);
+	bool     part = sid_ucmd_dev_get_type(ucmd_ctx) == UDEV_DEVTYPE_PARTITION;
+	int      len  = 0;
+	int      r;
+
+	if ((r = _read_sysfs_uint(ucmd_ctx, "size", &size)) < 0)
+		return r;
+
+	/* partitions do not have their own diskseq, but they change with the disk they are on */
+	if (_read_sysfs_uint(ucmd_ctx, part ? "../diskseq" : "diskseq", &diskseq) == 0 &&
+	    (!part || _read_sysfs_uint(ucmd_ctx, "start", &start) == 0))
+		len = snprintf(gen, gen_size, "diskseq=%" PRIu64 ",start=%" PRIu64 ",", diskseq, start);
+
+	if ((*fd = open(dev_path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+
+	/* size in sysfs is always in 512-byte sectors */
+	size *= 512;
+
+	if ((r = _checksum_area(*fd, 0, BLKID_SUM_SIZE, &sum)) < 0)
+		return r;
+
+	if (size > BLKID_SUM_SIZE && (r = _checksum_area(*fd, size - BLKID_SUM_SIZE, BLKID_SUM_SIZE, &sum)) < 0)
+		return r;
+
+	snprintf(gen + len, gen_size - len, "size=%" PRIu64 ",sum=%016" PRIx64, size, sum);
+	return 0;
+}
+
+static bool _reprobe_requested(struct module *module, struct sid_ucmd_ctx *ucmd_ctx)
+{
+	const char *val;
+
+	return (val = sid_ucmd_get_kv(module, ucmd_ctx, KV_NS_UDEV, BLKID_REPROBE_KEY, NULL, NULL)) && *val && strcmp(val, "0");
+}
+
+/*
+ * The cache record consists of the generation followed by name and value pairs
+ * of probe results, all of them as strings including terminating NUL.
+ */
+static int _add_cached_properties(struct module *module, struct sid_ucmd_ctx *ucmd_ctx, const char *gen)
+{
+	const char *cache, *end, *p, *name;
+	size_t      size;
+
+	if (!(cache = sid_ucmd_get_kv(module, ucmd_ctx, KV_NS_DEVICE, keys[BLKID_CACHE], &size, NULL)) || !size ||
+	    cache[size - 1] || strcmp(cache, gen))
+		return -ENOENT;
+
+	end = cache + size;
+
+	/* check the pairs are complete first so we do not end up with half of the properties */
+	for (p = cache + strlen(cache) + 1; p < end; p += strlen(p) + 1) {
+		if ((p += strlen(p) + 1) >= end)
+			return -EBADMSG;
+	}
+
+	for (p = cache + strlen(cache) + 1; p < end; p += strlen(p) + 1) {
+		name = p;
+		p += strlen(p) + 1;
+		_add_property(module, ucmd_ctx, name, p);
+	}
+
+	log_debug(MID, "Using cached probe results for %s (%s).", sid_ucmd_dev_get_name(ucmd_ctx), gen);
+	return 0;
+}
+
+static void _set_cached_properties(struct module *module, struct sid_ucmd_ctx *ucmd_ctx, const char *gen, blkid_probe pr)
+{
+	const char *name, *data;
+	size_t      size, len;
+	char *      cache, *p;
+	int         nvals, i;
+
+	nvals = blkid_probe_numof_values(pr);
+	size  = strlen(gen) + 1;
+
+	for (i = 0; i < nvals; i++) {
+		if (!blkid_probe_get_value(pr, i, &name, &data, NULL))
+			size += strlen(name) + strlen(data) + 2;
+	}
+
+	if (!(cache = malloc(size))) {
+		log_error(MID, "Failed to allocate probe cache record.");
+		return;
+	}
+
+	len = strlen(gen) + 1;
+	memcpy(cache, gen, len);
+	p = cache + len;
+
+	for (i = 0; i < nvals; i++) {
+		if (blkid_probe_get_value(pr, i, &name, &data, NULL))
+			continue;
+
+		len = strlen(name) + 1;
+		memcpy(p, name, len);
+		p += len;
+
+		len = strlen(data) + 1;
+		memcpy(p, data, len);
+		p += len;
+	}
+
+	if (!sid_ucmd_set_kv(module, ucmd_ctx, KV_NS_DEVICE, keys[BLKID_CACHE], cache, size, KV_PERSISTENT | KV_MOD_PRIVATE))
+		log_error(MID, "Failed to cache probe results.");
+
+	free(cache);
+}
+
+/*
+ * Devices of a scan batch are scanned one after another so queue the reads of the areas
+ * the probe needs for all of them first, the probe then finds them in page cache.
+ */
+static int _blkid_scan_prefetch(struct module *module, struct sid_ucmd_ctx *ucmd_ctx)
+{
+	char     dev_path[PATH_MAX];
+	uint64_t size;
+	int      fd;
+
+	if (_read_sysfs_uint(ucmd_ctx, "size", &size) < 0)
+		return 0;
+
+	snprintf(dev_path, sizeof(dev_path), SYSTEM_DEV_PATH "/%s", sid_ucmd_dev_get_name(ucmd_ctx));
+
+	if ((fd = open(dev_path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+
+	/* size in sysfs is always in 512-byte sectors */
+	size *= 512;
+
+	(void) posix_fadvise(fd, 0, BLKID_SUM_SIZE, POSIX_FADV_WILLNEED);
+
+	if (size > BLKID_SUM_SIZE)
+		(void) posix_fadvise(fd, size - BLKID_SUM_SIZE, BLKID_SUM_SIZE, POSIX_FADV_WILLNEED);
+
+	close(fd);
+	return 0;
+}
+SID_UCMD_SCAN_PREFETCH(_blkid_scan_prefetch)
+
 static int _blkid_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_ctx)
 {
 	char        dev_path[PATH_MAX];
+	char        gen[BLKID_GEN_MAX];
+	bool        gen_valid;
 	int64_t     offset = 0;
 	int         noraid = 0;
 	int         fd     = -1;
@@ -256,6 +476,19 @@ static int _blkid_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_ctx
 	int         i;
 	int         r = -1;
 
+	snprintf(dev_path, sizeof(dev_path), SYSTEM_DEV_PATH "/%s", sid_ucmd_dev_get_name(ucmd_ctx));
+
+	if ((r = _get_probe_gen(ucmd_ctx, dev_path, &fd, gen, sizeof(gen))) < 0)
+		log_debug(MID, "Failed to get generation of %s, probe results not cached: %s.", dev_path, strerror(-r));
+
+	gen_valid = r == 0;
+	r         = -1;
+
+	if (gen_valid && !_reprobe_requested(module, ucmd_ctx) && _add_cached_properties(module, ucmd_ctx, gen) == 0) {
+		r = 0;
+		goto out;
+	}
+
 	pr = blkid_new_probe();
 	if (!pr)
 		goto out;
@@ -269,9 +502,7 @@ static int _blkid_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_ctx
 	if (noraid)
 		blkid_probe_filter_superblocks_usage(pr, BLKID_FLTR_NOTIN, BLKID_USAGE_RAID);
 
-	snprintf(dev_path, sizeof(dev_path), SYSTEM_DEV_PATH "/%s", sid_ucmd_dev_get_name(ucmd_ctx));
-
-	if ((fd = open(dev_path, O_RDONLY | O_CLOEXEC)) < 0) {
+	if (fd < 0 && (fd = open(dev_path, O_RDONLY | O_CLOEXEC)) < 0) {
 		log_error_errno(MID, errno, "Failed to open device %s", dev_path);
 		goto out;
 	}
@@ -292,6 +523,9 @@ static int _blkid_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_ctx
 		_add_property(module, ucmd_ctx, name, data);
 	}
 
+	if (gen_valid)
+		_set_cached_properties(module, ucmd_ctx, gen, pr);
+
 	r = 0;
 out:
 	if (fd >= 0)
@@ -17,15 +17,19 @@
  * along with SID.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "base/mem.h"
 #include "base/util.h"
 #include "log/log.h"
 #include "resource/ucmd-module.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <libudev.h>
 #include <limits.h>
 #include <mpath_valid.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #define MID "dm_mpath"
 
@@ -35,12 +39,98 @@ SID_UCMD_MOD_PRIO(-1)
 #define VALID_KEY "SID_DM_MULTIPATH_VALID"
 #define WWID_KEY  "SID_DM_MULTIPATH_WWID"
 
+#define MPATH_CONF_FILE "/etc/multipath.conf"
+#define MPATH_CONF_DIR  "/etc/multipath/conf.d"
+
+struct dm_mpath_mod_ctx {
+	int             cmdline_allow; /* result of _kernel_cmdline_allow, the command line does not change */
+	struct timespec conf_mtime;    /* newest modification time of multipath configuration when it was loaded */
+};
+
+static int _kernel_cmdline_allow(void)
+{
+	char *value = NULL;
+
+	if (!util_cmdline_get_arg("nompath", NULL, NULL) && !util_cmdline_get_arg("nompath", &value, NULL))
+		return 1;
+	if (value && strcmp(value, "off") != 0)
+		return 1;
+	return 0;
+}
+
+static void _update_newest_mtime(struct timespec *newest, const struct stat *st)
+{
+	if (st->st_mtim.tv_sec > newest->tv_sec || (st->st_mtim.tv_sec == newest->tv_sec && st->st_mtim.tv_nsec > newest->tv_nsec))
+		*newest = st->st_mtim;
+}
+
+/*
+ * Get the newest modification time of multipath configuration files. This only takes
+ * a few stat calls while reloading the configuration means parsing all of it again.
+ */
+static void _get_conf_mtime(struct timespec *mtime)
+{
+	struct stat    st;
+	DIR *          dir;
+	struct dirent *dirent;
+
+	*mtime = (struct timespec) {0};
+
+	if (!stat(MPATH_CONF_FILE, &st))
+		_update_newest_mtime(mtime, &st);
+
+	if (!(dir = opendir(MPATH_CONF_DIR)))
+		return;
+
+	/* the directory changes if files are added, removed or replaced, entries change if rewritten in place */
+	if (!fstat(dirfd(dir), &st))
+		_update_newest_mtime(mtime, &st);
+
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] != '.' && !fstatat(dirfd(dir), dirent->d_name, &st, 0))
+			_update_newest_mtime(mtime, &st);
+	}
+
+	closedir(dir);
+}
+
+static int _reload_config_if_changed(struct dm_mpath_mod_ctx *dm_mpath_mod)
+{
+	struct timespec mtime;
+
+	_get_conf_mtime(&mtime);
+
+	if (mtime.tv_sec == dm_mpath_mod->conf_mtime.tv_sec && mtime.tv_nsec == dm_mpath_mod->conf_mtime.tv_nsec)
+		return 0;
+
+	log_debug(MID, "multipath configuration changed, reloading");
+
+	if (mpathvalid_reload_config() < 0)
+		return -1;
+
+	dm_mpath_mod->conf_mtime = mtime;
+	return 0;
+}
+
 static int _dm_mpath_init(struct module *module, struct sid_ucmd_mod_ctx *ucmd_mod_ctx)
 {
+	struct dm_mpath_mod_ctx *dm_mpath_mod;
+
 	log_debug(MID, "init");
+
+	if (!(dm_mpath_mod = mem_zalloc(sizeof(*dm_mpath_mod)))) {
+		log_error(MID, "Failed to allocate memory module context structure.");
+		return -1;
+	}
+
+	/* mpathvalid_init loads the configuration, record what it has loaded */
+	_get_conf_mtime(&dm_mpath_mod->conf_mtime);
+	dm_mpath_mod->cmdline_allow = _kernel_cmdline_allow();
+
 	/* TODO - set up dm/udev logging */
 	if (mpathvalid_init(MPATH_LOG_PRIO_NOLOG, MPATH_LOG_STDERR)) {
 		log_error(MID, "failed to initialize mpathvalid");
+		free(dm_mpath_mod);
 		return -1;
 	}
 	if (sid_ucmd_mod_reserve_kv(module, ucmd_mod_ctx, KV_NS_UDEV, PATH_KEY) < 0) {
@@ -55,9 +145,11 @@ static int _dm_mpath_init(struct module *module, struct sid_ucmd_mod_ctx *ucmd_m
 		log_error(MID, "Failed to reserve multipath device key %s", WWID_KEY);
 		goto fail;
 	}
+	module_set_data(module, dm_mpath_mod);
 	return 0;
 fail:
 	mpathvalid_exit();
+	free(dm_mpath_mod);
 	return -1;
 }
 SID_UCMD_MOD_INIT(_dm_mpath_init)
@@ -67,21 +159,11 @@ static int _dm_mpath_exit(struct module *module, struct sid_ucmd_mod_ctx *ucmd_m
 	log_debug(MID, "exit");
 	// Do we need to unreserve the key here?
 	mpathvalid_exit();
+	free(module_get_data(module));
 	return 0;
 }
 SID_UCMD_MOD_EXIT(_dm_mpath_exit)
 
-static int _kernel_cmdline_allow(void)
-{
-	char *value = NULL;
-
-	if (!util_cmdline_get_arg("nompath", NULL, NULL) && !util_cmdline_get_arg("nompath", &value, NULL))
-		return 1;
-	if (value && strcmp(value, "off") != 0)
-		return 1;
-	return 0;
-}
-
 static int _dm_mpath_reset(struct module *module, struct sid_ucmd_mod_ctx *ucmd_mod_ctx)
 {
 	log_debug(MID, "reset");
@@ -114,12 +196,13 @@ static int _is_parent_multipathed(struct module *mod, struct sid_ucmd_ctx *ucmd_
 
 static int _dm_mpath_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_ctx)
 {
-	int   r;
-	char *wwid;
-	char  valid_str[2];
+	struct dm_mpath_mod_ctx *dm_mpath_mod = module_get_data(module);
+	int                      r;
+	char *                   wwid;
+	char                     valid_str[2];
 	log_debug(MID, "scan-next");
 
-	if (!_kernel_cmdline_allow()) // treat failure as allowed
+	if (!dm_mpath_mod->cmdline_allow) // treat failure as allowed
 		return 0;
 
 	if (sid_ucmd_dev_get_type(ucmd_ctx) == UDEV_DEVTYPE_UNKNOWN)
@@ -128,7 +211,7 @@ static int _dm_mpath_scan_next(struct module *module, struct sid_ucmd_ctx *ucmd_
 	if (sid_ucmd_dev_get_type(ucmd_ctx) == UDEV_DEVTYPE_PARTITION)
 		return _is_parent_multipathed(module, ucmd_ctx);
 
-	if (mpathvalid_reload_config() < 0) {
+	if (_reload_config_if_changed(dm_mpath_mod) < 0) {
 		log_error(MID, "failed to reinitialize mpathvalid");
 		return -1;
 	}
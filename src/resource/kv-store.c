@@ -19,43 +19,228 @@
 
 #include "resource/kv-store.h"
 
+#include "base/arena.h"
+#include "base/bitmap.h"
+#include "base/bloom.h"
 #include "base/hash.h"
+#include "base/list.h"
 #include "base/mem.h"
+#include "base/radix.h"
 #include "log/log.h"
 #include "resource/resource.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define KV_STORE_NAME "kv-store"
 
 typedef enum
 {
 	KV_STORE_VALUE_INT_ALLOC = UINT32_C(0x00000001),
+	KV_STORE_VALUE_INT_ARENA = UINT32_C(0x00000002),
 } kv_store_value_int_flags_t;
 
+#define KV_STORE_ATOM_MAX_PARTS 16
+#define KV_STORE_ALIGN          sizeof(uint64_t) /* alignment of image values and journal entries */
+
+/* Bloom filter with 10 bits per key and 7 hash functions has false positive rate of about 1%. */
+#define KV_STORE_FILTER_BITS_PER_KEY 10
+#define KV_STORE_FILTER_HASH_COUNT   7
+
+#define KV_STORE_COMPACT_ARENA_CHUNK_SIZE (256 * 1024)
+
 struct kv_store {
-	struct hash_table *ht;
+	kv_store_backend_t backend;
+	union {
+		struct hash_table *ht;
+		struct radix_tree *rt;
+	};
+	struct arena *         arena;
+	struct hash_table *    atoms;
+	uint32_t               atom_count;
+	struct list            snapshots;
+	struct kv_store_image *image;
+
+	struct bloom *               filter;
+	size_t                       filter_capacity; /* number of keys the filter is sized for */
+	size_t                       filter_keys;     /* number of keys added to the filter since its last rebuild */
+	size_t                       filter_removed;  /* number of keys removed from the store since last filter rebuild */
+	struct kv_store_filter_stats filter_stats;
+
+	struct radix_tree *dirty; /* keys changed since dirty tracking was enabled or last reset, NULL if not tracking */
+
+	uint64_t generation; /* set by the owner, see kv_store_set_generation */
+
+	struct arena *compact_arena;     /* values repacked by current or last compaction */
+	struct arena *compact_old_arena; /* values repacked by previous compaction, released once current one completes */
+	bool          compacting;
+	char *        compact_key; /* last key repacked by current compaction */
+	uint32_t      compact_key_len;
+	uint32_t      compact_key_size;
+	uint64_t      garbage; /* records removed or replaced since last compaction started */
+	uint64_t      compactions;
+
+	sid_resource_t *      res;
+	kv_store_account_fn_t account_fn;
+	struct hash_table *   accounts[KV_STORE_ACCOUNT_CLASS_COUNT]; /* struct kv_store_account by account name */
+	uint64_t              account_soft_limit[KV_STORE_ACCOUNT_CLASS_COUNT];
+};
+
+struct kv_store_account {
+	struct kv_store_account_stats stats;
+	bool                          over_limit; /* warning about soft limit logged */
+};
+
+struct kv_store_atom {
+	uint32_t id;
+	unsigned refs;    /* number of kv_store_atom_get calls not yet matched by kv_store_atom_put */
+	uint32_t key_len; /* including terminating '\0' */
+	unsigned part_count;
+	uint32_t part_offset[KV_STORE_ATOM_MAX_PARTS];
+	char     key[];
 };
 
 struct kv_store_value {
 	size_t                     size;
 	kv_store_value_int_flags_t int_flags;
 	kv_store_value_flags_t     ext_flags;
-	char                       data[];
+	unsigned                   snap_refs; /* number of snapshots still referencing this value */
+	char                       data[] __attribute__((aligned(sizeof(void *))));
+};
+
+/*
+ * Snapshots.
+ *
+ * Taking a snapshot is just about registering it with the store. Then, whenever
+ * a key is changed for the first time after taking the snapshot, the original
+ * value of the key is moved to snapshot's 'old_values' instead of destroying it.
+ * If the key did not exist at the time the snapshot was taken, _no_value is
+ * recorded instead. Iterating over the snapshot then merges the keys from the
+ * live store and 'old_values', preferring the values from 'old_values'.
+ *
+ * The iteration over the snapshot always looks up the next key after the last
+ * one returned so it's not affected by any changes in the live store.
+ */
+struct kv_store_snapshot {
+	struct list        list;
+	struct kv_store *  store;
+	struct radix_tree *old_values;
+};
+
+static struct kv_store_value _no_value;
+
+/*
+ * Image.
+ *
+ * The image is a file with all records of the store which is mapped into memory
+ * when loaded. A record is copied from the image into the store only on first
+ * access, the 'loaded' bitmap tracks which ones are already in the store.
+ *
+ * Layout (native byte order):
+ *
+ *  1) struct kv_store_image_header
+ *  2) struct kv_store_image_record [record_count], sorted by key
+ *  3) keys, including terminating '\0'
+ *  4) values, each one starting at 8-byte boundary
+ *
+ * If the value is a vector, then "value_size" denotes vector item count
+ * and the value is stored as array of item sizes (uint64_t) followed by
+ * data of all the items.
+ */
+#define KV_STORE_IMAGE_MAGIC   "SIDKVIMG"
+#define KV_STORE_IMAGE_VERSION 1
+
+struct kv_store_image_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t record_count;
+	uint64_t size;
+	uint64_t seqnum; /* user-defined, e.g. last journal entry the image covers */
+};
+
+struct kv_store_image_record {
+	uint64_t key_offset;
+	uint64_t value_offset;
+	uint64_t value_size;
+	uint32_t key_len;
+	uint32_t flags;
+};
+
+struct kv_store_image {
+	char *                        map;
+	size_t                        size;
+	struct kv_store_image_record *records;
+	uint64_t                      record_count;
+	uint64_t                      pending_count;
+	struct bitmap *               loaded;
+};
+
+/*
+ * Journal.
+ *
+ * Each journal entry consists of:
+ *
+ *  1) struct kv_store_journal_entry
+ *  2) key   (key_len, including terminating '\0')
+ *  3) value (value_size, encoded the same way as in image, none if unsetting)
+ *
+ * The checksum covers the whole entry and it's calculated with the checksum
+ * field set to zero. Replay stops at first entry with wrong size or checksum.
+ */
+#define KV_STORE_JOURNAL_UNSET UINT32_C(0x80000000)
+
+struct kv_store_journal_entry {
+	uint32_t size; /* including this header */
+	uint32_t checksum;
+	uint64_t seqnum;
+	uint64_t value_size;
+	uint32_t key_len;
+	uint32_t flags; /* KV_STORE_VALUE_VECTOR, KV_STORE_JOURNAL_UNSET */
+};
+
+struct kv_store_journal {
+	int      fd;
+	off_t    size;   /* size of committed entries */
+	uint64_t seqnum; /* seqnum of last entry added */
+	char *   buf;    /* entries added, but not committed yet */
+	size_t   buf_size;
+	size_t   buf_used;
 };
 
 struct kv_update_fn_relay {
+	struct kv_store *    kv_store;
 	const char *         key;
 	kv_store_update_fn_t kv_update_fn;
 	void *               kv_update_fn_arg;
 	int                  ret_code;
+	bool                 created; /* new record created */
 };
 
 struct kv_store_iter {
-	struct kv_store * store;
-	struct hash_node *current;
+	struct kv_store *store;
+	union {
+		struct hash_node * ht;
+		struct radix_node *rt;
+	} current;
+	char *   prefix;
+	uint32_t prefix_len;
+	bool     rehash_paused; /* KV_STORE_BACKEND_HASH only: the store may be changed while iterating */
+
+	/* for iterating over snapshot or dirty records only */
+	struct kv_store_snapshot *snapshot;
+	bool                      dirty;
+	struct kv_store_value *   snapshot_value;
+	char *                    last_key;
+	uint32_t                  last_key_len;
+	uint32_t                  last_key_size;
 };
 
 static void _set_ptr(void *dest, const void *p)
@@ -79,14 +264,33 @@ static void *_get_data(struct kv_store_value *value)
 	return value->ext_flags & KV_STORE_VALUE_REF ? _get_ptr(value->data) : value->data;
 }
 
+static void *_zalloc(struct arena *arena, size_t size)
+{
+	return arena ? arena_zalloc(arena, size) : mem_zalloc(size);
+}
+
+static void _free(struct arena *arena, void *p)
+{
+	if (!arena)
+		free(p);
+}
+
 static void _destroy_kv_store_value(struct kv_store_value *value)
 {
 	struct iovec *iov;
 	size_t        i;
+	bool          in_arena;
 
 	if (!value)
 		return;
 
+	/*
+	 * Memory allocated from arena is not freed here, it is released at once
+	 * when the whole arena is destroyed. We still need to take care of any
+	 * references with KV_STORE_VALUE_AUTOFREE.
+	 */
+	in_arena = value->int_flags & KV_STORE_VALUE_INT_ARENA;
+
 	/* Take extra care of situations where we store reference to a value. */
 	if (value->ext_flags & KV_STORE_VALUE_REF) {
 		if (value->ext_flags & KV_STORE_VALUE_VECTOR) {
@@ -94,7 +298,8 @@ static void _destroy_kv_store_value(struct kv_store_value *value)
 
 			if (value->int_flags & KV_STORE_VALUE_INT_ALLOC) {
 				/* H */
-				free(iov[0].iov_base);
+				if (!in_arena)
+					free(iov[0].iov_base);
 				if (value->ext_flags & KV_STORE_VALUE_AUTOFREE)
 					free(iov);
 				else
@@ -122,7 +327,41 @@ static void _destroy_kv_store_value(struct kv_store_value *value)
 	 */
 
 	/* A, B, C, D, E, F */
-	free(value);
+	if (!in_arena)
+		free(value);
+}
+
+static void _release_kv_store_value(struct kv_store_value *value)
+{
+	if (value && !value->snap_refs)
+		_destroy_kv_store_value(value);
+}
+
+static void _unref_kv_store_value(struct kv_store_value *value)
+{
+	if (value != &_no_value && !--value->snap_refs)
+		_destroy_kv_store_value(value);
+}
+
+/*
+ * Record the value of a key before it is changed for all snapshots which do not have it recorded yet.
+ */
+static int _snapshot_old_value(struct kv_store *kv_store, const char *key, uint32_t key_len, struct kv_store_value *old_value)
+{
+	struct kv_store_snapshot *snapshot;
+
+	list_iterate_items (snapshot, &kv_store->snapshots) {
+		if (radix_lookup(snapshot->old_values, key, key_len, NULL))
+			continue;
+
+		if (radix_insert(snapshot->old_values, key, key_len, old_value ?: &_no_value, 0) < 0)
+			return -ENOMEM;
+
+		if (old_value)
+			old_value->snap_refs++;
+	}
+
+	return 0;
 }
 
 /*
@@ -153,7 +392,8 @@ static void _destroy_kv_store_value(struct kv_store_value *value)
  * For vectors, this also means that both the struct iovec and values reference by iovec.iov_base have
  * been allocated by "malloc" too.
  */
-static struct kv_store_value *_create_kv_store_value(struct iovec *            iov,
+static struct kv_store_value *_create_kv_store_value(struct arena *            arena,
+                                                     struct iovec *            iov,
                                                      int                       iov_cnt,
                                                      kv_store_value_flags_t    flags,
                                                      kv_store_value_op_flags_t op_flags,
@@ -170,7 +410,7 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 		if (flags & KV_STORE_VALUE_REF) {
 			value_size = sizeof(*value) + sizeof(intptr_t);
 
-			if (!(value = mem_zalloc(value_size)))
+			if (!(value = _zalloc(arena, value_size)))
 				return NULL;
 
 			if (op_flags & KV_STORE_VALUE_OP_MERGE) {
@@ -178,8 +418,10 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 				for (i = 0, data_size = 0; i < iov_cnt; i++)
 					data_size += iov[i].iov_len;
 
-				if (!(p1 = malloc(data_size)))
-					return mem_freen(value);
+				if (!(p1 = arena ? arena_alloc(arena, data_size) : malloc(data_size))) {
+					_free(arena, value);
+					return NULL;
+				}
 
 				for (i = 0, p2 = p1; i < iov_cnt; i++) {
 					memcpy(p2, iov[i].iov_base, iov[i].iov_len);
@@ -202,7 +444,7 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 				/* F */
 				value_size = sizeof(*value) + data_size;
 
-				if (!(value = mem_zalloc(value_size)))
+				if (!(value = _zalloc(arena, value_size)))
 					return NULL;
 
 				for (i = 0, p1 = value->data; i < iov_cnt; i++) {
@@ -217,7 +459,7 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 				/* E */
 				value_size = sizeof(*value) + iov_cnt * sizeof(struct iovec) + data_size;
 
-				if (!(value = mem_zalloc(value_size)))
+				if (!(value = _zalloc(arena, value_size)))
 					return NULL;
 
 				iov2 = (struct iovec *) value->data;
@@ -239,7 +481,7 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 			/* C,D */
 			value_size = sizeof(*value) + sizeof(intptr_t);
 
-			if (!(value = mem_zalloc(value_size)))
+			if (!(value = _zalloc(arena, value_size)))
 				return NULL;
 
 			_set_ptr(value->data, iov[0].iov_base);
@@ -247,7 +489,7 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 			/* A,B */
 			value_size = sizeof(*value) + iov[0].iov_len;
 
-			if (!(value = mem_zalloc(value_size)))
+			if (!(value = _zalloc(arena, value_size)))
 				return NULL;
 
 			memcpy(value->data, iov[0].iov_base, iov[0].iov_len);
@@ -257,12 +499,499 @@ static struct kv_store_value *_create_kv_store_value(struct iovec *            i
 		value->size = iov[0].iov_len;
 	}
 
+	if (arena)
+		value->int_flags |= KV_STORE_VALUE_INT_ARENA;
+
 	value->ext_flags = flags;
 	*size            = value_size;
 
 	return value;
 }
 
+static int _compare_keys(const char *key1, uint32_t key1_len, const char *key2, uint32_t key2_len)
+{
+	int r;
+
+	if ((r = memcmp(key1, key2, key1_len < key2_len ? key1_len : key2_len)))
+		return r;
+
+	return key1_len < key2_len ? -1 : key1_len > key2_len;
+}
+
+static struct kv_store_value *_lookup(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			return hash_lookup(kv_store->ht, key, key_len, NULL);
+		case KV_STORE_BACKEND_RADIX:
+			return radix_lookup(kv_store->rt, key, key_len, NULL);
+	}
+
+	return NULL;
+}
+
+static int _insert(struct kv_store *kv_store, const char *key, uint32_t key_len, struct kv_store_value *value, size_t value_size)
+{
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			return hash_insert(kv_store->ht, key, key_len, value, value_size);
+		case KV_STORE_BACKEND_RADIX:
+			return radix_insert(kv_store->rt, key, key_len, value, value_size);
+	}
+
+	return -EINVAL;
+}
+
+static void _account_check_limit(struct kv_store *        kv_store,
+                                 unsigned                 account_class,
+                                 const char *             name,
+                                 struct kv_store_account *account)
+{
+	uint64_t limit = kv_store->account_soft_limit[account_class];
+
+	if (!limit)
+		return;
+
+	if (!account->over_limit && account->stats.bytes > limit) {
+		account->over_limit = true;
+		log_warning(ID(kv_store->res),
+		            "Account %s uses %" PRIu64 " bytes in %" PRIu64 " records, over soft limit of %" PRIu64 " bytes.",
+		            name,
+		            account->stats.bytes,
+		            account->stats.records,
+		            limit);
+	} else if (account->over_limit && account->stats.bytes <= limit)
+		account->over_limit = false;
+}
+
+/*
+ * Charge the record to its accounts if 'charge' is set, otherwise release the charge.
+ * The 'value_size' is the size of the struct kv_store_value as stored in the backend.
+ */
+static void _account(struct kv_store *      kv_store,
+                     const char *           key,
+                     uint32_t               key_len,
+                     struct kv_store_value *value,
+                     size_t                 value_size,
+                     bool                   charge)
+{
+	const char *             accounts[KV_STORE_ACCOUNT_CLASS_COUNT] = {NULL};
+	struct kv_store_account *account;
+	uint64_t                 bytes = value_size + key_len;
+	uint32_t                 name_len;
+	unsigned                 i;
+
+	if (!kv_store->account_fn || !value)
+		return;
+
+	kv_store->account_fn(key, _get_data(value), value->size, value->ext_flags, accounts);
+
+	for (i = 0; i < KV_STORE_ACCOUNT_CLASS_COUNT; i++) {
+		if (!accounts[i])
+			continue;
+
+		name_len = strlen(accounts[i]) + 1;
+
+		if (!(account = hash_lookup(kv_store->accounts[i], accounts[i], name_len, NULL))) {
+			if (!charge)
+				continue;
+
+			if (!(account = mem_zalloc(sizeof(*account))))
+				continue;
+
+			if (hash_insert(kv_store->accounts[i], accounts[i], name_len, account, sizeof(*account)) < 0) {
+				free(account);
+				continue;
+			}
+		}
+
+		if (charge) {
+			account->stats.records++;
+			account->stats.bytes += bytes;
+		} else {
+			if (!--account->stats.records) {
+				hash_remove(kv_store->accounts[i], accounts[i], name_len);
+				free(account);
+				continue;
+			}
+			account->stats.bytes -= bytes < account->stats.bytes ? bytes : account->stats.bytes;
+		}
+
+		_account_check_limit(kv_store, i, accounts[i], account);
+	}
+}
+
+static void _image_release(struct kv_store *kv_store)
+{
+	struct kv_store_image *image = kv_store->image;
+
+	(void) munmap(image->map, image->size);
+	if (image->loaded)
+		bitmap_destroy(image->loaded);
+	free(image);
+
+	kv_store->image = NULL;
+}
+
+static const char *_image_get_key(struct kv_store_image *image, uint64_t i, uint32_t *key_len)
+{
+	*key_len = image->records[i].key_len;
+	return image->map + image->records[i].key_offset;
+}
+
+/*
+ * Returns index of the first record with key not less than the one given.
+ */
+static uint64_t _image_lower_bound(struct kv_store_image *image, const char *key, uint32_t key_len)
+{
+	uint64_t    lo = 0, hi = image->record_count, mid;
+	const char *mid_key;
+	uint32_t    mid_key_len;
+
+	while (lo < hi) {
+		mid     = lo + (hi - lo) / 2;
+		mid_key = _image_get_key(image, mid, &mid_key_len);
+
+		if (_compare_keys(mid_key, mid_key_len, key, key_len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Value encoding shared by images and journals. For vectors, 'size' is the item count
+ * and the value is encoded as array of item sizes (uint64_t) followed by the items.
+ */
+static size_t _get_encoded_value_size(void *value, size_t size, kv_store_value_flags_t flags)
+{
+	struct iovec *iov;
+	size_t        i, encoded_size;
+
+	if (!(flags & KV_STORE_VALUE_VECTOR))
+		return size;
+
+	for (i = 0, iov = value, encoded_size = size * sizeof(uint64_t); i < size; i++)
+		encoded_size += iov[i].iov_len;
+
+	return encoded_size;
+}
+
+static size_t _encode_value(char *dest, void *value, size_t size, kv_store_value_flags_t flags)
+{
+	struct iovec *iov;
+	uint64_t      item_size;
+	char *        p;
+	size_t        i;
+
+	if (!(flags & KV_STORE_VALUE_VECTOR)) {
+		memcpy(dest, value, size);
+		return size;
+	}
+
+	for (i = 0, iov = value; i < size; i++) {
+		item_size = iov[i].iov_len;
+		memcpy(dest + i * sizeof(uint64_t), &item_size, sizeof(item_size));
+	}
+
+	for (i = 0, p = dest + size * sizeof(uint64_t); i < size; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	return p - dest;
+}
+
+/*
+ * Decode value at 'p' into 'iov' without copying the data. If the value is a vector,
+ * 'iov' is newly allocated, otherwise 'iov_internal' is used. Returns -EBADMSG if the
+ * encoded value does not fit before 'end'.
+ */
+static int _decode_value(char *                 p,
+                         char *                 end,
+                         uint64_t               size,
+                         kv_store_value_flags_t flags,
+                         struct iovec *         iov_internal,
+                         struct iovec **        iov,
+                         int *                  iov_cnt)
+{
+	uint64_t item_size, i;
+	char *   item_sizes = p;
+
+	if (!(flags & KV_STORE_VALUE_VECTOR)) {
+		if (size > (uint64_t) (end - p))
+			return -EBADMSG;
+
+		iov_internal->iov_base = p;
+		iov_internal->iov_len  = size;
+		*iov                   = iov_internal;
+		*iov_cnt               = 1;
+		return 0;
+	}
+
+	if (size > INT_MAX || size > (uint64_t) (end - p) / sizeof(uint64_t))
+		return -EBADMSG;
+
+	if (!(*iov = malloc((size ?: 1) * sizeof(struct iovec))))
+		return -ENOMEM;
+
+	for (i = 0, p += size * sizeof(uint64_t); i < size; i++) {
+		memcpy(&item_size, item_sizes + i * sizeof(uint64_t), sizeof(item_size));
+
+		if (item_size > (uint64_t) (end - p)) {
+			free(*iov);
+			*iov = NULL;
+			return -EBADMSG;
+		}
+
+		(*iov)[i].iov_base = p;
+		(*iov)[i].iov_len  = item_size;
+		p += item_size;
+	}
+
+	*iov_cnt = size;
+	return 0;
+}
+
+static int _image_load_record(struct kv_store *kv_store, uint64_t i)
+{
+	struct kv_store_image *       image = kv_store->image;
+	struct kv_store_image_record *rec   = &image->records[i];
+	struct iovec                  iov_internal, *iov;
+	struct kv_store_value *       value;
+	size_t                        value_size;
+	const char *                  key;
+	uint32_t                      key_len;
+	int                           iov_cnt;
+	int                           r = 0;
+
+	if (bitmap_bit_is_set(image->loaded, i, NULL))
+		return 0;
+
+	key = _image_get_key(image, i, &key_len);
+
+	/* records already in the store take precedence */
+	if (_lookup(kv_store, key, key_len))
+		goto out;
+
+	if ((r = _decode_value(image->map + rec->value_offset,
+	                       image->map + image->size,
+	                       rec->value_size,
+	                       rec->flags,
+	                       &iov_internal,
+	                       &iov,
+	                       &iov_cnt)) < 0)
+		return r;
+
+	value = _create_kv_store_value(kv_store->arena, iov, iov_cnt, rec->flags, KV_STORE_VALUE_NO_OP, &value_size);
+
+	if (iov != &iov_internal)
+		free(iov);
+
+	if (!value)
+		return -ENOMEM;
+
+	if ((r = _insert(kv_store, key, key_len, value, value_size)) < 0) {
+		_destroy_kv_store_value(value);
+		return r;
+	}
+
+	_account(kv_store, key, key_len, value, value_size, true);
+out:
+	(void) bitmap_bit_set(image->loaded, i);
+	image->pending_count--;
+	return r;
+}
+
+/*
+ * Load the record with given key from image if there's any.
+ */
+static int _image_fault_in(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	struct kv_store_image *image = kv_store->image;
+	const char *           found_key;
+	uint32_t               found_key_len;
+	uint64_t               i;
+	int                    r;
+
+	if (!image)
+		return 0;
+
+	i = _image_lower_bound(image, key, key_len);
+
+	if (i == image->record_count)
+		return 0;
+
+	found_key = _image_get_key(image, i, &found_key_len);
+
+	if (_compare_keys(found_key, found_key_len, key, key_len))
+		return 0;
+
+	r = _image_load_record(kv_store, i);
+
+	if (!image->pending_count)
+		_image_release(kv_store);
+
+	return r;
+}
+
+/*
+ * Load all records with keys starting with given prefix from image. The
+ * records are sorted in the image so these form one contiguous sequence.
+ */
+static int _image_fault_in_prefix(struct kv_store *kv_store, const char *prefix, uint32_t prefix_len)
+{
+	struct kv_store_image *image = kv_store->image;
+	const char *           key;
+	uint32_t               key_len;
+	uint64_t               i;
+	int                    r = 0;
+
+	if (!image)
+		return 0;
+
+	for (i = prefix ? _image_lower_bound(image, prefix, prefix_len) : 0; i < image->record_count; i++) {
+		key = _image_get_key(image, i, &key_len);
+
+		if (prefix && (key_len <= prefix_len || memcmp(key, prefix, prefix_len)))
+			break;
+
+		if ((r = _image_load_record(kv_store, i)) < 0)
+			break;
+	}
+
+	if (!image->pending_count)
+		_image_release(kv_store);
+
+	return r;
+}
+
+static size_t _filter_get_bit_count(size_t capacity)
+{
+	return (capacity ?: 1) * KV_STORE_FILTER_BITS_PER_KEY;
+}
+
+/*
+ * Rebuild the filter from scratch for all keys in the store and in the image. This drops
+ * any removed keys from the filter and also allows for changing the filter size.
+ */
+static int _filter_rebuild(struct kv_store *kv_store, size_t capacity)
+{
+	struct bloom *     filter;
+	struct hash_node * hn;
+	struct radix_node *rn;
+	const char *       key;
+	uint32_t           key_len;
+	size_t             keys = 0;
+	uint64_t           i;
+
+	if (!(filter = bloom_create(_filter_get_bit_count(capacity), KV_STORE_FILTER_HASH_COUNT)))
+		return -ENOMEM;
+
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			for (hn = hash_get_first(kv_store->ht); hn; hn = hash_get_next(kv_store->ht, hn), keys++) {
+				key = hash_get_key(kv_store->ht, hn, &key_len);
+				bloom_add(filter, hash_compute(key, key_len));
+			}
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			radix_iterate(rn, kv_store->rt)
+			{
+				key = radix_get_key(kv_store->rt, rn, &key_len);
+				bloom_add(filter, hash_compute(key, key_len));
+				keys++;
+			}
+			break;
+	}
+
+	if (kv_store->image)
+		for (i = 0; i < kv_store->image->record_count; i++) {
+			if (bitmap_bit_is_set(kv_store->image->loaded, i, NULL))
+				continue;
+			key = _image_get_key(kv_store->image, i, &key_len);
+			bloom_add(filter, hash_compute(key, key_len));
+			keys++;
+		}
+
+	if (kv_store->filter)
+		bloom_destroy(kv_store->filter);
+
+	kv_store->filter          = filter;
+	kv_store->filter_capacity = capacity;
+	kv_store->filter_keys     = keys;
+	kv_store->filter_removed  = 0;
+	kv_store->filter_stats.rebuilds++;
+
+	return 0;
+}
+
+static void _filter_add(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	if (!kv_store->filter)
+		return;
+
+	bloom_add(kv_store->filter, hash_compute(key, key_len));
+
+	/*
+	 * Grow the filter as it fills up so the false positive rate stays low. If this
+	 * fails, we're still fine - just the false positive rate will be higher.
+	 */
+	if (++kv_store->filter_keys > kv_store->filter_capacity)
+		(void) _filter_rebuild(kv_store, kv_store->filter_capacity * 2);
+}
+
+static void _filter_remove(struct kv_store *kv_store)
+{
+	if (!kv_store->filter)
+		return;
+
+	/* keys can't be removed from the filter, rebuild it when there are too many stale ones */
+	if (++kv_store->filter_removed > kv_store->filter_capacity / 2)
+		(void) _filter_rebuild(kv_store, kv_store->filter_capacity);
+}
+
+/*
+ * Returns false if the key is surely not in the store.
+ */
+static bool _filter_may_contain(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	if (!kv_store->filter)
+		return true;
+
+	if (bloom_may_contain(kv_store->filter, hash_compute(key, key_len)))
+		return true;
+
+	kv_store->filter_stats.negative++;
+	return false;
+}
+
+static void _filter_account_lookup(struct kv_store *kv_store, bool found)
+{
+	if (!kv_store->filter)
+		return;
+
+	if (found)
+		kv_store->filter_stats.positive++;
+	else
+		kv_store->filter_stats.false_positive++;
+}
+
+static void _dirty_add(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	/*
+	 * Recording the key can only fail on allocation failure and there's no way
+	 * to report that in this context. Keep it simple and stop tracking then so
+	 * that kv_store_iter_create_dirty fails instead of silently missing the key.
+	 */
+	if (kv_store->dirty && radix_insert(kv_store->dirty, key, key_len, NULL, 0) < 0) {
+		radix_destroy(kv_store->dirty);
+		kv_store->dirty = NULL;
+	}
+}
+
 static int _hash_update_fn(const char *               key,
                            uint32_t                   key_len,
                            struct kv_store_value *    old_value,
@@ -325,7 +1054,8 @@ static int _hash_update_fn(const char *               key,
 					iov                 = tmp_iov;
 				}
 
-				if (!(edited_new_value = _create_kv_store_value(iov,
+				if (!(edited_new_value = _create_kv_store_value(relay->kv_store->arena,
+				                                                iov,
 				                                                iov_cnt,
 				                                                update_spec.new_flags,
 				                                                update_spec.op_flags,
@@ -342,37 +1072,53 @@ static int _hash_update_fn(const char *               key,
 		}
 	}
 
+	if (r && _snapshot_old_value(relay->kv_store, key, key_len, old_value) < 0) {
+		_destroy_kv_store_value(*new_value);
+		*new_value      = NULL;
+		relay->ret_code = -ENOMEM;
+		return HASH_UPDATE_KEEP;
+	}
+
 	if (r) {
+		_account(relay->kv_store, key, key_len, old_value, old_value_len, false);
+		_account(relay->kv_store, key, key_len, *new_value, *new_value_len, true);
 		if (old_value)
-			_destroy_kv_store_value(old_value);
+			relay->kv_store->garbage++;
+		_release_kv_store_value(old_value);
 	} else {
 		_destroy_kv_store_value(*new_value);
 		*new_value = NULL;
 	}
 
 	relay->ret_code = r;
-	return r;
+	relay->created  = r && !old_value;
+	return r ? HASH_UPDATE_SET : HASH_UPDATE_KEEP;
 }
 
-void *kv_store_set_value(sid_resource_t *          kv_store_res,
-                         const char *              key,
-                         void *                    value,
-                         size_t                    value_size,
-                         kv_store_value_flags_t    flags,
-                         kv_store_value_op_flags_t op_flags,
-                         kv_store_update_fn_t      kv_update_fn,
-                         void *                    kv_update_fn_arg)
+static void *_set_value(struct kv_store *         kv_store,
+                        const char *              key,
+                        uint32_t                  key_len,
+                        void *                    value,
+                        size_t                    value_size,
+                        kv_store_value_flags_t    flags,
+                        kv_store_value_op_flags_t op_flags,
+                        kv_store_update_fn_t      kv_update_fn,
+                        void *                    kv_update_fn_arg)
 {
-	struct kv_update_fn_relay relay        = {.key              = key,
+	struct kv_update_fn_relay relay        = {.kv_store         = kv_store,
+                                           .key              = key,
                                            .kv_update_fn     = kv_update_fn,
                                            .kv_update_fn_arg = kv_update_fn_arg,
                                            .ret_code         = -EREMOTEIO};
-	struct kv_store *         kv_store     = sid_resource_get_data(kv_store_res);
 	struct iovec              iov_internal = {.iov_base = value, .iov_len = value_size};
 	struct iovec *            iov;
 	int                       iov_cnt;
 	size_t                    kv_store_value_size;
 	struct kv_store_value *   kv_store_value;
+	int                       r = -1;
+
+	if (_image_fault_in(kv_store, key, key_len) < 0)
+		return NULL;
 
 	if (flags & KV_STORE_VALUE_VECTOR) {
 		iov     = value;
@@ -382,30 +1128,102 @@ void *kv_store_set_value(sid_resource_t *          kv_store_res,
 		iov_cnt = 1;
 	}
 
-	if (!(kv_store_value = _create_kv_store_value(iov, iov_cnt, flags, op_flags, &kv_store_value_size)))
+	if (!(kv_store_value = _create_kv_store_value(kv_store->arena, iov, iov_cnt, flags, op_flags, &kv_store_value_size)))
 		return NULL;
 
-	if (hash_update(kv_store->ht,
-	                key,
-	                strlen(key) + 1,
-	                (void **) &kv_store_value,
-	                &kv_store_value_size,
-	                (hash_update_fn_t) _hash_update_fn,
-	                &relay))
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			r = hash_update(kv_store->ht,
+			                key,
+			                key_len,
+			                (void **) &kv_store_value,
+			                &kv_store_value_size,
+			                (hash_update_fn_t) _hash_update_fn,
+			                &relay);
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			r = radix_update(kv_store->rt,
+			                 key,
+			                 key_len,
+			                 (void **) &kv_store_value,
+			                 &kv_store_value_size,
+			                 (radix_update_fn_t) _hash_update_fn,
+			                 &relay);
+			break;
+	}
+
+	if (r)
 		return NULL;
 
 	if (relay.ret_code < 0)
 		return NULL;
 
+	if (relay.created)
+		_filter_add(kv_store, key, key_len);
+
+	_dirty_add(kv_store, key, key_len);
+
 	return _get_data(kv_store_value);
 }
 
-void *kv_store_get_value(sid_resource_t *kv_store_res, const char *key, size_t *value_size, kv_store_value_flags_t *flags)
+void *kv_store_set_value(sid_resource_t *          kv_store_res,
+                         const char *              key,
+                         void *                    value,
+                         size_t                    value_size,
+                         kv_store_value_flags_t    flags,
+                         kv_store_value_op_flags_t op_flags,
+                         kv_store_update_fn_t      kv_update_fn,
+                         void *                    kv_update_fn_arg)
+{
+	return _set_value(sid_resource_get_data(kv_store_res),
+	                  key,
+	                  strlen(key) + 1,
+	                  value,
+	                  value_size,
+	                  flags,
+	                  op_flags,
+	                  kv_update_fn,
+	                  kv_update_fn_arg);
+}
+
+void *kv_store_set_value_atom(sid_resource_t *          kv_store_res,
+                              const kv_store_atom_t *   atom,
+                              void *                    value,
+                              size_t                    value_size,
+                              kv_store_value_flags_t    flags,
+                              kv_store_value_op_flags_t op_flags,
+                              kv_store_update_fn_t      kv_update_fn,
+                              void *                    kv_update_fn_arg)
+{
+	return _set_value(sid_resource_get_data(kv_store_res),
+	                  atom->key,
+	                  atom->key_len,
+	                  value,
+	                  value_size,
+	                  flags,
+	                  op_flags,
+	                  kv_update_fn,
+	                  kv_update_fn_arg);
+}
+
+static void *_get_value(struct kv_store *       kv_store,
+                        const char *            key,
+                        uint32_t                key_len,
+                        size_t *                value_size,
+                        kv_store_value_flags_t *flags)
 {
-	struct kv_store *      kv_store = sid_resource_get_data(kv_store_res);
 	struct kv_store_value *found;
 
-	if (!(found = hash_lookup(kv_store->ht, key, strlen(key) + 1, NULL)))
+	if (!_filter_may_contain(kv_store, key, key_len))
+		return NULL;
+
+	if (_image_fault_in(kv_store, key, key_len) < 0)
+		return NULL;
+
+	found = _lookup(kv_store, key, key_len);
+	_filter_account_lookup(kv_store, found);
+
+	if (!found)
 		return NULL;
 
 	if (value_size)
@@ -417,50 +1235,294 @@ void *kv_store_get_value(sid_resource_t *kv_store_res, const char *key, size_t *
 	return _get_data(found);
 }
 
-int kv_store_unset_value(sid_resource_t *kv_store_res, const char *key, kv_store_update_fn_t kv_unset_fn, void *kv_unset_fn_arg)
+void *kv_store_get_value(sid_resource_t *kv_store_res, const char *key, size_t *value_size, kv_store_value_flags_t *flags)
+{
+	return _get_value(sid_resource_get_data(kv_store_res), key, strlen(key) + 1, value_size, flags);
+}
+
+void *kv_store_get_value_atom(sid_resource_t *        kv_store_res,
+                              const kv_store_atom_t * atom,
+                              size_t *                value_size,
+                              kv_store_value_flags_t *flags)
+{
+	return _get_value(sid_resource_get_data(kv_store_res), atom->key, atom->key_len, value_size, flags);
+}
+
+static int _hash_unset_fn(const char *               key,
+                          uint32_t                   key_len,
+                          struct kv_store_value *    old_value,
+                          size_t                     old_value_len,
+                          struct kv_store_value **   new_value,
+                          size_t *                   new_value_len,
+                          struct kv_update_fn_relay *relay)
 {
-	struct kv_store *           kv_store = sid_resource_get_data(kv_store_res);
-	struct kv_store_value *     found;
 	struct kv_store_update_spec update_spec = {0};
 
-	/*
-	 * FIXME: hash_lookup and hash_remove are two searches inside hash - maybe try to do
-	 *        this in one step (...that requires hash interface extension).
-	 */
-	if (!(found = hash_lookup(kv_store->ht, key, strlen(key) + 1, NULL)))
+	if (!old_value) {
+		relay->ret_code = -ENODATA;
+		return HASH_UPDATE_KEEP;
+	}
+
+	if (relay->kv_update_fn) {
+		update_spec.old_data      = _get_data(old_value);
+		update_spec.old_data_size = old_value->size;
+		update_spec.old_flags     = old_value->ext_flags;
+
+		if (!relay->kv_update_fn(relay->key, &update_spec, relay->kv_update_fn_arg)) {
+			relay->ret_code = -EREMOTEIO;
+			return HASH_UPDATE_KEEP;
+		}
+	}
+
+	if (_snapshot_old_value(relay->kv_store, key, key_len, old_value) < 0) {
+		relay->ret_code = -ENOMEM;
+		return HASH_UPDATE_KEEP;
+	}
+
+	_account(relay->kv_store, key, key_len, old_value, old_value_len, false);
+	relay->kv_store->garbage++;
+	_release_kv_store_value(old_value);
+	return HASH_UPDATE_REMOVE;
+}
+
+static int _unset_value(struct kv_store *    kv_store,
+                        const char *         key,
+                        uint32_t             key_len,
+                        kv_store_update_fn_t kv_unset_fn,
+                        void *               kv_unset_fn_arg)
+{
+	struct kv_update_fn_relay relay = {.kv_store         = kv_store,
+	                                   .key              = key,
+	                                   .kv_update_fn     = kv_unset_fn,
+	                                   .kv_update_fn_arg = kv_unset_fn_arg};
+	int                       r;
+
+	if (!_filter_may_contain(kv_store, key, key_len))
 		return -ENODATA;
 
-	update_spec.old_data      = _get_data(found);
-	update_spec.old_data_size = found->size;
-	update_spec.old_flags     = found->ext_flags;
+	if ((r = _image_fault_in(kv_store, key, key_len)) < 0)
+		return r;
+
+	/* lookup, resolution and removal is done with one search only */
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			hash_update(kv_store->ht, key, key_len, NULL, NULL, (hash_update_fn_t) _hash_unset_fn, &relay);
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			radix_update(kv_store->rt, key, key_len, NULL, NULL, (radix_update_fn_t) _hash_unset_fn, &relay);
+			break;
+	}
+
+	if (!relay.ret_code) {
+		_filter_remove(kv_store);
+		_dirty_add(kv_store, key, key_len);
+	}
 
-	if (kv_unset_fn && !kv_unset_fn(key, &update_spec, kv_unset_fn_arg))
-		return -EREMOTEIO;
+	return relay.ret_code;
+}
 
-	_destroy_kv_store_value(found);
-	hash_remove(kv_store->ht, key, strlen(key) + 1);
+int kv_store_unset_value(sid_resource_t *kv_store_res, const char *key, kv_store_update_fn_t kv_unset_fn, void *kv_unset_fn_arg)
+{
+	return _unset_value(sid_resource_get_data(kv_store_res), key, strlen(key) + 1, kv_unset_fn, kv_unset_fn_arg);
+}
 
-	return 0;
+int kv_store_unset_value_atom(sid_resource_t *       kv_store_res,
+                              const kv_store_atom_t *atom,
+                              kv_store_update_fn_t   kv_unset_fn,
+                              void *                 kv_unset_fn_arg)
+{
+	return _unset_value(sid_resource_get_data(kv_store_res), atom->key, atom->key_len, kv_unset_fn, kv_unset_fn_arg);
+}
+
+const kv_store_atom_t *kv_store_atom_get(sid_resource_t *kv_store_res, const char *key)
+{
+	struct kv_store *     kv_store = sid_resource_get_data(kv_store_res);
+	uint32_t              key_len  = strlen(key) + 1;
+	struct kv_store_atom *atom;
+	const char *          p;
+
+	if (!kv_store->atoms &&
+	    !(kv_store->atoms = hash_create_with_params(64, &((struct hash_params) {.grow_load = 100}))))
+		return NULL;
+
+	if ((atom = hash_lookup(kv_store->atoms, key, key_len, NULL))) {
+		atom->refs++;
+		return atom;
+	}
+
+	if (!(atom = mem_zalloc(sizeof(*atom) + key_len)))
+		return NULL;
+
+	memcpy(atom->key, key, key_len);
+	atom->key_len = key_len;
+
+	/* split the key into parts separated by KV_STORE_KEY_JOIN just once */
+	for (p = atom->key; p && atom->part_count < KV_STORE_ATOM_MAX_PARTS; atom->part_count++) {
+		atom->part_offset[atom->part_count] = p - atom->key;
+		if ((p = strstr(p, KV_STORE_KEY_JOIN)))
+			p += KV_STORE_KEY_JOIN_LEN;
+	}
+
+	if (hash_insert(kv_store->atoms, atom->key, key_len, atom, sizeof(*atom) + key_len) < 0) {
+		free(atom);
+		return NULL;
+	}
+
+	atom->id   = kv_store->atom_count++;
+	atom->refs = 1;
+
+	return atom;
+}
+
+void kv_store_atom_put(sid_resource_t *kv_store_res, const kv_store_atom_t *atom)
+{
+	struct kv_store *     kv_store = sid_resource_get_data(kv_store_res);
+	struct kv_store_atom *a        = (struct kv_store_atom *) atom;
+
+	if (!a || --a->refs)
+		return;
+
+	hash_remove(kv_store->atoms, a->key, a->key_len);
+	free(a);
+}
+
+uint32_t kv_store_atom_get_id(const kv_store_atom_t *atom)
+{
+	return atom->id;
+}
+
+const char *kv_store_atom_get_key(const kv_store_atom_t *atom)
+{
+	return atom->key;
+}
+
+const char *kv_store_atom_get_part(const kv_store_atom_t *atom, unsigned part, bool to_end, size_t *len)
+{
+	if (part >= atom->part_count)
+		return NULL;
+
+	if (len) {
+		if (to_end || part == atom->part_count - 1)
+			*len = atom->key_len - 1 - atom->part_offset[part];
+		else
+			*len = atom->part_offset[part + 1] - KV_STORE_KEY_JOIN_LEN - atom->part_offset[part];
+	}
+
+	return atom->key + atom->part_offset[part];
 }
 
 kv_store_iter_t *kv_store_iter_create(sid_resource_t *kv_store_res)
+{
+	return kv_store_iter_create_prefix(kv_store_res, NULL);
+}
+
+kv_store_iter_t *kv_store_iter_create_prefix(sid_resource_t *kv_store_res, const char *prefix)
+{
+	kv_store_iter_t *iter;
+
+	if (!(iter = mem_zalloc(sizeof(*iter))))
+		return NULL;
+
+	if (prefix) {
+		if (!(iter->prefix = strdup(prefix))) {
+			free(iter);
+			return NULL;
+		}
+		iter->prefix_len = strlen(prefix);
+	}
+
+	iter->store = sid_resource_get_data(kv_store_res);
+
+	if (_image_fault_in_prefix(iter->store, iter->prefix, iter->prefix_len) < 0) {
+		kv_store_iter_destroy(iter);
+		return NULL;
+	}
+
+	if (iter->store->backend == KV_STORE_BACKEND_HASH) {
+		hash_rehash_pause(iter->store->ht);
+		iter->rehash_paused = true;
+	}
+
+	return iter;
+}
+
+kv_store_snapshot_t *kv_store_snapshot_create(sid_resource_t *kv_store_res)
+{
+	struct kv_store *    kv_store = sid_resource_get_data(kv_store_res);
+	kv_store_snapshot_t *snapshot;
+
+	/* the snapshot iterator relies on keys being ordered */
+	if (kv_store->backend != KV_STORE_BACKEND_RADIX)
+		return NULL;
+
+	if (!(snapshot = mem_zalloc(sizeof(*snapshot))))
+		return NULL;
+
+	if (!(snapshot->old_values = radix_create())) {
+		free(snapshot);
+		return NULL;
+	}
+
+	snapshot->store = kv_store;
+	list_add(&kv_store->snapshots, &snapshot->list);
+
+	return snapshot;
+}
+
+void kv_store_snapshot_destroy(kv_store_snapshot_t *snapshot)
+{
+	radix_iter(snapshot->old_values, (radix_iterate_fn) _unref_kv_store_value);
+	radix_destroy(snapshot->old_values);
+	list_del(&snapshot->list);
+	free(snapshot);
+}
+
+kv_store_iter_t *kv_store_iter_create_snapshot(kv_store_snapshot_t *snapshot, const char *prefix)
 {
 	kv_store_iter_t *iter;
 
-	if (!(iter = malloc(sizeof(*iter))))
+	if (!(iter = mem_zalloc(sizeof(*iter))))
 		return NULL;
 
-	iter->store   = sid_resource_get_data(kv_store_res);
-	iter->current = NULL;
+	if (prefix) {
+		if (!(iter->prefix = strdup(prefix))) {
+			free(iter);
+			return NULL;
+		}
+		iter->prefix_len = strlen(prefix);
+	}
+
+	iter->store    = snapshot->store;
+	iter->snapshot = snapshot;
+
+	if (_image_fault_in_prefix(iter->store, iter->prefix, iter->prefix_len) < 0) {
+		kv_store_iter_destroy(iter);
+		return NULL;
+	}
 
 	return iter;
 }
 
+static struct kv_store_value *_get_iter_value(kv_store_iter_t *iter)
+{
+	if (iter->snapshot || iter->dirty)
+		return iter->snapshot_value;
+
+	switch (iter->store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			return iter->current.ht ? hash_get_data(iter->store->ht, iter->current.ht, NULL) : NULL;
+		case KV_STORE_BACKEND_RADIX:
+			return iter->current.rt ? radix_get_data(iter->store->rt, iter->current.rt, NULL) : NULL;
+	}
+
+	return NULL;
+}
+
 void *kv_store_iter_current(kv_store_iter_t *iter, size_t *size, kv_store_value_flags_t *flags)
 {
 	struct kv_store_value *value;
 
-	if (!(value = iter->current ? hash_get_data(iter->store->ht, iter->current, NULL) : NULL))
+	if (!(value = _get_iter_value(iter)))
 		return NULL;
 
 	if (size)
@@ -474,58 +1536,1109 @@ void *kv_store_iter_current(kv_store_iter_t *iter, size_t *size, kv_store_value_
 
 const char *kv_store_iter_current_key(kv_store_iter_t *iter)
 {
-	return iter->current ? hash_get_key(iter->store->ht, iter->current, NULL) : NULL;
+	if (iter->snapshot || iter->dirty)
+		return iter->snapshot_value ? iter->last_key : NULL;
+
+	switch (iter->store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			return iter->current.ht ? hash_get_key(iter->store->ht, iter->current.ht, NULL) : NULL;
+		case KV_STORE_BACKEND_RADIX:
+			return iter->current.rt ? radix_get_key(iter->store->rt, iter->current.rt, NULL) : NULL;
+	}
+
+	return NULL;
+}
+
+static int _set_iter_last_key(kv_store_iter_t *iter, const char *key, uint32_t key_len)
+{
+	char *p;
+
+	if (key_len > iter->last_key_size) {
+		if (!(p = realloc(iter->last_key, key_len)))
+			return -ENOMEM;
+		iter->last_key      = p;
+		iter->last_key_size = key_len;
+	}
+
+	memcpy(iter->last_key, key, key_len);
+	iter->last_key_len = key_len;
+
+	return 0;
+}
+
+static struct kv_store_value *_snapshot_iter_next(kv_store_iter_t *iter)
+{
+	struct radix_tree *    live_rt = iter->store->rt;
+	struct radix_tree *    old_rt  = iter->snapshot->old_values;
+	struct radix_node *    live_node, *old_node;
+	const char *           live_key = NULL, *old_key = NULL;
+	uint32_t               live_key_len = 0, old_key_len = 0;
+	struct kv_store_value *value;
+	int                    r;
+
+	do {
+		if (iter->last_key_len) {
+			live_node = radix_get_next_after(live_rt, iter->last_key, iter->last_key_len, iter->prefix, iter->prefix_len);
+			old_node  = radix_get_next_after(old_rt, iter->last_key, iter->last_key_len, iter->prefix, iter->prefix_len);
+		} else {
+			live_node = radix_get_first(live_rt, iter->prefix, iter->prefix_len);
+			old_node  = radix_get_first(old_rt, iter->prefix, iter->prefix_len);
+		}
+
+		if (!live_node && !old_node)
+			return NULL;
+
+		if (live_node)
+			live_key = radix_get_key(live_rt, live_node, &live_key_len);
+		if (old_node)
+			old_key = radix_get_key(old_rt, old_node, &old_key_len);
+
+		if (live_node && old_node)
+			r = _compare_keys(live_key, live_key_len, old_key, old_key_len);
+		else
+			r = live_node ? -1 : 1;
+
+		/* for the same key, the value recorded in the snapshot wins */
+		if (r < 0) {
+			value = radix_get_data(live_rt, live_node, NULL);
+			r     = _set_iter_last_key(iter, live_key, live_key_len);
+		} else {
+			value = radix_get_data(old_rt, old_node, NULL);
+			r     = _set_iter_last_key(iter, old_key, old_key_len);
+		}
+
+		if (r < 0)
+			return NULL;
+	} while (value == &_no_value);
+
+	return value;
+}
+
+static struct kv_store_value *_dirty_iter_next(kv_store_iter_t *iter)
+{
+	struct radix_tree *    dirty_rt = iter->store->dirty;
+	struct radix_node *    node;
+	const char *           key;
+	uint32_t               key_len;
+	struct kv_store_value *value;
+
+	if (!dirty_rt)
+		return NULL;
+
+	do {
+		if (iter->last_key_len)
+			node = radix_get_next_after(dirty_rt, iter->last_key, iter->last_key_len, NULL, 0);
+		else
+			node = radix_get_first(dirty_rt, NULL, 0);
+
+		if (!node)
+			return NULL;
+
+		key = radix_get_key(dirty_rt, node, &key_len);
+
+		if (_set_iter_last_key(iter, key, key_len) < 0)
+			return NULL;
+
+		/* skip keys which were unset */
+	} while (!(value = _lookup(iter->store, key, key_len)));
+
+	return value;
 }
 
 void *kv_store_iter_next(kv_store_iter_t *iter, size_t *size, kv_store_value_flags_t *flags)
 {
-	iter->current = iter->current ? hash_get_next(iter->store->ht, iter->current) : hash_get_first(iter->store->ht);
+	struct hash_table *ht;
+	struct radix_tree *rt;
+
+	if (iter->snapshot) {
+		iter->snapshot_value = _snapshot_iter_next(iter);
+		return kv_store_iter_current(iter, size, flags);
+	}
+
+	if (iter->dirty) {
+		iter->snapshot_value = _dirty_iter_next(iter);
+		return kv_store_iter_current(iter, size, flags);
+	}
+
+	switch (iter->store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			/* hash backend is not ordered, so we need to go through all keys and check the prefix */
+			ht = iter->store->ht;
+			do
+				iter->current.ht = iter->current.ht ? hash_get_next(ht, iter->current.ht) : hash_get_first(ht);
+			while (iter->current.ht && iter->prefix &&
+			       strncmp(hash_get_key(ht, iter->current.ht, NULL), iter->prefix, iter->prefix_len));
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			rt               = iter->store->rt;
+			iter->current.rt = iter->current.rt ? radix_get_next(rt, iter->current.rt, iter->prefix, iter->prefix_len)
+			                                    : radix_get_first(rt, iter->prefix, iter->prefix_len);
+			break;
+	}
 
 	return kv_store_iter_current(iter, size, flags);
 }
 
 void kv_store_iter_reset(kv_store_iter_t *iter)
 {
-	iter->current = NULL;
+	iter->current.ht     = NULL;
+	iter->current.rt     = NULL;
+	iter->snapshot_value = NULL;
+	iter->last_key_len   = 0;
 }
 
 void kv_store_iter_destroy(kv_store_iter_t *iter)
 {
+	if (iter->rehash_paused)
+		hash_rehash_resume(iter->store->ht);
+
+	free(iter->last_key);
+	free(iter->prefix);
 	free(iter);
 }
 
-static int _init_kv_store(sid_resource_t *kv_store_res, const void *kickstart_data, void **data)
+int kv_store_dirty_track(sid_resource_t *kv_store_res, bool enable)
 {
-	const struct sid_kv_store_resource_params *params = kickstart_data;
-	struct kv_store *                          kv_store;
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
 
-	if (!(kv_store = mem_zalloc(sizeof(*kv_store)))) {
-		log_error(ID(kv_store_res), "Failed to allocate key-value store structure.");
-		goto out;
+	if (!enable) {
+		if (kv_store->dirty) {
+			radix_destroy(kv_store->dirty);
+			kv_store->dirty = NULL;
+		}
+		return 0;
 	}
 
-	if (!(kv_store->ht = hash_create(params->hash.initial_size))) {
-		log_error(ID(kv_store_res), "Failed to create hash table for key-value store.");
-		goto out;
-	}
+	if (!kv_store->dirty && !(kv_store->dirty = radix_create()))
+		return -ENOMEM;
 
-	*data = kv_store;
 	return 0;
-out:
-	if (kv_store) {
-		if (kv_store->ht)
-			hash_destroy(kv_store->ht);
-		free(kv_store);
-	}
-	return -1;
 }
 
-static int _destroy_kv_store(sid_resource_t *kv_store_res)
+int kv_store_dirty_reset(sid_resource_t *kv_store_res)
+{
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+
+	if (!kv_store->dirty)
+		return -ENOTSUP;
+
+	/* reset is done after all dirty records are handled so recreating the tree is just fine */
+	radix_destroy(kv_store->dirty);
+	kv_store->dirty = NULL;
+
+	return kv_store_dirty_track(kv_store_res, true);
+}
+
+int kv_store_dirty_get_count(sid_resource_t *kv_store_res, unsigned *count)
+{
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+
+	if (!kv_store->dirty)
+		return -ENOTSUP;
+
+	*count = radix_get_num_entries(kv_store->dirty);
+	return 0;
+}
+
+uint64_t kv_store_get_generation(sid_resource_t *kv_store_res)
+{
+	return ((struct kv_store *) sid_resource_get_data(kv_store_res))->generation;
+}
+
+void kv_store_set_generation(sid_resource_t *kv_store_res, uint64_t generation)
+{
+	((struct kv_store *) sid_resource_get_data(kv_store_res))->generation = generation;
+}
+
+kv_store_iter_t *kv_store_iter_create_dirty(sid_resource_t *kv_store_res)
 {
 	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+	kv_store_iter_t *iter;
+
+	if (!kv_store->dirty)
+		return NULL;
+
+	if (!(iter = mem_zalloc(sizeof(*iter))))
+		return NULL;
+
+	iter->store = kv_store;
+	iter->dirty = true;
+
+	return iter;
+}
+
+static size_t _align_size(size_t size)
+{
+	return (size + KV_STORE_ALIGN - 1) & ~(KV_STORE_ALIGN - 1);
+}
+
+static int _image_record_cmp(const void *a, const void *b, void *arg)
+{
+	const struct kv_store_image_record *rec1 = a, *rec2 = b;
+	const char *                        map  = arg;
+
+	return _compare_keys(map + rec1->key_offset, rec1->key_len, map + rec2->key_offset, rec2->key_len);
+}
+
+int kv_store_image_write(sid_resource_t *kv_store_res, const char *path, uint64_t seqnum)
+{
+	struct kv_store *             kv_store = sid_resource_get_data(kv_store_res);
+	kv_store_iter_t *             iter     = NULL;
+	char *                        tmp_path = NULL;
+	char *                        map      = MAP_FAILED;
+	struct kv_store_image_header *header;
+	struct kv_store_image_record *rec;
+	kv_store_value_flags_t        flags;
+	const char *                  key;
+	void *                        value;
+	size_t                        size, key_len, keys_size = 0, values_size = 0, record_count = 0, image_size = 0;
+	size_t                        key_offset, value_offset;
+	int                           fd = -1;
+	int                           r;
+
+	if (!(iter = kv_store_iter_create(kv_store_res))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* first pass to calculate the size of the image */
+	while ((value = kv_store_iter_next(iter, &size, &flags))) {
+		keys_size += strlen(kv_store_iter_current_key(iter)) + 1;
+		values_size += _align_size(_get_encoded_value_size(value, size, flags));
+		record_count++;
+	}
+
+	key_offset   = sizeof(*header) + record_count * sizeof(*rec);
+	value_offset = _align_size(key_offset + keys_size);
+	image_size   = value_offset + values_size;
+
+	if (asprintf(&tmp_path, "%s.tmp", path) < 0) {
+		tmp_path = NULL;
+		r        = -ENOMEM;
+		goto out;
+	}
+
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (ftruncate(fd, image_size) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if ((map = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		r = -errno;
+		goto out;
+	}
+
+	header = (struct kv_store_image_header *) map;
+	memcpy(header->magic, KV_STORE_IMAGE_MAGIC, sizeof(header->magic));
+	header->version      = KV_STORE_IMAGE_VERSION;
+	header->record_count = record_count;
+	header->size         = image_size;
+	header->seqnum       = seqnum;
+
+	/* second pass to fill in the records */
+	rec = (struct kv_store_image_record *) (map + sizeof(*header));
+	kv_store_iter_reset(iter);
+
+	while ((value = kv_store_iter_next(iter, &size, &flags))) {
+		key     = kv_store_iter_current_key(iter);
+		key_len = strlen(key) + 1;
+
+		memcpy(map + key_offset, key, key_len);
+		rec->key_offset   = key_offset;
+		rec->key_len      = key_len;
+		rec->value_offset = value_offset;
+		rec->value_size   = size;
+		rec->flags        = flags & KV_STORE_VALUE_VECTOR;
+		key_offset += key_len;
+		value_offset = _align_size(value_offset + _encode_value(map + value_offset, value, size, flags));
+		rec++;
+	}
+
+	/* image lookups rely on records sorted by key */
+	if (kv_store->backend != KV_STORE_BACKEND_RADIX)
+		qsort_r(map + sizeof(*header), record_count, sizeof(*rec), _image_record_cmp, map);
+
+	if (munmap(map, image_size) < 0) {
+		map = MAP_FAILED;
+		r   = -errno;
+		goto out;
+	}
+	map = MAP_FAILED;
+
+	if (fdatasync(fd) < 0 || rename(tmp_path, path) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	r = 0;
+out:
+	if (map != MAP_FAILED)
+		(void) munmap(map, image_size);
+	if (fd >= 0) {
+		(void) close(fd);
+		if (r < 0)
+			(void) unlink(tmp_path);
+	}
+	free(tmp_path);
+	if (iter)
+		kv_store_iter_destroy(iter);
+
+	if (r < 0)
+		log_error_errno(ID(kv_store_res), r, "Failed to write key-value store image %s", path);
+
+	return r;
+}
+
+static int _image_check(struct kv_store_image *image)
+{
+	struct kv_store_image_header *header = (struct kv_store_image_header *) image->map;
+	struct kv_store_image_record *rec;
+	const char *                  prev_key     = NULL;
+	uint32_t                      prev_key_len = 0;
+	uint64_t                      i;
+
+	if (image->size < sizeof(*header) || memcmp(header->magic, KV_STORE_IMAGE_MAGIC, sizeof(header->magic)) ||
+	    header->version != KV_STORE_IMAGE_VERSION || header->size != image->size ||
+	    header->record_count > (image->size - sizeof(*header)) / sizeof(*rec))
+		return -EBADMSG;
+
+	image->records      = (struct kv_store_image_record *) (image->map + sizeof(*header));
+	image->record_count = header->record_count;
+
+	/*
+	 * Check keys only so we can search the image safely. The values
+	 * are checked as they are loaded so we don't need to touch them here.
+	 */
+	for (i = 0; i < image->record_count; i++) {
+		rec = &image->records[i];
+
+		if (!rec->key_len || rec->key_offset > image->size || rec->key_len > image->size - rec->key_offset ||
+		    image->map[rec->key_offset + rec->key_len - 1] || rec->value_offset > image->size ||
+		    (rec->flags & ~KV_STORE_VALUE_VECTOR))
+			return -EBADMSG;
+
+		if (prev_key && _compare_keys(prev_key, prev_key_len, image->map + rec->key_offset, rec->key_len) >= 0)
+			return -EBADMSG;
+
+		prev_key     = image->map + rec->key_offset;
+		prev_key_len = rec->key_len;
+	}
+
+	return 0;
+}
+
+int kv_store_image_load(sid_resource_t *kv_store_res, const char *path, uint64_t *seqnum)
+{
+	struct kv_store *      kv_store = sid_resource_get_data(kv_store_res);
+	struct kv_store_image *image    = NULL;
+	struct stat            st;
+	size_t                 capacity;
+	int                    fd = -1;
+	int                    r;
+
+	if (kv_store->image)
+		return -EBUSY;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (!(image = mem_zalloc(sizeof(*image)))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	image->size = st.st_size;
+
+	if (image->size < sizeof(struct kv_store_image_header)) {
+		r = -EBADMSG;
+		goto out;
+	}
+
+	if ((image->map = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		image->map = NULL;
+		r          = -errno;
+		goto out;
+	}
+
+	if ((r = _image_check(image)) < 0)
+		goto out;
+
+	if (image->record_count && !(image->loaded = bitmap_create(image->record_count, false, &r)))
+		goto out;
+
+	if (seqnum)
+		*seqnum = ((struct kv_store_image_header *) image->map)->seqnum;
+
+	image->pending_count = image->record_count;
+	kv_store->image      = image;
+
+	if (!image->pending_count)
+		_image_release(kv_store);
+	else if (kv_store->filter) {
+		capacity = kv_store->filter_capacity;
+		while (capacity < kv_store->filter_keys + image->pending_count)
+			capacity *= 2;
+
+		/* the filter must not miss any keys from the image, drop it if we can't rebuild it */
+		if (_filter_rebuild(kv_store, capacity) < 0) {
+			log_warning(ID(kv_store_res), "Failed to rebuild key-value store filter, disabling the filter.");
+			bloom_destroy(kv_store->filter);
+			kv_store->filter = NULL;
+		}
+	}
+
+	r = 0;
+out:
+	if (fd >= 0)
+		(void) close(fd);
+
+	if (r < 0) {
+		if (image) {
+			if (image->map)
+				(void) munmap(image->map, image->size);
+			free(image);
+		}
+
+		if (r != -ENOENT)
+			log_error_errno(ID(kv_store_res), r, "Failed to load key-value store image %s", path);
+	}
+
+	return r;
+}
+
+/* FNV-1a */
+static uint32_t _journal_checksum(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	uint32_t             h = UINT32_C(2166136261);
+	size_t               i;
+
+	for (i = 0; i < size; i++)
+		h = (h ^ p[i]) * UINT32_C(16777619);
+
+	return h;
+}
+
+static int _journal_replay_entry(sid_resource_t *kv_store_res, struct kv_store_journal_entry *entry)
+{
+	char *       key = (char *) (entry + 1);
+	struct iovec iov_internal, *iov;
+	int          iov_cnt;
+	int          r;
+
+	if (entry->flags & KV_STORE_JOURNAL_UNSET) {
+		r = kv_store_unset_value(kv_store_res, key, NULL, NULL);
+		return r == -ENODATA ? 0 : r;
+	}
+
+	if ((r = _decode_value(key + entry->key_len,
+	                       (char *) entry + entry->size,
+	                       entry->value_size,
+	                       entry->flags,
+	                       &iov_internal,
+	                       &iov,
+	                       &iov_cnt)) < 0)
+		return r;
+
+	if (entry->flags & KV_STORE_VALUE_VECTOR) {
+		r = kv_store_set_value(kv_store_res, key, iov, iov_cnt, entry->flags, KV_STORE_VALUE_NO_OP, NULL, NULL)
+		            ? 0
+		            : -ENOMEM;
+		free(iov);
+	} else
+		r = kv_store_set_value(kv_store_res,
+		                       key,
+		                       iov->iov_base,
+		                       iov->iov_len,
+		                       entry->flags,
+		                       KV_STORE_VALUE_NO_OP,
+		                       NULL,
+		                       NULL)
+		            ? 0
+		            : -ENOMEM;
+
+	return r;
+}
+
+/*
+ * Replay journal entries newer than 'seqnum'. Returns the size of the valid part of the
+ * journal in 'valid_size' and the highest seqnum found in 'last_seqnum'.
+ */
+static int _journal_replay(sid_resource_t *kv_store_res,
+                           int             fd,
+                           size_t          size,
+                           uint64_t        seqnum,
+                           off_t *         valid_size,
+                           uint64_t *      last_seqnum)
+{
+	struct kv_store_journal_entry *entry;
+	char *                         map, *p;
+	uint32_t                       checksum;
+	int                            r = 0;
+
+	*valid_size  = 0;
+	*last_seqnum = seqnum;
+
+	if (!size)
+		return 0;
+
+	if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return -errno;
+
+	for (p = map; (size_t) (map + size - p) >= sizeof(*entry); p += entry->size) {
+		entry = (struct kv_store_journal_entry *) p;
+
+		if (entry->size < sizeof(*entry) || entry->size > (size_t) (map + size - p) || !entry->key_len ||
+		    entry->key_len > entry->size - sizeof(*entry) || p[sizeof(*entry) + entry->key_len - 1])
+			break;
+
+		/* the mapping is private so we can zero the checksum field in place */
+		checksum        = entry->checksum;
+		entry->checksum = 0;
+		if (_journal_checksum(entry, entry->size) != checksum)
+			break;
+
+		if (entry->seqnum > seqnum && (r = _journal_replay_entry(kv_store_res, entry)) < 0)
+			break;
+
+		if (entry->seqnum > *last_seqnum)
+			*last_seqnum = entry->seqnum;
+
+		*valid_size = p + entry->size - map;
+	}
+
+	(void) munmap(map, size);
+	return r;
+}
+
+kv_store_journal_t *kv_store_journal_open(sid_resource_t *kv_store_res, const char *path, uint64_t seqnum, int *ret_code)
+{
+	kv_store_journal_t *journal = NULL;
+	struct stat         st;
+	int                 r;
+
+	if (!(journal = mem_zalloc(sizeof(*journal)))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if ((journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (fstat(journal->fd, &st) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if ((r = _journal_replay(kv_store_res, journal->fd, st.st_size, seqnum, &journal->size, &journal->seqnum)) < 0)
+		goto out;
+
+	if (journal->size < st.st_size) {
+		log_warning(ID(kv_store_res),
+		            "Dropping %jd bytes of incomplete entries at the end of key-value store journal %s.",
+		            (intmax_t) (st.st_size - journal->size),
+		            path);
+
+		if (ftruncate(journal->fd, journal->size) < 0) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	r = 0;
+out:
+	if (r < 0) {
+		log_error_errno(ID(kv_store_res), r, "Failed to open key-value store journal %s", path);
+		if (journal) {
+			if (journal->fd >= 0)
+				(void) close(journal->fd);
+			free(journal);
+			journal = NULL;
+		}
+	}
+
+	if (ret_code)
+		*ret_code = r;
+
+	return journal;
+}
+
+void kv_store_journal_close(kv_store_journal_t *journal)
+{
+	(void) close(journal->fd);
+	free(journal->buf);
+	free(journal);
+}
+
+static int _journal_add(kv_store_journal_t *journal, const char *key, void *value, size_t value_size, uint32_t flags)
+{
+	struct kv_store_journal_entry *entry;
+	size_t                         key_len = strlen(key) + 1;
+	size_t                         entry_size, encoded_size = 0;
+	size_t                         new_buf_size;
+	char *                         p;
+
+	if (!(flags & KV_STORE_JOURNAL_UNSET))
+		encoded_size = _get_encoded_value_size(value, value_size, flags);
+
+	/* keep the entries aligned */
+	entry_size = _align_size(sizeof(*entry) + key_len + encoded_size);
+
+	if (entry_size > UINT32_MAX)
+		return -E2BIG;
+
+	if (journal->buf_used + entry_size > journal->buf_size) {
+		new_buf_size = journal->buf_size ? journal->buf_size : 4096;
+		while (new_buf_size < journal->buf_used + entry_size)
+			new_buf_size *= 2;
+
+		if (!(p = realloc(journal->buf, new_buf_size)))
+			return -ENOMEM;
+
+		journal->buf      = p;
+		journal->buf_size = new_buf_size;
+	}
+
+	p     = journal->buf + journal->buf_used;
+	entry = (struct kv_store_journal_entry *) p;
+
+	*entry = (struct kv_store_journal_entry) {
+		.size       = entry_size,
+		.seqnum     = journal->seqnum + 1,
+		.value_size = flags & KV_STORE_JOURNAL_UNSET ? 0 : value_size,
+		.key_len    = key_len,
+		.flags      = flags & (KV_STORE_VALUE_VECTOR | KV_STORE_JOURNAL_UNSET),
+	};
+
+	memcpy(p + sizeof(*entry), key, key_len);
+
+	if (encoded_size)
+		(void) _encode_value(p + sizeof(*entry) + key_len, value, value_size, flags);
+
+	memset(p + sizeof(*entry) + key_len + encoded_size, 0, entry_size - sizeof(*entry) - key_len - encoded_size);
+
+	entry->checksum = _journal_checksum(entry, entry_size);
+
+	journal->buf_used += entry_size;
+	journal->seqnum++;
+
+	return 0;
+}
+
+int kv_store_journal_add_set(kv_store_journal_t *   journal,
+                             const char *           key,
+                             void *                 value,
+                             size_t                 value_size,
+                             kv_store_value_flags_t flags)
+{
+	return _journal_add(journal, key, value, value_size, flags & KV_STORE_VALUE_VECTOR);
+}
+
+int kv_store_journal_add_unset(kv_store_journal_t *journal, const char *key)
+{
+	return _journal_add(journal, key, NULL, 0, KV_STORE_JOURNAL_UNSET);
+}
+
+int kv_store_journal_commit(kv_store_journal_t *journal)
+{
+	size_t  done = 0;
+	ssize_t n;
+	int     r = 0;
+
+	if (!journal->buf_used)
+		return 0;
+
+	/* one write and one sync for all the entries added since last commit */
+	while (done < journal->buf_used) {
+		if ((n = pwrite(journal->fd, journal->buf + done, journal->buf_used - done, journal->size + done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			r = -errno;
+			goto out;
+		}
+		done += n;
+	}
+
+	if (fdatasync(journal->fd) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	journal->size += done;
+out:
+	/* do not leave partially written entries behind */
+	if (r < 0)
+		(void) ftruncate(journal->fd, journal->size);
+
+	journal->buf_used = 0;
+	return r;
+}
+
+int kv_store_journal_reset(kv_store_journal_t *journal)
+{
+	journal->buf_used = 0;
+
+	if (ftruncate(journal->fd, 0) < 0)
+		return -errno;
+
+	journal->size = 0;
+	return 0;
+}
+
+uint64_t kv_store_journal_get_seqnum(kv_store_journal_t *journal)
+{
+	return journal->seqnum;
+}
+
+/*
+ * Compaction.
+ *
+ * Values which are not references are moved one by one into a new arena while the
+ * compaction goes through the records in key order, the radix tree nodes are moved
+ * into newly allocated memory together with them. Values moved by previous compaction
+ * are in the old arena which is released as a whole once all records are moved again.
+ *
+ * Values in arenas are never freed separately so memory of values removed or replaced
+ * after they were moved is only released by next compaction, 'garbage' counts these too.
+ */
+static int _set_compact_key(struct kv_store *kv_store, const char *key, uint32_t key_len)
+{
+	char *p;
+
+	if (key_len > kv_store->compact_key_size) {
+		if (!(p = realloc(kv_store->compact_key, key_len)))
+			return -ENOMEM;
+		kv_store->compact_key      = p;
+		kv_store->compact_key_size = key_len;
+	}
+
+	memcpy(kv_store->compact_key, key, key_len);
+	kv_store->compact_key_len = key_len;
+
+	return 0;
+}
+
+static struct kv_store_value *_repack_kv_store_value(struct kv_store *kv_store, struct kv_store_value *value, size_t value_size)
+{
+	struct kv_store_value *new_value;
+	struct iovec *         iov;
+	size_t                 i;
+
+	if (!(new_value = arena_alloc(kv_store->compact_arena, value_size)))
+		return NULL;
+
+	memcpy(new_value, value, value_size);
+	new_value->int_flags |= KV_STORE_VALUE_INT_ARENA;
+
+	/* E - the vector points to parts stored right behind it */
+	if (value->ext_flags & KV_STORE_VALUE_VECTOR) {
+		iov = (struct iovec *) new_value->data;
+		for (i = 0; i < new_value->size; i++)
+			iov[i].iov_base = new_value->data + ((char *) iov[i].iov_base - value->data);
+	}
+
+	return new_value;
+}
+
+int kv_store_compact_start(sid_resource_t *kv_store_res)
+{
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+	struct arena *   arena;
+
+	/* values allocated from arena_chunk_size arena are not released before the store is destroyed anyway */
+	if (kv_store->backend != KV_STORE_BACKEND_RADIX || kv_store->arena)
+		return -ENOTSUP;
+
+	if (kv_store->compacting)
+		return 0;
+
+	if (!(arena = arena_create(KV_STORE_COMPACT_ARENA_CHUNK_SIZE)))
+		return -ENOMEM;
+
+	kv_store->compact_old_arena = kv_store->compact_arena;
+	kv_store->compact_arena     = arena;
+	kv_store->compact_key_len   = 0;
+	kv_store->compacting        = true;
+	kv_store->garbage           = 0;
+
+	return 0;
+}
+
+int kv_store_compact_step(sid_resource_t *kv_store_res, unsigned max_records)
+{
+	struct kv_store *      kv_store = sid_resource_get_data(kv_store_res);
+	struct radix_node *    node;
+	struct kv_store_value *value, *new_value;
+	const char *           key;
+	uint32_t               key_len;
+	size_t                 value_size;
+	unsigned               i;
+	int                    r;
+
+	if (!kv_store->compacting)
+		return 0;
+
+	/* snapshots may still reference values in the old arena */
+	if (!list_is_empty(&kv_store->snapshots))
+		return -EBUSY;
+
+	for (i = 0; i < max_records; i++) {
+		if (kv_store->compact_key_len)
+			node = radix_get_next_after(kv_store->rt, kv_store->compact_key, kv_store->compact_key_len, NULL, 0);
+		else
+			node = radix_get_first(kv_store->rt, NULL, 0);
+
+		if (!node) {
+			if (kv_store->compact_old_arena) {
+				arena_destroy(kv_store->compact_old_arena);
+				kv_store->compact_old_arena = NULL;
+			}
+			kv_store->compacting = false;
+			kv_store->compactions++;
+			return 0;
+		}
+
+		key       = radix_get_key(kv_store->rt, node, &key_len);
+		value     = radix_get_data(kv_store->rt, node, &value_size);
+		new_value = NULL;
+
+		/* references point to memory owned by the caller, only the record itself could be moved */
+		if (!(value->ext_flags & KV_STORE_VALUE_REF) && !(new_value = _repack_kv_store_value(kv_store, value, value_size)))
+			return -ENOMEM;
+
+		if ((r = _set_compact_key(kv_store, key, key_len)) < 0)
+			return r;
+
+		if (new_value) {
+			(void) radix_insert(kv_store->rt, kv_store->compact_key, key_len, new_value, value_size);
+			_destroy_kv_store_value(value);
+		}
+
+		radix_repack_node(kv_store->rt, node);
+	}
+
+	return 1;
+}
+
+int kv_store_get_filter_stats(sid_resource_t *kv_store_res, struct kv_store_filter_stats *stats)
+{
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+
+	if (!kv_store->filter)
+		return -ENOTSUP;
+
+	*stats = kv_store->filter_stats;
+	return 0;
+}
+
+int kv_store_get_stats(sid_resource_t *kv_store_res, struct kv_store_stats *stats)
+{
+	struct kv_store *kv_store = sid_resource_get_data(kv_store_res);
+
+	*stats = (struct kv_store_stats) {0};
+
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			stats->records        = hash_get_num_entries(kv_store->ht);
+			stats->hash_entries   = stats->records;
+			stats->hash_slots     = hash_get_num_slots(kv_store->ht);
+			stats->hash_chain_max = hash_get_max_chain_len(kv_store->ht);
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			stats->records = radix_get_num_entries(kv_store->rt);
+			radix_get_shape(kv_store->rt, &stats->radix_nodes, &stats->radix_depth_max);
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (kv_store->atoms) {
+		stats->atom_entries   = hash_get_num_entries(kv_store->atoms);
+		stats->atom_slots     = hash_get_num_slots(kv_store->atoms);
+		stats->atom_chain_max = hash_get_max_chain_len(kv_store->atoms);
+	}
+
+	if (kv_store->image)
+		stats->image_pending = kv_store->image->pending_count;
+
+	stats->garbage     = kv_store->garbage;
+	stats->compactions = kv_store->compactions;
+
+	return 0;
+}
+
+int kv_store_iterate_accounts(sid_resource_t *              kv_store_res,
+                              unsigned                      account_class,
+                              kv_store_account_iterate_fn_t account_fn,
+                              void *                        arg)
+{
+	struct kv_store *        kv_store = sid_resource_get_data(kv_store_res);
+	struct kv_store_account *account;
+	struct hash_node *       n;
+	int                      r;
+
+	if (account_class >= KV_STORE_ACCOUNT_CLASS_COUNT)
+		return -EINVAL;
+
+	if (!kv_store->account_fn)
+		return -ENOTSUP;
+
+	hash_iterate (n, kv_store->accounts[account_class]) {
+		account = hash_get_data(kv_store->accounts[account_class], n, NULL);
+
+		if ((r = account_fn(hash_get_key(kv_store->accounts[account_class], n, NULL), &account->stats, arg)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static void _destroy_accounts(struct kv_store *kv_store)
+{
+	unsigned i;
+
+	for (i = 0; i < KV_STORE_ACCOUNT_CLASS_COUNT; i++) {
+		if (kv_store->accounts[i]) {
+			hash_iter(kv_store->accounts[i], free);
+			hash_destroy(kv_store->accounts[i]);
+		}
+	}
+}
+
+static int _init_kv_store(sid_resource_t *kv_store_res, const void *kickstart_data, void **data)
+{
+	const struct sid_kv_store_resource_params *params = kickstart_data;
+	struct kv_store *                          kv_store;
+	unsigned                                   i;
+
+	if (!(kv_store = mem_zalloc(sizeof(*kv_store)))) {
+		log_error(ID(kv_store_res), "Failed to allocate key-value store structure.");
+		goto out;
+	}
+
+	kv_store->backend = params->backend;
+	kv_store->res     = kv_store_res;
+	list_init(&kv_store->snapshots);
+
+	if (params->account_fn) {
+		for (i = 0; i < KV_STORE_ACCOUNT_CLASS_COUNT; i++) {
+			if (!(kv_store->accounts[i] = hash_create(32))) {
+				log_error(ID(kv_store_res), "Failed to create accounts for key-value store.");
+				goto out;
+			}
+			kv_store->account_soft_limit[i] = params->account_soft_limit[i];
+		}
+		kv_store->account_fn = params->account_fn;
+	}
+
+	if (params->arena_chunk_size && !(kv_store->arena = arena_create(params->arena_chunk_size))) {
+		log_error(ID(kv_store_res), "Failed to create arena for key-value store.");
+		goto out;
+	}
+
+	if (params->filter_size_hint) {
+		if (!(kv_store->filter =
+		              bloom_create(_filter_get_bit_count(params->filter_size_hint), KV_STORE_FILTER_HASH_COUNT))) {
+			log_error(ID(kv_store_res), "Failed to create filter for key-value store.");
+			goto out;
+		}
+		kv_store->filter_capacity = params->filter_size_hint;
+	}
+
+	switch (params->backend) {
+		case KV_STORE_BACKEND_HASH:
+			if (!(kv_store->ht = hash_create_with_params(params->hash.initial_size,
+			                                             &((struct hash_params) {.grow_load   = params->hash.grow_load,
+			                                                                     .shrink_load = params->hash.shrink_load,
+			                                                                     .arena       = kv_store->arena})))) {
+				log_error(ID(kv_store_res), "Failed to create hash table for key-value store.");
+				goto out;
+			}
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			if (!(kv_store->rt = radix_create())) {
+				log_error(ID(kv_store_res), "Failed to create radix tree for key-value store.");
+				goto out;
+			}
+			break;
+		default:
+			log_error(ID(kv_store_res), "Unknown key-value store backend.");
+			goto out;
+	}
+
+	*data = kv_store;
+	return 0;
+out:
+	if (kv_store) {
+		_destroy_accounts(kv_store);
+		if (kv_store->filter)
+			bloom_destroy(kv_store->filter);
+		if (kv_store->arena)
+			arena_destroy(kv_store->arena);
+		free(kv_store);
+	}
+	return -1;
+}
+
+static int _destroy_kv_store(sid_resource_t *kv_store_res)
+{
+	struct kv_store *         kv_store = sid_resource_get_data(kv_store_res);
+	struct kv_store_snapshot *snapshot, *tmp_snapshot;
+
+	list_iterate_items_safe_back (snapshot, tmp_snapshot, &kv_store->snapshots)
+		kv_store_snapshot_destroy(snapshot);
+
+	switch (kv_store->backend) {
+		case KV_STORE_BACKEND_HASH:
+			hash_iter(kv_store->ht, (hash_iterate_fn) _destroy_kv_store_value);
+			hash_destroy(kv_store->ht);
+			break;
+		case KV_STORE_BACKEND_RADIX:
+			radix_iter(kv_store->rt, (radix_iterate_fn) _destroy_kv_store_value);
+			radix_destroy(kv_store->rt);
+			break;
+	}
+
+	if (kv_store->atoms) {
+		hash_iter(kv_store->atoms, free);
+		hash_destroy(kv_store->atoms);
+	}
+
+	if (kv_store->image)
+		_image_release(kv_store);
+
+	if (kv_store->filter)
+		bloom_destroy(kv_store->filter);
+
+	if (kv_store->dirty)
+		radix_destroy(kv_store->dirty);
+
+	_destroy_accounts(kv_store);
+
+	if (kv_store->arena)
+		arena_destroy(kv_store->arena);
+
+	if (kv_store->compact_arena)
+		arena_destroy(kv_store->compact_arena);
+
+	if (kv_store->compact_old_arena)
+		arena_destroy(kv_store->compact_old_arena);
 
-	hash_iter(kv_store->ht, (hash_iterate_fn) _destroy_kv_store_value);
-	hash_destroy(kv_store->ht);
+	free(kv_store->compact_key);
 	free(kv_store);
 
 	return 0;
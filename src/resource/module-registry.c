@@ -47,15 +47,23 @@ struct module_registry {
 	sid_resource_iter_t *        module_iter;
 };
 
+typedef enum
+{
+	MODULE_STATE_INDEXED, /* only known by name, not loaded yet (MODULE_REGISTRY_LAZY) */
+	MODULE_STATE_LOADED,
+	MODULE_STATE_FAILED,
+} module_state_t;
+
 struct module {
-	module_fn_t *init_fn;
-	module_fn_t *exit_fn;
-	module_fn_t *reset_fn;
-	char *       full_name;
-	char *       name;
-	void *       handle;
-	void **      symbols;
-	void *       data;
+	module_state_t state;
+	module_fn_t *  init_fn;
+	module_fn_t *  exit_fn;
+	module_fn_t *  reset_fn;
+	char *         full_name;
+	char *         name;
+	void *         handle;
+	void **        symbols;
+	void *         data;
 };
 
 static int _set_module_name(struct module_registry *registry, struct module *module, const char *name)
@@ -78,22 +86,135 @@ static int _set_module_name(struct module_registry *registry, struct module *mod
 	return 0;
 }
 
-static sid_resource_t *_find_module(sid_resource_t *module_registry_res, const char *module_name)
+typedef void (*generic_t)(void);
+
+static int _load_module_symbol(sid_resource_t *                   module_res,
+                               void *                             dl_handle,
+                               const struct module_symbol_params *params,
+                               void **                            symbol_store)
 {
-	struct module_registry *registry = sid_resource_get_data(module_registry_res);
-	sid_resource_t *        res, *found = NULL;
+	void *symbol;
 
-	sid_resource_iter_reset(registry->module_iter);
-	while ((res = sid_resource_iter_next(registry->module_iter))) {
-		if (sid_resource_match(res, &sid_resource_type_module, NULL)) {
-			if (!strcmp(((struct module *) sid_resource_get_data(res))->name, module_name)) {
-				found = res;
-				break;
-			}
-		}
+	if (!(symbol = dlsym(dl_handle, params->name))) {
+		if (params->flags & MODULE_SYMBOL_FAIL_ON_MISSING) {
+			log_error(ID(module_res), "Failed to load symbol %s: %s.", params->name, dlerror());
+			return -1;
+		} else if (params->flags & MODULE_SYMBOL_WARN_ON_MISSING)
+			log_warning(ID(module_res), "Symbol %s not loaded.", params->name);
+	}
+
+	if (params->flags & MODULE_SYMBOL_INDIRECT)
+		symbol = symbol ? *((generic_t **) symbol) : NULL;
+
+	*symbol_store = symbol;
+	return 0;
+}
+
+#define MODULE_PRIO_NAME  "module_prio"
+#define MODULE_INIT_NAME  "module_init"
+#define MODULE_EXIT_NAME  "module_exit"
+#define MODULE_RESET_NAME "module_reset"
+
+static struct module_registry *_get_registry(sid_resource_t *module_res)
+{
+	return sid_resource_get_data(sid_resource_search(module_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
+}
+
+static int _load_module(sid_resource_t *module_res, struct module_registry *registry, struct module *module)
+{
+	struct module_symbol_params symbol_params = {0};
+	char                        path[PATH_MAX];
+	int64_t *                   p_prio;
+	unsigned                    i;
+
+	if (snprintf(path,
+	             sizeof(path) - 1,
+	             "%s/%s%s%s",
+	             registry->directory,
+	             registry->module_prefix ?: "",
+	             module->name,
+	             registry->module_suffix ?: "") < 0) {
+		log_error(ID(module_res), "Failed to create module path.");
+		goto fail;
+	}
+
+	if (!(module->handle = dlopen(path, RTLD_NOW))) {
+		log_error(ID(module_res), "Failed to open module: %s.", dlerror());
+		goto fail;
 	}
 
-	return found;
+	/* module priority value is direct symbol */
+	symbol_params.name = MODULE_PRIO_NAME;
+	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &p_prio) < 0)
+		goto fail;
+
+	if (p_prio && (sid_resource_set_prio(module_res, *p_prio) < 0))
+		goto fail;
+
+	/* function symbols are indirect symbols */
+	symbol_params.flags = MODULE_SYMBOL_INDIRECT;
+
+	symbol_params.name = MODULE_RESET_NAME;
+	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->reset_fn) < 0)
+		goto fail;
+
+	symbol_params.flags |= MODULE_SYMBOL_FAIL_ON_MISSING;
+	symbol_params.name = MODULE_INIT_NAME;
+	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->init_fn) < 0)
+		goto fail;
+
+	symbol_params.name = MODULE_EXIT_NAME;
+	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->exit_fn) < 0)
+		goto fail;
+
+	for (i = 0; i < registry->symbol_count; i++) {
+		if (_load_module_symbol(module_res, module->handle, &registry->symbol_params[i], &module->symbols[i]) < 0)
+			goto fail;
+	}
+
+	if (module->init_fn(module, registry->cb_arg) < 0) {
+		log_error(ID(module_res), "Module-specific initialization failed.");
+		goto fail;
+	}
+
+	module->state = MODULE_STATE_LOADED;
+	return 0;
+fail:
+	if (module->handle) {
+		(void) dlclose(module->handle);
+		module->handle = NULL;
+	}
+	module->init_fn  = NULL;
+	module->exit_fn  = NULL;
+	module->reset_fn = NULL;
+	memset(module->symbols, 0, registry->symbol_count * sizeof(void *));
+	module->state = MODULE_STATE_FAILED;
+	return -1;
+}
+
+/*
+ * With MODULE_REGISTRY_LAZY, preloading only creates the module resources so
+ * the modules are looked up by name as before, but opening the module and
+ * resolving its symbols is left until the module is used for the first time.
+ */
+static int _ensure_module_loaded(sid_resource_t *module_res)
+{
+	struct module *module = sid_resource_get_data(module_res);
+
+	switch (module->state) {
+		case MODULE_STATE_LOADED:
+			return 0;
+		case MODULE_STATE_INDEXED:
+			return _load_module(module_res, _get_registry(module_res), module);
+		default:
+			return -1;
+	}
+}
+
+static sid_resource_t *_find_module(sid_resource_t *module_registry_res, const char *module_name)
+{
+	/* module name is the same as module resource id so let the search use child index */
+	return sid_resource_search(module_registry_res, SID_RESOURCE_SEARCH_IMM_DESC, &sid_resource_type_module, module_name);
 }
 
 sid_resource_t *module_registry_load_module(sid_resource_t *module_registry_res, const char *module_name)
@@ -102,6 +223,11 @@ sid_resource_t *module_registry_load_module(sid_resource_t *module_registry_res,
 	sid_resource_t *        module_res;
 
 	if ((module_res = _find_module(module_registry_res, module_name))) {
+		if (_ensure_module_loaded(module_res) < 0) {
+			log_error(ID(module_registry_res), "Failed to load module %s/%s.", registry->directory, module_name);
+			return NULL;
+		}
+
 		log_debug(ID(module_registry_res),
 		          "Module %s/%s already loaded, skipping load request.",
 		          registry->directory,
@@ -120,6 +246,12 @@ sid_resource_t *module_registry_load_module(sid_resource_t *module_registry_res,
 		return NULL;
 	}
 
+	if (_ensure_module_loaded(module_res) < 0) {
+		log_error(ID(module_registry_res), "Failed to load module %s/%s.", registry->directory, module_name);
+		(void) sid_resource_destroy(module_res);
+		return NULL;
+	}
+
 	return module_res;
 }
 
@@ -142,12 +274,54 @@ int module_registry_get_module_symbols(sid_resource_t *module_res, const void **
 		return 0;
 	}
 
+	if (_ensure_module_loaded(module_res) < 0) {
+		*ret = NULL;
+		return -1;
+	}
+
 	module = sid_resource_get_data(module_res);
 	*ret   = (const void **) module->symbols;
 
 	return 0;
 }
 
+int module_registry_load_modules(sid_resource_t *module_registry_res)
+{
+	struct module_registry *registry = sid_resource_get_data(module_registry_res);
+	sid_resource_iter_t *   iter;
+	sid_resource_t *        res;
+	struct module *         module;
+	int                     count = 0;
+
+	if (!(iter = sid_resource_iter_create(module_registry_res)))
+		return -ENOMEM;
+
+	/* loading a module may change its priority and position among the modules so start over each time */
+	while (true) {
+		sid_resource_iter_reset(iter);
+
+		while ((res = sid_resource_iter_next(iter))) {
+			module = sid_resource_get_data(res);
+			if (module->state != MODULE_STATE_LOADED)
+				break;
+		}
+
+		if (!res)
+			break;
+
+		/* modules which can not be loaded are dropped, just like the ones failing to preload */
+		if (module->state == MODULE_STATE_INDEXED && _load_module(res, registry, module) == 0)
+			count++;
+		else {
+			log_error(ID(module_registry_res), "Failed to load module %s/%s.", registry->directory, module->name);
+			(void) sid_resource_destroy(res);
+		}
+	}
+
+	sid_resource_iter_destroy(iter);
+	return count;
+}
+
 static const char module_reset_failed_msg[] = "Module-specific reset failed.";
 
 int module_registry_reset_modules(sid_resource_t *module_registry_res)
@@ -174,9 +348,8 @@ int module_registry_reset_modules(sid_resource_t *module_registry_res)
 
 int module_registry_reset_module(sid_resource_t *module_res)
 {
-	struct module_registry *registry =
-		sid_resource_get_data(sid_resource_search(module_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
-	struct module *module = sid_resource_get_data(module_res);
+	struct module_registry *registry = _get_registry(module_res);
+	struct module *         module   = sid_resource_get_data(module_res);
 
 	if (module->reset_fn && module->reset_fn(module, registry->cb_arg) < 0) {
 		log_error(ID(module_res), module_reset_failed_msg);
@@ -308,45 +481,11 @@ out:
 	return r;
 }
 
-typedef void (*generic_t)(void);
-
-static int _load_module_symbol(sid_resource_t *                   module_res,
-                               void *                             dl_handle,
-                               const struct module_symbol_params *params,
-                               void **                            symbol_store)
-{
-	void *symbol;
-
-	if (!(symbol = dlsym(dl_handle, params->name))) {
-		if (params->flags & MODULE_SYMBOL_FAIL_ON_MISSING) {
-			log_error(ID(module_res), "Failed to load symbol %s: %s.", params->name, dlerror());
-			return -1;
-		} else if (params->flags & MODULE_SYMBOL_WARN_ON_MISSING)
-			log_warning(ID(module_res), "Symbol %s not loaded.", params->name);
-	}
-
-	if (params->flags & MODULE_SYMBOL_INDIRECT)
-		symbol = symbol ? *((generic_t **) symbol) : NULL;
-
-	*symbol_store = symbol;
-	return 0;
-}
-
-#define MODULE_PRIO_NAME  "module_prio"
-#define MODULE_INIT_NAME  "module_init"
-#define MODULE_EXIT_NAME  "module_exit"
-#define MODULE_RESET_NAME "module_reset"
-
 static int _init_module(sid_resource_t *module_res, const void *kickstart_data, void **data)
 {
-	struct module_registry *registry =
-		sid_resource_get_data(sid_resource_search(module_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
-	struct module_symbol_params symbol_params = {0};
-	struct module *             module        = NULL;
-	char                        path[PATH_MAX];
-	int64_t *                   p_prio;
-	unsigned                    i;
-	int                         r;
+	struct module_registry *registry = _get_registry(module_res);
+	struct module *         module   = NULL;
+	int                     r;
 
 	if (!(module = mem_zalloc(sizeof(*module)))) {
 		log_error(ID(module_res), "Failed to allocate module structure.");
@@ -363,63 +502,15 @@ static int _init_module(sid_resource_t *module_res, const void *kickstart_data,
 		goto fail;
 	}
 
-	if (snprintf(path,
-	             sizeof(path) - 1,
-	             "%s/%s%s%s",
-	             registry->directory,
-	             registry->module_prefix ?: "",
-	             module->name,
-	             registry->module_suffix ?: "") < 0) {
-		log_error(ID(module_res), "Failed to create module path.");
-		goto fail;
-	}
-
-	if (!(module->handle = dlopen(path, RTLD_NOW))) {
-		log_error(ID(module_res), "Failed to open module: %s.", dlerror());
-		goto fail;
-	}
-
-	/* module priority value is direct symbol */
-	symbol_params.name = MODULE_PRIO_NAME;
-	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &p_prio) < 0)
-		goto fail;
+	module->state = MODULE_STATE_INDEXED;
+	*data         = module;
 
-	if (p_prio && (sid_resource_set_prio(module_res, *p_prio) < 0))
+	if (!(registry->flags & MODULE_REGISTRY_LAZY) && _load_module(module_res, registry, module) < 0)
 		goto fail;
 
-	/* function symbols are indirect symbols */
-	symbol_params.flags = MODULE_SYMBOL_INDIRECT;
-
-	symbol_params.name = MODULE_RESET_NAME;
-	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->reset_fn) < 0)
-		goto fail;
-
-	symbol_params.flags |= MODULE_SYMBOL_FAIL_ON_MISSING;
-	symbol_params.name = MODULE_INIT_NAME;
-	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->init_fn) < 0)
-		goto fail;
-
-	symbol_params.name = MODULE_EXIT_NAME;
-	if (_load_module_symbol(module_res, module->handle, &symbol_params, (void **) &module->exit_fn) < 0)
-		goto fail;
-
-	for (i = 0; i < registry->symbol_count; i++) {
-		if (_load_module_symbol(module_res, module->handle, &registry->symbol_params[i], &module->symbols[i]) < 0)
-			goto fail;
-	}
-
-	*data = module;
-
-	if (module->init_fn(module, registry->cb_arg) < 0) {
-		log_error(ID(module_res), "Module-specific initialization failed.");
-		goto fail;
-	}
-
 	return 0;
 fail:
 	if (module) {
-		if (module->handle)
-			(void) dlclose(module->handle);
 		free(module->full_name);
 		free(module->symbols);
 		free(module);
@@ -429,15 +520,17 @@ fail:
 
 static int _destroy_module(sid_resource_t *module_res)
 {
-	struct module_registry *registry =
-		sid_resource_get_data(sid_resource_search(module_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
-	struct module *module = sid_resource_get_data(module_res);
+	struct module_registry *registry = _get_registry(module_res);
+	struct module *         module   = sid_resource_get_data(module_res);
 
-	if (module->exit_fn(module, registry->cb_arg) < 0)
-		log_error(ID(module_res), "Module-specific finalization failed.");
+	/* modules which were never loaded have nothing to finalize */
+	if (module->state == MODULE_STATE_LOADED) {
+		if (module->exit_fn(module, registry->cb_arg) < 0)
+			log_error(ID(module_res), "Module-specific finalization failed.");
 
-	if (dlclose(module->handle) < 0)
-		log_error(ID(module_res), "Failed to close %s module handle: %s.", module->name, dlerror());
+		if (dlclose(module->handle) < 0)
+			log_error(ID(module_res), "Failed to close %s module handle: %s.", module->name, dlerror());
+	}
 
 	free(module->symbols);
 	free(module->full_name);
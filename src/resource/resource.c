@@ -19,8 +19,10 @@
 
 #include "resource/resource.h"
 
+#include "base/hash.h"
 #include "base/list.h"
 #include "base/mem.h"
+#include "base/util.h"
 #include "log/log.h"
 
 #include <stdio.h>
@@ -31,6 +33,10 @@
 #include <systemd/sd-event.h>
 #include <unistd.h>
 
+#define CHILD_INDEX_MIN_COUNT 8   /* index children of a resource once it has this many */
+#define CHILD_INDEX_KEY_SIZE  256 /* children with longer composed key are not indexed */
+#define EVENT_STATS_KEY_SIZE  256 /* event sources with longer composed key are not recorded */
+
 typedef struct sid_resource {
 	struct list                list;
 	const sid_resource_type_t *type;
@@ -38,11 +44,17 @@ typedef struct sid_resource {
 	unsigned                   ref_count;
 	sid_resource_t *           parent;
 	struct list                children;
+	unsigned                   child_count;
+	struct hash_table *        child_index; /* first child for each (type, id), created if there are many children */
 	sid_resource_flags_t       flags;
 	int64_t                    prio;
 	struct {
-		sd_event *sd_event_loop;
-		int       signalfd;
+		sd_event *                        sd_event_loop;
+		int                               signalfd;
+		struct hash_table *               es_stats;            /* per "<type name>/<event source name>", if enabled */
+		uint64_t                          handler_budget_usec; /* longer handler run is reported as stall, 0 = no budget */
+		uint64_t                          stall_count;
+		struct sid_resource_event_source *dispatched_es;       /* set while its handler runs, cleared if destroyed */
 	} event_loop;
 	struct list                event_sources;
 	struct service_link_group *slg;
@@ -58,14 +70,147 @@ typedef struct sid_resource_iter {
 } sid_resource_iter_t;
 
 typedef struct sid_resource_event_source {
-	struct list      list;
-	sid_resource_t * res;
-	sd_event_source *sd_es;
-	const char *     name;
-	void *           handler;
-	void *           data;
+	struct list                      list;
+	sid_resource_t *                 res;
+	sd_event_source *                sd_es;
+	const char *                     name;
+	void *                           handler;
+	void *                           data;
+	sid_resource_t *                 res_event_loop;
+	struct sid_resource_event_stats *stats; /* owned by resource with event loop, NULL if not enabled */
 } sid_resource_event_source_t;
 
+/* state of one handler call, kept aside as the handler may destroy the event source */
+struct event_dispatch {
+	sid_resource_event_source_t *    es;
+	sid_resource_t *                 res_event_loop;
+	struct sid_resource_event_stats *stats;
+	uint64_t                         start_usec;
+};
+
+sid_resource_t *_get_resource_with_event_loop(sid_resource_t *res, int error_if_not_found);
+
+static struct sid_resource_event_stats *_get_event_stats(sid_resource_t *res_event_loop, sid_resource_event_source_t *es)
+{
+	struct sid_resource_event_stats *stats;
+	char                             key[EVENT_STATS_KEY_SIZE];
+	int                              key_len;
+
+	key_len = snprintf(key, sizeof(key), "%s/%s", es->res->type->name ?: "", es->name);
+
+	if (key_len < 0 || (size_t) key_len >= sizeof(key))
+		return NULL;
+
+	/* store the key with the terminating NUL so it can be used as a name directly */
+	key_len++;
+
+	if ((stats = hash_lookup(res_event_loop->event_loop.es_stats, key, key_len, NULL)))
+		return stats;
+
+	if (!(stats = mem_zalloc(sizeof(*stats))))
+		return NULL;
+
+	if (hash_insert(res_event_loop->event_loop.es_stats, key, key_len, stats, sizeof(*stats)) < 0) {
+		free(stats);
+		return NULL;
+	}
+
+	return stats;
+}
+
+static void _attach_event_stats(sid_resource_t *res_event_loop, sid_resource_t *res)
+{
+	sid_resource_event_source_t *es;
+	sid_resource_t *             child_res;
+
+	list_iterate_items (es, &res->event_sources) {
+		if (!es->stats)
+			es->stats = _get_event_stats(res_event_loop, es);
+	}
+
+	list_iterate_items (child_res, &res->children) {
+		/* event sources of child with its own event loop belong to that loop */
+		if (!child_res->event_loop.sd_event_loop)
+			_attach_event_stats(res_event_loop, child_res);
+	}
+}
+
+static void _destroy_event_stats(struct hash_table *es_stats)
+{
+	struct hash_node *n;
+
+	hash_iterate (n, es_stats)
+		free(hash_get_data(es_stats, n, NULL));
+
+	hash_destroy(es_stats);
+}
+
+static void _record_event_stats(struct sid_resource_event_stats *stats, uint64_t usec)
+{
+	unsigned bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+
+	if (bucket >= SID_RESOURCE_EVENT_STATS_HIST_SIZE)
+		bucket = SID_RESOURCE_EVENT_STATS_HIST_SIZE - 1;
+
+	stats->dispatch_count++;
+	stats->usec_total += usec;
+	stats->usec_hist[bucket]++;
+
+	if (usec > stats->usec_max)
+		stats->usec_max = usec;
+}
+
+/*
+ * Returns false if neither statistics nor handler budget is set for the event
+ * source and so the handler does not need to be timed at all.
+ */
+static bool _start_dispatch(sid_resource_event_source_t *es, struct event_dispatch *dispatch)
+{
+	sid_resource_t *res_event_loop = es->res_event_loop;
+
+	if (!es->stats && !res_event_loop->event_loop.handler_budget_usec)
+		return false;
+
+	dispatch->es             = es;
+	dispatch->res_event_loop = res_event_loop;
+	dispatch->stats          = es->stats;
+	dispatch->start_usec     = util_time_get_now_usec(CLOCK_MONOTONIC);
+
+	res_event_loop->event_loop.dispatched_es = es;
+	return true;
+}
+
+static void _end_dispatch(struct event_dispatch *dispatch)
+{
+	sid_resource_t *res_event_loop = dispatch->res_event_loop;
+	uint64_t        usec           = util_time_get_now_usec(CLOCK_MONOTONIC) - dispatch->start_usec;
+	uint64_t        budget_usec    = res_event_loop->event_loop.handler_budget_usec;
+
+	if (dispatch->stats)
+		_record_event_stats(dispatch->stats, usec);
+
+	if (budget_usec && usec > budget_usec) {
+		res_event_loop->event_loop.stall_count++;
+
+		if (dispatch->stats)
+			dispatch->stats->stall_count++;
+
+		if (res_event_loop->event_loop.dispatched_es == dispatch->es)
+			log_warning(dispatch->es->res->id,
+			            "Event source %s handler took %" PRIu64 " us, over budget of %" PRIu64 " us.",
+			            dispatch->es->name,
+			            usec,
+			            budget_usec);
+		else
+			log_warning(res_event_loop->id,
+			            "Handler of removed event source took %" PRIu64 " us, over budget of %" PRIu64 " us.",
+			            usec,
+			            budget_usec);
+	}
+
+	res_event_loop->event_loop.dispatched_es = NULL;
+}
+
 static int _create_event_source(sid_resource_t *              res,
                                 const char *                  name,
                                 sd_event_source *             sd_es,
@@ -75,6 +220,7 @@ static int _create_event_source(sid_resource_t *              res,
 {
 	static const char            unnamed[] = "unnamed";
 	sid_resource_event_source_t *new_es;
+	sid_resource_t *             res_event_loop;
 	int                          r = 0;
 
 	if (!(new_es = malloc(sizeof(*new_es)))) {
@@ -86,6 +232,7 @@ static int _create_event_source(sid_resource_t *              res,
 	new_es->sd_es   = sd_es;
 	new_es->handler = handler;
 	new_es->data    = data;
+	new_es->stats   = NULL;
 
 	sd_event_source_set_userdata(sd_es, new_es);
 	if (name) {
@@ -102,7 +249,13 @@ static int _create_event_source(sid_resource_t *              res,
 		if (sd_event_source_set_description(sd_es, name) < 0 || sd_event_source_get_description(sd_es, &new_es->name) < 0)
 			name = new_es->name = unnamed;
 	} else
-		name = unnamed;
+		name = new_es->name = unnamed;
+
+	/* callers make sure there is an event loop */
+	new_es->res_event_loop = res_event_loop = _get_resource_with_event_loop(res, 1);
+
+	if (res_event_loop->event_loop.es_stats)
+		new_es->stats = _get_event_stats(res_event_loop, new_es);
 
 	log_debug(res->id, "Event source created: %s.", name);
 
@@ -118,8 +271,14 @@ out:
 
 static void _destroy_event_source(sid_resource_event_source_t *es)
 {
+	sid_resource_t *res_event_loop;
+
 	log_debug(es->res->id, "Event source removed: %s.", es->name);
 
+	/* es->res_event_loop is not used here, it may be gone if es->res has been isolated */
+	if ((res_event_loop = _get_resource_with_event_loop(es->res, 0)) && res_event_loop->event_loop.dispatched_es == es)
+		res_event_loop->event_loop.dispatched_es = NULL;
+
 	sd_event_source_unref(es->sd_es);
 	list_del(&es->list);
 	free(es);
@@ -159,6 +318,87 @@ out:
 	return r;
 }
 
+/*
+ * Compose key for the child index from type and id. Returns key length or 0 if the
+ * key does not fit the buffer - such children are not indexed and searched linearly.
+ */
+static uint32_t _get_child_index_key(const sid_resource_type_t *type, const char *id, char *key, size_t key_size)
+{
+	size_t id_len = strlen(id);
+
+	if (sizeof(type) + id_len > key_size)
+		return 0;
+
+	memcpy(key, &type, sizeof(type));
+	memcpy(key + sizeof(type), id, id_len);
+
+	return sizeof(type) + id_len;
+}
+
+static bool _res_has_id_part(sid_resource_t *res)
+{
+	return !res->type->name || strlen(res->id) > strlen(res->type->name);
+}
+
+static void _index_child(sid_resource_t *parent_res, sid_resource_t *res)
+{
+	char            key[CHILD_INDEX_KEY_SIZE];
+	uint32_t        key_len;
+	sid_resource_t *indexed_res;
+
+	if (!_res_has_id_part(res) ||
+	    !(key_len = _get_child_index_key(res->type, sid_resource_get_id(res), key, sizeof(key))))
+		return;
+
+	/* children are ordered by prio and a new child goes after the existing ones with the same prio */
+	if ((indexed_res = hash_lookup(parent_res->child_index, key, key_len, NULL)) && res->prio >= indexed_res->prio)
+		return;
+
+	if (hash_insert(parent_res->child_index, key, key_len, res, 0) < 0) {
+		/* without complete index, fall back to linear search */
+		hash_destroy(parent_res->child_index);
+		parent_res->child_index = NULL;
+	}
+}
+
+static void _unindex_child(sid_resource_t *parent_res, sid_resource_t *res)
+{
+	char            key[CHILD_INDEX_KEY_SIZE];
+	uint32_t        key_len;
+	sid_resource_t *child_res;
+
+	if (!_res_has_id_part(res) ||
+	    !(key_len = _get_child_index_key(res->type, sid_resource_get_id(res), key, sizeof(key))) ||
+	    hash_lookup(parent_res->child_index, key, key_len, NULL) != res)
+		return;
+
+	hash_remove(parent_res->child_index, key, key_len);
+
+	/* index the next child with the same type and id, if any */
+	list_iterate_items (child_res, &parent_res->children) {
+		if (child_res != res && child_res->type == res->type && _res_has_id_part(child_res) &&
+		    !strcmp(sid_resource_get_id(child_res), sid_resource_get_id(res))) {
+			_index_child(parent_res, child_res);
+			break;
+		}
+	}
+}
+
+static void _create_child_index(sid_resource_t *parent_res)
+{
+	sid_resource_t *child_res;
+
+	if (!(parent_res->child_index = hash_create(2 * parent_res->child_count)))
+		return;
+
+	list_iterate_items (child_res, &parent_res->children) {
+		_index_child(parent_res, child_res);
+
+		if (!parent_res->child_index)
+			break;
+	}
+}
+
 static void _add_res_to_parent_res(sid_resource_t *res, sid_resource_t *parent_res)
 {
 	sid_resource_t *child_res;
@@ -173,6 +413,13 @@ static void _add_res_to_parent_res(sid_resource_t *res, sid_resource_t *parent_r
 
 		list_add(child_lh, &res->list);
 		res->ref_count++;
+
+		parent_res->child_count++;
+
+		if (parent_res->child_index)
+			_index_child(parent_res, res);
+		else if (parent_res->child_count >= CHILD_INDEX_MIN_COUNT)
+			_create_child_index(parent_res);
 	}
 }
 
@@ -180,6 +427,11 @@ static void _remove_res_from_parent_res(sid_resource_t *res)
 {
 	if (res->parent) {
 		list_del(&res->list);
+		res->parent->child_count--;
+
+		if (res->parent->child_index)
+			_unindex_child(res->parent, res);
+
 		res->parent = NULL;
 		res->ref_count--;
 	}
@@ -274,9 +526,15 @@ fail:
 		if (res->event_loop.sd_event_loop)
 			sd_event_unref(res->event_loop.sd_event_loop);
 
+		if (res->event_loop.es_stats)
+			_destroy_event_stats(res->event_loop.es_stats);
+
 		if (res->slg)
 			service_link_group_destroy_with_members(res->slg);
 
+		if (res->child_index)
+			hash_destroy(res->child_index);
+
 		/* Drop the termporary reference! */
 		res->ref_count--;
 
@@ -330,6 +588,11 @@ int sid_resource_destroy(sid_resource_t *res)
 		res->event_loop.signalfd = -1;
 	}
 
+	if (res->event_loop.es_stats) {
+		_destroy_event_stats(res->event_loop.es_stats);
+		res->event_loop.es_stats = NULL;
+	}
+
 	_remove_res_from_parent_res(res);
 
 	if (res->ref_count > 0)
@@ -341,6 +604,9 @@ int sid_resource_destroy(sid_resource_t *res)
 	if (res->slg)
 		service_link_group_destroy_with_members(res->slg);
 
+	if (res->child_index)
+		hash_destroy(res->child_index);
+
 	if (pid == res->pid_created)
 		log_debug(res->id, "%s.", msg_destroyed);
 	else
@@ -439,7 +705,16 @@ sid_resource_t *_get_resource_with_event_loop(sid_resource_t *res, int error_if_
 static int _sd_io_event_handler(sd_event_source *sd_es, int fd, uint32_t revents, void *data)
 {
 	sid_resource_event_source_t *es = data;
-	return ((sid_resource_io_event_handler_t) es->handler)(es, fd, revents, es->data);
+	struct event_dispatch        dispatch;
+	int                          r;
+
+	if (!_start_dispatch(es, &dispatch))
+		return ((sid_resource_io_event_handler_t) es->handler)(es, fd, revents, es->data);
+
+	r = ((sid_resource_io_event_handler_t) es->handler)(es, fd, revents, es->data);
+	_end_dispatch(&dispatch);
+
+	return r;
 }
 
 int sid_resource_create_io_event_source(sid_resource_t *                res,
@@ -475,11 +750,18 @@ fail:
 	return r;
 }
 
+int sid_resource_set_io_event_source_events(sid_resource_event_source_t *es, uint32_t events)
+{
+	return sd_event_source_set_io_events(es->sd_es, events);
+}
+
 static int _sd_signal_event_handler(sd_event_source *sd_es, int sfd, uint32_t revents, void *data)
 {
 	sid_resource_event_source_t *es = sd_event_source_get_userdata(sd_es);
 	struct signalfd_siginfo      si;
 	ssize_t                      res;
+	struct event_dispatch        dispatch;
+	int                          r;
 
 	res = read(sfd, &si, sizeof(si));
 
@@ -492,7 +774,13 @@ static int _sd_signal_event_handler(sd_event_source *sd_es, int sfd, uint32_t re
 		return 1;
 	}
 
-	return ((sid_resource_signal_event_handler_t) es->handler)(es, &si, es->res);
+	if (!_start_dispatch(es, &dispatch))
+		return ((sid_resource_signal_event_handler_t) es->handler)(es, &si, es->res);
+
+	r = ((sid_resource_signal_event_handler_t) es->handler)(es, &si, es->res);
+	_end_dispatch(&dispatch);
+
+	return r;
 }
 
 int sid_resource_create_signal_event_source(sid_resource_t *                    res,
@@ -560,7 +848,16 @@ fail:
 static int _sd_child_event_handler(sd_event_source *sd_es, const siginfo_t *si, void *data)
 {
 	sid_resource_event_source_t *es = data;
-	return ((sid_resource_child_event_handler_t) es->handler)(es, si, es->data);
+	struct event_dispatch        dispatch;
+	int                          r;
+
+	if (!_start_dispatch(es, &dispatch))
+		return ((sid_resource_child_event_handler_t) es->handler)(es, si, es->data);
+
+	r = ((sid_resource_child_event_handler_t) es->handler)(es, si, es->data);
+	_end_dispatch(&dispatch);
+
+	return r;
 }
 
 int sid_resource_create_child_event_source(sid_resource_t *                   res,
@@ -605,7 +902,16 @@ fail:
 static int _sd_time_event_handler(sd_event_source *sd_es, uint64_t usec, void *data)
 {
 	sid_resource_event_source_t *es = data;
-	return ((sid_resource_time_event_handler_t) es->handler)(es, usec, es->data);
+	struct event_dispatch        dispatch;
+	int                          r;
+
+	if (!_start_dispatch(es, &dispatch))
+		return ((sid_resource_time_event_handler_t) es->handler)(es, usec, es->data);
+
+	r = ((sid_resource_time_event_handler_t) es->handler)(es, usec, es->data);
+	_end_dispatch(&dispatch);
+
+	return r;
 }
 
 int sid_resource_create_time_event_source(sid_resource_t *                  res,
@@ -652,7 +958,16 @@ fail:
 static int _sd_generic_event_handler(sd_event_source *sd_es, void *data)
 {
 	sid_resource_event_source_t *es = data;
-	return ((sid_resource_generic_event_handler_t) es->handler)(es, es->data);
+	struct event_dispatch        dispatch;
+	int                          r;
+
+	if (!_start_dispatch(es, &dispatch))
+		return ((sid_resource_generic_event_handler_t) es->handler)(es, es->data);
+
+	r = ((sid_resource_generic_event_handler_t) es->handler)(es, es->data);
+	_end_dispatch(&dispatch);
+
+	return r;
 }
 
 int sid_resource_create_deferred_event_source(sid_resource_t *                     res,
@@ -772,6 +1087,30 @@ bool sid_resource_match(sid_resource_t *res, const sid_resource_type_t *type, co
 	return (type ? res->type == type : true) && (id ? !strcmp(sid_resource_get_id(res), id) : true);
 }
 
+/*
+ * Look up immediate child with given type and id in the child index. Returns true if the
+ * index gives a definitive answer in *found, false if linear search is needed instead.
+ */
+static bool _search_child_index(sid_resource_t *           res,
+                                const sid_resource_type_t *type,
+                                const char *               id,
+                                sid_resource_t *           ign_res,
+                                sid_resource_t **          found)
+{
+	char     key[CHILD_INDEX_KEY_SIZE];
+	uint32_t key_len;
+
+	if (!res->child_index || !type || !id || !(key_len = _get_child_index_key(type, id, key, sizeof(key))))
+		return false;
+
+	/* only the first child with the type and id is indexed so it must not be skipped */
+	if ((*found = hash_lookup(res->child_index, key, key_len, NULL)) &&
+	    (*found == ign_res || (*found)->flags & SID_RESOURCE_RESTRICT_WALK_DOWN))
+		return false;
+
+	return true;
+}
+
 sid_resource_t *_search_down(sid_resource_t *             res,
                              sid_resource_search_method_t method,
                              const sid_resource_type_t *  type,
@@ -780,16 +1119,22 @@ sid_resource_t *_search_down(sid_resource_t *             res,
 {
 	sid_resource_t *child_res, *found;
 
-	list_iterate_items (child_res, &res->children) {
-		if (child_res->flags & SID_RESOURCE_RESTRICT_WALK_DOWN)
-			continue;
+	/* depth-first search interleaves checking children with descending so it can not use the index */
+	if (method != SID_RESOURCE_SEARCH_DFS && _search_child_index(res, type, id, ign_res, &found)) {
+		if (found)
+			return found;
+	} else {
+		list_iterate_items (child_res, &res->children) {
+			if (child_res->flags & SID_RESOURCE_RESTRICT_WALK_DOWN)
+				continue;
 
-		if (child_res != ign_res && sid_resource_match(child_res, type, id))
-			return child_res;
+			if (child_res != ign_res && sid_resource_match(child_res, type, id))
+				return child_res;
 
-		if (method == SID_RESOURCE_SEARCH_DFS) {
-			if ((found = sid_resource_search(child_res, method, type, id)))
-				return found;
+			if (method == SID_RESOURCE_SEARCH_DFS) {
+				if ((found = sid_resource_search(child_res, method, type, id)))
+					return found;
+			}
 		}
 	}
 
@@ -997,6 +1342,71 @@ int sid_resource_run_event_loop(sid_resource_t *res)
 	return 0;
 }
 
+int sid_resource_enable_event_stats(sid_resource_t *res)
+{
+	sid_resource_t *res_event_loop;
+
+	if (!(res_event_loop = _get_resource_with_event_loop(res, 1)))
+		return -ENOMEDIUM;
+
+	if (res_event_loop->event_loop.es_stats)
+		return 0;
+
+	if (!(res_event_loop->event_loop.es_stats = hash_create(32)))
+		return -ENOMEM;
+
+	/* also cover event sources that already exist */
+	_attach_event_stats(res_event_loop, res_event_loop);
+
+	log_debug(res_event_loop->id, "Event source statistics enabled.");
+	return 0;
+}
+
+int sid_resource_iterate_event_stats(sid_resource_t *res, sid_resource_event_stats_fn_t fn, void *arg)
+{
+	sid_resource_t *  res_event_loop;
+	struct hash_node *n;
+	int               r;
+
+	if (!(res_event_loop = _get_resource_with_event_loop(res, 1)))
+		return -ENOMEDIUM;
+
+	if (!res_event_loop->event_loop.es_stats)
+		return -ENOTSUP;
+
+	hash_iterate (n, res_event_loop->event_loop.es_stats) {
+		if ((r = fn(hash_get_key(res_event_loop->event_loop.es_stats, n, NULL),
+		            hash_get_data(res_event_loop->event_loop.es_stats, n, NULL),
+		            arg)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int sid_resource_set_event_handler_budget(sid_resource_t *res, uint64_t usec)
+{
+	sid_resource_t *res_event_loop;
+
+	if (!(res_event_loop = _get_resource_with_event_loop(res, 1)))
+		return -ENOMEDIUM;
+
+	res_event_loop->event_loop.handler_budget_usec = usec;
+
+	log_debug(res_event_loop->id, "Event handler budget set to %" PRIu64 " us.", usec);
+	return 0;
+}
+
+uint64_t sid_resource_get_event_stall_count(sid_resource_t *res)
+{
+	sid_resource_t *res_event_loop;
+
+	if (!(res_event_loop = _get_resource_with_event_loop(res, 1)))
+		return 0;
+
+	return res_event_loop->event_loop.stall_count;
+}
+
 int sid_resource_exit_event_loop(sid_resource_t *res)
 {
 	if (!res->event_loop.sd_event_loop) {
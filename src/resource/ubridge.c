@@ -22,7 +22,11 @@
 #include "base/bitmap.h"
 #include "base/buffer.h"
 #include "base/comms.h"
+#include "base/list.h"
 #include "base/mem.h"
+#include "base/probe.h"
+#include "base/radix.h"
+#include "base/rec.h"
 #include "base/util.h"
 #include "iface/usid.h"
 #include "log/log.h"
@@ -36,6 +40,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <libudev.h>
+#include <limits.h>
+#include <malloc.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
@@ -45,6 +51,7 @@
 #define UBRIDGE_NAME    "ubridge"
 #define CONNECTION_NAME "connection"
 #define COMMAND_NAME    "command"
+#define UCMD_POOL_NAME  "ucmd-pool"
 
 #define INTERNAL_AGGREGATE_ID "ubridge-internal"
 #define MODULES_AGGREGATE_ID  "modules"
@@ -58,14 +65,82 @@
 #define SID_UCMD_MOD_FN_NAME_TRIGGER_ACTION_NEXT    "sid_ucmd_trigger_action_next"
 
 #define MAIN_KV_STORE_NAME     "main"
+#define SYNC_KV_STORE_NAME     "sync"
 #define MAIN_WORKER_CHANNEL_ID "main"
 
+#define MAIN_WORKER_UPDATE_CHANNEL_ID "update" /* main kv store updates sent to idle workers */
+
+#define WORKER_POOL_MIN      2  /* idle workers kept pre-forked for incoming events */
+#define WORKER_POOL_MAX      16 /* do not pre-fork if there are this many running workers */
+#define WORKER_POOL_IDLE_MAX 8  /* idle workers the pool may grow to if events arrive often */
+#define WORKER_RUNNING_MAX   16 /* with event coalescing, queue events if there are this many running workers */
+
+#define UCMD_POOL_MAX 4 /* max released connection and command structures kept for reuse in a worker */
+
+#define MOD_STATS_FLUSH_USEC 1000000 /* send module statistics at least this often even without database update */
+
+#define PENDING_CONN_MAX       256   /* stop accepting new connections if there are this many queued */
+#define PENDING_CONN_PEEK_MAX  65536 /* do not look into requests bigger than this before handing them over */
+#define PENDING_CONN_BATCH_MAX 8     /* max queued connections handed over to the same worker in one go */
+
+#define EVENT_HANDLER_BUDGET_USEC 500000 /* report main event loop handlers running longer than this */
+
+/* environment overrides for worker pool and idle worker policy settings */
+#define KEY_ENV_WORKER_POOL_MIN              "SID_WORKER_POOL_MIN"
+#define KEY_ENV_WORKER_POOL_MAX              "SID_WORKER_POOL_MAX"
+#define KEY_ENV_WORKER_POOL_IDLE_MAX         "SID_WORKER_POOL_IDLE_MAX"
+#define KEY_ENV_WORKER_POOL_WINDOW_USEC      "SID_WORKER_POOL_WINDOW_USEC"
+#define KEY_ENV_WORKER_IDLE_TIMEOUT_MIN_USEC "SID_WORKER_IDLE_TIMEOUT_MIN_USEC"
+#define KEY_ENV_WORKER_IDLE_TIMEOUT_MAX_USEC "SID_WORKER_IDLE_TIMEOUT_MAX_USEC"
+#define KEY_ENV_WORKER_IDLE_TIMEOUT_FACTOR   "SID_WORKER_IDLE_TIMEOUT_FACTOR"
+#define KEY_ENV_WORKER_AFFINITY              "SID_WORKER_AFFINITY"  /* 1 = dispatch events by device affinity */
+#define KEY_ENV_EVENT_COALESCING             "SID_EVENT_COALESCING" /* 1 = queue and coalesce events */
+#define KEY_ENV_WORKER_RUNNING_MAX           "SID_WORKER_RUNNING_MAX" /* queue events above this, 0 = no limit */
+#define KEY_ENV_PENDING_CONN_MAX             "SID_PENDING_CONN_MAX"   /* stop accepting above this, 0 = no limit */
+#define KEY_ENV_EVENT_STATS                  "SID_EVENT_STATS"        /* 1 = record main event loop statistics */
+#define KEY_ENV_EVENT_HANDLER_BUDGET_USEC    "SID_EVENT_HANDLER_BUDGET_USEC" /* 0 = do not report slow handlers */
+#define KEY_ENV_KV_OWNER_SOFT_LIMIT          "SID_KV_OWNER_SOFT_LIMIT" /* warn above this many bytes per owner, 0 = no limit */
+#define KEY_ENV_COLDPLUG                     "SID_COLDPLUG" /* 1 = scan all block devices found in sysfs on startup */
+
+#define MAIN_KV_STORE_DIR              "/run/" PACKAGE
+#define MAIN_KV_STORE_IMAGE_PATH       MAIN_KV_STORE_DIR "/" MAIN_KV_STORE_NAME "-kv-store.img"
+#define MAIN_KV_STORE_JOURNAL_PATH     MAIN_KV_STORE_DIR "/" MAIN_KV_STORE_NAME "-kv-store.journal"
+#define MAIN_KV_STORE_IMAGE_DELAY_USEC UINT64_C(60000000) /* delay between the first change and writing the image */
+#define MAIN_KV_STORE_FILTER_SIZE_HINT 4096               /* initial number of keys the lookup filter is sized for */
+#define MAIN_KV_STORE_SYNC_DELAY_USEC  UINT64_C(2000)     /* time to gather worker exports into one sync transaction */
+#define MAIN_KV_STORE_ACCOUNT_NS       0                  /* account class by namespace, see _main_kv_store_account */
+#define MAIN_KV_STORE_ACCOUNT_OWNER    1                  /* account class by owner, see _main_kv_store_account */
+#define MAIN_KV_STORE_COMPACT_SLICE    256                /* records moved by one compaction step */
+#define MAIN_KV_STORE_COMPACT_GARBAGE  4096               /* compact if at least this many records removed or replaced... */
+#define MAIN_KV_STORE_COMPACT_RATIO    50                 /* ...and they are at least this percentage of records left */
+#define MAIN_KV_STORE_COMPACT_PRIO     100                /* compaction steps yield to all the other event sources */
+
+#define SYNC_KV_STORE_ARENA_CHUNK_SIZE 65536 /* allocation chunk for records gathered for one sync transaction */
+
+#define EXPORT_BUF_ALLOC_STEP 16384 /* growth step for the buffer holding serialized key-value store export */
+#define EXPORT_SEALS          (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+#define DUMP_PART_SIZE      65536 /* size of record stream after which a part of streamed dump is sent */
+#define KV_GET_REQ_DATA_MAX 4096  /* maximum size of key spec in USID_CMD_GET request */
+
+#define SUBSCRIBE_REQ_DATA_MAX 4096 /* maximum size of key prefixes in USID_CMD_SUBSCRIBE request */
+
+#define COLDPLUG_SYSFS_PATH    SYSTEM_SYSFS_PATH "/class/block"
+#define COLDPLUG_UEVENT_MAX    4096 /* maximum size of uevent file read for each device */
+#define COLDPLUG_KEY_SUBSYSTEM "SUBSYSTEM"
+#define COLDPLUG_KEY_DEVNAME   "DEVNAME"
+#define COLDPLUG_SUBSYSTEM     "block"
+#define SUBSCRIBER_PENDING_MAX 4096 /* changed keys not sent to a subscriber yet, the subscriber is dropped above this */
+
 #define KV_PAIR_C "="
 #define KV_END_C  ""
 
 #define ID_NULL  ""
 #define KEY_NULL ID_NULL
 
+/* part of string composed by buffer_join_add */
+#define STR_PART(s) {.str = (s), .len = (s) ? strlen(s) : 0}
+
 #define KV_PREFIX_OP_ILLEGAL_C   "X"
 #define KV_PREFIX_OP_SET_C       ""
 #define KV_PREFIX_OP_PLUS_C      "+"
@@ -76,11 +151,16 @@
 #define KV_PREFIX_NS_MODULE_C    "M"
 #define KV_PREFIX_NS_GLOBAL_C    "G"
 
+/* key prefix shared by all records of KV_OP_SET operation in KV_NS_DEVICE namespace */
+#define KV_PREFIX_SET_NS_DEVICE KV_PREFIX_OP_SET_C KV_STORE_KEY_JOIN KV_PREFIX_NS_DEVICE_C KV_STORE_KEY_JOIN
+
 #define KEY_SYS_C "#"
 
-#define KV_KEY_DEV_READY    KEY_SYS_C "RDY"
-#define KV_KEY_DEV_RESERVED KEY_SYS_C "RES"
-#define KV_KEY_DEV_MOD      KEY_SYS_C "MOD"
+#define KV_KEY_DEV_READY     KEY_SYS_C "RDY"
+#define KV_KEY_DEV_RESERVED  KEY_SYS_C "RES"
+#define KV_KEY_DEV_MOD       KEY_SYS_C "MOD"
+#define KV_KEY_DEV_HIERARCHY KEY_SYS_C "HFP" /* fingerprint of relatives in sysfs, see _get_hierarchy_fingerprint */
+#define KV_KEY_DEV_UDEV      KEY_SYS_C "UDV" /* udev records of the last scan, see _cache_udev_records */
 
 #define KV_KEY_DOM_LAYER "LYR"
 #define KV_KEY_DOM_USER  "USR"
@@ -98,6 +178,7 @@
 /* internal resources */
 const sid_resource_type_t sid_resource_type_ubridge_connection;
 const sid_resource_type_t sid_resource_type_ubridge_command;
+const sid_resource_type_t sid_resource_type_ubridge_ucmd_pool;
 
 struct sid_ucmd_mod_ctx {
 	sid_resource_t *kv_store_res; /* KV store main or snapshot */
@@ -110,10 +191,69 @@ struct umonitor {
 	struct udev_monitor *mon;
 };
 
+typedef enum
+{
+	PENDING_PRIO_HIGH = 0, /* add and remove events */
+	PENDING_PRIO_NORMAL,   /* all the other events */
+	_PENDING_PRIO_COUNT,
+} pending_prio_t;
+
+struct ubridge_queue_stats {
+	uint64_t queued;          /* connections which had to wait for a worker */
+	uint64_t superseded;      /* queued events skipped because of a later event for the same device */
+	uint64_t throttled;       /* times accepting new connections was suspended because the queue was full */
+	uint64_t wait_usec_total; /* total time connections waited for a worker */
+	uint64_t wait_usec_max;   /* longest time a connection waited for a worker */
+	unsigned depth;           /* current number of queued connections */
+	unsigned depth_max;       /* highest number of queued connections */
+};
+
+struct ubridge_stats {
+	uint64_t start_usec;         /* CLOCK_MONOTONIC time when ubridge was initialized */
+	uint64_t startup_usec;       /* time spent initializing ubridge before serving the socket */
+	uint64_t modules_usec;       /* time spent loading modules after the socket is served */
+	uint64_t modules_loaded;     /* modules loaded by main process */
+	uint64_t coldplug_devices;   /* devices put in coldplug batch */
+	uint64_t coldplug_failed;    /* coldplug devices failed or not replied */
+	uint64_t coldplug_usec;      /* time from start of coldplug until all devices are replied */
+	uint64_t conns;              /* accepted connections */
+	uint64_t scans;              /* USID_CMD_SCAN and USID_CMD_SCAN_BATCH requests */
+	uint64_t export_count;       /* exports received from workers */
+	uint64_t export_bytes;       /* total size of exports received from workers */
+	uint64_t export_usec_total;  /* total time spent on staging exports for sync */
+	uint64_t export_usec_max;    /* longest time spent on staging one export */
+	uint64_t sync_count;         /* sync transactions with main kv store */
+	uint64_t sync_records;       /* records applied to main kv store by sync transactions */
+	uint64_t sync_usec_total;    /* total time spent on sync transactions */
+	uint64_t sync_usec_max;      /* longest sync transaction */
+	uint64_t compact_usec_total; /* total time spent on main kv store compaction steps */
+	uint64_t compact_usec_max;   /* longest main kv store compaction step */
+};
+
 struct ubridge {
-	int                     socket_fd;
-	struct sid_ucmd_mod_ctx ucmd_mod_ctx;
-	struct umonitor         umonitor;
+	int                          socket_fd;
+	sid_resource_event_source_t *interface_es; /* accepting new connections, not set if the queue is full */
+	struct sid_ucmd_mod_ctx      ucmd_mod_ctx;
+	struct umonitor              umonitor;
+	sid_resource_event_source_t *image_es;          /* pending write of main kv store image */
+	kv_store_journal_t *         journal;           /* main kv store journal */
+	sid_resource_t *             sync_kv_store_res; /* records gathered from workers, not yet synced with main kv store */
+	sid_resource_event_source_t *sync_es;           /* pending sync of gathered records with main kv store */
+	sid_resource_event_source_t *compact_es;        /* pending step of main kv store compaction */
+	sid_resource_event_source_t *modules_es;        /* pending load of modules in main process */
+	bool                         coldplug_enabled;  /* run coldplug once modules are loaded */
+	struct coldplug *            coldplug;          /* coldplug in progress, records are synced once it finishes */
+	bool                         worker_affinity;   /* dispatch events for related devices to the same worker */
+	bool                         event_coalescing;  /* queue events if workers are busy and skip superseded ones */
+	unsigned                     running_max;       /* queue events if there are this many running workers, 0 = no limit */
+	unsigned                     pending_max;       /* stop accepting if there are this many queued connections, 0 = no limit */
+	bool                         event_stats;       /* event source statistics recorded for main event loop */
+	/* accepted connections not yet handed over to a worker, one queue for each priority */
+	struct list                  pending_conns[_PENDING_PRIO_COUNT];
+	struct ubridge_queue_stats   queue_stats;
+	struct ubridge_stats         stats;
+	struct list                  subscribers; /* connections with USID_CMD_SUBSCRIBE, served by main process */
+	struct radix_tree *          mod_stats;   /* struct mod_stats by module name, aggregated from workers */
 };
 
 typedef enum
@@ -134,8 +274,21 @@ typedef enum
 	__CMD_SCAN_PHASE_B_TRIGGER_ACTION_END = CMD_SCAN_PHASE_B_TRIGGER_ACTION_NEXT,
 
 	CMD_SCAN_PHASE_ERROR,
+	_CMD_SCAN_PHASE_COUNT,
 } cmd_scan_phase_t;
 
+/* run time statistics of module functions for one scan phase */
+struct mod_phase_stats {
+	uint64_t calls;
+	uint64_t failures;
+	uint64_t usec_total;
+	uint64_t usec_max;
+};
+
+struct mod_stats {
+	struct mod_phase_stats phase[_CMD_SCAN_PHASE_COUNT];
+};
+
 struct udevice {
 	udev_action_t  action;
 	udev_devtype_t type;
@@ -148,17 +301,139 @@ struct udevice {
 };
 
 struct connection {
-	int            fd;
-	struct buffer *buf;
+	struct list       list;
+	struct ucmd_pool *pool; /* pool to return the structure to on destroy, if any */
+	int               fd;
+	struct buffer *   buf;
+	bool              diverged; /* worker changed records which are not synced with main kv store */
+};
+
+/*
+ * Connection and command structures released in a worker, kept with their buffers for reuse
+ * by the next connection and command handled by the same worker.
+ */
+struct ucmd_pool {
+	struct list                free_conns;
+	unsigned                   free_conn_count;
+	struct list                free_ucmd_ctxs;
+	unsigned                   free_ucmd_ctx_count;
+	struct block_mod_dispatch *block_mod_dispatch;   /* built on first scan, block modules do not change in worker */
+	struct radix_tree *        mod_stats;            /* struct mod_stats by module name, gathered since last sent */
+	uint64_t                   mod_stats_flush_usec; /* when module statistics were last sent to main process */
+	int                        sysfs_dev_block_fd;   /* SYSTEM_SYSFS_PATH "/dev/block" opened on first use or -1 */
+	struct radix_tree *        sysfs_slaves;         /* struct sysfs_slaves by "major:minor" of the device */
+};
+
+/* Slaves of a device as last read from sysfs, see _get_sysfs_slaves. */
+struct sysfs_slave {
+	ino_t ino;       /* inode of the entry in slaves directory, it changes if the slave is added again */
+	char  devno[16]; /* devno of the slave, canonicalized with _canonicalize_kv_key */
+};
+
+struct sysfs_slaves {
+	unsigned           count;
+	struct sysfs_slave slaves[];
+};
+
+/*
+ * Connection accepted by main process which is waiting for request data (es set)
+ * or for a worker to become available (es not set) before it is handed over.
+ */
+struct pending_conn {
+	struct list                  list;
+	sid_resource_t *             internal_ubridge_res;
+	int                          fd;
+	sid_resource_event_source_t *es;
+	uint64_t                     accept_usec;
+	bool                         waiting; /* waited for a worker to become available */
+	uint8_t                      cmd;     /* USID_CMD_UNDEFINED if the header has not been received yet */
+	uint8_t                      prot;
+	uint32_t                     req_id;
+	bool                         has_req; /* fields below are set from the scan request */
+	uint64_t                     seqnum;
+	dev_t                        devno;
+	udev_action_t                action;
+};
+
+/* Coldplug in progress, see _start_coldplug. */
+struct coldplug {
+	int                          fd; /* main process end of connection handed over to a worker */
+	sid_resource_event_source_t *es;
+	struct buffer *              req_buf; /* USID_CMD_SCAN_BATCH request with all the devices, NULL once sent */
+	size_t                       req_pos;
+	struct buffer *              res_buf; /* reply being received */
+	unsigned                     devices;
+	unsigned                     replied;
+	unsigned                     failed;
+	uint64_t                     start_usec;
+};
+
+/* Client subscribed to changes of main kv store, see USID_CMD_SUBSCRIBE in iface/usid.h. */
+struct subscriber {
+	struct list                  list;
+	sid_resource_t *             internal_ubridge_res;
+	int                          fd;
+	sid_resource_event_source_t *es;
+	uint8_t                      prot;
+	uint32_t                     req_id;
+	char *                       prefixes;      /* NUL-terminated key prefixes one after another, NULL for all keys */
+	size_t                       prefixes_size;
+	struct radix_tree *          pending_keys;  /* keys changed since the last reply, in key order */
+	struct buffer *              out_buf;       /* reply being sent, NULL if none */
+	size_t                       out_pos;       /* part of out_buf already sent */
+	bool                         overflow;      /* too many changes piled up, close after sending out_buf */
+};
+
+typedef enum
+{
+	DEV_KEY_READY,
+	DEV_KEY_RESERVED,
+	DEV_KEY_MOD,
+	DEV_KEY_HIERARCHY,
+	DEV_KEY_UDEV,
+	_DEV_KEY_COUNT,
+} dev_key_t;
+
+typedef enum
+{
+	UDEV_ENV_KEY_ACTION,
+	UDEV_ENV_KEY_DEVPATH,
+	UDEV_ENV_KEY_DEVTYPE,
+	UDEV_ENV_KEY_MAJOR,
+	UDEV_ENV_KEY_MINOR,
+	UDEV_ENV_KEY_SEQNUM,
+	UDEV_ENV_KEY_SYNTH_UUID,
+	_UDEV_ENV_KEY_COUNT,
+} udev_env_key_t;
+
+/* udev environment from USID_CMD_SCAN request, looked up directly instead of through kv store */
+struct udev_env {
+	char *      mem;                        /* copy of the request data, key=value\0key=value\0... */
+	size_t      size;
+	const char *known[_UDEV_ENV_KEY_COUNT]; /* values of known keys, point to mem */
+};
+
+#define CMD_ARGS_MAX 6
+
+/* request data as NUL-terminated strings (USID_CMD_DUMP filter, USID_CMD_GET key spec) */
+struct cmd_args {
+	char *      mem;                 /* copy of the request data */
+	const char *parts[CMD_ARGS_MAX]; /* point to mem, NULL for empty strings */
 };
 
 struct sid_ucmd_ctx {
-	char *                  dev_id;         /* device identifier (major_minor) */
-	struct udevice          udev_dev;       /* udev context for currently processed device */
-	cmd_scan_phase_t        scan_phase;     /* current phase at the time of use of this context */
-	struct sid_ucmd_mod_ctx ucmd_mod_ctx;   /* commod module context */
-	struct buffer *         res_buf;        /* result buffer */
-	struct usid_msg_header  request_header; /* original request header (keep last, contains flexible array) */
+	char *                  dev_id;                   /* device identifier (major_minor) */
+	struct udevice          udev_dev;                 /* udev context for currently processed device */
+	cmd_scan_phase_t        scan_phase;               /* current phase at the time of use of this context */
+	struct sid_ucmd_mod_ctx ucmd_mod_ctx;             /* commod module context */
+	const kv_store_atom_t * dev_keys[_DEV_KEY_COUNT]; /* core device keys, interned on first use */
+	struct buffer *         res_buf;                  /* result buffer */
+	struct list             list;                     /* for linking released contexts in ucmd_pool */
+	struct ucmd_pool *      pool;                     /* pool to return the context to on destroy, if any */
+	uint32_t                req_id;                   /* request ID to put in reply (protocol 2 and higher) */
+	struct cmd_args         args;                     /* request data of USID_CMD_DUMP and USID_CMD_GET */
+	struct udev_env         udev_env;                 /* udev environment of USID_CMD_SCAN */
+	struct usid_msg_header  request_header;           /* original request header (keep last, contains flexible array) */
 };
 
 struct cmd_mod_fns {
@@ -171,14 +446,37 @@ struct cmd_mod_fns {
 	sid_ucmd_fn_t *trigger_action_current;
 	sid_ucmd_fn_t *trigger_action_next;
 	sid_ucmd_fn_t *error;
+	sid_ucmd_fn_t *scan_prefetch; /* block modules only, not resolved for type modules */
 } __attribute__((packed));
 
+/* block module function to call in a scan phase */
+struct block_mod_fn {
+	struct module *         mod;
+	sid_ucmd_fn_t *         fn;
+	struct mod_phase_stats *stats; /* NULL if not recorded */
+};
+
+/*
+ * Block module functions for all scan phases. Each phase has its own contiguous part of fns
+ * with only the modules that implement the phase, in the order the modules are registered.
+ */
+struct block_mod_dispatch {
+	unsigned            start[_CMD_SCAN_PHASE_COUNT + 1]; /* phase p uses fns[start[p]] up to fns[start[p + 1] - 1] */
+	struct block_mod_fn fns[];
+};
+
 struct cmd_exec_arg {
-	sid_resource_t *     cmd_res;
-	sid_resource_t *     type_mod_registry_res;
-	sid_resource_iter_t *block_mod_iter;       /* all block modules to execute */
-	sid_resource_t *     type_mod_res_current; /* one type module for current layer to execute */
-	sid_resource_t *     type_mod_res_next;    /* one type module for next layer to execute */
+	sid_resource_t *                 cmd_res;
+	sid_resource_t *                 type_mod_registry_res;
+	const struct block_mod_dispatch *block_mod_dispatch;     /* all block modules to execute */
+	struct block_mod_dispatch *      block_mod_dispatch_own; /* set if not cached in ucmd_pool, freed on exit */
+	sid_resource_t *                 type_mod_res_current;   /* one type module for current layer to execute */
+	sid_resource_t *                 type_mod_res_next;      /* one type module for next layer to execute */
+	const struct cmd_mod_fns *       type_mod_fns_current;   /* symbols of type_mod_res_current */
+	const struct cmd_mod_fns *       type_mod_fns_next;      /* symbols of type_mod_res_next */
+	struct mod_stats *               type_mod_stats_current; /* NULL if not recorded */
+	struct mod_stats *               type_mod_stats_next;    /* NULL if not recorded */
+	bool                             reply_cached;           /* replied with cached udev records, nothing to export */
 };
 
 struct cmd_reg {
@@ -193,6 +491,32 @@ struct kv_value {
 	char                data[]; /* contains both internal and external data */
 } __attribute__((packed));
 
+/*
+ * Internal kv_value flag marking a packed set (see _set_iter_init). It is never
+ * exposed to modules.
+ */
+#define KV_VALUE_PACKED_SET UINT64_C(0x8000000000000000)
+
+/*
+ * Record types used between main process and workers (see _write_kv_rec, _write_kv_unset_rec
+ * and _write_mod_stats_rec).
+ */
+#define KV_REC_PACKED_SET (USID_KV_REC_UNSET + 1) /* internal only */
+#define KV_REC_MOD_STATS  (USID_KV_REC_UNSET + 2) /* internal only */
+#define KV_REC_UNSET      USID_KV_REC_UNSET
+
+typedef uint16_t kv_set_item_len_t;
+#define KV_SET_ITEM_LEN_MAX UINT16_MAX
+
+struct kv_set_iter {
+	struct iovec *iov; /* vector form */
+	size_t        iov_cnt;
+	size_t        i;
+	const char *  p; /* packed form */
+	const char *  end;
+	struct iovec  item;
+};
+
 enum
 {
 	KV_VALUE_IDX_SEQNUM,
@@ -215,12 +539,18 @@ enum
 #define KV_VALUE_OWNER(iov)  ((char *) ((struct iovec *) iov)[KV_VALUE_IDX_OWNER].iov_base)
 #define KV_VALUE_DATA(iov)   (((struct iovec *) iov)[KV_VALUE_IDX_DATA].iov_base)
 
+typedef enum
+{
+	MAIN_KV_STORE_REQ_CHECKPOINT, /* write image of main kv store */
+} main_kv_store_req_t;
+
 struct kv_update_arg {
-	sid_resource_t *res;
-	struct buffer * gen_buf;
-	const char *    owner;    /* in */
-	void *          custom;   /* in/out */
-	int             ret_code; /* out */
+	sid_resource_t *    res;
+	struct buffer *     gen_buf;
+	const char *        owner;    /* in */
+	void *              custom;   /* in/out */
+	kv_store_journal_t *journal;  /* in, optional journal to record the change in */
+	int                 ret_code; /* out */
 };
 
 typedef enum
@@ -238,12 +568,21 @@ typedef enum
 	DELTA_WITH_REL  = 0x2, /* as DELTA_WITH_DIFF, but also update referenced relatives */
 } delta_flags_t;
 
+/*
+ * The plus, minus and final sets are all packed sets with the same header
+ * and they're all carved out of one allocation pointed to by 'mem'.
+ * Set pointer is NULL if the set is not used. Sizes are in bytes.
+ */
 struct kv_delta {
-	kv_op_t        op;
-	delta_flags_t  flags;
-	struct buffer *plus;
-	struct buffer *minus;
-	struct buffer *final;
+	kv_op_t          op;
+	delta_flags_t    flags;
+	char *           mem;
+	struct kv_value *plus;
+	struct kv_value *minus;
+	struct kv_value *final;
+	size_t           plus_size;
+	size_t           minus_size;
+	size_t           final_size;
 };
 
 typedef enum
@@ -281,12 +620,15 @@ struct kv_key_res_def {
 };
 
 struct cross_bitmap_calc_arg {
-	struct iovec * old_value;
-	size_t         old_size;
-	struct bitmap *old_bmp;
-	struct iovec * new_value;
-	size_t         new_size;
-	struct bitmap *new_bmp;
+	void *                 old_value;
+	size_t                 old_size;
+	kv_store_value_flags_t old_flags;
+	size_t                 old_items_size;
+	struct bitmap *        old_bmp;
+	struct kv_value *      new_value;
+	size_t                 new_size;
+	size_t                 new_items_size;
+	struct bitmap *        new_bmp;
 };
 
 /*
@@ -352,26 +694,16 @@ static const char *_do_buffer_compose_key(struct buffer *buf, struct kv_key_spec
 	                                             [KV_NS_MODULE]    = KV_PREFIX_NS_MODULE_C,
 	                                             [KV_NS_GLOBAL]    = KV_PREFIX_NS_GLOBAL_C};
 
-	/* <op>:<ns>:<ns_part>:<id>:<id_part>[:<key>] */
-
-	return buffer_fmt_add(buf,
-	                      NULL,
-	                      "%s" KV_STORE_KEY_JOIN /* op */
-	                      "%s" KV_STORE_KEY_JOIN /* ns */
-	                      "%s" KV_STORE_KEY_JOIN /* ns_part */
-	                      "%s" KV_STORE_KEY_JOIN /* dom */
-	                      "%s" KV_STORE_KEY_JOIN /* id */
-	                      "%s"
-	                      "%s" /* id_part */
-	                      "%s",
-	                      op_to_key_prefix_map[spec->op],
-	                      ns_to_key_prefix_map[spec->ns],
-	                      spec->ns_part,
-	                      spec->dom,
-	                      spec->id,
-	                      spec->id_part,
-	                      prefix_only ? KEY_NULL : KV_STORE_KEY_JOIN,
-	                      prefix_only ? KEY_NULL : spec->key);
+	/* <op>:<ns>:<ns_part>:<dom>:<id>:<id_part>[:<key>] */
+	struct buffer_str parts[] = {STR_PART(op_to_key_prefix_map[spec->op]),
+	                             STR_PART(ns_to_key_prefix_map[spec->ns]),
+	                             STR_PART(spec->ns_part),
+	                             STR_PART(spec->dom),
+	                             STR_PART(spec->id),
+	                             STR_PART(spec->id_part),
+	                             STR_PART(spec->key)};
+
+	return buffer_join_add(buf, NULL, KV_STORE_KEY_JOIN, parts, prefix_only ? 6 : 7);
 }
 
 static const char *_buffer_compose_key(struct buffer *buf, struct kv_key_spec *spec)
@@ -469,7 +801,7 @@ static const char *_buffer_copy_ns_part_from_key(struct buffer *buf, const char
 	if (!(str = _get_key_part(key, KEY_PART_NS_PART, &len)))
 		return NULL;
 
-	return buffer_fmt_add(buf, NULL, "%.*s", len, str);
+	return buffer_join_add(buf, NULL, NULL, &((struct buffer_str) {.str = str, .len = len}), 1);
 }
 
 static struct iovec *_get_value_vector(kv_store_value_flags_t flags, void *value, size_t value_size, struct iovec *iov)
@@ -492,18 +824,98 @@ static struct iovec *_get_value_vector(kv_store_value_flags_t flags, void *value
 	return iov;
 }
 
-static const char *_get_iov_str(struct buffer *buf, bool unset, struct iovec *iov, size_t iov_size)
+/*
+ * Packed sets are stored as scalar values (struct kv_value) with KV_VALUE_PACKED_SET
+ * flag set. The data part following the owner is a contiguous sequence of sorted items,
+ * each one prefixed with its length (including the terminating NUL byte) which is stored
+ * unaligned. Set iterator walks through both packed sets and vectors.
+ */
+static bool _is_packed_set(kv_store_value_flags_t flags, void *value)
 {
-	size_t      i;
-	const char *str;
+	return value && !(flags & KV_STORE_VALUE_VECTOR) && (((struct kv_value *) value)->flags & KV_VALUE_PACKED_SET);
+}
+
+static void _set_iter_init(struct kv_set_iter *iter, kv_store_value_flags_t flags, void *value, size_t value_size)
+{
+	struct kv_value *kv_value = value;
+
+	*iter = (struct kv_set_iter) {0};
+
+	if (flags & KV_STORE_VALUE_VECTOR) {
+		iter->iov     = value;
+		iter->iov_cnt = value ? value_size : 0;
+		iter->i       = KV_VALUE_IDX_DATA;
+	} else if (_is_packed_set(flags, value)) {
+		iter->p   = kv_value->data + strlen(kv_value->data) + 1;
+		iter->end = (const char *) value + value_size;
+	}
+}
+
+static const struct iovec *_set_iter_next(struct kv_set_iter *iter)
+{
+	kv_set_item_len_t len;
+
+	if (iter->iov)
+		return iter->i < iter->iov_cnt ? &iter->iov[iter->i++] : NULL;
+
+	if (!iter->p || (size_t) (iter->end - iter->p) < sizeof(len))
+		return NULL;
+
+	memcpy(&len, iter->p, sizeof(len));
+	iter->p += sizeof(len);
+
+	if ((size_t) (iter->end - iter->p) < len) {
+		iter->p = NULL;
+		return NULL;
+	}
+
+	iter->item = (struct iovec) {(void *) iter->p, len};
+	iter->p += len;
+
+	return &iter->item;
+}
+
+/*
+ * Gets the number of items in a set and the size the items take in packed form.
+ */
+static int _get_set_items_size(kv_store_value_flags_t flags, void *value, size_t value_size, size_t *size, size_t *count)
+{
+	struct kv_set_iter  iter;
+	const struct iovec *item;
+	size_t              items_size = 0, items_count = 0;
+
+	_set_iter_init(&iter, flags, value, value_size);
+
+	while ((item = _set_iter_next(&iter))) {
+		if (item->iov_len > KV_SET_ITEM_LEN_MAX)
+			return -E2BIG;
+		items_size += sizeof(kv_set_item_len_t) + item->iov_len;
+		items_count++;
+	}
+
+	if (size)
+		*size = items_size;
+	if (count)
+		*count = items_count;
+
+	return 0;
+}
+
+static const char *_get_iov_str(struct buffer *buf, bool unset, kv_store_value_flags_t flags, void *value, size_t value_size)
+{
+	struct kv_set_iter  iter;
+	const struct iovec *item;
+	const char *        str;
 
 	if (unset)
-		return buffer_fmt_add(buf, NULL, "NULL");
+		return buffer_add(buf, "NULL", sizeof("NULL"), NULL);
 
 	str = buffer_add(buf, "", 0, NULL);
 
-	for (i = KV_VALUE_IDX_DATA; i < iov_size; i++) {
-		if (!buffer_add(buf, iov[i].iov_base, iov[i].iov_len - 1, NULL) || !buffer_add(buf, " ", 1, NULL))
+	_set_iter_init(&iter, flags, value, value_size);
+
+	while ((item = _set_iter_next(&iter))) {
+		if (!buffer_add(buf, item->iov_base, item->iov_len - 1, NULL) || !buffer_add(buf, " ", 1, NULL))
 			goto fail;
 	}
 
@@ -516,60 +928,246 @@ fail:
 	return NULL;
 }
 
-static int _write_kv_store_dump(struct buffer *buf, sid_resource_t *kv_store_res)
+/*
+ * Writes key-value record as described in iface/usid.h. This is used both for dump
+ * and for export to main process. Sets are always written item by item, whatever
+ * form they are stored in. With internal_types, packed sets are written with
+ * KV_REC_PACKED_SET type so the receiver can store them in the same form.
+ */
+static int _write_kv_rec(struct rec_writer *   w,
+                         const char *          key,
+                         kv_store_value_flags_t flags,
+                         void *                value,
+                         size_t                size,
+                         bool                  internal_types)
 {
-	kv_store_iter_t *       iter;
-	const char *            key = "<NO KEY>";
-	struct usid_dump_header header;
-	size_t                  size;
-	kv_store_value_flags_t  flags;
-	void *                  value;
-	struct iovec            tmp_iov[KV_VALUE_IDX_DATA + 1];
-	struct iovec *          iov;
-	unsigned int            i;
-	int                     r = 0;
-	uint32_t                len;
-	void *                  data;
+	struct iovec        tmp_iov[KV_VALUE_IDX_DATA + 1];
+	struct iovec *      iov;
+	struct kv_set_iter  set_iter;
+	const struct iovec *item;
+	size_t              count;
+	uint64_t            type;
+	bool                is_set;
+	int                 r;
 
-	if (!(iter = kv_store_iter_create(kv_store_res))) {
+	iov = _get_value_vector(flags, value, size, tmp_iov);
+
+	if (flags & KV_STORE_VALUE_VECTOR)
+		type = USID_KV_REC_SET;
+	else if (_is_packed_set(flags, value))
+		type = internal_types ? KV_REC_PACKED_SET : USID_KV_REC_SET;
+	else
+		type = USID_KV_REC_VALUE;
+
+	if ((is_set = type != USID_KV_REC_VALUE)) {
+		if ((r = _get_set_items_size(flags, value, size, NULL, &count)) < 0)
+			return r;
+	} else
+		count = 1;
+
+	if ((r = rec_write_key(w, key)) < 0 || (r = rec_write_uint(w, type)) < 0 ||
+	    (r = rec_write_uint(w, KV_VALUE_SEQNUM(iov))) < 0 ||
+	    (r = rec_write_uint(w, KV_VALUE_FLAGS(iov) & ~KV_VALUE_PACKED_SET)) < 0 ||
+	    (r = rec_write_data(w, iov[KV_VALUE_IDX_OWNER].iov_base, iov[KV_VALUE_IDX_OWNER].iov_len)) < 0 ||
+	    (r = rec_write_uint(w, count)) < 0)
+		return r;
+
+	if (!is_set)
+		return rec_write_data(w, iov[KV_VALUE_IDX_DATA].iov_base, iov[KV_VALUE_IDX_DATA].iov_len);
+
+	_set_iter_init(&set_iter, flags, value, size);
+	while ((item = _set_iter_next(&set_iter))) {
+		if ((r = rec_write_data(w, item->iov_base, item->iov_len)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/* Writes record for a key which is not in the store anymore. It only has the key and the KV_REC_UNSET type. */
+static int _write_kv_unset_rec(struct rec_writer *w, const char *key)
+{
+	int r;
+
+	if ((r = rec_write_key(w, key)) < 0)
+		return r;
+
+	return rec_write_uint(w, KV_REC_UNSET);
+}
+
+static bool _key_part_equals(const char *key, key_part_t part, const char *str)
+{
+	const char *key_part;
+	size_t      len;
+
+	if (!(key_part = _get_key_part(key, part, &len)))
+		return false;
+
+	return len == strlen(str) && !strncmp(key_part, str, len);
+}
+
+static bool _dump_filter_match(const char *const *filter, const char *key, kv_store_value_flags_t flags, void *value, size_t size)
+{
+	const char *  ns     = filter[USID_DUMP_FILTER_NS];
+	const char *  dev_id = filter[USID_DUMP_FILTER_DEV];
+	const char *  owner  = filter[USID_DUMP_FILTER_OWNER];
+	struct iovec  tmp_iov[KV_VALUE_IDX_DATA + 1];
+	struct iovec *iov;
+
+	/* the key prefix is already applied by the iterator */
+
+	if (ns && !_key_part_equals(key, KEY_PART_NS, ns))
+		return false;
+
+	if (dev_id && (_get_ns_from_key(key) != KV_NS_DEVICE || !_key_part_equals(key, KEY_PART_NS_PART, dev_id)))
+		return false;
+
+	if (owner) {
+		iov = _get_value_vector(flags, value, size, tmp_iov);
+		if (strcmp(KV_VALUE_OWNER(iov), owner))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Sends the records written to buf so far as one part of the dump reply and
+ * clears buf for the next part. The last part is sent as usual reply.
+ */
+static int _send_dump_part(sid_resource_t *cmd_res, struct buffer *part_buf, struct buffer *buf)
+{
+	sid_resource_t *       conn_res = sid_resource_search(cmd_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	struct connection *    conn     = sid_resource_get_data(conn_res);
+	struct sid_ucmd_ctx *  ucmd_ctx = sid_resource_get_data(cmd_res);
+	struct usid_msg_header header   = {.status = COMMAND_STATUS_MORE, .prot = ucmd_ctx->request_header.prot};
+	struct usid_msg_ext    ext      = {.req_id = ucmd_ctx->req_id};
+	const void *           data;
+	size_t                 size;
+	int                    r;
+
+	(void) buffer_get_data(buf, &data, &size);
+
+	if (!buffer_add(part_buf, &header, sizeof(header), &r) || !buffer_add(part_buf, &ext, sizeof(ext), &r) ||
+	    !buffer_add(part_buf, (void *) data, size, &r))
+		goto out;
+
+	r = buffer_write_all(part_buf, conn->fd);
+out:
+	(void) buffer_clear(part_buf);
+	(void) buffer_clear(buf);
+	return r;
+}
+
+/*
+ * Writes all records matching the command's dump filter to gen_buf. With stream set,
+ * parts of DUMP_PART_SIZE are sent as soon as they are written, each with its own
+ * record stream, so only the last part is left in gen_buf.
+ */
+static int _write_kv_store_dump(sid_resource_t *cmd_res, bool stream)
+{
+	struct sid_ucmd_ctx *  ucmd_ctx     = sid_resource_get_data(cmd_res);
+	sid_resource_t *       kv_store_res = ucmd_ctx->ucmd_mod_ctx.kv_store_res;
+	struct buffer *        buf          = ucmd_ctx->ucmd_mod_ctx.gen_buf;
+	const char *const *    filter       = ucmd_ctx->args.parts;
+	struct buffer *        part_buf     = NULL;
+	kv_store_iter_t *      iter;
+	struct rec_writer *    w   = NULL;
+	const char *           key = "<NO KEY>";
+	size_t                 size;
+	kv_store_value_flags_t flags;
+	void *                 value;
+	int                    r = 0;
+
+	if (!(iter = kv_store_iter_create_prefix(kv_store_res, filter[USID_DUMP_FILTER_KEY_PREFIX]))) {
 		log_error(ID(kv_store_res), INTERNAL_ERROR "%s: failed to create record iterator", __func__);
 		return -ENOMEM;
 	}
 
+	if (stream && !(part_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                                 .type    = BUFFER_TYPE_VECTOR,
+	                                                                 .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                                         &((struct buffer_init) {.size = 3, .alloc_step = 1, .limit = 0}),
+	                                         &r)))
+		goto out;
+
+	if (!(w = rec_writer_create(buf, &r)))
+		goto out;
+
 	while ((value = kv_store_iter_next(iter, &size, &flags))) {
 		key = kv_store_iter_current_key(iter);
-		if (!strncmp(key, "U:", 2))
+		if (_get_ns_from_key(key) == KV_NS_UDEV || !_dump_filter_match(filter, key, flags, value, size))
 			continue;
-		iov               = _get_value_vector(flags, value, size, tmp_iov);
-		header.seqnum     = KV_VALUE_SEQNUM(iov);
-		header.flags      = KV_VALUE_FLAGS(iov);
-		header.data_count = (flags & KV_STORE_VALUE_VECTOR) ? size - KV_VALUE_IDX_DATA : 1;
-		if (!buffer_add(buf, &header, sizeof(header), &r))
-			goto out;
-		len = strlen(key) + 1;
-		if (!buffer_add(buf, &len, sizeof(len), &r))
-			goto out;
-		if (!buffer_add(buf, (void *) key, len, &r))
-			goto out;
-		for (i = 0; i < header.data_count + 1; i++) {
-			data = iov[KV_VALUE_IDX_OWNER + i].iov_base;
-			len  = iov[KV_VALUE_IDX_OWNER + i].iov_len;
-			if (!buffer_add(buf, &len, sizeof(len), &r))
-				goto out;
-			if (!buffer_add(buf, data, len, &r))
-				goto out;
+		if ((r = _write_kv_rec(w, key, flags, value, size, false)) < 0)
+			break;
+
+		if (part_buf && buffer_stat(buf).usage.used >= DUMP_PART_SIZE) {
+			rec_writer_destroy(w);
+			w = NULL;
+			if ((r = _send_dump_part(cmd_res, part_buf, buf)) < 0 || !(w = rec_writer_create(buf, &r)))
+				break;
 		}
 	}
-	/* add zeroed header to signal the end of the dump */
-	memset(&header, 0, sizeof(header));
-	buffer_add(buf, &header, sizeof(header), &r);
 out:
+	if (w)
+		rec_writer_destroy(w);
+	if (part_buf)
+		buffer_destroy(part_buf);
 	if (r < 0)
 		log_error_errno(ID(kv_store_res), r, "%s: failed to add value for key: %s", __func__, key);
 	kv_store_iter_destroy(iter);
 	return r;
 }
 
+/*
+ * Writes record for the key given by USID_CMD_GET key spec to buf. The record stream
+ * is left without any records if the key is not set.
+ */
+static int _write_kv_get_result(struct buffer *buf, sid_resource_t *kv_store_res, const char *const *spec)
+{
+	struct buffer_str       parts[1 + USID_GET_SPEC_COUNT] = {STR_PART(KV_PREFIX_OP_SET_C)};
+	struct rec_writer *     w;
+	const char *            tmp_key;
+	char *                  key;
+	sid_ucmd_kv_namespace_t ns;
+	size_t                  size;
+	kv_store_value_flags_t  flags;
+	void *                  value;
+	int                     i, r;
+
+	if (!spec[USID_GET_SPEC_KEY])
+		return -EINVAL;
+
+	/* <op>:<ns>:<ns_part>:<dom>:<id>:<id_part>:<key> */
+	for (i = 0; i < USID_GET_SPEC_COUNT; i++)
+		parts[i + 1] = (struct buffer_str) STR_PART(spec[i]);
+
+	if (!(tmp_key = buffer_join_add(buf, &r, KV_STORE_KEY_JOIN, parts, 1 + USID_GET_SPEC_COUNT)))
+		return r;
+
+	key = strdup(tmp_key);
+	buffer_rewind_mem(buf, tmp_key);
+
+	if (!key)
+		return -ENOMEM;
+
+	if ((ns = _get_ns_from_key(key)) == KV_NS_UNDEFINED || ns == KV_NS_UDEV) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (!(w = rec_writer_create(buf, &r)))
+		goto out;
+
+	if ((value = kv_store_get_value(kv_store_res, key, &size, &flags)))
+		r = _write_kv_rec(w, key, flags, value, size, false);
+
+	rec_writer_destroy(w);
+out:
+	free(key);
+	return r;
+}
+
 static void _dump_kv_store(const char *str, sid_resource_t *kv_store_res)
 {
 	kv_store_iter_t *      iter;
@@ -578,7 +1176,10 @@ static void _dump_kv_store(const char *str, sid_resource_t *kv_store_res)
 	void *                 value;
 	struct iovec           tmp_iov[KV_VALUE_IDX_DATA + 1];
 	struct iovec *         iov;
+	struct kv_set_iter     set_iter;
+	const struct iovec *   item;
 	unsigned int           i = 0, j;
+	bool                   is_set;
 
 	if (!(iter = kv_store_iter_create(kv_store_res))) {
 		log_error(ID(kv_store_res), INTERNAL_ERROR "%s: failed to create record iterator", __func__);
@@ -587,9 +1188,10 @@ static void _dump_kv_store(const char *str, sid_resource_t *kv_store_res)
 
 	log_print(ID(kv_store_res), "\n======= KV STORE DUMP BEGIN %s =======", str);
 	while ((value = kv_store_iter_next(iter, &size, &flags))) {
-		iov = _get_value_vector(flags, value, size, tmp_iov);
-		if (!strncmp(kv_store_iter_current_key(iter), "U:", 2))
+		if (_get_ns_from_key(kv_store_iter_current_key(iter)) == KV_NS_UDEV)
 			continue;
+		iov    = _get_value_vector(flags, value, size, tmp_iov);
+		is_set = _is_packed_set(flags, value);
 		log_print(ID(kv_store_res), "  --- RECORD %u", i);
 		log_print(ID(kv_store_res), "      key: %s", kv_store_iter_current_key(iter));
 		log_print(ID(kv_store_res),
@@ -602,13 +1204,13 @@ static void _dump_kv_store(const char *str, sid_resource_t *kv_store_res)
 		          KV_VALUE_OWNER(iov));
 		log_print(ID(kv_store_res),
 		          "      value: %s",
-		          flags & KV_STORE_VALUE_VECTOR ? "vector" : (const char *) KV_VALUE_DATA(iov));
-		if (flags & KV_STORE_VALUE_VECTOR) {
-			for (j = KV_VALUE_IDX_DATA; j < size; j++)
-				log_print(ID(kv_store_res),
-				          "        [%u] = %s",
-				          j - KV_VALUE_IDX_DATA,
-				          (const char *) iov[j].iov_base);
+		          flags & KV_STORE_VALUE_VECTOR ? "vector"
+		          : is_set                      ? "set"
+		                                        : (const char *) KV_VALUE_DATA(iov));
+		if ((flags & KV_STORE_VALUE_VECTOR) || is_set) {
+			_set_iter_init(&set_iter, flags, value, size);
+			for (j = 0; (item = _set_iter_next(&set_iter)); j++)
+				log_print(ID(kv_store_res), "        [%u] = %s", j, (const char *) item->iov_base);
 		}
 		log_print(ID(kv_store_res), " ");
 		i++;
@@ -623,15 +1225,16 @@ static void _dump_kv_store_dev_stack_in_dot(const char *str, sid_resource_t *kv_
 	static const char ID[] = "DOT";
 	kv_store_iter_t * iter;
 	void *            value;
-	size_t            value_size, elem_count, dom_len, this_dev_len, ref_dev_len;
+	size_t            value_size, dom_len, this_dev_len, ref_dev_len;
 	const char *      full_key, *key, *dom, *this_dev, *ref_dev;
 
 	kv_store_value_flags_t flags;
 	struct iovec           tmp_iov[KV_VALUE_IDX_DATA + 1];
-	struct iovec *         iov;
-	int                    i;
+	struct kv_set_iter     set_iter;
+	const struct iovec *   item;
 
-	if (!(iter = kv_store_iter_create(kv_store_res))) {
+	/* we're intested in KV_NS_DEVICE records only */
+	if (!(iter = kv_store_iter_create_prefix(kv_store_res, KV_PREFIX_SET_NS_DEVICE))) {
 		log_error(ID(kv_store_res), INTERNAL_ERROR "%s: failed to create record iterator", __func__);
 		goto out;
 	}
@@ -640,11 +1243,6 @@ static void _dump_kv_store_dev_stack_in_dot(const char *str, sid_resource_t *kv_
 
 	while ((value = kv_store_iter_next(iter, &value_size, &flags))) {
 		full_key = kv_store_iter_current_key(iter);
-
-		/* we're intested in KV_NS_DEVICE records only */
-		if (_get_ns_from_key(full_key) != KV_NS_DEVICE)
-			continue;
-
 		key = _get_key_part(full_key, KEY_PART_CORE, NULL);
 
 		/*
@@ -669,15 +1267,17 @@ static void _dump_kv_store_dev_stack_in_dot(const char *str, sid_resource_t *kv_
 			continue;
 
 		this_dev = _get_key_part(full_key, KEY_PART_NS_PART, &this_dev_len);
-		iov      = _get_value_vector(flags, value, value_size, tmp_iov);
 
-		if (flags & KV_STORE_VALUE_VECTOR)
-			elem_count = value_size;
+		/* plain value has one element only, the iterator is empty for it then */
+		_set_iter_init(&set_iter, flags, value, value_size);
+
+		if ((flags & KV_STORE_VALUE_VECTOR) || _is_packed_set(flags, value))
+			item = _set_iter_next(&set_iter);
 		else
-			elem_count = KV_VALUE_IDX_DATA + 1;
+			item = &_get_value_vector(flags, value, value_size, tmp_iov)[KV_VALUE_IDX_DATA];
 
-		for (i = KV_VALUE_IDX_DATA; i < elem_count; i++) {
-			ref_dev = _get_key_part((const char *) iov[i].iov_base, KEY_PART_NS_PART, &ref_dev_len);
+		for (; item; item = _set_iter_next(&set_iter)) {
+			ref_dev = _get_key_part((const char *) item->iov_base, KEY_PART_NS_PART, &ref_dev_len);
 			log_print(ID, "\"%.*s\" -> \"%.*s\"", (int) this_dev_len, this_dev, (int) ref_dev_len, ref_dev);
 		}
 	}
@@ -811,41 +1411,28 @@ static const char *_get_ns_part(struct module *mod, struct sid_ucmd_ctx *ucmd_ct
 
 static void _destroy_delta(struct kv_delta *delta)
 {
-	if (delta->plus) {
-		buffer_destroy(delta->plus);
-		delta->plus = NULL;
-	}
+	free(delta->mem);
 
-	if (delta->minus) {
-		buffer_destroy(delta->minus);
-		delta->minus = NULL;
-	}
+	delta->mem  = NULL;
+	delta->plus = delta->minus = delta->final = NULL;
+	delta->plus_size = delta->minus_size = delta->final_size = 0;
+}
 
-	if (delta->final) {
-		buffer_destroy(delta->final);
-		delta->final = NULL;
-	}
+static bool _set_is_empty(struct kv_value *set, size_t size)
+{
+	return size <= sizeof(struct kv_value) + _kv_value_ext_data_offset(set);
 }
 
 static void _destroy_unused_delta(struct kv_delta *delta)
 {
-	struct iovec *iov;
-	size_t        size;
-
-	if (delta->plus) {
-		buffer_get_data(delta->plus, (const void **) &iov, &size);
-		if (size <= KV_VALUE_IDX_DATA) {
-			buffer_destroy(delta->plus);
-			delta->plus = NULL;
-		}
+	if (delta->plus && _set_is_empty(delta->plus, delta->plus_size)) {
+		delta->plus      = NULL;
+		delta->plus_size = 0;
 	}
 
-	if (delta->minus) {
-		buffer_get_data(delta->minus, (const void **) &iov, &size);
-		if (size <= KV_VALUE_IDX_DATA) {
-			buffer_destroy(delta->minus);
-			delta->minus = NULL;
-		}
+	if (delta->minus && _set_is_empty(delta->minus, delta->minus_size)) {
+		delta->minus      = NULL;
+		delta->minus_size = 0;
 	}
 }
 
@@ -938,17 +1525,38 @@ void *sid_ucmd_set_kv(struct module *         mod,
 	return _do_sid_ucmd_set_kv(mod, ucmd_ctx, ns, KV_KEY_DOM_USER, key, flags, value, value_size);
 }
 
+static const void *
+	_get_kv_value_data(const char *owner, struct kv_value *kv_value, size_t size, size_t *value_size, sid_ucmd_kv_flags_t *flags)
+{
+	size_t data_offset;
+
+	if (kv_value->flags & KV_MOD_PRIVATE) {
+		if (strcmp(kv_value->data, owner))
+			return NULL;
+	}
+
+	if (flags)
+		*flags = kv_value->flags & ~KV_VALUE_PACKED_SET;
+
+	data_offset = _kv_value_ext_data_offset(kv_value);
+	size -= (sizeof(*kv_value) + data_offset);
+
+	if (value_size)
+		*value_size = size;
+
+	return size ? kv_value->data + data_offset : NULL;
+}
+
 static const void *_cmd_get_key_spec_value(struct module *      mod,
                                            struct sid_ucmd_ctx *ucmd_ctx,
                                            struct kv_key_spec * key_spec,
                                            size_t *             value_size,
                                            sid_ucmd_kv_flags_t *flags)
 {
-	const char *     owner    = _get_mod_name(mod);
 	const char *     full_key = NULL;
 	struct kv_value *kv_value;
-	size_t           size, data_offset;
-	void *           ret = NULL;
+	size_t           size;
+	const void *     ret = NULL;
 
 	if (!(full_key = _buffer_compose_key(ucmd_ctx->ucmd_mod_ctx.gen_buf, key_spec)))
 		goto out;
@@ -956,33 +1564,83 @@ static const void *_cmd_get_key_spec_value(struct module *      mod,
 	if (!(kv_value = kv_store_get_value(ucmd_ctx->ucmd_mod_ctx.kv_store_res, full_key, &size, NULL)))
 		goto out;
 
-	if (kv_value->flags & KV_MOD_PRIVATE) {
-		if (strcmp(kv_value->data, owner))
-			goto out;
-	}
-
-	if (flags)
-		*flags = kv_value->flags;
-
-	data_offset = _kv_value_ext_data_offset(kv_value);
-	size -= (sizeof(*kv_value) + data_offset);
-
-	if (value_size)
-		*value_size = size;
-
-	if (size)
-		ret = kv_value->data + data_offset;
+	ret = _get_kv_value_data(_get_mod_name(mod), kv_value, size, value_size, flags);
 out:
 	if (full_key)
 		buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, full_key);
 	return ret;
 }
 
-static const void *_do_sid_ucmd_get_kv(struct module *         mod,
-                                       struct sid_ucmd_ctx *   ucmd_ctx,
-                                       sid_ucmd_kv_namespace_t ns,
-                                       const char *            key,
-                                       size_t *                value_size,
+/*
+ * Perfect hash for the udev keys which are known to core. The slot for each key is
+ * precomputed with UDEV_ENV_KEY_HASH, all known keys are at least 4 characters long.
+ */
+#define UDEV_ENV_KEY_HASH_SIZE      16
+#define UDEV_ENV_KEY_HASH(key, len) (((len) + (unsigned char) (key)[1] + (unsigned char) (key)[3]) & (UDEV_ENV_KEY_HASH_SIZE - 1))
+
+static const struct {
+	const char *   key;
+	size_t         len;
+	udev_env_key_t id;
+} _udev_env_keys[UDEV_ENV_KEY_HASH_SIZE] = {
+	[0]  = {UDEV_KEY_DEVTYPE, sizeof(UDEV_KEY_DEVTYPE) - 1, UDEV_ENV_KEY_DEVTYPE},
+	[2]  = {UDEV_KEY_ACTION, sizeof(UDEV_KEY_ACTION) - 1, UDEV_ENV_KEY_ACTION},
+	[5]  = {UDEV_KEY_MAJOR, sizeof(UDEV_KEY_MAJOR) - 1, UDEV_ENV_KEY_MAJOR},
+	[7]  = {UDEV_KEY_SYNTH_UUID, sizeof(UDEV_KEY_SYNTH_UUID) - 1, UDEV_ENV_KEY_SYNTH_UUID},
+	[9]  = {UDEV_KEY_SEQNUM, sizeof(UDEV_KEY_SEQNUM) - 1, UDEV_ENV_KEY_SEQNUM},
+	[12] = {UDEV_KEY_DEVPATH, sizeof(UDEV_KEY_DEVPATH) - 1, UDEV_ENV_KEY_DEVPATH},
+	[13] = {UDEV_KEY_MINOR, sizeof(UDEV_KEY_MINOR) - 1, UDEV_ENV_KEY_MINOR},
+};
+
+/* Returns udev_env_key_t for the key or _UDEV_ENV_KEY_COUNT if the key is not known. */
+static udev_env_key_t _get_udev_env_key(const char *key, size_t len)
+{
+	unsigned slot;
+
+	if (len < 4)
+		return _UDEV_ENV_KEY_COUNT;
+
+	slot = UDEV_ENV_KEY_HASH(key, len);
+
+	if (_udev_env_keys[slot].len != len || memcmp(_udev_env_keys[slot].key, key, len))
+		return _UDEV_ENV_KEY_COUNT;
+
+	return _udev_env_keys[slot].id;
+}
+
+/*
+ * Look up a value in udev environment. The values are not stored in kv store unless
+ * a module sets them so this is the fallback for sid_ucmd_get_kv with KV_NS_UDEV.
+ */
+static const char *_get_udev_env_value(struct sid_ucmd_ctx *ucmd_ctx, const char *key, size_t *value_size)
+{
+	struct udev_env *env = &ucmd_ctx->udev_env;
+	size_t           len = strlen(key);
+	udev_env_key_t   id;
+	const char *     p, *end, *value = NULL;
+
+	if ((id = _get_udev_env_key(key, len)) < _UDEV_ENV_KEY_COUNT)
+		value = env->known[id];
+	else {
+		for (p = env->mem, end = env->mem + env->size; p < end; p += strlen(p) + 1) {
+			if (!strncmp(p, key, len) && p[len] == KV_PAIR_C[0]) {
+				value = p + len + 1;
+				break;
+			}
+		}
+	}
+
+	if (value && value_size)
+		*value_size = strlen(value) + 1;
+
+	return value;
+}
+
+static const void *_do_sid_ucmd_get_kv(struct module *         mod,
+                                       struct sid_ucmd_ctx *   ucmd_ctx,
+                                       sid_ucmd_kv_namespace_t ns,
+                                       const char *            key,
+                                       size_t *                value_size,
                                        sid_ucmd_kv_flags_t *   flags)
 {
 	struct kv_key_spec key_spec = {.op      = KV_OP_SET,
@@ -992,7 +1650,13 @@ static const void *_do_sid_ucmd_get_kv(struct module *         mod,
 	                               .id      = ID_NULL,
 	                               .id_part = ID_NULL,
 	                               .key     = key};
-	return _cmd_get_key_spec_value(mod, ucmd_ctx, &key_spec, value_size, flags);
+	const void *       value;
+
+	if (!(value = _cmd_get_key_spec_value(mod, ucmd_ctx, &key_spec, value_size, flags)) && ns == KV_NS_UDEV &&
+	    (value = _get_udev_env_value(ucmd_ctx, key, value_size)) && flags)
+		*flags = 0;
+
+	return value;
 }
 
 const void *sid_ucmd_get_kv(struct module *         mod,
@@ -1156,6 +1820,94 @@ int sid_ucmd_mod_add_mod_subregistry(struct module *mod, struct sid_ucmd_mod_ctx
 	return module_registry_add_module_subregistry(res, mod_subregistry);
 }
 
+/*
+ * Core device keys are accessed many times while processing a single command.
+ * Compose each key only once per command and use the interned key afterwards,
+ * the keys are released with the command in _put_dev_keys.
+ */
+static const kv_store_atom_t *_get_dev_key(struct sid_ucmd_ctx *ucmd_ctx, dev_key_t dev_key)
+{
+	static const char *dev_key_map[] = {[DEV_KEY_READY]     = KV_KEY_DEV_READY,
+	                                    [DEV_KEY_RESERVED]  = KV_KEY_DEV_RESERVED,
+	                                    [DEV_KEY_MOD]       = KV_KEY_DEV_MOD,
+	                                    [DEV_KEY_HIERARCHY] = KV_KEY_DEV_HIERARCHY,
+	                                    [DEV_KEY_UDEV]      = KV_KEY_DEV_UDEV};
+	struct kv_key_spec key_spec    = {.op      = KV_OP_SET,
+                                       .ns      = KV_NS_DEVICE,
+                                       .ns_part = ucmd_ctx->dev_id,
+                                       .dom     = ID_NULL,
+                                       .id      = ID_NULL,
+                                       .id_part = ID_NULL,
+                                       .key     = dev_key_map[dev_key]};
+	const char *       full_key;
+
+	if (ucmd_ctx->dev_keys[dev_key])
+		return ucmd_ctx->dev_keys[dev_key];
+
+	if (!(full_key = _buffer_compose_key(ucmd_ctx->ucmd_mod_ctx.gen_buf, &key_spec)))
+		return NULL;
+
+	ucmd_ctx->dev_keys[dev_key] = kv_store_atom_get(ucmd_ctx->ucmd_mod_ctx.kv_store_res, full_key);
+	buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, full_key);
+
+	return ucmd_ctx->dev_keys[dev_key];
+}
+
+/*
+ * Set core device key. Modules can't reserve keys starting with KEY_SYS_C
+ * so there's no need to check global reservations here.
+ */
+static void *_set_dev_kv(struct sid_ucmd_ctx *ucmd_ctx, dev_key_t dev_key, const void *value, size_t value_size)
+{
+	sid_ucmd_kv_flags_t    flags = DEFAULT_KV_FLAGS_CORE;
+	const kv_store_atom_t *atom;
+	struct iovec           iov[KV_VALUE_IDX_DATA + 1];
+	struct kv_value *      kv_value;
+	struct kv_update_arg   update_arg;
+
+	if (!(atom = _get_dev_key(ucmd_ctx, dev_key)))
+		return NULL;
+
+	KV_VALUE_PREPARE_HEADER(iov, ucmd_ctx->udev_dev.seqnum, flags, core_owner);
+	iov[KV_VALUE_IDX_DATA] = (struct iovec) {(void *) value, value_size};
+
+	update_arg = (struct kv_update_arg) {.res      = ucmd_ctx->ucmd_mod_ctx.kv_store_res,
+	                                     .owner    = core_owner,
+	                                     .gen_buf  = ucmd_ctx->ucmd_mod_ctx.gen_buf,
+	                                     .custom   = NULL,
+	                                     .ret_code = -EREMOTEIO};
+
+	if (!(kv_value = kv_store_set_value_atom(ucmd_ctx->ucmd_mod_ctx.kv_store_res,
+	                                         atom,
+	                                         iov,
+	                                         KV_VALUE_IDX_DATA + 1,
+	                                         KV_STORE_VALUE_VECTOR,
+	                                         KV_STORE_VALUE_OP_MERGE,
+	                                         _kv_overwrite,
+	                                         &update_arg)))
+		return NULL;
+
+	return kv_value->data + _kv_value_ext_data_offset(kv_value);
+}
+
+static const void *_get_dev_kv_data(struct sid_ucmd_ctx *ucmd_ctx, dev_key_t dev_key, size_t *value_size)
+{
+	const kv_store_atom_t *atom;
+	struct kv_value *      kv_value;
+	size_t                 size;
+
+	if (!(atom = _get_dev_key(ucmd_ctx, dev_key)) ||
+	    !(kv_value = kv_store_get_value_atom(ucmd_ctx->ucmd_mod_ctx.kv_store_res, atom, &size, NULL)))
+		return NULL;
+
+	return _get_kv_value_data(core_owner, kv_value, size, value_size, NULL);
+}
+
+static const void *_get_dev_kv(struct sid_ucmd_ctx *ucmd_ctx, dev_key_t dev_key)
+{
+	return _get_dev_kv_data(ucmd_ctx, dev_key, NULL);
+}
+
 int sid_ucmd_dev_set_ready(struct module *mod, struct sid_ucmd_ctx *ucmd_ctx, dev_ready_t ready)
 {
 	if (!mod || !ucmd_ctx || (ready == DEV_NOT_RDY_UNDEFINED))
@@ -1167,7 +1919,7 @@ int sid_ucmd_dev_set_ready(struct module *mod, struct sid_ucmd_ctx *ucmd_ctx, de
 	if (ready == DEV_NOT_RDY_UNPROCESSED)
 		return -EINVAL;
 
-	_do_sid_ucmd_set_kv(NULL, ucmd_ctx, KV_NS_DEVICE, NULL, KV_KEY_DEV_READY, DEFAULT_KV_FLAGS_CORE, &ready, sizeof(ready));
+	_set_dev_kv(ucmd_ctx, DEV_KEY_READY, &ready, sizeof(ready));
 
 	return 0;
 }
@@ -1180,7 +1932,7 @@ dev_ready_t sid_ucmd_dev_get_ready(struct module *mod, struct sid_ucmd_ctx *ucmd
 	if (!mod || !ucmd_ctx)
 		return DEV_NOT_RDY_UNDEFINED;
 
-	if (!(p_ready = _do_sid_ucmd_get_kv(NULL, ucmd_ctx, KV_NS_DEVICE, KV_KEY_DEV_READY, NULL, NULL)))
+	if (!(p_ready = _get_dev_kv(ucmd_ctx, DEV_KEY_READY)))
 		result = DEV_NOT_RDY_UNPROCESSED;
 	else
 		result = *p_ready;
@@ -1196,14 +1948,7 @@ int sid_ucmd_dev_set_reserved(struct module *mod, struct sid_ucmd_ctx *ucmd_ctx,
 	if (!(_cmd_scan_phase_regs[ucmd_ctx->scan_phase].flags & CMD_SCAN_CAP_RES))
 		return -EPERM;
 
-	_do_sid_ucmd_set_kv(NULL,
-	                    ucmd_ctx,
-	                    KV_NS_DEVICE,
-	                    NULL,
-	                    KV_KEY_DEV_RESERVED,
-	                    DEFAULT_KV_FLAGS_CORE,
-	                    &reserved,
-	                    sizeof(reserved));
+	_set_dev_kv(ucmd_ctx, DEV_KEY_RESERVED, &reserved, sizeof(reserved));
 
 	return 0;
 }
@@ -1216,7 +1961,7 @@ dev_reserved_t sid_ucmd_dev_get_reserved(struct module *mod, struct sid_ucmd_ctx
 	if (!mod || !ucmd_ctx)
 		return DEV_RES_UNDEFINED;
 
-	if (!(p_reserved = _do_sid_ucmd_get_kv(NULL, ucmd_ctx, KV_NS_DEVICE, KV_KEY_DEV_RESERVED, NULL, NULL)))
+	if (!(p_reserved = _get_dev_kv(ucmd_ctx, DEV_KEY_RESERVED)))
 		result = DEV_RES_UNPROCESSED;
 	else
 		result = *p_reserved;
@@ -1375,7 +2120,9 @@ int sid_ucmd_group_destroy(struct module *         mod,
 {
 	static sid_ucmd_kv_flags_t kv_flags_persist_no_reserved = (DEFAULT_KV_FLAGS_CORE) & ~KV_MOD_RESERVED;
 	const char *               cur_full_key                 = NULL;
-	size_t                     size;
+	void *                     value;
+	size_t                     size, items_size;
+	kv_store_value_flags_t     flags;
 	struct iovec               iov_blank[KV_VALUE_IDX_DATA];
 	int                        r = -1;
 
@@ -1415,10 +2162,13 @@ int sid_ucmd_group_destroy(struct module *         mod,
 	if (!(cur_full_key = _buffer_compose_key(ucmd_ctx->ucmd_mod_ctx.gen_buf, rel_spec.cur_key_spec)))
 		goto out;
 
-	if (!kv_store_get_value(ucmd_ctx->ucmd_mod_ctx.kv_store_res, cur_full_key, &size, NULL))
+	if (!(value = kv_store_get_value(ucmd_ctx->ucmd_mod_ctx.kv_store_res, cur_full_key, &size, &flags)))
+		goto out;
+
+	if (_get_set_items_size(flags, value, size, &items_size, NULL) < 0)
 		goto out;
 
-	if (size > KV_VALUE_IDX_DATA && !force) {
+	if (items_size && !force) {
 		r = -ENOTEMPTY;
 		goto out;
 	}
@@ -1445,49 +2195,43 @@ out:
 	return r;
 }
 
-static int _device_add_field(struct sid_ucmd_ctx *ucmd_ctx, const char *start)
+static void _device_add_field(struct sid_ucmd_ctx *ucmd_ctx, udev_env_key_t id, const char *value)
 {
-	const char *key;
-	const char *value;
-	int         r = -1;
-
-	if (!(value = strchr(start, KV_PAIR_C[0])) || !*(++value))
-		return -1;
-
-	if (!(key = buffer_fmt_add(ucmd_ctx->ucmd_mod_ctx.gen_buf, &r, "%.*s", value - start - 1, start)))
-		return r;
-	;
-
-	if (!(value = _do_sid_ucmd_set_kv(NULL, ucmd_ctx, KV_NS_UDEV, NULL, key, 0, value, strlen(value) + 1)))
-		goto out;
+	ucmd_ctx->udev_env.known[id] = value;
 
 	/* Common key=value pairs are also directly in the ucmd_ctx->udev_dev structure. */
-	if (!strcmp(key, UDEV_KEY_ACTION))
-		ucmd_ctx->udev_dev.action = util_udev_str_to_udev_action(value);
-	else if (!strcmp(key, UDEV_KEY_DEVPATH)) {
-		ucmd_ctx->udev_dev.path = value;
-		ucmd_ctx->udev_dev.name = util_str_rstr(value, "/");
-		ucmd_ctx->udev_dev.name++;
-	} else if (!strcmp(key, UDEV_KEY_DEVTYPE))
-		ucmd_ctx->udev_dev.type = util_udev_str_to_udev_devtype(value);
-	else if (!strcmp(key, UDEV_KEY_SEQNUM))
-		ucmd_ctx->udev_dev.seqnum = strtoull(value, NULL, 10);
-	else if (!strcmp(key, UDEV_KEY_SYNTH_UUID))
-		ucmd_ctx->udev_dev.synth_uuid = value;
-
-	r = 0;
-out:
-	buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, key);
-	return r;
-};
+	switch (id) {
+		case UDEV_ENV_KEY_ACTION:
+			ucmd_ctx->udev_dev.action = util_udev_str_to_udev_action(value);
+			break;
+		case UDEV_ENV_KEY_DEVPATH:
+			ucmd_ctx->udev_dev.path = value;
+			ucmd_ctx->udev_dev.name = util_str_rstr(value, "/");
+			ucmd_ctx->udev_dev.name++;
+			break;
+		case UDEV_ENV_KEY_DEVTYPE:
+			ucmd_ctx->udev_dev.type = util_udev_str_to_udev_devtype(value);
+			break;
+		case UDEV_ENV_KEY_SEQNUM:
+			ucmd_ctx->udev_dev.seqnum = strtoull(value, NULL, 10);
+			break;
+		case UDEV_ENV_KEY_SYNTH_UUID:
+			ucmd_ctx->udev_dev.synth_uuid = value;
+			break;
+		default:
+			break;
+	}
+}
 
 static int _parse_cmd_nullstr_udev_env(struct sid_ucmd_ctx *ucmd_ctx, const char *env, size_t env_size)
 {
-	dev_t       devno;
-	const char *end;
-	int         r = 0;
+	struct udev_env *udev_env = &ucmd_ctx->udev_env;
+	dev_t            devno;
+	char *           p, *end, *value;
+	udev_env_key_t   id;
+	int              r = 0;
 
-	if (env_size <= sizeof(devno)) {
+	if (env_size <= sizeof(devno) || env[env_size - 1]) {
 		r = -EINVAL;
 		goto out;
 	}
@@ -1505,15 +2249,72 @@ static int _parse_cmd_nullstr_udev_env(struct sid_ucmd_ctx *ucmd_ctx, const char
 	 * We have this on input ('devno' prefix is already processed so skip it):
 	 *
 	 *   devnokey1=value1\0key2=value2\0...
+	 *
+	 * The environment is copied as a whole and the values are used right from the copy.
 	 */
-	for (end = env + env_size, env += sizeof(devno); env < end; env += strlen(env) + 1) {
-		if ((r = _device_add_field(ucmd_ctx, env) < 0))
-			goto out;
+	udev_env->size = env_size - sizeof(devno);
+
+	if (!(udev_env->mem = malloc(udev_env->size))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(udev_env->mem, env + sizeof(devno), udev_env->size);
+
+	for (p = udev_env->mem, end = p + udev_env->size; p < end; p += strlen(p) + 1) {
+		if (!(value = strchr(p, KV_PAIR_C[0])) || !*(++value))
+			continue;
+
+		if ((id = _get_udev_env_key(p, value - p - 1)) < _UDEV_ENV_KEY_COUNT)
+			_device_add_field(ucmd_ctx, id, value);
 	}
 out:
 	return r;
 }
 
+/*
+ * Splits data into count NUL-terminated strings, empty strings are recorded as NULL.
+ * No data at all is the same as count empty strings.
+ */
+static int _parse_nullstr_args(char *data, size_t data_size, const char **parts, unsigned count)
+{
+	char *   p = data, *end = data + data_size;
+	unsigned i;
+
+	memset(parts, 0, count * sizeof(*parts));
+
+	if (!data_size)
+		return 0;
+
+	if (end[-1])
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (p >= end)
+			return -EINVAL;
+		if (*p)
+			parts[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	return p == end ? 0 : -EINVAL;
+}
+
+static int _parse_cmd_args(struct sid_ucmd_ctx *ucmd_ctx, const char *data, size_t data_size, unsigned count)
+{
+	struct cmd_args *args = &ucmd_ctx->args;
+
+	if (!data_size)
+		return 0;
+
+	if (!(args->mem = malloc(data_size)))
+		return -ENOMEM;
+
+	memcpy(args->mem, data, data_size);
+
+	return _parse_nullstr_args(args->mem, data_size, args->parts, count);
+}
+
 static void _canonicalize_module_name(char *name)
 {
 	char *p = name;
@@ -1551,7 +2352,7 @@ static const char *_lookup_module_name(sid_resource_t *cmd_res)
 	int                  major;
 	size_t               len;
 
-	if ((mod_name = _do_sid_ucmd_get_kv(NULL, ucmd_ctx, KV_NS_DEVICE, KV_KEY_DEV_MOD, NULL, NULL)))
+	if ((mod_name = _get_dev_kv(ucmd_ctx, DEV_KEY_MOD)))
 		goto out;
 
 	if (!(f = fopen(SYSTEM_PROC_DEVICES_PATH, "r"))) {
@@ -1626,14 +2427,7 @@ static const char *_lookup_module_name(sid_resource_t *cmd_res)
 	buf[len] = '\0';
 	_canonicalize_module_name(buf);
 
-	if (!(mod_name = _do_sid_ucmd_set_kv(NULL,
-	                                     ucmd_ctx,
-	                                     KV_NS_DEVICE,
-	                                     NULL,
-	                                     KV_KEY_DEV_MOD,
-	                                     DEFAULT_KV_FLAGS_CORE,
-	                                     buf,
-	                                     strlen(buf) + 1)))
+	if (!(mod_name = _set_dev_kv(ucmd_ctx, DEV_KEY_MOD, buf, strlen(buf) + 1)))
 		log_error_errno(ID(cmd_res), errno, "Failed to store device " CMD_DEV_ID_FMT " module name", CMD_DEV_ID(ucmd_ctx));
 out:
 	if (f)
@@ -1663,6 +2457,20 @@ static int _cmd_exec_version(struct cmd_exec_arg *exec_arg)
 	return r;
 }
 
+static int _cmd_exec_event_stats(struct cmd_exec_arg *exec_arg)
+{
+	/* main process replies itself if the statistics are enabled, see _reply_event_stats */
+	log_error(ID(exec_arg->cmd_res), "Event source statistics not enabled, set %s=1 to enable them.", KEY_ENV_EVENT_STATS);
+	return -ENOTSUP;
+}
+
+static int _cmd_exec_scan_batch(struct cmd_exec_arg *exec_arg)
+{
+	/* batch is split into separate scan commands on receipt, see _create_scan_batch_commands */
+	log_error(ID(exec_arg->cmd_res), INTERNAL_ERROR "%s: Scan batch executed as a whole.", __func__);
+	return -EINVAL;
+}
+
 static int _cmd_exec_dump(struct cmd_exec_arg *exec_arg)
 {
 	int                  r;
@@ -1670,13 +2478,51 @@ static int _cmd_exec_dump(struct cmd_exec_arg *exec_arg)
 	char *               dump_data;
 	size_t               size;
 
-	if ((r = _write_kv_store_dump(ucmd_ctx->ucmd_mod_ctx.gen_buf, ucmd_ctx->ucmd_mod_ctx.kv_store_res)) == 0) {
+	/* the reply is a vector, it only references the last part left in gen_buf */
+	if ((r = _write_kv_store_dump(exec_arg->cmd_res, USID_PROTOCOL_HAS_EXT(ucmd_ctx->request_header.prot))) == 0) {
 		buffer_get_data(ucmd_ctx->ucmd_mod_ctx.gen_buf, (const void **) &dump_data, &size);
 		buffer_add(ucmd_ctx->res_buf, dump_data, size, &r);
 	}
 	return r;
 }
 
+/* normally answered by main process, only requests following the first one on a connection get here */
+static int _cmd_exec_get(struct cmd_exec_arg *exec_arg)
+{
+	int                  r;
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	struct buffer *      buf      = ucmd_ctx->ucmd_mod_ctx.gen_buf;
+	char *               data;
+	size_t               size;
+
+	if ((r = _write_kv_get_result(buf, ucmd_ctx->ucmd_mod_ctx.kv_store_res, ucmd_ctx->args.parts)) == 0) {
+		buffer_get_data(buf, (const void **) &data, &size);
+		buffer_add(ucmd_ctx->res_buf, data, size, &r);
+	}
+	return r;
+}
+
+static int _cmd_exec_subscribe(struct cmd_exec_arg *exec_arg)
+{
+	/* main process takes over subscribing connections, see _add_subscriber */
+	log_error(ID(exec_arg->cmd_res), "Subscription must be the first request on a connection.");
+	return -EINVAL;
+}
+
+static int _cmd_exec_module_stats(struct cmd_exec_arg *exec_arg)
+{
+	/* main process keeps the statistics and it replies itself, see _reply_module_stats */
+	log_error(ID(exec_arg->cmd_res), INTERNAL_ERROR "%s: Module statistics requested from worker.", __func__);
+	return -ENOTSUP;
+}
+
+static int _cmd_exec_stats(struct cmd_exec_arg *exec_arg)
+{
+	/* main process keeps the statistics and it replies itself, see _reply_stats */
+	log_error(ID(exec_arg->cmd_res), INTERNAL_ERROR "%s: Statistics requested from worker.", __func__);
+	return -ENOTSUP;
+}
+
 static int _get_sysfs_value(struct module *mod, const char *path, char *buf, size_t buf_size)
 {
 	FILE * fp;
@@ -1707,23 +2553,82 @@ out:
 	return r;
 }
 
+/* Same as _get_sysfs_value, but with path relative to dir_fd. */
+static int _get_sysfs_value_at(struct module *mod, int dir_fd, const char *path, char *buf, size_t buf_size)
+{
+	ssize_t len;
+	int     fd;
+
+	if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+		log_sys_error(_get_mod_name(mod), "openat", path);
+		return -1;
+	}
+
+	if ((len = read(fd, buf, buf_size - 1)) < 0) {
+		log_sys_error(_get_mod_name(mod), "read", path);
+		(void) close(fd);
+		return -1;
+	}
+
+	(void) close(fd);
+
+	buf[len] = '\0';
+	if (len && buf[len - 1] == '\n')
+		buf[--len] = '\0';
+
+	if (!len) {
+		log_error(_get_mod_name(mod), "No value found in %s.", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns fd of SYSTEM_SYSFS_PATH "/dev/block" directory for sysfs lookups relative to devno,
+ * so the path of the device does not need to be resolved each time. The directory is kept
+ * open in the command pool, without the pool it is opened for each use and own is set to
+ * tell the caller to close it.
+ */
+static int _get_sysfs_dev_block_fd(struct sid_ucmd_ctx *ucmd_ctx, bool *own)
+{
+	int fd;
+
+	if (ucmd_ctx->pool && ucmd_ctx->pool->sysfs_dev_block_fd >= 0) {
+		*own = false;
+		return ucmd_ctx->pool->sysfs_dev_block_fd;
+	}
+
+	if ((fd = open(SYSTEM_SYSFS_PATH "/dev/block", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -errno;
+
+	if (!(*own = !ucmd_ctx->pool))
+		ucmd_ctx->pool->sysfs_dev_block_fd = fd;
+
+	return fd;
+}
+
 int _part_get_whole_disk(struct module *mod, struct sid_ucmd_ctx *ucmd_ctx, char *devno, size_t size)
 {
-	const char *s;
-	int         r;
+	char path[32];
+	bool own_fd;
+	int  dev_block_fd, r;
 
-	if (!ucmd_ctx || !mod || !devno || !size)
+	/* mod is NULL if called from core */
+	if (!ucmd_ctx || !devno || !size)
 		return -EINVAL;
 
-	if (!(s = buffer_fmt_add(ucmd_ctx->ucmd_mod_ctx.gen_buf, &r, "%s%s/../dev", SYSTEM_SYSFS_PATH, ucmd_ctx->udev_dev.path))) {
-		log_error_errno(_get_mod_name(mod),
-		                r,
-		                "Failed to compose sysfs path for whole device of partition device " CMD_DEV_ID_FMT,
-		                CMD_DEV_ID(ucmd_ctx));
-		return r;
+	if ((dev_block_fd = _get_sysfs_dev_block_fd(ucmd_ctx, &own_fd)) < 0) {
+		log_error_errno(_get_mod_name(mod), dev_block_fd, "Failed to open sysfs directory with block devices");
+		return dev_block_fd;
 	}
-	r = _get_sysfs_value(mod, s, devno, size);
-	buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, s);
+
+	snprintf(path, sizeof(path), "%d:%d/../dev", ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor);
+	r = _get_sysfs_value_at(mod, dev_block_fd, path, devno, size);
+
+	if (own_fd)
+		(void) close(dev_block_fd);
+
 	if (r < 0)
 		return r;
 
@@ -1757,319 +2662,361 @@ const void *sid_ucmd_part_get_disk_kv(struct module *      mod,
 	return _cmd_get_key_spec_value(mod, ucmd_ctx, &key_spec, value_size, flags);
 }
 
-static int _init_delta_buffer(struct buffer **delta_buf, size_t size, struct iovec *header, size_t header_size)
+static size_t _get_set_header_size(struct iovec *header)
 {
-	struct buffer *buf = NULL;
-	size_t         i;
-	int            r = 0;
+	return sizeof(struct kv_value) + header[KV_VALUE_IDX_OWNER].iov_len;
+}
 
-	if (!size)
-		return 0;
+static void _set_add_item(struct kv_value *set, size_t *size, const struct iovec *item)
+{
+	kv_set_item_len_t len = item->iov_len;
 
-	if (size < header_size) {
-		r = -EINVAL;
-		goto out;
-	}
+	memcpy((char *) set + *size, &len, sizeof(len));
+	memcpy((char *) set + *size + sizeof(len), item->iov_base, len);
+	*size += sizeof(len) + len;
+}
 
-	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
-	                                                  .type    = BUFFER_TYPE_VECTOR,
-	                                                  .mode    = BUFFER_MODE_PLAIN}),
-	                          &((struct buffer_init) {.size = size, .alloc_step = 0, .limit = 0}),
-	                          &r)))
-		goto out;
+static void _init_delta_set(struct kv_value **set, size_t *set_size, char **mem, size_t capacity, struct iovec *header)
+{
+	if (!capacity)
+		return;
 
-	for (i = 0; i < header_size; i++) {
-		if (!buffer_add(buf, header[i].iov_base, header[i].iov_len, &r))
-			goto out;
-	}
-out:
-	if (r < 0)
-		free(buf);
-	else
-		*delta_buf = buf;
-	return r;
+	*set = (struct kv_value *) *mem;
+	*mem += capacity;
+
+	(*set)->seqnum = KV_VALUE_SEQNUM(header);
+	(*set)->flags  = KV_VALUE_FLAGS(header) | KV_VALUE_PACKED_SET;
+	memcpy((*set)->data, KV_VALUE_OWNER(header), header[KV_VALUE_IDX_OWNER].iov_len);
+	*set_size = _get_set_header_size(header);
 }
 
+/*
+ * Capacities are the maximum sizes of each packed set in bytes, including the header.
+ * All the sets are allocated at once and items are then added without any further
+ * bound checks so the capacities must be computed in advance by the caller.
+ */
 static int _init_delta_struct(struct kv_delta *delta,
-                              size_t           minus_size,
-                              size_t           plus_size,
-                              size_t           final_size,
-                              struct iovec *   header,
-                              size_t           header_size)
-{
-	if (_init_delta_buffer(&delta->plus, plus_size, header, header_size) < 0 ||
-	    _init_delta_buffer(&delta->minus, minus_size, header, header_size) < 0 ||
-	    _init_delta_buffer(&delta->final, final_size, header, header_size) < 0) {
-		_destroy_delta(delta);
-		return -1;
-	}
+                              size_t           minus_capacity,
+                              size_t           plus_capacity,
+                              size_t           final_capacity,
+                              struct iovec *   header)
+{
+	size_t header_size;
+	char * mem;
 
-	return 0;
-}
+	if (!minus_capacity && !plus_capacity && !final_capacity)
+		return 0;
 
-static int _iov_str_item_cmp(const void *a, const void *b)
-{
-	const struct iovec *iovec_item_a = (struct iovec *) a;
-	const struct iovec *iovec_item_b = (struct iovec *) b;
+	if (!header)
+		return -EINVAL;
 
-	return strcmp((const char *) iovec_item_a->iov_base, (const char *) iovec_item_b->iov_base);
-}
+	header_size = _get_set_header_size(header);
 
-static int _delta_step_calculate(struct kv_store_update_spec *spec, struct kv_update_arg *update_arg)
-{
-	struct kv_delta *delta     = ((struct kv_rel_spec *) update_arg->custom)->delta;
-	struct iovec *   old_value = spec->old_data;
-	size_t           old_size  = spec->old_data_size;
-	struct iovec *   new_value = spec->new_data;
-	size_t           new_size  = spec->new_data_size;
-	size_t           i_old, i_new;
-	int              cmp_result;
-	int              r = -1;
+	if ((minus_capacity && minus_capacity < header_size) || (plus_capacity && plus_capacity < header_size) ||
+	    (final_capacity && final_capacity < header_size))
+		return -EINVAL;
 
-	if (_init_delta_struct(delta, old_size, new_size, old_size + new_size, new_value, KV_VALUE_IDX_DATA) < 0)
-		goto out;
+	if (!(mem = malloc(minus_capacity + plus_capacity + final_capacity)))
+		return -ENOMEM;
 
-	if (!old_size)
-		old_size = KV_VALUE_IDX_DATA;
-
-	if (!new_size)
-		new_size = KV_VALUE_IDX_DATA;
-
-	/* start right beyond the header */
-	i_old = i_new = KV_VALUE_IDX_DATA;
-
-	/* look for differences between old_value and new_value vector */
-	while (1) {
-		if ((i_old < old_size) && (i_new < new_size)) {
-			/* both vectors still still have items to handle */
-			cmp_result = strcmp(old_value[i_old].iov_base, new_value[i_new].iov_base);
-			if (cmp_result < 0) {
-				/* the old vector has item the new one doesn't have */
-				switch (delta->op) {
-					case KV_OP_SET:
-						/* we have detected removed item: add it to delta->minus */
-						if (!buffer_add(delta->minus,
-						                old_value[i_old].iov_base,
-						                old_value[i_old].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_PLUS:
-					/* we're keeping old item: add it to delta->final */
-					/* no break here intentionally! */
-					case KV_OP_MINUS:
-						/* we're keeping old item: add it to delta->final */
-						if (!buffer_add(delta->final,
-						                old_value[i_old].iov_base,
-						                old_value[i_old].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_ILLEGAL:
-						goto out;
-				}
-				i_old++;
-			} else if (cmp_result > 0) {
-				/* the new vector has item the old one doesn't have */
-				switch (delta->op) {
-					case KV_OP_SET:
-					/* we have detected new item: add it to delta->plus and delta->final */
-					/* no break here intentionally! */
-					case KV_OP_PLUS:
-						/* we're adding new item: add it to delta->plus and delta->final */
-						if (!buffer_add(delta->plus,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r) ||
-						    !buffer_add(delta->final,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_MINUS:
-						/* we're trying to remove non-existing item: ignore it */
-						break;
-					case KV_OP_ILLEGAL:
-						goto out;
-				}
-				i_new++;
-			} else {
-				/* both old and new has the item */
-				switch (delta->op) {
-					case KV_OP_SET:
-					/* we have detected no change for this item: add it to delta->final */
-					/* no break here intentionally! */
-					case KV_OP_PLUS:
-						/* we're trying to add already existing item: add it to delta->final but not
-						 * delta->plus */
-						if (!buffer_add(delta->final,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_MINUS:
-						/* we're removing item: add it to delta->minus */
-						if (!buffer_add(delta->minus,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_ILLEGAL:
-						goto out;
-				}
-				i_old++;
-				i_new++;
-			}
-			continue;
-		} else if (i_old == old_size) {
-			/* only new vector still has items to handle */
-			while (i_new < new_size) {
-				switch (delta->op) {
-					case KV_OP_SET:
-					/* we have detected new item: add it to delta->final */
-					/* no break here intentionally! */
-					case KV_OP_PLUS:
-						/* we're adding new item: add it to delta->plus and delta->final */
-						if (!buffer_add(delta->plus,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r) ||
-						    !buffer_add(delta->final,
-						                new_value[i_new].iov_base,
-						                new_value[i_new].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_MINUS:
-						/* we're removing non-existing item: don't add to delta->minus */
-						break;
-					case KV_OP_ILLEGAL:
-						goto out;
-				}
-				i_new++;
-			}
-		} else if (i_new == new_size) {
-			/* only old vector still has items to handle */
-			while (i_old < old_size) {
-				switch (delta->op) {
-					case KV_OP_SET:
-						/* we have detected removed item: add it to delta->minus */
-						if (!buffer_add(delta->minus,
-						                old_value[i_old].iov_base,
-						                old_value[i_old].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_PLUS:
-					/* we're keeping old item: add it to delta->final */
-					/* no break here intentionally! */
-					case KV_OP_MINUS:
-						/* we're not changing the old item so add it to delta->final */
-						if (!buffer_add(delta->final,
-						                old_value[i_old].iov_base,
-						                old_value[i_old].iov_len,
-						                &r))
-							goto out;
-						break;
-					case KV_OP_ILLEGAL:
-						goto out;
-				}
-				i_old++;
-			}
-		}
-		/* no more items to process in both old and new vector: exit */
-		break;
-	}
+	delta->mem = mem;
 
-	r = 0;
-out:
-	if (r < 0)
-		_destroy_delta(delta);
-	else
-		_destroy_unused_delta(delta);
+	_init_delta_set(&delta->plus, &delta->plus_size, &mem, plus_capacity, header);
+	_init_delta_set(&delta->minus, &delta->minus_size, &mem, minus_capacity, header);
+	_init_delta_set(&delta->final, &delta->final_size, &mem, final_capacity, header);
 
-	return r;
+	return 0;
 }
 
-static void _delta_cross_bitmap_calculate(struct cross_bitmap_calc_arg *cross)
+/*
+ * Compares set items holding strings, the same way strcmp does. The item
+ * lengths are known so memcmp can be used instead of looking for the terminating
+ * NUL byte and the comparison never runs past the end of any of the items.
+ */
+static int _iov_str_cmp(const struct iovec *iov_a, const struct iovec *iov_b)
 {
-	size_t old_size, new_size;
-	size_t i_old, i_new;
-	int    cmp_result;
-
-	if ((old_size = cross->old_size) < KV_VALUE_IDX_DATA)
-		old_size = KV_VALUE_IDX_DATA;
+	size_t len = iov_a->iov_len < iov_b->iov_len ? iov_a->iov_len : iov_b->iov_len;
+	int    r;
 
-	if ((new_size = cross->new_size) < KV_VALUE_IDX_DATA)
-		new_size = KV_VALUE_IDX_DATA;
-
-	i_old = i_new = KV_VALUE_IDX_DATA;
+	if ((r = memcmp(iov_a->iov_base, iov_b->iov_base, len)))
+		return r;
 
-	while (1) {
-		if ((i_old < old_size) && (i_new < new_size)) {
-			/* both vectors still have items to handle */
-			cmp_result = strcmp(cross->old_value[i_old].iov_base, cross->new_value[i_new].iov_base);
-			if (cmp_result < 0) {
-				/* the old vector has item the new one doesn't have: OK */
-				i_old++;
-			} else if (cmp_result > 0) {
-				/* the new vector has item the old one doesn't have: OK */
-				i_new++;
-			} else {
-				/* both old and new has the item: we have found contradiction! */
-				bitmap_bit_unset(cross->old_bmp, i_old);
-				bitmap_bit_unset(cross->new_bmp, i_new);
-				i_old++;
-				i_new++;
-			}
-		} else if (i_old == old_size) {
-			/* only new vector still has items to handle: nothing else to compare */
-			break;
-		} else if (i_new == new_size) {
-			/* only old vector still has items to handle: nothing else to compare */
-			break;
-		}
-	}
+	return (len < iov_a->iov_len ? ((const unsigned char *) iov_a->iov_base)[len] : 0) -
+	       (len < iov_b->iov_len ? ((const unsigned char *) iov_b->iov_base)[len] : 0);
 }
 
-static int _delta_abs_calculate(struct kv_store_update_spec *spec, struct kv_update_arg *update_arg, struct kv_delta *abs_delta)
+static int _iov_str_item_cmp(const void *a, const void *b)
+{
+	return _iov_str_cmp(a, b);
+}
+
+static int _delta_step_calculate(struct kv_store_update_spec *spec, struct kv_update_arg *update_arg)
+{
+	struct kv_delta *   delta = ((struct kv_rel_spec *) update_arg->custom)->delta;
+	struct iovec        tmp_header[KV_VALUE_IDX_DATA + 1];
+	struct iovec *      header;
+	struct kv_set_iter  old_iter, new_iter;
+	const struct iovec *old_item, *new_item;
+	size_t              header_size, old_items_size, new_items_size;
+	int                 cmp_result;
+
+	if (delta->op == KV_OP_ILLEGAL)
+		return -1;
+
+	if (!(header = _get_value_vector(spec->new_flags, spec->new_data, spec->new_data_size, tmp_header)))
+		return -1;
+
+	if (_get_set_items_size(spec->old_flags, spec->old_data, spec->old_data_size, &old_items_size, NULL) < 0 ||
+	    _get_set_items_size(spec->new_flags, spec->new_data, spec->new_data_size, &new_items_size, NULL) < 0)
+		return -1;
+
+	header_size = _get_set_header_size(header);
+
+	/*
+	 * Both sets are sorted so each step adds at most one item to each of the
+	 * output sets: plus can have at most the new items, minus at most the old
+	 * items and final at most both the old and the new items.
+	 */
+	if (_init_delta_struct(delta,
+	                       old_items_size ? header_size + old_items_size : 0,
+	                       new_items_size ? header_size + new_items_size : 0,
+	                       header_size + old_items_size + new_items_size,
+	                       header) < 0)
+		return -1;
+
+	_set_iter_init(&old_iter, spec->old_flags, spec->old_data, spec->old_data_size);
+	_set_iter_init(&new_iter, spec->new_flags, spec->new_data, spec->new_data_size);
+
+	old_item = _set_iter_next(&old_iter);
+	new_item = _set_iter_next(&new_iter);
+
+	/* look for differences between old and new set */
+	while (old_item || new_item) {
+		if (!new_item)
+			/* only old set still has items to handle */
+			cmp_result = -1;
+		else if (!old_item)
+			/* only new set still has items to handle */
+			cmp_result = 1;
+		else
+			/* both sets still have items to handle */
+			cmp_result = _iov_str_cmp(old_item, new_item);
+
+		if (cmp_result < 0) {
+			/* the old set has item the new one doesn't have */
+			switch (delta->op) {
+				case KV_OP_SET:
+					/* we have detected removed item: add it to delta->minus */
+					_set_add_item(delta->minus, &delta->minus_size, old_item);
+					break;
+				default:
+					/* we're keeping old item: add it to delta->final */
+					_set_add_item(delta->final, &delta->final_size, old_item);
+					break;
+			}
+			old_item = _set_iter_next(&old_iter);
+		} else if (cmp_result > 0) {
+			/* the new set has item the old one doesn't have */
+			switch (delta->op) {
+				case KV_OP_MINUS:
+					/* we're trying to remove non-existing item: ignore it */
+					break;
+				default:
+					/* we're adding new item: add it to delta->plus and delta->final */
+					_set_add_item(delta->plus, &delta->plus_size, new_item);
+					_set_add_item(delta->final, &delta->final_size, new_item);
+					break;
+			}
+			new_item = _set_iter_next(&new_iter);
+		} else {
+			/* both old and new has the item */
+			switch (delta->op) {
+				case KV_OP_MINUS:
+					/* we're removing item: add it to delta->minus */
+					_set_add_item(delta->minus, &delta->minus_size, new_item);
+					break;
+				default:
+					/*
+					 * we have detected no change for this item or we're trying to add
+					 * already existing item: add it to delta->final but not delta->plus
+					 */
+					_set_add_item(delta->final, &delta->final_size, new_item);
+					break;
+			}
+			old_item = _set_iter_next(&old_iter);
+			new_item = _set_iter_next(&new_iter);
+		}
+	}
+
+	_destroy_unused_delta(delta);
+	return 0;
+}
+
+/*
+ * Bitmaps in cross_bitmap_calc_arg are indexed by the item position in the set.
+ * A bitmap is not created for a set without any items.
+ */
+static int _cross_init_side(void *                 value,
+                            size_t                 size,
+                            kv_store_value_flags_t flags,
+                            size_t *               items_size,
+                            struct bitmap **       bmp)
+{
+	size_t count;
+
+	if (_get_set_items_size(flags, value, size, items_size, &count) < 0)
+		return -1;
+
+	if (count && !(*bmp = bitmap_create(count, true, NULL)))
+		return -1;
+
+	return 0;
+}
+
+static void _delta_cross_bitmap_calculate(struct cross_bitmap_calc_arg *cross)
+{
+	struct kv_set_iter  old_iter, new_iter;
+	const struct iovec *old_item, *new_item;
+	size_t              i_old = 0, i_new = 0;
+	int                 cmp_result;
+
+	if (!cross->old_bmp || !cross->new_bmp)
+		return;
+
+	_set_iter_init(&old_iter, cross->old_flags, cross->old_value, cross->old_size);
+	_set_iter_init(&new_iter, KV_STORE_VALUE_NO_FLAGS, cross->new_value, cross->new_size);
+
+	old_item = _set_iter_next(&old_iter);
+	new_item = _set_iter_next(&new_iter);
+
+	/* only compare while both sets still have items to handle */
+	while (old_item && new_item) {
+		cmp_result = _iov_str_cmp(old_item, new_item);
+		if (cmp_result < 0) {
+			/* the old set has item the new one doesn't have: OK */
+			old_item = _set_iter_next(&old_iter);
+			i_old++;
+		} else if (cmp_result > 0) {
+			/* the new set has item the old one doesn't have: OK */
+			new_item = _set_iter_next(&new_iter);
+			i_new++;
+		} else {
+			/* both old and new has the item: we have found contradiction! */
+			bitmap_bit_unset(cross->old_bmp, i_old);
+			bitmap_bit_unset(cross->new_bmp, i_new);
+			old_item = _set_iter_next(&old_iter);
+			new_item = _set_iter_next(&new_iter);
+			i_old++;
+			i_new++;
+		}
+	}
+}
+
+/*
+ * Returns the next item with corresponding bit set in the bitmap. The 'i' is
+ * the position of the next item the iterator returns and it is updated here.
+ * The bitmap has as many bits as there are items in the set.
+ */
+static const struct iovec *_set_iter_next_marked(struct kv_set_iter *iter, size_t *i, struct bitmap *bmp)
+{
+	const struct iovec *item;
+	size_t              next;
+
+	if (!bmp)
+		return NULL;
+
+	next = bitmap_find_next_set(bmp, *i);
+
+	while ((item = _set_iter_next(iter))) {
+		if ((*i)++ == next)
+			break;
+	}
+
+	return item;
+}
+
+/*
+ * Merges items from two sorted sets into one, taking only items with
+ * corresponding bit set in the bitmap. Both sets are already sorted so
+ * the result is sorted as well. An item found in both sets is added once.
+ */
+static void _delta_merge(struct kv_value *      set,
+                         size_t *               set_size,
+                         kv_store_value_flags_t flags_a,
+                         void *                 value_a,
+                         size_t                 size_a,
+                         struct bitmap *        bmp_a,
+                         kv_store_value_flags_t flags_b,
+                         void *                 value_b,
+                         size_t                 size_b,
+                         struct bitmap *        bmp_b)
+{
+	struct kv_set_iter  iter_a, iter_b;
+	const struct iovec *item_a, *item_b;
+	size_t              i_a = 0, i_b = 0;
+	int                 cmp_result;
+
+	_set_iter_init(&iter_a, flags_a, value_a, size_a);
+	_set_iter_init(&iter_b, flags_b, value_b, size_b);
+
+	item_a = _set_iter_next_marked(&iter_a, &i_a, bmp_a);
+	item_b = _set_iter_next_marked(&iter_b, &i_b, bmp_b);
+
+	while (item_a || item_b) {
+		if (item_a && item_b)
+			cmp_result = _iov_str_cmp(item_a, item_b);
+		else
+			cmp_result = item_a ? -1 : 1;
+
+		if (cmp_result > 0) {
+			_set_add_item(set, set_size, item_b);
+			item_b = _set_iter_next_marked(&iter_b, &i_b, bmp_b);
+		} else {
+			_set_add_item(set, set_size, item_a);
+			if (cmp_result == 0)
+				item_b = _set_iter_next_marked(&iter_b, &i_b, bmp_b);
+			item_a = _set_iter_next_marked(&iter_a, &i_a, bmp_a);
+		}
+	}
+}
+
+static int _delta_abs_calculate(struct kv_store_update_spec *spec, struct kv_update_arg *update_arg, struct kv_delta *abs_delta)
 {
 	struct cross_bitmap_calc_arg cross1   = {0};
 	struct cross_bitmap_calc_arg cross2   = {0};
 	struct kv_rel_spec *         rel_spec = update_arg->custom;
 	kv_op_t                      orig_op  = rel_spec->cur_key_spec->op;
+	struct iovec                 tmp_header[KV_VALUE_IDX_DATA + 1];
+	struct iovec *               header;
 	const char *                 delta_full_key;
-	struct iovec *               abs_plus, *abs_minus;
-	size_t                       i, abs_plus_size, abs_minus_size;
+	size_t                       header_size, abs_plus_capacity = 0, abs_minus_capacity = 0;
 	int                          r = -1;
 
 	if (!rel_spec->delta->plus && !rel_spec->delta->minus)
 		return 0;
 
+	if (!(header = _get_value_vector(spec->new_flags, spec->new_data, spec->new_data_size, tmp_header)))
+		return -1;
+
+	header_size = _get_set_header_size(header);
+
 	rel_spec->cur_key_spec->op = KV_OP_PLUS;
 	delta_full_key             = _buffer_compose_key(update_arg->gen_buf, rel_spec->cur_key_spec);
 	if (!delta_full_key)
 		goto out;
-	cross1.old_value = kv_store_get_value(update_arg->res, delta_full_key, &cross1.old_size, NULL);
+	cross1.old_value = kv_store_get_value(update_arg->res, delta_full_key, &cross1.old_size, &cross1.old_flags);
 	buffer_rewind_mem(update_arg->gen_buf, delta_full_key);
-	if (cross1.old_value) {
-		if (!(cross1.old_bmp = bitmap_create(cross1.old_size, true, NULL)))
-			goto out;
-	}
+	if (_cross_init_side(cross1.old_value, cross1.old_size, cross1.old_flags, &cross1.old_items_size, &cross1.old_bmp) < 0)
+		goto out;
 
 	rel_spec->cur_key_spec->op = KV_OP_MINUS;
 	delta_full_key             = _buffer_compose_key(update_arg->gen_buf, rel_spec->cur_key_spec);
 	if (!delta_full_key)
 		goto out;
-	cross2.old_value = kv_store_get_value(update_arg->res, delta_full_key, &cross2.old_size, NULL);
+	cross2.old_value = kv_store_get_value(update_arg->res, delta_full_key, &cross2.old_size, &cross2.old_flags);
 	buffer_rewind_mem(update_arg->gen_buf, delta_full_key);
-	if (cross2.old_value) {
-		if (!(cross2.old_bmp = bitmap_create(cross2.old_size, true, NULL)))
-			goto out;
-	}
+	if (_cross_init_side(cross2.old_value, cross2.old_size, cross2.old_flags, &cross2.old_items_size, &cross2.old_bmp) < 0)
+		goto out;
 
 	/*
 	 * set up cross1 - old plus vs. new minus
@@ -2080,9 +3027,10 @@ static int _delta_abs_calculate(struct kv_store_update_spec *spec, struct kv_upd
 	 * minus      |---> minus
 	 */
 	if (rel_spec->delta->minus) {
-		buffer_get_data(rel_spec->delta->minus, (const void **) &cross1.new_value, &cross1.new_size);
+		cross1.new_value = rel_spec->delta->minus;
+		cross1.new_size  = rel_spec->delta->minus_size;
 
-		if (!(cross1.new_bmp = bitmap_create(cross1.new_size, true, NULL)))
+		if (_cross_init_side(cross1.new_value, cross1.new_size, 0, &cross1.new_items_size, &cross1.new_bmp) < 0)
 			goto out;
 
 		/* cross-compare old_plus with new_minus and unset bitmap positions where we find contradiction */
@@ -2098,9 +3046,10 @@ static int _delta_abs_calculate(struct kv_store_update_spec *spec, struct kv_upd
 	 * minus <---|     minus
 	 */
 	if (rel_spec->delta->plus) {
-		buffer_get_data(rel_spec->delta->plus, (const void **) &cross2.new_value, &cross2.new_size);
+		cross2.new_value = rel_spec->delta->plus;
+		cross2.new_size  = rel_spec->delta->plus_size;
 
-		if (!(cross2.new_bmp = bitmap_create(cross2.new_size, true, NULL)))
+		if (_cross_init_side(cross2.new_value, cross2.new_size, 0, &cross2.new_items_size, &cross2.new_bmp) < 0)
 			goto out;
 
 		/* cross-compare old_minus with new_plus and unset bitmap positions where we find contradiction */
@@ -2108,71 +3057,51 @@ static int _delta_abs_calculate(struct kv_store_update_spec *spec, struct kv_upd
 	}
 
 	/*
-	 * count overall size for both plus and minus taking only non-contradicting items
+	 * Count the upper bound of overall size for both plus and minus. The absolute
+	 * set is created even if all its items contradict so it overwrites the old one.
 	 *
 	 * OLD             NEW
 	 *
 	 * plus  <---+---> plus
 	 * minus <---+---> minus
 	 */
-	abs_minus_size = ((cross2.old_bmp ? bitmap_get_bit_set_count(cross2.old_bmp) : 0) +
-	                  (cross1.new_bmp ? bitmap_get_bit_set_count(cross1.new_bmp) : 0));
-	if (cross2.old_bmp && cross1.new_bmp)
-		abs_minus_size -= KV_VALUE_IDX_DATA;
-
-	abs_plus_size = ((cross1.old_bmp ? bitmap_get_bit_set_count(cross1.old_bmp) : 0) +
-	                 (cross2.new_bmp ? bitmap_get_bit_set_count(cross2.new_bmp) : 0));
-	if (cross1.old_bmp && cross2.new_bmp)
-		abs_plus_size -= KV_VALUE_IDX_DATA;
-
-	/* go through the old and new plus and minus vectors and merge non-contradicting items */
-	if (_init_delta_struct(abs_delta, abs_minus_size, abs_plus_size, 0, spec->new_data, KV_VALUE_IDX_DATA) < 0)
+	if (cross2.old_value || cross1.new_value)
+		abs_minus_capacity = header_size + cross2.old_items_size + cross1.new_items_size;
+
+	if (cross1.old_value || cross2.new_value)
+		abs_plus_capacity = header_size + cross1.old_items_size + cross2.new_items_size;
+
+	/* go through the old and new plus and minus sets and merge non-contradicting items */
+	if (_init_delta_struct(abs_delta, abs_minus_capacity, abs_plus_capacity, 0, header) < 0)
 		goto out;
 
 	if (rel_spec->delta->flags & DELTA_WITH_REL)
 		abs_delta->flags |= DELTA_WITH_REL;
 
-	if (cross1.old_value) {
-		for (i = KV_VALUE_IDX_DATA; i < cross1.old_size; i++) {
-			if (bitmap_bit_is_set(cross1.old_bmp, i, NULL) &&
-			    !buffer_add(abs_delta->plus, cross1.old_value[i].iov_base, cross1.old_value[i].iov_len, &r))
-				goto out;
-		}
-	}
-
-	if (cross1.new_value) {
-		for (i = KV_VALUE_IDX_DATA; i < cross1.new_size; i++) {
-			if (bitmap_bit_is_set(cross1.new_bmp, i, NULL) &&
-			    !buffer_add(abs_delta->minus, cross1.new_value[i].iov_base, cross1.new_value[i].iov_len, &r))
-				goto out;
-		}
-	}
-
-	if (cross2.old_value) {
-		for (i = KV_VALUE_IDX_DATA; i < cross2.old_size; i++) {
-			if (bitmap_bit_is_set(cross2.old_bmp, i, NULL) &&
-			    !buffer_add(abs_delta->minus, cross2.old_value[i].iov_base, cross2.old_value[i].iov_len, &r))
-				goto out;
-		}
-	}
-
-	if (cross2.new_value) {
-		for (i = KV_VALUE_IDX_DATA; i < cross2.new_size; i++) {
-			if (bitmap_bit_is_set(cross2.new_bmp, i, NULL) &&
-			    !buffer_add(abs_delta->plus, cross2.new_value[i].iov_base, cross2.new_value[i].iov_len, &r))
-				goto out;
-		}
-	}
-
-	if (abs_delta->plus) {
-		buffer_get_data(abs_delta->plus, (const void **) &abs_plus, &abs_plus_size);
-		qsort(abs_plus + KV_VALUE_IDX_DATA, abs_plus_size - KV_VALUE_IDX_DATA, sizeof(struct iovec), _iov_str_item_cmp);
-	}
-
-	if (abs_delta->minus) {
-		buffer_get_data(abs_delta->minus, (const void **) &abs_minus, &abs_minus_size);
-		qsort(abs_minus + KV_VALUE_IDX_DATA, abs_minus_size - KV_VALUE_IDX_DATA, sizeof(struct iovec), _iov_str_item_cmp);
-	}
+	/* all the sets are sorted so merging them keeps the result sorted */
+	if (abs_delta->plus)
+		_delta_merge(abs_delta->plus,
+		             &abs_delta->plus_size,
+		             cross1.old_flags,
+		             cross1.old_value,
+		             cross1.old_size,
+		             cross1.old_bmp,
+		             0,
+		             cross2.new_value,
+		             cross2.new_size,
+		             cross2.new_bmp);
+
+	if (abs_delta->minus)
+		_delta_merge(abs_delta->minus,
+		             &abs_delta->minus_size,
+		             cross2.old_flags,
+		             cross2.old_value,
+		             cross2.old_size,
+		             cross2.old_bmp,
+		             0,
+		             cross1.new_value,
+		             cross1.new_size,
+		             cross1.new_bmp);
 
 	r = 0;
 out:
@@ -2193,15 +3122,6 @@ out:
 	return r;
 }
 
-// TODO: Make it possible to set all flags at once or change selected flag bits.
-static void _value_vector_mark_persist(struct iovec *iov, int persist)
-{
-	if (persist)
-		iov[KV_VALUE_IDX_FLAGS] = (struct iovec) {&kv_flags_persist, sizeof(kv_flags_persist)};
-	else
-		iov[KV_VALUE_IDX_FLAGS] = (struct iovec) {&kv_flags_no_persist, sizeof(kv_flags_no_persist)};
-}
-
 static void _flip_key_specs(struct kv_rel_spec *rel_spec)
 {
 	struct kv_key_spec *tmp_key_spec;
@@ -2214,27 +3134,34 @@ static void _flip_key_specs(struct kv_rel_spec *rel_spec)
 static int
 	_delta_update(struct kv_store_update_spec *spec, struct kv_update_arg *update_arg, struct kv_delta *abs_delta, kv_op_t op)
 {
-	uint64_t            seqnum        = KV_VALUE_SEQNUM(spec->new_data);
 	struct kv_rel_spec *rel_spec      = update_arg->custom;
 	kv_op_t             orig_op       = rel_spec->cur_key_spec->op;
 	const char *        tmp_mem_start = buffer_add(update_arg->gen_buf, "", 0, NULL);
 	struct kv_delta *   orig_delta;
-	struct iovec *      delta_iov, *abs_delta_iov;
-	size_t              delta_iov_cnt, abs_delta_iov_cnt, i;
+	struct kv_value *   delta_set, *abs_delta_set;
+	size_t              delta_set_size, abs_delta_set_size;
+	struct kv_set_iter  iter;
+	const struct iovec *item;
 	const char *        key_prefix, *ns_part, *full_key;
+	struct iovec        tmp_header[KV_VALUE_IDX_DATA + 1];
 	struct iovec        rel_iov[KV_VALUE_IDX_DATA + 1];
+	uint64_t            seqnum;
 	int                 r = 0;
 
 	if (op == KV_OP_PLUS) {
 		if (!abs_delta->plus)
 			return 0;
-		buffer_get_data(abs_delta->plus, (const void **) &abs_delta_iov, &abs_delta_iov_cnt);
-		buffer_get_data(rel_spec->delta->plus, (const void **) &delta_iov, &delta_iov_cnt);
+		abs_delta_set      = abs_delta->plus;
+		abs_delta_set_size = abs_delta->plus_size;
+		delta_set          = rel_spec->delta->plus;
+		delta_set_size     = rel_spec->delta->plus_size;
 	} else if (op == KV_OP_MINUS) {
 		if (!abs_delta->minus)
 			return 0;
-		buffer_get_data(abs_delta->minus, (const void **) &abs_delta_iov, &abs_delta_iov_cnt);
-		buffer_get_data(rel_spec->delta->minus, (const void **) &delta_iov, &delta_iov_cnt);
+		abs_delta_set      = abs_delta->minus;
+		abs_delta_set_size = abs_delta->minus_size;
+		delta_set          = rel_spec->delta->minus;
+		delta_set_size     = rel_spec->delta->minus_size;
 	} else {
 		log_error(ID(update_arg->res), INTERNAL_ERROR "%s: incorrect delta operation requested.", __func__);
 		return -1;
@@ -2247,23 +3174,21 @@ static int
 	if (!full_key)
 		return -1;
 
-	_value_vector_mark_persist(abs_delta_iov, 1);
+	abs_delta_set->flags = kv_flags_persist | KV_VALUE_PACKED_SET;
 
 	kv_store_set_value(update_arg->res,
 	                   full_key,
-	                   abs_delta_iov,
-	                   abs_delta_iov_cnt,
-	                   KV_STORE_VALUE_VECTOR,
+	                   abs_delta_set,
+	                   abs_delta_set_size,
+	                   KV_STORE_VALUE_NO_FLAGS,
 	                   KV_STORE_VALUE_NO_OP,
 	                   _kv_overwrite,
 	                   update_arg);
 
-	_value_vector_mark_persist(abs_delta_iov, 0);
-
 	buffer_rewind_mem(update_arg->gen_buf, full_key);
 
 	/* the other way round now - store final and absolute delta for each relative */
-	if (delta_iov_cnt && rel_spec->delta->flags & DELTA_WITH_REL) {
+	if (delta_set && rel_spec->delta->flags & DELTA_WITH_REL) {
 		_flip_key_specs(rel_spec);
 		orig_delta = rel_spec->delta;
 
@@ -2283,11 +3208,14 @@ static int
 			r = -1;
 			goto fail;
 		}
+		seqnum = KV_VALUE_SEQNUM(_get_value_vector(spec->new_flags, spec->new_data, spec->new_data_size, tmp_header));
 		KV_VALUE_PREPARE_HEADER(rel_iov, seqnum, kv_flags_no_persist, (char *) update_arg->owner);
 		rel_iov[KV_VALUE_IDX_DATA] = (struct iovec) {.iov_base = (void *) key_prefix, .iov_len = strlen(key_prefix) + 1};
 
-		for (i = KV_VALUE_IDX_DATA; i < delta_iov_cnt; i++) {
-			ns_part                         = _buffer_copy_ns_part_from_key(update_arg->gen_buf, delta_iov[i].iov_base);
+		_set_iter_init(&iter, KV_STORE_VALUE_NO_FLAGS, delta_set, delta_set_size);
+
+		while ((item = _set_iter_next(&iter))) {
+			ns_part                         = _buffer_copy_ns_part_from_key(update_arg->gen_buf, item->iov_base);
 			rel_spec->cur_key_spec->ns_part = ns_part;
 			full_key                        = _buffer_compose_key(update_arg->gen_buf, rel_spec->cur_key_spec);
 			if (!full_key) {
@@ -2471,14 +3399,15 @@ static int _kv_delta(const char *full_key __attribute__((unused)), struct kv_sto
 	}
 
 	/*
-	 * Get the actual vector out of rel_spec->delta->final and rewrite spec->new_data
-	 * with this one. Also, make the vector to be copied instead of referenced only
-	 * because we will destroy the delta buffer completely.
+	 * Get the actual packed set out of rel_spec->delta->final and rewrite spec->new_data
+	 * with this one. Also, make the set to be copied instead of referenced only
+	 * because we will destroy the delta sets completely.
 	 */
 	if (rel_spec->delta->final) {
-		buffer_get_data(rel_spec->delta->final, (const void **) &spec->new_data, &spec->new_data_size);
+		spec->new_data      = rel_spec->delta->final;
+		spec->new_data_size = rel_spec->delta->final_size;
 
-		spec->new_flags &= ~KV_STORE_VALUE_REF;
+		spec->new_flags &= ~(KV_STORE_VALUE_VECTOR | KV_STORE_VALUE_REF);
 
 		r = 1;
 	}
@@ -2488,18 +3417,159 @@ out:
 	return r;
 }
 
+/*
+ * Reads devnos of the device's slaves from sysfs. Each event for a device with slaves would
+ * otherwise read the dev file of each slave again while the slaves hardly ever change, so
+ * the result is cached in the command pool. The cached result is used as long as entries in
+ * the slaves directory still have the same inodes, which only requires reading the directory.
+ *
+ * If the result is not cached, because there is no pool, own is set and the caller frees it.
+ */
+static struct sysfs_slaves *_get_sysfs_slaves(sid_resource_t *cmd_res, bool *own)
+{
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(cmd_res);
+	struct radix_tree ** cache    = ucmd_ctx->pool ? &ucmd_ctx->pool->sysfs_slaves : NULL;
+	struct sysfs_slaves *cached = NULL, *slaves = NULL, *tmp_slaves;
+	char                 dir_path[32], dev_path[NAME_MAX + 8];
+	DIR *                dir = NULL;
+	struct dirent *      dirent;
+	unsigned             i = 0, alloc = 0;
+	bool                 own_fd;
+	int                  dev_block_fd, fd = -1;
+
+	*own = false;
+
+	if ((dev_block_fd = _get_sysfs_dev_block_fd(ucmd_ctx, &own_fd)) < 0) {
+		log_error_errno(ID(cmd_res), dev_block_fd, "Failed to open sysfs directory with block devices");
+		return NULL;
+	}
+
+	snprintf(dir_path, sizeof(dir_path), "%d:%d/" SYSTEM_SYSFS_SLAVES, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor);
+
+	if ((fd = openat(dev_block_fd, dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || !(dir = fdopendir(fd))) {
+		/*
+		 * FIXME: Add code to deal with/warn about: (errno == ENOENT) && (ucmd_ctx->udev_dev.action !=
+		 * UDEV_ACTION_REMOVE). That means we don't have REMOVE uevent, but at the same time, we don't have sysfs
+		 * content, e.g. because we're processing this uevent too late: the device has already been removed right
+		 * after this uevent was triggered. For now, error out even in this case.
+		 */
+		log_sys_error(ID(cmd_res), fd < 0 ? "openat" : "fdopendir", dir_path);
+		goto out;
+	}
+
+	fd = -1;
+
+	if (cache && *cache)
+		cached = radix_lookup(*cache, dir_path, strlen(dir_path) + 1, NULL);
+
+	if (cached) {
+		while ((dirent = readdir(dir))) {
+			if (dirent->d_name[0] == '.')
+				continue;
+
+			if (i == cached->count || cached->slaves[i].ino != dirent->d_ino)
+				break;
+			i++;
+		}
+
+		if (!dirent && i == cached->count) {
+			slaves = cached;
+			goto out;
+		}
+
+		rewinddir(dir);
+	}
+
+	i = 0;
+
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		if (i == alloc) {
+			alloc = alloc ? alloc * 2 : 4;
+
+			if (!(tmp_slaves = realloc(slaves, sizeof(*slaves) + alloc * sizeof(struct sysfs_slave)))) {
+				log_error(ID(cmd_res),
+				          "Failed to allocate slave list for device " CMD_DEV_ID_FMT,
+				          CMD_DEV_ID(ucmd_ctx));
+				free(slaves);
+				slaves = NULL;
+				goto out;
+			}
+			slaves = tmp_slaves;
+		}
+
+		snprintf(dev_path, sizeof(dev_path), "%s/dev", dirent->d_name);
+
+		if (_get_sysfs_value_at(NULL, dirfd(dir), dev_path, slaves->slaves[i].devno, sizeof(slaves->slaves[i].devno)) < 0)
+			continue;
+
+		_canonicalize_kv_key(slaves->slaves[i].devno);
+		slaves->slaves[i].ino = dirent->d_ino;
+		i++;
+	}
+
+	if (!slaves && !(slaves = mem_zalloc(sizeof(*slaves)))) {
+		log_error(ID(cmd_res), "Failed to allocate slave list for device " CMD_DEV_ID_FMT, CMD_DEV_ID(ucmd_ctx));
+		goto out;
+	}
+
+	slaves->count = i;
+
+	if (cache && (*cache || (*cache = radix_create())) && radix_insert(*cache, dir_path, strlen(dir_path) + 1, slaves, 0) == 0)
+		free(cached);
+	else
+		*own = true;
+out:
+	if (dir)
+		(void) closedir(dir);
+	if (fd >= 0)
+		(void) close(fd);
+	if (own_fd)
+		(void) close(dev_block_fd);
+
+	return slaves;
+}
+
+/* Checks if the record under the key contains exactly the items passed in iov, starting from KV_VALUE_IDX_DATA. */
+static bool _kv_set_equals(sid_resource_t *kv_store_res, const char *key, struct iovec *iov, size_t iov_cnt)
+{
+	struct kv_set_iter     old_iter, new_iter;
+	const struct iovec *   old_item, *new_item;
+	kv_store_value_flags_t flags;
+	size_t                 size;
+	void *                 value;
+
+	if (!(value = kv_store_get_value(kv_store_res, key, &size, &flags)))
+		return false;
+
+	_set_iter_init(&old_iter, flags, value, size);
+	_set_iter_init(&new_iter, KV_STORE_VALUE_VECTOR, iov, iov_cnt);
+
+	do {
+		old_item = _set_iter_next(&old_iter);
+		new_item = _set_iter_next(&new_iter);
+
+		if (!old_item || !new_item)
+			return old_item == new_item;
+	} while (old_item->iov_len == new_item->iov_len && !memcmp(old_item->iov_base, new_item->iov_base, old_item->iov_len));
+
+	return false;
+}
+
 static int _refresh_device_disk_hierarchy_from_sysfs(sid_resource_t *cmd_res)
 {
 	/* FIXME: ...fail completely here, discarding any changes made to DB so far if any of the steps below fail? */
 	struct sid_ucmd_ctx *ucmd_ctx      = sid_resource_get_data(cmd_res);
 	const char *         tmp_mem_start = buffer_add(ucmd_ctx->ucmd_mod_ctx.gen_buf, "", 0, NULL);
 	const char *         s;
-	struct dirent **     dirent  = NULL;
-	struct buffer *      vec_buf = NULL;
-	char                 devno_buf[16];
+	struct sysfs_slaves *slaves     = NULL;
+	bool                 own_slaves = false;
+	struct buffer *      vec_buf    = NULL;
 	struct iovec *       iov;
 	size_t               iov_cnt;
-	int                  count = 0, i;
+	unsigned             count = 0, i;
 	int                  r     = -1;
 
 	struct kv_rel_spec rel_spec = {.delta = &((struct kv_delta) {.op    = KV_OP_SET,
@@ -2531,44 +3601,19 @@ static int _refresh_device_disk_hierarchy_from_sysfs(sid_resource_t *cmd_res)
 	                                   .custom  = &rel_spec};
 
 	if (ucmd_ctx->udev_dev.action != UDEV_ACTION_REMOVE) {
-		if (!(s = buffer_fmt_add(ucmd_ctx->ucmd_mod_ctx.gen_buf,
-		                         &r,
-		                         "%s%s/%s",
-		                         SYSTEM_SYSFS_PATH,
-		                         ucmd_ctx->udev_dev.path,
-		                         SYSTEM_SYSFS_SLAVES))) {
-			log_error_errno(ID(cmd_res),
-			                r,
-			                "Failed to compose sysfs %s path for device " CMD_DEV_ID_FMT,
-			                SYSTEM_SYSFS_SLAVES,
-			                CMD_DEV_ID(ucmd_ctx));
-			goto out;
-		}
-
-		if ((count = scandir(s, &dirent, NULL, NULL)) < 0) {
-			/*
-			 * FIXME: Add code to deal with/warn about: (errno == ENOENT) && (ucmd_ctx->udev_dev.action !=
-			 * UDEV_ACTION_REMOVE). That means we don't have REMOVE uevent, but at the same time, we don't have sysfs
-			 * content, e.g. because we're processing this uevent too late: the device has already been removed right
-			 * after this uevent was triggered. For now, error out even in this case.
-			 */
-			log_sys_error(ID(cmd_res), "scandir", s);
+		if (!(slaves = _get_sysfs_slaves(cmd_res, &own_slaves)))
 			goto out;
-		}
-
-		buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, s);
+		count = slaves->count;
 	}
 
 	/*
 	 * Create vec_buf used to set up database records.
-	 * (count - 2 + 3) == (count + 1)
-	 * -2 to subtract "." and ".." directory which we're not interested in
 	 * +3 for "seqnum|flags|owner" header
 	 */
 	if (!(vec_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
 	                                                      .type    = BUFFER_TYPE_VECTOR,
 	                                                      .mode    = BUFFER_MODE_PLAIN}),
-	                              &((struct buffer_init) {.size = count + 1, .alloc_step = 1, .limit = 0}),
+	                              &((struct buffer_init) {.size = count + 3, .alloc_step = 1, .limit = 0}),
 	                              &r))) {
 		log_error_errno(ID(cmd_res),
 		                r,
@@ -2583,46 +3628,15 @@ static int _refresh_device_disk_hierarchy_from_sysfs(sid_resource_t *cmd_res)
 	    !buffer_add(vec_buf, core_owner, strlen(core_owner) + 1, &r))
 		goto out;
 
-	/* Read relatives from sysfs into vec_buf. */
-	if (ucmd_ctx->udev_dev.action != UDEV_ACTION_REMOVE) {
-		for (i = 0; i < count; i++) {
-			if (dirent[i]->d_name[0] == '.') {
-				free(dirent[i]);
-				continue;
-			}
+	/* Add relatives read from sysfs to vec_buf. */
+	for (i = 0; i < count; i++) {
+		rel_spec.rel_key_spec->ns_part = slaves->slaves[i].devno;
 
-			if ((s = buffer_fmt_add(ucmd_ctx->ucmd_mod_ctx.gen_buf,
-			                        &r,
-			                        "%s%s/%s/%s/dev",
-			                        SYSTEM_SYSFS_PATH,
-			                        ucmd_ctx->udev_dev.path,
-			                        SYSTEM_SYSFS_SLAVES,
-			                        dirent[i]->d_name))) {
-				if (_get_sysfs_value(NULL, s, devno_buf, sizeof(devno_buf)) < 0) {
-					buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, s);
-					continue;
-				}
-				buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, s);
-
-				_canonicalize_kv_key(devno_buf);
-				rel_spec.rel_key_spec->ns_part = devno_buf;
-
-				s = _buffer_compose_key_prefix(ucmd_ctx->ucmd_mod_ctx.gen_buf, rel_spec.rel_key_spec);
-				if (!s || !buffer_add(vec_buf, (void *) s, strlen(s) + 1, &r))
-					goto out;
-			} else
-				log_error_errno(
-					ID(cmd_res),
-					r,
-					"Failed to compose sysfs path for device %s which is relative of device " CMD_DEV_ID_FMT,
-					dirent[i]->d_name,
-					CMD_DEV_ID(ucmd_ctx));
-
-			free(dirent[i]);
-		}
-		free(dirent);
-		rel_spec.rel_key_spec->ns_part = ID_NULL;
+		s = _buffer_compose_key_prefix(ucmd_ctx->ucmd_mod_ctx.gen_buf, rel_spec.rel_key_spec);
+		if (!s || !buffer_add(vec_buf, (void *) s, strlen(s) + 1, &r))
+			goto out;
 	}
+	rel_spec.rel_key_spec->ns_part = ID_NULL;
 
 	/* Get the actual vector with relatives and sort it. */
 	buffer_get_data(vec_buf, (const void **) (&iov), &iov_cnt);
@@ -2637,6 +3651,12 @@ static int _refresh_device_disk_hierarchy_from_sysfs(sid_resource_t *cmd_res)
 		goto out;
 	}
 
+	/* Nothing to do if the record already has the same relatives, the relations are set up already too. */
+	if (_kv_set_equals(ucmd_ctx->ucmd_mod_ctx.kv_store_res, s, iov, iov_cnt)) {
+		r = 0;
+		goto out;
+	}
+
 	/*
 	 * Handle delta.final vector for this device.
 	 * The delta.final is computed inside _kv_delta out of vec_buf.
@@ -2656,6 +3676,8 @@ out:
 	_destroy_delta(rel_spec.delta);
 	if (vec_buf)
 		buffer_destroy(vec_buf);
+	if (own_slaves)
+		free(slaves);
 	buffer_rewind_mem(ucmd_ctx->ucmd_mod_ctx.gen_buf, tmp_mem_start);
 	return r;
 }
@@ -2719,6 +3741,12 @@ static int _refresh_device_partition_hierarchy_from_sysfs(sid_resource_t *cmd_re
 		goto out;
 	}
 
+	/* Nothing to do if the record already has the same relative, the relation is set up already too. */
+	if (_kv_set_equals(ucmd_ctx->ucmd_mod_ctx.kv_store_res, s, iov_to_store, KV_VALUE_IDX_DATA + 1)) {
+		r = 0;
+		goto out;
+	}
+
 	/*
 	 * Handle delta.final vector for this device.
 	 * The delta.final is computed inside _kv_delta out of vec_buf.
@@ -2760,128 +3788,462 @@ static int _refresh_device_hierarchy_from_sysfs(sid_resource_t *cmd_res)
 	return 0;
 }
 
-static int _execute_block_modules(struct cmd_exec_arg *exec_arg, cmd_scan_phase_t phase)
+/* Returns statistics for the module, they are added if not there yet. Returns NULL if that fails. */
+static struct mod_stats *_get_mod_stats(struct radix_tree **t, const char *name)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	sid_resource_t *          block_mod_res;
-	struct module *           block_mod;
-	const struct cmd_mod_fns *block_mod_fns;
-	int                       r = -1;
+	struct mod_stats *stats;
+	size_t            len = strlen(name) + 1;
 
-	sid_resource_iter_reset(exec_arg->block_mod_iter);
+	if (!*t && !(*t = radix_create()))
+		return NULL;
 
-	while ((block_mod_res = sid_resource_iter_next(exec_arg->block_mod_iter))) {
-		if (module_registry_get_module_symbols(block_mod_res, (const void ***) &block_mod_fns) < 0) {
-			log_error(ID(exec_arg->cmd_res), "Failed to retrieve module symbols from module %s.", ID(block_mod_res));
-			goto out;
-		}
+	if ((stats = radix_lookup(*t, name, len, NULL)))
+		return stats;
 
-		block_mod = sid_resource_get_data(block_mod_res);
+	if (!(stats = mem_zalloc(sizeof(*stats))))
+		return NULL;
 
-		switch (phase) {
-			case CMD_SCAN_PHASE_A_IDENT:
-				if (block_mod_fns->ident && block_mod_fns->ident(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_A_SCAN_PRE:
-				if (block_mod_fns->scan_pre && block_mod_fns->scan_pre(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_A_SCAN_CURRENT:
-				if (block_mod_fns->scan_current && block_mod_fns->scan_current(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_A_SCAN_NEXT:
-				if (block_mod_fns->scan_next && block_mod_fns->scan_next(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_A_SCAN_POST_CURRENT:
-				if (block_mod_fns->scan_post_current && block_mod_fns->scan_post_current(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_A_SCAN_POST_NEXT:
-				if (block_mod_fns->scan_post_next && block_mod_fns->scan_post_next(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_B_TRIGGER_ACTION_CURRENT:
-				if (block_mod_fns->trigger_action_current &&
-				    block_mod_fns->trigger_action_current(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_B_TRIGGER_ACTION_NEXT:
-				if (block_mod_fns->trigger_action_next &&
-				    block_mod_fns->trigger_action_next(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			case CMD_SCAN_PHASE_ERROR:
-				if (block_mod_fns->error && block_mod_fns->error(block_mod, ucmd_ctx) < 0)
-					goto out;
-				break;
-			default:
-				log_error(ID(exec_arg->cmd_res),
-				          INTERNAL_ERROR "%s: Trying illegal execution of block modules in %s state.",
-				          __func__,
-				          _cmd_scan_phase_regs[phase].name);
-				break;
-		}
+	if (radix_insert(*t, name, len, stats, sizeof(*stats)) < 0) {
+		free(stats);
+		return NULL;
 	}
 
-	r = 0;
-out:
-	return r;
+	return stats;
 }
 
-static int _set_device_kv_records(sid_resource_t *cmd_res)
+static void _destroy_mod_stats(struct radix_tree *t)
 {
-	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(cmd_res);
-	dev_ready_t          ready;
-	dev_reserved_t       reserved;
-
-	if (!_do_sid_ucmd_get_kv(NULL, ucmd_ctx, KV_NS_DEVICE, KV_KEY_DEV_READY, NULL, NULL)) {
-		ready    = DEV_NOT_RDY_UNPROCESSED;
-		reserved = DEV_RES_UNPROCESSED;
+	if (!t)
+		return;
 
-		_do_sid_ucmd_set_kv(NULL,
-		                    ucmd_ctx,
-		                    KV_NS_DEVICE,
-		                    NULL,
-		                    KV_KEY_DEV_READY,
-		                    DEFAULT_KV_FLAGS_CORE,
-		                    &ready,
-		                    sizeof(ready));
-		_do_sid_ucmd_set_kv(NULL,
-		                    ucmd_ctx,
-		                    KV_NS_DEVICE,
-		                    NULL,
-		                    KV_KEY_DEV_RESERVED,
-		                    DEFAULT_KV_FLAGS_CORE,
-		                    &reserved,
-		                    sizeof(reserved));
-	}
+	radix_iter(t, free);
+	radix_destroy(t);
+}
 
-	_refresh_device_hierarchy_from_sysfs(cmd_res);
+static struct mod_stats *_get_type_mod_stats(struct sid_ucmd_ctx *ucmd_ctx, sid_resource_t *type_mod_res)
+{
+	/* only workers have the pool and the statistics are sent to main process from there */
+	if (!type_mod_res || !ucmd_ctx->pool)
+		return NULL;
 
-	return 0;
+	return _get_mod_stats(&ucmd_ctx->pool->mod_stats, module_get_full_name(sid_resource_get_data(type_mod_res)));
 }
 
-static int _cmd_exec_scan_init(struct cmd_exec_arg *exec_arg)
+static int _call_mod_fn(sid_ucmd_fn_t *fn, struct module *mod, struct sid_ucmd_ctx *ucmd_ctx, struct mod_phase_stats *stats)
 {
-	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	sid_resource_t *     block_mod_registry_res;
+	uint64_t start_usec, usec;
+	int      r;
 
-	if (!(block_mod_registry_res = sid_resource_search(ucmd_ctx->ucmd_mod_ctx.modules_res,
-	                                                   SID_RESOURCE_SEARCH_IMM_DESC,
-	                                                   &sid_resource_type_module_registry,
-	                                                   MODULES_BLOCK_ID))) {
-		log_error(ID(exec_arg->cmd_res), INTERNAL_ERROR "%s: Failed to find block module registry resource.", __func__);
-		goto fail;
+	if (!stats)
+		return fn(mod, ucmd_ctx);
+
+	start_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
+	r          = fn(mod, ucmd_ctx);
+	usec       = util_time_get_now_usec(CLOCK_MONOTONIC) - start_usec;
+
+	stats->calls++;
+	stats->usec_total += usec;
+
+	if (r < 0)
+		stats->failures++;
+
+	if (usec > stats->usec_max)
+		stats->usec_max = usec;
+
+	return r;
+}
+
+static sid_ucmd_fn_t *_get_mod_fn(const struct cmd_mod_fns *block_mod_fns, cmd_scan_phase_t phase)
+{
+	switch (phase) {
+		case CMD_SCAN_PHASE_A_IDENT:
+			return block_mod_fns->ident;
+		case CMD_SCAN_PHASE_A_SCAN_PRE:
+			return block_mod_fns->scan_pre;
+		case CMD_SCAN_PHASE_A_SCAN_CURRENT:
+			return block_mod_fns->scan_current;
+		case CMD_SCAN_PHASE_A_SCAN_NEXT:
+			return block_mod_fns->scan_next;
+		case CMD_SCAN_PHASE_A_SCAN_POST_CURRENT:
+			return block_mod_fns->scan_post_current;
+		case CMD_SCAN_PHASE_A_SCAN_POST_NEXT:
+			return block_mod_fns->scan_post_next;
+		case CMD_SCAN_PHASE_B_TRIGGER_ACTION_CURRENT:
+			return block_mod_fns->trigger_action_current;
+		case CMD_SCAN_PHASE_B_TRIGGER_ACTION_NEXT:
+			return block_mod_fns->trigger_action_next;
+		case CMD_SCAN_PHASE_ERROR:
+			return block_mod_fns->error;
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Resolve block module functions for all phases in one go so executing a phase does not
+ * need to go through all the modules and their symbols again.
+ */
+static struct block_mod_dispatch *
+	_create_block_mod_dispatch(sid_resource_t *cmd_res, sid_resource_t *block_mod_registry_res, struct radix_tree **mod_stats)
+{
+	sid_resource_iter_t *      iter;
+	sid_resource_t *           block_mod_res;
+	const struct cmd_mod_fns * block_mod_fns;
+	struct block_mod_dispatch *dispatch                     = NULL;
+	unsigned                   count[_CMD_SCAN_PHASE_COUNT] = {0};
+	unsigned                   pos[_CMD_SCAN_PHASE_COUNT];
+	unsigned                   total = 0;
+	cmd_scan_phase_t           phase;
+	struct module *            block_mod;
+	struct mod_stats *         stats;
+	sid_ucmd_fn_t *            fn;
+
+	/* modules are loaded lazily and loading reorders them by priority so load them all before iterating */
+	if (module_registry_load_modules(block_mod_registry_res) < 0) {
+		log_error(ID(cmd_res), "Failed to load block modules.");
+		return NULL;
+	}
+
+	if (!(iter = sid_resource_iter_create(block_mod_registry_res))) {
+		log_error(ID(cmd_res), "Failed to create block module iterator.");
+		return NULL;
+	}
+
+	while ((block_mod_res = sid_resource_iter_next(iter))) {
+		if (module_registry_get_module_symbols(block_mod_res, (const void ***) &block_mod_fns) < 0) {
+			log_error(ID(cmd_res), "Failed to retrieve module symbols from module %s.", ID(block_mod_res));
+			goto out;
+		}
+
+		if (!block_mod_fns)
+			continue;
+
+		for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+			if (_get_mod_fn(block_mod_fns, phase)) {
+				count[phase]++;
+				total++;
+			}
+		}
+	}
+
+	if (!(dispatch = mem_zalloc(sizeof(*dispatch) + total * sizeof(struct block_mod_fn)))) {
+		log_error(ID(cmd_res), "Failed to allocate block module dispatch table.");
+		goto out;
+	}
+
+	for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+		pos[phase]                 = dispatch->start[phase];
+		dispatch->start[phase + 1] = dispatch->start[phase] + count[phase];
+	}
+
+	sid_resource_iter_reset(iter);
+
+	while ((block_mod_res = sid_resource_iter_next(iter))) {
+		if (module_registry_get_module_symbols(block_mod_res, (const void ***) &block_mod_fns) < 0 || !block_mod_fns)
+			continue;
+
+		block_mod = sid_resource_get_data(block_mod_res);
+		stats     = mod_stats ? _get_mod_stats(mod_stats, module_get_full_name(block_mod)) : NULL;
+
+		for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+			if ((fn = _get_mod_fn(block_mod_fns, phase)))
+				dispatch->fns[pos[phase]++] = (struct block_mod_fn) {.mod   = block_mod,
+				                                                     .fn    = fn,
+				                                                     .stats = stats ? &stats->phase[phase] : NULL};
+		}
+	}
+out:
+	sid_resource_iter_destroy(iter);
+	return dispatch;
+}
+
+static int _execute_block_modules(struct cmd_exec_arg *exec_arg, cmd_scan_phase_t phase)
+{
+	struct sid_ucmd_ctx *            ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	const struct block_mod_dispatch *dispatch = exec_arg->block_mod_dispatch;
+	unsigned                         i;
+
+	if (!dispatch)
+		return 0;
+
+	for (i = dispatch->start[phase]; i < dispatch->start[phase + 1]; i++) {
+		if (_call_mod_fn(dispatch->fns[i].fn, dispatch->fns[i].mod, ucmd_ctx, dispatch->fns[i].stats) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Execute the phase function of the type module for the current or for the next layer, if there is one. */
+static int _execute_type_module(struct cmd_exec_arg *exec_arg, bool next, cmd_scan_phase_t phase)
+{
+	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	sid_resource_t *          mod_res  = next ? exec_arg->type_mod_res_next : exec_arg->type_mod_res_current;
+	const struct cmd_mod_fns *mod_fns  = next ? exec_arg->type_mod_fns_next : exec_arg->type_mod_fns_current;
+	struct mod_stats *        stats    = next ? exec_arg->type_mod_stats_next : exec_arg->type_mod_stats_current;
+	sid_ucmd_fn_t *           fn;
+
+	if (!mod_res || !mod_fns || !(fn = _get_mod_fn(mod_fns, phase)))
+		return 0;
+
+	return _call_mod_fn(fn, sid_resource_get_data(mod_res), ucmd_ctx, stats ? &stats->phase[phase] : NULL);
+}
+
+static uint64_t _checksum(uint64_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t               i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		sum = (sum ^ p[i]) * UINT64_C(0x100000001b3);
+
+	return sum;
+}
+
+/*
+ * Fingerprint of the device's relatives in sysfs: the slaves of a disk or the disk of
+ * a partition. Slaves are taken with the inodes of their entries in slaves directory so
+ * removing a slave and adding it again changes the fingerprint, too.
+ */
+static int _get_hierarchy_fingerprint(sid_resource_t *cmd_res, uint64_t *fingerprint)
+{
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(cmd_res);
+	uint64_t             sum      = UINT64_C(0xcbf29ce484222325);
+	struct sysfs_slaves *slaves;
+	bool                 own_slaves;
+	char                 devno_buf[16];
+	unsigned             i;
+
+	switch (ucmd_ctx->udev_dev.type) {
+		case UDEV_DEVTYPE_DISK:
+			if (!(slaves = _get_sysfs_slaves(cmd_res, &own_slaves)))
+				return -1;
+			for (i = 0; i < slaves->count; i++) {
+				sum = _checksum(sum, &slaves->slaves[i].ino, sizeof(slaves->slaves[i].ino));
+				sum = _checksum(sum, slaves->slaves[i].devno, strlen(slaves->slaves[i].devno) + 1);
+			}
+			if (own_slaves)
+				free(slaves);
+			break;
+		case UDEV_DEVTYPE_PARTITION:
+			if (_part_get_whole_disk(NULL, ucmd_ctx, devno_buf, sizeof(devno_buf)) < 0)
+				return -1;
+			sum = _checksum(sum, devno_buf, strlen(devno_buf) + 1);
+			break;
+		case UDEV_DEVTYPE_UNKNOWN:
+			break;
+	}
+
+	*fingerprint = sum;
+	return 0;
+}
+
+/* Sets core device record, unless it already has the same value so the record is not exported needlessly. */
+static void _update_dev_kv(struct sid_ucmd_ctx *ucmd_ctx, dev_key_t dev_key, const void *value, size_t value_size)
+{
+	const void *old_value;
+	size_t      old_size;
+
+	if ((old_value = _get_dev_kv_data(ucmd_ctx, dev_key, &old_size)) && old_size == value_size &&
+	    !memcmp(old_value, value, value_size))
+		return;
+
+	_set_dev_kv(ucmd_ctx, dev_key, value, value_size);
+}
+
+/*
+ * Keep udev records of the device as they are going to be sent to udev so the reply can be
+ * repeated without scanning the device again, see _can_reply_cached. The records are stored
+ * the same way as in the reply, key=value pairs separated by '\0', with one more '\0' at the end.
+ */
+static int _cache_udev_records(sid_resource_t *cmd_res)
+{
+	struct sid_ucmd_ctx *  ucmd_ctx = sid_resource_get_data(cmd_res);
+	char                   prefix[64];
+	kv_store_iter_t *      iter     = NULL;
+	struct buffer *        buf      = NULL;
+	struct kv_value *      kv_value;
+	kv_store_value_flags_t flags;
+	const char *           key, *value;
+	const void *           data;
+	size_t                 data_size;
+	int                    r = -1;
+
+	snprintf(prefix,
+	         sizeof(prefix),
+	         KV_PREFIX_OP_SET_C KV_STORE_KEY_JOIN KV_PREFIX_NS_UDEV_C KV_STORE_KEY_JOIN "%s" KV_STORE_KEY_JOIN,
+	         ucmd_ctx->dev_id);
+
+	if (!(iter = kv_store_iter_create_prefix(ucmd_ctx->ucmd_mod_ctx.kv_store_res, prefix)) ||
+	    !(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                  .type    = BUFFER_TYPE_LINEAR,
+	                                                  .mode    = BUFFER_MODE_PLAIN}),
+	                          &((struct buffer_init) {.size = 0, .alloc_step = PATH_MAX, .limit = 0}),
+	                          &r)))
+		goto out;
+
+	/* only records with KV_PERSISTENT flag are sent to udev, vectors are not supported, see _export_kv_store */
+	while ((kv_value = kv_store_iter_next(iter, NULL, &flags))) {
+		if ((flags & KV_STORE_VALUE_VECTOR) || !(kv_value->flags & KV_PERSISTENT))
+			continue;
+
+		key   = _get_key_part(kv_store_iter_current_key(iter), KEY_PART_CORE, NULL);
+		value = kv_value->data + _kv_value_ext_data_offset(kv_value);
+
+		if (!buffer_add(buf, (void *) key, strlen(key), &r) || !buffer_add(buf, KV_PAIR_C, 1, &r) ||
+		    !buffer_add(buf, (void *) value, strlen(value) + 1, &r))
+			goto out;
+	}
+
+	if (!buffer_add(buf, KV_END_C, 1, &r))
+		goto out;
+
+	kv_store_iter_destroy(iter);
+	iter = NULL;
+
+	(void) buffer_get_data(buf, &data, &data_size);
+	_update_dev_kv(ucmd_ctx, DEV_KEY_UDEV, data, data_size);
+	r = 0;
+out:
+	if (iter)
+		kv_store_iter_destroy(iter);
+	if (buf)
+		buffer_destroy(buf);
+	return r;
+}
+
+static bool _mod_fns_scan(const struct cmd_mod_fns *mod_fns)
+{
+	cmd_scan_phase_t phase;
+
+	for (phase = CMD_SCAN_PHASE_A_IDENT; phase <= CMD_SCAN_PHASE_A_SCAN_POST_NEXT; phase++) {
+		if (_get_mod_fn(mod_fns, phase))
+			return true;
+	}
+
+	return false;
+}
+
+static bool _type_mod_scans(struct cmd_exec_arg *exec_arg, const char *mod_name)
+{
+	sid_resource_t *          mod_res;
+	const struct cmd_mod_fns *mod_fns;
+
+	if (!(mod_res = module_registry_get_module(exec_arg->type_mod_registry_res, mod_name)))
+		return false;
+
+	if (module_registry_get_module_symbols(mod_res, (const void ***) &mod_fns) < 0)
+		return true;
+
+	return mod_fns && _mod_fns_scan(mod_fns);
+}
+
+/*
+ * A change event for a device which was scanned before does not need to go through the scan
+ * phases if no module would be called in them and the device's relatives in sysfs are still
+ * the same. Nothing would be changed in the records then, so just reply with the udev records
+ * from the last scan and do not export anything.
+ */
+static bool _can_reply_cached(struct cmd_exec_arg *exec_arg)
+{
+	struct sid_ucmd_ctx *            ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	const struct block_mod_dispatch *dispatch = exec_arg->block_mod_dispatch;
+	const char *                     mod_name;
+	const void *                     old_fingerprint;
+	uint64_t                         fingerprint;
+	size_t                           size;
+
+	if (ucmd_ctx->udev_dev.action != UDEV_ACTION_CHANGE || !_get_dev_kv(ucmd_ctx, DEV_KEY_READY) ||
+	    !_get_dev_kv_data(ucmd_ctx, DEV_KEY_UDEV, &size))
+		return false;
+
+	if (dispatch && dispatch->start[CMD_SCAN_PHASE_A_IDENT] != dispatch->start[CMD_SCAN_PHASE_A_SCAN_POST_NEXT + 1])
+		return false;
+
+	/* without the module name recorded, the scan would look it up and possibly find a module to call */
+	if (!(mod_name = _get_dev_kv(ucmd_ctx, DEV_KEY_MOD)) || _type_mod_scans(exec_arg, mod_name))
+		return false;
+
+	if ((mod_name = _do_sid_ucmd_get_kv(NULL, ucmd_ctx, KV_NS_DEVICE, SID_UCMD_KEY_DEVICE_NEXT_MOD, NULL, NULL)) &&
+	    _type_mod_scans(exec_arg, mod_name))
+		return false;
+
+	if (!(old_fingerprint = _get_dev_kv_data(ucmd_ctx, DEV_KEY_HIERARCHY, &size)) || size != sizeof(fingerprint) ||
+	    _get_hierarchy_fingerprint(exec_arg->cmd_res, &fingerprint) < 0)
+		return false;
+
+	return !memcmp(old_fingerprint, &fingerprint, sizeof(fingerprint));
+}
+
+static int _reply_cached(struct cmd_exec_arg *exec_arg)
+{
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	const char *         records;
+	size_t               size;
+	int                  r;
+
+	if (!(records = _get_dev_kv_data(ucmd_ctx, DEV_KEY_UDEV, &size)))
+		return -1;
+
+	/* the records stay in the inherited store until the reply is written, the buffer can reference them */
+	if (size > 1 && !buffer_add(ucmd_ctx->res_buf, (void *) records, size - 1, &r))
+		return r;
+
+	return 0;
+}
+
+static int _set_device_kv_records(sid_resource_t *cmd_res)
+{
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(cmd_res);
+	dev_ready_t          ready;
+	dev_reserved_t       reserved;
+	uint64_t             fingerprint;
+
+	if (!_get_dev_kv(ucmd_ctx, DEV_KEY_READY)) {
+		ready    = DEV_NOT_RDY_UNPROCESSED;
+		reserved = DEV_RES_UNPROCESSED;
+
+		_set_dev_kv(ucmd_ctx, DEV_KEY_READY, &ready, sizeof(ready));
+		_set_dev_kv(ucmd_ctx, DEV_KEY_RESERVED, &reserved, sizeof(reserved));
 	}
 
-	if (!(exec_arg->block_mod_iter = sid_resource_iter_create(block_mod_registry_res))) {
-		log_error(ID(exec_arg->cmd_res), "Failed to create block module iterator.");
+	_refresh_device_hierarchy_from_sysfs(cmd_res);
+
+	if (ucmd_ctx->udev_dev.action != UDEV_ACTION_REMOVE && _get_hierarchy_fingerprint(cmd_res, &fingerprint) == 0)
+		_update_dev_kv(ucmd_ctx, DEV_KEY_HIERARCHY, &fingerprint, sizeof(fingerprint));
+
+	return 0;
+}
+
+static int _cmd_exec_scan_init(struct cmd_exec_arg *exec_arg)
+{
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	sid_resource_t *     block_mod_registry_res;
+
+	if (!(block_mod_registry_res = sid_resource_search(ucmd_ctx->ucmd_mod_ctx.modules_res,
+	                                                   SID_RESOURCE_SEARCH_IMM_DESC,
+	                                                   &sid_resource_type_module_registry,
+	                                                   MODULES_BLOCK_ID))) {
+		log_error(ID(exec_arg->cmd_res), INTERNAL_ERROR "%s: Failed to find block module registry resource.", __func__);
 		goto fail;
 	}
 
+	if (!(exec_arg->block_mod_dispatch = ucmd_ctx->pool ? ucmd_ctx->pool->block_mod_dispatch : NULL)) {
+		if (!(exec_arg->block_mod_dispatch_own =
+		              _create_block_mod_dispatch(exec_arg->cmd_res,
+		                                         block_mod_registry_res,
+		                                         ucmd_ctx->pool ? &ucmd_ctx->pool->mod_stats : NULL)))
+			goto fail;
+
+		exec_arg->block_mod_dispatch = exec_arg->block_mod_dispatch_own;
+
+		if (ucmd_ctx->pool) {
+			ucmd_ctx->pool->block_mod_dispatch = exec_arg->block_mod_dispatch_own;
+			exec_arg->block_mod_dispatch_own   = NULL;
+		}
+	}
+
 	if (!(exec_arg->type_mod_registry_res = sid_resource_search(ucmd_ctx->ucmd_mod_ctx.modules_res,
 	                                                            SID_RESOURCE_SEARCH_IMM_DESC,
 	                                                            &sid_resource_type_module_registry,
@@ -2890,6 +4252,11 @@ static int _cmd_exec_scan_init(struct cmd_exec_arg *exec_arg)
 		goto fail;
 	}
 
+	if ((exec_arg->reply_cached = _can_reply_cached(exec_arg))) {
+		log_debug(ID(exec_arg->cmd_res), "Device unchanged and no module to call, replying with cached records.");
+		return 0;
+	}
+
 	if (_set_device_kv_records(exec_arg->cmd_res) < 0) {
 		log_error(ID(exec_arg->cmd_res), "Failed to set device hierarchy.");
 		goto fail;
@@ -2897,78 +4264,50 @@ static int _cmd_exec_scan_init(struct cmd_exec_arg *exec_arg)
 
 	return 0;
 fail:
-	if (exec_arg->block_mod_iter) {
-		sid_resource_iter_destroy(exec_arg->block_mod_iter);
-		exec_arg->block_mod_iter = NULL;
-	}
+	free(exec_arg->block_mod_dispatch_own);
+	exec_arg->block_mod_dispatch_own = NULL;
+	exec_arg->block_mod_dispatch     = NULL;
 
 	return -1;
 }
 
 static int _cmd_exec_scan_ident(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-	const char *              mod_name;
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	const char *         mod_name;
 
 	if ((mod_name = _lookup_module_name(exec_arg->cmd_res)) &&
 	    !(exec_arg->type_mod_res_current = module_registry_get_module(exec_arg->type_mod_registry_res, mod_name)))
 		log_debug(ID(exec_arg->cmd_res), "Module %s not loaded.", mod_name);
 
+	module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &exec_arg->type_mod_fns_current);
+	exec_arg->type_mod_stats_current = _get_type_mod_stats(ucmd_ctx, exec_arg->type_mod_res_current);
+
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_IDENT);
 
 	// sid_resource_dump_all_in_dot(sid_resource_search(exec_arg->cmd_res, SID_RESOURCE_SEARCH_TOP, NULL, NULL));
 
-	if (!exec_arg->type_mod_res_current)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->ident)
-		return mod_fns->ident(sid_resource_get_data(exec_arg->type_mod_res_current), ucmd_ctx);
-
-	return 0;
+	return _execute_type_module(exec_arg, false, CMD_SCAN_PHASE_A_IDENT);
 }
 
 static int _cmd_exec_scan_pre(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_SCAN_PRE);
 
-	if (!exec_arg->type_mod_res_current)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->scan_pre)
-		return mod_fns->scan_pre(sid_resource_get_data(exec_arg->type_mod_res_current), ucmd_ctx);
-
-	return 0;
+	return _execute_type_module(exec_arg, false, CMD_SCAN_PHASE_A_SCAN_PRE);
 }
 
 static int _cmd_exec_scan_current(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_SCAN_CURRENT);
 
-	if (!exec_arg->type_mod_res_current)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->scan_current)
-		if (mod_fns->scan_current(sid_resource_get_data(exec_arg->type_mod_res_current), ucmd_ctx))
-			return -1;
-
-	return 0;
+	return _execute_type_module(exec_arg, false, CMD_SCAN_PHASE_A_SCAN_CURRENT) ? -1 : 0;
 }
 
 static int _cmd_exec_scan_next(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-	const char *              next_mod_name;
+	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
+	const char *         next_mod_name;
 
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_SCAN_NEXT);
 
@@ -2978,48 +4317,24 @@ static int _cmd_exec_scan_next(struct cmd_exec_arg *exec_arg)
 	} else
 		exec_arg->type_mod_res_next = NULL;
 
-	if (!exec_arg->type_mod_res_next)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_next, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->scan_next)
-		return mod_fns->scan_next(sid_resource_get_data(exec_arg->type_mod_res_next), ucmd_ctx);
+	module_registry_get_module_symbols(exec_arg->type_mod_res_next, (const void ***) &exec_arg->type_mod_fns_next);
+	exec_arg->type_mod_stats_next = _get_type_mod_stats(ucmd_ctx, exec_arg->type_mod_res_next);
 
-	return 0;
+	return _execute_type_module(exec_arg, true, CMD_SCAN_PHASE_A_SCAN_NEXT);
 }
 
 static int _cmd_exec_scan_post_current(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_SCAN_POST_CURRENT);
 
-	if (!exec_arg->type_mod_res_current)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->scan_post_current)
-		return mod_fns->scan_post_current(sid_resource_get_data(exec_arg->type_mod_res_current), ucmd_ctx);
-
-	return 0;
+	return _execute_type_module(exec_arg, false, CMD_SCAN_PHASE_A_SCAN_POST_CURRENT);
 }
 
 static int _cmd_exec_scan_post_next(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_A_SCAN_POST_NEXT);
 
-	if (!exec_arg->type_mod_res_next)
-		return 0;
-
-	module_registry_get_module_symbols(exec_arg->type_mod_res_next, (const void ***) &mod_fns);
-	if (mod_fns && mod_fns->scan_post_next)
-		return mod_fns->scan_post_next(sid_resource_get_data(exec_arg->type_mod_res_next), ucmd_ctx);
-
-	return 0;
+	return _execute_type_module(exec_arg, true, CMD_SCAN_PHASE_A_SCAN_POST_NEXT);
 }
 
 static int _cmd_exec_scan_wait(struct cmd_exec_arg *exec_arg)
@@ -3029,10 +4344,9 @@ static int _cmd_exec_scan_wait(struct cmd_exec_arg *exec_arg)
 
 static int _cmd_exec_scan_exit(struct cmd_exec_arg *exec_arg)
 {
-	if (exec_arg->block_mod_iter) {
-		sid_resource_iter_destroy(exec_arg->block_mod_iter);
-		exec_arg->block_mod_iter = NULL;
-	}
+	free(exec_arg->block_mod_dispatch_own);
+	exec_arg->block_mod_dispatch_own = NULL;
+	exec_arg->block_mod_dispatch     = NULL;
 
 	return 0;
 }
@@ -3049,23 +4363,12 @@ static int _cmd_exec_trigger_action_next(struct cmd_exec_arg *exec_arg)
 
 static int _cmd_exec_scan_error(struct cmd_exec_arg *exec_arg)
 {
-	struct sid_ucmd_ctx *     ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
-	const struct cmd_mod_fns *mod_fns;
-	int                       r = 0;
+	int r = 0;
 
 	_execute_block_modules(exec_arg, CMD_SCAN_PHASE_ERROR);
 
-	if (exec_arg->type_mod_res_current) {
-		module_registry_get_module_symbols(exec_arg->type_mod_res_current, (const void ***) &mod_fns);
-		if (mod_fns && mod_fns->error)
-			r |= mod_fns->error(sid_resource_get_data(exec_arg->type_mod_res_current), ucmd_ctx);
-	}
-
-	if (exec_arg->type_mod_res_next) {
-		module_registry_get_module_symbols(exec_arg->type_mod_res_next, (const void ***) &mod_fns);
-		if (mod_fns && mod_fns->error)
-			r |= mod_fns->error(sid_resource_get_data(exec_arg->type_mod_res_next), ucmd_ctx);
-	}
+	r |= _execute_type_module(exec_arg, false, CMD_SCAN_PHASE_ERROR);
+	r |= _execute_type_module(exec_arg, true, CMD_SCAN_PHASE_ERROR);
 
 	return r;
 }
@@ -3102,12 +4405,30 @@ static int _cmd_exec_scan(struct cmd_exec_arg *exec_arg)
 {
 	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(exec_arg->cmd_res);
 	cmd_scan_phase_t     phase;
+	int                  r;
 
 	for (phase = CMD_SCAN_PHASE_A_INIT; phase <= CMD_SCAN_PHASE_A_EXIT; phase++) {
+		/* init phase found there's nothing to scan, see _can_reply_cached */
+		if (exec_arg->reply_cached && phase != CMD_SCAN_PHASE_A_INIT && phase != CMD_SCAN_PHASE_A_EXIT)
+			continue;
+
 		log_debug(ID(exec_arg->cmd_res), "Executing %s phase.", _cmd_scan_phase_regs[phase].name);
 		ucmd_ctx->scan_phase = phase;
 
-		if (_cmd_scan_phase_regs[phase].exec(exec_arg) < 0) {
+		SID_PROBE4(scan__phase__start,
+		           phase,
+		           _cmd_scan_phase_regs[phase].name,
+		           ucmd_ctx->udev_dev.major,
+		           ucmd_ctx->udev_dev.minor);
+		r = _cmd_scan_phase_regs[phase].exec(exec_arg);
+		SID_PROBE5(scan__phase__end,
+		           phase,
+		           _cmd_scan_phase_regs[phase].name,
+		           ucmd_ctx->udev_dev.major,
+		           ucmd_ctx->udev_dev.minor,
+		           r);
+
+		if (r < 0) {
 			log_error(ID(exec_arg->cmd_res), "%s phase failed.", _cmd_scan_phase_regs[phase].name);
 
 			/* if init or exit phase fails, there's nothing else we can do */
@@ -3120,41 +4441,167 @@ static int _cmd_exec_scan(struct cmd_exec_arg *exec_arg)
 		}
 	}
 
+	if (exec_arg->reply_cached) {
+		SID_PROBE2(scan__cached, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor);
+		return _reply_cached(exec_arg);
+	}
+
+	if (ucmd_ctx->udev_dev.action != UDEV_ACTION_REMOVE && _cache_udev_records(exec_arg->cmd_res) < 0)
+		log_debug(ID(exec_arg->cmd_res), "Failed to cache udev records.");
+
 	return 0;
 }
 
 static int _cmd_exec_checkpoint(struct cmd_exec_arg *exec_arg)
 {
-	return 0;
+	main_kv_store_req_t     req       = MAIN_KV_STORE_REQ_CHECKPOINT;
+	struct worker_data_spec data_spec = {.data = &req, .data_size = sizeof(req)};
+
+	/* main key-value store lives in main process so ask there to write the image */
+	return worker_control_channel_send(exec_arg->cmd_res, MAIN_WORKER_CHANNEL_ID, &data_spec);
 }
 
 static struct cmd_reg _cmd_regs[] = {
-	[USID_CMD_ACTIVE]     = {.name = NULL, .flags = 0, .exec = _cmd_exec_unknown},
-	[USID_CMD_CHECKPOINT] = {.name = NULL, .flags = 0, .exec = _cmd_exec_checkpoint},
-	[USID_CMD_REPLY]      = {.name = NULL, .flags = 0, .exec = _cmd_exec_reply},
-	[USID_CMD_SCAN]       = {.name = NULL, .flags = 0, .exec = _cmd_exec_scan},
-	[USID_CMD_UNKNOWN]    = {.name = NULL, .flags = 0, .exec = _cmd_exec_unknown},
-	[USID_CMD_VERSION]    = {.name = NULL, .flags = 0, .exec = _cmd_exec_version},
-	[USID_CMD_DUMP]       = {.name = NULL, .flags = 0, .exec = _cmd_exec_dump},
+	[USID_CMD_ACTIVE]       = {.name = NULL, .flags = 0, .exec = _cmd_exec_unknown},
+	[USID_CMD_CHECKPOINT]   = {.name = NULL, .flags = 0, .exec = _cmd_exec_checkpoint},
+	[USID_CMD_REPLY]        = {.name = NULL, .flags = 0, .exec = _cmd_exec_reply},
+	[USID_CMD_SCAN]         = {.name = NULL, .flags = 0, .exec = _cmd_exec_scan},
+	[USID_CMD_UNKNOWN]      = {.name = NULL, .flags = 0, .exec = _cmd_exec_unknown},
+	[USID_CMD_VERSION]      = {.name = NULL, .flags = 0, .exec = _cmd_exec_version},
+	[USID_CMD_DUMP]         = {.name = NULL, .flags = 0, .exec = _cmd_exec_dump},
+	[USID_CMD_EVENT_STATS]  = {.name = NULL, .flags = 0, .exec = _cmd_exec_event_stats},
+	[USID_CMD_SCAN_BATCH]   = {.name = NULL, .flags = 0, .exec = _cmd_exec_scan_batch},
+	[USID_CMD_GET]          = {.name = NULL, .flags = 0, .exec = _cmd_exec_get},
+	[USID_CMD_SUBSCRIBE]    = {.name = NULL, .flags = 0, .exec = _cmd_exec_subscribe},
+	[USID_CMD_MODULE_STATS] = {.name = NULL, .flags = 0, .exec = _cmd_exec_module_stats},
+	[USID_CMD_STATS]        = {.name = NULL, .flags = 0, .exec = _cmd_exec_stats},
 };
 
+static void _drop_udev_records(sid_resource_t *kv_store_res)
+{
+	kv_store_iter_t *iter;
+	const char *     key;
+
+	if (!(iter = kv_store_iter_create_dirty(kv_store_res)))
+		return;
+
+	while (kv_store_iter_next(iter, NULL, NULL)) {
+		key = kv_store_iter_current_key(iter);
+		if (_get_ns_from_key(key) == KV_NS_UDEV)
+			(void) kv_store_unset_value(kv_store_res, key, NULL, NULL);
+	}
+
+	kv_store_iter_destroy(iter);
+}
+
+/* Returns number of phases in which module functions were called. */
+static unsigned _count_mod_stats_phases(const struct mod_stats *stats)
+{
+	cmd_scan_phase_t phase;
+	unsigned         count = 0;
+
+	for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+		if (stats->phase[phase].calls)
+			count++;
+	}
+
+	return count;
+}
+
+/*
+ * Writes module statistics record. With internal set, the record is prefixed with
+ * KV_REC_MOD_STATS type so it can be sent to main process within key-value records,
+ * otherwise the record fields are the ones described in iface/usid.h.
+ */
+static int _write_mod_stats_rec(struct rec_writer *w, const char *name, const struct mod_stats *stats, bool internal)
+{
+	cmd_scan_phase_t phase;
+	int              r;
+
+	if ((r = rec_write_key(w, name)) < 0 || (internal && (r = rec_write_uint(w, KV_REC_MOD_STATS)) < 0) ||
+	    (r = rec_write_uint(w, _count_mod_stats_phases(stats))) < 0)
+		return r;
+
+	for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+		if (!stats->phase[phase].calls)
+			continue;
+
+		if ((r = rec_write_data(w, _cmd_scan_phase_regs[phase].name, strlen(_cmd_scan_phase_regs[phase].name) + 1)) < 0 ||
+		    (r = rec_write_uint(w, stats->phase[phase].calls)) < 0 ||
+		    (r = rec_write_uint(w, stats->phase[phase].failures)) < 0 ||
+		    (r = rec_write_uint(w, stats->phase[phase].usec_total)) < 0 ||
+		    (r = rec_write_uint(w, stats->phase[phase].usec_max)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * Appends module statistics gathered since they were sent last time to the export for
+ * main process and starts gathering again. Unless forced, this is done only if the
+ * statistics have not been sent for MOD_STATS_FLUSH_USEC so that commands which do not
+ * change any records do not cause export on their own each time.
+ */
+static int _export_mod_stats(struct ucmd_pool *pool, struct rec_writer *w, bool force)
+{
+	struct radix_node *n;
+	struct mod_stats * stats;
+	uint64_t           now_usec;
+	bool               written = false;
+	int                r;
+
+	if (!pool || !pool->mod_stats)
+		return 0;
+
+	now_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
+
+	if (!force && now_usec - pool->mod_stats_flush_usec < MOD_STATS_FLUSH_USEC)
+		return 0;
+
+	radix_iterate(n, pool->mod_stats)
+	{
+		stats = radix_get_data(pool->mod_stats, n, NULL);
+
+		if (!_count_mod_stats_phases(stats))
+			continue;
+
+		if ((r = _write_mod_stats_rec(w, radix_get_key(pool->mod_stats, n, NULL), stats, true)) < 0)
+			return r;
+
+		/* the records are added to main process' statistics so start from zero */
+		memset(stats, 0, sizeof(*stats));
+		written = true;
+	}
+
+	if (written || force)
+		pool->mod_stats_flush_usec = now_usec;
+
+	return 0;
+}
+
 static int _export_kv_store(sid_resource_t *cmd_res)
 {
 	struct sid_ucmd_ctx *   ucmd_ctx = sid_resource_get_data(cmd_res);
+	sid_resource_t *        conn_res = sid_resource_search(cmd_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	struct connection *     conn     = conn_res ? sid_resource_get_data(conn_res) : NULL;
 	struct kv_value *       kv_value;
 	kv_store_iter_t *       iter;
 	const char *            key;
 	void *                  value;
-	bool                    vector;
-	size_t                  size, iov_size, key_size, data_offset;
+	bool                    vector, persistent, dirty;
+	size_t                  size, data_offset;
 	kv_store_value_flags_t  flags;
 	struct iovec *          iov;
-	int                     export_fd     = -1;
-	size_t                  bytes_written = 0;
+	struct buffer *         export_buf = NULL;
+	struct rec_writer *     export_w   = NULL;
+	int                     export_fd  = -1;
+	size_t                  export_size;
+	const void *            export_data;
 	struct worker_data_spec data_spec;
-	unsigned                i;
-	ssize_t                 r_wr;
-	int                     r = -1;
+	unsigned                dirty_count, handled_count = 0; /* changed records synced or dropped */
+	unsigned                exported = 0;
+	int                     r        = -1;
 
 	/*
 	 * Export key-value store to udev or for sync with main kv store.
@@ -3162,52 +4609,61 @@ static int _export_kv_store(sid_resource_t *cmd_res)
 	 * For udev, we append key=value pairs to the output buffer that is sent back
 	 * to udev as result of "usid scan" command.
 	 *
-	 * For others, we serialize the temp key-value store to an anonymous file in memory
-	 * created by memfd_create. Then we pass the file FD over to worker proxy that reads
-	 * it and it updates the "main" key-value store.
+	 * For others, we serialize the temp key-value store to a buffer backed by an anonymous
+	 * file in memory created by memfd_create. The whole export image is built in memory
+	 * first, then the file is sealed so it can not be changed anymore and we pass the file
+	 * FD over to worker proxy that reads it and it updates the "main" key-value store.
 	 *
 	 * We only send key=value pairs which are marked with KV_PERSISTENT flag.
+	 *
+	 * Only records changed since the worker was forked or since the last export can be
+	 * marked with KV_PERSISTENT flag, so if the store tracks changed records, iterate
+	 * over these only instead of going through the whole inherited store.
 	 */
-	if (!(iter = kv_store_iter_create(ucmd_ctx->ucmd_mod_ctx.kv_store_res))) {
+	if (!(dirty = (iter = kv_store_iter_create_dirty(ucmd_ctx->ucmd_mod_ctx.kv_store_res))) &&
+	    !(iter = kv_store_iter_create(ucmd_ctx->ucmd_mod_ctx.kv_store_res))) {
 		// TODO: Discard udev kv-store we've already appended to the output buffer!
 		log_error(ID(cmd_res), "Failed to create iterator for temp key-value store.");
 		goto out;
 	}
 
-	export_fd = memfd_create("kv_store_export", MFD_CLOEXEC);
-
-	/* Reserve space to write the overall data size. */
-	if (lseek(export_fd, sizeof(bytes_written), SEEK_SET) < 0) {
-		log_error_errno(ID(cmd_res), errno, "lseek failed");
+	if (!(export_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MEMFD,
+	                                                         .type    = BUFFER_TYPE_LINEAR,
+	                                                         .mode    = BUFFER_MODE_PLAIN}),
+	                                 &((struct buffer_init) {.size = 0, .alloc_step = EXPORT_BUF_ALLOC_STEP, .limit = 0}),
+	                                 &r))) {
+		log_error_errno(ID(cmd_res), r, "Failed to create buffer for key-value store export.");
 		goto out;
-	};
+	}
+
+	if (!(export_w = rec_writer_create(export_buf, &r)))
+		goto fail;
 
-	// FIXME: maybe buffer first so there's only single write
 	while ((value = kv_store_iter_next(iter, &size, &flags))) {
 		vector = flags & KV_STORE_VALUE_VECTOR;
 
 		if (vector) {
-			iov      = value;
-			iov_size = size;
-			kv_value = NULL;
-
-			if (!(KV_VALUE_FLAGS(iov) & KV_PERSISTENT))
-				continue;
+			iov        = value;
+			kv_value   = NULL;
+			persistent = KV_VALUE_FLAGS(iov) & KV_PERSISTENT;
 
 			KV_VALUE_FLAGS(iov) &= ~KV_PERSISTENT;
 		} else {
-			iov      = NULL;
-			iov_size = 0;
-			kv_value = value;
-
-			if (!(kv_value->flags & KV_PERSISTENT))
-				continue;
+			iov        = NULL;
+			kv_value   = value;
+			persistent = kv_value->flags & KV_PERSISTENT;
 
 			kv_value->flags &= ~KV_PERSISTENT;
 		}
 
-		key      = kv_store_iter_current_key(iter);
-		key_size = strlen(key) + 1;
+		key = kv_store_iter_current_key(iter);
+
+		if (!persistent) {
+			/* udev records are dropped after export so they do not count as local changes */
+			if (_get_ns_from_key(key) == KV_NS_UDEV)
+				handled_count++;
+			continue;
+		}
 
 		// TODO: Also deal with situation if the udev namespace values are defined as vectors by chance.
 		if (_get_ns_from_key(key) == KV_NS_UDEV) {
@@ -3216,8 +4672,10 @@ static int _export_kv_store(sid_resource_t *cmd_res)
 				          INTERNAL_ERROR "%s: Unsupported vector value for key %s in udev namespace.",
 				          __func__,
 				          key);
+				r = -ENOTSUP;
 				goto out;
 			}
+			handled_count++;
 			key = _get_key_part(key, KEY_PART_CORE, NULL);
 			if (!buffer_add(ucmd_ctx->res_buf, (void *) key, strlen(key), &r) ||
 			    !buffer_add(ucmd_ctx->res_buf, KV_PAIR_C, 1, &r))
@@ -3233,95 +4691,38 @@ static int _export_kv_store(sid_resource_t *cmd_res)
 		}
 
 		/*
-		 * Export keys with data to main process.
-		 *
-		 * Serialization format fields:
-		 *
-		 *  1) overall message size (size_t)
-		 *  2) flags                (uint32_t)
-		 *  3) key size             (size_t)
-		 *  4) data size            (size_t)
-		 *  5) key                  (key_size)
-		 *  6) data                 (data_size)
-		 *
-		 * If "data" is a vector, then "data size" denotes vector
-		 * item count and "data" is split into these fields repeated
-		 * for each vector item:
-		 *
-		 *  6a) vector item size
-		 *  6b) vector item data
-		 *
-		 * Repeat 2) - 7) as long as there are keys to send.
+		 * Export keys with data to main process as key-value records (see _write_kv_rec).
+		 * Records are written in key order so keys share long prefixes which are then
+		 * stored only once. Packed sets are marked so they can be stored in the same form
+		 * in main kv store.
 		 */
+		if ((r = _write_kv_rec(export_w, key, flags, value, size, true)) < 0)
+			goto fail;
 
-		/* FIXME: Try to reduce the "write" calls. */
-		if ((r_wr = write(export_fd, &flags, sizeof(flags))) == sizeof(flags))
-			bytes_written += r_wr;
-		else {
-			log_error_errno(ID(cmd_res), errno, "write failed");
-			goto out;
-		}
-
-		if ((r_wr = write(export_fd, &key_size, sizeof(key_size))) == sizeof(key_size))
-			bytes_written += r_wr;
-		else {
-			log_error_errno(ID(cmd_res), errno, "write failed");
-			goto out;
-		}
+		handled_count++;
+		exported++;
+	}
 
-		if ((r_wr = write(export_fd, &size, sizeof(size))) == sizeof(size))
-			bytes_written += r_wr;
-		else {
-			log_error_errno(ID(cmd_res), errno, "write failed");
-			goto out;
-		}
+	/* module statistics go along with records, but they are sent even without them from time to time */
+	if ((r = _export_mod_stats(ucmd_ctx->pool, export_w, exported > 0)) < 0)
+		goto fail;
 
-		if ((r_wr = write(export_fd, key, strlen(key) + 1)) == strlen(key) + 1)
-			bytes_written += r_wr;
-		else {
-			log_error_errno(ID(cmd_res), errno, "write failed");
-			goto out;
-		}
+	rec_writer_destroy(export_w);
+	export_w = NULL;
 
-		if (vector) {
-			for (i = 0, size = 0; i < iov_size; i++) {
-				size += iov[i].iov_len;
-
-				if ((r_wr = write(export_fd, &iov[i].iov_len, sizeof(iov->iov_len))) == sizeof(iov->iov_len))
-					bytes_written += r_wr;
-				else {
-					log_error_errno(ID(cmd_res), errno, "write failed");
-					goto out;
-				}
+	(void) buffer_get_data(export_buf, &export_data, &export_size);
 
-				if ((r_wr = write(export_fd, iov[i].iov_base, iov[i].iov_len)) == iov[i].iov_len)
-					bytes_written += r_wr;
-				else {
-					log_error_errno(ID(cmd_res), errno, "write failed");
-					goto out;
-				}
-			}
-		} else {
-			if ((r_wr = write(export_fd, kv_value, size)) == size)
-				bytes_written += r_wr;
-			else {
-				log_error_errno(ID(cmd_res), errno, "write failed");
-				goto out;
-			}
-		}
-	}
+	SID_PROBE4(export, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor, export_size, exported);
 
-	if (lseek(export_fd, 0, SEEK_SET) < 0) {
-		log_error_errno(ID(cmd_res), errno, "lseek failed");
-		goto out;
-	}
-	if (write(export_fd, &bytes_written, sizeof(bytes_written)) < 0) {
-		log_error_errno(ID(cmd_res), errno, "write failed");
+	/* only the format version is there if no record is exported */
+	if (export_size <= 1) {
+		r = 0;
 		goto out;
 	}
-	if (lseek(export_fd, 0, SEEK_SET) < 0) {
-		log_error_errno(ID(cmd_res), errno, "lseek failed");
-		goto out;
+
+	if ((export_fd = buffer_detach_fd(export_buf)) < 0) {
+		r = export_fd;
+		goto fail;
 	}
 
 	data_spec.data               = NULL;
@@ -3329,28 +4730,60 @@ static int _export_kv_store(sid_resource_t *cmd_res)
 	data_spec.ext.used           = true;
 	data_spec.ext.socket.fd_pass = export_fd;
 
-	if (bytes_written)
-		worker_control_channel_send(cmd_res, MAIN_WORKER_CHANNEL_ID, &data_spec);
+	worker_control_channel_send(cmd_res, MAIN_WORKER_CHANNEL_ID, &data_spec);
 
 	r = 0;
+	goto out;
+fail:
+	log_error_errno(ID(cmd_res), r, "Failed to serialize key-value store for export.");
 out:
 	if (iter)
 		kv_store_iter_destroy(iter);
+	if (export_w)
+		rec_writer_destroy(export_w);
+	if (export_buf)
+		buffer_destroy(export_buf);
 	if (export_fd >= 0)
 		close(export_fd);
 
+	if (r == 0) {
+		/*
+		 * Records in udev namespace are never synced with main kv store, drop them. If there are
+		 * any other changed records which main kv store does not get, e.g. records without
+		 * KV_PERSISTENT flag or unset records, this worker can not be reused for another command.
+		 */
+		if (dirty && kv_store_dirty_get_count(ucmd_ctx->ucmd_mod_ctx.kv_store_res, &dirty_count) == 0 &&
+		    dirty_count == handled_count)
+			_drop_udev_records(ucmd_ctx->ucmd_mod_ctx.kv_store_res);
+		else if (conn)
+			conn->diverged = true;
+
+		/* all changed records are exported now, start tracking the changes afresh */
+		(void) kv_store_dirty_reset(ucmd_ctx->ucmd_mod_ctx.kv_store_res);
+	}
+
 	return r;
 }
 
 static int _connection_cleanup(sid_resource_t *conn_res)
 {
-	sid_resource_t *worker_res = sid_resource_search(conn_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	sid_resource_t *   worker_res = sid_resource_search(conn_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	struct connection *conn       = sid_resource_get_data(conn_res);
+	bool               diverged   = conn->diverged;
 
 	sid_resource_destroy(conn_res);
 
-	// TODO: If there are more connections per worker used,
-	// 	 then check if this is the last connection.
-	// 	 If it's not the last one, then do not yield the worker.
+	/*
+	 * Worker yields each connection separately, worker proxy keeps track of how many
+	 * connections are still queued for this worker. A retired worker still handles
+	 * the queued connections, but it is not given any other command and it is made to
+	 * exit afterwards. New workers are forked with current records.
+	 */
+	if (diverged) {
+		log_debug(ID(worker_res), "Records in worker differ from main key-value store, retiring worker.");
+		(void) worker_control_worker_retire(worker_res);
+		return 0;
+	}
 
 	(void) worker_control_worker_yield(worker_res);
 
@@ -3364,10 +4797,14 @@ static int _cmd_handler(sid_resource_event_source_t *es, void *data)
 	sid_resource_t *       conn_res        = sid_resource_search(cmd_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
 	struct connection *    conn            = sid_resource_get_data(conn_res);
 	struct usid_msg_header response_header = {0};
+	struct usid_msg_ext    response_ext    = {.req_id = ucmd_ctx->req_id};
 	struct cmd_exec_arg    exec_arg        = {0};
 
 	int r = -1;
 
+	SID_PROBE3(cmd__start, ucmd_ctx->request_header.cmd, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor);
+
+	/* the response buffer is a vector, the header is referenced and it can still be updated below */
 	if (!buffer_add(ucmd_ctx->res_buf, &response_header, sizeof(response_header), &r))
 		goto out;
 
@@ -3375,6 +4812,9 @@ static int _cmd_handler(sid_resource_event_source_t *es, void *data)
 		/* If client speaks older protocol, reply using this protocol, if possible. */
 		response_header.prot = ucmd_ctx->request_header.prot;
 		exec_arg.cmd_res     = cmd_res;
+		if (USID_PROTOCOL_HAS_EXT(response_header.prot) &&
+		    !buffer_add(ucmd_ctx->res_buf, &response_ext, USID_MSG_EXT_SIZE, &r))
+			goto out;
 		if ((r = _cmd_regs[ucmd_ctx->request_header.cmd].exec(&exec_arg)) < 0) {
 			log_error(ID(cmd_res), "Failed to execute command");
 			goto out;
@@ -3385,7 +4825,8 @@ static int _cmd_handler(sid_resource_event_source_t *es, void *data)
 		return -1;
 	}
 
-	if ((r = _export_kv_store(cmd_res)) < 0) {
+	/* nothing changed if the scan replied with cached records */
+	if (!exec_arg.reply_cached && (r = _export_kv_store(cmd_res)) < 0) {
 		log_error(ID(cmd_res), "Failed to synchronize key-value store.");
 		goto out;
 	}
@@ -3393,42 +4834,187 @@ out:
 	if (r < 0)
 		response_header.status |= COMMAND_STATUS_FAILURE;
 
-	if (buffer_write_all(ucmd_ctx->res_buf, conn->fd) < 0)
+	SID_PROBE4(cmd__end, ucmd_ctx->request_header.cmd, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor, r);
+
+	if (buffer_write_all(ucmd_ctx->res_buf, conn->fd) < 0) {
 		(void) _connection_cleanup(conn_res);
+		return r;
+	}
+
+	/* the connection may carry more requests, do not keep finished commands until it closes */
+	(void) sid_resource_destroy(cmd_res);
 
 	return r;
 }
 
-static int _reply_failure(sid_resource_t *conn_res)
+/*
+ * The reply is tiny so it is written directly, without touching the connection
+ * buffer which may still hold other requests of a batch.
+ */
+static int _reply_failure(sid_resource_t *conn_res, uint8_t prot, uint32_t req_id)
 {
-	struct connection *    conn = sid_resource_get_data(conn_res);
-	struct usid_msg        msg;
-	uint8_t                prot;
-	struct usid_msg_header response_header = {
-		.status = COMMAND_STATUS_FAILURE,
+	struct connection *conn = sid_resource_get_data(conn_res);
+	struct {
+		MSG_SIZE_PREFIX_TYPE   size;
+		struct usid_msg_header header;
+		struct usid_msg_ext    ext;
+	} __attribute__((packed)) reply = {
+		.header = {.status = COMMAND_STATUS_FAILURE, .prot = prot},
+		.ext    = {.req_id = req_id},
 	};
-	int r = -1;
 
-	(void) buffer_get_data(conn->buf, (const void **) &msg.header, &msg.size);
-	prot = msg.header->prot;
-	(void) buffer_rewind(conn->buf, MSG_SIZE_PREFIX_LEN, BUFFER_POS_ABS);
-	if (prot <= USID_PROTOCOL) {
-		response_header.prot = prot;
-		if (buffer_add(conn->buf, &response_header, sizeof(response_header), &r))
-			r = buffer_write_all(conn->buf, conn->fd);
+	if (prot > USID_PROTOCOL)
+		return -1;
+
+	reply.size = USID_PROTOCOL_HAS_EXT(prot) ? sizeof(reply) : sizeof(reply) - USID_MSG_EXT_SIZE;
+
+	if (write(conn->fd, &reply, reply.size) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int _create_command(sid_resource_t *conn_res, struct usid_msg *msg)
+{
+	char id[32];
+
+	snprintf(id, sizeof(id), "%d/%s", getpid(), usid_cmd_names[msg->header->cmd]);
+
+	if (!sid_resource_create(conn_res,
+	                         &sid_resource_type_ubridge_command,
+	                         SID_RESOURCE_NO_FLAGS,
+	                         id,
+	                         msg,
+	                         SID_RESOURCE_PRIO_NORMAL,
+	                         SID_RESOURCE_NO_SERVICE_LINKS)) {
+		log_error(ID(conn_res), "Failed to register command for processing.");
+		return _reply_failure(conn_res, msg->header->prot, msg->req_id);
+	}
+
+	return 0;
+}
+
+/*
+ * Let block modules start the I/O they need for all the devices of the batch before the
+ * commands are executed one by one, see SID_UCMD_SCAN_PREFETCH. This is only an optimization
+ * so any failure here just means the devices are read when they're scanned.
+ */
+static void _prefetch_scan_batch(sid_resource_t *conn_res)
+{
+	sid_resource_t *          modules_res, *block_mod_registry_res, *block_mod_res, *cmd_res;
+	sid_resource_iter_t *     mod_iter = NULL, *cmd_iter = NULL;
+	const struct cmd_mod_fns *block_mod_fns;
+	struct sid_ucmd_ctx *     ucmd_ctx;
+
+	if (!(modules_res =
+	              sid_resource_search(conn_res, SID_RESOURCE_SEARCH_GENUS, &sid_resource_type_aggregate, MODULES_AGGREGATE_ID)) ||
+	    !(block_mod_registry_res = sid_resource_search(modules_res,
+	                                                   SID_RESOURCE_SEARCH_IMM_DESC,
+	                                                   &sid_resource_type_module_registry,
+	                                                   MODULES_BLOCK_ID)) ||
+	    module_registry_load_modules(block_mod_registry_res) < 0)
+		return;
+
+	if (!(mod_iter = sid_resource_iter_create(block_mod_registry_res)) || !(cmd_iter = sid_resource_iter_create(conn_res)))
+		goto out;
+
+	while ((block_mod_res = sid_resource_iter_next(mod_iter))) {
+		if (module_registry_get_module_symbols(block_mod_res, (const void ***) &block_mod_fns) < 0 || !block_mod_fns ||
+		    !block_mod_fns->scan_prefetch)
+			continue;
+
+		sid_resource_iter_reset(cmd_iter);
+
+		while ((cmd_res = sid_resource_iter_next(cmd_iter))) {
+			if (!sid_resource_match(cmd_res, &sid_resource_type_ubridge_command, NULL))
+				continue;
+
+			ucmd_ctx = sid_resource_get_data(cmd_res);
+
+			if (ucmd_ctx->request_header.cmd == USID_CMD_SCAN)
+				(void) block_mod_fns->scan_prefetch(sid_resource_get_data(block_mod_res), ucmd_ctx);
+		}
+	}
+out:
+	if (cmd_iter)
+		sid_resource_iter_destroy(cmd_iter);
+	if (mod_iter)
+		sid_resource_iter_destroy(mod_iter);
+}
+
+/*
+ * Split USID_CMD_SCAN_BATCH into separate USID_CMD_SCAN commands, one for each item,
+ * so each device is processed and replied to the same way as with single scan request.
+ */
+static int _create_scan_batch_commands(sid_resource_t *conn_res, struct usid_msg *msg)
+{
+	struct usid_scan_batch_item item;
+	struct usid_msg_header      item_header = {.prot = msg->header->prot, .cmd = USID_CMD_SCAN};
+	struct usid_msg             item_msg;
+	struct buffer *             buf;
+	const char *                p, *end;
+	int                         r = 0;
+
+	/* check all the items first so a malformed batch is rejected as a whole */
+	for (p = msg->header->data, end = (const char *) msg->header + msg->size; p < end; p += item.size) {
+		if ((size_t) (end - p) < USID_SCAN_BATCH_ITEM_SIZE)
+			goto malformed;
+
+		memcpy(&item, p, sizeof(item));
+
+		if (item.size <= USID_SCAN_BATCH_ITEM_SIZE || item.size > (size_t) (end - p))
+			goto malformed;
+	}
+
+	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                  .type    = BUFFER_TYPE_LINEAR,
+	                                                  .mode    = BUFFER_MODE_PLAIN}),
+	                          &((struct buffer_init) {.size = 0, .alloc_step = PATH_MAX, .limit = 0}),
+	                          &r))) {
+		log_error_errno(ID(conn_res), r, "Failed to create buffer for scan batch item");
+		return _reply_failure(conn_res, msg->header->prot, msg->req_id);
+	}
+
+	/* commands copy what they need from the request on init so the buffer is reused */
+	for (p = msg->header->data; p < end && r == 0; p += item.size) {
+		memcpy(&item, p, sizeof(item));
+		(void) buffer_clear(buf);
+
+		/* scan request carries SEQNUM in the status field of the header */
+		item_header.status = item.seqnum;
+
+		if (!buffer_add(buf, &item_header, USID_MSG_HEADER_SIZE, &r) ||
+		    !buffer_add(buf, (void *) (p + USID_SCAN_BATCH_ITEM_SIZE), item.size - USID_SCAN_BATCH_ITEM_SIZE, &r)) {
+			r = _reply_failure(conn_res, msg->header->prot, item.req_id);
+			continue;
+		}
+
+		(void) buffer_get_data(buf, (const void **) &item_msg.header, &item_msg.size);
+		item_msg.req_id = item.req_id;
+
+		r = _create_command(conn_res, &item_msg);
 	}
 
+	buffer_destroy(buf);
+
+	if (r == 0)
+		_prefetch_scan_batch(conn_res);
+
 	return r;
+malformed:
+	log_error(ID(conn_res), "Malformed scan batch request.");
+	return _reply_failure(conn_res, msg->header->prot, msg->req_id);
 }
 
 static int _on_connection_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
 {
-	sid_resource_t *   conn_res = data;
-	struct connection *conn     = sid_resource_get_data(conn_res);
-	struct usid_msg    msg;
-	char               id[32];
-	ssize_t            n;
-	int                r = 0;
+	sid_resource_t *        conn_res = data;
+	struct connection *     conn     = sid_resource_get_data(conn_res);
+	struct usid_msg         msg;
+	struct usid_msg_header *header;
+	struct usid_msg_ext     ext;
+	ssize_t                 n;
+	int                     r = 0;
 
 	if (revents & EPOLLERR) {
 		if (revents & EPOLLHUP)
@@ -3442,28 +5028,42 @@ static int _on_connection_event(sid_resource_event_source_t *es, int fd, uint32_
 	n = buffer_read(conn->buf, fd);
 	if (n > 0) {
 		if (buffer_is_complete(conn->buf, NULL)) {
-			(void) buffer_get_data(conn->buf, (const void **) &msg.header, &msg.size);
+			(void) buffer_get_data(conn->buf, (const void **) &header, &msg.size);
+			msg.header = header;
+			msg.req_id = 0;
 
 			/* Sanitize command number - map all out of range command numbers to CMD_UNKNOWN. */
-			if (msg.header->cmd < _USID_CMD_START || msg.header->cmd > _USID_CMD_END)
-				msg.header->cmd = USID_CMD_UNKNOWN;
-
-			snprintf(id, sizeof(id), "%d/%s", getpid(), usid_cmd_names[msg.header->cmd]);
-
-			if (!sid_resource_create(conn_res,
-			                         &sid_resource_type_ubridge_command,
-			                         SID_RESOURCE_NO_FLAGS,
-			                         id,
-			                         &msg,
-			                         SID_RESOURCE_PRIO_NORMAL,
-			                         SID_RESOURCE_NO_SERVICE_LINKS)) {
-				log_error(ID(conn_res), "Failed to register command for processing.");
-				if (_reply_failure(conn_res) < 0) {
+			if (header->cmd < _USID_CMD_START || header->cmd > _USID_CMD_END)
+				header->cmd = USID_CMD_UNKNOWN;
+
+			/*
+			 * Move the header over the extension so it is directly followed by the data again
+			 * and the rest of the processing does not need to care about the protocol version.
+			 */
+			if (USID_PROTOCOL_HAS_EXT(header->prot) && header->prot <= USID_PROTOCOL) {
+				if (msg.size < USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE) {
+					log_error(ID(conn_res), "Missing request header extension.");
 					(void) _connection_cleanup(conn_res);
 					return -1;
 				}
+
+				memcpy(&ext, header->data, USID_MSG_EXT_SIZE);
+				msg.header = memmove((char *) header + USID_MSG_EXT_SIZE, header, USID_MSG_HEADER_SIZE);
+				msg.size -= USID_MSG_EXT_SIZE;
+				msg.req_id = ext.req_id;
+			}
+
+			if (msg.header->cmd == USID_CMD_SCAN_BATCH)
+				r = _create_scan_batch_commands(conn_res, &msg);
+			else
+				r = _create_command(conn_res, &msg);
+
+			if (r < 0) {
+				(void) _connection_cleanup(conn_res);
+				return -1;
 			}
-			(void) buffer_reset(conn->buf);
+
+			(void) buffer_clear(conn->buf);
 		}
 	} else if (n < 0) {
 		if (n == -EAGAIN || n == -EINTR)
@@ -3478,99 +5078,162 @@ static int _on_connection_event(sid_resource_event_source_t *es, int fd, uint32_
 	return r;
 }
 
-static int _init_connection(sid_resource_t *res, const void *kickstart_data, void **data)
+static void _free_connection(struct connection *conn)
 {
-	const struct worker_data_spec *data_spec = kickstart_data;
-	struct connection *            conn;
-	int                            r;
+	if (conn->buf)
+		buffer_destroy(conn->buf);
 
-	if (!(conn = mem_zalloc(sizeof(*conn)))) {
-		log_error(ID(res), "Failed to allocate new connection structure.");
-		goto fail;
-	}
+	free(conn);
+}
 
-	conn->fd = data_spec->ext.socket.fd_pass;
+/*
+ * Workers live long and see many different devices, including removed ones,
+ * so the device keys are interned only while a command uses them.
+ */
+static void _put_dev_keys(struct sid_ucmd_ctx *ucmd_ctx)
+{
+	dev_key_t dev_key;
 
-	if (sid_resource_create_io_event_source(res, NULL, conn->fd, _on_connection_event, 0, "client connection", res) < 0) {
-		log_error(ID(res), "Failed to register connection event handler.");
-		goto fail;
+	for (dev_key = 0; dev_key < _DEV_KEY_COUNT; dev_key++) {
+		if (ucmd_ctx->dev_keys[dev_key]) {
+			kv_store_atom_put(ucmd_ctx->ucmd_mod_ctx.kv_store_res, ucmd_ctx->dev_keys[dev_key]);
+			ucmd_ctx->dev_keys[dev_key] = NULL;
+		}
 	}
+}
 
-	if (!(conn->buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
-	                                                        .type    = BUFFER_TYPE_LINEAR,
-	                                                        .mode    = BUFFER_MODE_SIZE_PREFIX}),
-	                                &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
-	                                &r))) {
-		log_error_errno(ID(res), r, "Failed to create connection buffer");
-		goto fail;
+static void _free_ucmd_ctx(struct sid_ucmd_ctx *ucmd_ctx)
+{
+	_put_dev_keys(ucmd_ctx);
+	if (ucmd_ctx->ucmd_mod_ctx.gen_buf)
+		buffer_destroy(ucmd_ctx->ucmd_mod_ctx.gen_buf);
+	if (ucmd_ctx->res_buf)
+		buffer_destroy(ucmd_ctx->res_buf);
+	free(ucmd_ctx->dev_id);
+	free(ucmd_ctx->args.mem);
+	free(ucmd_ctx->udev_env.mem);
+	free(ucmd_ctx);
+}
+
+static int _init_ucmd_pool(sid_resource_t *res, const void *kickstart_data, void **data)
+{
+	struct ucmd_pool *pool;
+
+	if (!(pool = mem_zalloc(sizeof(*pool)))) {
+		log_error(ID(res), "Failed to allocate command pool structure.");
+		return -1;
 	}
 
-	*data = conn;
+	list_init(&pool->free_conns);
+	list_init(&pool->free_ucmd_ctxs);
+	pool->sysfs_dev_block_fd = -1;
+
+	*data = pool;
 	return 0;
-fail:
-	if (conn) {
-		if (conn->buf)
-			buffer_destroy(conn->buf);
-		free(conn);
-	}
-	return -1;
 }
 
-static int _destroy_connection(sid_resource_t *res)
+static int _destroy_ucmd_pool(sid_resource_t *res)
 {
-	struct connection *conn = sid_resource_get_data(res);
+	struct ucmd_pool *   pool = sid_resource_get_data(res);
+	struct connection *  conn, *tmp_conn;
+	struct sid_ucmd_ctx *ucmd_ctx, *tmp_ucmd_ctx;
 
-	if (conn->fd != -1)
-		close(conn->fd);
+	list_iterate_items_safe (conn, tmp_conn, &pool->free_conns)
+		_free_connection(conn);
 
-	if (conn->buf)
-		buffer_destroy(conn->buf);
+	list_iterate_items_safe (ucmd_ctx, tmp_ucmd_ctx, &pool->free_ucmd_ctxs)
+		_free_ucmd_ctx(ucmd_ctx);
 
-	free(conn);
+	free(pool->block_mod_dispatch);
+	_destroy_mod_stats(pool->mod_stats);
+
+	if (pool->sysfs_slaves) {
+		radix_iter(pool->sysfs_slaves, free);
+		radix_destroy(pool->sysfs_slaves);
+	}
+
+	if (pool->sysfs_dev_block_fd >= 0)
+		(void) close(pool->sysfs_dev_block_fd);
+
+	free(pool);
 	return 0;
 }
 
-static bool _socket_client_is_capable(int fd, usid_cmd_t cmd)
+static struct connection *_get_connection(sid_resource_t *res, struct ucmd_pool *pool)
 {
-	socklen_t    len = 0;
-	struct ucred uc;
+	struct connection *conn;
+	int                r;
 
-	len = sizeof(struct ucred);
-	/* root can run any command */
-	if ((fd >= 0) && (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) == 0) && (uc.uid == 0))
-		return true;
-	return !usid_cmd_root_only[cmd];
-}
+	if (pool && pool->free_conn_count) {
+		conn = list_item(pool->free_conns.n, struct connection);
+		list_del(&conn->list);
+		pool->free_conn_count--;
+		return conn;
+	}
 
-static int _init_command(sid_resource_t *res, const void *kickstart_data, void **data)
+	if (!(conn = mem_zalloc(sizeof(*conn)))) {
+		log_error(ID(res), "Failed to allocate new connection structure.");
+		return NULL;
+	}
+
+	if (!(conn->buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                        .type    = BUFFER_TYPE_LINEAR,
+	                                                        .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                                &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+	                                &r))) {
+		log_error_errno(ID(res), r, "Failed to create connection buffer");
+		free(conn);
+		return NULL;
+	}
+
+	conn->pool = pool;
+	return conn;
+}
+
+static void _put_connection(struct connection *conn)
 {
-	const struct usid_msg *msg      = kickstart_data;
-	struct sid_ucmd_ctx *  ucmd_ctx = NULL;
-	struct connection *    conn     = sid_resource_get_data(sid_resource_search(res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
-	const char *           worker_id;
-	int                    r;
+	struct ucmd_pool *pool = conn->pool;
+	struct buffer *   buf  = conn->buf;
 
-	if (!conn || !_socket_client_is_capable(conn->fd, msg->header->cmd)) {
-		log_error(ID(res), "client does not have permission to run %s", usid_cmd_names[msg->header->cmd]);
-		return -1;
+	if (!pool || pool->free_conn_count >= UCMD_POOL_MAX) {
+		_free_connection(conn);
+		return;
+	}
+
+	(void) buffer_clear(buf);
+	*conn = (struct connection) {.pool = pool, .fd = -1, .buf = buf};
+
+	list_add(&pool->free_conns, &conn->list);
+	pool->free_conn_count++;
+}
+
+static struct sid_ucmd_ctx *_get_ucmd_ctx(sid_resource_t *res, struct ucmd_pool *pool)
+{
+	struct sid_ucmd_ctx *ucmd_ctx;
+	int                  r;
+
+	if (pool && pool->free_ucmd_ctx_count) {
+		ucmd_ctx = list_item(pool->free_ucmd_ctxs.n, struct sid_ucmd_ctx);
+		list_del(&ucmd_ctx->list);
+		pool->free_ucmd_ctx_count--;
+		return ucmd_ctx;
 	}
 
 	if (!(ucmd_ctx = mem_zalloc(sizeof(*ucmd_ctx)))) {
 		log_error(ID(res), "Failed to allocate new command structure.");
-		return -1;
+		return NULL;
 	}
 
+	/* udev reply adds several items for each exported key so grow geometrically */
 	if (!(ucmd_ctx->res_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
 	                                                                .type    = BUFFER_TYPE_VECTOR,
 	                                                                .mode    = BUFFER_MODE_SIZE_PREFIX}),
-	                                        &((struct buffer_init) {.size = 1, .alloc_step = 1, .limit = 0}),
+	                                        &((struct buffer_init) {.size = 1, .alloc_step = 1, .limit = 0, .alloc_factor = 2}),
 	                                        &r))) {
 		log_error_errno(ID(res), r, "Failed to create response buffer");
 		goto fail;
 	}
 
-	ucmd_ctx->request_header = *msg->header;
-
 	if (!(ucmd_ctx->ucmd_mod_ctx.gen_buf =
 	              buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
 	                                                    .type    = BUFFER_TYPE_LINEAR,
@@ -3581,6 +5244,107 @@ static int _init_command(sid_resource_t *res, const void *kickstart_data, void *
 		goto fail;
 	}
 
+	ucmd_ctx->pool = pool;
+	return ucmd_ctx;
+fail:
+	_free_ucmd_ctx(ucmd_ctx);
+	return NULL;
+}
+
+static void _put_ucmd_ctx(struct sid_ucmd_ctx *ucmd_ctx)
+{
+	struct ucmd_pool *pool    = ucmd_ctx->pool;
+	struct buffer *   res_buf = ucmd_ctx->res_buf;
+	struct buffer *   gen_buf = ucmd_ctx->ucmd_mod_ctx.gen_buf;
+
+	if (!pool || pool->free_ucmd_ctx_count >= UCMD_POOL_MAX) {
+		_free_ucmd_ctx(ucmd_ctx);
+		return;
+	}
+
+	_put_dev_keys(ucmd_ctx);
+	free(ucmd_ctx->dev_id);
+	free(ucmd_ctx->args.mem);
+	free(ucmd_ctx->udev_env.mem);
+	(void) buffer_clear(res_buf);
+	(void) buffer_clear(gen_buf);
+
+	memset(ucmd_ctx, 0, sizeof(*ucmd_ctx));
+	ucmd_ctx->pool                 = pool;
+	ucmd_ctx->res_buf              = res_buf;
+	ucmd_ctx->ucmd_mod_ctx.gen_buf = gen_buf;
+
+	list_add(&pool->free_ucmd_ctxs, &ucmd_ctx->list);
+	pool->free_ucmd_ctx_count++;
+}
+
+static int _init_connection(sid_resource_t *res, const void *kickstart_data, void **data)
+{
+	const struct worker_data_spec *data_spec = kickstart_data;
+	sid_resource_t *               pool_res;
+	struct connection *            conn;
+
+	/* the pool is only set up in workers */
+	pool_res = sid_resource_search(res, SID_RESOURCE_SEARCH_SIB, &sid_resource_type_ubridge_ucmd_pool, NULL);
+
+	if (!(conn = _get_connection(res, pool_res ? sid_resource_get_data(pool_res) : NULL)))
+		return -1;
+
+	conn->fd = data_spec->ext.socket.fd_pass;
+
+	if (sid_resource_create_io_event_source(res, NULL, conn->fd, _on_connection_event, 0, "client connection", res) < 0) {
+		log_error(ID(res), "Failed to register connection event handler.");
+		conn->fd = -1;
+		_put_connection(conn);
+		return -1;
+	}
+
+	*data = conn;
+	return 0;
+}
+
+static int _destroy_connection(sid_resource_t *res)
+{
+	struct connection *conn = sid_resource_get_data(res);
+
+	if (conn->fd != -1)
+		close(conn->fd);
+
+	_put_connection(conn);
+	return 0;
+}
+
+static bool _socket_client_is_capable(int fd, usid_cmd_t cmd)
+{
+	socklen_t    len = 0;
+	struct ucred uc;
+
+	len = sizeof(struct ucred);
+	/* root can run any command */
+	if ((fd >= 0) && (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) == 0) && (uc.uid == 0))
+		return true;
+	return !usid_cmd_root_only[cmd];
+}
+
+static int _init_command(sid_resource_t *res, const void *kickstart_data, void **data)
+{
+	const struct usid_msg *msg      = kickstart_data;
+	struct sid_ucmd_ctx *  ucmd_ctx = NULL;
+	struct connection *    conn     = sid_resource_get_data(sid_resource_search(res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL));
+	const char *           worker_id;
+	int                    r;
+
+	if (!conn || !_socket_client_is_capable(conn->fd, msg->header->cmd)) {
+		log_error(ID(res), "client does not have permission to run %s", usid_cmd_names[msg->header->cmd]);
+		return -1;
+	}
+
+	if (!(ucmd_ctx = _get_ucmd_ctx(res, conn->pool)))
+		return -1;
+
+	ucmd_ctx->request_header = *msg->header;
+	ucmd_ctx->req_id         = msg->req_id;
+
 	if (!(ucmd_ctx->ucmd_mod_ctx.modules_res =
 	              sid_resource_search(res, SID_RESOURCE_SEARCH_GENUS, &sid_resource_type_aggregate, MODULES_AGGREGATE_ID))) {
 		log_error(ID(res), INTERNAL_ERROR "%s: Failed to find module registry aggregator.", __func__);
@@ -3599,6 +5363,14 @@ static int _init_command(sid_resource_t *res, const void *kickstart_data, void *
 			log_error_errno(ID(res), r, "Failed to parse udev environment variables");
 			goto fail;
 		}
+	} else if (msg->header->cmd == USID_CMD_DUMP || msg->header->cmd == USID_CMD_GET) {
+		if ((r = _parse_cmd_args(ucmd_ctx,
+		                         msg->header->data,
+		                         msg->size - sizeof(*msg->header),
+		                         msg->header->cmd == USID_CMD_DUMP ? USID_DUMP_FILTER_COUNT : USID_GET_SPEC_COUNT)) < 0) {
+			log_error_errno(ID(res), r, "Failed to parse %s request", usid_cmd_names[msg->header->cmd]);
+			goto fail;
+		}
 	}
 
 	if (!(worker_id = worker_control_get_worker_id(res))) {
@@ -3623,30 +5395,18 @@ static int _init_command(sid_resource_t *res, const void *kickstart_data, void *
 		goto fail;
 	}
 
+	SID_PROBE3(cmd__init, msg->header->cmd, ucmd_ctx->udev_dev.major, ucmd_ctx->udev_dev.minor);
+
 	*data = ucmd_ctx;
 	return 0;
 fail:
-	if (ucmd_ctx) {
-		if (ucmd_ctx->ucmd_mod_ctx.gen_buf)
-			buffer_destroy(ucmd_ctx->ucmd_mod_ctx.gen_buf);
-		if (ucmd_ctx->res_buf)
-			buffer_destroy(ucmd_ctx->res_buf);
-		if (ucmd_ctx->dev_id)
-			free(ucmd_ctx->dev_id);
-		free(ucmd_ctx);
-	}
+	_put_ucmd_ctx(ucmd_ctx);
 	return -1;
 }
 
 static int _destroy_command(sid_resource_t *res)
 {
-	struct sid_ucmd_ctx *ucmd_ctx = sid_resource_get_data(res);
-
-	buffer_destroy(ucmd_ctx->ucmd_mod_ctx.gen_buf);
-	buffer_destroy(ucmd_ctx->res_buf);
-	free(ucmd_ctx->dev_id);
-	free(ucmd_ctx);
-
+	_put_ucmd_ctx(sid_resource_get_data(res));
 	return 0;
 }
 
@@ -3673,6 +5433,9 @@ static int _main_kv_store_unset(const char *full_key, struct kv_store_update_spe
 		return 0;
 	}
 
+	if (update_arg->journal && kv_store_journal_add_unset(update_arg->journal, full_key) < 0)
+		log_error(ID(update_arg->res), "Failed to record unset of key %s in journal.", full_key);
+
 	return 1;
 }
 
@@ -3699,13 +5462,22 @@ static int _main_kv_store_update(const char *full_key, struct kv_store_update_sp
 		iov_new = _get_value_vector(spec->new_flags, spec->new_data, spec->new_data_size, tmp_iov_new);
 	}
 
-	if (r)
+	if (r) {
 		log_debug(ID(update_arg->res),
 		          "Updating value for key %s (new seqnum %" PRIu64 " >= old seqnum %" PRIu64 ")",
 		          full_key,
 		          KV_VALUE_SEQNUM(iov_new),
 		          iov_old ? KV_VALUE_SEQNUM(iov_old) : 0);
-	else
+
+		/* record the resulting value so replaying the journal does not need to resolve deltas again */
+		if (update_arg->journal &&
+		    kv_store_journal_add_set(update_arg->journal,
+		                             full_key,
+		                             spec->new_data,
+		                             spec->new_data_size,
+		                             spec->new_flags) < 0)
+			log_error(ID(update_arg->res), "Failed to record update of key %s in journal.", full_key);
+	} else
 		log_debug(ID(update_arg->res),
 		          "Keeping old value for key %s (new seqnum %" PRIu64 " < old seqnum %" PRIu64 ")",
 		          full_key,
@@ -3715,295 +5487,2623 @@ static int _main_kv_store_update(const char *full_key, struct kv_store_update_sp
 	return r;
 }
 
-static int _sync_main_kv_store(sid_resource_t *worker_proxy_res, sid_resource_t *internal_ubridge_res, int fd)
+static int _write_main_kv_store_image(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+	uint64_t        seqnum  = ubridge->journal ? kv_store_journal_get_seqnum(ubridge->journal) : 0;
+	int             r;
+
+	if (ubridge->image_es)
+		sid_resource_destroy_event_source(&ubridge->image_es);
+
+	if ((r = kv_store_image_write(ubridge->ucmd_mod_ctx.kv_store_res, MAIN_KV_STORE_IMAGE_PATH, seqnum)) < 0)
+		return r;
+
+	log_debug(ID(internal_ubridge_res),
+	          "Main key-value store image written to " MAIN_KV_STORE_IMAGE_PATH " (journal seqnum %" PRIu64 ").",
+	          seqnum);
+
+	/* the image covers all journal entries now */
+	if (ubridge->journal && (r = kv_store_journal_reset(ubridge->journal)) < 0)
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to reset main key-value store journal");
+
+	return r;
+}
+
+static int _on_main_kv_store_image_event(sid_resource_event_source_t *es, uint64_t usec, void *data)
+{
+	(void) _write_main_kv_store_image(data);
+	return 0;
+}
+
+/*
+ * The image is written with a delay so that a burst of changes results in a single write.
+ * Changes done in the meantime are recorded in the journal.
+ */
+static void _schedule_main_kv_store_image(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+
+	if (ubridge->image_es)
+		return;
+
+	if (sid_resource_create_time_event_source(internal_ubridge_res,
+	                                          &ubridge->image_es,
+	                                          CLOCK_MONOTONIC,
+	                                          util_time_get_now_usec(CLOCK_MONOTONIC) + MAIN_KV_STORE_IMAGE_DELAY_USEC,
+	                                          0,
+	                                          _on_main_kv_store_image_event,
+	                                          0,
+	                                          "main kv store image",
+	                                          internal_ubridge_res) < 0) {
+		ubridge->image_es = NULL;
+		log_error(ID(internal_ubridge_res), "Failed to schedule writing of main key-value store image.");
+	}
+}
+
+static uint64_t _add_duration(uint64_t *total, uint64_t *max, uint64_t start_usec)
+{
+	uint64_t usec = util_time_get_now_usec(CLOCK_MONOTONIC) - start_usec;
+
+	*total += usec;
+	if (usec > *max)
+		*max = usec;
+
+	return usec;
+}
+
+static void _schedule_main_kv_store_compact_step(sid_resource_t *internal_ubridge_res);
+
+static int _on_main_kv_store_compact_event(sid_resource_event_source_t *es, void *data)
+{
+	sid_resource_t *internal_ubridge_res = data;
+	struct ubridge *ubridge              = sid_resource_get_data(internal_ubridge_res);
+	uint64_t        start_usec           = util_time_get_now_usec(CLOCK_MONOTONIC);
+	int             r;
+
+	sid_resource_destroy_event_source(&ubridge->compact_es);
+
+	r = kv_store_compact_step(ubridge->ucmd_mod_ctx.kv_store_res, MAIN_KV_STORE_COMPACT_SLICE);
+	(void) _add_duration(&ubridge->stats.compact_usec_total, &ubridge->stats.compact_usec_max, start_usec);
+
+	if (r > 0)
+		_schedule_main_kv_store_compact_step(internal_ubridge_res);
+	else if (r == 0) {
+		/* the records are packed at the start of the heap now, give the rest back to the system */
+		(void) malloc_trim(0);
+		log_debug(ID(internal_ubridge_res), "Main key-value store compacted.");
+	} else
+		/* the compaction stays in progress and continues when it is started next time */
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to compact main key-value store");
+
+	return 0;
+}
+
+/*
+ * Compaction steps have lower priority than all the other event sources so each step
+ * only runs when the event loop has nothing else to do and the compaction never delays
+ * handling of events by more than one step.
+ */
+static void _schedule_main_kv_store_compact_step(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+
+	if (ubridge->compact_es)
+		return;
+
+	if (sid_resource_create_deferred_event_source(internal_ubridge_res,
+	                                              &ubridge->compact_es,
+	                                              _on_main_kv_store_compact_event,
+	                                              MAIN_KV_STORE_COMPACT_PRIO,
+	                                              "main kv store compaction",
+	                                              internal_ubridge_res) < 0) {
+		ubridge->compact_es = NULL;
+		log_error(ID(internal_ubridge_res), "Failed to schedule main key-value store compaction.");
+	}
+}
+
+/*
+ * After removal storms (e.g. a whole SAN zone going away), the records left are scattered
+ * over the heap and the memory can not be returned to the system. Compact the store if the
+ * records removed or replaced since last compaction outnumber the ones left enough or if
+ * forced by the checkpoint command.
+ */
+static void _compact_main_kv_store(sid_resource_t *internal_ubridge_res, bool force)
+{
+	struct ubridge *      ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct kv_store_stats stats;
+	int                   r;
+
+	if (!force && (kv_store_get_stats(ubridge->ucmd_mod_ctx.kv_store_res, &stats) < 0 ||
+	               stats.garbage < MAIN_KV_STORE_COMPACT_GARBAGE ||
+	               stats.garbage * 100 < stats.records * MAIN_KV_STORE_COMPACT_RATIO))
+		return;
+
+	if ((r = kv_store_compact_start(ubridge->ucmd_mod_ctx.kv_store_res)) < 0) {
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to start main key-value store compaction");
+		return;
+	}
+
+	_schedule_main_kv_store_compact_step(internal_ubridge_res);
+}
+
+static const struct sid_kv_store_resource_params sync_kv_store_res_params = {.backend          = KV_STORE_BACKEND_RADIX,
+                                                                             .arena_chunk_size = SYNC_KV_STORE_ARENA_CHUNK_SIZE};
+
+/*
+ * Records gathered for one sync transaction are deduplicated by seqnum - if more workers
+ * export the same key, only the record with the highest seqnum is synced.
+ */
+static int _sync_kv_store_update(const char *full_key, struct kv_store_update_spec *spec, void *arg)
+{
+	struct iovec  tmp_iov_old[KV_VALUE_IDX_DATA + 1];
+	struct iovec  tmp_iov_new[KV_VALUE_IDX_DATA + 1];
+	struct iovec *iov_old, *iov_new;
+
+	if (!(iov_old = _get_value_vector(spec->old_flags, spec->old_data, spec->old_data_size, tmp_iov_old)))
+		return 1;
+
+	iov_new = _get_value_vector(spec->new_flags, spec->new_data, spec->new_data_size, tmp_iov_new);
+
+	return KV_VALUE_SEQNUM(iov_new) >= KV_VALUE_SEQNUM(iov_old);
+}
+
+/* Adds resulting value of a record changed in main kv store to the update for idle workers. */
+static int _write_main_kv_store_update(struct rec_writer *w, sid_resource_t *kv_store_res, const char *key)
 {
-	static const char      syncing_msg[] = "Syncing main key-value store:  %s = %s (seqnum %" PRIu64 ")";
-	struct ubridge *       ubridge       = sid_resource_get_data(internal_ubridge_res);
-	sid_resource_t *       kv_store_res;
 	kv_store_value_flags_t flags;
-	size_t                 msg_size, full_key_size, data_size, data_offset, i;
-	char *                 full_key, *shm = NULL, *p, *end;
-	struct kv_value *      value = NULL;
-	struct iovec *         iov   = NULL;
-	const char *           iov_str;
-	void *                 data_to_store;
-	struct kv_rel_spec     rel_spec   = {.delta = &((struct kv_delta) {0})};
-	struct kv_update_arg   update_arg = {.gen_buf = ubridge->ucmd_mod_ctx.gen_buf, .custom = &rel_spec};
-	bool                   unset;
-	int                    r = -1;
+	size_t                 size;
+	void *                 value;
 
-	if (!(kv_store_res = sid_resource_search(internal_ubridge_res,
+	if (!(value = kv_store_get_value(kv_store_res, key, &size, &flags)))
+		return _write_kv_unset_rec(w, key);
+
+	return _write_kv_rec(w, key, flags, value, size, true);
+}
+
+/*
+ * Sends the update to idle workers over MAIN_WORKER_UPDATE_CHANNEL_ID as sealed file,
+ * tagged with the main kv store generation which the workers have after applying it.
+ */
+static int _send_main_kv_store_update(sid_resource_t *    worker_control_res,
+                                      struct rec_writer **update_w,
+                                      struct buffer *     update_buf,
+                                      uint64_t            generation)
+{
+	struct worker_data_spec data_spec;
+	int                     fd, r;
+
+	rec_writer_destroy(*update_w);
+	*update_w = NULL;
+
+	if ((fd = buffer_detach_fd(update_buf)) < 0) {
+		log_error_errno(ID(worker_control_res), fd, "Failed to seal update of idle workers");
+		return fd;
+	}
+
+	data_spec.data               = &generation;
+	data_spec.data_size          = sizeof(generation);
+	data_spec.ext.used           = true;
+	data_spec.ext.socket.fd_pass = fd;
+
+	if ((r = worker_control_send_to_idle(worker_control_res, MAIN_WORKER_UPDATE_CHANNEL_ID, &data_spec)) >= 0)
+		log_debug(ID(worker_control_res),
+		          "Sent update to main key-value store generation %" PRIu64 " to %d idle workers.",
+		          generation,
+		          r);
+
+	(void) close(fd);
+	return r;
+}
+
+static void _destroy_subscriber(struct subscriber *sub)
+{
+	list_del(&sub->list);
+
+	if (sub->es)
+		sid_resource_destroy_event_source(&sub->es);
+
+	if (sub->fd >= 0)
+		(void) close(sub->fd);
+
+	if (sub->pending_keys)
+		radix_destroy(sub->pending_keys);
+
+	if (sub->out_buf)
+		buffer_destroy(sub->out_buf);
+
+	free(sub->prefixes);
+	free(sub);
+}
+
+static bool _subscriber_matches(struct subscriber *sub, const char *key)
+{
+	const char *prefix, *end;
+	size_t      len;
+
+	if (!sub->prefixes)
+		return true;
+
+	for (prefix = sub->prefixes, end = sub->prefixes + sub->prefixes_size; prefix < end; prefix += len + 1) {
+		len = strlen(prefix);
+		if (!strncmp(key, prefix, len))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Prepares next reply in out_buf with resulting values of all keys changed since
+ * the previous reply. Changes are taken from main kv store only now so more changes
+ * of the same key in the meantime end up as one record.
+ */
+static int _build_subscriber_reply(struct subscriber *sub)
+{
+	struct usid_msg_header header = {.status = COMMAND_STATUS_MORE, .prot = sub->prot};
+	struct usid_msg_ext    ext    = {.req_id = sub->req_id};
+	sid_resource_t *       kv_store_res;
+	struct rec_writer *    w;
+	struct radix_node *    n;
+	int                    r;
+
+	if (!(kv_store_res = sid_resource_search(sub->internal_ubridge_res,
 	                                         SID_RESOURCE_SEARCH_IMM_DESC,
 	                                         &sid_resource_type_kv_store,
 	                                         MAIN_KV_STORE_NAME)))
 		return -ENOMEDIUM;
 
-	ubridge = sid_resource_get_data(internal_ubridge_res);
+	if (!(sub->out_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                           .type    = BUFFER_TYPE_LINEAR,
+	                                                           .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                                   &((struct buffer_init) {.size = 0, .alloc_step = PATH_MAX, .limit = 0}),
+	                                   &r)))
+		return r;
+
+	sub->out_pos = 0;
 
-	if (read(fd, &msg_size, sizeof(msg_size)) != sizeof(msg_size)) {
-		log_error_errno(ID(worker_proxy_res), errno, "Failed to read shared memory size");
-		goto out;
+	if (sub->overflow)
+		header.status = COMMAND_STATUS_FAILURE;
+
+	if (!buffer_add(sub->out_buf, &header, sizeof(header), &r) ||
+	    (USID_PROTOCOL_HAS_EXT(header.prot) && !buffer_add(sub->out_buf, &ext, sizeof(ext), &r)))
+		return r;
+
+	if (sub->overflow)
+		return 0;
+
+	if (!(w = rec_writer_create(sub->out_buf, &r)))
+		return r;
+
+	radix_iterate (n, sub->pending_keys) {
+		if ((r = _write_main_kv_store_update(w, kv_store_res, radix_get_key(sub->pending_keys, n, NULL))) < 0)
+			break;
+	}
+
+	rec_writer_destroy(w);
+
+	radix_destroy(sub->pending_keys);
+	if (!(sub->pending_keys = radix_create()) && r == 0)
+		r = -ENOMEM;
+
+	return r;
+}
+
+/*
+ * Sends as much as the socket takes without blocking and waits for EPOLLOUT for the rest.
+ * Returns -1 if the subscriber is destroyed.
+ */
+static int _send_to_subscriber(struct subscriber *sub)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (!sub->out_buf) {
+			if (!sub->overflow && !radix_get_num_entries(sub->pending_keys))
+				break;
+
+			if ((n = _build_subscriber_reply(sub)) < 0)
+				goto fail;
+		}
+
+		if ((n = buffer_write(sub->out_buf, sub->fd, sub->out_pos)) >= 0) {
+			sub->out_pos += n;
+			continue;
+		}
+
+		if (n == -EINTR)
+			continue;
+
+		if (n == -EAGAIN)
+			return sid_resource_set_io_event_source_events(sub->es, EPOLLIN | EPOLLOUT);
+
+		if (n != -ENODATA || sub->overflow)
+			goto fail;
+
+		buffer_destroy(sub->out_buf);
+		sub->out_buf = NULL;
+	}
+
+	return sid_resource_set_io_event_source_events(sub->es, EPOLLIN);
+fail:
+	if (n != -ENODATA)
+		log_error_errno(ID(sub->internal_ubridge_res), n, "Failed to send changes to subscriber");
+	_destroy_subscriber(sub);
+	return -1;
+}
+
+static int _on_subscriber_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
+{
+	struct subscriber *sub = data;
+	char               buf[64];
+	ssize_t            n;
+
+	/* the client is not supposed to send anything else, only closing the connection matters */
+	if (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			;
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			_destroy_subscriber(sub);
+			return 0;
+		}
+	}
+
+	if (revents & EPOLLOUT)
+		(void) _send_to_subscriber(sub);
+
+	return 0;
+}
+
+/* Records change of a key in main kv store for all subscribers interested in it. */
+static void _notify_subscribers(sid_resource_t *internal_ubridge_res, const char *key)
+{
+	struct ubridge *   ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct subscriber *sub;
+
+	list_iterate_items (sub, &ubridge->subscribers) {
+		if (sub->overflow || !_subscriber_matches(sub, key))
+			continue;
+
+		if (radix_get_num_entries(sub->pending_keys) >= SUBSCRIBER_PENDING_MAX ||
+		    radix_insert(sub->pending_keys, key, strlen(key) + 1, NULL, 0) < 0) {
+			log_error(ID(internal_ubridge_res), "Too many changes pending for subscriber, dropping it.");
+			sub->overflow = true;
+		}
+	}
+}
+
+static void _flush_subscribers(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *   ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct subscriber *sub, *tmp_sub;
+
+	/* subscribers still sending the previous reply continue on EPOLLOUT */
+	list_iterate_items_safe (sub, tmp_sub, &ubridge->subscribers) {
+		if (!sub->out_buf && (sub->overflow || radix_get_num_entries(sub->pending_keys)))
+			(void) _send_to_subscriber(sub);
+	}
+}
+
+/*
+ * Takes over the connection from pconn. The connection stays in main process as
+ * it is the main kv store that the subscriber follows.
+ */
+static void _add_subscriber(struct pending_conn *pconn)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+	char                 req_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE + SUBSCRIBE_REQ_DATA_MAX];
+	MSG_SIZE_PREFIX_TYPE size;
+	size_t               data_offset;
+	struct subscriber *  sub;
+
+	data_offset = MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + (USID_PROTOCOL_HAS_EXT(pconn->prot) ? USID_MSG_EXT_SIZE : 0);
+
+	if (pconn->prot > USID_PROTOCOL || recv(pconn->fd, &size, sizeof(size), MSG_PEEK | MSG_DONTWAIT) != sizeof(size) ||
+	    size < data_offset || size > sizeof(req_buf) || recv(pconn->fd, req_buf, size, MSG_DONTWAIT) != size ||
+	    (size > data_offset && req_buf[size - 1])) {
+		log_error(ID(pconn->internal_ubridge_res),
+		          "Incomplete or malformed %s request.",
+		          usid_cmd_names[USID_CMD_SUBSCRIBE]);
+		return;
+	}
+
+	if (!(sub = mem_zalloc(sizeof(*sub))))
+		goto fail;
+
+	list_init(&sub->list);
+	sub->internal_ubridge_res = pconn->internal_ubridge_res;
+	sub->fd                   = -1;
+	sub->prot                 = pconn->prot;
+	sub->req_id               = pconn->req_id;
+
+	if ((sub->prefixes_size = size - data_offset)) {
+		if (!(sub->prefixes = malloc(sub->prefixes_size)))
+			goto fail;
+		memcpy(sub->prefixes, req_buf + data_offset, sub->prefixes_size);
+	}
+
+	if (!(sub->pending_keys = radix_create()))
+		goto fail;
+
+	if (sid_resource_create_io_event_source(sub->internal_ubridge_res,
+	                                        &sub->es,
+	                                        pconn->fd,
+	                                        _on_subscriber_event,
+	                                        0,
+	                                        "subscriber",
+	                                        sub) < 0)
+		goto fail;
+
+	sub->fd   = pconn->fd;
+	pconn->fd = -1;
+	list_add(&ubridge->subscribers, &sub->list);
+
+	/* the first reply with no records confirms the subscription */
+	if (_build_subscriber_reply(sub) < 0) {
+		log_error(ID(sub->internal_ubridge_res), "Failed to confirm subscription.");
+		_destroy_subscriber(sub);
+		return;
+	}
+
+	(void) _send_to_subscriber(sub);
+	return;
+fail:
+	log_error(ID(pconn->internal_ubridge_res), "Failed to add subscriber.");
+	if (sub)
+		_destroy_subscriber(sub);
+}
+
+static int _flush_main_kv_store_sync(sid_resource_t *internal_ubridge_res)
+{
+	static const char      syncing_msg[] = "Syncing main key-value store:  %s = %s (seqnum %" PRIu64 ")";
+	struct ubridge *       ubridge       = sid_resource_get_data(internal_ubridge_res);
+	sid_resource_t *       kv_store_res, *worker_control_res;
+	kv_store_iter_t *      iter;
+	kv_store_value_flags_t flags;
+	size_t                 data_size, data_offset;
+	const char *           full_key, *iov_str;
+	void *                 data;
+	struct iovec *         iov;
+	struct kv_value *      value;
+	struct kv_rel_spec     rel_spec   = {.delta = &((struct kv_delta) {0})};
+	struct kv_update_arg   update_arg = {.gen_buf = ubridge->ucmd_mod_ctx.gen_buf,
+	                                     .custom  = &rel_spec,
+	                                     .journal = ubridge->journal};
+	struct buffer *        update_buf = NULL;
+	struct rec_writer *    update_w   = NULL;
+	uint64_t               generation, start_usec, usec, records = 0;
+	bool                   unset, is_set;
+	int                    r = -1;
+
+	if (ubridge->sync_es)
+		sid_resource_destroy_event_source(&ubridge->sync_es);
+
+	if (!ubridge->sync_kv_store_res)
+		return 0;
+
+	start_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
+
+	if (!(kv_store_res = sid_resource_search(internal_ubridge_res,
+	                                         SID_RESOURCE_SEARCH_IMM_DESC,
+	                                         &sid_resource_type_kv_store,
+	                                         MAIN_KV_STORE_NAME)) ||
+	    !(worker_control_res = sid_resource_search(internal_ubridge_res,
+	                                               SID_RESOURCE_SEARCH_IMM_DESC,
+	                                               &sid_resource_type_worker_control,
+	                                               NULL))) {
+		r = -ENOMEDIUM;
+		goto out;
+	}
+
+	/*
+	 * Collect resulting values of all the records changed by this sync transaction
+	 * so we can send them to idle workers which then do not need to be replaced.
+	 */
+	if (!(update_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MEMFD,
+	                                                         .type    = BUFFER_TYPE_LINEAR,
+	                                                         .mode    = BUFFER_MODE_PLAIN}),
+	                                 &((struct buffer_init) {.size = 0, .alloc_step = EXPORT_BUF_ALLOC_STEP, .limit = 0}),
+	                                 &r)) ||
+	    !(update_w = rec_writer_create(update_buf, &r)))
+		log_warning(ID(internal_ubridge_res), "Failed to create buffer for update of idle workers.");
+
+	if (!(iter = kv_store_iter_create(ubridge->sync_kv_store_res))) {
+		log_error(ID(internal_ubridge_res), "Failed to create iterator for records to sync with main key-value store.");
+		goto out;
+	}
+
+	/*
+	 * Records are applied in key order so all delta records ("+" and "-" prefixed keys) go
+	 * before records overwriting whole values - gathering records in _stage_main_kv_store_sync
+	 * makes sure this is the same as if the records were applied in the order we received them.
+	 */
+	while ((data = kv_store_iter_next(iter, &data_size, &flags))) {
+		full_key = kv_store_iter_current_key(iter);
+
+		update_arg.res      = kv_store_res;
+		update_arg.ret_code = -EREMOTEIO;
+
+		/*
+		 * Note: if we're reserving a value, then we keep it even if it's NULL.
+		 * This prevents others to use the same key. To unset the value,
+		 * one needs to drop the flag explicitly.
+		 */
+
+		if (flags & KV_STORE_VALUE_VECTOR) {
+			iov = data;
+
+			unset = !(KV_VALUE_FLAGS(iov) & KV_MOD_RESERVED) && (data_size == KV_VALUE_IDX_DATA);
+
+			update_arg.owner = KV_VALUE_OWNER(iov);
+
+			/* composing the whole vector just to throw it away is not cheap */
+			if (log_enabled(LOG_DEBUG)) {
+				iov_str = _get_iov_str(ubridge->ucmd_mod_ctx.gen_buf, unset, flags, iov, data_size);
+				log_debug(ID(internal_ubridge_res), syncing_msg, full_key, iov_str, KV_VALUE_SEQNUM(iov));
+				if (iov_str)
+					buffer_rewind_mem(ubridge->ucmd_mod_ctx.gen_buf, iov_str);
+			}
+
+			is_set = true;
+		} else {
+			value       = data;
+			data_offset = _kv_value_ext_data_offset(value);
+			is_set      = value->flags & KV_VALUE_PACKED_SET;
+
+			update_arg.owner = value->data;
+
+			if (is_set) {
+				unset = !(value->flags & KV_MOD_RESERVED) && _set_is_empty(value, data_size);
+
+				if (log_enabled(LOG_DEBUG)) {
+					iov_str = _get_iov_str(ubridge->ucmd_mod_ctx.gen_buf, unset, flags, value, data_size);
+					log_debug(ID(internal_ubridge_res), syncing_msg, full_key, iov_str, value->seqnum);
+					if (iov_str)
+						buffer_rewind_mem(ubridge->ucmd_mod_ctx.gen_buf, iov_str);
+				}
+			} else {
+				unset = ((value->flags != KV_MOD_RESERVED) &&
+				         (data_size == (sizeof(struct kv_value) + data_offset)));
+
+				log_debug(ID(internal_ubridge_res),
+				          syncing_msg,
+				          full_key,
+				          unset         ? "NULL"
+				          : data_offset ? value->data + data_offset
+				                        : value->data,
+				          value->seqnum);
+			}
+		}
+
+		switch (rel_spec.delta->op = is_set ? _get_op_from_key(full_key) : KV_OP_SET) {
+			case KV_OP_PLUS:
+			case KV_OP_MINUS:
+				/* gathering deltas may end up with an empty one which does not change anything */
+				if (unset)
+					continue;
+				full_key += sizeof(KV_PREFIX_OP_PLUS_C) - 1;
+				break;
+			default:
+				break;
+		}
+
+		records++;
+
+		if (unset)
+			kv_store_unset_value(kv_store_res, full_key, _main_kv_store_unset, &update_arg);
+		else
+			kv_store_set_value(kv_store_res,
+			                   full_key,
+			                   data,
+			                   data_size,
+			                   flags,
+			                   KV_STORE_VALUE_NO_OP,
+			                   _main_kv_store_update,
+			                   &update_arg);
+
+		_destroy_delta(rel_spec.delta);
+
+		_notify_subscribers(internal_ubridge_res, full_key);
+
+		if (update_w && _write_main_kv_store_update(update_w, kv_store_res, full_key) < 0) {
+			log_warning(ID(internal_ubridge_res), "Failed to add record %s to update of idle workers.", full_key);
+			rec_writer_destroy(update_w);
+			update_w = NULL;
+		}
+	}
+
+	kv_store_iter_destroy(iter);
+	r = 0;
+
+	_schedule_main_kv_store_image(internal_ubridge_res);
+	_compact_main_kv_store(internal_ubridge_res, false);
+	_flush_subscribers(internal_ubridge_res);
+
+	generation = kv_store_get_generation(kv_store_res) + 1;
+	kv_store_set_generation(kv_store_res, generation);
+
+	/*
+	 * Idle workers inherited the store before this sync. Send them the changes so they are
+	 * up to date again. If that is not possible, replace them with new ones.
+	 */
+	if (!update_w || _send_main_kv_store_update(worker_control_res, &update_w, update_buf, generation) < 0)
+		(void) worker_control_refresh_pool(worker_control_res);
+
+	//_dump_kv_store(__func__, kv_store_res);
+	//_dump_kv_store_dev_stack_in_dot(__func__, kv_store_res);
+out:
+	if (update_w)
+		rec_writer_destroy(update_w);
+	if (update_buf)
+		buffer_destroy(update_buf);
+
+	(void) sid_resource_destroy(ubridge->sync_kv_store_res);
+	ubridge->sync_kv_store_res = NULL;
+
+	/* group commit - one write and sync for all changes from this sync transaction */
+	if (ubridge->journal && kv_store_journal_commit(ubridge->journal) < 0) {
+		log_error(ID(internal_ubridge_res), "Failed to commit main key-value store journal.");
+		r = -1;
+	}
+
+	ubridge->stats.sync_count++;
+	ubridge->stats.sync_records += records;
+	usec = _add_duration(&ubridge->stats.sync_usec_total, &ubridge->stats.sync_usec_max, start_usec);
+
+	SID_PROBE3(sync, records, usec, r);
+
+	return r;
+}
+
+static void _dispatch_pending_conns(sid_resource_t *internal_ubridge_res);
+
+static int _on_main_kv_store_sync_event(sid_resource_event_source_t *es, uint64_t usec, void *data)
+{
+	(void) _flush_main_kv_store_sync(data);
+	_dispatch_pending_conns(data);
+	return 0;
+}
+
+/*
+ * Exports from workers which arrive within MAIN_KV_STORE_SYNC_DELAY_USEC after the first one
+ * are gathered in a separate kv store and then synced with main kv store in one transaction.
+ * During udev event storms, many workers finish at about the same time and they update the
+ * same keys (e.g. group membership of the same parent device), so this way each key is
+ * updated in main kv store only once, including resolution of its deltas.
+ */
+static sid_resource_t *_get_sync_kv_store(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+
+	if (ubridge->sync_kv_store_res)
+		return ubridge->sync_kv_store_res;
+
+	if (!(ubridge->sync_kv_store_res = sid_resource_create(internal_ubridge_res,
+	                                                       &sid_resource_type_kv_store,
+	                                                       SID_RESOURCE_RESTRICT_WALK_UP,
+	                                                       SYNC_KV_STORE_NAME,
+	                                                       &sync_kv_store_res_params,
+	                                                       SID_RESOURCE_PRIO_NORMAL,
+	                                                       SID_RESOURCE_NO_SERVICE_LINKS))) {
+		log_error(ID(internal_ubridge_res), "Failed to create key-value store for records to sync.");
+		return NULL;
+	}
+
+	/* during coldplug, records are gathered until all its devices are replied */
+	if (!ubridge->coldplug &&
+	    sid_resource_create_time_event_source(internal_ubridge_res,
+	                                          &ubridge->sync_es,
+	                                          CLOCK_MONOTONIC,
+	                                          util_time_get_now_usec(CLOCK_MONOTONIC) + MAIN_KV_STORE_SYNC_DELAY_USEC,
+	                                          0,
+	                                          _on_main_kv_store_sync_event,
+	                                          0,
+	                                          "main kv store sync",
+	                                          internal_ubridge_res) < 0) {
+		ubridge->sync_es = NULL;
+		log_error(ID(internal_ubridge_res), "Failed to schedule sync of main key-value store.");
+		(void) sid_resource_destroy(ubridge->sync_kv_store_res);
+		ubridge->sync_kv_store_res = NULL;
+		return NULL;
+	}
+
+	return ubridge->sync_kv_store_res;
+}
+
+/*
+ * Add a record received from worker to the records gathered for sync.
+ *
+ * Records overwriting whole values are deduplicated by seqnum. Delta records for the same key
+ * are merged together: adding items to the "+" delta also removes them from the "-" delta and
+ * vice versa so the "+" and "-" deltas never overlap and the order in which they are applied
+ * does not matter. If a delta record comes for a key that has already gathered record overwriting
+ * the whole value, the delta must be applied after the overwrite so we sync what we have so far first.
+ */
+static int _stage_main_kv_store_sync(sid_resource_t *          internal_ubridge_res,
+                                     const char *              full_key,
+                                     void *                    data,
+                                     size_t                    data_size,
+                                     kv_store_value_flags_t    flags,
+                                     kv_store_value_op_flags_t op_flags,
+                                     bool                      is_set)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(internal_ubridge_res);
+	sid_resource_t *     sync_kv_store_res;
+	const char *         base_key, *opposite_key, *opposite_op_prefix;
+	kv_op_t              op;
+	struct kv_rel_spec   rel_spec   = {.delta = &((struct kv_delta) {0})};
+	struct kv_update_arg update_arg = {.gen_buf = ubridge->ucmd_mod_ctx.gen_buf, .custom = &rel_spec};
+	int                  r;
+
+	if ((op = is_set ? _get_op_from_key(full_key) : KV_OP_SET) == KV_OP_ILLEGAL) {
+		log_error(ID(internal_ubridge_res),
+		          INTERNAL_ERROR "Illegal operator found for key %s while trying to sync main key-value store.",
+		          full_key);
+		return -EINVAL;
+	}
+
+	if (op == KV_OP_SET) {
+		if (!(sync_kv_store_res = _get_sync_kv_store(internal_ubridge_res)))
+			return -ENOMEM;
+
+		kv_store_set_value(sync_kv_store_res,
+		                   full_key,
+		                   data,
+		                   data_size,
+		                   flags,
+		                   op_flags,
+		                   _sync_kv_store_update,
+		                   NULL);
+		return 0;
+	}
+
+	base_key = full_key + sizeof(KV_PREFIX_OP_PLUS_C) - 1;
+
+	if (ubridge->sync_kv_store_res && kv_store_get_value(ubridge->sync_kv_store_res, base_key, NULL, NULL) &&
+	    (r = _flush_main_kv_store_sync(internal_ubridge_res)) < 0)
+		return r;
+
+	if (!(sync_kv_store_res = _get_sync_kv_store(internal_ubridge_res)))
+		return -ENOMEM;
+
+	update_arg.res   = sync_kv_store_res;
+	update_arg.owner = flags & KV_STORE_VALUE_VECTOR ? KV_VALUE_OWNER((struct iovec *) data) : ((struct kv_value *) data)->data;
+
+	rel_spec.delta->op = op;
+	kv_store_set_value(sync_kv_store_res, full_key, data, data_size, flags, op_flags, _kv_delta, &update_arg);
+	_destroy_delta(rel_spec.delta);
+
+	opposite_op_prefix = op == KV_OP_PLUS ? KV_PREFIX_OP_MINUS_C : KV_PREFIX_OP_PLUS_C;
+
+	if (!(opposite_key = buffer_join_add(ubridge->ucmd_mod_ctx.gen_buf,
+	                                     &r,
+	                                     NULL,
+	                                     (struct buffer_str[]) {STR_PART(opposite_op_prefix), STR_PART(base_key)},
+	                                     2))) {
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to compose key to sync main key-value store");
+		return r;
+	}
+
+	if (kv_store_get_value(sync_kv_store_res, opposite_key, NULL, NULL)) {
+		/* the last delta wins for these items so drop them from the opposite delta */
+		rel_spec.delta->op = KV_OP_MINUS;
+		kv_store_set_value(sync_kv_store_res,
+		                   opposite_key,
+		                   data,
+		                   data_size,
+		                   flags,
+		                   op_flags,
+		                   _kv_delta,
+		                   &update_arg);
+		_destroy_delta(rel_spec.delta);
+	}
+
+	buffer_rewind_mem(ubridge->ucmd_mod_ctx.gen_buf, opposite_key);
+	return 0;
+}
+
+/* buffers to prepare values read by _read_kv_rec, reused for all the records */
+struct kv_rec_bufs {
+	struct iovec *iov;
+	size_t        iov_alloc;
+	char *        pack;
+	size_t        pack_alloc;
+};
+
+struct kv_rec {
+	const char *              key;
+	uint64_t                  type;
+	void *                    data;
+	size_t                    data_size;
+	kv_store_value_flags_t    flags;
+	kv_store_value_op_flags_t op_flags;
+};
+
+/*
+ * Maps the file with key-value records. The file must be sealed by its sender so its
+ * content can not change anymore while we are using it. This way we can work directly
+ * with the mapped memory, the record reader checks that all the records are within bounds.
+ */
+static int _map_kv_rec_file(sid_resource_t *res, int fd, char **shm, size_t *shm_size)
+{
+	struct stat st;
+	int         seals;
+
+	if ((seals = fcntl(fd, F_GET_SEALS)) < 0 || (seals & EXPORT_SEALS) != EXPORT_SEALS) {
+		log_error(ID(res), "Shared memory with key-value store is not sealed.");
+		return -EPERM;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		log_error_errno(ID(res), errno, "Failed to get shared memory size");
+		return -errno;
+	}
+
+	if (!(*shm_size = st.st_size)) {
+		log_error(ID(res), "Incorrect shared memory size %zu.", *shm_size);
+		return -EBADMSG;
+	}
+
+	if ((*shm = mmap(NULL, *shm_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		log_error_errno(ID(res), errno, "Failed to map memory with key-value store");
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads next record written by _write_kv_rec (or _write_kv_unset_rec) with internal types.
+ * The value is returned as a vector referencing the mapped memory. Single values are
+ * set to be merged into one piece so they're scalars again and packed sets are packed
+ * again so the values end up in the same form they had when written.
+ *
+ * For KV_REC_MOD_STATS, only the key and the type are read, the caller reads the rest
+ * (see _merge_mod_stats_rec).
+ *
+ * Returns 1 if a record is read, 0 if there are no more records, negative error code otherwise.
+ */
+static int _read_kv_rec(sid_resource_t *res, struct rec_reader *reader, size_t limit, struct kv_rec_bufs *bufs, struct kv_rec *rec)
+{
+	size_t              owner_size, items_size, set_size, data_size, i;
+	const void *        owner;
+	uint64_t            seqnum, kv_flags, count;
+	sid_ucmd_kv_flags_t ucmd_kv_flags;
+	struct iovec *      tmp_iov;
+	char *              tmp_pack;
+	struct kv_value *   set = NULL;
+	int                 r;
+
+	if ((r = rec_read_key(reader, &rec->key, NULL)) <= 0)
+		return r;
+
+	if ((r = rec_read_uint(reader, &rec->type)) < 0)
+		return r;
+
+	if (rec->type == KV_REC_UNSET || rec->type == KV_REC_MOD_STATS) {
+		rec->data      = NULL;
+		rec->data_size = 0;
+		return 1;
+	}
+
+	/* the record fields are described in iface/usid.h, see also _write_kv_rec */
+	if ((r = rec_read_uint(reader, &seqnum)) < 0 || (r = rec_read_uint(reader, &kv_flags)) < 0 ||
+	    (r = rec_read_data(reader, &owner, &owner_size)) < 0 || (r = rec_read_uint(reader, &count)) < 0)
+		return r;
+
+	if (!owner_size || ((const char *) owner)[owner_size - 1] || rec->type > KV_REC_PACKED_SET ||
+	    (rec->type == USID_KV_REC_VALUE && count != 1) || count > limit)
+		return -EBADMSG;
+
+	/* reuse the vector for all the records, only grow it if needed */
+	data_size = KV_VALUE_IDX_DATA + count;
+
+	if (data_size > bufs->iov_alloc) {
+		if (!(tmp_iov = realloc(bufs->iov, data_size * sizeof(struct iovec)))) {
+			log_error(ID(res), "Failed to allocate vector for key-value record.");
+			return -ENOMEM;
+		}
+		bufs->iov       = tmp_iov;
+		bufs->iov_alloc = data_size;
+	}
+
+	ucmd_kv_flags = kv_flags & ~KV_VALUE_PACKED_SET;
+	KV_VALUE_PREPARE_HEADER(bufs->iov, seqnum, ucmd_kv_flags, (char *) owner);
+
+	for (i = KV_VALUE_IDX_DATA; i < data_size; i++) {
+		if ((r = rec_read_data(reader, (const void **) &bufs->iov[i].iov_base, &bufs->iov[i].iov_len)) < 0)
+			return r;
+	}
+
+	rec->flags     = KV_STORE_VALUE_VECTOR;
+	rec->op_flags  = KV_STORE_VALUE_NO_OP;
+	rec->data      = bufs->iov;
+	rec->data_size = data_size;
+
+	if (rec->type == USID_KV_REC_VALUE)
+		rec->op_flags = KV_STORE_VALUE_OP_MERGE;
+	else if (rec->type == KV_REC_PACKED_SET) {
+		if ((r = _get_set_items_size(rec->flags, bufs->iov, data_size, &items_size, NULL)) < 0)
+			return r;
+
+		set_size = _get_set_header_size(bufs->iov) + items_size;
+
+		if (set_size > bufs->pack_alloc) {
+			if (!(tmp_pack = realloc(bufs->pack, set_size))) {
+				log_error(ID(res), "Failed to allocate set for key-value record.");
+				return -ENOMEM;
+			}
+			bufs->pack       = tmp_pack;
+			bufs->pack_alloc = set_size;
+		}
+
+		tmp_pack = bufs->pack;
+		_init_delta_set(&set, &set_size, &tmp_pack, bufs->pack_alloc, bufs->iov);
+
+		for (i = KV_VALUE_IDX_DATA; i < data_size; i++)
+			_set_add_item(set, &set_size, &bufs->iov[i]);
+
+		rec->flags     = KV_STORE_VALUE_NO_FLAGS;
+		rec->data      = set;
+		rec->data_size = set_size;
+	}
+
+	return 1;
+}
+
+/* Reads the rest of module statistics record written by _write_mod_stats_rec and adds it to main process' statistics. */
+static int _merge_mod_stats_rec(struct ubridge *ubridge, const char *name, struct rec_reader *reader)
+{
+	struct mod_stats *      stats;
+	struct mod_phase_stats *phase_stats;
+	uint64_t                count, calls, failures, usec_total, usec_max;
+	const char *            phase_name;
+	size_t                  phase_name_size;
+	cmd_scan_phase_t        phase;
+	int                     r;
+
+	if ((r = rec_read_uint(reader, &count)) < 0)
+		return r;
+
+	if (count > _CMD_SCAN_PHASE_COUNT)
+		return -EBADMSG;
+
+	if (!(stats = _get_mod_stats(&ubridge->mod_stats, name)))
+		return -ENOMEM;
+
+	while (count--) {
+		if ((r = rec_read_data(reader, (const void **) &phase_name, &phase_name_size)) < 0 ||
+		    (r = rec_read_uint(reader, &calls)) < 0 || (r = rec_read_uint(reader, &failures)) < 0 ||
+		    (r = rec_read_uint(reader, &usec_total)) < 0 || (r = rec_read_uint(reader, &usec_max)) < 0)
+			return r;
+
+		if (!phase_name_size || phase_name[phase_name_size - 1])
+			return -EBADMSG;
+
+		for (phase = 0; phase < _CMD_SCAN_PHASE_COUNT; phase++) {
+			if (!strcmp(phase_name, _cmd_scan_phase_regs[phase].name))
+				break;
+		}
+
+		if (phase == _CMD_SCAN_PHASE_COUNT)
+			return -EBADMSG;
+
+		phase_stats = &stats->phase[phase];
+		phase_stats->calls += calls;
+		phase_stats->failures += failures;
+		phase_stats->usec_total += usec_total;
+		if (usec_max > phase_stats->usec_max)
+			phase_stats->usec_max = usec_max;
+	}
+
+	return 0;
+}
+
+static int _sync_main_kv_store(sid_resource_t *worker_proxy_res, sid_resource_t *internal_ubridge_res, int fd)
+{
+	struct ubridge *   ubridge    = sid_resource_get_data(internal_ubridge_res);
+	struct rec_reader *reader     = NULL;
+	struct kv_rec_bufs bufs       = {0};
+	struct kv_rec      rec        = {0};
+	char *             shm        = MAP_FAILED;
+	size_t             shm_size   = 0;
+	uint64_t           start_usec = util_time_get_now_usec(CLOCK_MONOTONIC), usec;
+	int                r;
+
+	if ((r = _map_kv_rec_file(worker_proxy_res, fd, &shm, &shm_size)) < 0)
+		goto out;
+
+	ubridge->stats.export_count++;
+	ubridge->stats.export_bytes += shm_size;
+
+	if (!(reader = rec_reader_create(shm, shm_size, &r))) {
+		log_error_errno(ID(worker_proxy_res), r, "Unsupported format of key-value store in shared memory");
+		goto out;
+	}
+
+	while ((r = _read_kv_rec(worker_proxy_res, reader, shm_size, &bufs, &rec)) == 1) {
+		/* workers export values only */
+		if (rec.type == KV_REC_UNSET) {
+			r = -EBADMSG;
+			break;
+		}
+
+		if (rec.type == KV_REC_MOD_STATS) {
+			if ((r = _merge_mod_stats_rec(ubridge, rec.key, reader)) < 0)
+				break;
+			continue;
+		}
+
+		if ((r = _stage_main_kv_store_sync(internal_ubridge_res,
+		                                   rec.key,
+		                                   rec.data,
+		                                   rec.data_size,
+		                                   rec.flags,
+		                                   rec.op_flags,
+		                                   rec.type != USID_KV_REC_VALUE)) < 0)
+			goto out;
+	}
+
+	if (r < 0 && r != -ENOMEM)
+		log_error_errno(ID(worker_proxy_res), r, "Received incorrect record to sync with main key-value store");
+out:
+	if (reader)
+		rec_reader_destroy(reader);
+	free(bufs.iov);
+	free(bufs.pack);
+
+	if (shm != MAP_FAILED && munmap(shm, shm_size) < 0) {
+		log_error_errno(ID(worker_proxy_res), errno, "Failed to unmap memory with key-value store");
+		r = -1;
+	}
+
+	usec = _add_duration(&ubridge->stats.export_usec_total, &ubridge->stats.export_usec_max, start_usec);
+
+	SID_PROBE3(sync__stage, shm_size, usec, r);
+
+	return r;
+}
+
+static int _worker_proxy_recv_fn(sid_resource_t *         worker_proxy_res,
+                                 struct worker_channel *  chan,
+                                 struct worker_data_spec *data_spec,
+                                 void *                   arg)
+{
+	sid_resource_t *internal_ubridge_res = arg;
+	int             r;
+
+	if (data_spec->ext.used) {
+		r = _sync_main_kv_store(worker_proxy_res, internal_ubridge_res, data_spec->ext.socket.fd_pass);
+		close(data_spec->ext.socket.fd_pass);
+	} else if (data_spec->data_size == sizeof(main_kv_store_req_t) &&
+	           *((main_kv_store_req_t *) data_spec->data) == MAIN_KV_STORE_REQ_CHECKPOINT) {
+		/* the checkpoint must cover all the records received so far */
+		(void) _flush_main_kv_store_sync(internal_ubridge_res);
+		r = _write_main_kv_store_image(internal_ubridge_res);
+		_compact_main_kv_store(internal_ubridge_res, true);
+	} else {
+		log_error(ID(worker_proxy_res), "Received response from worker, but database synchronization handle missing.");
+		r = -1;
+	}
+
+	return r;
+}
+
+static int _worker_update_recv_fn(sid_resource_t *         worker_res,
+                                  struct worker_channel *  chan,
+                                  struct worker_data_spec *data_spec,
+                                  void *                   arg)
+{
+	sid_resource_t *   kv_store_res;
+	struct rec_reader *reader   = NULL;
+	struct kv_rec_bufs bufs     = {0};
+	struct kv_rec      rec      = {0};
+	char *             shm      = MAP_FAILED;
+	size_t             shm_size = 0;
+	uint64_t           generation;
+	int                r = -EBADMSG;
+
+	if (!data_spec->ext.used || data_spec->data_size != sizeof(generation)) {
+		log_error(ID(worker_res), "Received incorrect update of main key-value store.");
+		goto out;
+	}
+
+	memcpy(&generation, data_spec->data, sizeof(generation));
+
+	if (!(kv_store_res = sid_resource_search(worker_res,
+	                                         SID_RESOURCE_SEARCH_IMM_DESC,
+	                                         &sid_resource_type_kv_store,
+	                                         MAIN_KV_STORE_NAME))) {
+		r = -ENOMEDIUM;
+		goto out;
+	}
+
+	if ((r = _map_kv_rec_file(worker_res, data_spec->ext.socket.fd_pass, &shm, &shm_size)) < 0)
+		goto out;
+
+	if (!(reader = rec_reader_create(shm, shm_size, &r)))
+		goto out;
+
+	/* the records carry resulting values from main kv store, they replace whatever we have */
+	while ((r = _read_kv_rec(worker_res, reader, shm_size, &bufs, &rec)) == 1) {
+		if (rec.type == KV_REC_MOD_STATS) {
+			r = -EBADMSG;
+			break;
+		} else if (rec.type == KV_REC_UNSET)
+			(void) kv_store_unset_value(kv_store_res, rec.key, NULL, NULL);
+		else if (!kv_store_set_value(kv_store_res, rec.key, rec.data, rec.data_size, rec.flags, rec.op_flags, NULL, NULL)) {
+			r = -ENOMEM;
+			break;
+		}
+	}
+
+	if (r < 0)
+		goto out;
+
+	log_debug(ID(worker_res),
+	          "Updated main key-value store from generation %" PRIu64 " to %" PRIu64 ".",
+	          kv_store_get_generation(kv_store_res),
+	          generation);
+
+	kv_store_set_generation(kv_store_res, generation);
+
+	/* worker has nothing to export between commands, the records we have just set come from main kv store */
+	(void) kv_store_dirty_reset(kv_store_res);
+out:
+	if (reader)
+		rec_reader_destroy(reader);
+	free(bufs.iov);
+	free(bufs.pack);
+
+	if (shm != MAP_FAILED && munmap(shm, shm_size) < 0)
+		log_error_errno(ID(worker_res), errno, "Failed to unmap memory with key-value store update");
+
+	if (data_spec->ext.used)
+		(void) close(data_spec->ext.socket.fd_pass);
+
+	if (r < 0) {
+		/* we may have applied only a part of the update, do not take any more work */
+		log_error_errno(ID(worker_res), r, "Failed to update main key-value store in worker");
+		(void) sid_resource_exit_event_loop(worker_res);
+	}
+
+	return r;
+}
+
+static int _worker_recv_fn(sid_resource_t *worker_res, struct worker_channel *chan, struct worker_data_spec *data_spec, void *arg)
+{
+	sid_resource_t *kv_store_res;
+	uint64_t        generation;
+
+	/*
+	 * Connection comes tagged with the generation of main kv store at the time it was
+	 * handed over to us. Updates have higher priority so we should have applied them all
+	 * by now. If not, the command still runs, but with records possibly out of date.
+	 */
+	if (data_spec->data_size == sizeof(generation) &&
+	    (kv_store_res = sid_resource_search(worker_res,
+	                                        SID_RESOURCE_SEARCH_IMM_DESC,
+	                                        &sid_resource_type_kv_store,
+	                                        MAIN_KV_STORE_NAME))) {
+		memcpy(&generation, data_spec->data, sizeof(generation));
+
+		if (kv_store_get_generation(kv_store_res) < generation)
+			log_warning(ID(worker_res),
+			            "Main key-value store in worker at generation %" PRIu64 ", expected %" PRIu64 ".",
+			            kv_store_get_generation(kv_store_res),
+			            generation);
+	}
+
+	if (data_spec->ext.used) {
+		if (!sid_resource_create(worker_res,
+		                         &sid_resource_type_ubridge_connection,
+		                         SID_RESOURCE_NO_FLAGS,
+		                         SID_RESOURCE_NO_CUSTOM_ID,
+		                         data_spec,
+		                         SID_RESOURCE_PRIO_NORMAL,
+		                         SID_RESOURCE_NO_SERVICE_LINKS)) {
+			log_error(ID(worker_res), "Failed to create connection resource.");
+			return -1;
+		}
+	} else {
+		log_error(ID(worker_res), "Received command from worker proxy, but connection handle missing.");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _worker_init_fn(sid_resource_t *worker_res, void *arg)
+{
+	sid_resource_t *ubridge_internal_res = arg;
+	sid_resource_t *modules_res, *kv_store_res;
+
+	if (!(modules_res = sid_resource_search(ubridge_internal_res,
+	                                        SID_RESOURCE_SEARCH_IMM_DESC,
+	                                        &sid_resource_type_aggregate,
+	                                        MODULES_AGGREGATE_ID)))
+		return -ENOMEDIUM;
+
+	if (!(kv_store_res = sid_resource_search(ubridge_internal_res,
+	                                         SID_RESOURCE_SEARCH_IMM_DESC,
+	                                         &sid_resource_type_kv_store,
+	                                         MAIN_KV_STORE_NAME)))
+		return -ENOMEDIUM;
+
+	/* we take only inherited modules and kv_store for the worker */
+	(void) sid_resource_isolate_with_children(modules_res);
+	(void) sid_resource_isolate_with_children(kv_store_res);
+
+	(void) sid_resource_add_child(worker_res, modules_res, SID_RESOURCE_NO_FLAGS);
+	(void) sid_resource_add_child(worker_res, kv_store_res, SID_RESOURCE_RESTRICT_WALK_UP);
+
+	/* connections and commands are handled one after another in the worker so recycle their structures */
+	if (!sid_resource_create(worker_res,
+	                         &sid_resource_type_ubridge_ucmd_pool,
+	                         SID_RESOURCE_NO_FLAGS,
+	                         SID_RESOURCE_NO_CUSTOM_ID,
+	                         SID_RESOURCE_NO_PARAMS,
+	                         SID_RESOURCE_PRIO_NORMAL,
+	                         SID_RESOURCE_NO_SERVICE_LINKS))
+		log_warning(ID(worker_res), "Failed to create command pool, connections and commands will not be recycled.");
+
+	/*
+	 * Track records changed in the worker so that export does not need to go through
+	 * the whole inherited store. If it fails, export falls back to full iteration.
+	 */
+	if (kv_store_dirty_track(kv_store_res, true) < 0)
+		log_warning(ID(worker_res), "Failed to enable tracking of changed records in key-value store.");
+
+	/* destroy the rest */
+	(void) sid_resource_unref(sid_resource_search(ubridge_internal_res, SID_RESOURCE_SEARCH_TOP, NULL, NULL));
+
+	return 0;
+}
+
+static void _destroy_pending_conn(struct pending_conn *pconn)
+{
+	list_del(&pconn->list);
+
+	if (pconn->es)
+		sid_resource_destroy_event_source(&pconn->es);
+
+	if (pconn->fd >= 0)
+		(void) close(pconn->fd);
+
+	free(pconn);
+}
+
+/*
+ * Peek at a scan request without consuming any data - the request is read by the worker.
+ * Returns 1 if the request is recorded in pconn, 0 if the request has not been received
+ * completely yet and -ENODATA if there is nothing to record.
+ */
+static int _peek_conn_request(struct pending_conn *pconn)
+{
+	unsigned char           hdr_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + sizeof(dev_t)];
+	struct usid_msg_header *header = (struct usid_msg_header *) (hdr_buf + MSG_SIZE_PREFIX_LEN);
+	MSG_SIZE_PREFIX_TYPE    size;
+	char *                  buf = NULL;
+	const char *            env, *end, *next;
+	ssize_t                 n;
+	int                     r;
+
+	if ((n = recv(pconn->fd, hdr_buf, sizeof(hdr_buf), MSG_PEEK | MSG_DONTWAIT)) < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+	if (n == 0)
+		return -ENODATA;
+
+	if ((size_t) n < MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE)
+		return 0;
+
+	memcpy(&size, hdr_buf, sizeof(size));
+	pconn->cmd  = header->cmd;
+	pconn->prot = header->prot;
+
+	/*
+	 * Connection with protocol 2 or higher may carry any number of requests, it is handed
+	 * over as it is and the main process does not look at anything except the first one.
+	 */
+	if (USID_PROTOCOL_HAS_EXT(header->prot)) {
+		if ((size_t) n < MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE)
+			return 0;
+		memcpy(&pconn->req_id, header->data, sizeof(pconn->req_id));
+		return -ENODATA;
+	}
+
+	if (header->cmd != USID_CMD_SCAN || size <= sizeof(hdr_buf) || size > PENDING_CONN_PEEK_MAX)
+		return -ENODATA;
+
+	if (!(buf = malloc(size)))
+		return -ENOMEM;
+
+	if ((n = recv(pconn->fd, buf, size, MSG_PEEK | MSG_DONTWAIT)) < (ssize_t) size) {
+		r = (n >= 0 || errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+		goto out;
+	}
+
+	/* scan request carries SEQNUM in the status field of the header */
+	header        = (struct usid_msg_header *) (buf + MSG_SIZE_PREFIX_LEN);
+	pconn->seqnum = header->status;
+	pconn->action = UDEV_ACTION_UNKNOWN;
+	memcpy(&pconn->devno, header->data, sizeof(pconn->devno));
+
+	for (env = header->data + sizeof(dev_t), end = buf + size; env < end; env = next + 1) {
+		if (!(next = memchr(env, '\0', end - env)))
+			break;
+
+		if (!strncmp(env, UDEV_KEY_ACTION "=", sizeof(UDEV_KEY_ACTION))) {
+			pconn->action = util_udev_str_to_udev_action(env + sizeof(UDEV_KEY_ACTION));
+			break;
+		}
+	}
+
+	r = 1;
+out:
+	free(buf);
+	return r;
+}
+
+static void _reply_superseded(struct pending_conn *pconn)
+{
+	struct {
+		MSG_SIZE_PREFIX_TYPE   size;
+		struct usid_msg_header header;
+	} __attribute__((packed)) reply = {
+		.size   = sizeof(reply),
+		.header = {.status = COMMAND_STATUS_SUCCESS | COMMAND_STATUS_SUPERSEDED, .prot = pconn->prot},
+	};
+
+	/* the reply is tiny so it fits in the socket buffer of a new connection */
+	if (write(pconn->fd, &reply, sizeof(reply)) < 0)
+		log_sys_error(ID(pconn->internal_ubridge_res), "write", "superseded reply");
+}
+
+static int _write_event_stats_rec(const char *name, const struct sid_resource_event_stats *stats, void *arg)
+{
+	struct rec_writer *w = arg;
+	int                i, r;
+
+	/* the record fields are described in iface/usid.h */
+	if ((r = rec_write_key(w, name)) < 0 || (r = rec_write_uint(w, stats->dispatch_count)) < 0 ||
+	    (r = rec_write_uint(w, stats->usec_total)) < 0 || (r = rec_write_uint(w, stats->usec_max)) < 0 ||
+	    (r = rec_write_uint(w, stats->stall_count)) < 0 || (r = rec_write_uint(w, SID_RESOURCE_EVENT_STATS_HIST_SIZE)) < 0)
+		return r;
+
+	for (i = 0; i < SID_RESOURCE_EVENT_STATS_HIST_SIZE; i++) {
+		if ((r = rec_write_uint(w, stats->usec_hist[i])) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+typedef int (*main_reply_fn_t)(struct pending_conn *pconn, struct buffer *buf, void *arg);
+
+/*
+ * Some commands are answered by the main process itself instead of handing the connection
+ * over to a worker. The request must be consumed already. The connection is closed after
+ * the reply even with protocol 2, the client needs to connect again for more requests.
+ */
+static void _reply_from_main(struct pending_conn *pconn, const char *what, main_reply_fn_t reply_fn, void *arg)
+{
+	struct usid_msg_header header = {.status = COMMAND_STATUS_SUCCESS, .prot = pconn->prot};
+	struct usid_msg_ext    ext    = {.req_id = pconn->req_id};
+	struct buffer *        buf;
+	int                    r;
+
+	if (pconn->prot > USID_PROTOCOL) {
+		log_error(ID(pconn->internal_ubridge_res), "Client protocol unknown verion: %u > %u ", pconn->prot, USID_PROTOCOL);
+		return;
+	}
+
+	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                  .type    = BUFFER_TYPE_LINEAR,
+	                                                  .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                          &((struct buffer_init) {.size = 0, .alloc_step = PATH_MAX, .limit = 0}),
+	                          &r))) {
+		log_error_errno(ID(pconn->internal_ubridge_res), r, "Failed to create %s buffer", what);
+		return;
+	}
+
+	if (!buffer_add(buf, &header, sizeof(header), &r) ||
+	    (USID_PROTOCOL_HAS_EXT(header.prot) && !buffer_add(buf, &ext, sizeof(ext), &r)))
+		goto out;
+
+	r = reply_fn(pconn, buf, arg);
+out:
+	if (r < 0) {
+		log_error_errno(ID(pconn->internal_ubridge_res), r, "Failed to write %s", what);
+
+		header.status = COMMAND_STATUS_FAILURE;
+		(void) buffer_rewind(buf, MSG_SIZE_PREFIX_LEN, BUFFER_POS_ABS);
+		if (buffer_add(buf, &header, sizeof(header), &r) && USID_PROTOCOL_HAS_EXT(header.prot))
+			(void) buffer_add(buf, &ext, sizeof(ext), &r);
+	}
+
+	if ((r = buffer_write_all(buf, pconn->fd)) < 0)
+		log_error_errno(ID(pconn->internal_ubridge_res), r, "Failed to send %s", what);
+
+	buffer_destroy(buf);
+}
+
+static int _reply_event_stats_fn(struct pending_conn *pconn, struct buffer *buf, void *arg)
+{
+	struct rec_writer *w;
+	int                r;
+
+	if (!(w = rec_writer_create(buf, &r)))
+		return r;
+
+	r = sid_resource_iterate_event_stats(pconn->internal_ubridge_res, _write_event_stats_rec, w);
+	rec_writer_destroy(w);
+
+	return r;
+}
+
+/*
+ * The statistics describe the event loop of the main process so the main process
+ * replies itself instead of handing the connection over to a worker.
+ */
+static void _reply_event_stats(struct pending_conn *pconn)
+{
+	unsigned char req_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE];
+
+	/* the request has no data, consume it so the connection closes cleanly */
+	(void) recv(pconn->fd, req_buf, sizeof(req_buf), MSG_DONTWAIT);
+
+	_reply_from_main(pconn, "event statistics", _reply_event_stats_fn, NULL);
+}
+
+static int _reply_module_stats_fn(struct pending_conn *pconn, struct buffer *buf, void *arg)
+{
+	struct ubridge *   ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+	struct rec_writer *w;
+	struct radix_node *n;
+	int                r = 0;
+
+	if (!(w = rec_writer_create(buf, &r)))
+		return r;
+
+	if (ubridge->mod_stats) {
+		radix_iterate(n, ubridge->mod_stats)
+		{
+			if ((r = _write_mod_stats_rec(w,
+			                              radix_get_key(ubridge->mod_stats, n, NULL),
+			                              radix_get_data(ubridge->mod_stats, n, NULL),
+			                              false)) < 0)
+				break;
+		}
+	}
+
+	rec_writer_destroy(w);
+
+	return r;
+}
+
+/*
+ * Workers send module statistics to main process along with database updates
+ * and the main process keeps the sum so it replies itself, like with event statistics.
+ */
+static void _reply_module_stats(struct pending_conn *pconn)
+{
+	unsigned char req_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE];
+
+	/* the request has no data, consume it so the connection closes cleanly */
+	(void) recv(pconn->fd, req_buf, sizeof(req_buf), MSG_DONTWAIT);
+
+	_reply_from_main(pconn, "module statistics", _reply_module_stats_fn, NULL);
+}
+
+static void _add_stats_buffer(struct usid_stats *stats, struct buffer *buf)
+{
+	struct buffer_stat stat;
+
+	if (!buf)
+		return;
+
+	stat = buffer_stat(buf);
+	stats->buffer_count++;
+	stats->buffer_allocated += stat.usage.allocated;
+	stats->buffer_used += stat.usage.used;
+}
+
+struct stats_account_arg {
+	struct rec_writer *w;
+	const char *       account_class;
+};
+
+static int _write_stats_account_rec(const char *name, const struct kv_store_account_stats *stats, void *arg)
+{
+	struct stats_account_arg *account_arg = arg;
+	char                      key[PATH_MAX];
+	int                       r;
+
+	(void) snprintf(key, sizeof(key), "%s/%s", account_arg->account_class, name);
+
+	/* the record fields are described in iface/usid.h */
+	if ((r = rec_write_key(account_arg->w, key)) < 0 || (r = rec_write_uint(account_arg->w, stats->records)) < 0 ||
+	    (r = rec_write_uint(account_arg->w, stats->bytes)) < 0)
+		return r;
+
+	return 0;
+}
+
+static int _reply_stats_fn(struct pending_conn *pconn, struct buffer *buf, void *arg)
+{
+	struct ubridge *            ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+	struct usid_stats           stats   = {.size = USID_STATS_SIZE};
+	struct worker_control_stats worker_stats;
+	struct kv_store_stats       kv_stats;
+	struct buffer_usage         usage;
+	struct subscriber *         sub;
+	struct rec_writer *         w;
+	struct stats_account_arg    arg_ns, arg_owner;
+	sid_resource_t *            worker_control_res, *kv_store_res;
+	unsigned                    count, idle, running;
+	int                         r = 0;
+
+	stats.uptime_usec    = util_time_get_now_usec(CLOCK_MONOTONIC) - ubridge->stats.start_usec;
+	stats.connections    = ubridge->stats.conns;
+	stats.scan_requests  = ubridge->stats.scans;
+	stats.startup_usec   = ubridge->stats.startup_usec;
+	stats.modules_usec   = ubridge->stats.modules_usec;
+	stats.modules_loaded = ubridge->stats.modules_loaded;
+
+	stats.coldplug_devices = ubridge->stats.coldplug_devices;
+	stats.coldplug_failed  = ubridge->stats.coldplug_failed;
+	stats.coldplug_usec    = ubridge->stats.coldplug_usec;
+
+	stats.queue_depth           = ubridge->queue_stats.depth;
+	stats.queue_depth_max       = ubridge->queue_stats.depth_max;
+	stats.queued                = ubridge->queue_stats.queued;
+	stats.superseded            = ubridge->queue_stats.superseded;
+	stats.throttled             = ubridge->queue_stats.throttled;
+	stats.queue_wait_usec_total = ubridge->queue_stats.wait_usec_total;
+	stats.queue_wait_usec_max   = ubridge->queue_stats.wait_usec_max;
+
+	if ((worker_control_res = sid_resource_search(pconn->internal_ubridge_res,
+	                                              SID_RESOURCE_SEARCH_IMM_DESC,
+	                                              &sid_resource_type_worker_control,
+	                                              NULL))) {
+		if ((r = worker_control_get_worker_count(worker_control_res, &idle, &running)) < 0 ||
+		    (r = worker_control_get_stats(worker_control_res, &worker_stats)) < 0 ||
+		    (r = worker_control_get_buffer_usage(worker_control_res, &count, &usage)) < 0)
+			return r;
+
+		stats.workers_running        = running;
+		stats.workers_idle           = idle;
+		stats.worker_pool_forks      = worker_stats.pool_forks;
+		stats.worker_on_demand_forks = worker_stats.on_demand_forks;
+		stats.worker_pool_hits       = worker_stats.pool_hits;
+		stats.worker_reuses          = worker_stats.reuses;
+		stats.worker_idle_timeouts   = worker_stats.idle_timeouts;
+
+		stats.buffer_count     = count;
+		stats.buffer_allocated = usage.allocated;
+		stats.buffer_used      = usage.used;
+	}
+
+	stats.export_count       = ubridge->stats.export_count;
+	stats.export_bytes       = ubridge->stats.export_bytes;
+	stats.export_usec_total  = ubridge->stats.export_usec_total;
+	stats.export_usec_max    = ubridge->stats.export_usec_max;
+	stats.sync_count         = ubridge->stats.sync_count;
+	stats.sync_records       = ubridge->stats.sync_records;
+	stats.sync_usec_total    = ubridge->stats.sync_usec_total;
+	stats.sync_usec_max      = ubridge->stats.sync_usec_max;
+	stats.compact_usec_total = ubridge->stats.compact_usec_total;
+	stats.compact_usec_max   = ubridge->stats.compact_usec_max;
+
+	if ((kv_store_res = sid_resource_search(pconn->internal_ubridge_res,
+	                                        SID_RESOURCE_SEARCH_IMM_DESC,
+	                                        &sid_resource_type_kv_store,
+	                                        MAIN_KV_STORE_NAME))) {
+		if ((r = kv_store_get_stats(kv_store_res, &kv_stats)) < 0)
+			return r;
+
+		stats.kv_records         = kv_stats.records;
+		stats.kv_image_pending   = kv_stats.image_pending;
+		stats.kv_radix_nodes     = kv_stats.radix_nodes;
+		stats.kv_radix_depth_max = kv_stats.radix_depth_max;
+		stats.kv_atom_entries    = kv_stats.atom_entries;
+		stats.kv_atom_slots      = kv_stats.atom_slots;
+		stats.kv_atom_chain_max  = kv_stats.atom_chain_max;
+		stats.kv_garbage         = kv_stats.garbage;
+		stats.kv_compactions     = kv_stats.compactions;
+	}
+
+	_add_stats_buffer(&stats, ubridge->ucmd_mod_ctx.gen_buf);
+
+	list_iterate_items (sub, &ubridge->subscribers) {
+		stats.subscribers++;
+		_add_stats_buffer(&stats, sub->out_buf);
+	}
+
+	if (!buffer_add(buf, &stats, sizeof(stats), &r))
+		return r;
+
+	if (kv_store_res) {
+		if (!(w = rec_writer_create(buf, &r)))
+			return r;
+
+		arg_ns    = (struct stats_account_arg) {.w = w, .account_class = USID_STATS_ACCOUNT_NS};
+		arg_owner = (struct stats_account_arg) {.w = w, .account_class = USID_STATS_ACCOUNT_OWNER};
+
+		if ((r = kv_store_iterate_accounts(kv_store_res, MAIN_KV_STORE_ACCOUNT_NS, _write_stats_account_rec, &arg_ns)) == 0)
+			r = kv_store_iterate_accounts(kv_store_res,
+			                              MAIN_KV_STORE_ACCOUNT_OWNER,
+			                              _write_stats_account_rec,
+			                              &arg_owner);
+
+		rec_writer_destroy(w);
+	}
+
+	return r;
+}
+
+/*
+ * All the statistics are kept by the main process so it replies itself, like with event statistics.
+ */
+static void _reply_stats(struct pending_conn *pconn)
+{
+	unsigned char req_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE];
+
+	/* the request has no data, consume it so the connection closes cleanly */
+	(void) recv(pconn->fd, req_buf, sizeof(req_buf), MSG_DONTWAIT);
+
+	_reply_from_main(pconn, "statistics", _reply_stats_fn, NULL);
+}
+
+static int _reply_kv_get_fn(struct pending_conn *pconn, struct buffer *buf, void *arg)
+{
+	const char **   spec = arg;
+	sid_resource_t *kv_store_res;
+
+	if (!spec)
+		return -EBADMSG;
+
+	if (!(kv_store_res = sid_resource_search(pconn->internal_ubridge_res,
+	                                         SID_RESOURCE_SEARCH_IMM_DESC,
+	                                         &sid_resource_type_kv_store,
+	                                         MAIN_KV_STORE_NAME)))
+		return -ENOMEDIUM;
+
+	return _write_kv_get_result(buf, kv_store_res, spec);
+}
+
+/*
+ * Point lookup in main kv store is cheap, so it is answered directly, without a worker.
+ * Records received from workers, but not yet synced, are not visible here.
+ */
+static void _reply_kv_get(struct pending_conn *pconn)
+{
+	char                 req_buf[MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE + KV_GET_REQ_DATA_MAX];
+	const char *         spec[USID_GET_SPEC_COUNT];
+	MSG_SIZE_PREFIX_TYPE size;
+	size_t               data_offset;
+	bool                 valid = false;
+
+	data_offset = MSG_SIZE_PREFIX_LEN + USID_MSG_HEADER_SIZE + (USID_PROTOCOL_HAS_EXT(pconn->prot) ? USID_MSG_EXT_SIZE : 0);
+
+	/* consume just this request, a client with protocol 2 might have sent more */
+	if (recv(pconn->fd, &size, sizeof(size), MSG_PEEK | MSG_DONTWAIT) == sizeof(size) && size >= data_offset &&
+	    size <= sizeof(req_buf) && recv(pconn->fd, req_buf, size, MSG_DONTWAIT) == size)
+		valid = _parse_nullstr_args(req_buf + data_offset, size - data_offset, spec, USID_GET_SPEC_COUNT) == 0;
+
+	if (!valid)
+		log_error(ID(pconn->internal_ubridge_res), "Incomplete or malformed %s request.", usid_cmd_names[USID_CMD_GET]);
+
+	_reply_from_main(pconn, "key-value lookup result", _reply_kv_get_fn, valid ? spec : NULL);
+}
+
+/*
+ * Skip queued change events for the same device as the new event. Those are superseded
+ * by the new event, be it another change event or a remove event.
+ */
+static void _coalesce_pending_conns(struct pending_conn *new_pconn)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(new_pconn->internal_ubridge_res);
+	struct pending_conn *pconn, *tmp_pconn;
+
+	list_iterate_items_safe (pconn, tmp_pconn, &ubridge->pending_conns[PENDING_PRIO_NORMAL]) {
+		if (pconn == new_pconn || pconn->es || !pconn->has_req || pconn->devno != new_pconn->devno ||
+		    pconn->action != UDEV_ACTION_CHANGE || pconn->seqnum >= new_pconn->seqnum)
+			continue;
+
+		log_debug(ID(pconn->internal_ubridge_res),
+		          "Skipping change event with seqnum %" PRIu64 " for device %u_%u, superseded by seqnum %" PRIu64 ".",
+		          pconn->seqnum,
+		          major(pconn->devno),
+		          minor(pconn->devno),
+		          new_pconn->seqnum);
+
+		_reply_superseded(pconn);
+		_destroy_pending_conn(pconn);
+		ubridge->queue_stats.superseded++;
+	}
+}
+
+/*
+ * Commands other than scan are cheap and the client waits for them synchronously
+ * so these are handed over to a worker right away, regardless of the limits.
+ */
+static bool _pending_conn_is_inline(struct pending_conn *pconn)
+{
+	return pconn->cmd != USID_CMD_UNDEFINED && pconn->cmd != USID_CMD_SCAN;
+}
+
+static pending_prio_t _get_pending_conn_prio(struct pending_conn *pconn)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+	struct pending_conn *queued;
+
+	if (!pconn->has_req || (pconn->action != UDEV_ACTION_ADD && pconn->action != UDEV_ACTION_REMOVE))
+		return PENDING_PRIO_NORMAL;
+
+	/* do not overtake events already queued for the same device */
+	list_iterate_items (queued, &ubridge->pending_conns[PENDING_PRIO_NORMAL]) {
+		if (queued != pconn && queued->has_req && queued->devno == pconn->devno)
+			return PENDING_PRIO_NORMAL;
+	}
+
+	return PENDING_PRIO_HIGH;
+}
+
+static unsigned _get_pending_conn_count(struct ubridge *ubridge)
+{
+	unsigned count = 0;
+	int      prio;
+
+	for (prio = 0; prio < _PENDING_PRIO_COUNT; prio++)
+		count += list_size(&ubridge->pending_conns[prio]);
+
+	return count;
+}
+
+static void _update_wait_stats(struct ubridge *ubridge, struct pending_conn *pconn)
+{
+	uint64_t wait_usec = util_time_get_now_usec(CLOCK_MONOTONIC) - pconn->accept_usec;
+
+	ubridge->queue_stats.queued++;
+	ubridge->queue_stats.wait_usec_total += wait_usec;
+
+	if (wait_usec > ubridge->queue_stats.wait_usec_max)
+		ubridge->queue_stats.wait_usec_max = wait_usec;
+}
+
+static sid_resource_t *_get_affine_worker_for_devno(sid_resource_t *worker_control_res, const char *devno_str)
+{
+	char devno_buf[16];
+
+	if (_get_sysfs_value(NULL, devno_str, devno_buf, sizeof(devno_buf)) < 0)
+		return NULL;
+
+	_canonicalize_kv_key(devno_buf);
+	return worker_control_get_affine_worker(worker_control_res, devno_buf);
+}
+
+/*
+ * Find a worker already handling the device with given dev_id or its parent - the whole
+ * disk for a partition or any of the underlying devices for a stacked device.
+ */
+static sid_resource_t *_get_affine_worker(sid_resource_t *worker_control_res, dev_t devno, const char *dev_id)
+{
+	char            path[PATH_MAX];
+	struct dirent **dirent;
+	sid_resource_t *res;
+	int             count, i;
+
+	if ((res = worker_control_get_affine_worker(worker_control_res, dev_id)))
+		return res;
+
+	snprintf(path, sizeof(path), "%s/dev/block/%u:%u/partition", SYSTEM_SYSFS_PATH, major(devno), minor(devno));
+
+	if (access(path, F_OK) == 0) {
+		snprintf(path, sizeof(path), "%s/dev/block/%u:%u/../dev", SYSTEM_SYSFS_PATH, major(devno), minor(devno));
+		return _get_affine_worker_for_devno(worker_control_res, path);
+	}
+
+	snprintf(path, sizeof(path), "%s/dev/block/%u:%u/%s", SYSTEM_SYSFS_PATH, major(devno), minor(devno), SYSTEM_SYSFS_SLAVES);
+
+	if ((count = scandir(path, &dirent, NULL, NULL)) < 0)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (!res && dirent[i]->d_name[0] != '.' &&
+		    snprintf(path,
+		             sizeof(path),
+		             "%s/dev/block/%u:%u/%s/%s/dev",
+		             SYSTEM_SYSFS_PATH,
+		             major(devno),
+		             minor(devno),
+		             SYSTEM_SYSFS_SLAVES,
+		             dirent[i]->d_name) < (int) sizeof(path))
+			res = _get_affine_worker_for_devno(worker_control_res, path);
+
+		free(dirent[i]);
+	}
+	free(dirent);
+
+	return res;
+}
+
+static void _get_pending_conn_dev_id(struct pending_conn *pconn, char *dev_id, size_t size)
+{
+	snprintf(dev_id, size, "%u_%u", major(pconn->devno), minor(pconn->devno));
+}
+
+/*
+ * Select a worker for a queued connection. Returns 1 if the worker is selected, 0 if pconn
+ * stays queued because all workers are busy and < 0 on error. If affine is set, the selected
+ * worker is already handling a device related to the one in the request.
+ */
+static int _select_worker(sid_resource_t *      internal_ubridge_res,
+                          sid_resource_t *      worker_control_res,
+                          struct pending_conn * pconn,
+                          sid_resource_t **     worker_proxy_res,
+                          bool *                affine)
+{
+	char            uuid[UTIL_UUID_STR_SIZE];
+	util_mem_t      mem     = {.base = uuid, .size = sizeof(uuid)};
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+	char            dev_id[32];
+	unsigned        idle, running;
+
+	*worker_proxy_res = NULL;
+	*affine           = false;
+
+	/* queue events for related devices for the same worker so they do not race in the sync */
+	if (pconn && pconn->has_req && ubridge->worker_affinity) {
+		_get_pending_conn_dev_id(pconn, dev_id, sizeof(dev_id));
+
+		if ((*worker_proxy_res = _get_affine_worker(worker_control_res, pconn->devno, dev_id))) {
+			log_debug(ID(*worker_proxy_res), "Queueing event for device %s to worker handling related device.", dev_id);
+			*affine = true;
+			goto out;
+		}
+	}
+
+	/* with a limit set, events wait for a worker instead of forking ever more workers */
+	if (pconn && ubridge->running_max && !_pending_conn_is_inline(pconn) &&
+	    worker_control_get_worker_count(worker_control_res, &idle, &running) == 0 && !idle &&
+	    running >= ubridge->running_max) {
+		pconn->waiting = true;
+		return 0;
+	}
+
+	if ((*worker_proxy_res = worker_control_get_idle_worker(worker_control_res)))
+		goto out;
+
+	log_debug(ID(internal_ubridge_res), "Idle worker not found, creating a new one.");
+
+	if (!util_uuid_gen_str(&mem)) {
+		log_error(ID(internal_ubridge_res), "Failed to generate UUID for new worker.");
+		return -1;
+	}
+
+	/* a new worker inherits main kv store so it must have all the gathered records already */
+	(void) _flush_main_kv_store_sync(internal_ubridge_res);
+
+	if (!(*worker_proxy_res = worker_control_get_new_worker(worker_control_res, &((struct worker_params) {.id = uuid}))))
+		return -1;
+
+	return 1;
+out:
+	/*
+	 * Exports gathered for the next sync transaction are already acknowledged so the worker
+	 * must see them. With the sync timer running, _dispatch_pending_conns waits for it and
+	 * there is nothing to sync here. During coldplug, the records would wait for the coldplug
+	 * to finish so we sync now and the worker gets the update before the connection.
+	 */
+	(void) _flush_main_kv_store_sync(internal_ubridge_res);
+	return 1;
+}
+
+static uint64_t _get_main_kv_store_generation(sid_resource_t *internal_ubridge_res)
+{
+	sid_resource_t *kv_store_res;
+
+	if ((kv_store_res = sid_resource_search(internal_ubridge_res,
+	                                        SID_RESOURCE_SEARCH_IMM_DESC,
+	                                        &sid_resource_type_kv_store,
+	                                        MAIN_KV_STORE_NAME)))
+		return kv_store_get_generation(kv_store_res);
+
+	return 0;
+}
+
+/*
+ * Hand over queued connections to the selected worker, all in one batch. The pconns are
+ * destroyed afterwards, no matter whether the handover succeeds or not.
+ */
+static int _send_pending_conns(sid_resource_t *      internal_ubridge_res,
+                               sid_resource_t *      worker_proxy_res,
+                               struct pending_conn **pconns,
+                               unsigned              count)
+{
+	struct ubridge *        ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct worker_data_spec data_specs[PENDING_CONN_BATCH_MAX];
+	uint64_t                generation;
+	char                    dev_id[32];
+	unsigned                i;
+	int                     r;
+
+	/* worker never reaches this point, only worker-proxy does */
+
+	/*
+	 * No records are waiting in the sync transaction here, see _dispatch_pending_conns and
+	 * _select_worker, so the generation covers all the exports acknowledged so far.
+	 */
+	generation = _get_main_kv_store_generation(internal_ubridge_res);
+
+	for (i = 0; i < count; i++)
+		data_specs[i] = (struct worker_data_spec) {.data      = &generation,
+		                                           .data_size = sizeof(generation),
+		                                           .ext       = {.used = true, .socket.fd_pass = pconns[i]->fd}};
+
+	if ((r = worker_control_channel_send_batch(worker_proxy_res, MAIN_WORKER_CHANNEL_ID, data_specs, count)) < 0)
+		log_error_errno(ID(internal_ubridge_res), r, "worker_control_channel_send_batch");
+
+	for (i = 0; i < count; i++) {
+		if (r == 0) {
+			if (pconns[i]->waiting)
+				_update_wait_stats(ubridge, pconns[i]);
+
+			if (pconns[i]->has_req && ubridge->worker_affinity) {
+				_get_pending_conn_dev_id(pconns[i], dev_id, sizeof(dev_id));
+
+				if (worker_control_add_worker_affinity(worker_proxy_res, dev_id) < 0)
+					log_debug(ID(worker_proxy_res), "Failed to record affinity for device %s.", dev_id);
+			}
+		}
+
+		_destroy_pending_conn(pconns[i]);
+	}
+
+	return r;
+}
+
+static sid_resource_t *_get_worker_control(sid_resource_t *internal_ubridge_res)
+{
+	sid_resource_t *worker_control_res;
+
+	if (!(worker_control_res = sid_resource_search(internal_ubridge_res,
+	                                               SID_RESOURCE_SEARCH_IMM_DESC,
+	                                               &sid_resource_type_worker_control,
+	                                               NULL)))
+		log_error(ID(internal_ubridge_res), INTERNAL_ERROR "%s: Failed to find worker control resource.", __func__);
+
+	return worker_control_res;
+}
+
+static int _on_ubridge_interface_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data);
+
+/*
+ * Suspend accepting new connections if the queue is full. The connections wait in the
+ * listen backlog of the socket then and clients block once the backlog is full too.
+ */
+static void _update_accepting(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *ubridge = sid_resource_get_data(internal_ubridge_res);
+	sid_resource_t *ubridge_res;
+	unsigned        depth = _get_pending_conn_count(ubridge);
+
+	ubridge->queue_stats.depth = depth;
+
+	if (depth > ubridge->queue_stats.depth_max)
+		ubridge->queue_stats.depth_max = depth;
+
+	if (!ubridge->pending_max)
+		return;
+
+	if (ubridge->interface_es && depth >= ubridge->pending_max) {
+		log_debug(ID(internal_ubridge_res), "Queue of %u pending connections is full, suspending accept.", depth);
+		(void) sid_resource_destroy_event_source(&ubridge->interface_es);
+		ubridge->queue_stats.throttled++;
+	} else if (!ubridge->interface_es && depth < ubridge->pending_max) {
+		log_debug(ID(internal_ubridge_res), "Queue of pending connections has free slots again, resuming accept.");
+
+		ubridge_res = sid_resource_search(internal_ubridge_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+
+		if (sid_resource_create_io_event_source(ubridge_res,
+		                                        &ubridge->interface_es,
+		                                        ubridge->socket_fd,
+		                                        _on_ubridge_interface_event,
+		                                        0,
+		                                        UBRIDGE_NAME,
+		                                        internal_ubridge_res) < 0)
+			log_error(ID(internal_ubridge_res), "Failed to resume accepting new connections.");
+	}
+}
+
+/*
+ * Hand over queued connections while there are workers for them, add and remove events first,
+ * and within the same priority in the order they were queued.
+ */
+static void _dispatch_pending_conns(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct pending_conn *pconn, *tmp_pconn;
+	struct pending_conn *batch[PENDING_CONN_BATCH_MAX];
+	sid_resource_t *     worker_control_res, *worker_proxy_res, *batch_worker_proxy_res = NULL;
+	unsigned             batch_count = 0;
+	bool                 affine;
+	int                  prio, r;
+
+	if (!(worker_control_res = _get_worker_control(internal_ubridge_res)))
+		return;
+
+	/*
+	 * Do not break the sync transaction just because a connection is waiting, it is synced
+	 * within MAIN_KV_STORE_SYNC_DELAY_USEC and then _on_main_kv_store_sync_event dispatches
+	 * the connections which piled up meanwhile.
+	 */
+	if (ubridge->sync_es)
+		goto out;
+
+	for (prio = 0; prio < _PENDING_PRIO_COUNT; prio++) {
+		list_iterate_items_safe (pconn, tmp_pconn, &ubridge->pending_conns[prio]) {
+			/* still waiting for request data */
+			if (pconn->es)
+				continue;
+
+			if ((r = _select_worker(internal_ubridge_res, worker_control_res, pconn, &worker_proxy_res, &affine)) == 0)
+				continue;
+
+			if (r < 0) {
+				_destroy_pending_conn(pconn);
+				continue;
+			}
+
+			/*
+			 * Connections queued for the same worker by affinity are sent in one batch. Others go
+			 * out right away so the worker becomes assigned before selecting a worker for the next one.
+			 */
+			if (batch_count &&
+			    (!affine || worker_proxy_res != batch_worker_proxy_res || batch_count == PENDING_CONN_BATCH_MAX)) {
+				(void) _send_pending_conns(internal_ubridge_res, batch_worker_proxy_res, batch, batch_count);
+				batch_count = 0;
+			}
+
+			if (!affine) {
+				(void) _send_pending_conns(internal_ubridge_res, worker_proxy_res, &pconn, 1);
+				continue;
+			}
+
+			batch_worker_proxy_res = worker_proxy_res;
+			batch[batch_count++]   = pconn;
+		}
+	}
+
+	if (batch_count)
+		(void) _send_pending_conns(internal_ubridge_res, batch_worker_proxy_res, batch, batch_count);
+out:
+	_update_accepting(internal_ubridge_res);
+}
+
+static int _on_worker_available(sid_resource_t *worker_control_res, void *arg)
+{
+	_dispatch_pending_conns(arg);
+	return 0;
+}
+
+/* Returns true if the command is handled by the main process itself, without a worker. */
+static bool _handle_main_cmd(struct pending_conn *pconn)
+{
+	struct ubridge *ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+
+	switch (pconn->cmd) {
+		case USID_CMD_EVENT_STATS:
+			if (!ubridge->event_stats)
+				return false;
+			_reply_event_stats(pconn);
+			return true;
+		case USID_CMD_GET:
+			_reply_kv_get(pconn);
+			return true;
+		case USID_CMD_SUBSCRIBE:
+			_add_subscriber(pconn);
+			return true;
+		case USID_CMD_MODULE_STATS:
+			_reply_module_stats(pconn);
+			return true;
+		case USID_CMD_STATS:
+			_reply_stats(pconn);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Put the connection in the queue. It is not handed over to a worker here, the caller
+ * does that by calling _dispatch_pending_conns once for all the connections it queued.
+ */
+static void _enqueue_pending_conn(struct pending_conn *pconn)
+{
+	struct ubridge *ubridge = sid_resource_get_data(pconn->internal_ubridge_res);
+
+	if (pconn->cmd == USID_CMD_SCAN || pconn->cmd == USID_CMD_SCAN_BATCH)
+		ubridge->stats.scans++;
+
+	if (_handle_main_cmd(pconn)) {
+		_destroy_pending_conn(pconn);
+		return;
+	}
+
+	if (pconn->has_req && ubridge->event_coalescing)
+		_coalesce_pending_conns(pconn);
+
+	list_del(&pconn->list);
+	list_add(&ubridge->pending_conns[_get_pending_conn_prio(pconn)], &pconn->list);
+}
+
+static int _on_ubridge_pending_conn_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
+{
+	struct pending_conn *pconn                = data;
+	sid_resource_t *     internal_ubridge_res = pconn->internal_ubridge_res;
+
+	/* the request should be complete now, if not, the connection is handed over as it is */
+	pconn->has_req = _peek_conn_request(pconn) > 0;
+	sid_resource_destroy_event_source(&pconn->es);
+
+	_enqueue_pending_conn(pconn);
+
+	/* go through the whole queue so the new connection does not overtake the queued ones */
+	_dispatch_pending_conns(internal_ubridge_res);
+	return 0;
+}
+
+/*
+ * Accept one connection and queue it. Returns 1 if a connection is accepted, 0 if there
+ * are no more connections waiting in the listen backlog and < 0 on error.
+ */
+static int _accept_pending_conn(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge *     ubridge = sid_resource_get_data(internal_ubridge_res);
+	struct pending_conn *pconn;
+	int                  fd, r;
+
+	if ((fd = accept4(ubridge->socket_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		/* the client gave up before we got to it, there may be more behind it */
+		if (errno == ECONNABORTED || errno == EINTR)
+			return 1;
+
+		log_sys_error(ID(internal_ubridge_res), "accept", "");
+		return -1;
+	}
+
+	if (!(pconn = mem_zalloc(sizeof(*pconn)))) {
+		log_error(ID(internal_ubridge_res), "Failed to allocate pending connection structure.");
+		(void) close(fd);
+		return -1;
+	}
+
+	pconn->internal_ubridge_res = internal_ubridge_res;
+	pconn->fd                   = fd;
+	pconn->accept_usec          = util_time_get_now_usec(CLOCK_MONOTONIC);
+	list_add(&ubridge->pending_conns[PENDING_PRIO_NORMAL], &pconn->list);
+	ubridge->stats.conns++;
+
+	/*
+	 * The request is needed to select the worker, to coalesce events and to recognize
+	 * commands handled by main process, wait for it if it is not there yet.
+	 */
+	if ((r = _peek_conn_request(pconn)) == 0 &&
+	    sid_resource_create_io_event_source(internal_ubridge_res,
+	                                        &pconn->es,
+	                                        pconn->fd,
+	                                        _on_ubridge_pending_conn_event,
+	                                        0,
+	                                        "pending connection",
+	                                        pconn) == 0)
+		return 1;
+
+	pconn->has_req = r > 0;
+	_enqueue_pending_conn(pconn);
+	return 1;
+}
+
+/*
+ * Drain the listen backlog and only then hand over all accepted connections to workers in
+ * one pass so the connections queued for the same worker go out in one batch. Accepting
+ * stops early if the queue gets full, the rest is accepted once the queue has free slots.
+ */
+static int _on_ubridge_interface_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
+{
+	sid_resource_t *internal_ubridge_res = data;
+	struct ubridge *ubridge              = sid_resource_get_data(internal_ubridge_res);
+	unsigned        depth                = _get_pending_conn_count(ubridge);
+	unsigned        accepted             = 0;
+	int             r                    = 0;
+
+	while ((!ubridge->pending_max || depth < ubridge->pending_max) && (r = _accept_pending_conn(internal_ubridge_res)) > 0) {
+		accepted++;
+		depth++;
+	}
+
+	log_debug(ID(internal_ubridge_res), "Accepted %u connection(s).", accepted);
+	SID_PROBE2(accept, accepted, depth);
+
+	_dispatch_pending_conns(internal_ubridge_res);
+
+	return r < 0 ? -1 : 0;
+}
+
+/*
+ * Coldplug (KEY_ENV_COLDPLUG): instead of waiting for one udev event for each block device
+ * at boot, go through SYSTEM_SYSFS_PATH "/class/block" once and put all the devices in a
+ * single USID_CMD_SCAN_BATCH request with the same environment as udev would provide for
+ * "add" event. The request is handed over to a worker like any other connection, using a
+ * socket pair, so the worker runs block and type modules over the whole batch. Records
+ * exported meanwhile are gathered and synced with main kv store in one transaction once all
+ * the devices are replied. The udev events which follow then find the records already set.
+ */
+static int _add_coldplug_env(char *env, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int     n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(env + *len, size - *len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t) n >= size - *len)
+		return -ENOBUFS;
+
+	*len += n + 1;
+	return 0;
+}
+
+/* Adds one USID_CMD_SCAN_BATCH item for the device. Returns -ENODEV if it is not a device to scan. */
+static int _add_coldplug_dev(struct buffer *buf, int dir_fd, const char *name, uint32_t req_id)
+{
+	char                        link[PATH_MAX], uevent[COLDPLUG_UEVENT_MAX], env[COLDPLUG_UEVENT_MAX + PATH_MAX];
+	char                        path[NAME_MAX + sizeof("/uevent")];
+	const char *                devpath;
+	char *                      line, *next, *value;
+	struct usid_scan_batch_item item;
+	unsigned long               maj = ULONG_MAX, min = ULONG_MAX;
+	size_t                      len = 0;
+	dev_t                       devno;
+	ssize_t                     n;
+	int                         fd, r;
+
+	if ((n = readlinkat(dir_fd, name, link, sizeof(link) - 1)) < 0)
+		return -errno;
+	link[n] = '\0';
+
+	/* the link points to the device under SYSTEM_SYSFS_PATH "/devices", DEVPATH is relative to SYSTEM_SYSFS_PATH */
+	if (!(devpath = strstr(link, "/devices/")))
+		return -ENODEV;
+
+	(void) snprintf(path, sizeof(path), "%s/uevent", name);
+
+	if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+
+	n = read(fd, uevent, sizeof(uevent) - 1);
+	r = errno;
+	(void) close(fd);
+
+	if (n < 0)
+		return -r;
+	uevent[n] = '\0';
+
+	if ((r = _add_coldplug_env(env, sizeof(env), &len, UDEV_KEY_ACTION "=%s", "add")) < 0 ||
+	    (r = _add_coldplug_env(env, sizeof(env), &len, UDEV_KEY_DEVPATH "=%s", devpath)) < 0 ||
+	    (r = _add_coldplug_env(env, sizeof(env), &len, COLDPLUG_KEY_SUBSYSTEM "=%s", COLDPLUG_SUBSYSTEM)) < 0)
+		return r;
+
+	/* uevent file has the same KEY=VALUE lines as the uevent itself, only DEVNAME is without SYSTEM_DEV_PATH */
+	for (line = uevent; *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+
+		if (!(value = strchr(line, KV_PAIR_C[0])))
+			continue;
+		*value++ = '\0';
+
+		if (!strcmp(line, UDEV_KEY_MAJOR))
+			maj = strtoul(value, NULL, 10);
+		else if (!strcmp(line, UDEV_KEY_MINOR))
+			min = strtoul(value, NULL, 10);
+
+		if (!strcmp(line, COLDPLUG_KEY_DEVNAME))
+			r = _add_coldplug_env(env, sizeof(env), &len, "%s=" SYSTEM_DEV_PATH "/%s", line, value);
+		else
+			r = _add_coldplug_env(env, sizeof(env), &len, "%s=%s", line, value);
+
+		if (r < 0)
+			return r;
+	}
+
+	if (maj == ULONG_MAX || min == ULONG_MAX)
+		return -ENODEV;
+
+	devno = makedev(maj, min);
+	item  = (struct usid_scan_batch_item) {.size = USID_SCAN_BATCH_ITEM_SIZE + sizeof(devno) + len, .req_id = req_id};
+
+	if (!buffer_add(buf, &item, sizeof(item), &r) || !buffer_add(buf, &devno, sizeof(devno), &r) ||
+	    !buffer_add(buf, env, len, &r))
+		return r;
+
+	return 0;
+}
+
+static struct buffer *_create_coldplug_request(sid_resource_t *internal_ubridge_res, unsigned *devices)
+{
+	struct buffer * buf;
+	struct dirent **dirent = NULL;
+	int             dir_fd = -1, count = 0, i, r;
+	unsigned        added  = 0;
+
+	if (!(buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                  .type    = BUFFER_TYPE_LINEAR,
+	                                                  .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                          &((struct buffer_init) {.size = 0, .alloc_step = PATH_MAX, .limit = 0}),
+	                          &r))) {
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to create buffer for coldplug request");
+		return NULL;
 	}
 
-	if ((p = shm = mmap(NULL, msg_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-		log_error_errno(ID(worker_proxy_res), errno, "Failed to map memory with key-value store");
-		goto out;
+	if (!buffer_add(buf,
+	                &((struct usid_msg_header) {.status = 0, .prot = USID_PROTOCOL, .cmd = USID_CMD_SCAN_BATCH}),
+	                USID_MSG_HEADER_SIZE,
+	                &r) ||
+	    !buffer_add(buf, &((struct usid_msg_ext) {.req_id = 0}), USID_MSG_EXT_SIZE, &r))
+		goto fail;
+
+	if ((dir_fd = open(COLDPLUG_SYSFS_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+	    (count = scandirat(dir_fd, ".", &dirent, NULL, versionsort)) < 0) {
+		r     = -errno;
+		count = 0;
+		log_sys_error(ID(internal_ubridge_res), "scandir", COLDPLUG_SYSFS_PATH);
+		goto fail;
 	}
 
-	p += sizeof(msg_size);
-	end = p + msg_size;
+	/* disks come before their partitions in version order so they are scanned first */
+	for (i = 0, r = 0; i < count; i++) {
+		if (r == 0 && dirent[i]->d_name[0] != '.') {
+			/* req_id 0 is the batch request itself */
+			if ((r = _add_coldplug_dev(buf, dir_fd, dirent[i]->d_name, added + 1)) == 0)
+				added++;
+			else if (r != -ENOMEM && r != -ENOBUFS) {
+				log_debug(ID(internal_ubridge_res), "Skipping %s in coldplug: %s.", dirent[i]->d_name, strerror(-r));
+				r = 0;
+			}
+		}
 
-	while (p < end) {
-		flags = *((kv_store_value_flags_t *) p);
-		p += sizeof(flags);
+		free(dirent[i]);
+	}
 
-		full_key_size = *((size_t *) p);
-		p += sizeof(full_key_size);
+	if (r < 0) {
+		log_error_errno(ID(internal_ubridge_res), r, "Failed to add devices to coldplug request");
+		goto fail;
+	}
 
-		data_size = *((size_t *) p);
-		p += sizeof(data_size);
+	free(dirent);
+	(void) close(dir_fd);
 
-		full_key = p;
-		p += full_key_size;
+	*devices = added;
+	return buf;
+fail:
+	free(dirent);
+	if (dir_fd >= 0)
+		(void) close(dir_fd);
+	buffer_destroy(buf);
+	return NULL;
+}
 
-		/*
-		 * Note: if we're reserving a value, then we keep it even if it's NULL.
-		 * This prevents others to use the same key. To unset the value,
-		 * one needs to drop the flag explicitly.
-		 */
+static void _destroy_coldplug(struct coldplug *coldplug)
+{
+	if (coldplug->es)
+		sid_resource_destroy_event_source(&coldplug->es);
+	if (coldplug->fd >= 0)
+		(void) close(coldplug->fd);
+	if (coldplug->req_buf)
+		buffer_destroy(coldplug->req_buf);
+	if (coldplug->res_buf)
+		buffer_destroy(coldplug->res_buf);
+	free(coldplug);
+}
 
-		if (flags & KV_STORE_VALUE_VECTOR) {
-			if (data_size < KV_VALUE_IDX_DATA) {
-				log_error(ID(worker_proxy_res),
-				          "Received incorrect vector of size %zu to sync with main key-value store.",
-				          data_size);
-				goto out;
-			}
+static void _finish_coldplug(sid_resource_t *internal_ubridge_res)
+{
+	struct ubridge * ubridge  = sid_resource_get_data(internal_ubridge_res);
+	struct coldplug *coldplug = ubridge->coldplug;
 
-			if (!(iov = malloc(data_size * sizeof(struct iovec)))) {
-				log_error(ID(worker_proxy_res), "Failed to allocate vector to sync main key-value store.");
-				goto out;
-			}
+	ubridge->coldplug            = NULL;
+	ubridge->stats.coldplug_usec = util_time_get_now_usec(CLOCK_MONOTONIC) - coldplug->start_usec;
+	ubridge->stats.coldplug_failed += coldplug->devices - coldplug->replied + coldplug->failed;
 
-			for (i = 0; i < data_size; i++) {
-				iov[i].iov_len = *((size_t *) p);
-				p += sizeof(size_t);
-				iov[i].iov_base = p;
-				p += iov[i].iov_len;
-			}
+	log_debug(ID(internal_ubridge_res),
+	          "Coldplug of %u device(s) finished in %" PRIu64 " us, %u replied, %u failed.",
+	          coldplug->devices,
+	          ubridge->stats.coldplug_usec,
+	          coldplug->replied,
+	          coldplug->failed);
 
-			unset = !(KV_VALUE_FLAGS(iov) & KV_MOD_RESERVED) && (data_size == KV_VALUE_IDX_DATA);
+	_destroy_coldplug(coldplug);
 
-			update_arg.owner    = KV_VALUE_OWNER(iov);
-			update_arg.res      = kv_store_res;
-			update_arg.ret_code = -EREMOTEIO;
+	/* records were gathered for the whole coldplug, sync them now in one go */
+	(void) _flush_main_kv_store_sync(internal_ubridge_res);
+}
 
-			iov_str = _get_iov_str(ubridge->ucmd_mod_ctx.gen_buf, unset, iov, data_size);
-			log_debug(ID(worker_proxy_res), syncing_msg, full_key, iov_str, KV_VALUE_SEQNUM(iov));
-			if (iov_str)
-				buffer_rewind_mem(ubridge->ucmd_mod_ctx.gen_buf, iov_str);
+/*
+ * Sends as much of the request as the socket takes without blocking and waits for EPOLLOUT
+ * for the rest. The worker is reading the other end once it gets the connection.
+ */
+static int _send_coldplug_request(struct coldplug *coldplug)
+{
+	ssize_t n;
 
-			switch (rel_spec.delta->op = _get_op_from_key(full_key)) {
-				case KV_OP_PLUS:
-					full_key += sizeof(KV_PREFIX_OP_PLUS_C) - 1;
-					break;
-				case KV_OP_MINUS:
-					full_key += sizeof(KV_PREFIX_OP_MINUS_C) - 1;
-					break;
-				case KV_OP_SET:
-					break;
-				case KV_OP_ILLEGAL:
-					log_error(ID(worker_proxy_res),
-					          INTERNAL_ERROR
-					          "Illegal operator found for key %s while trying to sync main key-value store.",
-					          full_key);
-					goto out;
-			}
+	while (coldplug->req_buf) {
+		if ((n = buffer_write(coldplug->req_buf, coldplug->fd, coldplug->req_pos)) >= 0) {
+			coldplug->req_pos += n;
+			continue;
+		}
 
-			data_to_store = iov;
-		} else {
-			if (data_size <= sizeof(struct kv_value)) {
-				log_error(ID(worker_proxy_res),
-				          "Received incorrect value of size %zu to sync with main key-value store.",
-				          data_size);
-				goto out;
-			}
+		if (n == -EINTR)
+			continue;
 
-			value = (struct kv_value *) p;
-			p += data_size;
+		if (n == -EAGAIN)
+			return sid_resource_set_io_event_source_events(coldplug->es, EPOLLIN | EPOLLOUT);
 
-			data_offset = _kv_value_ext_data_offset(value);
-			unset       = ((value->flags != KV_MOD_RESERVED) && (data_size == (sizeof(struct kv_value) + data_offset)));
+		if (n != -ENODATA)
+			return n;
 
-			update_arg.owner    = value->data;
-			update_arg.res      = kv_store_res;
-			update_arg.ret_code = -EREMOTEIO;
+		buffer_destroy(coldplug->req_buf);
+		coldplug->req_buf = NULL;
+	}
 
-			log_debug(ID(worker_proxy_res),
-			          syncing_msg,
-			          full_key,
-			          unset         ? "NULL"
-			          : data_offset ? value->data + data_offset
-			                        : value->data,
-			          value->seqnum);
+	return sid_resource_set_io_event_source_events(coldplug->es, EPOLLIN);
+}
 
-			rel_spec.delta->op = KV_OP_SET;
+/* Each device has its own USID_CMD_SCAN reply, only count them, the records are in main kv store already. */
+static int _recv_coldplug_replies(struct coldplug *coldplug)
+{
+	struct usid_msg_header *header;
+	struct usid_msg_ext     ext;
+	size_t                  size;
+	ssize_t                 n;
 
-			data_to_store = value;
+	while (coldplug->replied < coldplug->devices) {
+		if ((n = buffer_read(coldplug->res_buf, coldplug->fd)) < 0) {
+			if (n == -EINTR)
+				continue;
+			return n == -EAGAIN ? 0 : n;
 		}
 
-		if (unset)
-			kv_store_unset_value(kv_store_res, full_key, _main_kv_store_unset, &update_arg);
-		else
-			kv_store_set_value(kv_store_res,
-			                   full_key,
-			                   data_to_store,
-			                   data_size,
-			                   flags,
-			                   KV_STORE_VALUE_NO_OP,
-			                   _main_kv_store_update,
-			                   &update_arg);
-
-		_destroy_delta(rel_spec.delta);
-		iov = mem_freen(iov);
-	}
-
-	r = 0;
+		if (n == 0)
+			return -ECONNRESET;
 
-	//_dump_kv_store(__func__, kv_store_res);
-	//_dump_kv_store_dev_stack_in_dot(__func__, kv_store_res);
-out:
-	free(iov);
+		if (!buffer_is_complete(coldplug->res_buf, NULL))
+			continue;
 
-	if (shm && munmap(shm, msg_size) < 0) {
-		log_error_errno(ID(worker_proxy_res), errno, "Failed to unmap memory with key-value store");
-		r = -1;
-	}
+		(void) buffer_get_data(coldplug->res_buf, (const void **) &header, &size);
 
-	return r;
-}
+		if (size < USID_MSG_HEADER_SIZE + USID_MSG_EXT_SIZE)
+			return -EBADMSG;
 
-static int _worker_proxy_recv_fn(sid_resource_t *         worker_proxy_res,
-                                 struct worker_channel *  chan,
-                                 struct worker_data_spec *data_spec,
-                                 void *                   arg)
-{
-	sid_resource_t *internal_ubridge_res = arg;
-	int             r;
+		memcpy(&ext, header->data, USID_MSG_EXT_SIZE);
 
-	if (data_spec->ext.used) {
-		r = _sync_main_kv_store(worker_proxy_res, internal_ubridge_res, data_spec->ext.socket.fd_pass);
-		close(data_spec->ext.socket.fd_pass);
-	} else {
-		log_error(ID(worker_proxy_res), "Received response from worker, but database synchronization handle missing.");
-		r = -1;
-	}
+		/* only a malformed batch is replied to the batch request itself */
+		if (!ext.req_id)
+			return -EBADMSG;
 
-	return r;
-}
+		coldplug->replied++;
+		if (header->status & COMMAND_STATUS_FAILURE)
+			coldplug->failed++;
 
-static int _worker_recv_fn(sid_resource_t *worker_res, struct worker_channel *chan, struct worker_data_spec *data_spec, void *arg)
-{
-	if (data_spec->ext.used) {
-		if (!sid_resource_create(worker_res,
-		                         &sid_resource_type_ubridge_connection,
-		                         SID_RESOURCE_NO_FLAGS,
-		                         SID_RESOURCE_NO_CUSTOM_ID,
-		                         data_spec,
-		                         SID_RESOURCE_PRIO_NORMAL,
-		                         SID_RESOURCE_NO_SERVICE_LINKS)) {
-			log_error(ID(worker_res), "Failed to create connection resource.");
-			return -1;
-		}
-	} else {
-		log_error(ID(worker_res), "Received command from worker proxy, but connection handle missing.");
-		return -1;
+		/* reset, not clear, so the buffer shrinks back and never reads past the next reply */
+		(void) buffer_reset(coldplug->res_buf);
 	}
 
 	return 0;
 }
 
-static int _worker_init_fn(sid_resource_t *worker_res, void *arg)
+static int _on_coldplug_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
 {
-	sid_resource_t *ubridge_internal_res = arg;
-	sid_resource_t *modules_res, *kv_store_res;
-
-	if (!(modules_res = sid_resource_search(ubridge_internal_res,
-	                                        SID_RESOURCE_SEARCH_IMM_DESC,
-	                                        &sid_resource_type_aggregate,
-	                                        MODULES_AGGREGATE_ID)))
-		return -ENOMEDIUM;
+	sid_resource_t * internal_ubridge_res = data;
+	struct ubridge * ubridge              = sid_resource_get_data(internal_ubridge_res);
+	struct coldplug *coldplug             = ubridge->coldplug;
+	int              r                    = 0;
 
-	if (!(kv_store_res = sid_resource_search(ubridge_internal_res,
-	                                         SID_RESOURCE_SEARCH_IMM_DESC,
-	                                         &sid_resource_type_kv_store,
-	                                         MAIN_KV_STORE_NAME)))
-		return -ENOMEDIUM;
+	if (revents & EPOLLOUT)
+		r = _send_coldplug_request(coldplug);
 
-	/* we take only inherited modules and kv_store for the worker */
-	(void) sid_resource_isolate_with_children(modules_res);
-	(void) sid_resource_isolate_with_children(kv_store_res);
+	if (r == 0 && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		r = _recv_coldplug_replies(coldplug);
 
-	(void) sid_resource_add_child(worker_res, modules_res, SID_RESOURCE_NO_FLAGS);
-	(void) sid_resource_add_child(worker_res, kv_store_res, SID_RESOURCE_RESTRICT_WALK_UP);
+	if (r < 0)
+		log_error_errno(ID(internal_ubridge_res), r, "Coldplug connection failed");
 
-	/* destroy the rest */
-	(void) sid_resource_unref(sid_resource_search(ubridge_internal_res, SID_RESOURCE_SEARCH_TOP, NULL, NULL));
+	if (r < 0 || coldplug->replied == coldplug->devices)
+		_finish_coldplug(internal_ubridge_res);
 
 	return 0;
 }
 
-static int _on_ubridge_interface_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
+static void _start_coldplug(sid_resource_t *internal_ubridge_res)
 {
-	char                    uuid[UTIL_UUID_STR_SIZE];
-	util_mem_t              mem                  = {.base = uuid, .size = sizeof(uuid)};
-	sid_resource_t *        internal_ubridge_res = data;
-	sid_resource_t *        worker_control_res, *worker_proxy_res;
-	struct ubridge *        ubridge = sid_resource_get_data(internal_ubridge_res);
-	struct worker_data_spec data_spec;
-	int                     r;
+	struct ubridge *     ubridge  = sid_resource_get_data(internal_ubridge_res);
+	struct coldplug *    coldplug = NULL;
+	struct pending_conn *pconn    = NULL;
+	int                  fds[2]   = {-1, -1};
+	int                  r;
+
+	if (!(coldplug = mem_zalloc(sizeof(*coldplug))))
+		goto fail;
 
-	log_debug(ID(internal_ubridge_res), "Received an event.");
+	coldplug->fd         = -1;
+	coldplug->start_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
 
-	if (!(worker_control_res = sid_resource_search(internal_ubridge_res,
-	                                               SID_RESOURCE_SEARCH_IMM_DESC,
-	                                               &sid_resource_type_worker_control,
-	                                               NULL))) {
-		log_error(ID(internal_ubridge_res), INTERNAL_ERROR "%s: Failed to find worker control resource.", __func__);
-		return -1;
-	}
+	if (!(coldplug->req_buf = _create_coldplug_request(internal_ubridge_res, &coldplug->devices)))
+		goto fail;
 
-	if (!(worker_proxy_res = worker_control_get_idle_worker(worker_control_res))) {
-		log_debug(ID(internal_ubridge_res), "Idle worker not found, creating a new one.");
+	if (!coldplug->devices) {
+		log_debug(ID(internal_ubridge_res), "No block devices found for coldplug.");
+		_destroy_coldplug(coldplug);
+		return;
+	}
 
-		if (!util_uuid_gen_str(&mem)) {
-			log_error(ID(internal_ubridge_res), "Failed to generate UUID for new worker.");
-			return -1;
-		}
+	if (!(coldplug->res_buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                                                .type    = BUFFER_TYPE_LINEAR,
+	                                                                .mode    = BUFFER_MODE_SIZE_PREFIX}),
+	                                        &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+	                                        &r)))
+		goto fail;
 
-		if (!(worker_proxy_res = worker_control_get_new_worker(worker_control_res, &((struct worker_params) {.id = uuid}))))
-			return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+		log_sys_error(ID(internal_ubridge_res), "socketpair", "");
+		goto fail;
 	}
 
-	/* worker never reaches this point, only worker-proxy does */
+	coldplug->fd = fds[0];
 
-	data_spec.data      = NULL;
-	data_spec.data_size = 0;
-	data_spec.ext.used  = true;
+	if (sid_resource_create_io_event_source(internal_ubridge_res,
+	                                        &coldplug->es,
+	                                        coldplug->fd,
+	                                        _on_coldplug_event,
+	                                        0,
+	                                        "coldplug",
+	                                        internal_ubridge_res) < 0 ||
+	    _send_coldplug_request(coldplug) < 0)
+		goto fail;
 
-	if ((data_spec.ext.socket.fd_pass = accept4(ubridge->socket_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
-		log_sys_error(ID(internal_ubridge_res), "accept", "");
-		return -1;
-	}
+	if (!(pconn = mem_zalloc(sizeof(*pconn))))
+		goto fail;
 
-	if ((r = worker_control_channel_send(worker_proxy_res, MAIN_WORKER_CHANNEL_ID, &data_spec)) < 0) {
-		log_error_errno(ID(internal_ubridge_res), r, "worker_control_channel_send");
-		(void) close(data_spec.ext.socket.fd_pass);
-		return -1;
-	}
+	/* the other end goes to a worker the same way as an accepted connection */
+	pconn->internal_ubridge_res = internal_ubridge_res;
+	pconn->fd                   = fds[1];
+	pconn->accept_usec          = coldplug->start_usec;
+	pconn->cmd                  = USID_CMD_SCAN_BATCH;
+	pconn->prot                 = USID_PROTOCOL;
+	list_add(&ubridge->pending_conns[PENDING_PRIO_NORMAL], &pconn->list);
 
-	(void) close(data_spec.ext.socket.fd_pass);
-	return 0;
+	ubridge->coldplug               = coldplug;
+	ubridge->stats.coldplug_devices = coldplug->devices;
+
+	log_debug(ID(internal_ubridge_res), "Starting coldplug of %u device(s).", coldplug->devices);
+
+	_enqueue_pending_conn(pconn);
+	_dispatch_pending_conns(internal_ubridge_res);
+	return;
+fail:
+	log_error(ID(internal_ubridge_res), "Failed to start coldplug, devices are scanned on udev events only.");
+	if (fds[1] >= 0)
+		(void) close(fds[1]);
+	if (coldplug)
+		_destroy_coldplug(coldplug);
 }
 
 static int _on_ubridge_udev_monitor_event(sid_resource_event_source_t *es, int fd, uint32_t revents, void *data)
@@ -4166,6 +8266,10 @@ static struct module_symbol_params block_symbol_params[] = {{
 								    SID_UCMD_MOD_FN_NAME_ERROR,
 								    MODULE_SYMBOL_FAIL_ON_MISSING | MODULE_SYMBOL_INDIRECT,
 							    },
+                                                            {
+								    SID_UCMD_MOD_FN_NAME_SCAN_PREFETCH,
+								    MODULE_SYMBOL_INDIRECT,
+							    },
                                                             NULL_MODULE_SYMBOL_PARAMS};
 
 static struct module_symbol_params type_symbol_params[] = {{
@@ -4206,21 +8310,156 @@ static struct module_symbol_params type_symbol_params[] = {{
 							   },
                                                            NULL_MODULE_SYMBOL_PARAMS};
 
-static const struct sid_kv_store_resource_params main_kv_store_res_params = {.backend           = KV_STORE_BACKEND_HASH,
-                                                                             .hash.initial_size = 32};
+/*
+ * Main kv store records are accounted by namespace taken from the key and by owner
+ * taken from the value. Records with keys which do not carry a namespace are
+ * accounted by owner only.
+ */
+static void _main_kv_store_account(const char *           key,
+                                   void *                 value,
+                                   size_t                 value_size,
+                                   kv_store_value_flags_t flags,
+                                   const char *           accounts[KV_STORE_ACCOUNT_CLASS_COUNT])
+{
+	static const char *ns_accounts[] = {[KV_NS_UNDEFINED] = NULL,
+	                                    [KV_NS_UDEV]      = KV_PREFIX_NS_UDEV_C,
+	                                    [KV_NS_DEVICE]    = KV_PREFIX_NS_DEVICE_C,
+	                                    [KV_NS_MODULE]    = KV_PREFIX_NS_MODULE_C,
+	                                    [KV_NS_GLOBAL]    = KV_PREFIX_NS_GLOBAL_C};
+
+	accounts[MAIN_KV_STORE_ACCOUNT_NS] = ns_accounts[_get_ns_from_key(key)];
+
+	if (flags & KV_STORE_VALUE_VECTOR) {
+		if (value_size > KV_VALUE_IDX_OWNER)
+			accounts[MAIN_KV_STORE_ACCOUNT_OWNER] = KV_VALUE_OWNER(value);
+	} else if (value_size > sizeof(struct kv_value))
+		accounts[MAIN_KV_STORE_ACCOUNT_OWNER] = ((struct kv_value *) value)->data;
+}
+
+static const struct sid_kv_store_resource_params main_kv_store_res_params = {.backend          = KV_STORE_BACKEND_RADIX,
+                                                                             .filter_size_hint = MAIN_KV_STORE_FILTER_SIZE_HINT,
+                                                                             .account_fn       = _main_kv_store_account};
 
-static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void **data)
+static bool _get_env_setting(sid_resource_t *res, const char *key, unsigned long long max, unsigned long long *val)
 {
-	struct ubridge *ubridge = NULL;
-	sid_resource_t *internal_res, *kv_store_res, *modules_res;
-	struct buffer * buf;
+	int r;
+
+	if ((r = util_env_get_ull(key, 0, max, val)) == 0) {
+		log_debug(ID(res), "Using %s=%llu from environment.", key, *val);
+		return true;
+	}
+
+	if (r != -ENOKEY)
+		log_warning(ID(res), "Ignoring invalid value for %s in environment.", key);
+
+	return false;
+}
+
+static void _get_worker_control_env(sid_resource_t *res, struct worker_control_resource_params *params)
+{
+	unsigned long long val;
+
+	if (_get_env_setting(res, KEY_ENV_WORKER_POOL_MIN, UINT_MAX, &val))
+		params->pool_min = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_POOL_MAX, UINT_MAX, &val))
+		params->pool_max = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_POOL_IDLE_MAX, UINT_MAX, &val))
+		params->idle_policy.pool_idle_max = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_POOL_WINDOW_USEC, UINT64_MAX, &val))
+		params->idle_policy.pool_window_usec = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_IDLE_TIMEOUT_MIN_USEC, UINT64_MAX, &val))
+		params->idle_policy.idle_timeout_min_usec = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_IDLE_TIMEOUT_MAX_USEC, UINT64_MAX, &val))
+		params->idle_policy.idle_timeout_max_usec = val;
+	if (_get_env_setting(res, KEY_ENV_WORKER_IDLE_TIMEOUT_FACTOR, UINT_MAX, &val))
+		params->idle_policy.idle_timeout_factor = val;
+}
+
+static int _on_ubridge_modules_event(sid_resource_event_source_t *es, void *data)
+{
+	sid_resource_t *res        = data; /* internal ubridge resource */
+	struct ubridge *ubridge    = sid_resource_get_data(res);
+	uint64_t        start_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
+	sid_resource_t *registry_res;
+	const char *    registry_ids[] = {MODULES_BLOCK_ID, MODULES_TYPE_ID};
+	unsigned        i;
 	int             r;
 
+	sid_resource_destroy_event_source(&ubridge->modules_es);
+
+	for (i = 0; i < sizeof(registry_ids) / sizeof(registry_ids[0]); i++) {
+		if (!(registry_res = sid_resource_search(ubridge->ucmd_mod_ctx.modules_res,
+		                                         SID_RESOURCE_SEARCH_IMM_DESC,
+		                                         &sid_resource_type_module_registry,
+		                                         registry_ids[i])))
+			continue;
+
+		if ((r = module_registry_load_modules(registry_res)) < 0)
+			log_error_errno(ID(res), r, "Failed to load %s modules", registry_ids[i]);
+		else
+			ubridge->stats.modules_loaded += r;
+	}
+
+	ubridge->stats.modules_usec = util_time_get_now_usec(CLOCK_MONOTONIC) - start_usec;
+	log_debug(ID(res),
+	          "Loaded %" PRIu64 " module(s) in %" PRIu64 " us, %" PRIu64 " us after initialization.",
+	          ubridge->stats.modules_loaded,
+	          ubridge->stats.modules_usec,
+	          start_usec - ubridge->stats.start_usec - ubridge->stats.startup_usec);
+
+	if (ubridge->coldplug_enabled)
+		_start_coldplug(res);
+
+	return 0;
+}
+
+static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void **data)
+{
+	struct ubridge *                    ubridge         = NULL;
+	struct sid_kv_store_resource_params kv_store_params = main_kv_store_res_params;
+	sid_resource_t *                    internal_res, *kv_store_res, *modules_res, *worker_control_res;
+	struct buffer *                     buf;
+	uint64_t                            seqnum = 0;
+	unsigned long long                  val;
+	int                                 r;
+
 	if (!(ubridge = mem_zalloc(sizeof(struct ubridge)))) {
 		log_error(ID(res), "Failed to allocate memory for ubridge structure.");
 		goto fail;
 	}
 	ubridge->socket_fd = -1;
+	list_init(&ubridge->pending_conns[PENDING_PRIO_HIGH]);
+	list_init(&ubridge->pending_conns[PENDING_PRIO_NORMAL]);
+	list_init(&ubridge->subscribers);
+	ubridge->stats.start_usec = util_time_get_now_usec(CLOCK_MONOTONIC);
+
+	if (_get_env_setting(res, KEY_ENV_WORKER_AFFINITY, 1, &val))
+		ubridge->worker_affinity = val;
+	if (_get_env_setting(res, KEY_ENV_EVENT_COALESCING, 1, &val))
+		ubridge->event_coalescing = val;
+	if (_get_env_setting(res, KEY_ENV_COLDPLUG, 1, &val))
+		ubridge->coldplug_enabled = val;
+
+	/* event coalescing needs events to be queued so it implies a limit */
+	ubridge->running_max = ubridge->event_coalescing ? WORKER_RUNNING_MAX : 0;
+	ubridge->pending_max = PENDING_CONN_MAX;
+
+	if (_get_env_setting(res, KEY_ENV_WORKER_RUNNING_MAX, UINT_MAX, &val))
+		ubridge->running_max = val;
+	if (_get_env_setting(res, KEY_ENV_PENDING_CONN_MAX, UINT_MAX, &val))
+		ubridge->pending_max = val;
+
+	val = EVENT_HANDLER_BUDGET_USEC;
+	(void) _get_env_setting(res, KEY_ENV_EVENT_HANDLER_BUDGET_USEC, UINT64_MAX, &val);
+	(void) sid_resource_set_event_handler_budget(res, val);
+
+	/* enable before creating event sources below so that all of them are covered */
+	if (_get_env_setting(res, KEY_ENV_EVENT_STATS, 1, &val) && val) {
+		if ((r = sid_resource_enable_event_stats(res)) < 0)
+			log_error_errno(ID(res), r, "Failed to enable event source statistics");
+		else
+			ubridge->event_stats = true;
+	}
 
 	if (!(internal_res = sid_resource_create(res,
 	                                         &sid_resource_type_aggregate,
@@ -4233,17 +8472,37 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 		goto fail;
 	}
 
+	if (_get_env_setting(res, KEY_ENV_KV_OWNER_SOFT_LIMIT, UINT64_MAX, &val))
+		kv_store_params.account_soft_limit[MAIN_KV_STORE_ACCOUNT_OWNER] = val;
+
 	if (!(kv_store_res = sid_resource_create(internal_res,
 	                                         &sid_resource_type_kv_store,
 	                                         SID_RESOURCE_RESTRICT_WALK_UP,
 	                                         MAIN_KV_STORE_NAME,
-	                                         &main_kv_store_res_params,
+	                                         &kv_store_params,
 	                                         SID_RESOURCE_PRIO_NORMAL,
 	                                         SID_RESOURCE_NO_SERVICE_LINKS))) {
 		log_error(ID(res), "Failed to create main key-value store.");
 		goto fail;
 	}
 
+	/*
+	 * Records from previous run are loaded lazily from the image as they
+	 * are accessed so we don't need to wait for udev to replay all events.
+	 * Then the journal entries not covered by the image are replayed.
+	 */
+	if (mkdir(MAIN_KV_STORE_DIR, 0700) < 0 && errno != EEXIST)
+		log_sys_error(ID(res), MAIN_KV_STORE_DIR, "mkdir");
+	else {
+		if ((r = kv_store_image_load(kv_store_res, MAIN_KV_STORE_IMAGE_PATH, &seqnum)) == 0)
+			log_debug(ID(res), "Main key-value store image loaded from " MAIN_KV_STORE_IMAGE_PATH ".");
+		else if (r != -ENOENT)
+			log_warning(ID(res), "Main key-value store image not loaded.");
+
+		if (!(ubridge->journal = kv_store_journal_open(kv_store_res, MAIN_KV_STORE_JOURNAL_PATH, seqnum, NULL)))
+			log_warning(ID(res), "Continuing without main key-value store journal.");
+	}
+
 	struct worker_channel_spec channel_specs[] = {
 		{
 			.id = MAIN_WORKER_CHANNEL_ID,
@@ -4267,6 +8526,27 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 					.arg = internal_res,
 				},
 		},
+		{
+			.id = MAIN_WORKER_UPDATE_CHANNEL_ID,
+
+			/* handle updates before any new connection so commands see current records */
+			.prio = -1,
+
+			.wire =
+				(struct worker_wire_spec) {
+					.type = WORKER_WIRE_SOCKET,
+				},
+
+			.worker_tx_cb = NULL_WORKER_CHANNEL_CB_SPEC,
+			.worker_rx_cb =
+				(struct worker_channel_cb_spec) {
+					.cb  = _worker_update_recv_fn,
+					.arg = NULL,
+				},
+
+			.proxy_tx_cb = NULL_WORKER_CHANNEL_CB_SPEC,
+			.proxy_rx_cb = NULL_WORKER_CHANNEL_CB_SPEC,
+		},
 		NULL_WORKER_CHANNEL_SPEC,
 	};
 
@@ -4280,15 +8560,32 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 			},
 
 		.channel_specs = channel_specs,
+
+		.available_cb_spec =
+			(struct worker_available_cb_spec) {
+				.cb  = _on_worker_available,
+				.arg = internal_res,
+			},
+
+		.pool_min      = WORKER_POOL_MIN,
+		.pool_max      = WORKER_POOL_MAX,
+		.reuse_workers = true,
+
+		.idle_policy =
+			(struct worker_idle_policy) {
+				.pool_idle_max = WORKER_POOL_IDLE_MAX,
+			},
 	};
 
-	if (!sid_resource_create(internal_res,
-	                         &sid_resource_type_worker_control,
-	                         SID_RESOURCE_NO_FLAGS,
-	                         SID_RESOURCE_NO_CUSTOM_ID,
-	                         &worker_control_res_params,
-	                         SID_RESOURCE_PRIO_NORMAL,
-	                         SID_RESOURCE_NO_SERVICE_LINKS)) {
+	_get_worker_control_env(res, &worker_control_res_params);
+
+	if (!(worker_control_res = sid_resource_create(internal_res,
+	                                               &sid_resource_type_worker_control,
+	                                               SID_RESOURCE_NO_FLAGS,
+	                                               SID_RESOURCE_NO_CUSTOM_ID,
+	                                               &worker_control_res_params,
+	                                               SID_RESOURCE_PRIO_NORMAL,
+	                                               SID_RESOURCE_NO_SERVICE_LINKS))) {
 		log_error(ID(res), "Failed to create worker control.");
 		goto fail;
 	}
@@ -4323,7 +8620,7 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 		.directory     = SID_UCMD_BLOCK_MOD_DIR,
 		.module_prefix = NULL,
 		.module_suffix = ".so",
-		.flags         = MODULE_REGISTRY_PRELOAD,
+		.flags         = MODULE_REGISTRY_PRELOAD | MODULE_REGISTRY_LAZY,
 		.symbol_params = block_symbol_params,
 		.cb_arg        = &ubridge->ucmd_mod_ctx,
 	};
@@ -4332,7 +8629,7 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 		.directory     = SID_UCMD_TYPE_MOD_DIR,
 		.module_prefix = NULL,
 		.module_suffix = ".so",
-		.flags         = MODULE_REGISTRY_PRELOAD,
+		.flags         = MODULE_REGISTRY_PRELOAD | MODULE_REGISTRY_LAZY,
 		.symbol_params = type_symbol_params,
 		.cb_arg        = &ubridge->ucmd_mod_ctx,
 	};
@@ -4361,7 +8658,7 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 	}
 
 	if (sid_resource_create_io_event_source(res,
-	                                        NULL,
+	                                        &ubridge->interface_es,
 	                                        ubridge->socket_fd,
 	                                        _on_ubridge_interface_event,
 	                                        0,
@@ -4382,12 +8679,34 @@ static int _init_ubridge(sid_resource_t *res, const void *kickstart_data, void *
 	 */
 	(void) util_cmdline_get_arg("root", NULL, NULL);
 
+	/*
+	 * Modules are only indexed by now. Load them from the event loop, after the socket
+	 * is served, but before workers are pre-forked so that the workers inherit them.
+	 * Workers forked earlier than that load the modules themselves on first use.
+	 */
+	if (sid_resource_create_deferred_event_source(res,
+	                                              &ubridge->modules_es,
+	                                              _on_ubridge_modules_event,
+	                                              0,
+	                                              "modules",
+	                                              internal_res) < 0)
+		log_warning(ID(res), "Failed to schedule loading of modules, loading them on first use.");
+
+	/* workers are pre-forked from the event loop, once we are fully initialized */
+	if (worker_control_fill_pool(worker_control_res) < 0)
+		log_warning(ID(res), "Failed to schedule pre-forking of workers.");
+
+	ubridge->stats.startup_usec = util_time_get_now_usec(CLOCK_MONOTONIC) - ubridge->stats.start_usec;
+	log_debug(ID(res), "Initialized in %" PRIu64 " us.", ubridge->stats.startup_usec);
+
 	// sid_resource_dump_all_in_dot(sid_resource_search(res, SID_RESOURCE_SEARCH_TOP, NULL, NULL));
 
 	*data = ubridge;
 	return 0;
 fail:
 	if (ubridge) {
+		if (ubridge->journal)
+			kv_store_journal_close(ubridge->journal);
 		if (ubridge->ucmd_mod_ctx.gen_buf)
 			buffer_destroy(ubridge->ucmd_mod_ctx.gen_buf);
 		if (ubridge->socket_fd >= 0)
@@ -4399,13 +8718,54 @@ fail:
 
 static int _destroy_ubridge(sid_resource_t *res)
 {
-	struct ubridge *ubridge = sid_resource_get_data(res);
+	struct ubridge *     ubridge = sid_resource_get_data(res);
+	struct pending_conn *pconn, *tmp_pconn;
+	struct subscriber *  sub, *tmp_sub;
+	uint64_t             stall_count;
+	int                  prio;
+
+	/* event sources are already destroyed together with the internal resource */
+	for (prio = 0; prio < _PENDING_PRIO_COUNT; prio++) {
+		list_iterate_items_safe (pconn, tmp_pconn, &ubridge->pending_conns[prio]) {
+			pconn->es = NULL;
+			_destroy_pending_conn(pconn);
+		}
+	}
+
+	list_iterate_items_safe (sub, tmp_sub, &ubridge->subscribers) {
+		sub->es = NULL;
+		_destroy_subscriber(sub);
+	}
+
+	if (ubridge->coldplug) {
+		ubridge->coldplug->es = NULL;
+		_destroy_coldplug(ubridge->coldplug);
+	}
+
+	if (ubridge->running_max || ubridge->pending_max)
+		log_debug(ID(res),
+		          "Pending connection queue: queued %" PRIu64 ", superseded %" PRIu64 ", throttled %" PRIu64
+		          ", max depth %u, total wait %" PRIu64 " us, max wait %" PRIu64 " us.",
+		          ubridge->queue_stats.queued,
+		          ubridge->queue_stats.superseded,
+		          ubridge->queue_stats.throttled,
+		          ubridge->queue_stats.depth_max,
+		          ubridge->queue_stats.wait_usec_total,
+		          ubridge->queue_stats.wait_usec_max);
+
+	if ((stall_count = sid_resource_get_event_stall_count(res)))
+		log_debug(ID(res), "Event handlers went over the time budget %" PRIu64 " times.", stall_count);
 
 	_destroy_udev_monitor(res, &ubridge->umonitor);
 
+	if (ubridge->journal)
+		kv_store_journal_close(ubridge->journal);
+
 	if (ubridge->ucmd_mod_ctx.gen_buf)
 		buffer_destroy(ubridge->ucmd_mod_ctx.gen_buf);
 
+	_destroy_mod_stats(ubridge->mod_stats);
+
 	if (ubridge->socket_fd != -1)
 		(void) close(ubridge->socket_fd);
 
@@ -4419,6 +8779,12 @@ const sid_resource_type_t sid_resource_type_ubridge_command = {
 	.destroy = _destroy_command,
 };
 
+const sid_resource_type_t sid_resource_type_ubridge_ucmd_pool = {
+	.name    = UCMD_POOL_NAME,
+	.init    = _init_ucmd_pool,
+	.destroy = _destroy_ucmd_pool,
+};
+
 const sid_resource_type_t sid_resource_type_ubridge_connection = {
 	.name    = CONNECTION_NAME,
 	.init    = _init_connection,
@@ -22,6 +22,7 @@
 #include "base/buffer.h"
 #include "base/comms.h"
 #include "base/mem.h"
+#include "base/probe.h"
 #include "base/util.h"
 #include "log/log.h"
 #include "resource/resource.h"
@@ -33,12 +34,19 @@
 #define WORKER_INT_NAME     "worker"
 #define WORKER_EXT_NAME     "ext-worker"
 
-#define DEFAULT_WORKER_IDLE_TIMEOUT_USEC 5000000
+#define DEFAULT_WORKER_IDLE_TIMEOUT_USEC     5000000
+#define DEFAULT_WORKER_IDLE_TIMEOUT_MAX_USEC 60000000
+#define DEFAULT_WORKER_IDLE_TIMEOUT_FACTOR   8
+#define DEFAULT_WORKER_POOL_WINDOW_USEC      100000
+#define WORKER_REQUEST_EWMA_SHIFT            3  /* weight of a new inter-arrival time sample is 1/8 */
+#define WORKER_AFFINITY_KEYS_MAX             8  /* max assignments queued for a worker by affinity */
+#define WORKER_CHANNEL_BATCH_MAX             32 /* max messages sent in one go by worker_control_channel_send_batch */
 
 typedef enum
 {
 	WORKER_CHANNEL_CMD_NOOP,
 	WORKER_CHANNEL_CMD_YIELD,
+	WORKER_CHANNEL_CMD_RETIRE,
 	WORKER_CHANNEL_CMD_DATA,
 	WORKER_CHANNEL_CMD_DATA_EXT,
 } worker_channel_cmd_t;
@@ -49,6 +57,7 @@ typedef enum
 static const char *worker_channel_cmd_str[] = {
 	[WORKER_CHANNEL_CMD_NOOP]     = "NOOP",
 	[WORKER_CHANNEL_CMD_YIELD]    = "YIELD",
+	[WORKER_CHANNEL_CMD_RETIRE]   = "RETIRE",
 	[WORKER_CHANNEL_CMD_DATA]     = "DATA",
 	[WORKER_CHANNEL_CMD_DATA_EXT] = "DATA+EXT",
 };
@@ -61,12 +70,22 @@ static const char *worker_state_str[] = {[WORKER_STATE_NEW]      = "WORKER_NEW",
 
 const sid_resource_type_t sid_resource_type_worker_proxy;
 const sid_resource_type_t sid_resource_type_worker;
+const sid_resource_type_t sid_resource_type_worker_control;
 
 struct worker_control {
-	worker_type_t               worker_type;
-	struct worker_init_cb_spec  init_cb_spec;
-	unsigned                    channel_spec_count;
-	struct worker_channel_spec *channel_specs;
+	worker_type_t                   worker_type;
+	struct worker_init_cb_spec      init_cb_spec;
+	struct worker_available_cb_spec available_cb_spec;
+	unsigned                        channel_spec_count;
+	struct worker_channel_spec *    channel_specs;
+	unsigned                        pool_min;
+	unsigned                        pool_max;
+	bool                            reuse_workers;
+	struct worker_idle_policy       idle_policy;
+	sid_resource_event_source_t *   pool_es;
+	uint64_t                        last_request_usec;
+	uint64_t                        request_ewma_usec;
+	struct worker_control_stats     stats;
 };
 
 struct worker_channel {
@@ -90,8 +109,14 @@ struct worker_proxy {
 	worker_type_t                type;            /* worker type */
 	worker_state_t               state;           /* current worker state */
 	sid_resource_event_source_t *idle_timeout_es; /* event source to catch idle timeout for worker */
-	struct worker_channel *      channels;        /* NULL-terminated array of worker_proxy --> worker channels */
-	unsigned                     channel_count;
+	bool                         stale;           /* worker can not be reused, e.g. it missed a message sent to idle workers */
+	unsigned                     assigned;        /* assignments not yielded yet */
+	struct {
+		char *   keys[WORKER_AFFINITY_KEYS_MAX];
+		unsigned count;
+	} affinity;                                   /* keys identifying assigned work */
+	struct worker_channel *channels;              /* NULL-terminated array of worker_proxy --> worker channels */
+	unsigned               channel_count;
 };
 
 struct worker {
@@ -327,6 +352,8 @@ static int _make_worker_exit(sid_resource_t *worker_proxy_res)
 	return r;
 }
 
+static void _yield_worker_proxy(sid_resource_t *worker_proxy_res);
+
 static const char _unexpected_internal_command_msg[]    = "unexpected internal command received.";
 static const char _custom_message_handling_failed_msg[] = "Custom message handling failed.";
 
@@ -335,8 +362,7 @@ static int _on_worker_proxy_channel_event(sid_resource_event_source_t *es, int f
 	struct worker_channel * chan = data;
 	worker_channel_cmd_t    cmd;
 	struct worker_data_spec data_spec = {0};
-	/*uint64_t timeout_usec;*/
-	int r;
+	int                     r;
 
 	r = _chan_buf_recv(chan, revents, &cmd, &data_spec);
 
@@ -351,15 +377,11 @@ static int _on_worker_proxy_channel_event(sid_resource_event_source_t *es, int f
 	if (r & CHAN_BUF_RECV_MSG) {
 		switch (cmd) {
 			case WORKER_CHANNEL_CMD_YIELD:
-				/* FIXME: Make timeout configurable. If timeout is set to zero, exit worker right away - call
-				_make_worker_exit.
-				 *
-				timeout_usec = util_get_now_usec(CLOCK_MONOTONIC) + DEFAULT_WORKER_IDLE_TIMEOUT_USEC;
-				sid_resource_create_time_event_source(chan->owner, &worker_proxy->idle_timeout_es, CLOCK_MONOTONIC,
-				                                      timeout_usec, 0, _on_worker_proxy_idle_timeout_event, "idle
-				timeout", chan->owner); _change_worker_proxy_state(chan->owner, WORKER_STATE_IDLE);
-				*/
-				_make_worker_exit(chan->owner);
+				_yield_worker_proxy(chan->owner);
+				break;
+			case WORKER_CHANNEL_CMD_RETIRE:
+				((struct worker_proxy *) sid_resource_get_data(chan->owner))->stale = true;
+				_yield_worker_proxy(chan->owner);
 				break;
 			case WORKER_CHANNEL_CMD_DATA:
 			case WORKER_CHANNEL_CMD_DATA_EXT:
@@ -584,7 +606,7 @@ static int
 		                                        NULL,
 		                                        chan->fd,
 		                                        is_worker ? _on_worker_channel_event : _on_worker_proxy_channel_event,
-		                                        0,
+		                                        chan->spec->prio,
 		                                        chan->spec->id,
 		                                        chan) < 0) {
 			log_error(id, "Failed to register communication channel with ID %s.", chan->spec->id);
@@ -668,7 +690,7 @@ void _destroy_channels(struct worker_channel *channels, unsigned channel_count)
 	free(channels);
 }
 
-sid_resource_t *worker_control_get_new_worker(sid_resource_t *worker_control_res, struct worker_params *params)
+static sid_resource_t *_create_worker(sid_resource_t *worker_control_res, struct worker_params *params)
 {
 	struct worker_control * worker_control        = sid_resource_get_data(worker_control_res);
 	struct worker_channel * worker_proxy_channels = NULL, *worker_channels = NULL;
@@ -796,6 +818,7 @@ sid_resource_t *worker_control_get_new_worker(sid_resource_t *worker_control_res
 		 */
 
 		log_debug(ID(worker_control_res), "Created new worker process with PID %d.", pid);
+		SID_PROBE2(worker__fork, pid, worker_control->worker_type);
 
 		_destroy_channels(worker_channels, worker_control->channel_spec_count);
 		worker_channels = NULL;
@@ -848,10 +871,172 @@ out:
 	exit(-r);
 }
 
-sid_resource_t *worker_control_get_idle_worker(sid_resource_t *worker_control_res)
+static void _notify_worker_available(sid_resource_t *worker_control_res)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+
+	if (worker_control->available_cb_spec.cb)
+		(void) worker_control->available_cb_spec.cb(worker_control_res, worker_control->available_cb_spec.arg);
+}
+
+static void _count_workers(sid_resource_t *worker_control_res, unsigned *idle, unsigned *running)
 {
 	sid_resource_iter_t *iter;
 	sid_resource_t *     res;
+	worker_state_t       state;
+
+	*idle = *running = 0;
+
+	if (!(iter = sid_resource_iter_create(worker_control_res)))
+		return;
+
+	while ((res = sid_resource_iter_next(iter))) {
+		state = ((struct worker_proxy *) sid_resource_get_data(res))->state;
+
+		if (state == WORKER_STATE_IDLE)
+			(*idle)++;
+
+		if (state != WORKER_STATE_EXITING && state != WORKER_STATE_EXITED)
+			(*running)++;
+	}
+
+	sid_resource_iter_destroy(iter);
+}
+
+static void _update_idle_policy(sid_resource_t *worker_control_res, uint64_t now)
+{
+	struct worker_control *    worker_control = sid_resource_get_data(worker_control_res);
+	struct worker_idle_policy *policy         = &worker_control->idle_policy;
+	uint64_t                   mean = 0, since_last, idle_timeout, diff;
+	unsigned                   pool_idle;
+
+	if (!worker_control->last_request_usec) {
+		/* no requests seen yet */
+		idle_timeout = policy->idle_timeout_min_usec;
+		pool_idle    = worker_control->pool_min;
+	} else {
+		/* if there was no request for longer than the mean, count that in right away */
+		since_last = now - worker_control->last_request_usec;
+		mean       = since_last > worker_control->request_ewma_usec ? since_last : worker_control->request_ewma_usec;
+
+		if (mean > policy->idle_timeout_max_usec / policy->idle_timeout_factor)
+			idle_timeout = policy->idle_timeout_max_usec;
+		else if ((idle_timeout = mean * policy->idle_timeout_factor) < policy->idle_timeout_min_usec)
+			idle_timeout = policy->idle_timeout_min_usec;
+
+		if (!mean || policy->pool_window_usec / mean >= policy->pool_idle_max)
+			pool_idle = policy->pool_idle_max;
+		else if ((pool_idle = policy->pool_window_usec / mean) < worker_control->pool_min)
+			pool_idle = worker_control->pool_min;
+	}
+
+	/* do not count in small changes of the idle timeout */
+	diff = idle_timeout > worker_control->stats.idle_timeout_usec ? idle_timeout - worker_control->stats.idle_timeout_usec
+	                                                              : worker_control->stats.idle_timeout_usec - idle_timeout;
+
+	if (pool_idle == worker_control->stats.pool_idle && diff < worker_control->stats.idle_timeout_usec / 4)
+		return;
+
+	worker_control->stats.idle_timeout_usec = idle_timeout;
+	worker_control->stats.pool_idle         = pool_idle;
+	worker_control->stats.policy_changes++;
+
+	log_debug(ID(worker_control_res),
+	          "Idle worker policy changed: idle timeout %" PRIu64 " ms, %u idle workers "
+	          "(mean time between requests %" PRIu64 " ms).",
+	          idle_timeout / 1000,
+	          pool_idle,
+	          mean / 1000);
+}
+
+static void _record_worker_request(sid_resource_t *worker_control_res)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+	uint64_t               now            = util_time_get_now_usec(CLOCK_MONOTONIC);
+	uint64_t               interval;
+
+	if (worker_control->last_request_usec) {
+		interval = now - worker_control->last_request_usec;
+
+		if (worker_control->request_ewma_usec)
+			worker_control->request_ewma_usec = worker_control->request_ewma_usec -
+			                                    (worker_control->request_ewma_usec >> WORKER_REQUEST_EWMA_SHIFT) +
+			                                    (interval >> WORKER_REQUEST_EWMA_SHIFT);
+		else
+			worker_control->request_ewma_usec = interval;
+	}
+
+	worker_control->last_request_usec = now;
+	_update_idle_policy(worker_control_res, now);
+}
+
+static int _set_worker_idle_timeout(sid_resource_t *worker_proxy_res, uint64_t timeout_usec);
+
+static int _on_worker_proxy_idle_timeout_event(sid_resource_event_source_t *es, uint64_t usec, void *data)
+{
+	sid_resource_t *       worker_proxy_res   = data;
+	struct worker_proxy *  worker_proxy       = sid_resource_get_data(worker_proxy_res);
+	sid_resource_t *       worker_control_res = sid_resource_search(worker_proxy_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	struct worker_control *worker_control     = sid_resource_get_data(worker_control_res);
+	unsigned               idle, running;
+
+	_update_idle_policy(worker_control_res, util_time_get_now_usec(CLOCK_MONOTONIC));
+	_count_workers(worker_control_res, &idle, &running);
+
+	if (idle <= worker_control->stats.pool_idle)
+		return _set_worker_idle_timeout(worker_proxy_res, worker_control->stats.idle_timeout_usec);
+
+	worker_control->stats.idle_timeouts++;
+	log_debug(ID(worker_proxy_res),
+	          "Idle timeout expired, shrinking worker pool to %u idle workers (%" PRIu64 " idle timeouts so far).",
+	          idle - 1,
+	          worker_control->stats.idle_timeouts);
+
+	sid_resource_destroy_event_source(&worker_proxy->idle_timeout_es);
+	return _make_worker_exit(worker_proxy_res);
+}
+
+static int _set_worker_idle_timeout(sid_resource_t *worker_proxy_res, uint64_t timeout_usec)
+{
+	struct worker_proxy *worker_proxy = sid_resource_get_data(worker_proxy_res);
+
+	if (worker_proxy->idle_timeout_es)
+		sid_resource_destroy_event_source(&worker_proxy->idle_timeout_es);
+
+	return sid_resource_create_time_event_source(worker_proxy_res,
+	                                             &worker_proxy->idle_timeout_es,
+	                                             CLOCK_MONOTONIC,
+	                                             util_time_get_now_usec(CLOCK_MONOTONIC) + timeout_usec,
+	                                             0,
+	                                             _on_worker_proxy_idle_timeout_event,
+	                                             0,
+	                                             "idle timeout",
+	                                             worker_proxy_res);
+}
+
+sid_resource_t *worker_control_get_new_worker(sid_resource_t *worker_control_res, struct worker_params *params)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+
+	worker_control->stats.on_demand_forks++;
+
+	if (worker_control->pool_min)
+		log_debug(ID(worker_control_res),
+		          "Forking worker on demand (%" PRIu64 " on-demand and %" PRIu64 " pre-forked workers so far).",
+		          worker_control->stats.on_demand_forks,
+		          worker_control->stats.pool_forks);
+
+	return _create_worker(worker_control_res, params);
+}
+
+sid_resource_t *worker_control_get_idle_worker(sid_resource_t *worker_control_res)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+	sid_resource_iter_t *  iter;
+	sid_resource_t *       res;
+
+	if (worker_control->pool_min || worker_control->reuse_workers)
+		_record_worker_request(worker_control_res);
 
 	if (!(iter = sid_resource_iter_create(worker_control_res)))
 		return NULL;
@@ -862,14 +1047,261 @@ sid_resource_t *worker_control_get_idle_worker(sid_resource_t *worker_control_re
 	}
 
 	sid_resource_iter_destroy(iter);
+
+	if (res) {
+		worker_control->stats.pool_hits++;
+		/* replace the worker we are handing out */
+		(void) worker_control_fill_pool(worker_control_res);
+	}
+
 	return res;
 }
 
+static int _on_worker_control_pool_event(sid_resource_event_source_t *es, void *data)
+{
+	sid_resource_t *       worker_control_res = data;
+	struct worker_control *worker_control     = sid_resource_get_data(worker_control_res);
+	char                   uuid[UTIL_UUID_STR_SIZE];
+	util_mem_t             mem = {.base = uuid, .size = sizeof(uuid)};
+	sid_resource_t *       res;
+	unsigned               idle, running;
+
+	_count_workers(worker_control_res, &idle, &running);
+
+	if (idle >= worker_control->stats.pool_idle || (worker_control->pool_max && running >= worker_control->pool_max)) {
+		log_debug(ID(worker_control_res), "Worker pool filled with %u idle and %u running workers.", idle, running);
+		sid_resource_destroy_event_source(&worker_control->pool_es);
+		return 0;
+	}
+
+	if (!util_uuid_gen_str(&mem) || !(res = _create_worker(worker_control_res, &((struct worker_params) {.id = uuid})))) {
+		log_error(ID(worker_control_res), "Failed to pre-fork worker for worker pool.");
+		sid_resource_destroy_event_source(&worker_control->pool_es);
+		return 0;
+	}
+
+	/* worker never reaches this point, only worker-proxy does */
+
+	worker_control->stats.pool_forks++;
+	_change_worker_proxy_state(res, WORKER_STATE_IDLE);
+
+	/* idle workers can only exceed pool_min if the pool is allowed to grow */
+	if (worker_control->idle_policy.pool_idle_max > worker_control->pool_min &&
+	    _set_worker_idle_timeout(res, worker_control->stats.idle_timeout_usec) < 0)
+		log_warning(ID(res), "Failed to set idle timeout for pre-forked worker.");
+
+	_notify_worker_available(worker_control_res);
+	return 0;
+}
+
+static void _clear_worker_affinity(struct worker_proxy *worker_proxy)
+{
+	while (worker_proxy->affinity.count)
+		free(worker_proxy->affinity.keys[--worker_proxy->affinity.count]);
+}
+
+static void _yield_worker_proxy(sid_resource_t *worker_proxy_res)
+{
+	struct worker_proxy *  worker_proxy       = sid_resource_get_data(worker_proxy_res);
+	sid_resource_t *       worker_control_res = sid_resource_search(worker_proxy_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
+	struct worker_control *worker_control     = sid_resource_get_data(worker_control_res);
+
+	/* worker yields once per assignment, it is done only after yielding the last one */
+	if (worker_proxy->assigned && --worker_proxy->assigned)
+		return;
+
+	_clear_worker_affinity(worker_proxy);
+
+	if (!worker_control->reuse_workers || worker_proxy->stale) {
+		(void) _make_worker_exit(worker_proxy_res);
+		return;
+	}
+
+	worker_control->stats.reuses++;
+	_change_worker_proxy_state(worker_proxy_res, WORKER_STATE_IDLE);
+
+	if (_set_worker_idle_timeout(worker_proxy_res, worker_control->stats.idle_timeout_usec) < 0) {
+		log_warning(ID(worker_proxy_res), "Failed to set idle timeout for yielded worker.");
+		(void) _make_worker_exit(worker_proxy_res);
+		return;
+	}
+
+	_notify_worker_available(worker_control_res);
+}
+
+int worker_control_fill_pool(sid_resource_t *worker_control_res)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+
+	if (!worker_control->pool_min || worker_control->worker_type != WORKER_TYPE_INTERNAL || worker_control->pool_es)
+		return 0;
+
+	/*
+	 * Fork from within the event loop and only one worker per loop iteration
+	 * so that events which are already pending do not need to wait for whole pool.
+	 */
+	return sid_resource_create_deferred_event_source(worker_control_res,
+	                                                 &worker_control->pool_es,
+	                                                 _on_worker_control_pool_event,
+	                                                 1,
+	                                                 "worker pool",
+	                                                 worker_control_res);
+}
+
+int worker_control_refresh_pool(sid_resource_t *worker_control_res)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+	sid_resource_iter_t *  iter;
+	sid_resource_t *       res;
+
+	if (!worker_control->pool_min)
+		return 0;
+
+	if (!(iter = sid_resource_iter_create(worker_control_res)))
+		return -ENOMEM;
+
+	while ((res = sid_resource_iter_next(iter))) {
+		if (((struct worker_proxy *) sid_resource_get_data(res))->state == WORKER_STATE_IDLE)
+			(void) _make_worker_exit(res);
+	}
+
+	sid_resource_iter_destroy(iter);
+
+	return worker_control_fill_pool(worker_control_res);
+}
+
+int worker_control_get_worker_count(sid_resource_t *worker_control_res, unsigned *idle, unsigned *running)
+{
+	if (!sid_resource_match(worker_control_res, &sid_resource_type_worker_control, NULL))
+		return -EINVAL;
+
+	_count_workers(worker_control_res, idle, running);
+	return 0;
+}
+
+int worker_control_get_stats(sid_resource_t *worker_control_res, struct worker_control_stats *stats)
+{
+	if (!sid_resource_match(worker_control_res, &sid_resource_type_worker_control, NULL))
+		return -EINVAL;
+
+	*stats = ((struct worker_control *) sid_resource_get_data(worker_control_res))->stats;
+	return 0;
+}
+
+static void _add_buffer_usage(struct buffer *buf, unsigned *count, struct buffer_usage *usage)
+{
+	struct buffer_stat stat;
+
+	if (!buf)
+		return;
+
+	stat = buffer_stat(buf);
+	usage->allocated += stat.usage.allocated;
+	usage->used += stat.usage.used;
+	(*count)++;
+}
+
+int worker_control_get_buffer_usage(sid_resource_t *worker_control_res, unsigned *count, struct buffer_usage *usage)
+{
+	sid_resource_iter_t *iter;
+	sid_resource_t *     res;
+	struct worker_proxy *worker_proxy;
+	unsigned             i;
+
+	if (!sid_resource_match(worker_control_res, &sid_resource_type_worker_control, NULL))
+		return -EINVAL;
+
+	*count = 0;
+	*usage = (struct buffer_usage) {0};
+
+	if (!(iter = sid_resource_iter_create(worker_control_res)))
+		return -ENOMEM;
+
+	while ((res = sid_resource_iter_next(iter))) {
+		worker_proxy = sid_resource_get_data(res);
+
+		for (i = 0; i < worker_proxy->channel_count; i++) {
+			_add_buffer_usage(worker_proxy->channels[i].in_buf, count, usage);
+			_add_buffer_usage(worker_proxy->channels[i].out_buf, count, usage);
+		}
+	}
+
+	sid_resource_iter_destroy(iter);
+	return 0;
+}
+
 sid_resource_t *worker_control_find_worker(sid_resource_t *worker_control_res, const char *id)
 {
 	return sid_resource_search(worker_control_res, SID_RESOURCE_SEARCH_IMM_DESC, &sid_resource_type_worker_proxy, id);
 }
 
+int worker_control_add_worker_affinity(sid_resource_t *worker_proxy_res, const char *key)
+{
+	struct worker_proxy *worker_proxy;
+	unsigned             i;
+
+	if (!sid_resource_match(worker_proxy_res, &sid_resource_type_worker_proxy, NULL) || !key || !*key)
+		return -EINVAL;
+
+	worker_proxy = sid_resource_get_data(worker_proxy_res);
+
+	if (worker_proxy->state != WORKER_STATE_ASSIGNED)
+		return -EBUSY;
+
+	for (i = 0; i < worker_proxy->affinity.count; i++) {
+		if (!strcmp(worker_proxy->affinity.keys[i], key))
+			return 0;
+	}
+
+	if (worker_proxy->affinity.count == WORKER_AFFINITY_KEYS_MAX)
+		return -ENOSPC;
+
+	if (!(worker_proxy->affinity.keys[worker_proxy->affinity.count] = strdup(key)))
+		return -ENOMEM;
+
+	worker_proxy->affinity.count++;
+	return 0;
+}
+
+sid_resource_t *worker_control_get_affine_worker(sid_resource_t *worker_control_res, const char *key)
+{
+	struct worker_control *worker_control = sid_resource_get_data(worker_control_res);
+	sid_resource_iter_t *  iter;
+	sid_resource_t *       res;
+	struct worker_proxy *  worker_proxy;
+	unsigned               i;
+
+	if (!key || !*key || !(iter = sid_resource_iter_create(worker_control_res)))
+		return NULL;
+
+	while ((res = sid_resource_iter_next(iter))) {
+		worker_proxy = sid_resource_get_data(res);
+
+		/*
+		 * Keep the queue of assignments for one worker bounded. Stale worker missed data
+		 * sent by worker_control_send_to_idle so it is not given any more work.
+		 */
+		if (worker_proxy->state != WORKER_STATE_ASSIGNED || worker_proxy->stale ||
+		    worker_proxy->assigned >= WORKER_AFFINITY_KEYS_MAX)
+			continue;
+
+		for (i = 0; i < worker_proxy->affinity.count; i++) {
+			if (!strcmp(worker_proxy->affinity.keys[i], key))
+				break;
+		}
+
+		if (i < worker_proxy->affinity.count)
+			break;
+	}
+
+	sid_resource_iter_destroy(iter);
+
+	if (res)
+		worker_control->stats.affinity_hits++;
+
+	return res;
+}
+
 bool worker_control_is_worker(sid_resource_t *res)
 {
 	// TODO: detect external worker
@@ -952,6 +1384,75 @@ out:
 	return r;
 }
 
+/*
+ * Batched variant of _chan_buf_send for channels with socket wire and size-prefixed buffers. Each
+ * message goes out as one datagram, the same way buffer_write_all writes it, followed by a separate
+ * one-byte datagram carrying the passed fd, if any, so the receiving side can not tell the difference.
+ */
+static int _chan_buf_send_batch(const struct worker_channel *chan, struct worker_data_spec *data_specs, unsigned count)
+{
+	static unsigned char  byte     = 0xFF;
+	struct iovec          byte_iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+	MSG_SIZE_PREFIX_TYPE  prefixes[WORKER_CHANNEL_BATCH_MAX];
+	worker_channel_cmd_t  cmds[WORKER_CHANNEL_BATCH_MAX];
+	struct iovec          iov[WORKER_CHANNEL_BATCH_MAX][3];
+	struct comms_unix_msg msgs[2 * WORKER_CHANNEL_BATCH_MAX];
+	unsigned              i, batch, msg_count, sent;
+	int                   r;
+
+	if (chan->spec->wire.type != WORKER_WIRE_SOCKET || buffer_stat(chan->out_buf).spec.mode != BUFFER_MODE_SIZE_PREFIX) {
+		for (i = 0; i < count; i++)
+			if ((r = _chan_buf_send(chan,
+			                        data_specs[i].ext.used ? WORKER_CHANNEL_CMD_DATA_EXT : WORKER_CHANNEL_CMD_DATA,
+			                        &data_specs[i])) < 0)
+				return r;
+		return 0;
+	}
+
+	for (; count; data_specs += batch, count -= batch) {
+		batch     = count < WORKER_CHANNEL_BATCH_MAX ? count : WORKER_CHANNEL_BATCH_MAX;
+		msg_count = 0;
+
+		for (i = 0; i < batch; i++) {
+			cmds[i]     = data_specs[i].ext.used ? WORKER_CHANNEL_CMD_DATA_EXT : WORKER_CHANNEL_CMD_DATA;
+			prefixes[i] = MSG_SIZE_PREFIX_LEN + sizeof(cmds[i]);
+			iov[i][0]   = (struct iovec) {.iov_base = &prefixes[i], .iov_len = MSG_SIZE_PREFIX_LEN};
+			iov[i][1]   = (struct iovec) {.iov_base = &cmds[i], .iov_len = sizeof(cmds[i])};
+
+			msgs[msg_count++] = (struct comms_unix_msg) {.iov = iov[i], .iov_len = 2};
+
+			if (data_specs[i].data && data_specs[i].data_size) {
+				prefixes[i] += data_specs[i].data_size;
+				iov[i][2] = (struct iovec) {.iov_base = data_specs[i].data, .iov_len = data_specs[i].data_size};
+				msgs[msg_count - 1].iov_len++;
+			}
+
+			if (data_specs[i].ext.used)
+				msgs[msg_count++] = (struct comms_unix_msg) {.iov      = &byte_iov,
+				                                             .iov_len  = 1,
+				                                             .fds      = &data_specs[i].ext.socket.fd_pass,
+				                                             .fd_count = 1};
+		}
+
+		for (sent = 0; sent < msg_count;) {
+			if ((r = comms_unix_send_mmsg(chan->fd, msgs + sent, msg_count - sent)) < 0) {
+				if (r == -EAGAIN || r == -EINTR)
+					continue;
+
+				log_error_errno(ID(chan->owner),
+				                r,
+				                "Failed to send batch of messages on channel %s",
+				                chan->spec->id);
+				return r;
+			}
+
+			sent += r;
+		}
+	}
+
+	return 0;
+}
+
 static struct worker_channel *_get_channel(struct worker_channel *channels, unsigned channel_count, const char *channel_id)
 {
 	struct worker_channel *chan;
@@ -966,7 +1467,11 @@ static struct worker_channel *_get_channel(struct worker_channel *channels, unsi
 	return NULL;
 }
 
-int worker_control_channel_send(sid_resource_t *current_res, const char *channel_id, struct worker_data_spec *data_spec)
+/* Find the channel to send data_spec through and do the bookkeeping needed before sending. */
+static int _prepare_channel_send(sid_resource_t *         current_res,
+                                 const char *             channel_id,
+                                 struct worker_data_spec *data_spec,
+                                 struct worker_channel ** chan_out)
 {
 	sid_resource_t *       res = current_res;
 	struct worker_proxy *  worker_proxy;
@@ -988,6 +1493,7 @@ int worker_control_channel_send(sid_resource_t *current_res, const char *channel
 			sid_resource_destroy_event_source(&worker_proxy->idle_timeout_es);
 		if (worker_proxy->state != WORKER_STATE_ASSIGNED)
 			_change_worker_proxy_state(res, WORKER_STATE_ASSIGNED);
+		worker_proxy->assigned++;
 
 		if (chan->spec->proxy_tx_cb.cb)
 			if (chan->spec->proxy_tx_cb.cb(res, chan, data_spec, chan->spec->proxy_tx_cb.arg) < 0)
@@ -1007,10 +1513,98 @@ int worker_control_channel_send(sid_resource_t *current_res, const char *channel
 	} else
 		return -ENOMEDIUM;
 
+	*chan_out = chan;
+	return 0;
+}
+
+int worker_control_channel_send(sid_resource_t *current_res, const char *channel_id, struct worker_data_spec *data_spec)
+{
+	struct worker_channel *chan;
+	int                    r;
+
+	if ((r = _prepare_channel_send(current_res, channel_id, data_spec, &chan)) < 0)
+		return r;
+
 	return _chan_buf_send(chan, data_spec->ext.used ? WORKER_CHANNEL_CMD_DATA_EXT : WORKER_CHANNEL_CMD_DATA, data_spec);
 }
 
-int worker_control_worker_yield(sid_resource_t *res)
+int worker_control_channel_send_batch(sid_resource_t *         current_res,
+                                      const char *             channel_id,
+                                      struct worker_data_spec *data_specs,
+                                      unsigned                 count)
+{
+	struct worker_channel *chan = NULL;
+	unsigned               i;
+	int                    r;
+
+	for (i = 0; i < count; i++)
+		if ((r = _prepare_channel_send(current_res, channel_id, &data_specs[i], &chan)) < 0)
+			return r;
+
+	return chan ? _chan_buf_send_batch(chan, data_specs, count) : 0;
+}
+
+int worker_control_send_to_idle(sid_resource_t *worker_control_res, const char *channel_id, struct worker_data_spec *data_spec)
+{
+	sid_resource_iter_t *  iter;
+	sid_resource_t *       res;
+	struct worker_proxy *  worker_proxy;
+	struct worker_channel *chan;
+	int                    count = 0;
+
+	if (!channel_id || !*channel_id)
+		return -ECHRNG;
+
+	if (!(iter = sid_resource_iter_create(worker_control_res)))
+		return -ENOMEM;
+
+	while ((res = sid_resource_iter_next(iter))) {
+		worker_proxy = sid_resource_get_data(res);
+
+		switch (worker_proxy->state) {
+			case WORKER_STATE_IDLE:
+				break;
+			case WORKER_STATE_ASSIGNED:
+				/* affine worker can still be given more work, see worker_control_get_affine_worker */
+				if (worker_proxy->affinity.count && !worker_proxy->stale)
+					break;
+				worker_proxy->stale = true;
+				continue;
+			case WORKER_STATE_NEW:
+				worker_proxy->stale = true;
+				continue;
+			default:
+				continue;
+		}
+
+		if (!(chan = _get_channel(worker_proxy->channels, worker_proxy->channel_count, channel_id))) {
+			count = -ECHRNG;
+			break;
+		}
+
+		if (chan->spec->proxy_tx_cb.cb)
+			if (chan->spec->proxy_tx_cb.cb(res, chan, data_spec, chan->spec->proxy_tx_cb.arg) < 0)
+				log_warning(ID(res), "%s", _custom_message_handling_failed_msg);
+
+		if (_chan_buf_send(chan,
+		                   data_spec->ext.used ? WORKER_CHANNEL_CMD_DATA_EXT : WORKER_CHANNEL_CMD_DATA,
+		                   data_spec) < 0) {
+			/* the worker has not received the message so it can not stay idle or take more work */
+			if (worker_proxy->state == WORKER_STATE_IDLE)
+				(void) _make_worker_exit(res);
+			else
+				worker_proxy->stale = true;
+			continue;
+		}
+
+		count++;
+	}
+
+	sid_resource_iter_destroy(iter);
+	return count;
+}
+
+static int _worker_yield(sid_resource_t *res, worker_channel_cmd_t cmd)
 {
 	sid_resource_t *       worker_res;
 	struct worker *        worker;
@@ -1027,15 +1621,26 @@ int worker_control_worker_yield(sid_resource_t *res)
 	for (i = 0; i < worker->channel_count; i++) {
 		chan = &worker->channels[i];
 		if (chan->spec->wire.type == WORKER_WIRE_PIPE_TO_PROXY || chan->spec->wire.type == WORKER_WIRE_SOCKET)
-			return _chan_buf_send(chan, WORKER_CHANNEL_CMD_YIELD, NULL);
+			return _chan_buf_send(chan, cmd, NULL);
 	}
 
 	return -ENOTCONN;
 }
 
+int worker_control_worker_yield(sid_resource_t *res)
+{
+	return _worker_yield(res, WORKER_CHANNEL_CMD_YIELD);
+}
+
+int worker_control_worker_retire(sid_resource_t *res)
+{
+	return _worker_yield(res, WORKER_CHANNEL_CMD_RETIRE);
+}
+
 static int _on_worker_proxy_child_event(sid_resource_event_source_t *es, const siginfo_t *si, void *data)
 {
-	sid_resource_t *worker_proxy_res = data;
+	sid_resource_t *worker_proxy_res   = data;
+	sid_resource_t *worker_control_res = sid_resource_search(worker_proxy_res, SID_RESOURCE_SEARCH_IMM_ANC, NULL, NULL);
 
 	switch (si->si_code) {
 		case CLD_EXITED:
@@ -1067,19 +1672,10 @@ static int _on_worker_proxy_child_event(sid_resource_event_source_t *es, const s
 	 * worker proxy needs to be separated.
 	 */
 	(void) sid_resource_destroy(worker_proxy_res);
+	_notify_worker_available(worker_control_res);
 	return 0;
 }
 
-/*
-static int _on_worker_proxy_idle_timeout_event(sid_resource_event_source_t *es, uint64_t usec, void *data)
-{
-        sid_resource_t *worker_proxy_res = data;
-
-        log_debug(ID(worker_proxy_res), "Idle timeout expired.");
-        return _make_worker_exit(worker_proxy_res);
-}
-*/
-
 static int _on_worker_signal_event(sid_resource_event_source_t *es, const struct signalfd_siginfo *si, void *arg)
 {
 	sid_resource_t *res = arg;
@@ -1132,6 +1728,7 @@ static int _destroy_worker_proxy(sid_resource_t *worker_proxy_res)
 {
 	struct worker_proxy *worker_proxy = sid_resource_get_data(worker_proxy_res);
 
+	_clear_worker_affinity(worker_proxy);
 	_destroy_channels(worker_proxy->channels, worker_proxy->channel_count);
 	free(worker_proxy);
 
@@ -1244,8 +1841,30 @@ static int _init_worker_control(sid_resource_t *worker_control_res, const void *
 		goto fail;
 	}
 
-	worker_control->worker_type  = params->worker_type;
-	worker_control->init_cb_spec = params->init_cb_spec;
+	worker_control->worker_type       = params->worker_type;
+	worker_control->init_cb_spec      = params->init_cb_spec;
+	worker_control->available_cb_spec = params->available_cb_spec;
+	worker_control->pool_min          = params->pool_min;
+	worker_control->pool_max          = params->pool_max;
+	worker_control->reuse_workers     = params->reuse_workers;
+	worker_control->idle_policy       = params->idle_policy;
+
+	if (!worker_control->idle_policy.idle_timeout_min_usec)
+		worker_control->idle_policy.idle_timeout_min_usec = DEFAULT_WORKER_IDLE_TIMEOUT_USEC;
+	if (worker_control->idle_policy.idle_timeout_max_usec < worker_control->idle_policy.idle_timeout_min_usec)
+		worker_control->idle_policy.idle_timeout_max_usec =
+			DEFAULT_WORKER_IDLE_TIMEOUT_MAX_USEC > worker_control->idle_policy.idle_timeout_min_usec
+				? DEFAULT_WORKER_IDLE_TIMEOUT_MAX_USEC
+				: worker_control->idle_policy.idle_timeout_min_usec;
+	if (!worker_control->idle_policy.idle_timeout_factor)
+		worker_control->idle_policy.idle_timeout_factor = DEFAULT_WORKER_IDLE_TIMEOUT_FACTOR;
+	if (!worker_control->idle_policy.pool_window_usec)
+		worker_control->idle_policy.pool_window_usec = DEFAULT_WORKER_POOL_WINDOW_USEC;
+	if (worker_control->idle_policy.pool_idle_max < worker_control->pool_min)
+		worker_control->idle_policy.pool_idle_max = worker_control->pool_min;
+
+	worker_control->stats.idle_timeout_usec = worker_control->idle_policy.idle_timeout_min_usec;
+	worker_control->stats.pool_idle         = worker_control->pool_min;
 
 	*data = worker_control;
 	return 0;
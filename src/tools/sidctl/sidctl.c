@@ -20,6 +20,7 @@
 #include "base/common.h"
 
 #include "base/buffer.h"
+#include "base/rec.h"
 #include "base/util.h"
 #include "iface/usid.h"
 #include "log/log.h"
@@ -27,8 +28,10 @@
 
 #include <getopt.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define LOG_PREFIX "sidctl"
 
@@ -47,70 +50,289 @@ struct args {
 	char **argv;
 };
 
+static int _add_dump_filter_to_buf(struct buffer *buf, void *data)
+{
+	const char **filter = data;
+	int          i, r = 0;
+
+	for (i = 0; i < USID_DUMP_FILTER_COUNT; i++) {
+		if (!buffer_add(buf, (void *) (filter[i] ? filter[i] : ""), filter[i] ? strlen(filter[i]) + 1 : 1, &r))
+			break;
+	}
+
+	return r;
+}
+
+static int _print_kv_recs(const void *data, size_t size, unsigned int *rec_num)
+{
+	struct rec_reader *reader;
+	size_t             len;
+	const char *       key;
+	const void *       owner, *value;
+	uint64_t           type, seqnum, flags, count, j;
+	int                r;
+
+	if (!(reader = rec_reader_create(data, size, &r)))
+		return r;
+
+	/* the record fields are described in iface/usid.h */
+	while ((r = rec_read_key(reader, &key, NULL)) == 1) {
+		if ((r = rec_read_uint(reader, &type)) < 0)
+			break;
+		if (type == USID_KV_REC_UNSET) {
+			printf("--- RECORD %u\n", *rec_num);
+			printf("    key: %s\n", key);
+			printf("    value: unset\n");
+			(*rec_num)++;
+			continue;
+		}
+		if ((r = rec_read_uint(reader, &seqnum)) < 0 ||
+		    (r = rec_read_uint(reader, &flags)) < 0 || (r = rec_read_data(reader, &owner, &len)) < 0 ||
+		    (r = rec_read_uint(reader, &count)) < 0)
+			break;
+		printf("--- RECORD %u\n", *rec_num);
+		printf("    key: %s\n", key);
+		printf("    seqnum: %" PRIu64 "  flags: %s%s%s%s  owner: %.*s\n",
+		       seqnum,
+		       flags & KV_PERSISTENT ? "KV_PERSISTENT " : "",
+		       flags & KV_MOD_PROTECTED ? "KV_MOD_PROTECTED " : "",
+		       flags & KV_MOD_PRIVATE ? "KV_MOD_PRIVATE " : "",
+		       flags & KV_MOD_RESERVED ? "KV_MOD_RESERVED " : "",
+		       len ? (int) len - 1 : 0,
+		       (const char *) owner);
+		if (type == USID_KV_REC_VALUE) {
+			if ((r = rec_read_data(reader, &value, &len)) < 0)
+				break;
+			if (len == 0)
+				printf("    value:\n");
+			else
+				printf("    value: %.*s\n", (int) strnlen(value, len), (const char *) value);
+		} else {
+			printf("    value: vector\n");
+			for (j = 0; j < count; j++) {
+				if ((r = rec_read_data(reader, &value, &len)) < 0)
+					break;
+				if (len == 0)
+					printf("      [%" PRIu64 "] =\n", j);
+				else
+					printf("      [%" PRIu64 "] = %.*s\n",
+					       j,
+					       (int) strnlen(value, len),
+					       (const char *) value);
+			}
+			if (r < 0)
+				break;
+		}
+		(*rec_num)++;
+	}
+
+	rec_reader_destroy(reader);
+	return r;
+}
+
 static int _usid_cmd_dump(struct args *args)
 {
-	struct buffer *         buf = NULL;
-	char *                  data, *ptr;
+	const char *            filter[USID_DUMP_FILTER_COUNT] = {NULL};
+	struct usid_conn *      conn;
+	struct buffer *         buf;
+	size_t                  size;
+	struct usid_msg_header *msg;
+	unsigned int            rec_num = 0;
+	bool                    more;
+	int                     opt, r;
+
+	struct option longopts[] = {
+		{"namespace", 1, NULL, 'n'},
+		{"device", 1, NULL, 'd'},
+		{"owner", 1, NULL, 'o'},
+		{"key-prefix", 1, NULL, 'k'},
+		{NULL, 0, NULL, 0},
+	};
+
+	optind = 1;
+	while ((opt = getopt_long(args->argc, args->argv, "n:d:o:k:", longopts, NULL)) != EOF) {
+		switch (opt) {
+			case 'n':
+				filter[USID_DUMP_FILTER_NS] = optarg;
+				break;
+			case 'd':
+				filter[USID_DUMP_FILTER_DEV] = optarg;
+				break;
+			case 'o':
+				filter[USID_DUMP_FILTER_OWNER] = optarg;
+				break;
+			case 'k':
+				filter[USID_DUMP_FILTER_KEY_PREFIX] = optarg;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	if ((r = usid_conn_open(LOG_PREFIX, &conn)) < 0)
+		return r;
+
+	if ((r = usid_conn_send(conn, USID_CMD_DUMP, 0, _add_dump_filter_to_buf, filter, NULL)) < 0)
+		goto out;
+
+	/* the dump comes in parts, each one is printed as soon as it arrives */
+	do {
+		if ((r = usid_conn_recv(conn, NULL, &buf)) < 0)
+			goto out;
+
+		buffer_get_data(buf, (const void **) &msg, &size);
+		if (size < USID_MSG_HEADER_SIZE || msg->status & COMMAND_STATUS_FAILURE) {
+			buffer_destroy(buf);
+			r = -1;
+			goto out;
+		}
+
+		more = msg->status & COMMAND_STATUS_MORE;
+		r    = _print_kv_recs(msg->data, size - USID_MSG_HEADER_SIZE, &rec_num);
+		buffer_destroy(buf);
+
+		if (r < 0) {
+			log_error_errno(LOG_PREFIX, r, "Failed to read database dump");
+			goto out;
+		}
+	} while (more);
+out:
+	usid_conn_close(conn);
+	return r;
+}
+
+static int _add_prefixes_to_buf(struct buffer *buf, void *data)
+{
+	struct args *args = data;
+	int          i, r = 0;
+
+	/* key prefixes are given as arguments following the command name */
+	for (i = 1; i < args->argc; i++) {
+		if (!buffer_add(buf, args->argv[i], strlen(args->argv[i]) + 1, &r))
+			break;
+	}
+
+	return r;
+}
+
+static int _usid_cmd_subscribe(struct args *args)
+{
+	struct usid_conn *      conn;
+	struct buffer *         buf;
 	size_t                  size;
 	struct usid_msg_header *msg;
-	struct usid_dump_header hdr;
+	unsigned int            rec_num = 0;
 	int                     r;
-	unsigned int            i = 0, j;
-	uint32_t                len;
 
-	if ((r = usid_req(LOG_PREFIX, USID_CMD_DUMP, 0, NULL, NULL, &buf)) == 0) {
+	if ((r = usid_conn_open(LOG_PREFIX, &conn)) < 0)
+		return r;
+
+	if ((r = usid_conn_send(conn, USID_CMD_SUBSCRIBE, 0, _add_prefixes_to_buf, args, NULL)) < 0)
+		goto out;
+
+	/* the first reply only confirms the subscription, then each reply carries a batch of changes */
+	for (;;) {
+		if ((r = usid_conn_recv(conn, NULL, &buf)) < 0)
+			break;
+
 		buffer_get_data(buf, (const void **) &msg, &size);
 		if (size < USID_MSG_HEADER_SIZE || msg->status & COMMAND_STATUS_FAILURE) {
+			log_error(LOG_PREFIX, "Subscription ended by SID daemon, changes were not read fast enough.");
 			buffer_destroy(buf);
-			return -1;
+			r = -1;
+			break;
 		}
-		size -= USID_MSG_HEADER_SIZE;
-		ptr = data = msg->data;
-
-		while (ptr < data + size) {
-			memcpy(&hdr, ptr, sizeof(hdr));
-			if (hdr.data_count == 0) /* check for dummy entry */
-				break;
-			ptr += sizeof(hdr);
-			memcpy(&len, ptr, sizeof(len)); /* get key */
-			ptr += sizeof(len);
-			printf("--- RECORD %u\n", i);
-			printf("    key: %s\n", ptr);
-			ptr += len;
-			memcpy(&len, ptr, sizeof(len)); /* get owner */
-			ptr += sizeof(len);
-			printf("    seqnum: %" PRIu64 "  flags: %s%s%s%s  owner: %s\n",
-			       hdr.seqnum,
-			       hdr.flags & KV_PERSISTENT ? "KV_PERSISTENT " : "",
-			       hdr.flags & KV_MOD_PROTECTED ? "KV_MOD_PROTECTED " : "",
-			       hdr.flags & KV_MOD_PRIVATE ? "KV_MOD_PRIVATE " : "",
-			       hdr.flags & KV_MOD_RESERVED ? "KV_MOD_RESERVED " : "",
-			       ptr);
-			ptr += len;
-			if (hdr.data_count == 1) {
-				memcpy(&len, ptr, sizeof(len));
-				ptr += sizeof(len);
-				if (len == 0)
-					printf("    value:\n");
-				else
-					printf("    value: %s\n", ptr);
-				ptr += len;
-			} else {
-				printf("    value: vector\n");
-				for (j = 0; j < hdr.data_count; j++) {
-					memcpy(&len, ptr, sizeof(len));
-					ptr += sizeof(len);
-					if (len == 0)
-						printf("      [%u] =\n", j);
-					else
-						printf("      [%u] = %s\n", j, ptr);
-					ptr += len;
-				}
-			}
-			i++;
+
+		r = _print_kv_recs(msg->data, size - USID_MSG_HEADER_SIZE, &rec_num);
+		buffer_destroy(buf);
+
+		if (r < 0) {
+			log_error_errno(LOG_PREFIX, r, "Failed to read database changes");
+			break;
 		}
+
+		fflush(stdout);
+	}
+out:
+	usid_conn_close(conn);
+	return r;
+}
+
+static int _add_get_spec_to_buf(struct buffer *buf, void *data)
+{
+	const char **spec = data;
+	int          i, r = 0;
+
+	for (i = 0; i < USID_GET_SPEC_COUNT; i++) {
+		if (!buffer_add(buf, (void *) (spec[i] ? spec[i] : ""), spec[i] ? strlen(spec[i]) + 1 : 1, &r))
+			break;
+	}
+
+	return r;
+}
+
+static int _usid_cmd_get(struct args *args)
+{
+	const char *            spec[USID_GET_SPEC_COUNT] = {NULL};
+	struct buffer *         buf                       = NULL;
+	size_t                  size;
+	struct usid_msg_header *msg;
+	unsigned int            rec_num = 0;
+	int                     opt, r;
+
+	struct option longopts[] = {
+		{"namespace", 1, NULL, 'n'},
+		{"ns-part", 1, NULL, 's'},
+		{"dom", 1, NULL, 'D'},
+		{"id", 1, NULL, 'i'},
+		{"id-part", 1, NULL, 'p'},
+		{NULL, 0, NULL, 0},
+	};
+
+	optind = 1;
+	while ((opt = getopt_long(args->argc, args->argv, "n:s:D:i:p:", longopts, NULL)) != EOF) {
+		switch (opt) {
+			case 'n':
+				spec[USID_GET_SPEC_NS] = optarg;
+				break;
+			case 's':
+				spec[USID_GET_SPEC_NS_PART] = optarg;
+				break;
+			case 'D':
+				spec[USID_GET_SPEC_DOM] = optarg;
+				break;
+			case 'i':
+				spec[USID_GET_SPEC_ID] = optarg;
+				break;
+			case 'p':
+				spec[USID_GET_SPEC_ID_PART] = optarg;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	if (!spec[USID_GET_SPEC_NS] || optind != args->argc - 1) {
+		log_error(LOG_PREFIX, "Namespace and key required.");
+		return -EINVAL;
+	}
+	spec[USID_GET_SPEC_KEY] = args->argv[optind];
+
+	if ((r = usid_req(LOG_PREFIX, USID_CMD_GET, 0, _add_get_spec_to_buf, spec, &buf)) < 0)
+		return r;
+
+	buffer_get_data(buf, (const void **) &msg, &size);
+	if (size < USID_MSG_HEADER_SIZE || msg->status & COMMAND_STATUS_FAILURE) {
 		buffer_destroy(buf);
+		return -1;
 	}
+
+	if ((r = _print_kv_recs(msg->data, size - USID_MSG_HEADER_SIZE, &rec_num)) < 0)
+		log_error_errno(LOG_PREFIX, r, "Failed to read database record");
+	else if (!rec_num)
+		r = -ENOENT;
+
+	buffer_destroy(buf);
 	return r;
 }
 
@@ -150,6 +372,312 @@ static int _usid_cmd_version(struct args *args)
 	return r;
 }
 
+static int _usid_cmd_event_stats(struct args *args)
+{
+	struct buffer *         buf = NULL;
+	struct rec_reader *     reader;
+	size_t                  size;
+	struct usid_msg_header *msg;
+	const char *            name;
+	uint64_t                count, usec_total, usec_max, stall_count, hist_size, hist_count, i;
+	int                     r;
+
+	if ((r = usid_req(LOG_PREFIX, USID_CMD_EVENT_STATS, 0, NULL, NULL, &buf)) < 0)
+		return r;
+
+	buffer_get_data(buf, (const void **) &msg, &size);
+	if (size < USID_MSG_HEADER_SIZE || msg->status & COMMAND_STATUS_FAILURE) {
+		log_error(LOG_PREFIX, "Event source statistics not available, SID daemon records them with SID_EVENT_STATS=1.");
+		buffer_destroy(buf);
+		return -1;
+	}
+	size -= USID_MSG_HEADER_SIZE;
+
+	if (!(reader = rec_reader_create(msg->data, size, &r))) {
+		buffer_destroy(buf);
+		return r;
+	}
+
+	/* the record fields are described in iface/usid.h */
+	while ((r = rec_read_key(reader, &name, NULL)) == 1) {
+		if ((r = rec_read_uint(reader, &count)) < 0 || (r = rec_read_uint(reader, &usec_total)) < 0 ||
+		    (r = rec_read_uint(reader, &usec_max)) < 0 || (r = rec_read_uint(reader, &stall_count)) < 0 ||
+		    (r = rec_read_uint(reader, &hist_size)) < 0)
+			break;
+
+		printf("--- EVENT SOURCE %s\n", name);
+		printf("    dispatched: %" PRIu64 "  total: %" PRIu64 " us  avg: %" PRIu64 " us  max: %" PRIu64
+		       " us  over budget: %" PRIu64 "\n",
+		       count,
+		       usec_total,
+		       count ? usec_total / count : 0,
+		       usec_max,
+		       stall_count);
+		printf("    histogram:");
+
+		for (i = 0; i < hist_size; i++) {
+			if ((r = rec_read_uint(reader, &hist_count)) < 0)
+				break;
+			if (!hist_count)
+				continue;
+			if (i == 0)
+				printf("  <1 us: %" PRIu64, hist_count);
+			else if (i == hist_size - 1)
+				printf("  >=%" PRIu64 " us: %" PRIu64, UINT64_C(1) << (i - 1), hist_count);
+			else
+				printf("  <%" PRIu64 " us: %" PRIu64, UINT64_C(1) << i, hist_count);
+		}
+		printf("\n");
+
+		if (r < 0)
+			break;
+	}
+
+	if (r < 0)
+		log_error_errno(LOG_PREFIX, r, "Failed to read event source statistics");
+
+	rec_reader_destroy(reader);
+	buffer_destroy(buf);
+	return r;
+}
+
+static int _usid_cmd_module_stats(struct args *args)
+{
+	struct buffer *         buf = NULL;
+	struct rec_reader *     reader;
+	size_t                  size, phase_name_size;
+	struct usid_msg_header *msg;
+	const char *            name, *phase_name;
+	uint64_t                phase_count, calls, failures, usec_total, usec_max;
+	int                     r;
+
+	if ((r = usid_req(LOG_PREFIX, USID_CMD_MODULE_STATS, 0, NULL, NULL, &buf)) < 0)
+		return r;
+
+	buffer_get_data(buf, (const void **) &msg, &size);
+	if (size < USID_MSG_HEADER_SIZE || msg->status & COMMAND_STATUS_FAILURE) {
+		buffer_destroy(buf);
+		return -1;
+	}
+	size -= USID_MSG_HEADER_SIZE;
+
+	if (!(reader = rec_reader_create(msg->data, size, &r))) {
+		buffer_destroy(buf);
+		return r;
+	}
+
+	/* the record fields are described in iface/usid.h */
+	while ((r = rec_read_key(reader, &name, NULL)) == 1) {
+		if ((r = rec_read_uint(reader, &phase_count)) < 0)
+			break;
+
+		printf("--- MODULE %s\n", name);
+
+		while (phase_count--) {
+			if ((r = rec_read_data(reader, (const void **) &phase_name, &phase_name_size)) < 0 ||
+			    (r = rec_read_uint(reader, &calls)) < 0 || (r = rec_read_uint(reader, &failures)) < 0 ||
+			    (r = rec_read_uint(reader, &usec_total)) < 0 || (r = rec_read_uint(reader, &usec_max)) < 0)
+				break;
+
+			if (!phase_name_size || phase_name[phase_name_size - 1]) {
+				r = -EBADMSG;
+				break;
+			}
+
+			printf("    %-18s calls: %" PRIu64 "  failed: %" PRIu64 "  total: %" PRIu64 " us  avg: %" PRIu64
+			       " us  max: %" PRIu64 " us\n",
+			       phase_name,
+			       calls,
+			       failures,
+			       usec_total,
+			       calls ? usec_total / calls : 0,
+			       usec_max);
+		}
+
+		if (r < 0)
+			break;
+	}
+
+	if (r < 0)
+		log_error_errno(LOG_PREFIX, r, "Failed to read module statistics");
+
+	rec_reader_destroy(reader);
+	buffer_destroy(buf);
+	return r;
+}
+
+#define STATS_FIELD(group, name) {group, #name, offsetof(struct usid_stats, name)}
+
+static const struct stats_field {
+	const char *group;
+	const char *name;
+	size_t      offset;
+} _stats_fields[] = {
+	STATS_FIELD("DAEMON", uptime_usec),
+	STATS_FIELD("DAEMON", connections),
+	STATS_FIELD("DAEMON", scan_requests),
+	STATS_FIELD("DAEMON", subscribers),
+	STATS_FIELD("DAEMON", startup_usec),
+	STATS_FIELD("DAEMON", modules_usec),
+	STATS_FIELD("DAEMON", modules_loaded),
+	STATS_FIELD("DAEMON", coldplug_devices),
+	STATS_FIELD("DAEMON", coldplug_failed),
+	STATS_FIELD("DAEMON", coldplug_usec),
+	STATS_FIELD("QUEUE", queue_depth),
+	STATS_FIELD("QUEUE", queue_depth_max),
+	STATS_FIELD("QUEUE", queued),
+	STATS_FIELD("QUEUE", superseded),
+	STATS_FIELD("QUEUE", throttled),
+	STATS_FIELD("QUEUE", queue_wait_usec_total),
+	STATS_FIELD("QUEUE", queue_wait_usec_max),
+	STATS_FIELD("WORKERS", workers_running),
+	STATS_FIELD("WORKERS", workers_idle),
+	STATS_FIELD("WORKERS", worker_pool_forks),
+	STATS_FIELD("WORKERS", worker_on_demand_forks),
+	STATS_FIELD("WORKERS", worker_pool_hits),
+	STATS_FIELD("WORKERS", worker_reuses),
+	STATS_FIELD("WORKERS", worker_idle_timeouts),
+	STATS_FIELD("SYNC", export_count),
+	STATS_FIELD("SYNC", export_bytes),
+	STATS_FIELD("SYNC", export_usec_total),
+	STATS_FIELD("SYNC", export_usec_max),
+	STATS_FIELD("SYNC", sync_count),
+	STATS_FIELD("SYNC", sync_records),
+	STATS_FIELD("SYNC", sync_usec_total),
+	STATS_FIELD("SYNC", sync_usec_max),
+	STATS_FIELD("STORE", kv_records),
+	STATS_FIELD("STORE", kv_image_pending),
+	STATS_FIELD("STORE", kv_radix_nodes),
+	STATS_FIELD("STORE", kv_radix_depth_max),
+	STATS_FIELD("STORE", kv_atom_entries),
+	STATS_FIELD("STORE", kv_atom_slots),
+	STATS_FIELD("STORE", kv_atom_chain_max),
+	STATS_FIELD("STORE", kv_garbage),
+	STATS_FIELD("STORE", kv_compactions),
+	STATS_FIELD("STORE", compact_usec_total),
+	STATS_FIELD("STORE", compact_usec_max),
+	STATS_FIELD("BUFFERS", buffer_count),
+	STATS_FIELD("BUFFERS", buffer_allocated),
+	STATS_FIELD("BUFFERS", buffer_used),
+};
+
+static int _print_stats_accounts(const void *data, size_t size, bool json)
+{
+	struct rec_reader *reader;
+	const char *       name;
+	uint64_t           records, bytes;
+	bool               first = true;
+	int                r;
+
+	if (!(reader = rec_reader_create(data, size, &r)))
+		return r;
+
+	if (json)
+		printf(",\n  \"accounts\": {");
+	else
+		printf("--- STORE ACCOUNTS\n");
+
+	/* the record fields are described in iface/usid.h */
+	while ((r = rec_read_key(reader, &name, NULL)) == 1) {
+		if ((r = rec_read_uint(reader, &records)) < 0 || (r = rec_read_uint(reader, &bytes)) < 0)
+			break;
+
+		if (json) {
+			printf("%s\n    \"%s\": {\"records\": %" PRIu64 ", \"bytes\": %" PRIu64 "}",
+			       first ? "" : ",",
+			       name,
+			       records,
+			       bytes);
+			first = false;
+		} else
+			printf("    %-24s records: %" PRIu64 "  bytes: %" PRIu64 "\n", name, records, bytes);
+	}
+
+	if (json)
+		printf("\n  }");
+
+	rec_reader_destroy(reader);
+	return r;
+}
+
+static int _usid_cmd_stats(struct args *args)
+{
+	struct buffer *         buf = NULL;
+	struct usid_msg_header *msg;
+	const char *            group = NULL;
+	size_t                  size, i;
+	uint64_t                stats_size, value;
+	bool                    json = false, first = true;
+	int                     opt, r;
+
+	struct option longopts[] = {
+		{"json", 0, NULL, 'j'},
+		{NULL, 0, NULL, 0},
+	};
+
+	optind = 1;
+	while ((opt = getopt_long(args->argc, args->argv, "j", longopts, NULL)) != EOF) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	if ((r = usid_req(LOG_PREFIX, USID_CMD_STATS, 0, NULL, NULL, &buf)) < 0)
+		return r;
+
+	buffer_get_data(buf, (const void **) &msg, &size);
+	if (size < USID_MSG_HEADER_SIZE + sizeof(stats_size) || msg->status & COMMAND_STATUS_FAILURE) {
+		buffer_destroy(buf);
+		return -1;
+	}
+	size -= USID_MSG_HEADER_SIZE;
+
+	/* the structure is packed and daemon may be older or newer, see struct usid_stats */
+	memcpy(&stats_size, msg->data, sizeof(stats_size));
+	if (stats_size > size) {
+		log_error(LOG_PREFIX, "Statistics truncated.");
+		buffer_destroy(buf);
+		return -EBADMSG;
+	}
+
+	if (json)
+		printf("{");
+
+	for (i = 0; i < sizeof(_stats_fields) / sizeof(_stats_fields[0]); i++) {
+		if (_stats_fields[i].offset + sizeof(value) > stats_size)
+			continue;
+
+		memcpy(&value, msg->data + _stats_fields[i].offset, sizeof(value));
+
+		if (json) {
+			printf("%s\n  \"%s\": %" PRIu64, first ? "" : ",", _stats_fields[i].name, value);
+			first = false;
+			continue;
+		}
+
+		if (!group || strcmp(group, _stats_fields[i].group)) {
+			group = _stats_fields[i].group;
+			printf("--- %s\n", group);
+		}
+
+		printf("    %-24s %" PRIu64 "\n", _stats_fields[i].name, value);
+	}
+
+	/* memory accounting of the database follows the structure */
+	if (size > stats_size && (r = _print_stats_accounts(msg->data + stats_size, size - stats_size, json)) < 0)
+		log_error_errno(LOG_PREFIX, r, "Failed to read database memory accounting");
+
+	if (json)
+		printf("\n}\n");
+
+	buffer_destroy(buf);
+	return r < 0 ? r : 0;
+}
+
 static void _help(FILE *f)
 {
 	fprintf(f,
@@ -170,10 +698,37 @@ static void _help(FILE *f)
 	        "      Output: USID_PROTOCOL/MAJOR/MINOR/RELEASE for USID version.\n"
 	        "              SID_PROTOCOL/MAJOR/MINOR/RELEASE for SID version.\n"
 	        "\n"
-	        "    dump\n"
+	        "    dump [-n|--namespace NS] [-d|--device MAJOR_MINOR] [-o|--owner MODULE] [-k|--key-prefix PREFIX]\n"
 	        "      Dump the SID daemon database.\n"
+	        "      Input:  Optional filter, only entries matching all given options are listed.\n"
+	        "      Output: Listing of database entries.\n"
+	        "\n"
+	        "    get -n|--namespace NS [-s|--ns-part NS_PART] [-D|--dom DOM] [-i|--id ID] [-p|--id-part ID_PART] KEY\n"
+	        "      Get one SID daemon database entry.\n"
+	        "      Input:  Key and its parts, e.g. 'get -n D -s 8_0 #RDY' for device 8:0 ready state.\n"
+	        "      Output: The database entry, the same as listed by dump, exits with failure if not found.\n"
+	        "\n"
+	        "    subscribe [KEY_PREFIX...]\n"
+	        "      Follow changes in the SID daemon database until interrupted.\n"
+	        "      Input:  Key prefixes to follow, all entries are followed if none given.\n"
+	        "      Output: Listing of changed database entries as they change, the same as listed by dump.\n"
+	        "\n"
+	        "    event-stats\n"
+	        "      Get dispatch counts and handler run times for event sources of SID daemon main loop.\n"
+	        "      Recorded only if SID daemon runs with SID_EVENT_STATS=1 in environment.\n"
+	        "      Input:  None.\n"
+	        "      Output: Listing of all event sources with run time histograms.\n"
+	        "\n"
+	        "    module-stats\n"
+	        "      Get call counts and run times of module functions for each scan phase.\n"
 	        "      Input:  None.\n"
-	        "      Output: Listing of all database entries.\n"
+	        "      Output: Listing of all modules which have been called with statistics for each phase.\n"
+	        "\n"
+	        "    stats [-j|--json]\n"
+	        "      Get runtime statistics of SID daemon: connections, queue, workers, database sync and memory.\n"
+	        "      Input:  Optional JSON output format.\n"
+	        "      Output: Listing of statistics in groups, or one JSON object with all the statistics,\n"
+	        "              including memory used by database records of each namespace and owner module.\n"
 	        "\n");
 }
 
@@ -232,6 +787,21 @@ int main(int argc, char *argv[])
 		case USID_CMD_DUMP:
 			r = _usid_cmd_dump(&subcmd_args);
 			break;
+		case USID_CMD_GET:
+			r = _usid_cmd_get(&subcmd_args);
+			break;
+		case USID_CMD_SUBSCRIBE:
+			r = _usid_cmd_subscribe(&subcmd_args);
+			break;
+		case USID_CMD_EVENT_STATS:
+			r = _usid_cmd_event_stats(&subcmd_args);
+			break;
+		case USID_CMD_MODULE_STATS:
+			r = _usid_cmd_module_stats(&subcmd_args);
+			break;
+		case USID_CMD_STATS:
+			r = _usid_cmd_stats(&subcmd_args);
+			break;
 		default:
 			_help(stderr);
 	}
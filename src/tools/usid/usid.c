@@ -26,6 +26,7 @@
 
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,6 +54,8 @@
 #define KEY_SID_MINOR    "SID_MINOR"
 #define KEY_SID_RELEASE  "SID_RELEASE"
 
+#define SCAN_BATCH_MAX 64 /* max devices sent in one USID_CMD_SCAN_BATCH request */
+
 struct args {
 	int    argc;
 	char **argv;
@@ -238,6 +241,203 @@ static int _usid_cmd_scan(struct args *args)
 	return r;
 }
 
+struct batch_dev {
+	char *         env; /* KEY=VALUE\0KEY=VALUE\0... */
+	size_t         env_size;
+	dev_t          devno;
+	uint64_t       seqnum;
+	uint32_t       req_id;
+	struct buffer *resp_buf;
+};
+
+struct batch {
+	struct batch_dev devs[SCAN_BATCH_MAX];
+	unsigned         count;
+};
+
+static void _free_batch_devs(struct batch *batch)
+{
+	unsigned i;
+
+	for (i = 0; i < batch->count; i++) {
+		free(batch->devs[i].env);
+		if (batch->devs[i].resp_buf)
+			buffer_destroy(batch->devs[i].resp_buf);
+	}
+
+	batch->count = 0;
+}
+
+/*
+ * Reads environment of one device as KEY=VALUE lines, devices are separated by an empty line.
+ * Returns 1 if a device is read, 0 if there are no more devices.
+ */
+static int _read_batch_dev(FILE *f, struct batch_dev *dev)
+{
+	unsigned long long major     = ULLONG_MAX;
+	unsigned long long minor     = ULLONG_MAX;
+	char *             line      = NULL;
+	size_t             line_size = 0;
+	char *             p;
+	ssize_t            len;
+	int                r = 0;
+
+	*dev = (struct batch_dev) {0};
+
+	while ((len = getline(&line, &line_size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (!len) {
+			if (dev->env_size)
+				break;
+			continue;
+		}
+
+		if (!strncmp(line, KEY_ENV_MAJOR "=", sizeof(KEY_ENV_MAJOR)))
+			major = strtoull(line + sizeof(KEY_ENV_MAJOR), NULL, 10);
+		else if (!strncmp(line, KEY_ENV_MINOR "=", sizeof(KEY_ENV_MINOR)))
+			minor = strtoull(line + sizeof(KEY_ENV_MINOR), NULL, 10);
+		else if (!strncmp(line, KEY_ENV_SEQNUM "=", sizeof(KEY_ENV_SEQNUM)))
+			dev->seqnum = strtoull(line + sizeof(KEY_ENV_SEQNUM), NULL, 10);
+
+		if (!(p = realloc(dev->env, dev->env_size + len + 1))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		memcpy(p + dev->env_size, line, len + 1);
+		dev->env = p;
+		dev->env_size += len + 1;
+	}
+
+	if (!dev->env_size)
+		goto out;
+
+	if (major > SYSTEM_MAX_MAJOR || minor > SYSTEM_MAX_MINOR) {
+		log_error(LOG_PREFIX, "Missing or invalid %s or %s in device environment.", KEY_ENV_MAJOR, KEY_ENV_MINOR);
+		r = -EINVAL;
+		goto out;
+	}
+
+	dev->devno = makedev(major, minor);
+	r          = 1;
+out:
+	free(line);
+	if (r <= 0) {
+		free(dev->env);
+		dev->env = NULL;
+	}
+	return r;
+}
+
+static int _add_scan_batch_to_buf(struct buffer *buf, void *data)
+{
+	struct batch *              batch = data;
+	struct batch_dev *          dev;
+	struct usid_scan_batch_item item;
+	unsigned                    i;
+	int                         r = 0;
+
+	for (i = 0; i < batch->count; i++) {
+		dev  = &batch->devs[i];
+		item = (struct usid_scan_batch_item) {.size   = USID_SCAN_BATCH_ITEM_SIZE + sizeof(dev->devno) + dev->env_size,
+		                                      .req_id = dev->req_id,
+		                                      .seqnum = dev->seqnum};
+
+		if (!buffer_add(buf, &item, sizeof(item), &r) || !buffer_add(buf, &dev->devno, sizeof(dev->devno), &r) ||
+		    !buffer_add(buf, dev->env, dev->env_size, &r))
+			break;
+	}
+
+	return r;
+}
+
+/*
+ * Sends the batch and waits for replies for all its devices which are then printed
+ * in the same order as the devices were read.
+ */
+static int _send_scan_batch(struct usid_conn *conn, struct batch *batch)
+{
+	struct buffer *buf;
+	uint32_t       batch_req_id, req_id, first_req_id;
+	unsigned       i, received;
+	int            r;
+
+	for (i = 0; i < batch->count; i++)
+		batch->devs[i].req_id = usid_conn_next_req_id(conn);
+
+	first_req_id = batch->devs[0].req_id;
+
+	if ((r = usid_conn_send(conn, USID_CMD_SCAN_BATCH, 0, _add_scan_batch_to_buf, batch, &batch_req_id)) < 0)
+		return r;
+
+	for (received = 0; received < batch->count;) {
+		if ((r = usid_conn_recv(conn, &req_id, &buf)) < 0)
+			return r;
+
+		/* only a failure is replied to the batch request itself */
+		if (req_id == batch_req_id) {
+			buffer_destroy(buf);
+			log_error(LOG_PREFIX, "Scan batch request failed.");
+			return -EIO;
+		}
+
+		if (req_id - first_req_id >= batch->count || batch->devs[req_id - first_req_id].resp_buf) {
+			buffer_destroy(buf);
+			log_error(LOG_PREFIX, "Unexpected reply with request ID %" PRIu32 ".", req_id);
+			return -EBADMSG;
+		}
+
+		batch->devs[req_id - first_req_id].resp_buf = buf;
+		received++;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		if ((r = _print_env_from_buffer(batch->devs[i].resp_buf)) < 0)
+			return r;
+		fprintf(stdout, "\n");
+	}
+
+	return 0;
+}
+
+static int _usid_cmd_scan_batch(struct args *args)
+{
+	struct usid_conn *conn;
+	struct batch *    batch;
+	int               r = 0;
+
+	if (!(batch = calloc(1, sizeof(*batch))))
+		return -ENOMEM;
+
+	if ((r = usid_conn_open(LOG_PREFIX, &conn)) < 0) {
+		free(batch);
+		return r;
+	}
+
+	/* all batches go through the same connection */
+	for (;;) {
+		while (batch->count < SCAN_BATCH_MAX && (r = _read_batch_dev(stdin, &batch->devs[batch->count])) > 0)
+			batch->count++;
+
+		if (r < 0 || !batch->count)
+			break;
+
+		r = _send_scan_batch(conn, batch);
+		_free_batch_devs(batch);
+
+		if (r < 0)
+			break;
+	}
+
+	_free_batch_devs(batch);
+	free(batch);
+	usid_conn_close(conn);
+
+	return r;
+}
+
 static int _usid_cmd_version(struct args *args)
 {
 	unsigned long long      val;
@@ -334,6 +534,13 @@ static void _help(FILE *f)
 	        "      Input:  Current command environment in KEY=VALUE format.\n"
 	        "      Output: Added or changed items in KEY=VALUE format.\n"
 	        "\n"
+	        "    scan-batch\n"
+	        "      Execute scanning phase in SID daemon for several devices at once.\n"
+	        "      Input:  Environments of devices on standard input in KEY=VALUE format,\n"
+	        "              separated by an empty line. Each must have MAJOR, MINOR and SEQNUM.\n"
+	        "      Output: Added or changed items in KEY=VALUE format for each device,\n"
+	        "              in the same order and separated by an empty line.\n"
+	        "\n"
 	        "    version\n"
 	        "      Get USID and SID daemon version.\n"
 	        "      Input:  None.\n"
@@ -408,6 +615,9 @@ int main(int argc, char *argv[])
 		case USID_CMD_SCAN:
 			r = _usid_cmd_scan(&subcmd_args);
 			break;
+		case USID_CMD_SCAN_BATCH:
+			r = _usid_cmd_scan_batch(&subcmd_args);
+			break;
 		case USID_CMD_VERSION:
 			r = _usid_cmd_version(&subcmd_args);
 			break;
@@ -19,10 +19,108 @@ static void test_invert_bitmap(void **state)
 	assert_int_equal(bitmap_get_bit_set_count(bitmap), 0);
 }
 
+static void test_bulk_ops(void **state)
+{
+	struct bitmap *a, *b, *c;
+	size_t         i, pos, count;
+	int            ret;
+
+	/* odd size so the last block is not full */
+	assert_non_null(a = bitmap_create(1000, false, &ret));
+	assert_non_null(b = bitmap_create(1000, true, &ret));
+	assert_non_null(c = bitmap_create(999, false, &ret));
+
+	for (i = 0; i < 1000; i += 3)
+		assert_int_equal(bitmap_bit_set(a, i), 0);
+	for (i = 0; i < 1000; i += 2)
+		assert_int_equal(bitmap_bit_unset(b, i), 0);
+
+	assert_int_equal(bitmap_and(a, c), -EINVAL);
+
+	/* a has every 3rd bit, b has every odd bit */
+	assert_int_equal(bitmap_and(a, b), 0);
+	for (i = 0; i < 1000; i++)
+		assert_int_equal(bitmap_bit_is_set(a, i, NULL), i % 3 == 0 && i % 2 == 1);
+	assert_int_equal(bitmap_get_bit_set_count(a), 167);
+
+	assert_int_equal(bitmap_or(a, b), 0);
+	assert_int_equal(bitmap_get_bit_set_count(a), 500);
+
+	assert_int_equal(bitmap_andnot(a, b), 0);
+	assert_int_equal(bitmap_get_bit_set_count(a), 0);
+	assert_int_equal(bitmap_find_next_set(a, 0), 1000);
+
+	/* inverted bitmap must not count bits beyond its size */
+	assert_int_equal(bitmap_andnot(b, a), 0);
+	assert_int_equal(bitmap_get_bit_set_count(b), 500);
+
+	count = 0;
+	bitmap_iterate_set (pos, b) {
+		assert_int_equal(pos % 2, 1);
+		count++;
+	}
+	assert_int_equal(count, 500);
+
+	assert_int_equal(bitmap_find_next_set(b, 0), 1);
+	assert_int_equal(bitmap_find_next_set(b, 1), 1);
+	assert_int_equal(bitmap_find_next_set(b, 64), 65);
+	assert_int_equal(bitmap_find_next_set(b, 999), 999);
+	assert_int_equal(bitmap_find_next_set(b, 1000), 1000);
+
+	bitmap_destroy(a);
+	bitmap_destroy(b);
+	bitmap_destroy(c);
+}
+
+/*
+ * Checks bulk operation and set bit iteration give the same results as the
+ * equivalent done bit by bit. Every 16th bit is set in the sparse bitmap.
+ */
+static void test_bulk_ops_sparse(void **state)
+{
+	static const size_t sizes[] = {64, 1000, 10000, 100000};
+	struct bitmap *     a, *b, *c;
+	size_t              i, j, pos, sum_bit, sum_set;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		assert_non_null(a = bitmap_create(sizes[i], true, NULL));
+		assert_non_null(b = bitmap_create(sizes[i], false, NULL));
+		assert_non_null(c = bitmap_create(sizes[i], true, NULL));
+		for (j = 0; j < sizes[i]; j += 16)
+			bitmap_bit_set(b, j);
+
+		for (j = 0; j < sizes[i]; j++)
+			if (bitmap_bit_is_set(b, j, NULL))
+				bitmap_bit_unset(a, j);
+
+		bitmap_andnot(c, b);
+
+		sum_bit = 0;
+		for (j = 0; j < sizes[i]; j++) {
+			assert_int_equal(bitmap_bit_is_set(c, j, NULL), bitmap_bit_is_set(a, j, NULL));
+			if (bitmap_bit_is_set(b, j, NULL))
+				sum_bit += j;
+		}
+
+		sum_set = 0;
+		bitmap_iterate_set (pos, b)
+			sum_set += pos;
+
+		assert_int_equal(sum_bit, sum_set);
+		assert_int_equal(bitmap_get_bit_set_count(c), sizes[i] - bitmap_get_bit_set_count(b));
+
+		bitmap_destroy(a);
+		bitmap_destroy(b);
+		bitmap_destroy(c);
+	}
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_invert_bitmap),
+		cmocka_unit_test(test_bulk_ops),
+		cmocka_unit_test(test_bulk_ops_sparse),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
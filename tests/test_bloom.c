@@ -0,0 +1,71 @@
+#include <base/bloom.h>
+#include <base/hash.h>
+#include <cmocka.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_KEY_COUNT 1000
+
+static uint64_t _key_hash(const char *prefix, int i)
+{
+	char key[32];
+	int  len = snprintf(key, sizeof(key), "%s%d", prefix, i);
+
+	return hash_compute(key, len + 1);
+}
+
+static void test_bloom_add(void **state)
+{
+	struct bloom *b = bloom_create(TEST_KEY_COUNT * 10, 7);
+	int           i, false_positives = 0;
+
+	assert_non_null(b);
+	assert_true(bloom_get_bit_count(b) >= TEST_KEY_COUNT * 10);
+
+	for (i = 0; i < TEST_KEY_COUNT; i++)
+		bloom_add(b, _key_hash("key", i));
+
+	/* no false negatives */
+	for (i = 0; i < TEST_KEY_COUNT; i++)
+		assert_true(bloom_may_contain(b, _key_hash("key", i)));
+
+	for (i = 0; i < TEST_KEY_COUNT; i++)
+		if (bloom_may_contain(b, _key_hash("other", i)))
+			false_positives++;
+
+	/* expected rate is about 1% */
+	assert_true(false_positives < TEST_KEY_COUNT / 20);
+
+	bloom_clear(b);
+	for (i = 0; i < TEST_KEY_COUNT; i++)
+		assert_false(bloom_may_contain(b, _key_hash("key", i)));
+
+	bloom_destroy(b);
+}
+
+static void test_bloom_small(void **state)
+{
+	struct bloom *b = bloom_create(1, 1);
+
+	assert_non_null(b);
+	assert_int_equal(bloom_get_bit_count(b), 64);
+	assert_false(bloom_may_contain(b, _key_hash("key", 0)));
+	bloom_add(b, _key_hash("key", 0));
+	assert_true(bloom_may_contain(b, _key_hash("key", 0)));
+	bloom_destroy(b);
+
+	assert_null(bloom_create(64, 0));
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_bloom_add),
+		cmocka_unit_test(test_bloom_small),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
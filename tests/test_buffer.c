@@ -1,10 +1,19 @@
+#include "base/common.h"
+
 #include "base/buffer.h"
 
 #include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define TEST_STR   "foo"
 #define TEST_SIZE  sizeof(TEST_STR)
@@ -13,6 +22,9 @@
 #define TEST_STR3  "quux"
 #define TEST_SIZE3 sizeof(TEST_STR3)
 
+#define TEST_ITEM_COUNT 10000 /* more than IOV_MAX */
+#define TEST_ITEM_SIZE  8
+
 int test_fmt_add(int buf_size)
 {
 	int            r   = 0;
@@ -41,6 +53,31 @@ static void test_no_realloc_fmt_add(void **state)
 	test_fmt_add(8);
 }
 
+static void test_join_add(void **state)
+{
+	struct buffer *   buf;
+	const char *      str;
+	struct buffer_str parts[] = {{TEST_STR, TEST_SIZE - 1}, {NULL, 0}, {TEST_STR2, TEST_SIZE2 - 1}};
+
+	buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC, .type = BUFFER_TYPE_LINEAR, .mode = BUFFER_MODE_PLAIN}),
+		&((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+		NULL);
+	assert_non_null(buf);
+
+	assert_non_null(str = buffer_join_add(buf, NULL, ":", parts, 3));
+	assert_string_equal(str, TEST_STR "::" TEST_STR2);
+
+	assert_non_null(str = buffer_join_add(buf, NULL, NULL, parts, 3));
+	assert_string_equal(str, TEST_STR TEST_STR2);
+
+	assert_non_null(str = buffer_join_add(buf, NULL, ":", parts, 0));
+	assert_string_equal(str, "");
+
+	assert_int_equal(buffer_stat(buf).usage.used, sizeof(TEST_STR "::" TEST_STR2) + sizeof(TEST_STR TEST_STR2) + 1);
+	buffer_destroy(buf);
+}
+
 static const void *do_rewind_test(struct buffer *buf)
 {
 	const void *rewind_mem;
@@ -116,15 +153,271 @@ static void test_vector_zero_add(void **state)
 	do_test_zero_add(buf);
 }
 
+static void test_linear_clear(void **state)
+{
+	struct buffer *buf;
+	char *         data;
+	size_t         data_size, allocated;
+
+	buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC, .type = BUFFER_TYPE_LINEAR, .mode = BUFFER_MODE_SIZE_PREFIX}),
+		&((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+		NULL);
+	assert_non_null(buf);
+	assert_non_null(buffer_add(buf, TEST_STR2, TEST_SIZE2, NULL));
+	allocated = buffer_stat(buf).usage.allocated;
+
+	assert_int_equal(buffer_clear(buf), 0);
+	assert_int_equal(buffer_stat(buf).usage.used, 0);
+	assert_int_equal(buffer_stat(buf).usage.allocated, allocated);
+
+	assert_non_null(buffer_add(buf, TEST_STR, TEST_SIZE, NULL));
+	assert_int_equal(buffer_stat(buf).usage.allocated, allocated);
+	assert_int_equal(buffer_get_data(buf, (const void **) &data, &data_size), 0);
+	assert_int_equal(data_size, TEST_SIZE);
+	assert_string_equal(data, TEST_STR);
+	buffer_destroy(buf);
+}
+
+static void test_vector_alloc_factor(void **state)
+{
+	struct buffer *buf;
+	static char    item;
+	int            i;
+
+	buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC, .type = BUFFER_TYPE_VECTOR, .mode = BUFFER_MODE_PLAIN}),
+		&((struct buffer_init) {.size = 1, .alloc_step = 1, .limit = 0, .alloc_factor = 2}),
+		NULL);
+	assert_non_null(buf);
+
+	for (i = 0; i < TEST_ITEM_COUNT; i++)
+		assert_non_null(buffer_add(buf, &item, sizeof(item), NULL));
+
+	/* doubled from 1 each time the buffer was full */
+	assert_int_equal(buffer_stat(buf).usage.used, TEST_ITEM_COUNT);
+	assert_int_equal(buffer_stat(buf).usage.allocated, 16384);
+	buffer_destroy(buf);
+}
+
+static void test_vector_write_large(void **state)
+{
+	static char          items[TEST_ITEM_COUNT][TEST_ITEM_SIZE];
+	static char          data[MSG_SIZE_PREFIX_LEN + sizeof(items)];
+	struct buffer *      buf;
+	MSG_SIZE_PREFIX_TYPE size_prefix;
+	size_t               pos = 0, received = 0;
+	ssize_t              n;
+	int                  pipe_fds[2], i;
+
+	assert_true(TEST_ITEM_COUNT > IOV_MAX);
+	assert_int_equal(pipe2(pipe_fds, O_NONBLOCK), 0);
+
+	buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+		                         .type    = BUFFER_TYPE_VECTOR,
+		                         .mode    = BUFFER_MODE_SIZE_PREFIX}),
+		&((struct buffer_init) {.size = 1, .alloc_step = 1, .limit = 0, .alloc_factor = 2}),
+		NULL);
+	assert_non_null(buf);
+
+	for (i = 0; i < TEST_ITEM_COUNT; i++) {
+		snprintf(items[i], TEST_ITEM_SIZE, "%07d", i);
+		assert_non_null(buffer_add(buf, items[i], TEST_ITEM_SIZE, NULL));
+	}
+
+	/* the data do not fit in the pipe at once so this also resumes after partial writes */
+	while ((n = buffer_write(buf, pipe_fds[1], pos)) != -ENODATA) {
+		if (n > 0)
+			pos += n;
+		else
+			assert_int_equal(n, -EAGAIN);
+
+		while ((n = read(pipe_fds[0], data + received, sizeof(data) - received)) > 0)
+			received += n;
+	}
+
+	assert_int_equal(pos, sizeof(data));
+	assert_int_equal(received, sizeof(data));
+
+	memcpy(&size_prefix, data, sizeof(size_prefix));
+	assert_int_equal(size_prefix, sizeof(data));
+	assert_memory_equal(data + MSG_SIZE_PREFIX_LEN, items, sizeof(items));
+
+	buffer_destroy(buf);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+/* check that fd is sealed and that it contains exactly TEST_STR with size prefix */
+static void _assert_detached_fd(int fd)
+{
+	char                 data[MSG_SIZE_PREFIX_LEN + TEST_SIZE + 1];
+	MSG_SIZE_PREFIX_TYPE size_prefix;
+
+	assert_true(fd >= 0);
+	assert_int_equal(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE, F_SEAL_WRITE);
+	assert_int_equal(write(fd, "x", 1), -1);
+
+	assert_int_equal(pread(fd, data, sizeof(data), 0), MSG_SIZE_PREFIX_LEN + TEST_SIZE);
+	memcpy(&size_prefix, data, sizeof(size_prefix));
+	assert_int_equal(size_prefix, MSG_SIZE_PREFIX_LEN + TEST_SIZE);
+	assert_string_equal(data + MSG_SIZE_PREFIX_LEN, TEST_STR);
+
+	close(fd);
+}
+
+static void _test_detach_fd(buffer_type_t type)
+{
+	struct buffer *buf;
+	const void *   data;
+	size_t         size;
+
+	buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MEMFD, .type = type, .mode = BUFFER_MODE_SIZE_PREFIX}),
+		&((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+		NULL);
+	assert_non_null(buf);
+
+	assert_non_null(buffer_add(buf, TEST_STR, TEST_SIZE, NULL));
+	_assert_detached_fd(buffer_detach_fd(buf));
+
+	/* the buffer is empty, but usable again */
+	assert_int_equal(buffer_get_data(buf, &data, &size), 0);
+	assert_non_null(buffer_add(buf, TEST_STR, TEST_SIZE, NULL));
+	_assert_detached_fd(buffer_detach_fd(buf));
+
+	buffer_destroy(buf);
+}
+
+static void test_linear_detach_fd(void **state)
+{
+	_test_detach_fd(BUFFER_TYPE_LINEAR);
+}
+
+static void test_vector_detach_fd(void **state)
+{
+	_test_detach_fd(BUFFER_TYPE_VECTOR);
+}
+
+static struct buffer *_create_ring(buffer_backend_t backend, size_t size, bool overwrite)
+{
+	struct buffer *buf;
+
+	buf = buffer_create(&((struct buffer_spec) {.backend = backend, .type = BUFFER_TYPE_RING, .mode = BUFFER_MODE_PLAIN}),
+	                    &((struct buffer_init) {.size = size, .ring_overwrite = overwrite}),
+	                    NULL);
+	assert_non_null(buf);
+	return buf;
+}
+
+static void test_ring_full(void **state)
+{
+	struct buffer *buf;
+	char           data[TEST_SIZE2];
+	int            r, i;
+
+	/* room for exactly two records of TEST_SIZE with their headers */
+	buf = _create_ring(BUFFER_BACKEND_MALLOC, 2 * (sizeof(uint32_t) + TEST_SIZE), false);
+
+	/* go around the end several times */
+	for (i = 0; i < 8; i++) {
+		assert_non_null(buffer_add(buf, TEST_STR, TEST_SIZE, NULL));
+		assert_non_null(buffer_add(buf, TEST_STR, TEST_SIZE, NULL));
+		assert_null(buffer_add(buf, TEST_STR, TEST_SIZE, &r));
+		assert_int_equal(r, -EAGAIN);
+
+		assert_int_equal(buffer_take(buf, data, sizeof(data)), TEST_SIZE);
+		assert_string_equal(data, TEST_STR);
+		assert_non_null(buffer_fmt_add(buf, &r, "%s", TEST_STR));
+		assert_int_equal(buffer_take(buf, data, 1), -ENOBUFS);
+		assert_int_equal(buffer_take(buf, data, sizeof(data)), TEST_SIZE);
+		assert_int_equal(buffer_take(buf, data, sizeof(data)), TEST_SIZE);
+		assert_string_equal(data, TEST_STR);
+		assert_int_equal(buffer_take(buf, data, sizeof(data)), -ENODATA);
+	}
+
+	/* a record never fits if it does not fit in empty buffer */
+	assert_null(buffer_add(buf, data, 2 * (sizeof(uint32_t) + TEST_SIZE), &r));
+	assert_int_equal(r, -EMSGSIZE);
+
+	buffer_destroy(buf);
+}
+
+static void test_ring_overwrite(void **state)
+{
+	struct buffer *buf;
+	char           data[TEST_SIZE];
+	int            i;
+
+	buf = _create_ring(BUFFER_BACKEND_MALLOC, 3 * (sizeof(uint32_t) + TEST_SIZE), true);
+
+	for (i = 0; i < 10; i++) {
+		snprintf(data, sizeof(data), "%03d", i);
+		assert_non_null(buffer_add(buf, data, sizeof(data), NULL));
+	}
+
+	/* only the last three remain */
+	for (i = 7; i < 10; i++) {
+		assert_int_equal(buffer_take(buf, data, sizeof(data)), sizeof(data));
+		assert_int_equal(atoi(data), i);
+	}
+
+	assert_int_equal(buffer_take(buf, data, sizeof(data)), -ENODATA);
+	buffer_destroy(buf);
+}
+
+static void test_ring_memfd_shared(void **state)
+{
+	struct buffer *buf;
+	uint32_t       value, expected = 0;
+	int            status, r;
+	pid_t          pid;
+
+	buf = _create_ring(BUFFER_BACKEND_MEMFD, 64, false);
+
+	/* child produces through the shared mapping, parent consumes in parallel */
+	assert_true((pid = fork()) >= 0);
+	if (pid == 0) {
+		for (value = 0; value < TEST_ITEM_COUNT;) {
+			if (buffer_add(buf, &value, sizeof(value), &r))
+				value++;
+			else if (r != -EAGAIN)
+				_exit(1);
+		}
+		_exit(0);
+	}
+
+	while (expected < TEST_ITEM_COUNT) {
+		if ((r = buffer_take(buf, &value, sizeof(value))) == -ENODATA)
+			continue;
+		assert_int_equal(r, sizeof(value));
+		assert_int_equal(value, expected++);
+	}
+
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	buffer_destroy(buf);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_realloc_fmt_add),
 		cmocka_unit_test(test_no_realloc_fmt_add),
+		cmocka_unit_test(test_join_add),
 		cmocka_unit_test(test_linear_rewind_mem),
 		cmocka_unit_test(test_vector_rewind_mem),
 		cmocka_unit_test(test_linear_zero_add),
 		cmocka_unit_test(test_vector_zero_add),
+		cmocka_unit_test(test_linear_clear),
+		cmocka_unit_test(test_vector_alloc_factor),
+		cmocka_unit_test(test_vector_write_large),
+		cmocka_unit_test(test_linear_detach_fd),
+		cmocka_unit_test(test_vector_detach_fd),
+		cmocka_unit_test(test_ring_full),
+		cmocka_unit_test(test_ring_overwrite),
+		cmocka_unit_test(test_ring_memfd_shared),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,143 @@
+#include "base/common.h"
+
+#include <base/comms.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_FD_COUNT  3
+#define TEST_MSG_COUNT 4
+
+static void _socketpair(int fds[2])
+{
+	assert_int_equal(socketpair(AF_LOCAL, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds), 0);
+}
+
+/* check that fd_received refers to the same file as fd_sent */
+static void _assert_same_file(int fd_sent, int fd_received)
+{
+	char buf[8];
+
+	assert_true(fd_received >= 0);
+	assert_int_not_equal(fd_sent, fd_received);
+	assert_int_equal(write(fd_received, "x", 1), 1);
+	assert_int_equal(read(fd_sent, buf, sizeof(buf)), 1);
+	assert_int_equal(close(fd_received), 0);
+}
+
+static void test_comms_send_recv(void **state)
+{
+	int          sock[2], pipe_fds[2], fd_received;
+	char         buf[16];
+	struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+
+	_socketpair(sock);
+	assert_int_equal(pipe2(pipe_fds, O_CLOEXEC), 0);
+
+	assert_int_equal(comms_unix_send(sock[0], "hello", 6, -1), 6);
+	assert_int_equal(comms_unix_recv(sock[1], buf, sizeof(buf), &fd_received), 6);
+	assert_int_equal(fd_received, -1);
+	assert_string_equal(buf, "hello");
+
+	assert_int_equal(comms_unix_send(sock[0], "fd", 3, pipe_fds[1]), 3);
+	assert_int_equal(comms_unix_recv_iovec(sock[1], &iov, 1, &fd_received), 3);
+	assert_string_equal(buf, "fd");
+	_assert_same_file(pipe_fds[0], fd_received);
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	close(sock[0]);
+	close(sock[1]);
+}
+
+static void test_comms_send_recv_fds(void **state)
+{
+	int          sock[2], pipes[TEST_FD_COUNT][2], fds[TEST_FD_COUNT], fds_received[TEST_FD_COUNT + 1];
+	unsigned     fd_count = TEST_FD_COUNT + 1;
+	char         byte     = 0xFF;
+	struct iovec iov      = {.iov_base = &byte, .iov_len = sizeof(byte)};
+	int          i;
+
+	_socketpair(sock);
+
+	for (i = 0; i < TEST_FD_COUNT; i++) {
+		assert_int_equal(pipe2(pipes[i], O_CLOEXEC), 0);
+		fds[i] = pipes[i][1];
+	}
+
+	assert_int_equal(comms_unix_send_fds(sock[0], &iov, 1, fds, TEST_FD_COUNT), 1);
+	assert_int_equal(comms_unix_recv_fds(sock[1], &iov, 1, fds_received, &fd_count), 1);
+	assert_int_equal(fd_count, TEST_FD_COUNT);
+
+	for (i = 0; i < TEST_FD_COUNT; i++) {
+		_assert_same_file(pipes[i][0], fds_received[i]);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+
+	assert_int_equal(comms_unix_send_fds(sock[0], &iov, 1, fds, COMMS_UNIX_FDS_MAX + 1), -EINVAL);
+
+	close(sock[0]);
+	close(sock[1]);
+}
+
+static void test_comms_mmsg(void **state)
+{
+	int                   sock[2], pipes[TEST_MSG_COUNT][2], fds_received[TEST_MSG_COUNT];
+	char                  data[TEST_MSG_COUNT][8], bufs[TEST_MSG_COUNT][8];
+	struct iovec          iov[TEST_MSG_COUNT], iov_recv[TEST_MSG_COUNT];
+	struct comms_unix_msg msgs[TEST_MSG_COUNT], msgs_recv[TEST_MSG_COUNT];
+	int                   i;
+
+	_socketpair(sock);
+
+	/* every other message passes an fd */
+	for (i = 0; i < TEST_MSG_COUNT; i++) {
+		assert_int_equal(pipe2(pipes[i], O_CLOEXEC), 0);
+		snprintf(data[i], sizeof(data[i]), "msg%d", i);
+
+		iov[i]  = (struct iovec) {.iov_base = data[i], .iov_len = strlen(data[i]) + 1};
+		msgs[i] = (struct comms_unix_msg) {.iov = &iov[i], .iov_len = 1, .fds = &pipes[i][1], .fd_count = i % 2};
+
+		iov_recv[i]  = (struct iovec) {.iov_base = bufs[i], .iov_len = sizeof(bufs[i])};
+		msgs_recv[i] = (struct comms_unix_msg) {.iov = &iov_recv[i], .iov_len = 1, .fds = &fds_received[i], .fd_count = 1};
+	}
+
+	assert_int_equal(comms_unix_send_mmsg(sock[0], msgs, TEST_MSG_COUNT), TEST_MSG_COUNT);
+	assert_int_equal(comms_unix_recv_mmsg(sock[1], msgs_recv, TEST_MSG_COUNT), TEST_MSG_COUNT);
+
+	for (i = 0; i < TEST_MSG_COUNT; i++) {
+		assert_int_equal(msgs[i].len, iov[i].iov_len);
+		assert_int_equal(msgs_recv[i].len, iov[i].iov_len);
+		assert_string_equal(bufs[i], data[i]);
+		assert_int_equal(msgs_recv[i].fd_count, i % 2);
+
+		if (i % 2)
+			_assert_same_file(pipes[i][0], fds_received[i]);
+
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+
+	assert_int_equal(comms_unix_send_mmsg(sock[0], msgs, 0), 0);
+
+	close(sock[0]);
+	close(sock[1]);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_comms_send_recv),
+		cmocka_unit_test(test_comms_send_recv_fds),
+		cmocka_unit_test(test_comms_mmsg),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,9 +1,12 @@
+#include "base/arena.h"
 #include "base/hash.h"
 
 #include <cmocka.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -80,11 +83,221 @@ static void test_hash_lookup()
 	hash_destroy(t);
 }
 
+static int _remove_odd_fn(const void *key,
+                          uint32_t    key_len,
+                          void *      old_data,
+                          size_t      old_data_len,
+                          void **     new_data,
+                          size_t *    new_data_len,
+                          void *      arg)
+{
+	unsigned *calls = arg;
+
+	(*calls)++;
+
+	if (!old_data)
+		return HASH_UPDATE_KEEP;
+
+	return atoi(old_data) % 2 ? HASH_UPDATE_REMOVE : HASH_UPDATE_KEEP;
+}
+
+static void test_hash_max_chain_len()
+{
+	struct hash_table *t = hash_create(1);
+	int                i;
+
+	assert_non_null(t);
+	assert_int_equal(hash_get_max_chain_len(t), 0);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(hash_insert(t, test_array[i], strlen(test_array[i]) + 1, test_array[i], 0), 0);
+
+	assert_true(hash_get_max_chain_len(t) >= 1);
+	assert_true(hash_get_max_chain_len(t) <= KEY_COUNT);
+
+	hash_wipe(t);
+	assert_int_equal(hash_get_max_chain_len(t), 0);
+
+	hash_destroy(t);
+}
+
+static void test_hash_update_remove()
+{
+	struct hash_table *t     = hash_create(5);
+	unsigned           calls = 0;
+
+	for (int i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(hash_insert(t, test_array[i], strlen(test_array[i]) + 1, test_array[i], strlen(test_array[i]) + 1),
+		                 0);
+
+	for (int i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(hash_update(t, test_array[i], strlen(test_array[i]) + 1, NULL, NULL, _remove_odd_fn, &calls), 0);
+
+	assert_int_equal(calls, KEY_COUNT);
+	assert_int_equal(hash_get_num_entries(t), KEY_COUNT / 2);
+
+	for (int i = 0; i < KEY_COUNT; i++)
+		assert_ptr_equal(hash_lookup(t, test_array[i], strlen(test_array[i]) + 1, NULL), i % 2 ? test_array[i] : NULL);
+
+	/* removing non-existing key is a no-op */
+	assert_int_equal(hash_update(t, "11", sizeof("11"), NULL, NULL, _remove_odd_fn, &calls), 0);
+	assert_int_equal(hash_get_num_entries(t), KEY_COUNT / 2);
+
+	hash_destroy(t);
+}
+
+#define RESIZE_KEY_COUNT 1000
+
+static void test_hash_arena()
+{
+	struct arena *     a = arena_create(4096);
+	struct hash_table *t = hash_create_with_params(16, &((struct hash_params) {.grow_load = 100, .arena = a}));
+	char               key[16];
+	size_t             data_len;
+	unsigned           i;
+
+	assert_non_null(t);
+
+	for (i = 0; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		assert_int_equal(hash_insert(t, key, strlen(key) + 1, a, i), 0);
+	}
+
+	for (i = 0; i < RESIZE_KEY_COUNT; i += 2) {
+		snprintf(key, sizeof(key), "key%u", i);
+		hash_remove(t, key, strlen(key) + 1);
+	}
+
+	assert_int_equal(hash_get_num_entries(t), RESIZE_KEY_COUNT / 2);
+
+	for (i = 0; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (i % 2) {
+			assert_ptr_equal(hash_lookup(t, key, strlen(key) + 1, &data_len), a);
+			assert_int_equal(data_len, i);
+		} else
+			assert_null(hash_lookup(t, key, strlen(key) + 1, NULL));
+	}
+
+	/* a single arena_destroy releases all the nodes, checked by leak sanitizer if enabled */
+	hash_destroy(t);
+	assert_true(arena_get_size(a) >= 4096);
+	arena_destroy(a);
+}
+
+static void test_hash_resize()
+{
+	struct hash_table *t = hash_create_with_params(16, &((struct hash_params) {.grow_load = 100, .shrink_load = 25}));
+	struct hash_node * n;
+	char               key[16];
+	unsigned           count;
+	int                i;
+
+	assert_non_null(t);
+
+	for (i = 0; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		assert_int_equal(hash_insert(t, key, strlen(key) + 1, (void *) (intptr_t) (i + 1), 0), 0);
+
+		/* all entries must be reachable while resize is in progress */
+		if (i % 97 == 0) {
+			count = 0;
+			hash_iterate (n, t)
+				count++;
+			assert_int_equal(count, i + 1);
+		}
+	}
+
+	assert_int_equal(hash_get_num_entries(t), RESIZE_KEY_COUNT);
+	assert_true(hash_get_num_slots(t) >= RESIZE_KEY_COUNT);
+	assert_true(hash_get_max_chain_len(t) >= 1);
+	assert_true(hash_get_max_chain_len(t) < RESIZE_KEY_COUNT);
+
+	for (i = 0; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		assert_int_equal((intptr_t) hash_lookup(t, key, strlen(key) + 1, NULL), i + 1);
+	}
+
+	for (i = 0; i < RESIZE_KEY_COUNT - 10; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		hash_remove(t, key, strlen(key) + 1);
+	}
+
+	assert_int_equal(hash_get_num_entries(t), 10);
+	assert_true(hash_get_num_slots(t) < RESIZE_KEY_COUNT);
+
+	for (i = RESIZE_KEY_COUNT - 10; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		assert_int_equal((intptr_t) hash_lookup(t, key, strlen(key) + 1, NULL), i + 1);
+	}
+
+	hash_destroy(t);
+
+	/* shrink threshold too close to grow threshold */
+	assert_null(hash_create_with_params(16, &((struct hash_params) {.grow_load = 100, .shrink_load = 50})));
+}
+
+static void test_hash_iterate_modify()
+{
+	struct hash_table *t = hash_create_with_params(16, &((struct hash_params) {.grow_load = 100, .shrink_load = 25}));
+	struct hash_node * n;
+	unsigned char      seen[RESIZE_KEY_COUNT] = {0};
+	char               key[16];
+	intptr_t           i;
+	int                added = 0;
+
+	assert_non_null(t);
+
+	for (i = 0; i < RESIZE_KEY_COUNT / 2; i++) {
+		snprintf(key, sizeof(key), "%d", (int) i);
+		assert_int_equal(hash_insert(t, key, strlen(key) + 1, (void *) i, 0), 0);
+	}
+
+	/* adding entries would grow the table and migrate the slots while iterating */
+	hash_rehash_pause(t);
+
+	hash_iterate (n, t) {
+		i = (intptr_t) hash_get_data(t, n, NULL);
+		if (i < RESIZE_KEY_COUNT / 2)
+			seen[i]++;
+
+		if (added < RESIZE_KEY_COUNT / 2) {
+			snprintf(key, sizeof(key), "%d", RESIZE_KEY_COUNT / 2 + added);
+			assert_int_equal(hash_insert(t, key, strlen(key) + 1, (void *) (intptr_t) (RESIZE_KEY_COUNT / 2 + added), 0),
+			                 0);
+			added++;
+		}
+	}
+
+	hash_rehash_resume(t);
+
+	for (i = 0; i < RESIZE_KEY_COUNT / 2; i++)
+		assert_int_equal(seen[i], 1);
+
+	assert_int_equal(hash_get_num_entries(t), RESIZE_KEY_COUNT / 2 + added);
+
+	/* the table grows once modified again */
+	snprintf(key, sizeof(key), "%d", RESIZE_KEY_COUNT);
+	assert_int_equal(hash_insert(t, key, strlen(key) + 1, NULL, 0), 0);
+	for (i = 0; i < RESIZE_KEY_COUNT; i++) {
+		snprintf(key, sizeof(key), "%d", (int) i);
+		hash_remove(t, key, strlen(key) + 1);
+	}
+	assert_int_equal(hash_get_num_entries(t), 1);
+
+	hash_destroy(t);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_hash_add),
 		cmocka_unit_test(test_hash_lookup),
+		cmocka_unit_test(test_hash_update_remove),
+		cmocka_unit_test(test_hash_max_chain_len),
+		cmocka_unit_test(test_hash_resize),
+		cmocka_unit_test(test_hash_iterate_modify),
+		cmocka_unit_test(test_hash_arena),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -1,3 +1,6 @@
+#include "base/common.h"
+
+#include <fcntl.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -13,7 +16,8 @@ static void test_type_G(void **state)
 	struct iovec           test_iov[] = {{"test", sizeof("test")}, {"value", sizeof("value")}};
 	size_t                 size       = sizeof(test_iov) / sizeof(test_iov[0]);
 	size_t                 value_size;
-	struct kv_store_value *value = _create_kv_store_value(test_iov,
+	struct kv_store_value *value = _create_kv_store_value(NULL,
+	                                                      test_iov,
 	                                                      size,
 	                                                      KV_STORE_VALUE_REF | KV_STORE_VALUE_VECTOR,
 	                                                      KV_STORE_VALUE_NO_OP,
@@ -36,7 +40,8 @@ static void test_type_H(void **state)
 	int                    i;
 
 	memcpy(old_iov, test_iov, sizeof(old_iov));
-	value = _create_kv_store_value(test_iov,
+	value = _create_kv_store_value(NULL,
+	                               test_iov,
 	                               size,
 	                               KV_STORE_VALUE_REF | KV_STORE_VALUE_VECTOR,
 	                               KV_STORE_VALUE_OP_MERGE,
@@ -55,11 +60,582 @@ static void test_type_H(void **state)
 	}
 }
 
+static struct kv_store *test_kv_store;
+
+void *__wrap_sid_resource_get_data(sid_resource_t *res)
+{
+	return test_kv_store;
+}
+
+static void _set_int(const char *key, int value)
+{
+	assert_ptr_not_equal(
+		kv_store_set_value(NULL, key, &value, sizeof(value), KV_STORE_VALUE_NO_FLAGS, KV_STORE_VALUE_NO_OP, NULL, NULL),
+		NULL);
+}
+
+static void _check_iter(kv_store_iter_t *iter, const char **keys, const int *values, int count)
+{
+	int *value;
+	int  i = 0;
+
+	kv_store_iter_reset(iter);
+	while ((value = kv_store_iter_next(iter, NULL, NULL))) {
+		assert_true(i < count);
+		assert_string_equal(kv_store_iter_current_key(iter), keys[i]);
+		assert_int_equal(*value, values[i]);
+		i++;
+	}
+	assert_int_equal(i, count);
+}
+
+static void test_snapshot(void **state)
+{
+	struct kv_store      kv_store = {.backend = KV_STORE_BACKEND_RADIX};
+	kv_store_snapshot_t *snapshot;
+	kv_store_iter_t *    iter, *live_iter;
+
+	assert_non_null(kv_store.rt = radix_create());
+	list_init(&kv_store.snapshots);
+	test_kv_store = &kv_store;
+
+	_set_int("a", 1);
+	_set_int("b", 2);
+	_set_int("c", 3);
+
+	assert_non_null(snapshot = kv_store_snapshot_create(NULL));
+	assert_non_null(iter = kv_store_iter_create_snapshot(snapshot, NULL));
+
+	_set_int("b", 20);
+	_set_int("ab", 9);
+	_set_int("d", 4);
+	assert_int_equal(kv_store_unset_value(NULL, "c", NULL, NULL), 0);
+
+	_check_iter(iter, (const char *[]) {"a", "b", "c"}, (int[]) {1, 2, 3}, 3);
+
+	/* changes done in the middle of the iteration must not be visible either */
+	kv_store_iter_reset(iter);
+	assert_int_equal(*(int *) kv_store_iter_next(iter, NULL, NULL), 1);
+	assert_int_equal(kv_store_unset_value(NULL, "b", NULL, NULL), 0);
+	_set_int("bb", 5);
+	assert_int_equal(*(int *) kv_store_iter_next(iter, NULL, NULL), 2);
+	assert_int_equal(*(int *) kv_store_iter_next(iter, NULL, NULL), 3);
+	assert_null(kv_store_iter_next(iter, NULL, NULL));
+
+	kv_store_iter_destroy(iter);
+	kv_store_snapshot_destroy(snapshot);
+
+	assert_non_null(live_iter = kv_store_iter_create(NULL));
+	_check_iter(live_iter, (const char *[]) {"a", "ab", "bb", "d"}, (int[]) {1, 9, 5, 4}, 4);
+	kv_store_iter_destroy(live_iter);
+
+	radix_iter(kv_store.rt, (radix_iterate_fn) _destroy_kv_store_value);
+	radix_destroy(kv_store.rt);
+}
+
+static void _create_test_kv_store(kv_store_backend_t backend)
+{
+	assert_non_null(test_kv_store = mem_zalloc(sizeof(*test_kv_store)));
+	test_kv_store->backend = backend;
+	if (backend == KV_STORE_BACKEND_RADIX)
+		assert_non_null(test_kv_store->rt = radix_create());
+	else
+		assert_non_null(test_kv_store->ht = hash_create(32));
+	list_init(&test_kv_store->snapshots);
+}
+
+static void _check_image(kv_store_backend_t backend)
+{
+	char             path[] = "/tmp/test_kv_store_image_XXXXXX";
+	struct iovec     iov[]  = {{"a", 1}, {"", 0}, {"bcd", 3}};
+	struct iovec *   vec;
+	kv_store_iter_t *iter;
+	size_t           size;
+	int              fd;
+
+	assert_true((fd = mkstemp(path)) >= 0);
+	close(fd);
+
+	_create_test_kv_store(backend);
+	_set_int("c", 3);
+	_set_int("a", 1);
+	_set_int("b", 2);
+	assert_non_null(kv_store_set_value(NULL, "v", iov, 3, KV_STORE_VALUE_VECTOR, KV_STORE_VALUE_NO_OP, NULL, NULL));
+	assert_int_equal(kv_store_image_write(NULL, path, 0), 0);
+	_destroy_kv_store(NULL);
+
+	/* load the image into a new store */
+	_create_test_kv_store(backend);
+	_set_int("b", 20);
+	assert_int_equal(kv_store_image_load(NULL, path, NULL), 0);
+	assert_non_null(test_kv_store->image);
+
+	/* records in the store take precedence over the ones in the image */
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "b", NULL, NULL), 20);
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "a", NULL, NULL), 1);
+	assert_int_equal(test_kv_store->image->pending_count, 2);
+
+	assert_int_equal(kv_store_unset_value(NULL, "c", NULL, NULL), 0);
+	assert_null(kv_store_get_value(NULL, "c", NULL, NULL));
+
+	assert_non_null(vec = kv_store_get_value(NULL, "v", &size, NULL));
+	assert_int_equal(size, 3);
+	assert_int_equal(vec[0].iov_len, 1);
+	assert_memory_equal(vec[0].iov_base, "a", 1);
+	assert_int_equal(vec[1].iov_len, 0);
+	assert_int_equal(vec[2].iov_len, 3);
+	assert_memory_equal(vec[2].iov_base, "bcd", 3);
+
+	/* all records loaded so the image is released */
+	assert_null(test_kv_store->image);
+
+	if (backend == KV_STORE_BACKEND_RADIX) {
+		assert_non_null(iter = kv_store_iter_create_prefix(NULL, "b"));
+		_check_iter(iter, (const char *[]) {"b"}, (int[]) {20}, 1);
+		kv_store_iter_destroy(iter);
+		assert_non_null(iter = kv_store_iter_create_prefix(NULL, "c"));
+		_check_iter(iter, NULL, NULL, 0);
+		kv_store_iter_destroy(iter);
+	}
+
+	_destroy_kv_store(NULL);
+	unlink(path);
+}
+
+static void test_image(void **state)
+{
+	_check_image(KV_STORE_BACKEND_RADIX);
+	_check_image(KV_STORE_BACKEND_HASH);
+}
+
+static void test_image_bad(void **state)
+{
+	char path[] = "/tmp/test_kv_store_image_XXXXXX";
+	int  fd;
+
+	assert_true((fd = mkstemp(path)) >= 0);
+	assert_int_equal(write(fd, KV_STORE_IMAGE_MAGIC, 8), 8);
+	close(fd);
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+	assert_int_equal(kv_store_image_load(NULL, path, NULL), -EBADMSG);
+	unlink(path);
+	assert_int_equal(kv_store_image_load(NULL, path, NULL), -ENOENT);
+	assert_null(test_kv_store->image);
+	_destroy_kv_store(NULL);
+}
+
+static void _check_filter(kv_store_backend_t backend)
+{
+	char                         path[] = "/tmp/test_kv_store_image_XXXXXX";
+	struct kv_store_filter_stats stats;
+	char                         key[16];
+	int                          fd, i;
+
+	assert_true((fd = mkstemp(path)) >= 0);
+	close(fd);
+
+	_create_test_kv_store(backend);
+	assert_int_equal(kv_store_get_filter_stats(NULL, &stats), -ENOTSUP);
+	assert_non_null(test_kv_store->filter = bloom_create(_filter_get_bit_count(4), KV_STORE_FILTER_HASH_COUNT));
+	test_kv_store->filter_capacity = 4;
+
+	/* the filter grows together with the store */
+	for (i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		_set_int(key, i);
+	}
+	assert_true(test_kv_store->filter_capacity >= 100);
+
+	for (i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		assert_int_equal(*(int *) kv_store_get_value(NULL, key, NULL, NULL), i);
+		snprintf(key, sizeof(key), "none%d", i);
+		assert_null(kv_store_get_value(NULL, key, NULL, NULL));
+	}
+
+	assert_int_equal(kv_store_get_filter_stats(NULL, &stats), 0);
+	assert_int_equal(stats.positive, 100);
+	assert_int_equal(stats.negative + stats.false_positive, 100);
+	assert_true(stats.negative > 90);
+	assert_true(stats.rebuilds > 0);
+
+	/* unset keys are not found even before the filter is rebuilt */
+	assert_int_equal(kv_store_unset_value(NULL, "key0", NULL, NULL), 0);
+	assert_null(kv_store_get_value(NULL, "key0", NULL, NULL));
+	assert_int_equal(kv_store_unset_value(NULL, "none0", NULL, NULL), -ENODATA);
+
+	assert_int_equal(kv_store_image_write(NULL, path, 0), 0);
+	_destroy_kv_store(NULL);
+
+	/* keys from the image which are not loaded yet must pass through the filter */
+	_create_test_kv_store(backend);
+	assert_non_null(test_kv_store->filter = bloom_create(_filter_get_bit_count(4), KV_STORE_FILTER_HASH_COUNT));
+	test_kv_store->filter_capacity = 4;
+	assert_int_equal(kv_store_image_load(NULL, path, NULL), 0);
+	assert_true(test_kv_store->filter_capacity >= 99);
+
+	for (i = 1; i < 100; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		assert_int_equal(*(int *) kv_store_get_value(NULL, key, NULL, NULL), i);
+	}
+	assert_null(kv_store_get_value(NULL, "key0", NULL, NULL));
+
+	_destroy_kv_store(NULL);
+	unlink(path);
+}
+
+static void test_filter(void **state)
+{
+	_check_filter(KV_STORE_BACKEND_RADIX);
+	_check_filter(KV_STORE_BACKEND_HASH);
+}
+
+static void _check_dirty(kv_store_backend_t backend)
+{
+	static const char *keys[]   = {"a", "c", "d"};
+	static const int   values[] = {10, 3, 4};
+	kv_store_iter_t *  iter;
+	unsigned           count;
+
+	_create_test_kv_store(backend);
+	_set_int("a", 1);
+	_set_int("b", 2);
+
+	/* no tracking, no iterator */
+	assert_null(kv_store_iter_create_dirty(NULL));
+	assert_int_equal(kv_store_dirty_reset(NULL), -ENOTSUP);
+	assert_int_equal(kv_store_dirty_get_count(NULL, &count), -ENOTSUP);
+
+	/* records existing before tracking was enabled are not dirty */
+	assert_int_equal(kv_store_dirty_track(NULL, true), 0);
+	_set_int("d", 4);
+	_set_int("c", 3);
+	_set_int("a", 10);
+	_set_int("e", 5);
+	assert_int_equal(kv_store_unset_value(NULL, "e", NULL, NULL), 0);
+	assert_int_equal(kv_store_unset_value(NULL, "b", NULL, NULL), 0);
+
+	/* unset records are skipped and the keys are in order regardless of the backend */
+	assert_non_null(iter = kv_store_iter_create_dirty(NULL));
+	_check_iter(iter, keys, values, 3);
+	kv_store_iter_destroy(iter);
+
+	/* unset keys are counted */
+	assert_int_equal(kv_store_dirty_get_count(NULL, &count), 0);
+	assert_int_equal(count, 5);
+
+	/* only changes after reset are dirty */
+	assert_int_equal(kv_store_dirty_reset(NULL), 0);
+	_set_int("c", 30);
+	assert_int_equal(kv_store_dirty_get_count(NULL, &count), 0);
+	assert_int_equal(count, 1);
+
+	assert_non_null(iter = kv_store_iter_create_dirty(NULL));
+	_check_iter(iter, (const char *[]) {"c"}, (int[]) {30}, 1);
+	kv_store_iter_destroy(iter);
+
+	assert_int_equal(kv_store_dirty_track(NULL, false), 0);
+	assert_null(kv_store_iter_create_dirty(NULL));
+
+	_destroy_kv_store(NULL);
+}
+
+static void test_dirty(void **state)
+{
+	_check_dirty(KV_STORE_BACKEND_RADIX);
+	_check_dirty(KV_STORE_BACKEND_HASH);
+}
+
+/* class 0 by the first character of the key, class 1 for all records */
+static void _test_account_fn(const char *           key,
+                             void *                 value,
+                             size_t                 value_size,
+                             kv_store_value_flags_t flags,
+                             const char *           accounts[KV_STORE_ACCOUNT_CLASS_COUNT])
+{
+	static const char *prefixes[] = {"a", "b"};
+
+	accounts[0] = key[0] == 'a' ? prefixes[0] : key[0] == 'b' ? prefixes[1] : NULL;
+	accounts[1] = "all";
+}
+
+static int _get_account_fn(const char *name, const struct kv_store_account_stats *stats, void *arg)
+{
+	struct kv_store_account_stats *sum = arg;
+
+	sum->records += stats->records;
+	sum->bytes += stats->bytes;
+	return 0;
+}
+
+static void _check_account(unsigned account_class, const char *name, uint64_t records)
+{
+	struct kv_store_account *account;
+
+	account = hash_lookup(test_kv_store->accounts[account_class], name, strlen(name) + 1, NULL);
+
+	if (!records) {
+		assert_null(account);
+		return;
+	}
+
+	assert_non_null(account);
+	assert_int_equal(account->stats.records, records);
+	assert_true(account->stats.bytes >= records * (sizeof(struct kv_store_value) + sizeof(int)));
+}
+
+static void _check_accounts(kv_store_backend_t backend)
+{
+	struct kv_store_account_stats sum = {0};
+	uint64_t                      bytes;
+	unsigned                      i;
+
+	_create_test_kv_store(backend);
+
+	/* no accounting */
+	assert_int_equal(kv_store_iterate_accounts(NULL, 0, _get_account_fn, &sum), -ENOTSUP);
+
+	for (i = 0; i < KV_STORE_ACCOUNT_CLASS_COUNT; i++)
+		assert_non_null(test_kv_store->accounts[i] = hash_create(32));
+	test_kv_store->account_fn = _test_account_fn;
+	assert_int_equal(kv_store_iterate_accounts(NULL, KV_STORE_ACCOUNT_CLASS_COUNT, _get_account_fn, &sum), -EINVAL);
+
+	_set_int("a1", 1);
+	_set_int("a2", 2);
+	_set_int("b1", 3);
+	_set_int("c1", 4);
+	_check_account(0, "a", 2);
+	_check_account(0, "b", 1);
+	_check_account(1, "all", 4);
+
+	/* class 1 covers all records, class 0 skips "c1" */
+	assert_int_equal(kv_store_iterate_accounts(NULL, 1, _get_account_fn, &sum), 0);
+	assert_int_equal(sum.records, 4);
+	bytes = sum.bytes;
+	sum   = (struct kv_store_account_stats) {0};
+	assert_int_equal(kv_store_iterate_accounts(NULL, 0, _get_account_fn, &sum), 0);
+	assert_int_equal(sum.records, 3);
+	assert_true(sum.bytes < bytes);
+
+	/* updates do not change the number of records */
+	_set_int("a1", 10);
+	_check_account(0, "a", 2);
+	_check_account(1, "all", 4);
+
+	/* accounts without records are dropped */
+	assert_int_equal(kv_store_unset_value(NULL, "a1", NULL, NULL), 0);
+	assert_int_equal(kv_store_unset_value(NULL, "a2", NULL, NULL), 0);
+	_check_account(0, "a", 0);
+	_check_account(0, "b", 1);
+	_check_account(1, "all", 2);
+
+	assert_int_equal(kv_store_unset_value(NULL, "b1", NULL, NULL), 0);
+	assert_int_equal(kv_store_unset_value(NULL, "c1", NULL, NULL), 0);
+	_check_account(1, "all", 0);
+
+	_destroy_kv_store(NULL);
+}
+
+static void test_accounts(void **state)
+{
+	_check_accounts(KV_STORE_BACKEND_RADIX);
+	_check_accounts(KV_STORE_BACKEND_HASH);
+}
+
+static void test_journal(void **state)
+{
+	char                journal_path[] = "/tmp/test_kv_store_journal_XXXXXX";
+	char                image_path[]   = "/tmp/test_kv_store_image_XXXXXX";
+	struct iovec        iov[]          = {{"a", 1}, {"bcd", 3}};
+	kv_store_journal_t *journal;
+	struct iovec *      vec;
+	size_t              size;
+	uint64_t            seqnum;
+	int                 fd, r;
+
+	assert_true((fd = mkstemp(journal_path)) >= 0);
+	close(fd);
+	assert_true((fd = mkstemp(image_path)) >= 0);
+	close(fd);
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+	assert_non_null(journal = kv_store_journal_open(NULL, journal_path, 0, &r));
+	assert_int_equal(r, 0);
+
+	_set_int("a", 1);
+	assert_int_equal(kv_store_journal_add_set(journal, "a", &(int) {1}, sizeof(int), 0), 0);
+	assert_int_equal(kv_store_journal_add_set(journal, "b", &(int) {2}, sizeof(int), 0), 0);
+	assert_int_equal(kv_store_journal_commit(journal), 0);
+
+	/* image covers all the entries so far */
+	_set_int("b", 2);
+	assert_int_equal(kv_store_image_write(NULL, image_path, kv_store_journal_get_seqnum(journal)), 0);
+	assert_int_equal(kv_store_journal_get_seqnum(journal), 2);
+
+	assert_int_equal(kv_store_journal_add_set(journal, "b", &(int) {20}, sizeof(int), 0), 0);
+	assert_int_equal(kv_store_journal_add_unset(journal, "a"), 0);
+	assert_int_equal(kv_store_journal_add_set(journal, "v", iov, 2, KV_STORE_VALUE_VECTOR), 0);
+	assert_int_equal(kv_store_journal_commit(journal), 0);
+	kv_store_journal_close(journal);
+	_destroy_kv_store(NULL);
+
+	/* simulate incomplete write of the last entry */
+	assert_true((fd = open(journal_path, O_WRONLY | O_APPEND)) >= 0);
+	assert_int_equal(write(fd, "garbage", 7), 7);
+	close(fd);
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+	assert_int_equal(kv_store_image_load(NULL, image_path, &seqnum), 0);
+	assert_int_equal(seqnum, 2);
+	assert_non_null(journal = kv_store_journal_open(NULL, journal_path, seqnum, &r));
+	assert_int_equal(kv_store_journal_get_seqnum(journal), 5);
+
+	assert_null(kv_store_get_value(NULL, "a", NULL, NULL));
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "b", NULL, NULL), 20);
+	assert_non_null(vec = kv_store_get_value(NULL, "v", &size, NULL));
+	assert_int_equal(size, 2);
+	assert_memory_equal(vec[1].iov_base, "bcd", 3);
+
+	/* journal reset after writing new image */
+	assert_int_equal(kv_store_image_write(NULL, image_path, kv_store_journal_get_seqnum(journal)), 0);
+	assert_int_equal(kv_store_journal_reset(journal), 0);
+	kv_store_journal_close(journal);
+	_destroy_kv_store(NULL);
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+	assert_int_equal(kv_store_image_load(NULL, image_path, &seqnum), 0);
+	assert_int_equal(seqnum, 5);
+	assert_non_null(journal = kv_store_journal_open(NULL, journal_path, seqnum, &r));
+	assert_int_equal(kv_store_journal_get_seqnum(journal), 5);
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "b", NULL, NULL), 20);
+	kv_store_journal_close(journal);
+	_destroy_kv_store(NULL);
+
+	unlink(journal_path);
+	unlink(image_path);
+}
+
+static void test_compact(void **state)
+{
+	struct iovec          iov[] = {{"a", 1}, {"bcd", 3}};
+	struct kv_store_stats stats;
+	kv_store_snapshot_t * snapshot;
+	struct iovec *        vec;
+	char                  key[16];
+	size_t                size;
+	int                   i, r, steps = 0;
+
+	_create_test_kv_store(KV_STORE_BACKEND_HASH);
+	assert_int_equal(kv_store_compact_start(NULL), -ENOTSUP);
+	_destroy_kv_store(NULL);
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "k%04d", i);
+		_set_int(key, i);
+	}
+	assert_non_null(kv_store_set_value(NULL, "v", iov, 2, KV_STORE_VALUE_VECTOR, KV_STORE_VALUE_NO_OP, NULL, NULL));
+
+	/* keep every tenth record */
+	for (i = 0; i < 1000; i++) {
+		if (i % 10) {
+			snprintf(key, sizeof(key), "k%04d", i);
+			assert_int_equal(kv_store_unset_value(NULL, key, NULL, NULL), 0);
+		}
+	}
+	_set_int("k0000", 10000);
+
+	assert_int_equal(kv_store_get_stats(NULL, &stats), 0);
+	assert_int_equal(stats.garbage, 901);
+
+	assert_int_equal(kv_store_compact_start(NULL), 0);
+	assert_non_null(snapshot = kv_store_snapshot_create(NULL));
+	assert_int_equal(kv_store_compact_step(NULL, 16), -EBUSY);
+	kv_store_snapshot_destroy(snapshot);
+
+	/* changes in between the steps are fine, both in front of and behind the compaction */
+	while ((r = kv_store_compact_step(NULL, 16)) == 1) {
+		if (steps++ == 2) {
+			_set_int("k0010", 10010);
+			_set_int("k0990", 10990);
+		}
+	}
+	assert_int_equal(r, 0);
+	assert_true(steps > 1);
+
+	assert_int_equal(kv_store_get_stats(NULL, &stats), 0);
+	assert_int_equal(stats.records, 101);
+	assert_int_equal(stats.garbage, 2);
+	assert_int_equal(stats.compactions, 1);
+
+	for (i = 0; i < 1000; i += 10) {
+		snprintf(key, sizeof(key), "k%04d", i);
+		assert_int_equal(*(int *) kv_store_get_value(NULL, key, NULL, NULL), i == 0 || i == 10 || i == 990 ? 10000 + i : i);
+	}
+	assert_non_null(vec = kv_store_get_value(NULL, "v", &size, NULL));
+	assert_int_equal(size, 2);
+	assert_memory_equal(vec[0].iov_base, "a", 1);
+	assert_memory_equal(vec[1].iov_base, "bcd", 3);
+
+	/* the second compaction moves the values out of the arena used by the first one */
+	_set_int("k0020", 10020);
+	assert_int_equal(kv_store_compact_start(NULL), 0);
+	assert_int_equal(kv_store_compact_step(NULL, UINT_MAX), 0);
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "k0020", NULL, NULL), 10020);
+	assert_int_equal(*(int *) kv_store_get_value(NULL, "k0030", NULL, NULL), 30);
+	assert_int_equal(kv_store_compact_step(NULL, 16), 0);
+
+	_destroy_kv_store(NULL);
+}
+
+static void test_atoms(void **state)
+{
+	const kv_store_atom_t *atom, *atom2;
+	struct kv_store_stats  stats;
+	uint32_t               id;
+
+	_create_test_kv_store(KV_STORE_BACKEND_RADIX);
+
+	assert_non_null(atom = kv_store_atom_get(NULL, "a:b"));
+	assert_ptr_equal(kv_store_atom_get(NULL, "a:b"), atom);
+	assert_non_null(atom2 = kv_store_atom_get(NULL, "c"));
+	id = kv_store_atom_get_id(atom2);
+
+	assert_int_equal(kv_store_get_stats(NULL, &stats), 0);
+	assert_int_equal(stats.atom_entries, 2);
+
+	/* the atom stays until the last reference is dropped */
+	kv_store_atom_put(NULL, atom);
+	assert_string_equal(kv_store_atom_get_key(atom), "a:b");
+	kv_store_atom_put(NULL, atom);
+	kv_store_atom_put(NULL, atom2);
+
+	assert_int_equal(kv_store_get_stats(NULL, &stats), 0);
+	assert_int_equal(stats.atom_entries, 0);
+
+	/* identifiers of released atoms are not reused */
+	assert_non_null(atom = kv_store_atom_get(NULL, "c"));
+	assert_true(kv_store_atom_get_id(atom) > id);
+
+	_destroy_kv_store(NULL);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_type_G),
 		cmocka_unit_test(test_type_H),
+		cmocka_unit_test(test_snapshot),
+		cmocka_unit_test(test_image),
+		cmocka_unit_test(test_image_bad),
+		cmocka_unit_test(test_journal),
+		cmocka_unit_test(test_filter),
+		cmocka_unit_test(test_dirty),
+		cmocka_unit_test(test_accounts),
+		cmocka_unit_test(test_compact),
+		cmocka_unit_test(test_atoms),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
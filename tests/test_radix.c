@@ -0,0 +1,218 @@
+#include "base/radix.h"
+
+#include <cmocka.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *test_keys[] = {
+	":D:8_0::::#RDY",
+	":D:8_0:LYR:::#GMB",
+	":D:8_0:LYR:::#GIN",
+	":D:8_1::::#RDY",
+	":D:8_16::::#RDY",
+	":D:253_3::::#RDY",
+	":D:253_3:LYR:::#GIN",
+	":G:::::#RES",
+	":M:8_0::blkid::ID_FS_TYPE",
+	":U:8_0::::ID_FS_UUID",
+	":U:8_0::::ID_FS_TYPE",
+	":U:8_1::::ID_FS_TYPE",
+	":D",
+	":",
+};
+
+#define KEY_COUNT (sizeof(test_keys) / sizeof(test_keys[0]))
+
+static int _key_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static unsigned _count_prefix(struct radix_tree *t, const char *prefix)
+{
+	struct radix_node *n;
+	const char *       key, *prev = NULL;
+	unsigned           count = 0;
+	uint32_t           len   = prefix ? strlen(prefix) : 0;
+
+	for (n = radix_get_first(t, prefix, len); n; n = radix_get_next(t, n, prefix, len)) {
+		key = radix_get_key(t, n, NULL);
+		if (prefix)
+			assert_int_equal(strncmp(key, prefix, len), 0);
+		/* keys must come in order */
+		if (prev)
+			assert_true(strcmp(prev, key) < 0);
+		prev = key;
+		count++;
+	}
+
+	return count;
+}
+
+static void test_radix_insert_lookup()
+{
+	struct radix_tree *t = radix_create();
+	size_t             data_len;
+	unsigned           i;
+
+	assert_non_null(t);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(radix_insert(t, test_keys[i], strlen(test_keys[i]) + 1, test_keys[i], i), 0);
+
+	assert_int_equal(radix_get_num_entries(t), KEY_COUNT);
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		assert_ptr_equal(radix_lookup(t, test_keys[i], strlen(test_keys[i]) + 1, &data_len), test_keys[i]);
+		assert_int_equal(data_len, i);
+	}
+
+	/* prefixes of existing keys are not entries themselves */
+	assert_null(radix_lookup(t, ":D:8_", sizeof(":D:8_"), NULL));
+	assert_null(radix_lookup(t, ":D:8_0::::#RDY", strlen(":D:8_0::::#RDY"), NULL));
+
+	radix_destroy(t);
+}
+
+static void test_radix_iterate()
+{
+	struct radix_tree *t = radix_create();
+	char *             sorted[KEY_COUNT];
+	struct radix_node *n;
+	unsigned           i;
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(radix_insert(t, test_keys[i], strlen(test_keys[i]) + 1, test_keys[i], 0), 0);
+
+	memcpy(sorted, test_keys, sizeof(sorted));
+	qsort(sorted, KEY_COUNT, sizeof(char *), _key_cmp);
+
+	i = 0;
+	radix_iterate(n, t)
+		assert_string_equal(radix_get_key(t, n, NULL), sorted[i++]);
+	assert_int_equal(i, KEY_COUNT);
+
+	assert_int_equal(_count_prefix(t, NULL), KEY_COUNT);
+	assert_int_equal(_count_prefix(t, ":D:"), 7);
+	assert_int_equal(_count_prefix(t, ":D:8_"), 5);
+	assert_int_equal(_count_prefix(t, ":D:8_0:"), 3);
+	assert_int_equal(_count_prefix(t, ":U:"), 3);
+	assert_int_equal(_count_prefix(t, ":D"), 8);
+	assert_int_equal(_count_prefix(t, ":X:"), 0);
+	assert_int_equal(_count_prefix(t, ":D:8_0::::#RDY_LONGER"), 0);
+
+	radix_destroy(t);
+}
+
+static void test_radix_remove()
+{
+	struct radix_tree *t = radix_create();
+	unsigned           i;
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(radix_insert(t, test_keys[i], strlen(test_keys[i]) + 1, test_keys[i], 0), 0);
+
+	/* remove every other key and check the rest is still there */
+	for (i = 0; i < KEY_COUNT; i += 2)
+		radix_remove(t, test_keys[i], strlen(test_keys[i]) + 1);
+
+	assert_int_equal(radix_get_num_entries(t), KEY_COUNT / 2);
+	assert_int_equal(_count_prefix(t, NULL), KEY_COUNT / 2);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_ptr_equal(radix_lookup(t, test_keys[i], strlen(test_keys[i]) + 1, NULL), i % 2 ? test_keys[i] : NULL);
+
+	for (i = 1; i < KEY_COUNT; i += 2)
+		radix_remove(t, test_keys[i], strlen(test_keys[i]) + 1);
+
+	assert_int_equal(radix_get_num_entries(t), 0);
+	assert_null(radix_get_first(t, NULL, 0));
+
+	radix_destroy(t);
+}
+
+static void test_radix_shape()
+{
+	struct radix_tree *t = radix_create();
+	unsigned           nodes, depth_max;
+
+	radix_get_shape(t, &nodes, &depth_max);
+	assert_int_equal(nodes, 1);
+	assert_int_equal(depth_max, 0);
+
+	assert_int_equal(radix_insert(t, "ab", sizeof("ab"), NULL, 0), 0);
+	radix_get_shape(t, &nodes, &depth_max);
+	assert_int_equal(nodes, 2);
+	assert_int_equal(depth_max, 1);
+
+	/* branching adds the common prefix as a node without an entry */
+	assert_int_equal(radix_insert(t, "ac", sizeof("ac"), NULL, 0), 0);
+	radix_get_shape(t, &nodes, &depth_max);
+	assert_int_equal(nodes, 4);
+	assert_int_equal(depth_max, 2);
+
+	radix_remove(t, "ab", sizeof("ab"));
+	radix_get_shape(t, &nodes, &depth_max);
+	assert_int_equal(nodes, 2);
+	assert_int_equal(depth_max, 1);
+
+	radix_destroy(t);
+}
+
+static void test_radix_repack()
+{
+	struct radix_tree *t = radix_create();
+	struct radix_node *n;
+	char               key[64];
+	const char *       n_key;
+	uint32_t           key_len;
+	unsigned           i;
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_int_equal(radix_insert(t, test_keys[i], strlen(test_keys[i]) + 1, test_keys[i], i), 0);
+
+	for (i = 0; i < KEY_COUNT; i += 2)
+		radix_remove(t, test_keys[i], strlen(test_keys[i]) + 1);
+
+	/* the node must not be used after repacking so continue from its key */
+	for (n = radix_get_first(t, NULL, 0); n; n = radix_get_next_after(t, key, key_len, NULL, 0)) {
+		n_key = radix_get_key(t, n, &key_len);
+		memcpy(key, n_key, key_len);
+		radix_repack_node(t, n);
+	}
+
+	assert_int_equal(radix_get_num_entries(t), KEY_COUNT / 2);
+	assert_int_equal(_count_prefix(t, NULL), KEY_COUNT / 2);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_ptr_equal(radix_lookup(t, test_keys[i], strlen(test_keys[i]) + 1, NULL), i % 2 ? test_keys[i] : NULL);
+
+	/* arrays of children trimmed by repacking grow again */
+	for (i = 0; i < KEY_COUNT; i += 2)
+		assert_int_equal(radix_insert(t, test_keys[i], strlen(test_keys[i]) + 1, test_keys[i], i), 0);
+
+	assert_int_equal(_count_prefix(t, NULL), KEY_COUNT);
+	assert_int_equal(_count_prefix(t, ":D:8_0:"), 3);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert_ptr_equal(radix_lookup(t, test_keys[i], strlen(test_keys[i]) + 1, NULL), test_keys[i]);
+
+	radix_destroy(t);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_radix_insert_lookup),
+		cmocka_unit_test(test_radix_iterate),
+		cmocka_unit_test(test_radix_remove),
+		cmocka_unit_test(test_radix_shape),
+		cmocka_unit_test(test_radix_repack),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,148 @@
+#include "base/buffer.h"
+#include "base/rec.h"
+
+#include <cmocka.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *test_keys[] = {":DEV:8_0::GMB", ":DEV:8_0::GIN", ":DEV:8_16", ":DEV:8_16::GMB", "+:DEV:8_16::GMB", ""};
+
+static struct buffer *_create_buffer(void)
+{
+	struct buffer *buf = buffer_create(
+		&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC, .type = BUFFER_TYPE_LINEAR, .mode = BUFFER_MODE_PLAIN}),
+		&((struct buffer_init) {.size = 0, .alloc_step = 64, .limit = 0}),
+		NULL);
+	assert_non_null(buf);
+	return buf;
+}
+
+static void _write_records(struct buffer *buf)
+{
+	struct rec_writer *w = rec_writer_create(buf, NULL);
+	unsigned           i;
+
+	assert_non_null(w);
+
+	for (i = 0; i < sizeof(test_keys) / sizeof(test_keys[0]); i++) {
+		assert_int_equal(rec_write_key(w, test_keys[i]), 0);
+		assert_int_equal(rec_write_uint(w, i), 0);
+		assert_int_equal(rec_write_uint(w, UINT64_MAX >> i), 0);
+		assert_int_equal(rec_write_data(w, test_keys[i], strlen(test_keys[i])), 0);
+	}
+
+	rec_writer_destroy(w);
+}
+
+static void test_rec_roundtrip(void **state)
+{
+	struct buffer *    buf = _create_buffer();
+	struct rec_reader *r;
+	const void *       data, *p;
+	size_t             size, len, key_len;
+	const char *       key;
+	uint64_t           val;
+	unsigned           i = 0;
+
+	_write_records(buf);
+	buffer_get_data(buf, &data, &size);
+
+	assert_non_null(r = rec_reader_create(data, size, NULL));
+
+	while (rec_read_key(r, &key, &key_len) == 1) {
+		assert_string_equal(key, test_keys[i]);
+		assert_int_equal(key_len, strlen(test_keys[i]));
+		assert_int_equal(rec_read_uint(r, &val), 0);
+		assert_int_equal(val, i);
+		assert_int_equal(rec_read_uint(r, &val), 0);
+		assert_true(val == UINT64_MAX >> i);
+		assert_int_equal(rec_read_data(r, &p, &len), 0);
+		assert_int_equal(len, strlen(test_keys[i]));
+		assert_memory_equal(p, test_keys[i], len);
+		i++;
+	}
+
+	assert_int_equal(i, sizeof(test_keys) / sizeof(test_keys[0]));
+	assert_int_equal(rec_read_key(r, &key, NULL), 0);
+
+	rec_reader_destroy(r);
+	buffer_destroy(buf);
+}
+
+static void test_rec_varint_size(void **state)
+{
+	struct buffer *    buf = _create_buffer();
+	struct rec_writer *w   = rec_writer_create(buf, NULL);
+	const void *       data;
+	size_t             size;
+
+	assert_non_null(w);
+	assert_int_equal(rec_write_uint(w, 127), 0);
+	buffer_get_data(buf, &data, &size);
+	assert_int_equal(size, 1 + 1);
+	assert_int_equal(rec_write_uint(w, 128), 0);
+	buffer_get_data(buf, &data, &size);
+	assert_int_equal(size, 1 + 1 + 2);
+	assert_int_equal(rec_write_uint(w, UINT64_MAX), 0);
+	buffer_get_data(buf, &data, &size);
+	assert_int_equal(size, 1 + 1 + 2 + 10);
+
+	rec_writer_destroy(w);
+	buffer_destroy(buf);
+}
+
+static void test_rec_malformed(void **state)
+{
+	static const unsigned char bad_version[]  = {REC_FORMAT_VERSION + 1, 0, 0};
+	static const unsigned char bad_prefix[]   = {REC_FORMAT_VERSION, 1, 1, 'a'};
+	static const unsigned char bad_varint[]   = {REC_FORMAT_VERSION, 0, 1, 'a', /* varint longer than 64 bits */
+                                                   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01};
+	struct buffer *            buf            = _create_buffer();
+	struct rec_reader *        r;
+	const void *               data, *p;
+	size_t                     size, len;
+	const char *               key;
+	uint64_t                   val;
+	int                        ret;
+
+	assert_null(rec_reader_create(bad_version, sizeof(bad_version), &ret));
+	assert_int_equal(ret, -EPROTONOSUPPORT);
+
+	assert_non_null(r = rec_reader_create(bad_prefix, sizeof(bad_prefix), NULL));
+	assert_int_equal(rec_read_key(r, &key, NULL), -EBADMSG);
+	rec_reader_destroy(r);
+
+	assert_non_null(r = rec_reader_create(bad_varint, sizeof(bad_varint), NULL));
+	assert_int_equal(rec_read_key(r, &key, NULL), 1);
+	assert_int_equal(rec_read_uint(r, &val), -EBADMSG);
+	rec_reader_destroy(r);
+
+	/* every truncation of a valid stream must be detected */
+	_write_records(buf);
+	buffer_get_data(buf, &data, &size);
+
+	assert_non_null(r = rec_reader_create(data, size - 1, NULL));
+	while ((ret = rec_read_key(r, &key, NULL)) == 1) {
+		if ((ret = rec_read_uint(r, &val)) < 0 || (ret = rec_read_uint(r, &val)) < 0 ||
+		    (ret = rec_read_data(r, &p, &len)) < 0)
+			break;
+	}
+	assert_int_equal(ret, -EBADMSG);
+	rec_reader_destroy(r);
+
+	buffer_destroy(buf);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_rec_roundtrip),
+		cmocka_unit_test(test_rec_varint_size),
+		cmocka_unit_test(test_rec_malformed),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
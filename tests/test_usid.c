@@ -43,10 +43,66 @@ static void test_checkpoint_env(void **state)
 	assert_string_equal(p, CHECKPOINT_NAME);
 }
 
+#define BATCH_INPUT                                                                                                            \
+	"MAJOR=8\nMINOR=0\nSEQNUM=1\n"                                                                                           \
+	"\n\n"                                                                                                                     \
+	"MAJOR=8\nMINOR=1\nSEQNUM=2\nKEY=value\n"                                                                                \
+	"\n"                                                                                                                       \
+	"SEQNUM=3\n"
+
+static void test_scan_batch_env(void **state)
+{
+	FILE *                       f;
+	struct batch                 batch = {0};
+	struct buffer *              buf;
+	struct usid_scan_batch_item *item;
+	char *                       data;
+	size_t                       size;
+
+	assert_non_null(f = fmemopen(BATCH_INPUT, sizeof(BATCH_INPUT) - 1, "r"));
+
+	/* empty lines between devices are skipped */
+	assert_int_equal(_read_batch_dev(f, &batch.devs[batch.count++]), 1);
+	assert_int_equal(_read_batch_dev(f, &batch.devs[batch.count++]), 1);
+	assert_int_equal(batch.devs[0].devno, makedev(8, 0));
+	assert_int_equal(batch.devs[1].seqnum, 2);
+	assert_memory_equal(batch.devs[1].env, "MAJOR=8\0MINOR=1\0SEQNUM=2\0KEY=value", batch.devs[1].env_size);
+
+	/* the last device is missing MAJOR and MINOR */
+	assert_int_equal(_read_batch_dev(f, &batch.devs[batch.count]), -EINVAL);
+	assert_int_equal(_read_batch_dev(f, &batch.devs[batch.count]), 0);
+	fclose(f);
+
+	buf = buffer_create(&((struct buffer_spec) {.backend = BUFFER_BACKEND_MALLOC,
+	                                            .type    = BUFFER_TYPE_LINEAR,
+	                                            .mode    = BUFFER_MODE_PLAIN}),
+	                    &((struct buffer_init) {.size = 0, .alloc_step = 1, .limit = 0}),
+	                    NULL);
+	assert_non_null(buf);
+
+	batch.devs[0].req_id = 10;
+	batch.devs[1].req_id = 11;
+	assert_int_equal(_add_scan_batch_to_buf(buf, &batch), 0);
+	assert_int_equal(buffer_get_data(buf, (const void **) &data, &size), 0);
+
+	item = (struct usid_scan_batch_item *) data;
+	assert_int_equal(item->size, USID_SCAN_BATCH_ITEM_SIZE + sizeof(dev_t) + batch.devs[0].env_size);
+	assert_int_equal(item->req_id, 10);
+	assert_int_equal(item->seqnum, 1);
+
+	item = (struct usid_scan_batch_item *) (data + item->size);
+	assert_int_equal(item->req_id, 11);
+	assert_int_equal((char *) item + item->size - data, size);
+
+	buffer_destroy(buf);
+	_free_batch_devs(&batch);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_checkpoint_env),
+		cmocka_unit_test(test_scan_batch_env),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }